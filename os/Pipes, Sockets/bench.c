@@ -0,0 +1,411 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "bios.h"
+#include "tinyoslib.h"
+#include "unit_testing.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   Each benchmark is a boot test, so it is repeated for every
+ *   combination of cores and terminals given on the command line, e.g.,
+ *
+ *       ./bench -c 1,2,4 bench_pipe_throughput
+ *
+ *   A benchmark repeats an operation for BENCH_TIME seconds (or up to
+ *   BENCH_MAX_SAMPLES times), timing each repetition, and reports the
+ *   operations per second and the percentiles of the latency.
+ *
+ */
+
+
+/* The running time of a measurement, in seconds */
+#define BENCH_TIME 1.0
+
+/* The largest number of timed repetitions of a measurement */
+#define BENCH_MAX_SAMPLES 200000
+
+
+/* The host clock in seconds. Only the host clock is fine enough. */
+static double bench_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+
+/* The latencies of a measurement */
+typedef struct bench_samples {
+	double* lat;        /* latency of each repetition, in seconds */
+	unsigned int n;     /* repetitions */
+	double start;       /* the time of bench_start */
+	double total;       /* the time between bench_start and bench_report */
+} bench_samples;
+
+
+static void bench_start(bench_samples* s)
+{
+	s->lat = xmalloc(BENCH_MAX_SAMPLES * sizeof(double));
+	s->n = 0;
+	s->start = bench_clock();
+}
+
+/* Return 1 while the measurement should continue */
+static int bench_running(bench_samples* s)
+{
+	return s->n < BENCH_MAX_SAMPLES && bench_clock() - s->start < BENCH_TIME;
+}
+
+static void bench_add(bench_samples* s, double lat)
+{
+	if(s->n < BENCH_MAX_SAMPLES)
+		s->lat[s->n++] = lat;
+}
+
+static int bench_cmp(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Return the latency at percentile p of sorted samples, in usec */
+static double bench_percentile(bench_samples* s, double p)
+{
+	if(s->n == 0) return 0.0;
+	unsigned int i = (unsigned int)(p * (s->n - 1) / 100.0 + 0.5);
+	return 1E6 * s->lat[i];
+}
+
+/*
+	Print a line of results and release the samples. If ops is 0, the
+	number of samples is used. A non-zero bytes adds the throughput in MB/sec.
+*/
+static void bench_report(const char* what, bench_samples* s, unsigned long ops, unsigned long bytes)
+{
+	s->total = bench_clock() - s->start;
+	if(ops == 0) ops = s->n;
+	qsort(s->lat, s->n, sizeof(double), bench_cmp);
+
+	char mbs[32] = "";
+	if(bytes)
+		snprintf(mbs, sizeof(mbs), "  %8.2f MB/s", bytes / s->total / (1024*1024));
+	MSG("%-24s cores=%-2u %10.0f ops/s  p50=%8.2fus p90=%8.2fus p99=%8.2fus%s\n",
+		what, cpu_cores(), ops / s->total,
+		bench_percentile(s, 50), bench_percentile(s, 90), bench_percentile(s, 99), mbs);
+
+	ASSERT(s->n > 0);
+	free(s->lat);
+}
+
+
+
+/*
+	Context switch: two threads take turns through a futex word.
+	Each repetition is a round trip, i.e., two switches.
+ */
+
+static int cs_turn;
+static int cs_stop;
+
+static int cs_partner(int argl, void* args)
+{
+	for(;;) {
+		while(__atomic_load_n(&cs_turn, __ATOMIC_ACQUIRE) == 0)
+			Futex(&cs_turn, FUTEX_WAIT, 0, FUTEX_INFINITE);
+		if(__atomic_load_n(&cs_stop, __ATOMIC_RELAXED)) break;
+		__atomic_store_n(&cs_turn, 0, __ATOMIC_RELEASE);
+		Futex(&cs_turn, FUTEX_WAKE, 1, 0);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_context_switch,
+	"Measure the round trip of two threads taking turns on a futex.",
+	.timeout = 60
+	)
+{
+	cs_turn = 0;
+	cs_stop = 0;
+	Tid_t t = CreateThread(cs_partner, 0, NULL);
+	ASSERT(t != NOTHREAD);
+
+	bench_samples s;
+	bench_start(&s);
+	while(bench_running(&s)) {
+		double t0 = bench_clock();
+		__atomic_store_n(&cs_turn, 1, __ATOMIC_RELEASE);
+		Futex(&cs_turn, FUTEX_WAKE, 1, 0);
+		while(__atomic_load_n(&cs_turn, __ATOMIC_ACQUIRE) == 1)
+			Futex(&cs_turn, FUTEX_WAIT, 1, FUTEX_INFINITE);
+		bench_add(&s, bench_clock() - t0);
+	}
+	bench_report("context switch", &s, 0, 0);
+
+	__atomic_store_n(&cs_stop, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&cs_turn, 1, __ATOMIC_RELEASE);
+	Futex(&cs_turn, FUTEX_WAKE, 1, 0);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+
+
+/*
+	Thread creation: CreateThread and ThreadJoin of a thread that returns.
+ */
+
+static int empty_task(int argl, void* args) { return argl; }
+
+BOOT_TEST(bench_thread_create_join,
+	"Measure CreateThread followed by ThreadJoin.",
+	.timeout = 60
+	)
+{
+	bench_samples s;
+	bench_start(&s);
+	while(bench_running(&s)) {
+		double t0 = bench_clock();
+		Tid_t t = CreateThread(empty_task, 0, NULL);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, NULL) == 0);
+		bench_add(&s, bench_clock() - t0);
+	}
+	bench_report("thread create/join", &s, 0, 0);
+	return 0;
+}
+
+
+
+/*
+	Process creation: Exec and WaitChild of a process that returns.
+ */
+
+BOOT_TEST(bench_exec_waitchild,
+	"Measure Exec followed by WaitChild.",
+	.timeout = 60
+	)
+{
+	bench_samples s;
+	bench_start(&s);
+	while(bench_running(&s)) {
+		double t0 = bench_clock();
+		Pid_t pid = Exec(empty_task, 0, NULL);
+		ASSERT(pid != NOPROC);
+		ASSERT(WaitChild(pid, NULL) == pid);
+		bench_add(&s, bench_clock() - t0);
+	}
+	bench_report("exec/waitchild", &s, 0, 0);
+	return 0;
+}
+
+
+
+/*
+	Pipe throughput: a thread writes chunks of a given size, for BENCH_TIME
+	seconds, and another reads them. The latency is that of each Write.
+ */
+
+static unsigned int pipe_chunk;
+static bench_samples pipe_samples;
+
+static int pipe_writer(int argl, void* args)
+{
+	Fid_t w = argl;
+	char* buf = xmalloc(pipe_chunk);
+	memset(buf, 'x', pipe_chunk);
+
+	while(bench_running(&pipe_samples)) {
+		double t0 = bench_clock();
+		unsigned int done = 0;
+		while(done < pipe_chunk) {
+			int rc = Write(w, buf+done, pipe_chunk-done);
+			ASSERT(rc > 0);
+			if(rc <= 0) break;
+			done += rc;
+		}
+		bench_add(&pipe_samples, bench_clock() - t0);
+	}
+	Close(w);
+	free(buf);
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_throughput,
+	"Measure the throughput of a pipe for chunks of various sizes.",
+	.timeout = 60
+	)
+{
+	static const unsigned int chunks[] = { 1, 64, 512, 4096, 16384, 65536 };
+	char* buf = xmalloc(65536);
+
+	for(unsigned int i=0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p) == 0);
+		pipe_chunk = chunks[i];
+
+		bench_start(&pipe_samples);
+		Tid_t t = CreateThread(pipe_writer, p.write, NULL);
+		ASSERT(t != NOTHREAD);
+
+		unsigned long bytes = 0;
+		int rc;
+		while((rc = Read(p.read, buf, 65536)) > 0)
+			bytes += rc;
+		ASSERT(rc == 0);
+
+		ASSERT(ThreadJoin(t, NULL) == 0);
+		Close(p.read);
+
+		char what[32];
+		snprintf(what, sizeof(what), "pipe chunk=%u", pipe_chunk);
+		bench_report(what, &pipe_samples, 0, bytes);
+	}
+
+	free(buf);
+	return 0;
+}
+
+
+
+/*
+	Socket connection rate: Connect and Close against a thread that
+	accepts and closes.
+ */
+
+static int socket_stop;
+
+static int socket_acceptor(int argl, void* args)
+{
+	Fid_t lsock = argl;
+	Fid_t s;
+	while((s = Accept(lsock)) != NOFILE) {
+		Close(s);
+		if(__atomic_load_n(&socket_stop, __ATOMIC_ACQUIRE)) break;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_socket_connect,
+	"Measure the rate of Connect to a listener that accepts.",
+	.timeout = 60
+	)
+{
+	const port_t port = 100;
+	socket_stop = 0;
+	Fid_t lsock = Socket(port);
+	ASSERT(lsock != NOFILE);
+	ASSERT(Listen(lsock) == 0);
+	Tid_t t = CreateThread(socket_acceptor, lsock, NULL);
+	ASSERT(t != NOTHREAD);
+
+	bench_samples s;
+	bench_start(&s);
+	while(bench_running(&s)) {
+		double t0 = bench_clock();
+		Fid_t c = Socket(NOPORT);
+		ASSERT(c != NOFILE);
+		ASSERT(Connect(c, port, 1000) == 0);
+		Close(c);
+		bench_add(&s, bench_clock() - t0);
+	}
+	bench_report("socket connect", &s, 0, 0);
+
+	/* A last connection to wake up the acceptor */
+	__atomic_store_n(&socket_stop, 1, __ATOMIC_RELEASE);
+	Fid_t c = Socket(NOPORT);
+	ASSERT(Connect(c, port, 1000) == 0);
+	Close(c);
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	Close(lsock);
+	return 0;
+}
+
+
+
+/*
+	Mutex and CondVar handoff: two threads pass a token, each waiting
+	on its own condition variable. Each repetition is a round trip.
+ */
+
+static Mutex hand_mx;
+static CondVar hand_cv[2];
+static int hand_turn;
+static int hand_stop;
+
+static int hand_partner(int argl, void* args)
+{
+	Mutex_Lock(&hand_mx);
+	for(;;) {
+		while(hand_turn == 0)
+			Cond_Wait(&hand_mx, &hand_cv[1]);
+		if(hand_stop) break;
+		hand_turn = 0;
+		Cond_Signal(&hand_cv[0]);
+	}
+	Mutex_Unlock(&hand_mx);
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_condvar,
+	"Measure the round trip of two threads passing a token with a mutex and condition variables.",
+	.timeout = 60
+	)
+{
+	hand_mx = MUTEX_INIT;
+	hand_cv[0] = hand_cv[1] = COND_INIT;
+	hand_turn = 0;
+	hand_stop = 0;
+	Tid_t t = CreateThread(hand_partner, 0, NULL);
+	ASSERT(t != NOTHREAD);
+
+	bench_samples s;
+	bench_start(&s);
+	Mutex_Lock(&hand_mx);
+	while(bench_running(&s)) {
+		double t0 = bench_clock();
+		hand_turn = 1;
+		Cond_Signal(&hand_cv[1]);
+		while(hand_turn == 1)
+			Cond_Wait(&hand_mx, &hand_cv[0]);
+		bench_add(&s, bench_clock() - t0);
+	}
+	hand_stop = 1;
+	hand_turn = 1;
+	Cond_Signal(&hand_cv[1]);
+	Mutex_Unlock(&hand_mx);
+	bench_report("mutex/condvar handoff", &s, 0, 0);
+
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+
+
+TEST_SUITE(all_benchmarks,
+	"All the kernel benchmarks."
+	)
+{
+	&bench_context_switch,
+	&bench_thread_create_join,
+	&bench_exec_waitchild,
+	&bench_pipe_throughput,
+	&bench_socket_connect,
+	&bench_mutex_condvar,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
@@ -1,17 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
-#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <limits.h>
+#include <sched.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include "util.h"
 #include "bios.h"
@@ -22,10 +32,19 @@
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- One timerfd per core thread, multiplexing the soft timers of the core
+	- Core threads mask all signals except for USR1, and never block it.
+	Interrupts are disabled by a per-core flag; SIGUSR1 arriving while it
+	is set only leaves the interrupt pending.
+	- The PIC thread waits on an epoll set, holding the timerfds, the
+	terminal fds and an eventfd used to wake it up. It dispatches 
+	interrupts to the right core thread by raising SIGUSR1, since a 
+	running core can only be interrupted by a signal.
+	- Block requests are pushed on a lock-free stack and the PIC thread 
+	is woken up to perform them on the disk files.
+	- The network device is a pair of frame rings, which the PIC thread
+	moves to and from TCP connections with the other nodes. The sockets
+	are in the epoll set, nonblocking.
 
  */
 
@@ -39,22 +58,25 @@ typedef struct core
 	interrupt_handler* bootfunc;
 	pthread_t thread;
 
-	struct sigevent timer_sigevent;
-	timer_t timer_id;
+	int timer_fd;
+	TimerDuration soft_timer[CORE_TIMERS];	/* Expiration times, or CORE_TIMER_OFF */
+	TimerDuration timer_armed;	/* Expiration of timer_fd, or CORE_TIMER_OFF */
 
 	interrupt_handler* intvec[maximum_interrupt_no];
 	sig_atomic_t intpending[maximum_interrupt_no];
+	uint serial_pending[maximum_interrupt_no];	/* bit i: serial port i raised the interrupt */
+	block_request* block_done;	/* The completed block requests, not taken yet */
 
-	sig_atomic_t int_disabled;
 	sig_atomic_t halted;
-	rlnode halted_node;
+	int restart_pending;		/* A restart came while the core was not halted */
+	pthread_mutex_t halt_mutex;	/* Protects halted and restart_pending */
 	pthread_cond_t halt_cond;
 
 	/* Statistics */
 	int irq_count;
 	int irq_raised[maximum_interrupt_no];
-	int irq_delivered[maximum_interrupt_no];
-} Core;
+	unsigned long irq_delivered[maximum_interrupt_no];
+} CACHE_ALIGNED Core;
 
 
 /* Per-core thread-local Core */
@@ -66,12 +88,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
-
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
 
@@ -81,17 +97,16 @@ static unsigned int ncores = 0;
 /* Core barrier */
 static pthread_barrier_t system_barrier, core_barrier;
 
+/* The host CPUs of the core threads and the PIC thread, or -1 */
+static int core_cpu[MAX_CORES];
+static int pic_cpu = -1;
+static int affinity_configured = 0;
+
 /* Flag that signals that PIC daemon should be active */
 static volatile sig_atomic_t PIC_active;
 
-/* Mutex for implementing core halt */
-static pthread_mutex_t core_halt_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-/* List of halted cores */
-static rlnode halted_list;
-
-/* PIC thread id */
-static pthread_t PIC_thread;
+/* Restarts requested by cpu_core_restart_one(), given to the next cores that halt */
+static uint restarts_pending;
 
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
@@ -104,9 +119,6 @@ static struct sigaction USR1_sigaction;
 typedef unsigned long coarse_clock_t;
 static volatile coarse_clock_t  system_clock;
 
-/* This is how fast the coarse clock is updated (in usec) */
-#define SLOW_HZ 10000
-
 /* This gives a rough serial port timeout of 300 msec */
 #define SERIAL_TIMEOUT 300
 
@@ -114,7 +126,83 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
 
 /* PIC daemon statistics */
-static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
+static unsigned long PIC_loops, PIC_kicks_drained, PIC_kicks_queued;
+
+/* The epoll set of the PIC daemon, and the eventfd that wakes it up */
+static int PIC_epoll = -1, PIC_eventfd = -1;
+
+/* The disks */
+typedef struct disk {
+	int fd;
+	uint64_t blocks;
+} disk;
+
+static disk DISK[MAX_BLOCK_DEVICES];
+static uint ndisks = 0;
+
+/* The paths of the disk files, given by vm_config_disks() */
+static char* disk_path[MAX_BLOCK_DEVICES];
+static uint disk_paths = 0;
+static int disks_configured = 0;
+
+/* The block requests submitted and not taken by the PIC yet, newest first */
+static block_request* block_submitted;
+
+/* 
+	A TCP connection with another node. Outgoing links carry the frames
+	sent to the node, and incoming links, accepted by the listener, the
+	frames it sends.
+ */
+typedef struct net_link {
+	int fd;                 /* -1 when closed */
+	int connecting;         /* An outgoing link whose connect() is in progress */
+	int stalled;            /* An incoming link with frames that did not fit the receive ring */
+	uint pos, len;          /* buf[pos..len) is not sent yet, or not taken yet */
+	char* buf;
+} net_link;
+
+/* The header of a frame on a link, in network byte order */
+typedef struct net_wire_header {
+	uint32_t size;
+	uint32_t node;          /* The sender */
+} net_wire_header;
+
+/* The bytes buffered by a link, room for many frames */
+#define NET_LINK_BUFFER (64*1024)
+
+/* The most incoming links, twice the nodes to allow for reconnections */
+#define NET_IN_LINKS (2*MAX_NET_NODES)
+
+/* The network given by vm_config_network() */
+static struct sockaddr_storage net_addr[MAX_NET_NODES];
+static socklen_t net_addrlen[MAX_NET_NODES];
+static uint net_addrs = 0;
+static int net_config_node = -1;
+static int net_configured = 0;
+
+/* The network of the booted machine */
+static int net_self = -1;
+static uint nnodes = 0;
+static int net_listen_fd = -1;
+static net_link net_out[MAX_NET_NODES], net_in[NET_IN_LINKS];
+
+/* Frames to a node are dropped until its time here, after its link failed */
+static coarse_clock_t net_unreachable[MAX_NET_NODES];
+
+/* The time to drop frames to a node after its link failed, in msec */
+#define NET_RETRY 100
+
+/* The rings, and the interrupt flags, are protected by net_lock */
+static pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+static net_frame net_tx_ring[BIOS_NET_RING], net_rx_ring[BIOS_NET_RING];
+static uint net_tx_head, net_tx_count, net_rx_head, net_rx_count;
+static int net_rx_armed;        /* Raise NET_RX_READY when frames arrive */
+static int net_tx_wanted;       /* Raise NET_TX_READY when the transmit ring has room */
+static int net_rx_stalled;      /* Some frames wait for room in the receive ring */
+
+/* The kinds of fds in the epoll set, kept in the upper half of epoll_data.u64 */
+enum { PIC_KICK, PIC_TIMER, PIC_CON, PIC_KBD, PIC_NET_LISTEN, PIC_NET_OUT, PIC_NET_IN };
+#define PIC_TAG(kind, index) (((uint64_t)(kind) << 32) | (index))
 
 
 /* Initialize static vars. This is called via pthread_once() */
@@ -125,7 +213,9 @@ static void initialize()
 	CHECKRC(pthread_key_create(&Core_key, NULL));
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* SIGUSR1 is never blocked: a handler may switch to a context that does
+	   not return through it, and nothing would unblock it then. */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -136,15 +226,6 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -161,21 +242,50 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/*
+	The interrupt-disable flag of the core of this host thread.
+
+	A context may be switched to another core by an interrupt at any point
+	where interrupts are enabled. So, the flag is set by a single store 
+	relative to the thread pointer, which the local-exec model guarantees: 
+	the store cannot be split by an interrupt into computing the address 
+	of one core's flag and writing it from another core.
+ */
+static _Thread_local volatile sig_atomic_t int_disabled 
+	__attribute__((tls_model("local-exec")));
+
 
 /*
 	Cause PIC daemon to loop.
  */
 static inline void interrupt_pic_thread()
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
-	__atomic_fetch_add(&PIC_usr1_queued,1,__ATOMIC_RELAXED);
+	uint64_t one = 1;
+	CHECK(write(PIC_eventfd, &one, sizeof(one)));
+	__atomic_fetch_add(&PIC_kicks_queued,1,__ATOMIC_RELAXED);
 }
 
 
 
+/*
+	Arm the timerfd of a core to expire at time 'when' of bios_clock(), 
+	which is CLOCK_MONOTONIC, or disarm it for CORE_TIMER_OFF.
+ */
+static void core_timer_arm(Core* core, TimerDuration when)
+{
+	struct itimerspec newtime = { .it_interval = {.tv_sec=0, .tv_nsec=0} };
+	if(when == CORE_TIMER_OFF)
+		newtime.it_value = (struct timespec) {.tv_sec=0, .tv_nsec=0};
+	else {
+		/* A zero it_value would disarm it */
+		if(when == 0) when = 1;
+		newtime.it_value = (struct timespec) {.tv_sec = when / 1000000, .tv_nsec = (when % 1000000) * 1000l};
+	}
+	CHECK(timerfd_settime(core->timer_fd, TFD_TIMER_ABSTIME, &newtime, NULL));
+	core->timer_armed = when;
+}
+
+
 /*
 	Helper pthread-startable function to launch a core thread.
 */
@@ -187,10 +297,15 @@ static void* bootfunc_wrapper(void* _core)
 	for(int i=0; i<maximum_interrupt_no; i++) {
 		core->intvec[i] = NULL;
 		core->intpending[i] = 0;
+		core->serial_pending[i] = 0;
 	}
+	core->block_done = NULL;
+	for(int i=0; i<CORE_TIMERS; i++)
+		core->soft_timer[i] = CORE_TIMER_OFF;
+	core->timer_armed = CORE_TIMER_OFF;
 
 	/* Mark interrupts as enabled */
-	core->int_disabled = 0;
+	int_disabled = 0;
 
 	/* establish the thread-local id */
 	CHECKRC(pthread_setspecific(Core_key, core));
@@ -199,12 +314,6 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
-
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
@@ -216,8 +325,10 @@ static void* bootfunc_wrapper(void* _core)
 		core->intvec[i] = NULL;
 	}		
 
-	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	/* Disarm the core timers, the PIC daemon closes the timerfd */
+	for(int i=0; i<CORE_TIMERS; i++)
+		core->soft_timer[i] = CORE_TIMER_OFF;
+	core_timer_arm(core, CORE_TIMER_OFF);
 
 	pthread_barrier_wait(& core_barrier);
 
@@ -249,20 +360,40 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 }
 
 
+/*
+	Return 1 if the given core has some interrupt pending.
+ */
+static inline int core_interrupt_pending(Core* core)
+{
+	for(int intno = 0; intno < maximum_interrupt_no; intno++)
+		if(core->intpending[intno]) return 1;
+	return 0;
+}
+
+
 /*
 	Dispatch the pending iterrupts for the given core.
  */
 static void dispatch_interrupts(Core* core)
 {
 	for(int intno = 0; intno < maximum_interrupt_no; intno++) {
-		if(core->int_disabled) break; /* will continue at
+		if(int_disabled) break; /* will continue at
 										 cpu_interrupt_enable()*/
-		if(core->intpending[intno]) {
-			core->intpending[intno] = 0;
+		/* A nested SIGUSR1 may dispatch it meanwhile, take it atomically */
+		if(core->intpending[intno] && __atomic_exchange_n(&core->intpending[intno], 0, __ATOMIC_RELAXED)) {
 			core->irq_delivered[intno]++;
 			interrupt_handler* handler =  core->intvec[intno];
 			if(handler != NULL) { 
+				/* Handlers start with interrupts disabled, and the
+				   interrupted code gets them back enabled */
+				int_disabled = 1;
 				handler();
+				int_disabled = 0;
+				/* The handler may have switched us to another core */
+				core = curr_core();
+				/* The interrupts raised during the handler were left
+				   pending, including those already looked at */
+				intno = -1;
 			}
 		}
 	}	
@@ -277,7 +408,7 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	Core* core = & CORE[si->si_value.sival_int];
 
 	core->irq_count++;
-	if(core->int_disabled) return;
+	if(int_disabled) return;	/* Left pending, for cpu_enable_interrupts() */
 	dispatch_interrupts(core);
 }
 
@@ -300,7 +431,7 @@ static coarse_clock_t get_coarse_time()
 /*
 	An io_device handles a file descriptor that is connected to some
 	'peripheral' in stream (byte-oriented) mode. The file descriptor must be
-	'select-able' (i.e. not a disk file) and support non-blocking mode.
+	pollable (i.e. not a disk file) and support non-blocking mode.
 
 	Model outline:
 
@@ -311,13 +442,11 @@ static coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
-
-	A not-ready device is made ready when select() returns it as such.
-
-	A ready device is made not-ready on each failed attempt to do an I/O transfer.
-
-	When a not-ready device becomes ready, an interrupt is raised.
+	The fd is registered with the PIC in edge-triggered mode. A device is 
+	not ready after an I/O transfer fails. When it becomes ready again (more
+	bytes arrive, or room is made), epoll reports an edge and an interrupt 
+	is raised. Also, an interrupt is raised when a device has not raised one
+	for SERIAL_TIMEOUT msec, in case the cores missed it.
  */
 
 typedef enum io_direction
@@ -335,64 +464,54 @@ typedef struct io_device
 	io_direction iodir;  		/* device direction */
 
 	volatile Core* int_core;		/* core to receive interrupts */
-	volatile int ready;  		/* ready flag */
 	coarse_clock_t last_int;	/* used for timeouts */
 } io_device;
 
 
-static int io_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
-}
-
 static void io_device_init(io_device* this, int fd, io_direction iodir)
 {
 	this->fd = fd;
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
-	this->ready = io_ready(fd, iodir);
 	this->last_int = system_clock;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
+/* Add the device to the epoll set of the PIC */
+static void io_device_watch(io_device* this, uint64_t tag)
+{
+	struct epoll_event ev = {
+		.events = ((this->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET,
+		.data.u64 = tag
+	};
+	CHECK(epoll_ctl(PIC_epoll, EPOLL_CTL_ADD, this->fd, &ev));
+}
+
 
-static int io_device_read(io_device* this, char* ptr)
+/* Read up to 'size' bytes with one system call, returning the bytes read. */
+static uint io_device_read(io_device* this, char* buf, uint size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
-
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	}
-	return rc==1;
+	ssize_t rc;
+	while((rc=read(this->fd, buf, size))==-1 && errno == EINTR);
+	assert(rc>=0 || errno==EAGAIN || errno==EWOULDBLOCK);
+	return (rc > 0) ? rc : 0;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/* Write up to 'size' bytes with one system call, returning the bytes written. */
+static uint io_device_write(io_device* this, const char* buf, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
-
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+	ssize_t rc;
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
-
-	return rc==1;
+	assert(rc>=0 || errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE); 
+	return (rc > 0) ? rc : 0;
 }
 
 
@@ -410,21 +529,30 @@ static terminal TERM[MAX_TERMINALS];
 /* Current number of terminals */
 static uint nterm = 0;
 
+char* bios_fifo_path(char* buf, size_t size, const char* name, uint no)
+{
+	const char* dir = getenv(BIOS_FIFO_DIR_ENV);
+	if(dir && *dir)
+		snprintf(buf, size, "%s/%s%u", dir, name, no);
+	else
+		snprintf(buf, size, "%s%u", name, no);
+	return buf;
+}
+
+
 /*
 	Open the FIFOs for this terminal
  */
 static int terminal_init(terminal* this, int no)
 {
-	char fname[32];
+	char fname[PATH_MAX];
 	int fd;
 
-	sprintf(fname, "con%d", no);
-	fd = open(fname, O_WRONLY);
+	fd = open(bios_fifo_path(fname, sizeof(fname), "con", no), O_WRONLY);
 	if(fd==-1) return -1;
 	io_device_init(& this->con, fd, IODIR_TX);
 
-	sprintf(fname, "kbd%d", no);
-	fd = open(fname, O_RDONLY);
+	fd = open(bios_fifo_path(fname, sizeof(fname), "kbd", no), O_RDONLY);
 	if(fd==-1) return -1;
 	io_device_init(& this->kbd, fd, IODIR_RX);
 
@@ -456,38 +584,620 @@ static void close_terminal(terminal* term)
 {
 	CHECK(terminal_destroy(term));
 }
-static inline void fdset_add(fd_set* set, int fd, int* nfds)
+
+
+/* 
+	Helper for PIC_daemon: the msec to wait until the next serial timeout,
+	or -1 to wait for an event, when there are no terminals.
+ */
+static int pic_timeout()
 {
-	FD_SET(fd, set);
-	if(fd >= *nfds) *nfds = fd+1;
+	if(nterm == 0) return -1;
+
+	coarse_clock_t deadline = TERM[0].con.last_int;
+	for(uint i=0; i<nterm; i++) {
+		if(TERM[i].con.last_int < deadline) deadline = TERM[i].con.last_int;
+		if(TERM[i].kbd.last_int < deadline) deadline = TERM[i].kbd.last_int;
+	}
+	deadline += SERIAL_TIMEOUT + 1;
+
+	coarse_clock_t now = get_coarse_time();
+	return (deadline > now) ? deadline - now : 0;
 }
 
 
-static int check_terminal(terminal* term)
+/* 
+	Helper for PIC_daemon. The port is marked in the core before the
+	interrupt is raised, so a handler that finds the interrupt pending 
+	also finds the port.
+ */
+static void pic_raise_serial(uint serial, Interrupt intno)
 {
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
+	io_device* dev = (intno==SERIAL_RX_READY) ? & TERM[serial].kbd : & TERM[serial].con;
+	Core* core = (Core*) dev->int_core;
+	dev->last_int = system_clock;
+	__atomic_fetch_or(& core->serial_pending[intno], 1u << serial, __ATOMIC_RELEASE);
+	raise_interrupt(core, intno);
 }
 
 
+/*
+	Host CPU affinity.
+ */
 
-/* Helper for PIC_daemon */
-static void pic_drain_sigusr1(int sigusr1fd)
+/* Parse a list of CPUs, e.g., "0-3,8", into set. Return 0, or -1 if malformed. */
+static int parse_cpu_list(const char* list, cpu_set_t* set)
 {
-	struct signalfd_siginfo sfdinfo;
-	while(1) {
-		int rc = read(sigusr1fd, &sfdinfo, sizeof(sfdinfo));
-		if(rc==-1) {
-			assert(errno==EAGAIN || errno==EWOULDBLOCK);
-			break;
+	CPU_ZERO(set);
+	const char* p = list;
+	while(*p) {
+		char* end;
+		long lo = strtol(p, &end, 10), hi = lo;
+		if(end == p || lo < 0) return -1;
+		p = end;
+		if(*p == '-') {
+			hi = strtol(p+1, &end, 10);
+			if(end == p+1 || hi < lo) return -1;
+			p = end;
+		}
+		if(hi >= CPU_SETSIZE) return -1;
+		for(long c = lo; c <= hi; c++) CPU_SET(c, set);
+		if(*p == ',') p++;
+		else if(*p) return -1;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int vm_config_affinity(const char* cpus, int pic)
+{
+	cpu_set_t allowed, set;
+	CHECK(sched_getaffinity(0, sizeof(allowed), &allowed));
+	if(pic >= CPU_SETSIZE || (pic >= 0 && !CPU_ISSET(pic, &allowed)))
+		return -1;
+
+	CPU_ZERO(&set);
+	if(cpus != NULL && strcmp(cpus, "auto") == 0) {
+		set = allowed;
+		if(pic >= 0 && CPU_COUNT(&set) > 1) CPU_CLR(pic, &set);
+	}
+	else if(cpus != NULL) {
+		cpu_set_t both;
+		if(parse_cpu_list(cpus, &set) != 0) return -1;
+		CPU_AND(&both, &set, &allowed);
+		if(! CPU_EQUAL(&both, &set)) return -1;
+	}
+
+	/* Deal the CPUs to the cores, in order */
+	int n = CPU_COUNT(&set);
+	for(uint c=0, cpu=0; c < MAX_CORES; c++) {
+		if(n == 0) { core_cpu[c] = -1; continue; }
+		while(! CPU_ISSET(cpu, &set)) cpu = (cpu+1) % CPU_SETSIZE;
+		core_cpu[c] = cpu;
+		cpu = (cpu+1) % CPU_SETSIZE;
+	}
+	pic_cpu = pic;
+	affinity_configured = 1;
+	return 0;
+}
+
+int bios_core_cpu(uint core)
+{
+	if(! affinity_configured || core >= MAX_CORES) return -1;
+	return core_cpu[core];
+}
+
+/* Take the affinity from the environment, if vm_config_affinity was not called */
+static void affinity_from_env()
+{
+	if(affinity_configured) return;
+	const char* cpus = getenv(BIOS_CPUS_ENV);
+	const char* pic = getenv(BIOS_PIC_CPU_ENV);
+	if(cpus && *cpus == '\0') cpus = NULL;
+	int pcpu = (pic && *pic) ? atoi(pic) : -1;
+	if(cpus == NULL && pcpu < 0) return;
+	if(vm_config_affinity(cpus, pcpu) != 0)
+		fprintf(stderr, "Ignoring %s=%s %s=%s, these CPUs are not available\n",
+			BIOS_CPUS_ENV, cpus ? cpus : "", BIOS_PIC_CPU_ENV, pic ? pic : "");
+}
+
+/* Set attr to start a thread on cpu, if it is not -1 */
+static void affinity_attr(pthread_attr_t* attr, int cpu)
+{
+	CHECKRC(pthread_attr_init(attr));
+	if(cpu < 0) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	CHECKRC(pthread_attr_setaffinity_np(attr, sizeof(set), &set));
+}
+
+
+/*
+	Disks.
+ */
+
+static void free_disk_paths()
+{
+	for(uint i=0; i<disk_paths; i++) free(disk_path[i]);
+	disk_paths = 0;
+}
+
+int vm_config_disks(const char* paths)
+{
+	char* path[MAX_BLOCK_DEVICES];
+	uint n = 0;
+
+	for(const char* p = paths; p != NULL && *p; ) {
+		const char* end = strchr(p, ',');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		if(n == MAX_BLOCK_DEVICES) goto error;
+		path[n] = strndup(p, len);
+		n++;
+		if(access(path[n-1], R_OK|W_OK) != 0) goto error;
+		p = end ? end+1 : p+len;
+	}
+
+	free_disk_paths();
+	for(uint i=0; i<n; i++) disk_path[i] = path[i];
+	disk_paths = n;
+	disks_configured = 1;
+	return 0;
+
+error:
+	for(uint i=0; i<n; i++) free(path[i]);
+	return -1;
+}
+
+/* Take the disks from the environment, if vm_config_disks was not called */
+static void disks_from_env()
+{
+	if(disks_configured) return;
+	const char* paths = getenv(BIOS_DISKS_ENV);
+	if(paths == NULL || *paths == '\0') return;
+	if(vm_config_disks(paths) != 0)
+		fprintf(stderr, "Ignoring %s=%s, some file cannot be read and written\n", 
+			BIOS_DISKS_ENV, paths);
+}
+
+static void open_disks()
+{
+	disks_from_env();
+	for(uint i=0; i<disk_paths; i++) {
+		DISK[i].fd = open(disk_path[i], O_RDWR | O_CLOEXEC);
+		CHECK(DISK[i].fd);
+		struct stat st;
+		CHECK(fstat(DISK[i].fd, &st));
+		DISK[i].blocks = st.st_size / BIOS_BLOCK_SIZE;
+	}
+	ndisks = disk_paths;
+	block_submitted = NULL;
+}
+
+static void close_disks()
+{
+	for(uint i=0; i<ndisks; i++)
+		CHECK(close(DISK[i].fd));
+	ndisks = 0;
+}
+
+/* Perform a block request on its disk file */
+static void disk_transfer(block_request* rq)
+{
+	struct iovec iov[BIOS_MAX_REQUEST_BLOCKS];
+	for(uint i=0; i<rq->count; i++) {
+		iov[i].iov_base = rq->buf[i];
+		iov[i].iov_len = BIOS_BLOCK_SIZE;
+	}
+
+	/* Regular files transfer everything, unless there is an error */
+	size_t want = (size_t) rq->count * BIOS_BLOCK_SIZE, done = 0;
+	off_t off = (off_t) rq->block * BIOS_BLOCK_SIZE;
+	struct iovec* v = iov;
+	int nv = rq->count;
+	while(done < want) {
+		ssize_t rc = rq->write ? pwritev(DISK[rq->disk].fd, v, nv, off+done)
+			: preadv(DISK[rq->disk].fd, v, nv, off+done);
+		if(rc < 0 && errno == EINTR) continue;
+		if(rc <= 0) break;
+		done += rc;
+		while(nv > 0 && (size_t) rc >= v->iov_len) { rc -= v->iov_len; v++; nv--; }
+		if(nv > 0) { v->iov_base = (char*) v->iov_base + rc; v->iov_len -= rc; }
+	}
+	rq->status = (done == want) ? 0 : -1;
+}
+
+/* 
+	Helper for PIC_daemon: perform the submitted block requests, oldest first,
+	and raise BLOCK_DONE once on each core that submitted some.
+ */
+static void pic_block_io()
+{
+	block_request* rq = __atomic_exchange_n(&block_submitted, NULL, __ATOMIC_ACQUIRE);
+
+	/* Reverse the stack */
+	block_request* fifo = NULL;
+	while(rq != NULL) {
+		block_request* next = rq->next;
+		rq->next = fifo;
+		fifo = rq;
+		rq = next;
+	}
+
+	uint cores_done = 0;
+	while(fifo != NULL) {
+		rq = fifo;
+		fifo = rq->next;
+		disk_transfer(rq);
+
+		Core* core = & CORE[rq->core];
+		rq->next = __atomic_load_n(& core->block_done, __ATOMIC_RELAXED);
+		while(! __atomic_compare_exchange_n(& core->block_done, & rq->next, rq, 
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		cores_done |= 1u << rq->core;
+	}
+
+	for(uint c=0; cores_done; c++, cores_done >>= 1)
+		if(cores_done & 1) raise_interrupt(& CORE[c], BLOCK_DONE);
+}
+
+
+/*
+	Network.
+
+	The frames sent to a node are written, in order, on the outgoing link
+	to it, which is connected on the first frame. The frames that arrive 
+	on the incoming links go to the receive ring. A frame sent to this
+	node goes to the receive ring directly.
+ */
+
+/* Resolve "host:port" */
+static int net_resolve(const char* hostport, size_t len, struct sockaddr_storage* addr, socklen_t* addrlen)
+{
+	char* host = strndup(hostport, len);
+	char* colon = strrchr(host, ':');
+	int rc = -1;
+	if(colon != NULL && colon != host) {
+		*colon = '\0';
+		struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+		struct addrinfo* ai;
+		if(getaddrinfo(host, colon+1, &hints, &ai) == 0) {
+			memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+			*addrlen = ai->ai_addrlen;
+			freeaddrinfo(ai);
+			rc = 0;
+		}
+	}
+	free(host);
+	return rc;
+}
+
+int vm_config_network(int node, const char* addrs)
+{
+	struct sockaddr_storage addr[MAX_NET_NODES];
+	socklen_t addrlen[MAX_NET_NODES];
+	uint n = 0;
+
+	if(node >= 0) {
+		for(const char* p = addrs; p != NULL && *p; ) {
+			const char* end = strchr(p, ',');
+			size_t len = end ? (size_t)(end - p) : strlen(p);
+			if(n == MAX_NET_NODES) return -1;
+			if(net_resolve(p, len, &addr[n], &addrlen[n]) != 0) return -1;
+			n++;
+			p = end ? end+1 : p+len;
+		}
+		if(n > 0 && (uint) node >= n) return -1;
+	}
+
+	memcpy(net_addr, addr, n*sizeof(addr[0]));
+	memcpy(net_addrlen, addrlen, n*sizeof(addrlen[0]));
+	net_addrs = n;
+	net_config_node = (n > 0) ? node : -1;
+	net_configured = 1;
+	return 0;
+}
+
+/* Take the network from the environment, if vm_config_network was not called */
+static void network_from_env()
+{
+	if(net_configured) return;
+	const char* addrs = getenv(BIOS_NET_ENV);
+	const char* node = getenv(BIOS_NODE_ENV);
+	if(addrs == NULL || *addrs == '\0') return;
+	if(node == NULL || vm_config_network(atoi(node), addrs) != 0)
+		fprintf(stderr, "Ignoring %s=%s, the node is not given or some address is bad\n", 
+			BIOS_NET_ENV, addrs);
+}
+
+static void net_link_open(net_link* link, int fd, uint32_t events, uint64_t tag)
+{
+	link->fd = fd;
+	link->connecting = link->stalled = 0;
+	link->pos = link->len = 0;
+	link->buf = xmalloc(NET_LINK_BUFFER);
+	struct epoll_event ev = { .events = events | EPOLLET, .data.u64 = tag };
+	CHECK(epoll_ctl(PIC_epoll, EPOLL_CTL_ADD, fd, &ev));
+}
+
+/* The frames still buffered are lost */
+static void net_link_close(net_link* link)
+{
+	if(link->fd < 0) return;
+	CHECK(close(link->fd));
+	free(link->buf);
+	link->fd = -1;
+	link->buf = NULL;
+}
+
+/* Helper for PIC_daemon, called before the barrier so that bios_net_node() is set at boot */
+static void open_network()
+{
+	network_from_env();
+
+	net_tx_head = net_tx_count = net_rx_head = net_rx_count = 0;
+	net_rx_armed = 1;
+	net_tx_wanted = net_rx_stalled = 0;
+	for(uint i=0; i<MAX_NET_NODES; i++) {
+		net_out[i].fd = -1;
+		net_unreachable[i] = 0;
+	}
+	for(uint i=0; i<NET_IN_LINKS; i++) net_in[i].fd = -1;
+
+	nnodes = net_addrs;
+	net_self = net_config_node;
+	if(net_self < 0) return;
+
+	const struct sockaddr_storage* addr = & net_addr[net_self];
+	net_listen_fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	CHECK(net_listen_fd);
+	int one = 1;
+	CHECK(setsockopt(net_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+	CHECK(bind(net_listen_fd, (const struct sockaddr*) addr, net_addrlen[net_self]));
+	CHECK(listen(net_listen_fd, NET_IN_LINKS));
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.u64 = PIC_TAG(PIC_NET_LISTEN, 0) };
+	CHECK(epoll_ctl(PIC_epoll, EPOLL_CTL_ADD, net_listen_fd, &ev));
+}
+
+/* The output left in the links is given this long to leave, at shutdown, in msec */
+#define NET_LINGER 1000
+
+static void close_network()
+{
+	if(net_self < 0) return;
+	for(uint i=0; i<MAX_NET_NODES; i++) {
+		net_link* link = & net_out[i];
+		if(link->fd >= 0 && ! link->connecting && link->pos < link->len) {
+			struct timeval tv = { NET_LINGER / 1000, (NET_LINGER % 1000) * 1000 };
+			setsockopt(link->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			fcntl(link->fd, F_SETFL, 0);
+			while(link->pos < link->len) {
+				ssize_t rc = send(link->fd, link->buf + link->pos, link->len - link->pos, MSG_NOSIGNAL);
+				if(rc > 0) link->pos += rc;
+				else if(rc < 0 && errno == EINTR) continue;
+				else break;
+			}
+		}
+		net_link_close(link);
+	}
+	for(uint i=0; i<NET_IN_LINKS; i++) net_link_close(& net_in[i]);
+	CHECK(close(net_listen_fd));
+	net_listen_fd = -1;
+	net_self = -1;
+	nnodes = 0;
+}
+
+/* Close a failed outgoing link, and drop the frames to its node for a while */
+static void net_link_fail(net_link* link)
+{
+	net_link_close(link);
+	net_unreachable[link - net_out] = system_clock + NET_RETRY;
+}
+
+/* Start connecting the outgoing link to a node. On failure, the link stays closed. */
+static void net_link_connect(uint node)
+{
+	int fd = socket(net_addr[node].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int rc = -1;
+	if(fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		rc = connect(fd, (const struct sockaddr*) & net_addr[node], net_addrlen[node]);
+	}
+	if(rc < 0 && errno != EINPROGRESS) {
+		if(fd >= 0) close(fd);
+		net_unreachable[node] = system_clock + NET_RETRY;
+		return;
+	}
+	net_link_open(& net_out[node], fd, EPOLLOUT | EPOLLRDHUP, PIC_TAG(PIC_NET_OUT, node));
+	net_out[node].connecting = (rc < 0);
+}
+
+/* Send the buffered bytes of an outgoing link, as many as the host takes */
+static void net_link_flush(net_link* link)
+{
+	while(link->fd >= 0 && ! link->connecting && link->pos < link->len) {
+		ssize_t rc = send(link->fd, link->buf + link->pos, link->len - link->pos, 
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(rc > 0) link->pos += rc;
+		else if(rc < 0 && errno == EINTR) continue;
+		else if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		else net_link_fail(link);
+	}
+	if(link->fd >= 0 && link->pos == link->len)
+		link->pos = link->len = 0;
+}
+
+/* Append a frame to the buffer of an outgoing link. Return 0 if there is no room. */
+static int net_link_append(net_link* link, const net_frame* f)
+{
+	size_t need = sizeof(net_wire_header) + f->size;
+	if(NET_LINK_BUFFER - link->len < need) {
+		memmove(link->buf, link->buf + link->pos, link->len - link->pos);
+		link->len -= link->pos;
+		link->pos = 0;
+		if(NET_LINK_BUFFER - link->len < need) return 0;
+	}
+	net_wire_header h = { htonl(f->size), htonl(net_self) };
+	memcpy(link->buf + link->len, &h, sizeof(h));
+	memcpy(link->buf + link->len + sizeof(h), f->data, f->size);
+	link->len += need;
+	return 1;
+}
+
+/* Add a frame to the receive ring. The caller holds net_lock and checked for room. */
+static void net_rx_put(uint node, const char* data, uint size)
+{
+	net_frame* f = & net_rx_ring[(net_rx_head + net_rx_count) % BIOS_NET_RING];
+	f->node = node;
+	f->size = size;
+	memcpy(f->data, data, size);
+	net_rx_count++;
+}
+
+/* 
+	Helper for PIC_daemon: move the transmit ring to the outgoing links, 
+	oldest first. A frame waits while its link is connecting, or full,
+	and the frames after it wait too.
+ */
+static void pic_net_tx()
+{
+	pthread_mutex_lock(& net_lock);
+	while(net_tx_count > 0) {
+		const net_frame* f = & net_tx_ring[net_tx_head];
+		if(f->node == (uint) net_self) {
+			if(net_rx_count == BIOS_NET_RING) { net_rx_stalled = 1; break; }
+			net_rx_put(f->node, f->data, f->size);
+		} else {
+			net_link* link = & net_out[f->node];
+			if(link->fd < 0 && system_clock >= net_unreachable[f->node]) 
+				net_link_connect(f->node);
+			if(link->connecting) break;
+			if(link->fd >= 0 && ! net_link_append(link, f)) {
+				net_link_flush(link);
+				if(link->fd >= 0 && ! net_link_append(link, f)) break;
+			}
+			/* A frame to a node that cannot be reached is dropped */
+		}
+		net_tx_head = (net_tx_head + 1) % BIOS_NET_RING;
+		net_tx_count--;
+	}
+	int wake = net_tx_wanted && net_tx_count <= BIOS_NET_RING/2;
+	if(wake) net_tx_wanted = 0;
+	pthread_mutex_unlock(& net_lock);
+
+	for(uint i=0; i<nnodes; i++)
+		net_link_flush(& net_out[i]);
+	if(wake) raise_interrupt(& CORE[0], NET_TX_READY);
+}
+
+/* Helper for PIC_daemon: an outgoing link connected, failed, or has room */
+static void pic_net_out(uint node, uint32_t events)
+{
+	net_link* link = & net_out[node];
+	if(link->fd < 0) return;
+	if(events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+		net_link_fail(link);
+		return;
+	}
+	if(link->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+			net_link_fail(link);
+		else
+			link->connecting = 0;
+	}
+}
+
+/* 
+	Move the complete frames of an incoming link to the receive ring.
+	Return 0 if the ring is full. The caller holds net_lock.
+ */
+static int net_link_parse(net_link* link)
+{
+	while(link->len - link->pos >= sizeof(net_wire_header)) {
+		net_wire_header h;
+		memcpy(&h, link->buf + link->pos, sizeof(h));
+		uint size = ntohl(h.size), node = ntohl(h.node);
+		if(size > BIOS_NET_MTU || node >= nnodes) {
+			/* Not a node of ours */
+			net_link_close(link);
+			return 1;
+		}
+		if(link->len - link->pos < sizeof(h) + size) break;
+		if(net_rx_count == BIOS_NET_RING) return 0;
+		net_rx_put(node, link->buf + link->pos + sizeof(h), size);
+		link->pos += sizeof(h) + size;
+	}
+
+	/* Keep the partial frame at the front */
+	memmove(link->buf, link->buf + link->pos, link->len - link->pos);
+	link->len -= link->pos;
+	link->pos = 0;
+	return 1;
+}
+
+/* Helper for PIC_daemon: read an incoming link, until it has no data or the receive ring is full */
+static void pic_net_read(net_link* link)
+{
+	while(link->fd >= 0) {
+		pthread_mutex_lock(& net_lock);
+		int room = net_link_parse(link);
+		link->stalled = ! room;
+		if(! room) net_rx_stalled = 1;
+		pthread_mutex_unlock(& net_lock);
+		if(! room || link->fd < 0) return;
+
+		/* A partial frame is shorter than the buffer, so there is room to read */
+		ssize_t rc = recv(link->fd, link->buf + link->len, NET_LINK_BUFFER - link->len, MSG_DONTWAIT);
+		if(rc > 0) link->len += rc;
+		else if(rc < 0 && errno == EINTR) continue;
+		else if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		else net_link_close(link);
+	}
+}
+
+/* Helper for PIC_daemon: accept the incoming links */
+static void pic_net_accept()
+{
+	for(;;) {
+		int fd = accept4(net_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			return;
+		}
+		uint i = 0;
+		while(i < NET_IN_LINKS && net_in[i].fd >= 0) i++;
+		if(i == NET_IN_LINKS) {
+			close(fd);
+			continue;
 		}
-		assert(rc==sizeof(sfdinfo));
-		__atomic_fetch_add(&PIC_usr1_drained,1,__ATOMIC_RELAXED);
-	}				
+		net_link_open(& net_in[i], fd, EPOLLIN | EPOLLRDHUP, PIC_TAG(PIC_NET_IN, i));
+		pic_net_read(& net_in[i]);
+	}
+}
+
+/* 
+	Helper for PIC_daemon: move frames on, and raise NET_RX_READY if frames
+	arrived at an empty ring.
+ */
+static void pic_net_io()
+{
+	if(net_self < 0) return;
+
+	/* bios_net_receive() kicks us when it makes room for stalled frames */
+	if(__atomic_exchange_n(& net_rx_stalled, 0, __ATOMIC_ACQ_REL))
+		for(uint i=0; i<NET_IN_LINKS; i++)
+			if(net_in[i].fd >= 0 && net_in[i].stalled) pic_net_read(& net_in[i]);
+
+	pic_net_tx();
+
+	pthread_mutex_lock(& net_lock);
+	int raise = net_rx_armed && net_rx_count > 0;
+	if(raise) net_rx_armed = 0;
+	pthread_mutex_unlock(& net_lock);
+	if(raise) raise_interrupt(& CORE[0], NET_RX_READY);
 }
 
 
@@ -496,11 +1206,19 @@ static void pic_drain_sigusr1(int sigusr1fd)
 	by calling raise_interrupt().
 
 	Interrupts sent include
-	(a) ALARM, when the per-core timer expires
+	(a) ALARM, when the per-core timerfd expires
 	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
 		io_device becomes ready.
+	(c) BLOCK_DONE, when it has performed block requests.
+	(d) NET_RX_READY  &  NET_TX_READY, as the network rings change.
 
+	The daemon sleeps in epoll_wait(). The set of watched fds does not change
+	while the daemon runs, so no work is done per terminal on each event.
  */
+
+/* The events taken by one call to epoll_wait() */
+#define PIC_EVENTS 32
+
 static void PIC_daemon(uint serialno)
 {
 	nterm = serialno;
@@ -513,108 +1231,112 @@ static void PIC_daemon(uint serialno)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	for(uint i=0; i<nterm; i++)
-		open_terminal(& TERM[i], i);
+	/* The epoll set, with the wake-up eventfd */
+	PIC_epoll = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(PIC_epoll);
+	PIC_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(PIC_eventfd);
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = PIC_TAG(PIC_KICK, 0) };
+	CHECK(epoll_ctl(PIC_epoll, EPOLL_CTL_ADD, PIC_eventfd, &ev));
+
+	/* The core timers */
+	for(uint c=0; c<ncores; c++) {
+		CORE[c].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		CHECK(CORE[c].timer_fd);
+		ev = (struct epoll_event) { .events = EPOLLIN, .data.u64 = PIC_TAG(PIC_TIMER, c) };
+		CHECK(epoll_ctl(PIC_epoll, EPOLL_CTL_ADD, CORE[c].timer_fd, &ev));
+	}
 
-	sigset_t saved_mask;
+	/* The terminals */
+	for(uint i=0; i<nterm; i++) {
+		open_terminal(& TERM[i], i);
+		io_device_watch(& TERM[i].con, PIC_TAG(PIC_CON, i));
+		io_device_watch(& TERM[i].kbd, PIC_TAG(PIC_KBD, i));
+	}
 
-	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
-	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
+	/* The network, known to the cores when they boot */
+	open_network();
 
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	/* Signals are meant for the cores */
+	sigset_t saved_mask;
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &saved_mask));
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 	
 	/* The PIC multiplexing loop */
 	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
-		int maxfd = 0;
-		fd_set readfds, writefds;
-
-		/* Prepare to select */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];
-			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
-		}
-
-		fdset_add(&readfds, sigalrmfd, &maxfd);
-		fdset_add(&readfds, sigusr1fd, &maxfd);
-
-		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
-		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
+		struct epoll_event events[PIC_EVENTS];
+		int nev = epoll_wait(PIC_epoll, events, PIC_EVENTS, pic_timeout());
 
 		/* update system clock */
 		system_clock = get_coarse_time();
 
 		/* process */
-		if(selcode<0) continue;
+		if(nev<0) {
+			assert(errno==EINTR);
+			continue;
+		}
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
 
-		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
+		for(int e=0; e<nev; e++) {
+			uint idx = (uint) events[e].data.u64;
+			uint64_t count;
 
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
+			switch(events[e].data.u64 >> 32) {
+				case PIC_KICK:
+					/* Its purpose was to wake us up */
+					if(read(PIC_eventfd, &count, sizeof(count)) == sizeof(count))
+						__atomic_fetch_add(&PIC_kicks_drained, count, __ATOMIC_RELAXED);
+					break;
+				case PIC_TIMER:
+					/* Nothing is read if the core has reset the timer meanwhile */
+					if(read(CORE[idx].timer_fd, &count, sizeof(count)) == sizeof(count))
+						raise_interrupt(& CORE[idx], ALARM);
+					break;
+				case PIC_CON:
+					pic_raise_serial(idx, SERIAL_TX_READY);
+					break;
+				case PIC_KBD:
+					pic_raise_serial(idx, SERIAL_RX_READY);
+					break;
+				case PIC_NET_LISTEN:
+					pic_net_accept();
+					break;
+				case PIC_NET_OUT:
+					pic_net_out(idx, events[e].events);
+					break;
+				case PIC_NET_IN:
+					pic_net_read(& net_in[idx]);
 					break;
-				}
-				assert(rc==sizeof(sfdinfo));
-
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
 			}
 		}
 
-		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
-		   from select) */
-		if( FD_ISSET(sigusr1fd, &readfds) ) {
-			pic_drain_sigusr1(sigusr1fd);
-		}
+		/* Perform the block requests, the cores kick us when they submit */
+		pic_block_io();
 
-		/* Handle the devices */
-		for(uint i=0; i<nterm; i++) {
+		/* Move the network frames on */
+		pic_net_io();
 
+		/* Handle the serial timeouts */
+		for(uint i=0; i<nterm; i++) {
 			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
-				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->con.ready = 1;
-				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
-			}
-
-
-			if( FD_ISSET(term->kbd.fd, &readfds) 
-				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
-				) 
-			{
-				term->kbd.ready = 1;
-				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
-			}
+			if((system_clock-term->con.last_int)>SERIAL_TIMEOUT)
+				pic_raise_serial(i, SERIAL_TX_READY);
+			if((system_clock-term->kbd.last_int)>SERIAL_TIMEOUT)
+				pic_raise_serial(i, SERIAL_RX_READY);
 		}
 	}
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
-	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
-	CHECK(close(sigusr1fd));
+	/* No block request is left behind */
+	pic_block_io();
+
+	/* The frames sent last go out if the host takes them now */
+	pic_net_io();
+	close_network();
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -624,6 +1346,13 @@ static void PIC_daemon(uint serialno)
 		close_terminal(& TERM[i]);
 	nterm = 0;
 
+	/* Close the timers and the epoll set */
+	for(uint c=0; c<ncores; c++)
+		CHECK(close(CORE[c].timer_fd));
+	CHECK(close(PIC_eventfd));
+	CHECK(close(PIC_epoll));
+	PIC_eventfd = PIC_epoll = -1;
+
 	/* Reset name */
 	CHECKRC(pthread_setname_np(pthread_self(), oldname));
 }
@@ -653,7 +1382,6 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
 
 	/* Set pic_active to 1 */
-	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
 	/* Initialize system_clock */
@@ -663,8 +1391,21 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	pthread_barrier_init(& system_barrier, NULL, cores+1);
 	pthread_barrier_init(& core_barrier, NULL, cores);
 
-	/* Initialize the halted list */
-	rlnode_init(&halted_list, NULL);
+	restarts_pending = 0;
+
+	/* Open the disks, before the cores ask for them */
+	open_disks();
+
+	/* Pin the PIC, which runs on this thread, saving the old affinity */
+	affinity_from_env();
+	cpu_set_t saved_affinity;
+	CHECKRC(pthread_getaffinity_np(pthread_self(), sizeof(saved_affinity), &saved_affinity));
+	if(pic_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(pic_cpu, &set);
+		CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+	}
 
 	/* Launch the core threads */
 	ncores = cores;
@@ -673,9 +1414,10 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CORE[c].bootfunc = bootfunc;
 		CORE[c].id = c;
 
+		pthread_mutex_init(& CORE[c].halt_mutex, NULL);
 		pthread_cond_init(& CORE[c].halt_cond, NULL);
 		CORE[c].halted = 0;
-		rlnode_init(& CORE[c].halted_node, &CORE[c]);
+		CORE[c].restart_pending = 0;
 
 		/* Initialize Core statistics */
 		CORE[c].irq_count = 0;
@@ -684,15 +1426,18 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 			CORE[c].irq_raised[intno] = 0;
 		}
 
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, bootfunc_wrapper, &CORE[c]));
+		/* Create the core thread, on its host CPU */
+		pthread_attr_t attr;
+		affinity_attr(&attr, bios_core_cpu(c));
+		CHECKRC(pthread_create(& CORE[c].thread, &attr, bootfunc_wrapper, &CORE[c]));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
 
 	/* Initialize PIC statistics */
-	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
+	PIC_loops = 0; PIC_kicks_queued = PIC_kicks_drained = 0;
 
 	/* Run the interrupt controller daemon on this thread */	
 	PIC_daemon(serialno);
@@ -706,8 +1451,11 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
 
-	/* Restore signal mask before VM execution */
+	/* Restore signal mask and affinity before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECKRC(pthread_setaffinity_np(pthread_self(), sizeof(saved_affinity), &saved_affinity));
+
+	close_disks();
 
 	/* Delete the Core table */
 	ncores = 0;
@@ -715,12 +1463,12 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* emit statistics */
 #if 0
 	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
-		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
+		PIC_loops, PIC_kicks_queued, PIC_kicks_drained);
 	for(uint c=0;c<cores;c++) {
 		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
 			c, CORE[c].irq_count);
 		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %d(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
+			fprintf(stderr," %lu(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
 		fprintf(stderr,"\n");
 	}
 #endif
@@ -732,54 +1480,106 @@ uint cpu_cores()
 	return ncores;
 }
 
+unsigned long cpu_core_interrupts(uint core)
+{
+	assert(core < MAX_CORES);
+	unsigned long n = 0;
+	for(uint i=0; i<maximum_interrupt_no; i++)
+		n += __atomic_load_n(& CORE[core].irq_delivered[i], __ATOMIC_RELAXED);
+	return n;
+}
+
+/* A spinning core gives up the host cpu every this many rounds */
+#define CPU_SPIN_YIELD 256
+
+void cpu_spin(unsigned long round)
+{
+	if(round % CPU_SPIN_YIELD == CPU_SPIN_YIELD - 1)
+		sched_yield();
+	else
+		cpu_relax();
+}
+
+/* Take one of the restarts_pending, if any. Return 1 if one was taken. */
+static int take_restart()
+{
+	uint pending = __atomic_load_n(&restarts_pending, __ATOMIC_RELAXED);
+	while(pending > 0 && ! __atomic_compare_exchange_n(&restarts_pending, &pending, pending-1,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		;
+	return pending > 0;
+}
+
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	/* Interrupts are disabled while we wait, they only wake us up */
 	Core* core = curr_core();
-	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	assert(! int_disabled);
+	int_disabled = 1;
+	pthread_mutex_lock(& core->halt_mutex);
+	/* An interrupt raised just before we got here would find us not halted,
+	   and its restart would be lost. So, do not halt with interrupts pending,
+	   or after a restart that found us running. */
+	int restarted = core->restart_pending;
+	core->restart_pending = 0;
+	if(! restarted && (CONFIG_UP || ! take_restart()) && ! core_interrupt_pending(core)) {
+		core->halted = 1;
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core->halt_mutex);
+	}
 	assert(! core->halted);
-	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	pthread_mutex_unlock(& core->halt_mutex);
+	int_disabled = 0;
 	dispatch_interrupts(core);
 }
 
-static inline void core_restart(Core* core)
+/* 
+	Restart a core, if halted. Return 1 if it was halted. Else, if sticky, 
+	the next halt of the core returns at once.
+ */
+static inline int core_restart(Core* core, int sticky)
 {
-	if(core->halted) {
+	int halted;
+	pthread_mutex_lock(& core->halt_mutex);
+	halted = core->halted;
+	if(halted) {
 		core->halted = 0;
-		rlist_remove(& core->halted_node);
 		pthread_cond_signal(& core->halt_cond);
-	}	
+	} else if(sticky)
+		core->restart_pending = 1;
+	pthread_mutex_unlock(& core->halt_mutex);
+	return halted;
 }
 
 void cpu_core_restart(uint c)
 {
-	pthread_mutex_lock(& core_halt_mutex);
-	core_restart(CORE+c);
-	pthread_mutex_unlock(& core_halt_mutex);	
+	core_restart(CORE+c, 1);
 }
 
 void cpu_core_restart_one()
 {
-	pthread_mutex_lock(& core_halt_mutex);
-	if(! is_rlist_empty(&halted_list)) {
-		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
-	}	
-	pthread_mutex_unlock(& core_halt_mutex);	
+#if CONFIG_UP
+	/* The only core takes the restart, now or at its next halt */
+	core_restart(CORE, 1);
+#else
+	/* Some core may be about to halt, do not lose the restart. The 
+	   restart is posted first, and taken back if a halted core is found. */
+	if(__atomic_add_fetch(&restarts_pending, 1, __ATOMIC_ACQ_REL) > ncores)
+		__atomic_sub_fetch(&restarts_pending, 1, __ATOMIC_RELAXED);
+
+	for(uint c=0; c<ncores; c++)
+		if(core_restart(CORE+c, 0)) {
+			take_restart();
+			break;
+		}
+#endif
 }
 
 void cpu_core_restart_all()
 {
-	pthread_mutex_lock(& core_halt_mutex);
+	/* Sticky, a core that is about to halt must not miss it */
 	for(uint c=0; c<ncores; c++)
-		core_restart(CORE+c);
-	pthread_mutex_unlock(& core_halt_mutex);	
+		core_restart(CORE+c, 1);
 }
 
 void cpu_core_barrier_sync()
@@ -799,25 +1599,188 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 }
 
 
+/*
+	Interrupts are masked lazily: no system call is made here, SIGUSR1 
+	finds the flag set and leaves the interrupt pending.
+ */
 void cpu_disable_interrupts()
 {
-	Core* core = curr_core();
-	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-		core->int_disabled = 1;
-	}
+	int_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
 void cpu_enable_interrupts()
 {
-	Core* core = curr_core();
-	if(core->int_disabled) {        
-		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
+	if(int_disabled) {
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		int_disabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		/* An interrupt may switch us to another core once the flag is clear */
 		dispatch_interrupts(curr_core());
 	}
 }
 
+int cpu_interrupts_disabled()
+{
+	return int_disabled;
+}
+
+
+#ifdef CPU_CONTEXT_ASM
+
+/*
+	The register-only context switch.
+
+	cpu_asm_switch(&oldsp, newsp) pushes the callee-saved registers (and the
+	floating point control state) on the current stack, stores the stack pointer 
+	into oldsp, loads newsp and pops the same registers from the new stack.
+
+	The signal mask is not touched. This is fine, since SIGUSR1 is never
+	blocked, and the kernel always disables interrupts before switching, 
+	and re-enables them explicitly afterwards.
+
+	A new context is a stack prepared to look as if it had been switched out,
+	with cpu_asm_start as its return address and the thread function in 
+	a callee-saved register.
+ */
+void cpu_asm_switch(void** oldsp, void* newsp);
+void cpu_asm_start(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl cpu_asm_switch\n"
+	".type cpu_asm_switch,@function\n"
+	"cpu_asm_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_asm_switch,.-cpu_asm_switch\n"
+	"\n"
+	".globl cpu_asm_start\n"
+	".type cpu_asm_start,@function\n"
+	"cpu_asm_start:\n"
+	"	xorl %ebp, %ebp\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size cpu_asm_start,.-cpu_asm_start\n"
+);
+
+/* The initial frame, in the order popped by cpu_asm_switch */
+struct cpu_asm_frame {
+	uint32_t mxcsr, fpucw;
+	uint64_t r15, r14, r13, r12, rbx, rbp;
+	uint64_t ret;
+};
+
+static void cpu_asm_init_frame(struct cpu_asm_frame* f, void (*func)())
+{
+	memset(f, 0, sizeof(*f));
+	f->mxcsr = 0x1F80;    /* the power-on defaults */
+	f->fpucw = 0x037F;
+	f->r12 = (uint64_t) func;
+	f->ret = (uint64_t) cpu_asm_start;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".globl cpu_asm_switch\n"
+	".type cpu_asm_switch,%function\n"
+	"cpu_asm_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x9, fpcr\n"
+	"	str x9, [sp, #160]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	ldr x9, [sp, #160]\n"
+	"	msr fpcr, x9\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size cpu_asm_switch,.-cpu_asm_switch\n"
+	"\n"
+	".globl cpu_asm_start\n"
+	".type cpu_asm_start,%function\n"
+	"cpu_asm_start:\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size cpu_asm_start,.-cpu_asm_start\n"
+);
+
+/* The initial frame, in the order loaded by cpu_asm_switch */
+struct cpu_asm_frame {
+	uint64_t x[12];       /* x19 ... x30 */
+	uint64_t d[8];        /* d8 ... d15 */
+	uint64_t fpcr, pad;
+};
+
+static void cpu_asm_init_frame(struct cpu_asm_frame* f, void (*func)())
+{
+	memset(f, 0, sizeof(*f));
+	f->x[0] = (uint64_t) func;             /* x19 */
+	f->x[11] = (uint64_t) cpu_asm_start;   /* x30, the link register */
+}
+
+#endif
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The frame is placed at the (16-byte aligned) top of the stack */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	struct cpu_asm_frame* f = (struct cpu_asm_frame*)(top - sizeof(struct cpu_asm_frame));
+	cpu_asm_init_frame(f, ctx_func);
+	ctx->sp = f;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_asm_switch(& oldctx->sp, newctx->sp);
+}
+
+#else
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
@@ -840,6 +1803,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -847,23 +1812,56 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
  */
 
 
-TimerDuration bios_set_timer(TimerDuration usec)
+/*
+	Soft timers.
+
+	The timerfd of a core is armed at most as late as the earliest soft 
+	timer. Setting a soft timer only moves it earlier, if needed. So, a 
+	timer that is pushed back (e.g., a quantum set again at each context 
+	switch) makes no system call: the timerfd expires early, and the ALARM 
+	handler re-arms it by bios_core_timers_expired().
+ */
+TimerDuration bios_set_core_timer(uint timer, TimerDuration when)
 {
-	time_t sec = usec / 1000000;
-	long nsec = (usec % 1000000) * 1000ull;
-	
-	struct itimerspec newtime = {
-		.it_value = {.tv_sec=sec, .tv_nsec=nsec},
-		.it_interval = {.tv_sec=0, .tv_nsec=0}
-	};
+	assert(timer < CORE_TIMERS);
+	Core* core = curr_core();
+	TimerDuration old = core->soft_timer[timer];
+	core->soft_timer[timer] = when;
+	if(when < core->timer_armed)
+		core_timer_arm(core, when);
+	return old;
+}
 
-	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
-	curr_core()->intpending[ALARM] = 0;
+uint bios_core_timers_expired()
+{
+	Core* core = curr_core();
+	TimerDuration now = bios_clock();
+	TimerDuration earliest = CORE_TIMER_OFF;
+	uint expired = 0;
+
+	for(uint i=0; i<CORE_TIMERS; i++) {
+		if(core->soft_timer[i] <= now) {
+			core->soft_timer[i] = CORE_TIMER_OFF;
+			expired |= 1u << i;
+		}
+		else if(core->soft_timer[i] < earliest)
+			earliest = core->soft_timer[i];
+	}
+
+	/* An expired timerfd is disarmed. If it is not, the ALARM was late and 
+	   the timerfd is still good, unless it is later than the earliest. */
+	if(core->timer_armed <= now)
+		core->timer_armed = CORE_TIMER_OFF;
+	if(earliest < core->timer_armed)
+		core_timer_arm(core, earliest);
+	return expired;
+}
 
-	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
-	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
+TimerDuration bios_set_timer(TimerDuration usec)
+{
+	TimerDuration now = bios_clock();
+	TimerDuration old = bios_set_core_timer(0, (usec == 0) ? CORE_TIMER_OFF : now + usec);
+	return (old == CORE_TIMER_OFF || old <= now) ? 0 : old - now;
 }
 
 TimerDuration bios_cancel_timer()
@@ -874,7 +1872,9 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec*1000000ul + t.tv_nsec/1000ul;
 }	
 
 
@@ -904,13 +1904,23 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the serial ports that raised 'intno' on this core.
+ */
+uint bios_serial_interrupts(Interrupt intno)
+{
+	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
+	return __atomic_exchange_n(& curr_core()->serial_pending[intno], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -920,7 +1930,122 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
 }
 
 
+/*
+	Read up to 'size' bytes from serial port 'serial'. Return the number
+	of bytes read.
+ */
+uint bios_read_serial_bytes(uint serial, char* buf, uint size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write up to 'size' bytes to serial port 'serial'. Return the number
+	of bytes written.
+ */
+uint bios_write_serial_bytes(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
+}
+
+
+
+
+/*
+	Block devices.
+ */
+
+uint bios_block_devices()
+{
+	return ndisks;
+}
+
+uint64_t bios_block_count(uint disk)
+{
+	assert(disk < ndisks);
+	return DISK[disk].blocks;
+}
+
+int bios_block_submit(block_request* rq)
+{
+	if(rq->disk >= ndisks || rq->count == 0 || rq->count > BIOS_MAX_REQUEST_BLOCKS
+		|| rq->block >= DISK[rq->disk].blocks || rq->count > DISK[rq->disk].blocks - rq->block)
+		return -1;
+
+	rq->core = cpu_core_id;
+	rq->status = 0;
+	rq->next = __atomic_load_n(&block_submitted, __ATOMIC_RELAXED);
+	while(! __atomic_compare_exchange_n(&block_submitted, &rq->next, rq, 
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	interrupt_pic_thread();
+	return 0;
+}
+
+block_request* bios_block_completions()
+{
+	return __atomic_exchange_n(& curr_core()->block_done, NULL, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+	Network.
+ */
+
+int bios_net_node()
+{
+	return net_self;
+}
+
+uint bios_net_nodes()
+{
+	return nnodes;
+}
+
+uint bios_net_send(const net_frame* frames, uint n)
+{
+	uint k = 0;
+	pthread_mutex_lock(& net_lock);
+	int kick = (net_tx_count == 0);
+	for(; k<n && net_tx_count < BIOS_NET_RING; k++) {
+		/* Frames with no destination are dropped */
+		if(net_self < 0 || frames[k].node >= nnodes || frames[k].size > BIOS_NET_MTU) continue;
+		net_frame* f = & net_tx_ring[(net_tx_head + net_tx_count) % BIOS_NET_RING];
+		f->node = frames[k].node;
+		f->size = frames[k].size;
+		memcpy(f->data, frames[k].data, f->size);
+		net_tx_count++;
+	}
+	if(k < n) net_tx_wanted = 1;
+	kick = kick && net_tx_count > 0;
+	pthread_mutex_unlock(& net_lock);
+
+	/* The PIC moves a ring that was not empty without a kick */
+	if(kick) interrupt_pic_thread();
+	return k;
+}
+
+uint bios_net_receive(net_frame* frames, uint n)
+{
+	uint k = 0;
+	pthread_mutex_lock(& net_lock);
+	for(; k<n && net_rx_count > 0; k++) {
+		const net_frame* f = & net_rx_ring[net_rx_head];
+		frames[k].node = f->node;
+		frames[k].size = f->size;
+		memcpy(frames[k].data, f->data, f->size);
+		net_rx_head = (net_rx_head + 1) % BIOS_NET_RING;
+		net_rx_count--;
+	}
+	if(k < n) net_rx_armed = 1;
+	int kick = (k > 0 && net_rx_stalled);
+	pthread_mutex_unlock(& net_lock);
+
+	if(kick) interrupt_pic_thread();
+	return k;
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <ucontext.h>
+#include "tinyos_config.h"
 
 /**
 	@file bios.h
@@ -61,6 +62,13 @@
 	it with some time interval. When the timer expires, the ALARM interrupt is raised 
 	for the core.
 
+	The timer of a core multiplexes @c CORE_TIMERS _soft timers_, each set to 
+	expire at some time of @c bios_clock() by @c bios_set_core_timer(). The 
+	ALARM interrupt may come before any soft timer expires, and its handler 
+	finds the expired ones by @c bios_core_timers_expired(). Setting soft timers
+	is cheap: the host timer is only re-armed when the earliest expiration moves
+	earlier, or by @c bios_core_timers_expired().
+
 	Serial ports
 	------------- 
 
@@ -98,6 +106,46 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Each serial interrupt is sent to the core assigned to it by 
+	@c bios_serial_interrupt_core(). The core also records the serial ports
+	that raised it, and the handler finds them by @c bios_serial_interrupts().
+
+	Block devices
+	-------------
+
+	The virtual machine has a number of disks, each backed by a host file,
+	which must exist. A disk is an array of blocks of @c BIOS_BLOCK_SIZE
+	bytes; a host file whose size is not a multiple of it has a partial 
+	last block, which is ignored.
+
+	A core transfers blocks by submitting a @c block_request and going on
+	with its work. The PIC daemon performs the requests in the order they
+	were submitted, with one host I/O call each, and raises @c BLOCK_DONE 
+	on the core that submitted a request when it completes. The handler 
+	takes the completed requests by @c bios_block_completions().
+
+	Network
+	-------
+
+	Virtual machines in different host processes, or on different hosts, 
+	can form a network of up to @c MAX_NET_NODES nodes. Each node is given 
+	a host TCP address, on which it listens, and the nodes are connected 
+	pairwise by TCP, as they send to each other.
+
+	The network device moves frames of up to @c BIOS_NET_MTU bytes, through
+	two rings of @c BIOS_NET_RING frames. The cores put frames on the 
+	transmit ring by @c bios_net_send(), and take the received ones from the
+	receive ring by @c bios_net_receive(), many at a time. The PIC daemon 
+	moves frames between the rings and the host. Frames between two nodes 
+	arrive in the order they were sent, and they are not lost, unless the
+	destination cannot be reached, in which case they are dropped.
+
+	The interrupts are coalesced. @c NET_RX_READY is raised once for frames
+	that arrive at an empty receive ring, and not again until the ring is 
+	found empty by @c bios_net_receive(). @c NET_TX_READY is raised when 
+	half of the transmit ring is free, after a send found it full. Both
+	interrupts go to core 0.
+
  */
 
 
@@ -114,6 +162,12 @@ typedef unsigned int uint;
 /** @brief A type for time intervals measured in microseconds */
 typedef uint64_t TimerDuration;
 
+/** @brief The number of soft timers of each core */
+#define CORE_TIMERS 4
+
+/** @brief The expiration time of a soft timer that is not set */
+#define CORE_TIMER_OFF ((TimerDuration)-1)
+
 /** @brief The interrupts supported by the CPU */
 typedef enum Interrupt
 {
@@ -123,17 +177,24 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	BLOCK_DONE,			/**< Raised when block requests submitted by the
+						   core have completed */
+	NET_RX_READY,		/**< Raised when frames arrive at the network device */
+	NET_TX_READY,		/**< Raised when the network device can take frames */
 
 	maximum_interrupt_no 
 } Interrupt;
 
 
-/** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
-
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief Maximum number of block devices (disks) for a virtual machine. */
+#define MAX_BLOCK_DEVICES 4
+
+/** @brief Maximum number of nodes of a network. */
+#define MAX_NET_NODES 16
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -161,6 +222,45 @@ typedef enum Interrupt
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/** @brief The environment variable listing the host CPUs of the cores */
+#define BIOS_CPUS_ENV "TINYOS_CPUS"
+
+/** @brief The environment variable naming the host CPU of the PIC thread */
+#define BIOS_PIC_CPU_ENV "TINYOS_PIC_CPU"
+
+/**
+	@brief Pin the threads of the simulated machine to host CPUs.
+
+	By default, the host schedules the core threads and the PIC thread 
+	freely. This function, called before @c vm_boot, pins them instead.
+
+	The core threads are pinned in order to the CPUs of the list @c cpus,
+	given as, e.g., @c "0-3,8,10", wrapping around if there are more cores
+	than CPUs. The list @c "auto" stands for all the CPUs the process may
+	run on, except @c pic_cpu if there are others. A NULL @c cpus leaves 
+	the cores unpinned. The PIC thread is pinned to @c pic_cpu, unless it
+	is -1.
+
+	Each core thread starts on its CPU, so the memory it touches first
+	(its stack, and the kernel data it initializes or allocates) is placed
+	on the local NUMA node, under the default memory policy of Linux.
+
+	If this function is not called, the settings are taken from the
+	environment variables @c TINYOS_CPUS and @c TINYOS_PIC_CPU, if set.
+	
+	@param cpus the list of CPUs of the cores, @c "auto", or NULL
+	@param pic_cpu the CPU of the PIC thread, or -1
+	@returns 0 on success, or -1 if a CPU is not available to the process
+		or the list is malformed, in which case nothing changes.
+ */
+int vm_config_affinity(const char* cpus, int pic_cpu);
+
+/**
+	@brief Return the host CPU a core is pinned to, or -1 if it is not pinned.
+ */
+int bios_core_cpu(uint core);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -171,6 +271,45 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Return the interrupts delivered to a core since the machine booted.
+
+	The count of a core is only updated by the core, so it may lag a little
+	when read by another core.
+ */
+unsigned long cpu_core_interrupts(uint core);
+
+
+/**
+	@brief Pause the CPU briefly, inside a spin loop.
+
+	This is a hint to the processor that the code is in a busy-wait loop,
+	it is a no-op on architectures without such a hint.
+*/
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__ ("yield" ::: "memory");
+#else
+	__asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+
+/**
+	@brief Pause the CPU inside a spin loop that may last long.
+
+	The simulated cores may outnumber the CPUs of the host. Then, a core
+	spinning on a lock held by a core that the host has descheduled would
+	spin for a whole host timeslice. This function calls @c cpu_relax(),
+	but every few rounds it lets the host run some other thread.
+
+	@param round the number of rounds spun so far
+*/
+void cpu_spin(unsigned long round);
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -187,7 +326,9 @@ void cpu_core_barrier_sync();
 /**
 	@brief Raise an ICI interrupt to the given core. 
 
-	This is a simple way that one core may interrupt another.
+	This is a simple way that one core may interrupt another. If the core
+	is halted, it is restarted. Only the given core is touched, so this is
+	the way to wake up a particular core.
  */
 void cpu_ici(uint core);
 
@@ -229,6 +370,15 @@ void cpu_disable_interrupts();
 void cpu_enable_interrupts();
 
 
+/**
+	@brief Return 1 if interrupts are disabled for this core, else 0.
+
+	Interrupts are disabled by @c cpu_disable_interrupts, and while an 
+	interrupt handler executes, unless it enables them.
+*/
+int cpu_interrupts_disabled();
+
+
 /**
 	@brief Halt the core until an interrupt arrives. 
 
@@ -244,7 +394,9 @@ void cpu_core_halt();
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. Else, the 
+	next call to @c cpu_core_halt() by the core returns at once, so a core 
+	that was about to halt does not miss the restart.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -253,6 +405,10 @@ void cpu_core_restart(uint c);
 	@brief Restart some halted core.
 
 	This call will restart some halted core, if at least one exists.
+	Else, the next call to @c cpu_core_halt() (by any core) returns
+	at once, so that a core that was about to halt does not miss it.
+	The cores are visited in turn, so prefer @c cpu_ici() when the 
+	core to wake up is known.
 */
 void cpu_core_restart_one();
 
@@ -260,14 +416,36 @@ void cpu_core_restart_one();
 	@brief Signal all halted cores to restart.
 
 	When this function is called, all halted cores will be restarted. 
+	A core that is not halted returns at once from its next call to
+	@c cpu_core_halt().
 */
 void cpu_core_restart_all();
 
 
+/*
+	When CPU_FAST_CONTEXT is defined, on x86-64 and aarch64, contexts are switched
+	by a few lines of assembly that save only the callee-saved registers and the
+	stack pointer. Otherwise (and always in builds with valgrind support), the
+	ucontext routines are used.
+ */
+#if defined(CPU_FAST_CONTEXT) && defined(NVALGRIND) && (defined(__x86_64__) || defined(__aarch64__))
+#define CPU_CONTEXT_ASM 1
+#endif
+
+#ifdef CPU_CONTEXT_ASM
+/**
+	@brief A type for saving CPU context into.
+
+	The callee-saved registers are pushed on the thread's stack, only
+	the stack pointer is kept here.
+*/
+typedef struct { void* sp; } cpu_context_t;
+#else
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -298,9 +476,35 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 /********************************************************************************
  ********************************************************************************/
 
+/**
+	@brief Set a soft timer of the current core.
+
+	The timer expires at time @c when of @c bios_clock(), or never if @c when
+	is @c CORE_TIMER_OFF. A time in the past expires at once. This must be 
+	called with interrupts disabled.
+
+	@param timer the soft timer, less than @c CORE_TIMERS
+	@param when the expiration time
+	@returns the previous expiration time of the timer
+	@see bios_core_timers_expired
+ */
+TimerDuration bios_set_core_timer(uint timer, TimerDuration when);
+
+/**
+	@brief Take the expired soft timers of the current core.
+
+	The ALARM handler calls this. The expired timers are stopped, and the 
+	core's timer is re-armed for the earliest one left.
+
+	@returns a bit mask, where bit @c i is set if soft timer @c i has expired
+ */
+uint bios_core_timers_expired();
+
 /** 
 	@brief Reset the core timer to the specified interval.
 
+	This is soft timer 0, see @c bios_set_core_timer().
+
 	The interval for the timer is given in microseconds, but the 
 	accuracy of the alarm is much coarser, to the order of 10 msec
 	(that is, 10,000 microseconds). After the interval expires, the
@@ -332,13 +536,10 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
-
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	This function returns the value of a monotonic clock, in usec,
+	counted from some arbitrary point in the past. The clock has
+	microsecond resolution, and is not affected by changes to the
+	time of day.
  */
 TimerDuration bios_clock();
 
@@ -353,6 +554,26 @@ TimerDuration bios_clock();
  */
 uint bios_serial_ports();
 
+
+/** @brief The environment variable naming the directory of the terminal fifos */
+#define BIOS_FIFO_DIR_ENV "TINYOS_FIFO_DIR"
+
+/**
+	@brief Return the path of a terminal fifo.
+
+	Serial port @c no is connected to the fifos named @c con<no> (the
+	screen) and @c kbd<no> (the keyboard). They are looked up in the 
+	current directory, or in the directory named by the environment
+	variable @c TINYOS_FIFO_DIR, if it is set.
+
+	@param buf the buffer to hold the path
+	@param size the size of @c buf
+	@param name the fifo name, "con" or "kbd"
+	@param no the serial port
+	@returns @c buf
+ */
+char* bios_fifo_path(char* buf, size_t size, const char* name, uint no);
+
 /**
 	@brief Assign a core to interrupts from a specific serial device.
 
@@ -364,11 +585,29 @@ uint bios_serial_ports();
 	         @c 0 and less than @c bios_serial_ports().
 	@param intno the interrupt to assign (one of @c SERIAL_RX_READY and 
 			@c SERIAL_TX_READY)
-	@param core th 
+	@param core the core that receives the interrupts, less than @c cpu_cores().
  */
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Find the serial ports that raised an interrupt.
+
+	Return the set of serial ports that raised interrupt @c intno on the
+	current core, since the previous call for @c intno on this core. Bit 
+	@c i of the returned value is set for serial port @c i. The set is
+	cleared by the call.
+
+	A port that raises the interrupt again after the call is guaranteed
+	to raise it anew, so a handler that calls this function once per 
+	invocation does not miss any ports.
+
+	@param intno one of @c SERIAL_RX_READY and @c SERIAL_TX_READY
+	@returns the bitmask of the ready serial ports
+ */
+uint bios_serial_interrupts(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -403,4 +642,194 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read many bytes from a serial port.
+
+	This is like @c bios_read_serial(), but it transfers up to @c size
+	bytes at once, with a single access to the device. 
+	If this operation returns less than @c size, there is no more data
+	to receive, and a @c SERIAL_RX_READY interrupt will be raised when 
+	there is.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the read bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read, possibly 0
+ */
+uint bios_read_serial_bytes(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write many bytes to a serial port.
+
+	This is like @c bios_write_serial(), but it transfers up to @c size
+	bytes at once, with a single access to the device. 
+	If this operation returns less than @c size, the device cannot accept
+	more data, and a @c SERIAL_TX_READY interrupt will be raised when it can.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send
+	@param size the number of bytes to send
+	@return the number of bytes written, possibly 0
+ */
+uint bios_write_serial_bytes(uint serial, const char* buf, uint size);
+
+
+/** @brief The size of a disk block, in bytes. */
+#define BIOS_BLOCK_SIZE 4096
+
+/** @brief The most blocks transferred by one block request. */
+#define BIOS_MAX_REQUEST_BLOCKS 32
+
+/** @brief The environment variable listing the host files of the disks */
+#define BIOS_DISKS_ENV "TINYOS_DISKS"
+
+/**
+	@brief Connect the disks of the following boots to host files.
+
+	The disks are numbered in the order of the comma-separated list of
+	paths @c paths, e.g., @c "disk0.img,disk1.img". A NULL (or empty) list 
+	means no disks. The files are opened at boot, for reading and writing.
+
+	If this function is not called, the list is taken from the environment 
+	variable @c TINYOS_DISKS, if set.
+
+	@param paths the list of host files, or NULL
+	@returns 0 on success, or -1 if there are more than @c MAX_BLOCK_DEVICES
+		files, or some file cannot be read and written, in which case 
+		nothing changes.
+ */
+int vm_config_disks(const char* paths);
+
+/** @brief Return the number of disks of the machine. */
+uint bios_block_devices();
+
+/** @brief Return the number of blocks of a disk. */
+uint64_t bios_block_count(uint disk);
+
+
+/**
+	@brief A request to transfer contiguous blocks of a disk.
+
+	The blocks are transferred to (or from) a separate buffer of 
+	@c BIOS_BLOCK_SIZE bytes each, so that a request may gather the
+	buffers of a block cache. The submitter fills in all the fields
+	except @c status and @c core, and must not touch the request 
+	until it completes.
+ */
+typedef struct block_request {
+	uint disk;              /**< The disk */
+	int write;              /**< Non-zero to write the blocks, zero to read them */
+	uint64_t block;         /**< The first block */
+	uint count;             /**< The number of blocks, at most @c BIOS_MAX_REQUEST_BLOCKS */
+	void* buf[BIOS_MAX_REQUEST_BLOCKS];  /**< The buffer of each block */
+
+	int status;             /**< Set on completion: 0 on success, or -1 on a host I/O error */
+	uint core;              /**< The core that submitted the request */
+	struct block_request* next;  /**< Free for the submitter, until the request is submitted
+	                                  and after it completes */
+} block_request;
+
+
+/**
+	@brief Submit a block request.
+
+	The request is performed asynchronously. When it completes, a 
+	@c BLOCK_DONE interrupt is raised on the current core.
+
+	@param rq the request
+	@returns 0 if the request was submitted, or -1 if it is malformed, 
+		i.e., the disk does not exist or the blocks are not all on it.
+ */
+int bios_block_submit(block_request* rq);
+
+
+/**
+	@brief Take the requests of the current core that have completed.
+
+	Return the requests submitted by the current core, that completed since
+	the previous call, linked through their @c next field, or NULL. A 
+	request that completes after the call raises @c BLOCK_DONE anew.
+ */
+block_request* bios_block_completions();
+
+
+/** @brief The most data bytes of a network frame. */
+#define BIOS_NET_MTU 4096
+
+/** @brief The number of frames of each ring of the network device. */
+#define BIOS_NET_RING 64
+
+/** @brief The environment variable listing the host addresses of the nodes */
+#define BIOS_NET_ENV "TINYOS_NET"
+
+/** @brief The environment variable giving the node of the machine */
+#define BIOS_NODE_ENV "TINYOS_NODE"
+
+/**
+	@brief Connect the following boots to a network.
+
+	The nodes are numbered in the order of the comma-separated list of 
+	host TCP addresses @c addrs, e.g., @c "10.0.0.1:7000,10.0.0.2:7000".
+	The machine is node @c node, and it listens on its own address. A NULL
+	(or empty) list, or a negative @c node, means no network.
+
+	If this function is not called, the settings are taken from the 
+	environment variables @c TINYOS_NET and @c TINYOS_NODE, if set.
+
+	@param node the node of this machine
+	@param addrs the list of addresses, or NULL
+	@returns 0 on success, or -1 if there are more than @c MAX_NET_NODES
+		addresses, some address cannot be resolved, or @c node is not on
+		the list, in which case nothing changes.
+ */
+int vm_config_network(int node, const char* addrs);
+
+/** @brief Return the node of the machine, or -1 if it is not on a network. */
+int bios_net_node();
+
+/** @brief Return the number of nodes of the network, 0 if there is none. */
+uint bios_net_nodes();
+
+
+/**
+	@brief A frame of the network device.
+ */
+typedef struct net_frame {
+	uint node;                  /**< The destination when sent, the source when received */
+	uint size;                  /**< The bytes of @c data, at most @c BIOS_NET_MTU */
+	char data[BIOS_NET_MTU];    /**< The data */
+} net_frame;
+
+
+/**
+	@brief Send frames.
+
+	Copy up to @c n frames to the transmit ring. A frame may be sent to
+	any node, including this one; frames to other nodes, or larger than
+	@c BIOS_NET_MTU, are taken and dropped. If this operation returns less than 
+	@c n, the ring is full, and a @c NET_TX_READY interrupt will be raised
+	when it has room. This must be called with interrupts disabled.
+
+	@param frames the frames
+	@param n the number of frames
+	@returns the number of frames taken, possibly 0
+ */
+uint bios_net_send(const net_frame* frames, uint n);
+
+/**
+	@brief Receive frames.
+
+	Take up to @c n frames from the receive ring. If this operation returns
+	less than @c n, the ring is empty, and a @c NET_RX_READY interrupt will
+	be raised when frames arrive. This must be called with interrupts 
+	disabled.
+
+	@param frames the location to store the frames
+	@param n the most frames to take
+	@returns the number of frames taken, possibly 0
+ */
+uint bios_net_receive(net_frame* frames, uint n);
+
+
 #endif
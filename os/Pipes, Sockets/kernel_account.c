@@ -0,0 +1,63 @@
+#include <assert.h>
+
+#include "kernel_account.h"
+#include "kernel_pool.h"
+
+
+static object_pool account_pool = OBJECT_POOL_INIT(mem_account, 16);
+
+
+mem_account* account_create()
+{
+	mem_account* acct = pool_alloc(& account_pool);
+	for(int k=0; k<MEM_KINDS; k++)
+		acct->bytes[k] = acct->limit[k] = 0;
+	acct->refs = 1;
+	return acct;
+}
+
+
+void account_hold(mem_account* acct)
+{
+	__atomic_add_fetch(& acct->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void account_put(mem_account* acct)
+{
+	if(__atomic_sub_fetch(& acct->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* Everything charged was held by a reference */
+		assert(acct->bytes[MEM_KERNEL] == 0 && acct->bytes[MEM_STACK] == 0);
+		pool_free(& account_pool, acct);
+	}
+}
+
+
+int mem_charge(mem_account* acct, mem_kind kind, size_t bytes)
+{
+	unsigned long limit = __atomic_load_n(& acct->limit[kind], __ATOMIC_RELAXED);
+	if(limit == 0) {
+		mem_force_charge(acct, kind, bytes);
+		return 0;
+	}
+
+	unsigned long cur = __atomic_load_n(& acct->bytes[kind], __ATOMIC_RELAXED);
+	do {
+		if(cur + bytes > limit)
+			return -1;
+	} while(! __atomic_compare_exchange_n(& acct->bytes[kind], & cur, cur + bytes,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+
+void mem_force_charge(mem_account* acct, mem_kind kind, size_t bytes)
+{
+	__atomic_add_fetch(& acct->bytes[kind], bytes, __ATOMIC_RELAXED);
+}
+
+
+void mem_uncharge(mem_account* acct, mem_kind kind, size_t bytes)
+{
+	__atomic_sub_fetch(& acct->bytes[kind], bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,84 @@
+#ifndef __KERNEL_ACCOUNT_H
+#define __KERNEL_ACCOUNT_H
+
+#include "util.h"
+#include "tinyos.h"
+
+/**
+	@file kernel_account.h
+	@brief Memory accounting of processes.
+
+	@defgroup account Memory accounting
+	@ingroup kernel
+	@brief Memory accounting of processes.
+
+	Each process has a @c mem_account, where the kernel memory that the
+	process makes the kernel allocate is charged: the TCBs and stacks of
+	its threads, its arena (which holds its PTCBs), the copy of its
+	arguments, and the pipes and sockets it creates. The bytes are counted
+	by kind, and each kind may have a limit, which is set by @c SetLimit.
+
+	A thread, pipe or socket may outlive the process that created it (a
+	TCB is released after its thread is switched out, and a pipe after
+	its last stream is closed), so it keeps a reference to the account,
+	and gives back its bytes to it when released. The process holds a
+	reference too, until it is reaped. An account is released with its
+	last reference.
+
+	The counts are updated atomically, so that any thread may charge an
+	account without locks.
+
+	@{
+*/
+
+/** @brief The kinds of memory of an account */
+typedef enum mem_kind {
+	MEM_KERNEL,     /**< Kernel objects: TCBs, PTCBs, args, pipes, sockets */
+	MEM_STACK,      /**< Thread stacks */
+	MEM_KINDS       /**< The number of kinds */
+} mem_kind;
+
+/** @brief The memory account of a process */
+typedef struct mem_account {
+	unsigned long bytes[MEM_KINDS];  /**< The bytes charged, by kind */
+	unsigned long limit[MEM_KINDS];  /**< The most bytes of each kind, or 0 for no limit */
+	unsigned int refs;               /**< The references to the account */
+} mem_account;
+
+/** @brief Make a new account, with no bytes and no limits, and one reference. */
+mem_account* account_create();
+
+/** @brief Add a reference to the account. */
+void account_hold(mem_account* acct);
+
+/** @brief Drop a reference to the account, releasing it with the last one. */
+void account_put(mem_account* acct);
+
+/**
+	@brief Charge bytes to the account, within its limit.
+
+	@returns 0 on success, or -1 if the charge would take the bytes of
+	the kind over its limit, in which case nothing is charged.
+*/
+int mem_charge(mem_account* acct, mem_kind kind, size_t bytes);
+
+/**
+	@brief Charge bytes to the account, regardless of its limit.
+
+	This is for memory that the kernel cannot do without, once the
+	process exists, e.g., the blocks of its arena.
+*/
+void mem_force_charge(mem_account* acct, mem_kind kind, size_t bytes);
+
+/** @brief Give back bytes charged to the account. */
+void mem_uncharge(mem_account* acct, mem_kind kind, size_t bytes);
+
+/** @brief The bytes of a kind currently charged to the account. */
+static inline unsigned long mem_charged(mem_account* acct, mem_kind kind)
+{
+	return __atomic_load_n(& acct->bytes[kind], __ATOMIC_RELAXED);
+}
+
+/** @} */
+
+#endif
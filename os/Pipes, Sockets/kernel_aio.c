@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "kernel_aio.h"
+#include "kernel_proc.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "kernel_sys.h"
+
+
+/* Drop a reference, releasing the ring with the last one. The caller holds the lock, which is released. */
+static void aio_decref(aio_context* ctx)
+{
+	int last = (--ctx->refcount == 0);
+	Mutex_Unlock(& ctx->lock);
+	if(last) free(ctx);
+}
+
+
+/* The ring lives on after the stream is closed, until its workers exit */
+static int aio_close(void* obj)
+{
+	aio_context* ctx = obj;
+	Mutex_Lock(& ctx->lock);
+	ctx->closed = 1;
+	ctx->inflight -= ctx->ptail - ctx->phead;
+	ctx->phead = ctx->ptail;
+	Cond_Broadcast(& ctx->completed);
+	aio_decref(ctx);
+	return 0;
+}
+
+static file_ops aio_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = aio_close
+};
+
+
+/* Perform an operation, as the process that owns the ring */
+static int aio_perform(aio_sqe* sqe)
+{
+	switch(sqe->op) {
+		case AIO_NOP: return 0;
+		case AIO_READ: return sys_Read(sqe->fid, sqe->buf, sqe->len);
+		case AIO_WRITE: return sys_Write(sqe->fid, sqe->buf, sqe->len);
+		case AIO_ACCEPT: return sys_Accept(sqe->fid);
+		case AIO_CONNECT: return sys_Connect(sqe->fid, sqe->port, sqe->timeout);
+		default: return -1;
+	}
+}
+
+
+/* A worker performs the pending operations, and exits when there are none */
+static void aio_worker()
+{
+	aio_context* ctx = CURTHREAD->thread_arg;
+	unsigned int pmask = 2*ctx->ring.entries - 1;
+
+	Mutex_Lock(& ctx->lock);
+	while(ctx->phead != ctx->ptail) {
+		aio_sqe sqe = ctx->pending[ctx->phead++ & pmask];
+		Mutex_Unlock(& ctx->lock);
+		int result = aio_perform(& sqe);
+		Mutex_Lock(& ctx->lock);
+
+		if(! ctx->closed) {
+			aio_ring* ring = & ctx->ring;
+			unsigned int tail = ring->cq_tail;
+			ring->cq[tail & (2*ring->entries - 1)] = (aio_cqe){ sqe.user_data, result };
+			__atomic_store_n(& ring->cq_tail, tail+1, __ATOMIC_RELEASE);
+			ctx->inflight--;
+			Cond_Broadcast(& ctx->completed);
+		}
+	}
+	ctx->workers--;
+	aio_decref(ctx);
+
+	kernel_lock();
+	process_thread_exit();
+	kernel_sleep(EXITED, SCHED_USER);
+}
+
+
+Fid_t sys_AioSetup(unsigned int entries, aio_ring** ring)
+{
+	if(entries == 0 || entries > AIO_MAX_ENTRIES || ring == NULL)
+		return NOFILE;
+
+	unsigned int size = 1;
+	while(size < entries) size *= 2;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	/* One block holds the context, the queues of the ring and the pending queue.
+	   Up to 2*size operations are in flight, and all may be pending. */
+	aio_context* ctx = xmalloc(sizeof(aio_context)
+		+ size*sizeof(aio_sqe) + 2*size*sizeof(aio_cqe) + 2*size*sizeof(aio_sqe));
+	ctx->lock = MUTEX_INIT;
+	ctx->completed = COND_INIT;
+	ctx->refcount = 1;
+	ctx->closed = 0;
+	ctx->owner = CURPROC;
+	ctx->phead = ctx->ptail = 0;
+	ctx->inflight = 0;
+	ctx->workers = 0;
+
+	aio_ring* r = & ctx->ring;
+	r->entries = size;
+	r->sq_head = r->sq_tail = 0;
+	r->cq_head = r->cq_tail = 0;
+	r->sq = (aio_sqe*) (ctx + 1);
+	r->cq = (aio_cqe*) (r->sq + size);
+	ctx->pending = (aio_sqe*) (r->cq + 2*size);
+
+	fcb->streamobj = ctx;
+	fcb->streamfunc = & aio_ops;
+	*ring = r;
+	return fid;
+}
+
+
+int sys_AioEnter(Fid_t fid, unsigned int to_submit, unsigned int min_complete, timeout_t timeout)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL) return -1;
+	if(fcb->streamfunc != & aio_ops || ((aio_context*) fcb->streamobj)->owner != CURPROC) {
+		FCB_decref(fcb);
+		return -1;
+	}
+
+	aio_context* ctx = fcb->streamobj;
+	aio_ring* ring = & ctx->ring;
+	unsigned int mask = ring->entries - 1;
+	unsigned int pmask = 2*ring->entries - 1;
+
+	Mutex_Lock(& ctx->lock);
+
+	/* Take the submissions that the completion queue has room for */
+	unsigned int head = ring->sq_head;
+	unsigned int avail = __atomic_load_n(& ring->sq_tail, __ATOMIC_ACQUIRE) - head;
+	unsigned int cq_used = ring->cq_tail - __atomic_load_n(& ring->cq_head, __ATOMIC_ACQUIRE);
+	unsigned int room = 2*ring->entries - cq_used - ctx->inflight;
+	unsigned int n = to_submit;
+	if(n > avail) n = avail;
+	if(n > room) n = room;
+
+	for(unsigned int i=0; i<n; i++)
+		ctx->pending[ctx->ptail++ & pmask] = ring->sq[(head + i) & mask];
+	__atomic_store_n(& ring->sq_head, head + n, __ATOMIC_RELEASE);
+	ctx->inflight += n;
+
+	/* One worker for each operation in flight, within the limit */
+	unsigned int want = (ctx->inflight < AIO_MAX_WORKERS) ? ctx->inflight : AIO_MAX_WORKERS;
+	unsigned int spawn = (want > ctx->workers) ? want - ctx->workers : 0;
+	ctx->workers += spawn;
+	ctx->refcount += spawn;
+	Mutex_Unlock(& ctx->lock);
+
+	if(spawn > 0) {
+		kernel_lock();
+		for(unsigned int i=0; i<spawn; i++) {
+			CURPROC->thread_count++;
+			TCB* tcb = spawn_thread(CURPROC, aio_worker);
+			tcb->owner_ptcb = NULL;
+			tcb->thread_arg = ctx;
+			wakeup(tcb);
+		}
+		kernel_unlock();
+	}
+
+	/* Wait for the completions */
+	TimerDuration deadline = (timeout == AIO_INFINITE) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+	Mutex_Lock(& ctx->lock);
+	while(ring->cq_tail - __atomic_load_n(& ring->cq_head, __ATOMIC_ACQUIRE) < min_complete
+			&& ctx->inflight > 0 && !ctx->closed) {
+		TimerDuration t = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) break;
+			t = deadline - now;
+		}
+		kernel_mxtimedwait(& ctx->lock, & ctx->completed, SCHED_IO, t);
+	}
+	Mutex_Unlock(& ctx->lock);
+
+	FCB_decref(fcb);
+	return n;
+}
@@ -0,0 +1,56 @@
+#ifndef __KERNEL_AIO_H
+#define __KERNEL_AIO_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_streams.h"
+
+/**
+	@file kernel_aio.h
+	@brief Asynchronous I/O rings.
+
+	@defgroup aio Asynchronous I/O
+	@ingroup kernel
+	@brief Asynchronous I/O rings.
+
+	A ring is held by a stream, created by @c AioSetup(). @c AioEnter()
+	copies the submissions of the ring into the @c pending queue of the
+	kernel, so that the process may reuse their entries at once, and starts
+	workers to perform them.
+
+	A worker is a thread of the process that owns the ring, without a PTCB,
+	which runs the operations of @c pending, one at a time, by the system
+	calls of the process (e.g., @c sys_Read), and posts their completions.
+	When @c pending is empty, it exits. So, a ring keeps one worker for each
+	operation in flight, up to @c AIO_MAX_WORKERS, and none when it is idle,
+	and the process exits as soon as the operations of its rings complete.
+
+	The completions never overflow the completion queue, since @c AioEnter
+	does not take more submissions than it can hold, counting those in flight.
+
+	The ring is released when its stream is closed and its last worker exits.
+
+	@{
+*/
+
+/** @brief The kernel side of a ring */
+typedef struct aio_context
+{
+	Mutex lock;                 /**< @brief Protects the fields below, and the completion queue */
+	CondVar completed;          /**< @brief Broadcast when a completion is posted */
+
+	unsigned int refcount;      /**< @brief The stream and the workers */
+	int closed;                 /**< @brief Set when the stream is closed */
+	PCB* owner;                 /**< @brief The process of the workers */
+
+	aio_sqe* pending;           /**< @brief The operations not started, room for <tt>2*entries</tt> of them */
+	unsigned int phead, ptail;  /**< @brief The indices of @c pending, modulo <tt>2*entries</tt> */
+	unsigned int inflight;      /**< @brief The operations submitted and not completed */
+	unsigned int workers;       /**< @brief The workers of the ring */
+
+	aio_ring ring;              /**< @brief The ring of the process, followed by its queues */
+} aio_context;
+
+/** @} */
+
+#endif
@@ -0,0 +1,86 @@
+#include <assert.h>
+
+#include "kernel_arena.h"
+#include "kernel_cc.h"
+
+
+/* The header of a chunk keeps the objects aligned to ARENA_GRAIN */
+#define ARENA_HEADER ARENA_GRAIN
+
+_Static_assert(ARENA_GRAIN >= sizeof(void*), "the objects of an arena cannot hold a link");
+_Static_assert(ARENA_MAX_OBJECT <= ARENA_CHUNK - ARENA_HEADER, "the chunks of an arena are too small");
+
+
+static inline unsigned int arena_class(size_t size)
+{
+	assert(size > 0 && size <= ARENA_MAX_OBJECT);
+	return (size - 1) / ARENA_GRAIN;
+}
+
+
+void arena_init(kernel_arena* arena)
+{
+	arena->lock = MUTEX_INIT;
+	arena->chunks = NULL;
+	arena->next = arena->end = NULL;
+	for(unsigned int c=0; c<ARENA_CLASSES; c++)
+		arena->free[c] = NULL;
+	arena->bytes = 0;
+	arena->account = NULL;
+}
+
+
+void* arena_alloc(kernel_arena* arena, size_t size)
+{
+	unsigned int c = arena_class(size);
+	size_t rsize = (c+1) * ARENA_GRAIN;
+	void* obj;
+
+	Mutex_Lock(& arena->lock);
+	if(arena->free[c] != NULL) {
+		obj = arena->free[c];
+		arena->free[c] = *(void**) obj;
+	} else {
+		if((size_t)(arena->end - arena->next) < rsize) {
+			/* The rest of the newest chunk is abandoned */
+			char* chunk = xmalloc(ARENA_CHUNK);
+			*(void**) chunk = arena->chunks;
+			arena->chunks = chunk;
+			arena->next = chunk + ARENA_HEADER;
+			arena->end = chunk + ARENA_CHUNK;
+			arena->bytes += ARENA_CHUNK;
+			if(arena->account != NULL)
+				mem_force_charge(arena->account, MEM_KERNEL, ARENA_CHUNK);
+		}
+		obj = arena->next;
+		arena->next += rsize;
+	}
+	Mutex_Unlock(& arena->lock);
+	return obj;
+}
+
+
+void arena_free(kernel_arena* arena, void* obj, size_t size)
+{
+	unsigned int c = arena_class(size);
+	Mutex_Lock(& arena->lock);
+	*(void**) obj = arena->free[c];
+	arena->free[c] = obj;
+	Mutex_Unlock(& arena->lock);
+}
+
+
+void arena_release(kernel_arena* arena)
+{
+	Mutex_Lock(& arena->lock);
+	void* chunk = arena->chunks;
+	while(chunk != NULL) {
+		void* next = *(void**) chunk;
+		free(chunk);
+		chunk = next;
+	}
+	if(arena->account != NULL)
+		mem_uncharge(arena->account, MEM_KERNEL, arena->bytes);
+	Mutex_Unlock(& arena->lock);
+	arena_init(arena);
+}
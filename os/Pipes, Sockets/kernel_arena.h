@@ -0,0 +1,76 @@
+#ifndef __KERNEL_ARENA_H
+#define __KERNEL_ARENA_H
+
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_account.h"
+
+/**
+	@file kernel_arena.h
+	@brief Arenas of kernel objects that live no longer than a process.
+
+	@defgroup arena Process arenas
+	@ingroup kernel
+	@brief Arenas of kernel objects that live no longer than a process.
+
+	Small kernel objects that belong to a single process (e.g., its PTCBs
+	and shared memory attachments) are carved from chunks of 
+	@c ARENA_CHUNK bytes, owned by the process. A released object is kept
+	in a free list of its size class, linked through its first word, and 
+	is reused by the next object of the class. When the process exits,
+	all the chunks are returned to the system at once, together with any
+	object that was never released.
+
+	Objects shared among processes (pipes, sockets, streams) outlive their
+	creator, and are kept in the per-core @ref pool instead.
+
+	An arena has its own spinlock, since its objects are created under
+	different locks.
+
+	The chunks are charged to the account of the arena, if it has one,
+	as kernel memory of the process.
+
+	@{
+*/
+
+/** @brief The size of the chunks of an arena */
+#define ARENA_CHUNK 4096
+
+/** @brief The sizes of objects are rounded up to this */
+#define ARENA_GRAIN 16
+
+/** @brief The size classes of an arena */
+#define ARENA_CLASSES 16
+
+/** @brief The largest object of an arena */
+#define ARENA_MAX_OBJECT (ARENA_GRAIN * ARENA_CLASSES)
+
+/** @brief An arena */
+typedef struct kernel_arena {
+	Mutex lock;                    /**< Protects the arena */
+	void* chunks;                  /**< The chunks, linked through their first word */
+	char* next;                    /**< The unused space of the newest chunk */
+	char* end;                     /**< The end of the newest chunk */
+	void* free[ARENA_CLASSES];     /**< The released objects of each class */
+	size_t bytes;                  /**< The total size of the chunks */
+	mem_account* account;          /**< The account charged for the chunks, or NULL */
+} kernel_arena;
+
+/** @brief Initialize an empty arena, without an account. */
+void arena_init(kernel_arena* arena);
+
+/** 
+	@brief Allocate an object from the arena. 
+	@pre @c size <= ARENA_MAX_OBJECT
+*/
+void* arena_alloc(kernel_arena* arena, size_t size);
+
+/** @brief Return an object of the given size to the arena. */
+void arena_free(kernel_arena* arena, void* obj, size_t size);
+
+/** @brief Release all the chunks of the arena, making it as new, without an account. */
+void arena_release(kernel_arena* arena);
+
+/** @} */
+
+#endif
@@ -0,0 +1,489 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_bcache.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+
+/* The state of a buffer */
+enum {
+	BUF_VALID   = 1,    /* The data holds the block */
+	BUF_DIRTY   = 2,    /* The data must be written to the disk */
+	BUF_READING = 4,    /* A read of the block is in progress */
+	BUF_WRITING = 8     /* A write of the block is in progress */
+};
+
+/* A buffer. Everything is protected by bcache_lock, except the data of a pinned buffer. */
+typedef struct bcache_buf {
+	uintptr_t key;      /* The key of the block in bcache_map, 0 if the buffer is not mapped */
+	uint disk;
+	uint64_t block;
+	int flags;
+	uint refs;          /* The streams copying from or to the buffer, which pin it */
+	int used;           /* Used since the clock hand last passed */
+} bcache_buf;
+
+static bcache_buf bcache_bufs[BCACHE_BUFFERS];
+
+/* The data of buffer i, kept apart so that a block request can point into it */
+static char bcache_data[BCACHE_BUFFERS][BIOS_BLOCK_SIZE] __attribute__((aligned(BIOS_BLOCK_SIZE)));
+
+/* The map from blocks to buffers, at most half full */
+static rhash bcache_map;
+static rhash_slot bcache_slots[2*BCACHE_BUFFERS];
+
+static Mutex bcache_lock = MUTEX_INIT;
+static CondVar bcache_io = COND_INIT;   /* Broadcast when I/O completes, or a buffer is unpinned */
+
+static uint bcache_hand;                /* The clock hand */
+static uint bcache_dirty;               /* The dirty buffers */
+
+/* The read-ahead state of a disk */
+typedef struct readahead {
+	uint64_t next;      /* The block that a sequential read would read next */
+	uint64_t ahead;     /* The first block not read ahead yet */
+	uint window;        /* The blocks to read ahead at a time, 0 after a random read */
+} readahead;
+
+static readahead bcache_ra[MAX_BLOCK_DEVICES];
+static int bcache_write_error[MAX_BLOCK_DEVICES];     /* A write failed since the last sync */
+static block_stats bcache_stats;
+
+
+/* The key of a block. There are at most 4 disks. */
+static inline uintptr_t bcache_key(uint disk, uint64_t block)
+{
+	return ((uintptr_t) block << 2 | disk) + 1;
+}
+
+static inline uint buf_index(bcache_buf* b)
+{
+	return b - bcache_bufs;
+}
+
+
+void initialize_bcache()
+{
+	rhash_init(&bcache_map, bcache_slots, 2*BCACHE_BUFFERS);
+	for(uint i=0; i<BCACHE_BUFFERS; i++) {
+		bcache_bufs[i].key = 0;
+		bcache_bufs[i].flags = 0;
+		bcache_bufs[i].refs = 0;
+		bcache_bufs[i].used = 0;
+	}
+	for(uint d=0; d<MAX_BLOCK_DEVICES; d++) {
+		bcache_ra[d] = (readahead){ 0, 0, 0 };
+		bcache_write_error[d] = 0;
+	}
+	bcache_hand = 0;
+	bcache_dirty = 0;
+	memset(&bcache_stats, 0, sizeof(bcache_stats));
+	bcache_lock = MUTEX_INIT;
+	bcache_io = COND_INIT;
+}
+
+
+
+/*
+	Block requests are built in a batch, which coalesces each buffer with
+	the previous one, when they are contiguous on the same disk. The batch
+	is submitted with bcache_lock held, so that the completion is handled
+	after the submitter waits for it.
+ */
+
+typedef struct batch {
+	block_request* head;
+	block_request* tail;
+} batch;
+
+static void batch_add(batch* bt, bcache_buf* b, int write)
+{
+	block_request* rq = bt->tail;
+	if(rq == NULL || rq->disk != b->disk || rq->block + rq->count != b->block
+		|| rq->count == BIOS_MAX_REQUEST_BLOCKS) {
+		rq = xmalloc(sizeof(block_request));
+		rq->disk = b->disk;
+		rq->write = write;
+		rq->block = b->block;
+		rq->count = 0;
+		rq->next = NULL;
+		if(bt->tail) bt->tail->next = rq; else bt->head = rq;
+		bt->tail = rq;
+		if(write) bcache_stats.write_requests++; else bcache_stats.read_requests++;
+	}
+	rq->buf[rq->count++] = bcache_data[buf_index(b)];
+	if(write) bcache_stats.blocks_written++; else bcache_stats.blocks_read++;
+}
+
+static void batch_submit(batch* bt)
+{
+	block_request* rq = bt->head;
+	while(rq != NULL) {
+		block_request* next = rq->next;   /* The bios takes over the link */
+		int rc = bios_block_submit(rq);
+		assert(rc == 0);
+		(void) rc;
+		rq = next;
+	}
+	bt->head = bt->tail = NULL;
+}
+
+
+
+/* Unmap a buffer that is neither pinned, nor busy, nor dirty, and was not used lately */
+static bcache_buf* bcache_evict()
+{
+	for(uint n = 0; n < 2*BCACHE_BUFFERS; n++) {
+		bcache_buf* b = & bcache_bufs[bcache_hand];
+		bcache_hand = (bcache_hand + 1) % BCACHE_BUFFERS;
+
+		if(b->refs > 0 || (b->flags & (BUF_DIRTY|BUF_READING|BUF_WRITING))) continue;
+		if(b->used) { b->used = 0; continue; }
+
+		if(b->key) rhash_remove(&bcache_map, b->key);
+		b->key = 0;
+		b->flags = 0;
+		return b;
+	}
+	return NULL;
+}
+
+/* Map a buffer to a block that is not cached, or return NULL if every buffer is in use */
+static bcache_buf* bcache_map_new(uint disk, uint64_t block)
+{
+	bcache_buf* b = bcache_evict();
+	if(b == NULL) return NULL;
+
+	b->disk = disk;
+	b->block = block;
+	b->key = bcache_key(disk, block);
+	rhash_slot* s = rhash_insert(&bcache_map, b->key);
+	assert(s != NULL);
+	s->obj = b;
+	return b;
+}
+
+
+static int writeback_order(const void* x, const void* y)
+{
+	const bcache_buf* a = *(bcache_buf* const*) x;
+	const bcache_buf* b = *(bcache_buf* const*) y;
+	if(a->disk != b->disk) return (a->disk > b->disk) - (a->disk < b->disk);
+	return (a->block > b->block) - (a->block < b->block);
+}
+
+/* Add the writes of the dirty buffers that are not pinned to a batch, in disk order */
+static void bcache_writeback(batch* bt)
+{
+	bcache_buf* w[BCACHE_BUFFERS];
+	uint n = 0;
+	for(uint i=0; i<BCACHE_BUFFERS; i++) {
+		bcache_buf* b = & bcache_bufs[i];
+		if((b->flags & BUF_DIRTY) && b->refs == 0) w[n++] = b;
+	}
+	qsort(w, n, sizeof(w[0]), writeback_order);
+
+	for(uint i=0; i<n; i++) {
+		w[i]->flags = (w[i]->flags & ~BUF_DIRTY) | BUF_WRITING;
+		bcache_dirty--;
+		batch_add(bt, w[i], 1);
+	}
+}
+
+
+/* Add reads of the blocks of [from, from+count) that are not cached to a batch */
+static void bcache_prefetch(batch* bt, uint disk, uint64_t from, uint count)
+{
+	uint64_t end = bios_block_count(disk);
+	for(uint64_t blk = from; blk < from+count && blk < end; blk++) {
+		if(rhash_find(&bcache_map, bcache_key(disk, blk)) != NULL) continue;
+		bcache_buf* b = bcache_map_new(disk, blk);
+		if(b == NULL) break;
+		b->flags = BUF_READING;
+		b->used = 1;        /* Keep it until it is read */
+		bcache_stats.readahead++;
+		batch_add(bt, b, 0);
+	}
+}
+
+/*
+	Note a read of a block, and read ahead when the reads are sequential.
+	The next window is read when half of the current one is consumed.
+ */
+static void bcache_read_ahead(batch* bt, uint disk, uint64_t block)
+{
+	readahead* ra = & bcache_ra[disk];
+	if(block+1 == ra->next) return;     /* The rest of the last block */
+	int sequential = (block == ra->next);
+	ra->next = block+1;
+
+	if(! sequential) {
+		ra->window = 0;
+		ra->ahead = block+1;
+		return;
+	}
+
+	if(ra->ahead < block+1) ra->ahead = block+1;
+	if(ra->window > 0 && ra->ahead - block > ra->window/2) return;
+
+	ra->window = (ra->window == 0) ? 2 : 2*ra->window;
+	if(ra->window > BCACHE_READ_AHEAD) ra->window = BCACHE_READ_AHEAD;
+	bcache_prefetch(bt, disk, ra->ahead, ra->window);
+	ra->ahead += ra->window;
+}
+
+
+/* What the caller of bcache_get will do with the block */
+enum bcache_access {
+	ACCESS_READ,        /* Read from it */
+	ACCESS_UPDATE,      /* Write part of it */
+	ACCESS_OVERWRITE    /* Write all of it, so it need not be read */
+};
+
+/*
+	Return the buffer of a block, pinned, or NULL if the block could not be read.
+	The caller holds bcache_lock, with preemption off.
+ */
+static bcache_buf* bcache_get(uint disk, uint64_t block, enum bcache_access access)
+{
+	batch bt = { NULL, NULL };
+	bcache_buf* b;
+
+	for(;;) {
+		rhash_slot* s = rhash_find(&bcache_map, bcache_key(disk, block));
+		if(s != NULL) {
+			b = s->obj;
+			bcache_stats.hits++;
+			break;
+		}
+
+		b = bcache_map_new(disk, block);
+		if(b != NULL) {
+			bcache_stats.misses++;
+			if(access == ACCESS_OVERWRITE)
+				b->flags = BUF_VALID;
+			else {
+				b->flags = BUF_READING;
+				batch_add(&bt, b, 0);
+			}
+			break;
+		}
+
+		/* Every buffer is in use. Clean the dirty ones, or wait for some to be unpinned. */
+		bcache_writeback(&bt);
+		batch_submit(&bt);
+		kernel_mxwait(&bcache_lock, &bcache_io, SCHED_IO);
+	}
+
+	b->refs++;
+	b->used = 1;
+	if(access == ACCESS_READ) bcache_read_ahead(&bt, disk, block);
+	batch_submit(&bt);
+
+	/* Do not touch a block while the disk transfers it */
+	while(b->flags & (BUF_READING|BUF_WRITING))
+		kernel_mxwait(&bcache_lock, &bcache_io, SCHED_IO);
+
+	if(! (b->flags & BUF_VALID)) {
+		if(--b->refs == 0) Cond_Broadcast(&bcache_io);
+		return NULL;
+	}
+	return b;
+}
+
+/* Unpin a buffer, marking it dirty if it was written. The caller holds bcache_lock. */
+static void bcache_put(bcache_buf* b, int dirty)
+{
+	if(dirty && !(b->flags & BUF_DIRTY)) {
+		b->flags |= BUF_DIRTY;
+		bcache_dirty++;
+	}
+
+	if(--b->refs == 0) Cond_Broadcast(&bcache_io);
+
+	if(bcache_dirty >= BCACHE_DIRTY_HIGH) {
+		batch bt = { NULL, NULL };
+		bcache_writeback(&bt);
+		batch_submit(&bt);
+	}
+}
+
+/*
+	Write back the dirty buffers of a disk, and wait for the writes.
+	Return -1 if a write to the disk failed since the last sync, else 0.
+	The caller holds bcache_lock, with preemption off.
+ */
+static int bcache_sync(uint disk)
+{
+	for(;;) {
+		int dirty = 0, busy = 0;
+		for(uint i=0; i<BCACHE_BUFFERS; i++) {
+			bcache_buf* b = & bcache_bufs[i];
+			if(b->key == 0 || b->disk != disk) continue;
+			if(b->flags & BUF_WRITING) busy = 1;
+			else if(b->flags & BUF_DIRTY) dirty = 1;
+		}
+		if(!dirty && !busy) break;
+
+		if(dirty) {
+			batch bt = { NULL, NULL };
+			bcache_writeback(&bt);
+			batch_submit(&bt);
+		}
+		kernel_mxwait(&bcache_lock, &bcache_io, SCHED_IO);
+	}
+
+	int rc = bcache_write_error[disk] ? -1 : 0;
+	bcache_write_error[disk] = 0;
+	return rc;
+}
+
+
+/*
+	The BLOCK_DONE handler takes the requests completed for this core.
+	A failed read unmaps its buffers. A failed write leaves them as they
+	are, clean, and is reported by the next sync of the disk.
+ */
+void bcache_done_handler()
+{
+	int pre = preempt_off;
+	Mutex_Lock(&bcache_lock);
+
+	block_request* rq = bios_block_completions();
+	int done = (rq != NULL);
+	while(rq != NULL) {
+		for(uint i=0; i<rq->count; i++) {
+			bcache_buf* b = & bcache_bufs[((char*) rq->buf[i] - bcache_data[0]) / BIOS_BLOCK_SIZE];
+			if(rq->write) {
+				b->flags &= ~BUF_WRITING;
+				if(rq->status != 0) bcache_write_error[rq->disk] = 1;
+			}
+			else if(rq->status == 0)
+				b->flags = BUF_VALID;
+			else {
+				rhash_remove(&bcache_map, b->key);
+				b->key = 0;
+				b->flags = 0;
+			}
+		}
+		block_request* next = rq->next;
+		free(rq);
+		rq = next;
+	}
+
+	if(done) Cond_Broadcast(&bcache_io);
+	Mutex_Unlock(&bcache_lock);
+	if(pre) preempt_on;
+}
+
+
+
+/*
+	The block device driver. A stream reads and writes its disk sequentially,
+	from the start, and its Close writes back the disk.
+ */
+
+typedef struct block_stream {
+	uint disk;
+	uint64_t pos;       /* The byte position of the next transfer */
+} block_stream;
+
+
+static void* block_open(uint minor)
+{
+	assert(minor < bios_block_devices());
+	block_stream* bs = xmalloc(sizeof(block_stream));
+	bs->disk = minor;
+	bs->pos = 0;
+	return bs;
+}
+
+/* Transfer between buf and the disk, block by block, through the cache */
+static unsigned int block_transfer(block_stream* bs, char* buf, unsigned int size, int write)
+{
+	uint64_t end = bios_block_count(bs->disk) * BIOS_BLOCK_SIZE;
+	unsigned int count = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(&bcache_lock);
+
+	while(count < size && bs->pos < end) {
+		uint64_t block = bs->pos / BIOS_BLOCK_SIZE;
+		unsigned int off = bs->pos % BIOS_BLOCK_SIZE;
+		unsigned int n = BIOS_BLOCK_SIZE - off;
+		if(n > size - count) n = size - count;
+
+		enum bcache_access access = !write ? ACCESS_READ 
+			: (n == BIOS_BLOCK_SIZE) ? ACCESS_OVERWRITE : ACCESS_UPDATE;
+		bcache_buf* b = bcache_get(bs->disk, block, access);
+		if(b == NULL) break;
+
+		/* The buffer is pinned, copy without the lock */
+		char* data = bcache_data[buf_index(b)] + off;
+		Mutex_Unlock(&bcache_lock);
+		if(write) memcpy(data, buf+count, n); else memcpy(buf+count, data, n);
+		Mutex_Lock(&bcache_lock);
+
+		bcache_put(b, write);
+		bs->pos += n;
+		count += n;
+	}
+
+	Mutex_Unlock(&bcache_lock);
+	if(pre) preempt_on;
+	return count;
+}
+
+static int block_read(void* this, char* buf, unsigned int size)
+{
+	block_stream* bs = this;
+	unsigned int count = block_transfer(bs, buf, size, 0);
+	/* A read that fails before the end of the disk is an error */
+	if(count == 0 && size > 0 && bs->pos < bios_block_count(bs->disk) * BIOS_BLOCK_SIZE)
+		return -1;
+	return count;
+}
+
+static int block_write(void* this, const char* buf, unsigned int size)
+{
+	unsigned int count = block_transfer(this, (char*) buf, size, 1);
+	return (count == 0 && size > 0) ? -1 : (int) count;
+}
+
+static int block_close(void* this)
+{
+	block_stream* bs = this;
+
+	int pre = preempt_off;
+	Mutex_Lock(&bcache_lock);
+	int rc = bcache_sync(bs->disk);
+	Mutex_Unlock(&bcache_lock);
+	if(pre) preempt_on;
+
+	free(bs);
+	return rc;
+}
+
+
+file_ops block_fops = {
+	.Open = block_open,
+	.Read = block_read,
+	.Write = block_write,
+	.Close = block_close,
+	.type = STREAM_BLOCK
+};
+
+
+int sys_GetBlockStats(block_stats* stats)
+{
+	if(stats == NULL) return -1;
+
+	int pre = preempt_off;
+	Mutex_Lock(&bcache_lock);
+	*stats = bcache_stats;
+	Mutex_Unlock(&bcache_lock);
+	if(pre) preempt_on;
+	return 0;
+}
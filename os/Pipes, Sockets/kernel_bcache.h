@@ -0,0 +1,60 @@
+#ifndef __KERNEL_BCACHE_H
+#define __KERNEL_BCACHE_H
+
+#include "kernel_dev.h"
+
+/**
+	@file kernel_bcache.h
+	@brief The block devices and their buffer cache.
+
+	@defgroup bcache Buffer cache
+	@ingroup kernel
+	@brief The block devices and their buffer cache.
+
+	The disks of the bios are the @c DEV_BLOCK devices. All their I/O goes
+	through one cache of @c BCACHE_BUFFERS buffers of @c BIOS_BLOCK_SIZE bytes,
+	shared by all disks. A buffer is found by (disk, block) in a hash map,
+	and is pinned while a stream copies from or to it. When a new block is
+	needed, a clock hand picks a buffer that is neither pinned, nor busy
+	with I/O, nor dirty, and was not used since the hand last passed it.
+
+	Reads that follow each other on a disk open a read-ahead window, which
+	doubles up to @c BCACHE_READ_AHEAD blocks. The next window is read
+	asynchronously when half of the previous one has been consumed. The
+	missing blocks of a window are read with as few requests as possible,
+	since contiguous blocks are coalesced into one request of up to
+	@c BIOS_MAX_REQUEST_BLOCKS blocks.
+
+	Writes only mark the buffers dirty. When @c BCACHE_DIRTY_HIGH buffers
+	are dirty, they are written back together, sorted by block and
+	coalesced as above. Closing a block stream writes back its disk and
+	waits for the writes.
+
+	The requests are performed by the PIC daemon of the bios, which raises
+	@c BLOCK_DONE on the core that submitted them. Every core handles
+	@c BLOCK_DONE, marking the buffers and waking up their waiters.
+
+	@{
+*/
+
+/** @brief The buffers of the cache */
+#define BCACHE_BUFFERS 256
+
+/** @brief The largest read-ahead window, in blocks */
+#define BCACHE_READ_AHEAD 16
+
+/** @brief The dirty buffers that start a write-back */
+#define BCACHE_DIRTY_HIGH 64
+
+/** @brief Initialize the cache. This is called at kernel startup. */
+void initialize_bcache();
+
+/** @brief The interrupt handler of @c BLOCK_DONE, installed on each core. */
+void bcache_done_handler();
+
+/** @brief The operations of the @c DEV_BLOCK devices. */
+extern file_ops block_fops;
+
+/** @} */
+
+#endif
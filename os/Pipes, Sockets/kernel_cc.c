@@ -1,10 +1,13 @@
 
 
 #include <assert.h>
+#include <time.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_trace.h"
+#include "kernel_sys.h"
 
 
 /**
@@ -24,38 +27,453 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex word has MUTEX_LOCKED clear when the mutex is free. Else, it 
+ 	contains the address of the owner TCB, or-ed with MUTEX_LOCKED. In both 
+ 	cases, MUTEX_WAITERS may be set. TCBs are page-aligned, so the two low 
+ 	bits are free. 
+
+ 	In the preemptive domain, a thread spins only while the owner is running on 
+ 	another core. Else, it "parks": it queues itself in a wait list and sleeps,
+ 	in the style of a futex. The wait lists are kept in a small hash table
+ 	keyed on the mutex address, so that no memory is needed in the mutex itself.
+ 	When a mutex with waiters is unlocked, the first waiter is woken up and
+ 	competes for the mutex again. The mutex is not handed over to it: that
+ 	would keep the mutex idle until the waiter gets a core, and running
+ 	threads would line up behind it.
+
+ 	A thread that parks lends its priority to the owner, so that a low 
+ 	priority owner is not kept off the cores, with the mutex, by threads 
+ 	of medium priority. The owner gives the loan back when it unlocks.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+#define MUTEX_LOCKED   ((Mutex)1)
+#define MUTEX_WAITERS  ((Mutex)2)
+#define MUTEX_OWNER(m) ((TCB*)((m) & ~(MUTEX_LOCKED|MUTEX_WAITERS)))
+
+/* With no owner running, we give up spinning after this many rounds */
+#define MUTEX_SPINS 1000
+
+/* Check whether the owner is running, every this many rounds */
+#define MUTEX_OWNER_CHECK 32
+
+
+/** \cond HELPER Helper structure for parked mutex waiters. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of the bucket list */
+	Mutex* mutex;				/* the mutex waited for */
+	TCB* thread;				/* thread to wait */
+	sig_atomic_t woken;			/* this is set when the mutex is released to us */
+} __mutex_waiter;
+/** \endcond */
+
+#define MUTEX_PARK_BUCKETS 64
+
+static struct mutex_park_bucket {
+	Mutex spinlock;				/* only ever locked with preemption off */
+	rlnode waiters;				/* initialized on first use */
+} mutex_park[MUTEX_PARK_BUCKETS];
+
+
+static inline struct mutex_park_bucket* mutex_bucket(Mutex* mutex)
+{
+	uintptr_t h = (uintptr_t) mutex;
+	h = (h >> 3) ^ (h >> 11);
+	return & mutex_park[h % MUTEX_PARK_BUCKETS];
+}
+
+static inline Mutex mutex_self()
+{
+	return ((Mutex) CURTHREAD) | MUTEX_LOCKED;
+}
+
+static inline int mutex_cas(Mutex* lock, Mutex* expected, Mutex desired)
+{
+	return __atomic_compare_exchange_n(lock, expected, desired, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/* The kernel lock, defined below */
+static Mutex kernel_mutex;
+static CondVar kernel_sem_cv;
+static TCB* kernel_sem_owner;
+
+
+#ifdef LOCK_PROFILE
+
+/*
+	Lock profiling.
+	----------------
+
+	The statistics of each lock are kept in a slot of an open-addressing 
+	table, which is claimed with a CAS on the address of the lock. The
+	statistics of a mutex are only updated by its holder, so they need no
+	atomics. Condition variables have many waiters, and use atomics.
+
+	Slots are never released. A lock freed and allocated again at the same
+	address just goes on counting.
+ */
+
+#define LOCK_PROFILE_SLOTS 2048
+#define LOCK_PROFILE_REPORT 25
+
+enum { LOCK_MUTEX, LOCK_CONDVAR };
+
+typedef struct lock_stats {
+	void* lock;                 /* NULL for a free slot */
+	int kind;
+	const char* name;
+	int index;
+
+	unsigned long acquired;     /* mutexes */
+	unsigned long contended;
+	unsigned long spins;
+	unsigned long parks;
+	unsigned long hold_ns;
+	unsigned long max_hold_ns;
+	unsigned long since;        /* when the current holder locked it */
+
+	unsigned long waits;        /* condition variables */
+	unsigned long wait_ns;
+} lock_stats;
+
+static lock_stats lock_table[LOCK_PROFILE_SLOTS];
+static unsigned long lock_table_overflow;
+
+static unsigned long lock_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000000000ul + t.tv_nsec;
+}
+
+/* Return the slot of a lock, claiming one if needed, or NULL if the table is full */
+static lock_stats* lock_stats_get(void* lock, int kind)
+{
+	uintptr_t h = (uintptr_t) lock;
+	h = (h >> 3) ^ (h >> 13);
+	for(unsigned int i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+		lock_stats* s = & lock_table[(h + i) % LOCK_PROFILE_SLOTS];
+		void* key = __atomic_load_n(& s->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL) {
+			if(__atomic_compare_exchange_n(& s->lock, &key, lock, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				s->kind = kind;
+				return s;
+			}
+		}
+		if(key == lock) return s;
+	}
+	__atomic_add_fetch(& lock_table_overflow, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void lock_profile_init()
+{
+	memset(lock_table, 0, sizeof(lock_table));
+	lock_table_overflow = 0;
+	lock_profile_name(& kernel_mutex, "kernel_mutex", -1);
+	lock_profile_name(& kernel_sem_cv, "kernel_sem_cv", -1);
+	for(int i=0; i<MUTEX_PARK_BUCKETS; i++)
+		lock_profile_name(& mutex_park[i].spinlock, "mutex_park", i);
+}
+
+void lock_profile_name(void* lock, const char* name, int index)
+{
+	lock_stats* s = lock_stats_get(lock, LOCK_MUTEX);
+	if(s) { s->name = name; s->index = index; }
+}
+
+/* Called by the new holder of a mutex */
+static void lock_profile_acquired(Mutex* lock, int contended, unsigned long spins, unsigned long parks)
+{
+	lock_stats* s = lock_stats_get(lock, LOCK_MUTEX);
+	if(s == NULL) return;
+	s->acquired++;
+	s->contended += contended;
+	s->spins += spins;
+	s->parks += parks;
+	s->since = lock_clock();
+}
+
+/* Called by the holder of a mutex, before it releases it */
+static void lock_profile_release(Mutex* lock)
+{
+	lock_stats* s = lock_stats_get(lock, LOCK_MUTEX);
+	if(s == NULL || s->since == 0) return;
+	unsigned long held = lock_clock() - s->since;
+	s->since = 0;
+	s->hold_ns += held;
+	if(held > s->max_hold_ns) s->max_hold_ns = held;
+}
+
+static void lock_profile_waited(CondVar* cv, unsigned long start)
+{
+	lock_stats* s = lock_stats_get(cv, LOCK_CONDVAR);
+	if(s == NULL) return;
+	s->kind = LOCK_CONDVAR;   /* in case it was named before its first wait */
+	__atomic_add_fetch(& s->waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(& s->wait_ns, lock_clock() - start, __ATOMIC_RELAXED);
+}
+
+/* Most contended first, then the longest held or waited for */
+static int lock_stats_cmp(const void* a, const void* b)
+{
+	const lock_stats* x = *(const lock_stats**) a;
+	const lock_stats* y = *(const lock_stats**) b;
+	if(x->contended != y->contended) return (x->contended < y->contended) ? 1 : -1;
+	unsigned long tx = x->hold_ns + x->wait_ns, ty = y->hold_ns + y->wait_ns;
+	if(tx != ty) return (tx < ty) ? 1 : -1;
+	return 0;
+}
+
+void lock_profile_report()
+{
+	static lock_stats* used[LOCK_PROFILE_SLOTS];
+	unsigned int n = 0;
+	for(unsigned int i=0; i<LOCK_PROFILE_SLOTS; i++)
+		if(lock_table[i].lock != NULL && (lock_table[i].acquired || lock_table[i].waits))
+			used[n++] = & lock_table[i];
+	qsort(used, n, sizeof(lock_stats*), lock_stats_cmp);
+
+	fprintf(stderr, "*** Lock profile: %u locks, showing the %u most contended\n", 
+		n, n < LOCK_PROFILE_REPORT ? n : LOCK_PROFILE_REPORT);
+	fprintf(stderr, "%-24s %10s %10s %12s %8s %12s %10s\n",
+		"lock", "acquired", "contended", "spins", "parks", "hold(us)", "max(us)");
+	for(unsigned int i=0; i<n && i<LOCK_PROFILE_REPORT; i++) {
+		lock_stats* s = used[i];
+		char name[32];
+		if(s->name == NULL)
+			snprintf(name, sizeof(name), "%s %p", s->kind==LOCK_CONDVAR ? "cond" : "mutex", s->lock);
+		else if(s->index >= 0)
+			snprintf(name, sizeof(name), "%s[%d]", s->name, s->index);
+		else
+			snprintf(name, sizeof(name), "%s", s->name);
+
+		if(s->kind == LOCK_CONDVAR)
+			fprintf(stderr, "%-24s %10lu waits, %lu us waiting\n", name, s->waits, s->wait_ns/1000);
+		else
+			fprintf(stderr, "%-24s %10lu %10lu %12lu %8lu %12lu %10lu\n", name,
+				s->acquired, s->contended, s->spins, s->parks, s->hold_ns/1000, s->max_hold_ns/1000);
+	}
+	if(lock_table_overflow)
+		fprintf(stderr, "*** %lu lock operations were not profiled, the table was full\n", lock_table_overflow);
+}
+
+#define LOCK_PROFILE_ACQUIRED(lock, contended, spins, parks) lock_profile_acquired((lock), (contended), (spins), (parks))
+#define LOCK_PROFILE_RELEASE(lock) lock_profile_release(lock)
+
+#else
+
+#define LOCK_PROFILE_ACQUIRED(lock, contended, spins, parks) ((void)(contended), (void)(spins), (void)(parks))
+#define LOCK_PROFILE_RELEASE(lock) ((void)0)
+
+#endif
+
+/* Try to lock the mutex, given the mutex word @c *m. On failure, @c *m is refreshed. */
+static inline int mutex_acquire(Mutex* lock, Mutex* m, Mutex self)
+{
+	return !(*m & MUTEX_LOCKED) && mutex_cas(lock, m, self | (*m & MUTEX_WAITERS));
+}
+
+/* Return 1 if the owner of a locked mutex is (probably) running on another core */
+static int mutex_owner_running(Mutex m)
+{
+	TCB* owner = MUTEX_OWNER(m);
+	if(owner == NULL) return 1;   /* The owner is not known, assume it runs */
+
+	uint ncores = cpu_cores();
+	for(uint c = 0; c < ncores; c++)
+		if(c != cpu_core_id && __atomic_load_n(& cctx[c].current_thread, __ATOMIC_RELAXED) == owner)
+			return 1;
+	return 0;
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+	Mutex self = mutex_self();
+	Mutex m = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while(! (m & MUTEX_LOCKED))
+		if(mutex_acquire(lock, &m, self)) {
+			LOCK_PROFILE_ACQUIRED(lock, 0, 0, 0);
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+	Sleep until the mutex is released. If the mutex is released before
+	we manage to queue ourselves, return at once.
+ */
+static void mutex_park_wait(Mutex* lock)
+{
+	struct mutex_park_bucket* bucket = mutex_bucket(lock);
+	__mutex_waiter waiter = { .mutex = lock, .thread = CURTHREAD, .woken = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Spin_Lock(& bucket->spinlock);
+	if(bucket->waiters.next == NULL)
+		rlnode_init(& bucket->waiters, NULL);
+
+	/* Announce that there are waiters, unless the mutex got free */
+	Mutex m = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while(m & MUTEX_LOCKED) {
+		if((m & MUTEX_WAITERS) || mutex_cas(lock, &m, m | MUTEX_WAITERS)) {
+			rlist_push_back(& bucket->waiters, & waiter.node);
+			sched_trace(TRACE_MUTEX, 0, lock, MUTEX_OWNER(m));
+
+			/* The owner cannot unlock before we release the bucket */
+			sched_inherit_priority(MUTEX_OWNER(m), lock);
+			while(! waiter.woken) {
+				sleep_releasing(STOPPED, & bucket->spinlock, SCHED_USER, NO_TIMEOUT);
+				Spin_Lock(& bucket->spinlock);
+			}
+			break;
+		}
+	}
+
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Queue a sleeping thread as a waiter of a mutex locked by the caller, 
+	as if it had parked itself. It is woken up by Mutex_Unlock. 
+ */
+static void mutex_park_enqueue(Mutex* lock, __mutex_waiter* waiter)
+{
+	struct mutex_park_bucket* bucket = mutex_bucket(lock);
+
+	int preempt = preempt_off;
+	Spin_Lock(& bucket->spinlock);
+	if(bucket->waiters.next == NULL)
+		rlnode_init(& bucket->waiters, NULL);
+
+	/* Only the bucket holders change the word of a locked mutex, besides us */
+	__atomic_fetch_or(lock, MUTEX_WAITERS, __ATOMIC_RELAXED);
+	rlist_push_back(& bucket->waiters, & waiter->node);
+
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+/* Take a queued waiter off its bucket, unless it has been woken up */
+static void mutex_park_cancel(__mutex_waiter* waiter)
+{
+	struct mutex_park_bucket* bucket = mutex_bucket(waiter->mutex);
+
+	int preempt = preempt_off;
+	Spin_Lock(& bucket->spinlock);
+	if(! waiter->woken)
+		rlist_remove(& waiter->node);
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Free the mutex and wake up the first thread waiting for it.
+ */
+static void mutex_unpark(Mutex* lock)
+{
+	struct mutex_park_bucket* bucket = mutex_bucket(lock);
+
+	int preempt = preempt_off;
+	Spin_Lock(& bucket->spinlock);
+
+	__mutex_waiter* first = NULL;
+	int more = 0;
+	if(bucket->waiters.next != NULL)
+		for(rlnode* n = bucket->waiters.next; n != & bucket->waiters; n = n->next) {
+			__mutex_waiter* w = n->obj;
+			if(w->mutex != lock) continue;
+			if(first == NULL) 
+				first = w;
+			else { 
+				more = 1; 
+				break; 
+			}
+		}
+
+	/* 
+		While we hold the bucket lock, no one else may change the mutex word, 
+		since it is locked and MUTEX_WAITERS is set.
+	 */
+	sched_restore_priority(lock);
+	__atomic_store_n(lock, more ? MUTEX_WAITERS : 0, __ATOMIC_RELEASE);
+	if(first != NULL) {
+		rlist_remove(& first->node);
+		first->woken = 1;
+		wakeup(first->thread);
+	}
+
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+}
+
+
 void Mutex_Lock(Mutex* lock)
 {
-#define MUTEX_SPINS 1000
+	Mutex self = mutex_self();
+	Mutex m = 0;
+	int contended = 0;
+	unsigned long spins = 0, parks = 0;
+
+	while(! mutex_acquire(lock, &m, self)) {
+		contended = 1;
+
+		/* Adaptive spin */
+		int spin = 0;
+		while((m = __atomic_load_n(lock, __ATOMIC_RELAXED)) & MUTEX_LOCKED) {
+			spins++;
+			/* An interrupt handler runs with the preemption of the code it
+			   interrupted, but it must not be switched out either */
+			if(! get_core_preemption() || cpu_interrupts_disabled()) {
+				cpu_spin(spins);   /* pure spinlock */
+				continue;
+			}
+			cpu_relax();
+			spin++;
+			if(spin >= MUTEX_SPINS || 
+				(spin % MUTEX_OWNER_CHECK == 0 && !mutex_owner_running(m)))
+				break;
+		}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-      __builtin_ia32_pause();      
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+		if(m & MUTEX_LOCKED) {
+			/* Spinning does not pay, sleep until the mutex is released */
+			mutex_park_wait(lock);
+			parks++;
+			m = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		}
+	}
+
+	LOCK_PROFILE_ACQUIRED(lock, contended, spins, parks);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	LOCK_PROFILE_RELEASE(lock);
+
+	Mutex m = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	if(!(m & MUTEX_WAITERS) && 
+		__atomic_compare_exchange_n(lock, &m, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	/* Someone may be waiting */
+	mutex_unpark(lock);
 }
 
 
@@ -68,9 +486,14 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* the mutex to lock again */
+	CondVar* ring;				/* the condition whose ring holds the waiter */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t parked;		/* this is set if the waiter is moved to 
+								   the waiters of the mutex */
+	__mutex_waiter park;		/* the entry of a parked waiter */
 } __cv_waiter;
 /** \endcond */
 
@@ -119,10 +542,16 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=CURTHREAD, .mutex=mutex, .ring=cv, 
+		.signalled = 0, .removed=0, .parked=0 };
 	rlnode_init(& waiter.node, &waiter);
+#ifdef LOCK_PROFILE
+	unsigned long start = lock_clock();
+#endif
 
-	Mutex_Lock(&(cv->waitset_lock));
+	/* The waitset lock is a spinlock */
+	int preempt = preempt_off;
+	Spin_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -135,21 +564,98 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	Mutex_Unlock(mutex);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
-	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	/* 
+		Woke up, we must check wether we were signaled, and tidy up. 
+		A signal may have moved us to the ring of the kernel lock, or 
+		to the waiters of the mutex (see cv_morph).
+	 */
+	Spin_Lock(&(cv->waitset_lock));
+	CondVar* ring = waiter.ring;
+	if(ring != cv) Spin_Lock(&(ring->waitset_lock));
 	if(! waiter.removed) {
-		assert(! waiter.signalled);
+		assert(ring != cv || ! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
+		remove_from_ring(ring, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
-
+	if(ring != cv) Spin_Unlock(&(ring->waitset_lock));
+	Spin_Unlock(&(cv->waitset_lock));
+	sched_preempt_restore(preempt);
+	if(waiter.parked)
+		mutex_park_cancel(& waiter.park);
+
+#ifdef LOCK_PROFILE
+	lock_profile_waited(cv, start);
+#endif
 	Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
 
+/*
+	Wait morphing.
+	--------------
+
+	A signalled waiter must lock its mutex again before it returns. If the
+	signaller holds that mutex, waking the waiter up is wasted: it runs only
+	to park on the mutex, and a broadcast makes all the waiters pile up on
+	it at once. Instead, the waiter is moved, still asleep, to the waiters
+	of the mutex, and Mutex_Unlock wakes the waiters up one at a time.
+
+	A thread of kernel_wait must take the kernel semaphore as well. If the 
+	signaller holds the semaphore, the waiter is moved to the ring of 
+	kernel_sem_cv, and kernel_unlock wakes it up.
+
+	A waiter that wakes up for some other reason, e.g., a timeout, takes
+	itself off the queue it was moved to, and returns as signalled.
+ */
+
+/* Return 1 if a thread is asleep, as wakeup() checks it */
+static int thread_asleep(TCB* tcb)
+{
+	int preempt = preempt_off;
+	Spin_Lock(& tcb->state_spinlock);
+	int asleep = (tcb->state == STOPPED || tcb->state == INIT);
+	Spin_Unlock(& tcb->state_spinlock);
+	if(preempt) preempt_on;
+	return asleep;
+}
+
+/* Move a waiter just taken off the ring of cv, if possible. Return 1 if it was moved. */
+static int cv_morph(CondVar* cv, __cv_waiter* waiter)
+{
+	TCB* self = CURTHREAD;
+	if(self == NULL) return 0;
+
+	if(waiter->mutex == & kernel_mutex && cv != & kernel_sem_cv) {
+		/* The semaphore is ours until kernel_unlock */
+		if(kernel_sem_owner != self || ! thread_asleep(waiter->thread))
+			return 0;
+		Spin_Lock(& kernel_sem_cv.waitset_lock);
+		if(kernel_sem_cv.waitset) {
+			__cv_waiter* wset = kernel_sem_cv.waitset;
+			rlist_push_back(& wset->node, & waiter->node);
+		} else
+			kernel_sem_cv.waitset = waiter;
+		waiter->ring = & kernel_sem_cv;
+		waiter->signalled = 1;
+		Spin_Unlock(& kernel_sem_cv.waitset_lock);
+		return 1;
+	}
+
+	Mutex m = __atomic_load_n(waiter->mutex, __ATOMIC_RELAXED);
+	if(!(m & MUTEX_LOCKED) || MUTEX_OWNER(m) != self || ! thread_asleep(waiter->thread))
+		return 0;
+	waiter->park = (__mutex_waiter){ .mutex = waiter->mutex, .thread = waiter->thread, .woken = 0 };
+	rlnode_init(& waiter->park.node, & waiter->park);
+	mutex_park_enqueue(waiter->mutex, & waiter->park);
+	waiter->removed = 1;
+	waiter->parked = 1;
+	waiter->signalled = 1;
+	return 1;
+}
+
+
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
@@ -162,6 +668,8 @@ static inline void cv_signal(CondVar* cv)
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
+		if(cv_morph(cv, waiter))
+			return;
 		waiter->removed = 1;
 		if(wakeup(waiter->thread)) {
 			waiter->signalled = 1;
@@ -172,6 +680,114 @@ static inline void cv_signal(CondVar* cv)
 
 
 
+/*
+	Futexes.
+	--------
+
+	The sleepers of a futex are kept in a hash table keyed on the address 
+	of the word, exactly as parked mutex waiters are. The word is checked 
+	with the bucket locked, so a waker that changes the word and then takes
+	the bucket lock cannot miss the sleeper.
+ */
+
+/** \cond HELPER Helper structure for futex sleepers. */
+typedef struct __futex_waiter {
+	rlnode node;				/* become part of the bucket list */
+	int* addr;					/* the word slept on */
+	TCB* thread;				/* the sleeping thread */
+	int woken;					/* set by FUTEX_WAKE */
+} __futex_waiter;
+/** \endcond */
+
+#define FUTEX_BUCKETS 64
+
+static struct futex_bucket {
+	Mutex spinlock;				/* only ever locked with preemption off */
+	rlnode waiters;				/* initialized on first use */
+} futex_table[FUTEX_BUCKETS];
+
+
+static struct futex_bucket* futex_bucket_lock(int* addr)
+{
+	uintptr_t h = (uintptr_t) addr;
+	h = (h >> 2) ^ (h >> 12);
+	struct futex_bucket* bucket = & futex_table[h % FUTEX_BUCKETS];
+	Spin_Lock(& bucket->spinlock);
+	if(bucket->waiters.next == NULL)
+		rlnode_init(& bucket->waiters, NULL);
+	return bucket;
+}
+
+
+static int futex_wait(int* addr, int val, timeout_t timeout)
+{
+	__futex_waiter waiter = { .addr = addr, .thread = CURTHREAD, .woken = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	TimerDuration deadline = (timeout == FUTEX_INFINITE) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+
+	int preempt = preempt_off;
+	struct futex_bucket* bucket = futex_bucket_lock(addr);
+
+	int rc = -1;
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+		rlist_push_back(& bucket->waiters, & waiter.node);
+		while(! waiter.woken) {
+			TimerDuration left = NO_TIMEOUT;
+			if(deadline != NO_TIMEOUT) {
+				TimerDuration now = bios_clock();
+				if(now >= deadline) {
+					rlist_remove(& waiter.node);
+					break;
+				}
+				left = deadline - now;
+			}
+			sleep_releasing(STOPPED, & bucket->spinlock, SCHED_USER, left);
+			Spin_Lock(& bucket->spinlock);
+		}
+		if(waiter.woken) rc = 0;
+	}
+
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+	return rc;
+}
+
+
+static int futex_wake(int* addr, int count)
+{
+	int preempt = preempt_off;
+	struct futex_bucket* bucket = futex_bucket_lock(addr);
+
+	int woken = 0;
+	for(rlnode* n = bucket->waiters.next; n != & bucket->waiters && woken < count; ) {
+		__futex_waiter* w = n->obj;
+		n = n->next;
+		if(w->addr != addr) continue;
+		rlist_remove(& w->node);
+		w->woken = 1;
+		wakeup(w->thread);
+		woken++;
+	}
+
+	Spin_Unlock(& bucket->spinlock);
+	if(preempt) preempt_on;
+	return woken;
+}
+
+
+int sys_Futex(int* addr, futex_op op, int val, timeout_t timeout)
+{
+	if(addr == NULL) return -1;
+	switch(op) {
+		case FUTEX_WAIT: return futex_wait(addr, val, timeout);
+		case FUTEX_WAKE: return futex_wake(addr, val);
+		default: return -1;
+	}
+}
+
+
+
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
 	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
@@ -186,17 +802,173 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  Spin_Lock(&(cv->waitset_lock));
   cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Spin_Unlock(&(cv->waitset_lock));
+  sched_preempt_restore(preempt);
 }
 
 
+/* The waiters of a broadcast are woken up in batches of this many */
+#define CV_WAKEUP_BATCH 32
+
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  TCB* threads[CV_WAKEUP_BATCH];
+  __cv_waiter* waiters[CV_WAKEUP_BATCH];
+
+  int preempt = preempt_off;
+  Spin_Lock(&(cv->waitset_lock));
+  while(cv->waitset) {
+    int n = 0;
+    while(cv->waitset && n < CV_WAKEUP_BATCH) {
+      __cv_waiter* waiter = cv->waitset;
+      remove_from_ring(cv, waiter);
+      if(cv_morph(cv, waiter)) continue;
+      waiter->removed = 1;
+      waiters[n] = waiter;
+      threads[n++] = waiter->thread;
+    }
+
+    wakeup_many(threads, n);
+    for(int i = 0; i < n; i++)
+      if(threads[i] != NULL) waiters[i]->signalled = 1;
+  }
+  Spin_Unlock(&(cv->waitset_lock));
+  sched_preempt_restore(preempt);
+}
+
+
+/*
+	Semaphores and reader-writer locks.
+	-----------------------------------
+
+	Both are monitors. The timed variants sleep on cv_wait until a
+	deadline, checking their condition again at each wakeup.
+ */
+
+static TimerDuration monitor_deadline(timeout_t timeout)
+{
+	return (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+}
+
+/* Wait on cv until the deadline. Return 0 if the deadline has passed. */
+static int monitor_wait(Mutex* mx, CondVar* cv, TimerDuration deadline)
+{
+	if(deadline == NO_TIMEOUT) {
+		cv_wait(mx, cv, SCHED_USER, NO_TIMEOUT);
+		return 1;
+	}
+	TimerDuration now = bios_clock();
+	if(now >= deadline) return 0;
+	cv_wait(mx, cv, SCHED_USER, deadline - now);
+	return 1;
+}
+
+
+static int sem_down(Semaphore* sem, TimerDuration deadline)
+{
+	int taken = 0;
+	Mutex_Lock(& sem->lock);
+	while(sem->value == 0 && monitor_wait(& sem->lock, & sem->cv, deadline));
+	if(sem->value > 0) {
+		sem->value--;
+		taken = 1;
+	}
+	Mutex_Unlock(& sem->lock);
+	return taken;
+}
+
+void Sem_Down(Semaphore* sem)
+{
+	sem_down(sem, NO_TIMEOUT);
+}
+
+int Sem_TimedDown(Semaphore* sem, timeout_t timeout)
+{
+	return sem_down(sem, monitor_deadline(timeout));
+}
+
+void Sem_Up(Semaphore* sem)
+{
+	Mutex_Lock(& sem->lock);
+	sem->value++;
+	Cond_Signal(& sem->cv);
+	Mutex_Unlock(& sem->lock);
+}
+
+
+static int rwlock_read(RWLock* rw, TimerDuration deadline)
+{
+	int taken = 0;
+	Mutex_Lock(& rw->lock);
+	while((rw->writer || rw->writers_waiting) && monitor_wait(& rw->lock, & rw->readers_cv, deadline));
+	if(!(rw->writer || rw->writers_waiting)) {
+		rw->readers++;
+		taken = 1;
+	}
+	Mutex_Unlock(& rw->lock);
+	return taken;
+}
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	rwlock_read(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout)
+{
+	return rwlock_read(rw, monitor_deadline(timeout));
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	Mutex_Lock(& rw->lock);
+	assert(rw->readers > 0);
+	if(--rw->readers == 0 && rw->writers_waiting)
+		Cond_Signal(& rw->writers_cv);
+	Mutex_Unlock(& rw->lock);
+}
+
+static int rwlock_write(RWLock* rw, TimerDuration deadline)
+{
+	int taken = 0;
+	Mutex_Lock(& rw->lock);
+	rw->writers_waiting++;
+	while((rw->writer || rw->readers) && monitor_wait(& rw->lock, & rw->writers_cv, deadline));
+	rw->writers_waiting--;
+	if(!(rw->writer || rw->readers)) {
+		rw->writer = 1;
+		taken = 1;
+	}
+	else if(rw->writers_waiting == 0 && !rw->writer)
+		/* We gave up, the readers we held back may go */
+		Cond_Broadcast(& rw->readers_cv);
+	Mutex_Unlock(& rw->lock);
+	return taken;
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	rwlock_write(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout)
+{
+	return rwlock_write(rw, monitor_deadline(timeout));
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	Mutex_Lock(& rw->lock);
+	assert(rw->writer);
+	rw->writer = 0;
+	if(rw->writers_waiting)
+		Cond_Signal(& rw->writers_cv);
+	else
+		Cond_Broadcast(& rw->readers_cv);
+	Mutex_Unlock(& rw->lock);
 }
 
 
@@ -240,6 +1012,9 @@ int get_core_preemption()
  *
  * Kernel locking is provided by a semaphore, implemented as a monitor.
  * A semaphre for kernel locking has the advantage that 
+ *
+ * The kernel lock is taken by the process-tree system calls only.
+ * Its holder is recorded, so that waiters can lend it their priority.
  */
 
 /* This mutex is used to implement the kernel semaphore as a monitor. */
@@ -251,21 +1026,40 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
-void kernel_lock()
+/* The thread holding the semaphore, protected by kernel_mutex */
+static TCB* kernel_sem_owner = NULL;
+
+/* Take the semaphore. Call with kernel_mutex held. */
+static void kernel_sem_down()
 {
-	Mutex_Lock(& kernel_mutex);
 	while(kernel_sem<=0) {
+		sched_inherit_priority(kernel_sem_owner, &kernel_sem);
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	}
 	kernel_sem--;
+	kernel_sem_owner = CURTHREAD;
+}
+
+/* Give the semaphore back. Call with kernel_mutex held. */
+static void kernel_sem_up()
+{
+	kernel_sem_owner = NULL;
+	sched_restore_priority(&kernel_sem);
+	kernel_sem++;
+	Cond_Signal(&kernel_sem_cv);
+}
+
+void kernel_lock()
+{
+	Mutex_Lock(& kernel_mutex);
+	kernel_sem_down();
 	Mutex_Unlock(& kernel_mutex);
 }
 
 void kernel_unlock()
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_sem_up();
 	Mutex_Unlock(& kernel_mutex);
 }
 
@@ -274,20 +1068,23 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 {
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	kernel_sem_up();
 
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
 	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
+	kernel_sem_down();
 	Mutex_Unlock(& kernel_mutex);		
 
 	return ret;
 }
 
+int kernel_mxwait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -301,8 +1098,7 @@ void kernel_broadcast(CondVar* cv)
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_sem_up();
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
 }
 
@@ -26,15 +26,28 @@
 	Many of the header definitions for Mutexes and CondVars are in the 
    	tinyos.h file
 */
+#include <assert.h>
 #include "kernel_sys.h"
 #include "kernel_sched.h"
 
 
 
 
+/**
+	@brief Try to lock a mutex, without waiting.
+
+	@returns 1 if the mutex was locked by the caller, 0 if it was already locked
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
 /*
  * Kernel preemption control.
  * These are wrappers for the kernel monitor.
+ *
+ * The kernel lock only protects the process tree (process creation and
+ * termination, threads, parent/child relations). Other kernel objects
+ * have their own mutexes, and wait with @c kernel_mxwait.
  */
 
 /**
@@ -49,6 +62,9 @@ void kernel_unlock();
 
 /**
 	@brief Wait on a condition variable using the kernel lock.
+
+	A thread signalled by the holder of the kernel lock sleeps on until
+	the lock is released, so that it does not wake up only to wait for it.
 	@returns 1 if signalled, 0 if not
   */
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
@@ -59,6 +75,22 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable using an object mutex.
+
+	This is used by kernel code which is protected by the mutex of some 
+	object (e.g., a pipe), instead of the kernel lock. The mutex is released
+	while the thread sleeps, and is locked again before the call returns.
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_mxwait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan, TimerDuration timeout);
+
+#define kernel_mxwait(mx, cv, cause) \
+	kernel_mxwait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_mxtimedwait(mx, cv, cause, timeout) \
+	kernel_mxwait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -126,6 +158,76 @@ int get_core_preemption();
 #define preempt_on  (set_core_preemption(1))
 
 
+/*
+ * Spinlocks.
+ */
+
+/**
+	@brief Lock a spinlock.
+
+	A spinlock is a @c Mutex that is only locked with preemption off, or
+	in an interrupt handler, so its holder is never switched out, and it is
+	never held by the code that an interrupt handler interrupts. The 
+	scheduler locks, the locks of the condition variables and those of the
+	wait buckets are spinlocks.
+
+	In a uniprocessor build (see @c CONFIG_UP), nothing else runs while 
+	preemption is off, or in an interrupt handler, and the spinlock calls 
+	do nothing. A spinlock that is then passed to @c sleep_releasing is 
+	still free, and unlocking it there does no harm.
+
+	@see Spin_Unlock
+ */
+#if CONFIG_UP
+static inline void Spin_Lock(Mutex* lock) { assert(! get_core_preemption() || cpu_interrupts_disabled()); (void) lock; }
+#else
+#define Spin_Lock(lock) Mutex_Lock(lock)
+#endif
+
+/** @brief Unlock a spinlock. @see Spin_Lock */
+#if CONFIG_UP
+static inline void Spin_Unlock(Mutex* lock) { (void) lock; }
+#else
+#define Spin_Unlock(lock) Mutex_Unlock(lock)
+#endif
+
+/** @brief Try to lock a spinlock. @see Spin_Lock, Mutex_TryLock */
+#if CONFIG_UP
+static inline int Spin_TryLock(Mutex* lock) { assert(! get_core_preemption() || cpu_interrupts_disabled()); (void) lock; return 1; }
+#else
+#define Spin_TryLock(lock) Mutex_TryLock(lock)
+#endif
+
+
+/*
+ * Lock profiling.
+ */
+
+/** 
+	@brief Lock profiling.
+
+	When the kernel is built with @c LOCK_PROFILE defined (e.g., by 
+	<tt>make LOCK_PROFILE=1</tt>), every mutex records its acquisitions,
+	contended acquisitions, spin rounds, parkings and hold times, and every 
+	condition variable records its waits and wait times. The statistics are 
+	kept in a hash table by address, and a report, sorted by contention, is
+	printed to @c stderr when the kernel halts.
+
+	Kernel locks can be given a name (and an index, e.g., the core of a
+	per-core lock, or -1) for the report. Without @c LOCK_PROFILE, these 
+	calls compile to nothing.
+ */
+#ifdef LOCK_PROFILE
+void lock_profile_name(void* lock, const char* name, int index);
+void lock_profile_init();
+void lock_profile_report();
+#else
+#define lock_profile_name(lock, name, index) ((void)0)
+#define lock_profile_init() ((void)0)
+#define lock_profile_report() ((void)0)
+#endif
+
+
 #endif
 
 
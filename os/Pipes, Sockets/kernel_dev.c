@@ -1,10 +1,15 @@
 
 #include <assert.h>
+#include <string.h>
 #include "kernel_cc.h"
 #include "kernel_dev.h"
 #include "kernel_sched.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_poll.h"
+#include "kernel_trace.h"
+#include "kernel_bcache.h"
+#include "kernel_net.h"
 
 /*************************************
 
@@ -66,10 +71,27 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* The bytes buffered by the driver for each direction of a terminal */
+#define SERIAL_RX_BUFFER 256
+#define SERIAL_TX_BUFFER 4096
+
+/* How long (usec) Close waits for a stuck console to accept the output */
+#define SERIAL_DRAIN_TIMEOUT 1000000
+
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  CondVar tx_ready;     /* Signalled when the device accepted output */
+  poll_queue pollq;     /* Threads polling this terminal */
+
+  /* Bytes taken from the device, not read yet */
+  uint rx_pos, rx_len;
+  char rx_buf[SERIAL_RX_BUFFER];
+
+  /* The output ring, waiting for the device */
+  uint tx_head, tx_count;
+  char tx_buf[SERIAL_TX_BUFFER];
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -78,19 +100,34 @@ serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 /*
   Interrupt-driven driver for serial-device reads.
+
+  The driver reads from the device in bulk, into rx_buf, and serves
+  the reads from there. Both helpers below need the spinlock.
  */
 
+/* Return the bytes in rx_buf, refilling it from the device if empty */
+static uint serial_rx_fill(serial_dcb_t* dcb)
+{
+  if(dcb->rx_pos == dcb->rx_len) {
+    dcb->rx_pos = 0;
+    dcb->rx_len = bios_read_serial_bytes(dcb->devno, dcb->rx_buf, SERIAL_RX_BUFFER);
+  }
+  return dcb->rx_len - dcb->rx_pos;
+}
+
 void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
+  /* Signal only the terminals that became ready */
+  uint ready = bios_serial_interrupts(SERIAL_RX_READY);
+  for(int i=0; ready; i++, ready >>= 1) {
+    if(!(ready & 1)) continue;
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    poll_notify(&dcb->pollq);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -103,67 +140,152 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
+    uint avail = serial_rx_fill(dcb);
+
+    if (avail) {
+      if(avail > size-count) avail = size-count;
+      memcpy(buf+count, dcb->rx_buf+dcb->rx_pos, avail);
+      dcb->rx_pos += avail;
+      count += avail;
     }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+    else if(count==0 && !stream_nonblocking()) {
+      kernel_mxwait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
-  return count;
+  return (count==0 && size>0) ? WOULDBLOCK : count;
 }
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial writes.
+
+  Writers copy their data into the output ring, and the ring is sent
+  to the device in bulk, by the writers and by the SERIAL_TX_READY handler, 
+  when the device can accept more.
+ */
+
+/* Send as much of the ring as the device accepts, returning the bytes sent. */
+static uint serial_tx_flush(serial_dcb_t* dcb)
+{
+  uint sent = 0;
+  while(dcb->tx_count > 0) {
+    uint n = SERIAL_TX_BUFFER - dcb->tx_head;
+    if(n > dcb->tx_count) n = dcb->tx_count;
+
+    uint w = bios_write_serial_bytes(dcb->devno, dcb->tx_buf+dcb->tx_head, n);
+    dcb->tx_head = (dcb->tx_head + w) % SERIAL_TX_BUFFER;
+    dcb->tx_count -= w;
+    sent += w;
+    if(w < n) break;
+  }
+  return sent;
+}
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint ready = bios_serial_interrupts(SERIAL_TX_READY);
+  for(int i=0; ready; i++, ready >>= 1) {
+    if(!(ready & 1)) continue;
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
+    if(serial_tx_flush(dcb) > 0) {
+      Cond_Broadcast(&dcb->tx_ready);
+      poll_notify(&dcb->pollq);
+    }
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
   Write call 
-  This is currently a polling driver.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
   unsigned int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
+    if(dcb->tx_count == SERIAL_TX_BUFFER && serial_tx_flush(dcb) == 0) {
+      if(stream_nonblocking()) break;
+      kernel_mxwait(&dcb->spinlock, &dcb->tx_ready, SCHED_IO);
+      continue;
     }
-    else
-      break;
+
+    /* Copy into the free space after the tail of the ring */
+    uint tail = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_BUFFER;
+    uint n = (tail >= dcb->tx_head) ? SERIAL_TX_BUFFER - tail : dcb->tx_head - tail;
+    if(n > SERIAL_TX_BUFFER - dcb->tx_count) n = SERIAL_TX_BUFFER - dcb->tx_count;
+    if(n > size - count) n = size - count;
+    memcpy(dcb->tx_buf+tail, buf+count, n);
+    dcb->tx_count += n;
+    count += n;
   }
+  serial_tx_flush(dcb);
+
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
 
-  return count;  
+  return (count==0 && size>0) ? WOULDBLOCK : count;  
 }
 
 
+/*
+  The device cannot be queried without reading from it, so the bytes
+  read are kept for the next serial_read.
+ */
+int serial_poll(void* dev, int events, struct poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  int mask = (serial_rx_fill(dcb) ? POLL_READ : 0)
+    | (dcb->tx_count < SERIAL_TX_BUFFER ? POLL_WRITE : 0);
+  poll_wait(pt, &dcb->pollq);
+
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return mask & events;
+}
+
+
+/*
+  Give the device some time to take the buffered output.
+ */
 int serial_close(void* dev) 
 {
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  while(dcb->tx_count > 0) {
+    if(serial_tx_flush(dcb) > 0) continue;
+    if(! kernel_mxtimedwait(&dcb->spinlock, &dcb->tx_ready, SCHED_IO, SERIAL_DRAIN_TIMEOUT))
+      break;
+  }
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
+
   return 0;
 }
 
@@ -180,7 +302,9 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Poll = serial_poll,
+  .Close = serial_close,
+  .type = STREAM_TERMINAL
 };
 
 
@@ -206,15 +330,49 @@ void initialize_devices()
   devtable[DEV_SERIAL].devnum = bios_serial_ports();
   devtable[DEV_SERIAL].dev_fops = serial_fops;
 
+  devtable[DEV_TRACE].type = DEV_TRACE;
+  devtable[DEV_TRACE].devnum = SCHED_TRACE_ENABLED;
+  devtable[DEV_TRACE].dev_fops = trace_fops;
+  initialize_trace();
+
+  devtable[DEV_BLOCK].type = DEV_BLOCK;
+  devtable[DEV_BLOCK].devnum = bios_block_devices();
+  devtable[DEV_BLOCK].dev_fops = block_fops;
+  initialize_bcache();
+
+  devtable[DEV_NET].type = DEV_NET;
+  devtable[DEV_NET].devnum = (bios_net_node() >= 0);
+  devtable[DEV_NET].dev_fops = net_fops;
+  initialize_net();
+
   /* Initialize the serial devices */
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
+    serial_dcb[i].tx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].rx_pos = serial_dcb[i].rx_len = 0;
+    serial_dcb[i].tx_head = serial_dcb[i].tx_count = 0;
+    poll_queue_init(&serial_dcb[i].pollq);
+
+    /* Spread the terminal interrupts over the cores */
+    bios_serial_interrupt_core(i, SERIAL_RX_READY, i % cpu_cores());
+    bios_serial_interrupt_core(i, SERIAL_TX_READY, i % cpu_cores());
   }
+}
 
+
+void initialize_core_devices()
+{
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+  cpu_interrupt_handler(BLOCK_DONE, bcache_done_handler);
+  cpu_interrupt_handler(NET_RX_READY, net_rx_handler);
+  cpu_interrupt_handler(NET_TX_READY, net_tx_handler);
+
+  /* Frames that arrived before the handler was installed raised no interrupt */
+  if(cpu_core_id == 0)
+    net_rx_handler();
 }
 
 
@@ -34,6 +34,12 @@
 */
 
 
+/* The segment type of vectored I/O, iovec_t in tinyos.h */
+struct io_vector;
+
+/* The state of a polling thread, see kernel_poll.h */
+struct poll_table;
+
 /**
   @brief The device-specific file operations table.
 
@@ -81,6 +87,33 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Vectored read operation (optional).
+
+    Read into the 'iovcnt' segments of 'iov', in order, stopping at the 
+    first segment that is not filled. Return the total number of bytes 
+    copied, or -1 on error. A stream that does not provide this method
+    is read by calling 'Read' once per segment.
+  */
+    int (*ReadV)(void* this, const struct io_vector* iov, int iovcnt);
+
+  /** @brief Vectored write operation (optional).
+
+    Write from the 'iovcnt' segments of 'iov', in order, stopping at the
+    first segment that is not written completely. Return the total number
+    of bytes copied, or -1 on error. A stream that does not provide this 
+    method is written by calling 'Write' once per segment.
+  */
+    int (*WriteV)(void* this, const struct io_vector* iov, int iovcnt);
+
+  /** @brief Poll operation (optional).
+
+    Return the events of 'events' that are ready for the stream, together
+    with POLL_HANGUP and POLL_ERROR if they hold. If 'pt' is not NULL, register 
+    it with poll_wait() to every queue that the stream notifies when its 
+    readiness changes. A stream without this method is always ready.
+  */
+    int (*Poll)(void* this, int events, struct poll_table* pt);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -92,6 +125,9 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief The @c stream_type of the streams, @c STREAM_OTHER if not set. */
+    int type;
 } file_ops;
 
 
@@ -104,6 +140,9 @@ typedef struct file_operations {
 typedef enum { 
 	DEV_NULL,    /**< Null device */
 	DEV_SERIAL,  /**< Serial device */
+	DEV_TRACE,   /**< Scheduler trace, @see kernel_trace.h */
+	DEV_BLOCK,   /**< Block device, @see kernel_bcache.h */
+	DEV_NET,     /**< Network device, reached through sockets, @see kernel_net.h */
 	DEV_MAX      /**< placeholder for maximum device number */
 }  Device_type;
 
@@ -133,6 +172,14 @@ typedef struct device_control_block
  */
 void initialize_devices();
 
+/**
+  @brief Install the interrupt handlers of the devices on the current core.
+
+  This function is called at kernel startup by every core, after
+  @c initialize_devices(), since an interrupt can be delivered to any core.
+ */
+void initialize_core_devices();
+
 
 /**
   @brief Open a device.
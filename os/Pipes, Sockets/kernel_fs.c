@@ -0,0 +1,547 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_fs.h"
+#include "kernel_proc.h"
+#include "kernel_cc.h"
+
+
+static fs_inode fs_root;
+static Mutex fs_lock = MUTEX_INIT;      /* Protects the namespace, the cache and the refs of the inodes */
+
+static rhash fs_dcache;
+static rhash_slot fs_dcache_slots[FS_DCACHE_SLOTS];
+
+
+static void fs_inode_init(fs_inode* ino, file_type type)
+{
+	ino->type = type;
+	ino->refs = 0;
+	rlnode_init(& ino->entries, NULL);
+	ino->nentries = 0;
+	ino->lock = MUTEX_INIT;
+	ino->size = 0;
+	ino->ext = NULL;
+	ino->next = 0;
+	ino->ext_cap = 0;
+}
+
+static fs_inode* fs_inode_new(file_type type)
+{
+	fs_inode* ino = xmalloc(sizeof(fs_inode));
+	fs_inode_init(ino, type);
+	return ino;
+}
+
+/* Drop a reference to an inode, releasing it with the last one. The caller holds fs_lock. */
+static void fs_decref(fs_inode* ino)
+{
+	assert(ino->refs > 0 && ino != & fs_root);
+	if(--ino->refs > 0) return;
+
+	assert(is_rlist_empty(& ino->entries));
+	for(unsigned int i=0; i<ino->next; i++)
+		free(ino->ext[i].data);
+	free(ino->ext);
+	free(ino);
+}
+
+
+void initialize_fs()
+{
+	fs_inode_init(& fs_root, FILE_DIRECTORY);
+	fs_root.refs = 1;
+	rhash_init(& fs_dcache, fs_dcache_slots, FS_DCACHE_SLOTS);
+	fs_lock = MUTEX_INIT;
+	lock_profile_name(& fs_lock, "fs_lock", -1);
+}
+
+/* Remove the entries of a directory, releasing the inodes that only they hold */
+static void fs_release_tree(fs_inode* dir)
+{
+	while(! is_rlist_empty(& dir->entries)) {
+		fs_dentry* d = rlist_pop_front(& dir->entries)->obj;
+		if(d->ino->type == FILE_DIRECTORY) fs_release_tree(d->ino);
+		fs_decref(d->ino);
+		free(d);
+	}
+	dir->nentries = 0;
+}
+
+void finalize_fs()
+{
+	fs_release_tree(& fs_root);
+}
+
+
+
+/*
+	The path cache.
+
+	The key of an entry mixes the address of its directory with its name.
+	Two entries with the same key share a slot, so the cache keeps the
+	last one looked up, and a hit is checked against the name. When the
+	map is full, it is emptied.
+ */
+
+static uintptr_t fs_dcache_key(fs_inode* dir, const char* name)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ (uintptr_t) dir;
+	for(const char* p = name; *p; p++)
+		h = (h ^ (unsigned char) *p) * 0x100000001b3ull;
+	return (uintptr_t) h | 1;
+}
+
+/* Return the entry of a name in a directory, or NULL. The caller holds fs_lock. */
+static fs_dentry* fs_lookup(fs_inode* dir, const char* name)
+{
+	uintptr_t key = fs_dcache_key(dir, name);
+	rhash_slot* s = rhash_find(& fs_dcache, key);
+	if(s != NULL) {
+		fs_dentry* d = s->obj;
+		if(d->dir == dir && strcmp(d->name, name) == 0) return d;
+	}
+
+	for(rlnode* p = dir->entries.next; p != & dir->entries; p = p->next) {
+		fs_dentry* d = p->obj;
+		if(strcmp(d->name, name) == 0) {
+			if((s = rhash_insert(& fs_dcache, key)) == NULL) {
+				rhash_init(& fs_dcache, fs_dcache_slots, FS_DCACHE_SLOTS);
+				s = rhash_insert(& fs_dcache, key);
+			}
+			s->obj = d;
+			return d;
+		}
+	}
+	return NULL;
+}
+
+/* Add an entry for a new inode. The caller holds fs_lock. */
+static void fs_link(fs_inode* dir, const char* name, fs_inode* ino)
+{
+	fs_dentry* d = xmalloc(sizeof(fs_dentry));
+	rlnode_init(& d->node, d);
+	d->dir = dir;
+	d->ino = ino;
+	strcpy(d->name, name);
+	rlist_push_back(& dir->entries, & d->node);
+	dir->nentries++;
+	ino->refs++;
+}
+
+/* Remove an entry, and drop its reference. The caller holds fs_lock. */
+static void fs_unlink(fs_dentry* d)
+{
+	rhash_slot* s = rhash_find(& fs_dcache, fs_dcache_key(d->dir, d->name));
+	if(s != NULL && s->obj == d) rhash_erase(& fs_dcache, s);
+
+	rlist_remove(& d->node);
+	d->dir->nentries--;
+	fs_decref(d->ino);
+	free(d);
+}
+
+/*
+	Resolve all but the last name of a path, which is copied to name. Return
+	the directory that should hold the last name, or NULL if the path is
+	illegal or a directory on it does not exist. The last name of the root
+	is empty. The caller holds fs_lock.
+ */
+static fs_inode* fs_parent(const char* path, char* name)
+{
+	if(path == NULL || path[0] != '/') return NULL;
+
+	fs_inode* dir = & fs_root;
+	const char* p = path;
+	for(;;) {
+		while(*p == '/') p++;
+		const char* end = strchrnul(p, '/');
+		size_t len = end - p;
+		if(len > MAX_NAME_LENGTH) return NULL;
+		memcpy(name, p, len);
+		name[len] = '\0';
+
+		const char* q = end;
+		while(*q == '/') q++;
+		if(*q == '\0') return dir;
+
+		fs_dentry* d = fs_lookup(dir, name);
+		if(d == NULL || d->ino->type != FILE_DIRECTORY) return NULL;
+		dir = d->ino;
+		p = end;
+	}
+}
+
+/* Return the inode of a path, or NULL. The caller holds fs_lock. */
+static fs_inode* fs_resolve(const char* path)
+{
+	char name[MAX_NAME_LENGTH+1];
+	fs_inode* dir = fs_parent(path, name);
+	if(dir == NULL) return NULL;
+	if(name[0] == '\0') return dir;
+	fs_dentry* d = fs_lookup(dir, name);
+	return d ? d->ino : NULL;
+}
+
+
+
+/*
+	File contents.
+ */
+
+/* Return the index of the extent holding offset pos, which is allocated */
+static unsigned int fs_extent_of(fs_inode* ino, unsigned long pos)
+{
+	unsigned int lo = 0, hi = ino->next - 1;
+	while(lo < hi) {
+		unsigned int mid = (lo + hi + 1) / 2;
+		if(ino->ext[mid].start <= pos) lo = mid; else hi = mid - 1;
+	}
+	return lo;
+}
+
+/* Add extents until the file can hold size bytes. The caller holds the lock of the inode. */
+static void fs_reserve(fs_inode* ino, unsigned long size)
+{
+	unsigned long alloc = ino->next ? ino->ext[ino->next-1].start + ino->ext[ino->next-1].size : 0;
+	while(alloc < size) {
+		unsigned long n = (alloc > size - alloc) ? alloc : size - alloc;
+		n = (n + FS_PAGE_SIZE - 1) & ~(unsigned long)(FS_PAGE_SIZE - 1);
+		if(n > FS_MAX_EXTENT) n = FS_MAX_EXTENT;
+
+		if(ino->next == ino->ext_cap) {
+			ino->ext_cap = ino->ext_cap ? 2*ino->ext_cap : 4;
+			ino->ext = xrealloc(ino->ext, ino->ext_cap * sizeof(fs_extent));
+		}
+		char* data = aligned_alloc(FS_PAGE_SIZE, n);
+		if(data == NULL) FATAL("virtual memory exhausted");
+		ino->ext[ino->next++] = (fs_extent){ data, alloc, n };
+		alloc += n;
+	}
+}
+
+/* Copy between buf and bytes [pos, pos+n) of the file, which are allocated */
+static void fs_copy(fs_inode* ino, unsigned long pos, char* buf, unsigned long n, int write)
+{
+	if(n == 0) return;
+	for(unsigned int i = fs_extent_of(ino, pos); n > 0; i++) {
+		fs_extent* e = & ino->ext[i];
+		unsigned long off = pos - e->start;
+		unsigned long len = e->size - off;
+		if(len > n) len = n;
+		if(write) memcpy(e->data + off, buf, len); else memcpy(buf, e->data + off, len);
+		pos += len;
+		buf += len;
+		n -= len;
+	}
+}
+
+/* Zero bytes [from, to) of the file, which are allocated */
+static void fs_zero(fs_inode* ino, unsigned long from, unsigned long to)
+{
+	if(from >= to) return;
+	for(unsigned int i = fs_extent_of(ino, from); from < to; i++) {
+		fs_extent* e = & ino->ext[i];
+		unsigned long end = e->start + e->size;
+		if(end > to) end = to;
+		memset(e->data + (from - e->start), 0, end - from);
+		from = end;
+	}
+}
+
+
+
+/*
+	The file streams.
+ */
+
+typedef struct fs_file {
+	fs_inode* ino;
+	int flags;
+	unsigned long pos;          /* Protected by the lock of the inode */
+} fs_file;
+
+
+static int fs_read(void* this, char* buf, unsigned int size)
+{
+	fs_file* f = this;
+	fs_inode* ino = f->ino;
+	if(! (f->flags & OPEN_RDONLY)) return -1;
+
+	Mutex_Lock(& ino->lock);
+	unsigned long n = (f->pos < ino->size) ? ino->size - f->pos : 0;
+	if(n > size) n = size;
+	fs_copy(ino, f->pos, buf, n, 0);
+	f->pos += n;
+	Mutex_Unlock(& ino->lock);
+	return n;
+}
+
+static int fs_write(void* this, const char* buf, unsigned int size)
+{
+	fs_file* f = this;
+	fs_inode* ino = f->ino;
+	if(! (f->flags & OPEN_WRONLY)) return -1;
+
+	Mutex_Lock(& ino->lock);
+	if(f->flags & OPEN_APPEND) f->pos = ino->size;
+
+	unsigned long n = (f->pos < MAX_FILE_SIZE) ? MAX_FILE_SIZE - f->pos : 0;
+	if(n > size) n = size;
+	if(n == 0 && size > 0) {
+		Mutex_Unlock(& ino->lock);
+		return -1;
+	}
+
+	fs_reserve(ino, f->pos + n);
+	if(f->pos > ino->size) fs_zero(ino, ino->size, f->pos);
+	fs_copy(ino, f->pos, (char*) buf, n, 1);
+	f->pos += n;
+	if(f->pos > ino->size) ino->size = f->pos;
+	Mutex_Unlock(& ino->lock);
+	return n;
+}
+
+static int fs_close(void* this)
+{
+	fs_file* f = this;
+	Mutex_Lock(& fs_lock);
+	fs_decref(f->ino);
+	Mutex_Unlock(& fs_lock);
+	free(f);
+	return 0;
+}
+
+static file_ops fs_fops = {
+	.Open = NULL,
+	.Read = fs_read,
+	.Write = fs_write,
+	.Close = fs_close,
+	.type = STREAM_FILE
+};
+
+
+
+/*
+	The system calls.
+ */
+
+Fid_t sys_Open(const char* path, int flags)
+{
+	if((flags & OPEN_RDWR) == 0) return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	fs_inode* ino = NULL;
+	char name[MAX_NAME_LENGTH+1];
+
+	Mutex_Lock(& fs_lock);
+	fs_inode* dir = fs_parent(path, name);
+	if(dir != NULL && name[0] != '\0') {
+		fs_dentry* d = fs_lookup(dir, name);
+		if(d == NULL && (flags & OPEN_CREAT)) {
+			ino = fs_inode_new(FILE_REGULAR);
+			fs_link(dir, name, ino);
+		}
+		else if(d != NULL && d->ino->type == FILE_REGULAR
+				&& (flags & (OPEN_CREAT|OPEN_EXCL)) != (OPEN_CREAT|OPEN_EXCL))
+			ino = d->ino;
+	}
+	if(ino) ino->refs++;
+	Mutex_Unlock(& fs_lock);
+
+	if(ino == NULL) {
+		FCB_unreserve(1, &fid, &fcb);
+		return NOFILE;
+	}
+
+	if((flags & OPEN_TRUNC) && (flags & OPEN_WRONLY)) {
+		Mutex_Lock(& ino->lock);
+		ino->size = 0;
+		Mutex_Unlock(& ino->lock);
+	}
+
+	fs_file* f = xmalloc(sizeof(fs_file));
+	f->ino = ino;
+	f->flags = flags;
+	f->pos = 0;
+
+	fcb->streamobj = f;
+	fcb->streamfunc = & fs_fops;
+	return fid;
+}
+
+
+long sys_Seek(Fid_t fid, long offset, seek_whence whence)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL) return -1;
+
+	long pos = -1;
+	if(fcb->streamfunc == & fs_fops) {
+		fs_file* f = fcb->streamobj;
+		Mutex_Lock(& f->ino->lock);
+		long base = (whence == SEEK_FROM_START) ? 0
+			: (whence == SEEK_FROM_CURRENT) ? (long) f->pos
+			: (whence == SEEK_FROM_END) ? (long) f->ino->size : -1;
+		if(base >= 0 && offset >= -base && offset <= (long) MAX_FILE_SIZE - base) {
+			pos = base + offset;
+			f->pos = pos;
+		}
+		Mutex_Unlock(& f->ino->lock);
+	}
+
+	FCB_decref(fcb);
+	return pos;
+}
+
+
+int sys_Stat(const char* path, file_info* info)
+{
+	if(info == NULL) return -1;
+
+	Mutex_Lock(& fs_lock);
+	fs_inode* ino = fs_resolve(path);
+	if(ino != NULL) {
+		info->type = ino->type;
+		if(ino->type == FILE_DIRECTORY) {
+			info->size = ino->nentries;
+			info->extents = 0;
+		}
+		else {
+			Mutex_Lock(& ino->lock);
+			info->size = ino->size;
+			info->extents = ino->next;
+			Mutex_Unlock(& ino->lock);
+		}
+	}
+	Mutex_Unlock(& fs_lock);
+
+	return ino ? 0 : -1;
+}
+
+
+int sys_MkDir(const char* path)
+{
+	int rc = -1;
+	char name[MAX_NAME_LENGTH+1];
+
+	Mutex_Lock(& fs_lock);
+	fs_inode* dir = fs_parent(path, name);
+	if(dir != NULL && name[0] != '\0' && fs_lookup(dir, name) == NULL) {
+		fs_link(dir, name, fs_inode_new(FILE_DIRECTORY));
+		rc = 0;
+	}
+	Mutex_Unlock(& fs_lock);
+	return rc;
+}
+
+
+int sys_Unlink(const char* path)
+{
+	int rc = -1;
+	char name[MAX_NAME_LENGTH+1];
+
+	Mutex_Lock(& fs_lock);
+	fs_inode* dir = fs_parent(path, name);
+	fs_dentry* d = (dir != NULL && name[0] != '\0') ? fs_lookup(dir, name) : NULL;
+	if(d != NULL && is_rlist_empty(& d->ino->entries)) {
+		fs_unlink(d);
+		rc = 0;
+	}
+	Mutex_Unlock(& fs_lock);
+	return rc;
+}
+
+
+void* sys_MapFile(Fid_t fid, unsigned long offset, unsigned int* len)
+{
+	if(len == NULL) return NULL;
+
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL) return NULL;
+
+	void* addr = NULL;
+	if(fcb->streamfunc == & fs_fops) {
+		fs_inode* ino = ((fs_file*) fcb->streamobj)->ino;
+
+		Mutex_Lock(& ino->lock);
+		if(offset < ino->size) {
+			fs_extent* e = & ino->ext[fs_extent_of(ino, offset)];
+			unsigned long end = e->start + e->size;
+			if(end > ino->size) end = ino->size;
+			addr = e->data + (offset - e->start);
+			*len = end - offset;
+		}
+		Mutex_Unlock(& ino->lock);
+	}
+
+	if(addr != NULL) {
+		fs_inode* ino = ((fs_file*) fcb->streamobj)->ino;
+		Mutex_Lock(& fs_lock);
+		ino->refs++;
+		Mutex_Unlock(& fs_lock);
+
+		PCB* pcb = CURPROC;
+		fs_mapping* m = arena_alloc(& pcb->arena, sizeof(fs_mapping));
+		m->ino = ino;
+		m->addr = addr;
+		rlnode_init(& m->node, m);
+
+		Mutex_Lock(& pcb->fidt_lock);
+		rlist_push_back(& pcb->map_list, & m->node);
+		Mutex_Unlock(& pcb->fidt_lock);
+	}
+
+	FCB_decref(fcb);
+	return addr;
+}
+
+
+/* Drop the reference of a mapping, and free it */
+static void fs_unmap(PCB* pcb, fs_mapping* m)
+{
+	Mutex_Lock(& fs_lock);
+	fs_decref(m->ino);
+	Mutex_Unlock(& fs_lock);
+	arena_free(& pcb->arena, m, sizeof(fs_mapping));
+}
+
+int sys_UnmapFile(void* addr)
+{
+	PCB* pcb = CURPROC;
+	fs_mapping* m = NULL;
+
+	Mutex_Lock(& pcb->fidt_lock);
+	for(rlnode* p = pcb->map_list.next; p != & pcb->map_list; p = p->next) {
+		if(((fs_mapping*) p->obj)->addr == addr) {
+			m = p->obj;
+			rlist_remove(p);
+			break;
+		}
+	}
+	Mutex_Unlock(& pcb->fidt_lock);
+
+	if(m == NULL)
+		return -1;
+
+	fs_unmap(pcb, m);
+	return 0;
+}
+
+
+void fs_unmap_all(PCB* pcb)
+{
+	Mutex_Lock(& pcb->fidt_lock);
+	while(! is_rlist_empty(& pcb->map_list)) {
+		fs_mapping* m = rlist_pop_front(& pcb->map_list)->obj;
+		Mutex_Unlock(& pcb->fidt_lock);
+		fs_unmap(pcb, m);
+		Mutex_Lock(& pcb->fidt_lock);
+	}
+	Mutex_Unlock(& pcb->fidt_lock);
+}
@@ -0,0 +1,107 @@
+#ifndef __KERNEL_FS_H
+#define __KERNEL_FS_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_streams.h"
+
+/**
+	@file kernel_fs.h
+	@brief The memory filesystem.
+
+	@defgroup fs Filesystem
+	@ingroup kernel
+	@brief The memory filesystem.
+
+	The files and directories are inodes, kept in memory. A directory holds
+	a list of entries, each naming an inode. Looking up a name in a directory
+	first tries the path cache, a hash map from (directory, name) to entries
+	of @c FS_DCACHE_SLOTS slots, which is filled by the lookups that scan the
+	list. The namespace, the cache and the reference counts of the inodes are
+	protected by @c fs_lock.
+
+	The contents of a file are held in extents, pieces of contiguous memory
+	that never move. Each extent is as large as all the previous ones together,
+	within [@c FS_PAGE_SIZE, @c FS_MAX_EXTENT], so a file has few extents and
+	@c MapFile() can return long runs of it. A truncated file keeps its
+	extents, so that its mappings stay valid. The size and the extents of a
+	file, and the positions of its streams, are protected by the lock of
+	the inode.
+
+	An inode is held by its entry, its streams and its mappings, and is
+	released when the last of them goes. The mappings of a process are kept
+	in its @c map_list, protected by its @c fidt_lock, and are unmapped when
+	the process exits.
+
+	@{
+*/
+
+/** @brief The unit of allocation of file contents */
+#define FS_PAGE_SIZE 4096
+
+/** @brief The largest extent */
+#define FS_MAX_EXTENT (1024*1024)
+
+/** @brief The slots of the path cache, a power of 2 */
+#define FS_DCACHE_SLOTS 1024
+
+
+/** @brief An extent of a file, holding bytes [start, start+size) */
+typedef struct fs_extent
+{
+	char* data;                 /**< @brief The memory of the extent */
+	unsigned long start;        /**< @brief The offset of its first byte in the file */
+	unsigned long size;         /**< @brief Its size in bytes, a multiple of @c FS_PAGE_SIZE */
+} fs_extent;
+
+
+/** @brief A file or directory */
+typedef struct fs_inode
+{
+	file_type type;             /**< @brief The kind of inode */
+	unsigned int refs;          /**< @brief The entry, streams and mappings that hold the inode */
+
+	/* Directories */
+	rlnode entries;             /**< @brief The entries of a directory */
+	unsigned long nentries;     /**< @brief Their number */
+
+	/* Files */
+	Mutex lock;                 /**< @brief Protects the fields below, and the positions of the streams */
+	unsigned long size;         /**< @brief The size of the file */
+	fs_extent* ext;             /**< @brief The extents, in order */
+	unsigned int next;          /**< @brief The number of extents */
+	unsigned int ext_cap;       /**< @brief The capacity of @c ext */
+} fs_inode;
+
+
+/** @brief An entry of a directory */
+typedef struct fs_dentry
+{
+	rlnode node;                /**< @brief Node in the @c entries of the directory */
+	fs_inode* dir;              /**< @brief The directory */
+	fs_inode* ino;              /**< @brief The inode named by the entry */
+	char name[MAX_NAME_LENGTH+1];
+} fs_dentry;
+
+
+/** @brief A mapping of a process, in its @c map_list */
+typedef struct fs_mapping
+{
+	rlnode node;                /**< @brief Node in @c map_list, pointing to the mapping */
+	fs_inode* ino;              /**< @brief The mapped file */
+	void* addr;                 /**< @brief The address returned by @c MapFile */
+} fs_mapping;
+
+
+/** @brief Initialize an empty filesystem. This is called at kernel startup. */
+void initialize_fs();
+
+/** @brief Release the filesystem. This is called at kernel shutdown. */
+void finalize_fs();
+
+/** @brief Unmap the mappings of the process. This is called at process exit. */
+void fs_unmap_all(PCB* pcb);
+
+/** @} */
+
+#endif
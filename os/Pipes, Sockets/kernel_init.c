@@ -9,6 +9,8 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_fs.h"
 
 
 
@@ -35,9 +37,11 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    lock_profile_init();
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_fs();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -47,6 +51,9 @@ void boot_tinyos_kernel()
 
   cpu_core_barrier_sync();
 
+  /* The devices interrupt every core */
+  initialize_core_devices();
+
 #ifndef NVALGRIND
   VALGRIND_PRINTF_BACKTRACE("TINYOS: Entering scheduler for core %d\n",cpu_core_id);
 #endif
@@ -55,6 +62,8 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+    finalize_fs();
+    lock_profile_report();
   }
 }
 
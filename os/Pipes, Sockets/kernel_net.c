@@ -0,0 +1,677 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_net.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_poll.h"
+
+
+/*
+	The frames of the protocol start with a header. The connections are
+	named by an id, which holds the index of the connection in CONN and
+	its generation, so that the frames of an old connection are not taken
+	by the next one in the same slot.
+ */
+enum { FRAME_SYN, FRAME_SYNACK, FRAME_DATA, FRAME_WINDOW, FRAME_SHUTDOWN };
+
+typedef struct net_header {
+	uint type;
+	uint dst;       /* The connection of the receiver, 0 for FRAME_SYN */
+	uint src;       /* The connection of the sender */
+	uint arg;       /* SYN: the port connected to, WINDOW: the credit, SHUTDOWN: the directions */
+	uint port;      /* The port of the sender */
+} net_header;
+
+/* The data bytes of a frame */
+#define NET_PAYLOAD (BIOS_NET_MTU - sizeof(net_header))
+
+/* The frames moved to or from the bios by one call */
+#define NET_BATCH 8
+
+/* The replies to frames of unknown connections, waiting for the transmit ring */
+#define NET_RESETS 16
+
+typedef enum {
+	NET_FREE,
+	NET_CONNECTING,     /* A connect sends SYN frames */
+	NET_REQUESTED,      /* A SYN is queued on a listener */
+	NET_ESTABLISHED,
+	NET_CLOSING         /* The socket closed, a SHUTDOWN frame is still to be sent */
+} net_state;
+
+/* The control frames that a connection has to send, in this order */
+enum { CTL_SYN = 1, CTL_SYNACK = 2, CTL_WINDOW = 4, CTL_SHUTDOWN = 8 };
+
+struct net_conn {
+	net_state state;
+	uint gen;
+	uint node;              /* The other node */
+	uint remote_id;         /* The connection on the other node */
+	port_t port, peer_port;
+
+	CondVar cv;             /* Connects, readers, and writers waiting for credit */
+	poll_queue pollq;
+
+	/* The bytes received and not read, a ring of NET_WINDOW bytes */
+	char* rx_buf;
+	uint rx_head, rx_count;
+	uint rx_consumed;       /* The bytes read, not given back as credit yet */
+	uint tx_credit;         /* The bytes the other end has room for */
+
+	int rx_eof;             /* The other end shut down its write direction */
+	int tx_closed;          /* The other end shut down its read direction */
+	int failed;             /* A connect was refused */
+	int shut[2];            /* The directions shut down here */
+
+	uint ctl;               /* The control frames to send */
+	uint shut_tx;           /* The directions of the SHUTDOWN frame to send */
+
+	request_t request;      /* The request of a SYN, queued on a listener */
+};
+
+
+/* The driver is protected by one spinlock, taken with preemption off */
+static Mutex nic_spinlock = MUTEX_INIT;
+
+/* Writers waiting for room in the transmit ring */
+static CondVar nic_tx_cv = COND_INIT;
+
+static net_conn CONN[NET_MAX_CONNS];
+
+/* Bit i is set if CONN[i] has control frames to send */
+static uint64_t ctl_pending;
+
+static struct { uint node, dst; } resets[NET_RESETS];
+static uint nresets;
+
+/* The frames passed to the bios */
+static net_frame tx_batch[NET_BATCH], rx_batch[NET_BATCH], ctl_frame;
+
+_Static_assert(NET_MAX_CONNS <= 64, "ctl_pending has a bit per connection");
+
+#define NET_ID(c) (((c)->gen << 8) | (uint)((c) - CONN + 1))
+
+/* The connection of an id, or NULL */
+static net_conn* net_conn_of(uint id)
+{
+	uint i = (id & 0xff) - 1;
+	if(i >= NET_MAX_CONNS) return NULL;
+	net_conn* c = & CONN[i];
+	return (c->state != NET_FREE && c->gen == (id >> 8)) ? c : NULL;
+}
+
+static net_conn* net_conn_alloc()
+{
+	for(uint i=0; i<NET_MAX_CONNS; i++) {
+		net_conn* c = & CONN[i];
+		if(c->state != NET_FREE) continue;
+		c->remote_id = 0;
+		c->cv = COND_INIT;
+		poll_queue_init(& c->pollq);
+		c->rx_buf = NULL;
+		c->rx_head = c->rx_count = c->rx_consumed = 0;
+		c->tx_credit = 0;
+		c->rx_eof = c->tx_closed = c->failed = 0;
+		c->shut[0] = c->shut[1] = 0;
+		c->ctl = c->shut_tx = 0;
+		return c;
+	}
+	return NULL;
+}
+
+/* The buffer, if any, is released by the caller */
+static void net_conn_free(net_conn* c)
+{
+	c->state = NET_FREE;
+	c->gen = (c->gen + 1) & 0xffffff;
+	c->ctl = 0;
+	ctl_pending &= ~(1ull << (c - CONN));
+}
+
+/* Wake up everyone waiting on a connection */
+static void net_conn_notify(net_conn* c)
+{
+	Cond_Broadcast(& c->cv);
+	poll_notify(& c->pollq);
+}
+
+
+/*
+	Control frames are sent one at a time, since they are few. A frame
+	that does not fit the transmit ring is kept, and the data frames of
+	all connections wait until the kept frames are sent, so that a
+	connection never sends data ahead of its SYNACK, or after its
+	SHUTDOWN.
+ */
+
+static int net_send_header(uint node, const net_header* h)
+{
+	ctl_frame.node = node;
+	ctl_frame.size = sizeof(net_header);
+	memcpy(ctl_frame.data, h, sizeof(net_header));
+	return bios_net_send(& ctl_frame, 1);
+}
+
+static void net_ctl(net_conn* c, uint ctl)
+{
+	c->ctl |= ctl;
+	ctl_pending |= 1ull << (c - CONN);
+}
+
+/* Reply to a frame of a connection that is not known */
+static void net_reset(uint node, uint dst)
+{
+	if(nresets == NET_RESETS) return;
+	resets[nresets].node = node;
+	resets[nresets].dst = dst;
+	nresets++;
+}
+
+/* Send the control frames of a connection. Return 0 if the ring is full. */
+static int net_ctl_send(net_conn* c)
+{
+	while(c->ctl) {
+		net_header h = { .dst = c->remote_id, .src = NET_ID(c), .arg = 0, .port = c->port };
+		uint bit;
+		if(c->ctl & CTL_SYN) {
+			bit = CTL_SYN; h.type = FRAME_SYN; h.dst = 0; h.arg = c->peer_port;
+		} else if(c->ctl & CTL_SYNACK) {
+			bit = CTL_SYNACK; h.type = FRAME_SYNACK;
+		} else if(c->ctl & CTL_WINDOW) {
+			bit = CTL_WINDOW; h.type = FRAME_WINDOW; h.arg = c->rx_consumed;
+		} else {
+			bit = CTL_SHUTDOWN; h.type = FRAME_SHUTDOWN; h.arg = c->shut_tx;
+		}
+
+		if(! net_send_header(c->node, &h)) return 0;
+		c->ctl &= ~bit;
+		if(bit == CTL_WINDOW) c->rx_consumed = 0;
+		if(bit == CTL_SHUTDOWN) c->shut_tx = 0;
+	}
+	if(c->state == NET_CLOSING) net_conn_free(c);
+	return 1;
+}
+
+/* Send the pending control frames. Return 0 if some are left. */
+static int net_ctl_flush()
+{
+	while(nresets > 0) {
+		net_header h = { FRAME_SHUTDOWN, resets[nresets-1].dst, 0, SHUTDOWN_BOTH, NOPORT };
+		if(! net_send_header(resets[nresets-1].node, &h)) return 0;
+		nresets--;
+	}
+	while(ctl_pending) {
+		int i = __builtin_ctzll(ctl_pending);
+		if(! net_ctl_send(& CONN[i])) return 0;
+		ctl_pending &= ~(1ull << i);
+	}
+	return 1;
+}
+
+
+/*
+	Receiving.
+ */
+
+/* A SYN from another node */
+static void net_rx_syn(uint node, const net_header* h)
+{
+	/* A SYN sent again, since the connect did not hear from us yet */
+	for(uint i=0; i<NET_MAX_CONNS; i++) {
+		net_conn* c = & CONN[i];
+		if(c->state > NET_CONNECTING && c->node == node && c->remote_id == h->src) {
+			if(c->state == NET_ESTABLISHED) net_ctl(c, CTL_SYNACK);
+			return;
+		}
+	}
+
+	net_conn* c = net_conn_alloc();
+	if(c == NULL) {
+		net_reset(node, h->src);
+		return;
+	}
+	c->state = NET_REQUESTED;
+	c->node = node;
+	c->remote_id = h->src;
+	c->port = h->arg;
+	c->peer_port = h->port;
+	c->request.remote = c;
+
+	int rc = socket_remote_request(c->port, & c->request);
+	if(rc == 0) return;
+
+	/* A busy port is left to the next SYN */
+	net_conn_free(c);
+	if(rc < 0) net_reset(node, h->src);
+}
+
+/* Data for a connection. The other end sends no more than its credit. */
+static void net_rx_data(net_conn* c, const char* data, uint size)
+{
+	if(c->state != NET_ESTABLISHED || c->shut[0]) return;
+	if(size > NET_WINDOW - c->rx_count) size = NET_WINDOW - c->rx_count;
+
+	uint tail = (c->rx_head + c->rx_count) % NET_WINDOW;
+	uint n = NET_WINDOW - tail;
+	if(n > size) n = size;
+	memcpy(c->rx_buf + tail, data, n);
+	memcpy(c->rx_buf, data + n, size - n);
+	c->rx_count += size;
+	net_conn_notify(c);
+}
+
+static void net_rx_frame(const net_frame* f)
+{
+	net_header h;
+	if(f->size < sizeof(h)) return;
+	memcpy(&h, f->data, sizeof(h));
+
+	if(h.type == FRAME_SYN) {
+		net_rx_syn(f->node, &h);
+		return;
+	}
+
+	/* A connect does not know the connection of the listener yet */
+	net_conn* c = net_conn_of(h.dst);
+	if(c == NULL || c->node != f->node
+			|| (c->state == NET_CONNECTING ? h.type != FRAME_SYNACK && h.type != FRAME_SHUTDOWN
+				: c->remote_id != h.src)) {
+		/* Resets are not answered, or they would bounce forever */
+		if(h.type != FRAME_SHUTDOWN) net_reset(f->node, h.src);
+		return;
+	}
+
+	switch(h.type) {
+		case FRAME_SYNACK:
+			if(c->state == NET_CONNECTING) {
+				c->remote_id = h.src;
+				c->tx_credit = NET_WINDOW;
+				c->ctl &= ~CTL_SYN;
+				c->state = NET_ESTABLISHED;
+				net_conn_notify(c);
+			}
+			break;
+		case FRAME_DATA:
+			net_rx_data(c, f->data + sizeof(h), f->size - sizeof(h));
+			break;
+		case FRAME_WINDOW:
+			c->tx_credit += h.arg;
+			net_conn_notify(c);
+			break;
+		case FRAME_SHUTDOWN:
+			if(c->state == NET_CONNECTING) c->failed = 1;
+			if(h.arg & SHUTDOWN_WRITE) c->rx_eof = 1;
+			if(h.arg & SHUTDOWN_READ) c->tx_closed = 1;
+			net_conn_notify(c);
+			break;
+	}
+}
+
+void net_rx_handler()
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+
+	/* The interrupt is raised again only after a batch comes short */
+	uint n;
+	do {
+		n = bios_net_receive(rx_batch, NET_BATCH);
+		for(uint i=0; i<n; i++)
+			net_rx_frame(& rx_batch[i]);
+	} while(n == NET_BATCH);
+
+	/* The replies */
+	net_ctl_flush();
+
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+}
+
+void net_tx_handler()
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	if(net_ctl_flush())
+		Cond_Broadcast(& nic_tx_cv);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+}
+
+
+/*
+	Connections.
+ */
+
+int net_connect(SCB* socket, uint node, port_t port, TimerDuration timeout)
+{
+	char* buf = xmalloc(NET_WINDOW);
+	TimerDuration deadline = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : bios_clock() + timeout;
+	net_conn* c;
+
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+
+	c = net_conn_alloc();
+	if(c != NULL) {
+		c->state = NET_CONNECTING;
+		c->node = node;
+		c->port = socket->portNum;
+		c->peer_port = port;
+		c->rx_buf = buf;
+
+		/* The SYN is sent again, in case the listener was busy */
+		while(c->state == NET_CONNECTING && !c->failed) {
+			TimerDuration wait = NET_SYN_RETRY * 1000ul;
+			if(deadline != NO_TIMEOUT) {
+				TimerDuration now = bios_clock();
+				if(now >= deadline) break;
+				if(deadline - now < wait) wait = deadline - now;
+			}
+			net_ctl(c, CTL_SYN);
+			net_ctl_flush();
+			kernel_mxtimedwait(& nic_spinlock, & c->cv, SCHED_IO, wait);
+		}
+
+		if(c->state == NET_ESTABLISHED)
+			buf = NULL;
+		else {
+			net_conn_free(c);
+			c = NULL;
+		}
+	}
+
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+
+	free(buf);
+	if(c == NULL) return -1;
+
+	socket_remote_peer(socket, c);
+	return 0;
+}
+
+
+void net_accept(request_t* request, SCB* socket)
+{
+	net_conn* c = request->remote;
+	char* buf = xmalloc(NET_WINDOW);
+
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	c->rx_buf = buf;
+	c->tx_credit = NET_WINDOW;
+	c->state = NET_ESTABLISHED;
+	net_ctl(c, CTL_SYNACK);
+	net_ctl_flush();
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+
+	socket_remote_peer(socket, c);
+}
+
+
+void net_refuse(request_t* request)
+{
+	net_conn* c = request->remote;
+
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	c->state = NET_CLOSING;
+	c->shut_tx = SHUTDOWN_BOTH;
+	net_ctl(c, CTL_SHUTDOWN);
+	net_ctl_flush();
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+}
+
+
+void net_close(net_conn* c)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	char* buf = c->rx_buf;
+	c->rx_buf = NULL;
+	c->state = NET_CLOSING;
+	c->shut_tx = SHUTDOWN_BOTH;
+	net_ctl(c, CTL_SHUTDOWN);
+	net_ctl_flush();
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+
+	free(buf);
+}
+
+
+int net_shutdown(net_conn* c, int how)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	for(int i=0; i<2; i++) {
+		if((how & (1<<i)) && ! c->shut[i]) {
+			c->shut[i] = 1;
+			c->shut_tx |= 1<<i;
+		}
+	}
+	if(c->shut_tx) {
+		net_ctl(c, CTL_SHUTDOWN);
+		net_ctl_flush();
+	}
+	net_conn_notify(c);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+	return 0;
+}
+
+
+port_t net_peer_port(net_conn* c)
+{
+	return c->peer_port;
+}
+
+
+/*
+	Reading and writing.
+ */
+
+static int net_read_locked(net_conn* c, char* buf, unsigned int size)
+{
+	while(c->rx_count == 0 && ! c->shut[0]) {
+		if(c->rx_eof || c->state != NET_ESTABLISHED || size == 0) return 0;
+		if(stream_nonblocking()) return WOULDBLOCK;
+		kernel_mxwait(& nic_spinlock, & c->cv, SCHED_PIPE);
+	}
+	if(c->shut[0]) return -1;
+
+	uint n = (size < c->rx_count) ? size : c->rx_count;
+	uint first = NET_WINDOW - c->rx_head;
+	if(first > n) first = n;
+	memcpy(buf, c->rx_buf + c->rx_head, first);
+	memcpy(buf + first, c->rx_buf, n - first);
+	c->rx_head = (c->rx_head + n) % NET_WINDOW;
+	c->rx_count -= n;
+
+	/* Give the room back to the sender in large steps */
+	c->rx_consumed += n;
+	if(c->rx_consumed >= NET_WINDOW/4) {
+		net_ctl(c, CTL_WINDOW);
+		net_ctl_flush();
+	}
+	return n;
+}
+
+int net_read(net_conn* c, char* buf, unsigned int size)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	int rc = net_read_locked(c, buf, size);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+	return rc;
+}
+
+
+/* Send a batch of data frames, within the credit. Return the bytes taken by the ring. */
+static uint net_send_data(net_conn* c, const char* buf, uint size)
+{
+	uint n = 0, nf = 0;
+	while(nf < NET_BATCH && n < size && n < c->tx_credit) {
+		uint len = size - n;
+		if(len > c->tx_credit - n) len = c->tx_credit - n;
+		if(len > NET_PAYLOAD) len = NET_PAYLOAD;
+
+		net_frame* f = & tx_batch[nf++];
+		net_header h = { FRAME_DATA, c->remote_id, NET_ID(c), 0, c->port };
+		f->node = c->node;
+		f->size = sizeof(h) + len;
+		memcpy(f->data, &h, sizeof(h));
+		memcpy(f->data + sizeof(h), buf + n, len);
+		n += len;
+	}
+
+	uint sent = bios_net_send(tx_batch, nf);
+	uint bytes = 0;
+	for(uint i=0; i<sent; i++)
+		bytes += tx_batch[i].size - sizeof(net_header);
+	c->tx_credit -= bytes;
+	return bytes;
+}
+
+static int net_write_locked(net_conn* c, const char* buf, unsigned int size)
+{
+	unsigned int count = 0;
+	while(count < size) {
+		if(c->shut[1] || c->tx_closed || c->state != NET_ESTABLISHED)
+			return count ? (int) count : -1;
+
+		/* The control frames kept go first */
+		uint n = 0;
+		int ring_full = ! net_ctl_flush();
+		if(! ring_full && c->tx_credit > 0) {
+			n = net_send_data(c, buf + count, size - count);
+			ring_full = (n == 0);
+		}
+		count += n;
+		if(n > 0) continue;
+
+		if(stream_nonblocking()) break;
+		kernel_mxwait(& nic_spinlock, ring_full ? & nic_tx_cv : & c->cv, SCHED_PIPE);
+	}
+	return (count == 0 && size > 0) ? WOULDBLOCK : (int) count;
+}
+
+int net_write(net_conn* c, const char* buf, unsigned int size)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	int rc = net_write_locked(c, buf, size);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+	return rc;
+}
+
+
+static int net_write_segment(void* obj, const char* buf, unsigned int size)
+{
+	return net_write_locked((net_conn*) obj, buf, size);
+}
+
+/* All the segments are moved under one lock acquisition. Only the first read waits. */
+int net_readv(net_conn* c, const iovec_t* iov, int iovcnt)
+{
+	int total = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	for(int i=0; i<iovcnt; i++) {
+		if(i > 0 && c->rx_count == 0) break;
+		int rc = net_read_locked(c, iov[i].base, iov[i].len);
+		if(rc < 0) {
+			if(i == 0) total = rc;
+			break;
+		}
+		total += rc;
+		if((unsigned int) rc < iov[i].len) break;
+	}
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+	return total;
+}
+
+int net_writev(net_conn* c, const iovec_t* iov, int iovcnt)
+{
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	int rc = stream_writev(c, net_write_segment, iov, iovcnt);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+	return rc;
+}
+
+
+int net_poll(net_conn* c, int events, struct poll_table* pt)
+{
+	int mask = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(& nic_spinlock);
+	if(events & POLL_READ) {
+		if(c->shut[0])
+			mask |= POLL_ERROR;
+		else {
+			if(c->rx_count > 0 || c->rx_eof) mask |= POLL_READ;
+			if(c->rx_eof) mask |= POLL_HANGUP;
+		}
+	}
+	if(events & POLL_WRITE) {
+		if(c->shut[1])
+			mask |= POLL_ERROR;
+		else if(c->tx_closed)
+			mask |= POLL_HANGUP | POLL_ERROR;
+		else if(c->tx_credit > 0)
+			mask |= POLL_WRITE;
+	}
+	poll_wait(pt, & c->pollq);
+	Mutex_Unlock(& nic_spinlock);
+	if(pre) preempt_on;
+
+	return mask & (events | POLL_HANGUP | POLL_ERROR);
+}
+
+
+int sys_GetNodeId()
+{
+	return bios_net_node();
+}
+
+
+/*
+	The device.
+ */
+
+static void* net_open(uint minor)
+{
+	return NULL;
+}
+
+static int net_dev_close(void* dev)
+{
+	return 0;
+}
+
+file_ops net_fops = {
+	.Open = net_open,
+	.Close = net_dev_close
+};
+
+
+void initialize_net()
+{
+	for(uint i=0; i<NET_MAX_CONNS; i++) {
+		CONN[i].state = NET_FREE;
+		CONN[i].gen = 0;
+	}
+	ctl_pending = 0;
+	nresets = 0;
+}
@@ -0,0 +1,103 @@
+#ifndef __KERNEL_NET_H
+#define __KERNEL_NET_H
+
+#include "kernel_socket.h"
+
+/**
+	@file kernel_net.h
+	@brief Stream sockets between the nodes of a network.
+
+	@defgroup net Network
+	@ingroup kernel
+	@brief Stream sockets between the nodes of a network.
+
+	The network device of the bios (@c DEV_NET) moves frames between the
+	machines of a network. This driver builds connections on it, so that
+	@c ConnectNode reaches a listener on another node, and the socket that
+	is connected, on either side, is read and written as if the other end
+	were local. The connection is a @c net_conn, attached to the peer of
+	each socket, in place of the local channel.
+
+	A connection is opened by a SYN frame, sent again every
+	@c NET_SYN_RETRY msec until the listener on the other node accepts it
+	with a SYNACK, or refuses it, or the connect times out. Data frames
+	carry up to a frame of bytes each. Each end has a receive buffer of
+	@c NET_WINDOW bytes, and gives the other end credit for the bytes its
+	readers take, by WINDOW frames, a quarter of the buffer at a time, so
+	the sender never overruns the buffer. A SHUTDOWN frame tells the other
+	end that a direction was shut down, or that the socket was closed.
+
+	The frames that arrive are taken in batches by the @c NET_RX_READY
+	handler, on core 0. A writer sends a batch of frames at a time, and
+	sleeps when the transmit ring is full, until @c NET_TX_READY. Control
+	frames that do not fit the ring are kept by their connection and sent
+	ahead of the next data.
+
+	Only stream sockets can span nodes. All the nodes are assumed to have
+	the same byte order.
+
+	@{
+*/
+
+/** @brief The most connections with other nodes, at a time */
+#define NET_MAX_CONNS 64
+
+/** @brief The receive buffer of a connection, in bytes */
+#define NET_WINDOW (64*1024)
+
+/** @brief The interval between the SYN frames of a connect, in msec */
+#define NET_SYN_RETRY 100
+
+/** @brief A connection with a socket on another node */
+typedef struct net_conn net_conn;
+
+/** @brief Initialize the driver. This is called at kernel startup. */
+void initialize_net();
+
+/** @brief The interrupt handler of @c NET_RX_READY */
+void net_rx_handler();
+
+/** @brief The interrupt handler of @c NET_TX_READY */
+void net_tx_handler();
+
+/** @brief The operations of the @c DEV_NET device, which is not opened by streams. */
+extern file_ops net_fops;
+
+/**
+	@brief Connect an unbound stream socket to a listener on another node.
+
+	This blocks for up to @c timeout usec. On success, the socket becomes
+	a peer of the connection.
+	@returns 0 on success, -1 on failure.
+  */
+int net_connect(SCB* socket, uint node, port_t port, TimerDuration timeout);
+
+/**
+	@brief Complete a request that arrived from another node.
+
+	The request was queued on a listener by @c socket_remote_request. The
+	unbound socket made by @c Accept becomes a peer of the connection.
+  */
+void net_accept(request_t* request, SCB* socket);
+
+/** @brief Refuse a request that arrived from another node, because its listener closed. */
+void net_refuse(request_t* request);
+
+int net_read(net_conn* conn, char* buf, unsigned int size);
+int net_write(net_conn* conn, const char* buf, unsigned int size);
+int net_readv(net_conn* conn, const iovec_t* iov, int iovcnt);
+int net_writev(net_conn* conn, const iovec_t* iov, int iovcnt);
+int net_poll(net_conn* conn, int events, struct poll_table* pt);
+
+/** @brief Shut down the directions in @c how, as for @c ShutDown. */
+int net_shutdown(net_conn* conn, int how);
+
+/** @brief Release the connection of a socket that is closed. */
+void net_close(net_conn* conn);
+
+/** @brief The port of the other end */
+port_t net_peer_port(net_conn* conn);
+
+/** @} */
+
+#endif
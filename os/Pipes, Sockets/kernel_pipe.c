@@ -1,19 +1,373 @@
+#include <string.h>
 #include "tinyos.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_cc.h"
+#include "kernel_socket.h"
+#include "kernel_poll.h"
+#include "kernel_pool.h"
+#include "kernel_proc.h"
 
 
 
-int pipe_read(void* pipe_obj, char *buf, unsigned int size)
+/*
+	The buffer is a ring: the next byte to read is at @c last_read_pos+1 and the
+	next byte to write at @c last_write_pos+1 (modulo the capacity). Data is moved 
+	in contiguous spans, with at most two memcpy per transfer.
+ */
+
+/* Copy n bytes out of the ring. Return the bytes it held before. */
+static int pipe_copy_out(pipe_CB* pipe, char* buf, unsigned int n)
 {
-	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+	unsigned int start = (pipe->last_read_pos + 1) % pipe->capacity;
+	unsigned int first = (n < pipe->capacity - start) ? n : pipe->capacity - start;
+
+	memcpy(buf, pipe->buffer + start, first);
+	memcpy(buf + first, pipe->buffer, n - first);
+
+	pipe->last_read_pos = (start + n - 1) % pipe->capacity;
+	return __atomic_fetch_sub(& pipe->bufferElementsCount, n, __ATOMIC_SEQ_CST);
+}
+
+/* Copy n bytes into the ring. Return the bytes it held before. */
+static int pipe_copy_in(pipe_CB* pipe, const char* buf, unsigned int n)
+{
+	unsigned int start = (pipe->last_write_pos + 1) % pipe->capacity;
+	unsigned int first = (n < pipe->capacity - start) ? n : pipe->capacity - start;
+
+	memcpy(pipe->buffer + start, buf, first);
+	memcpy(pipe->buffer, buf + first, n - first);
+
+	pipe->last_write_pos = (start + n - 1) % pipe->capacity;
+	return __atomic_fetch_add(& pipe->bufferElementsCount, n, __ATOMIC_SEQ_CST);
+}
+
+/* 
+	Double the buffer, up to max_capacity. The data is moved to the start of the
+	new buffer. Return 0 if the buffer cannot grow.
+ */
+static int pipe_grow(pipe_CB* pipe)
+{
+	if(pipe->capacity >= pipe->max_capacity) return 0;
+
+	unsigned int newcap = (pipe->capacity > pipe->max_capacity/2) ? 
+		pipe->max_capacity : 2*pipe->capacity;
+	if(mem_charge(pipe->account, MEM_KERNEL, newcap - pipe->capacity) != 0)
+		return 0;
+	char* newbuf = xmalloc(newcap);
+
+	unsigned int n = pipe->bufferElementsCount;
+	pipe_copy_out(pipe, newbuf, n);
+	free(pipe->buffer);
+
+	pipe->buffer = newbuf;
+	pipe->capacity = newcap;
+	pipe->last_read_pos = newcap - 1;
+	pipe->last_write_pos = (int)n - 1;
+	pipe->bufferElementsCount = n;
+	return 1;
+}
+
+/* Move n bytes from the ring of src to the ring of dst. */
+static void pipe_transfer(pipe_CB* src, pipe_CB* dst, unsigned int n)
+{
+	while(n > 0) {
+		unsigned int start = (src->last_read_pos + 1) % src->capacity;
+		unsigned int span = (n < src->capacity - start) ? n : src->capacity - start;
+
+		pipe_copy_in(dst, src->buffer + start, span);
+
+		src->last_read_pos = (start + span - 1) % src->capacity;
+		__atomic_sub_fetch(& src->bufferElementsCount, span, __ATOMIC_SEQ_CST);
+		n -= span;
+	}
+}
+
+/*
+	Released pipes with a buffer of the default size are pooled together 
+	with their buffer, since sockets create and release two of them per
+	connection.
+ */
+#ifndef PIPE_POOL_HIGH_WATER
+#define PIPE_POOL_HIGH_WATER 32
+#endif
+
+static object_pool pipe_pool = OBJECT_POOL_INIT(pipe_CB, PIPE_POOL_HIGH_WATER);
+
+/* The memory of a pipe with a buffer of the given size */
+static inline size_t pipe_bytes(unsigned int capacity)
+{
+	return sizeof(pipe_CB) + capacity;
+}
+
+/* Channels are pooled, as they are created and released with connections */
+static object_pool channel_pool = OBJECT_POOL_INIT(channel_t, PIPE_POOL_HIGH_WATER);
+
+static void pipe_free(pipe_CB* pipe)
+{
+	// A channel is released with its last ring.
+	channel_t* channel = pipe->channel;
+	if(channel != NULL) {
+		if(__atomic_sub_fetch(& channel->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+			mem_uncharge(channel->account, MEM_KERNEL, sizeof(channel_t));
+			account_put(channel->account);
+			pool_free(& channel_pool, channel);
+		}
+		return;
+	}
+
+	mem_uncharge(pipe->account, MEM_KERNEL, pipe_bytes(pipe->capacity));
+	account_put(pipe->account);
+	if(pipe->capacity == BUFFER_SIZE && pool_put(& pipe_pool, pipe))
+		return;
+	free(pipe->buffer);
+	free(pipe);
+}
+
+
+/*
+	Locking.
+
+	The reader side of the ring (@c last_read_pos) and the writer side 
+	(@c last_write_pos) are owned through the tokens @c reader_busy and 
+	@c writer_busy, and @c bufferElementsCount is updated atomically. 
+	A single reader and a single writer can thus move data at the same 
+	time, taking only their own token, without the mutex (the fast path 
+	of @c pipe_read and @c pipe_write). A token is never held while 
+	waiting for anything.
+
+	All other code locks the pipe with @c pipe_lock(), which takes the
+	mutex and both tokens, and sees a pipe that no one else touches.
+	Threads going to sleep release the tokens, and count themselves in
+	@c readers_asleep or @c writers_asleep. After a fast transfer, the
+	pipe is locked only if the ring was empty (or full), and someone 
+	sleeps or polls.
+ */
+
+static inline void pipe_token_acquire(int* token)
+{
+	for(unsigned long round = 0; __atomic_exchange_n(token, 1, __ATOMIC_ACQUIRE); round++)
+		cpu_spin(round);
+}
+
+static inline int pipe_token_try(int* token)
+{
+	return ! __atomic_exchange_n(token, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void pipe_token_release(int* token)
+{
+	__atomic_store_n(token, 0, __ATOMIC_RELEASE);
+}
+
+static inline void pipe_lock(pipe_CB* pipe)
+{
+	Mutex_Lock(& pipe->mx);
+	pipe_token_acquire(& pipe->reader_busy);
+	pipe_token_acquire(& pipe->writer_busy);
+}
+
+/*
+	Wakeups.
+
+	A sleeper is signalled only when it can make progress: a reader when
+	the ring holds data, a writer when it has room. Only one sleeper of 
+	each side is signalled at a time (@c readers_woken, @c writers_woken);
+	when it runs, it passes the wakeup on to the next one, if the ring still
+	holds data (or room) after its own transfer. So a write into an empty
+	ring wakes one reader, not all of them, and a pipe with many sleepers
+	wakes them one after another only while they have something to do.
+
+	The pollers are notified only when the ring stops being empty or full
+	(@c pipe_notify). Closing either end, and reading from a message ring,
+	whose writers wait for room for a whole message, wake everybody.
+ */
+
+/* Signal one reader, unless one is on its way */
+static inline void pipe_signal_reader(pipe_CB* pipe)
+{
+	if(pipe->readers_asleep > 0 && pipe->readers_woken == 0 && pipe->bufferElementsCount > 0) {
+		pipe->readers_woken++;
+		sched_wake_affine(pipe);
+		Cond_Signal(& pipe->cv_readers);
+	}
+}
+
+/* Signal one writer, unless one is on its way */
+static inline void pipe_signal_writer(pipe_CB* pipe)
+{
+	if(pipe->writers_asleep > 0 && pipe->writers_woken == 0 && pipe->bufferElementsCount < (int) pipe->capacity) {
+		pipe->writers_woken++;
+		sched_wake_affine(pipe);
+		Cond_Signal(& pipe->cv_writers);
+	}
+}
+
+/* Notify the pollers if a transfer that found @c before bytes in the ring ended an empty or full ring */
+static inline void pipe_notify(pipe_CB* pipe, int before)
+{
+	if(before == 0 || before == (int) pipe->capacity)
+		poll_notify(& pipe->pollq);
+}
+
+static inline void pipe_unlock(pipe_CB* pipe)
+{
+	/* Pass the wakeups on */
+	pipe_signal_reader(pipe);
+	pipe_signal_writer(pipe);
+
+	pipe_token_release(& pipe->writer_busy);
+	pipe_token_release(& pipe->reader_busy);
+	Mutex_Unlock(& pipe->mx);
+}
+
+/* Sleep at a condition of a locked pipe, after waking up the other side */
+static void pipe_wait(pipe_CB* pipe, CondVar* cv)
+{
+	int reader = (cv == & pipe->cv_readers);
+	int* asleep = reader ? & pipe->readers_asleep : & pipe->writers_asleep;
+	int* woken = reader ? & pipe->readers_woken : & pipe->writers_woken;
+
+	if(reader) pipe_signal_writer(pipe); else pipe_signal_reader(pipe);
+
+	(*asleep)++;
+	sched_wake_affine(pipe);
+	pipe_token_release(& pipe->writer_busy);
+	pipe_token_release(& pipe->reader_busy);
+	kernel_mxwait(& pipe->mx, cv, SCHED_PIPE);
+	pipe_token_acquire(& pipe->reader_busy);
+	pipe_token_acquire(& pipe->writer_busy);
+	(*asleep)--;
+	if(*woken > 0) (*woken)--;
+}
+
+
+/* Wake up the threads sleeping at cv, and the pollers of the pipe */
+static inline void pipe_broadcast(pipe_CB* pipe, CondVar* cv)
+{
+	if(cv == & pipe->cv_readers)
+		pipe->readers_woken = pipe->readers_asleep;
+	else
+		pipe->writers_woken = pipe->writers_asleep;
+	Cond_Broadcast(cv);
+	poll_notify(& pipe->pollq);
+}
+
+
+/*
+	Message rings.
+
+	In a ring of a message socket, each write is stored as one message: 
+	a header with the length, followed by the data. A write waits until 
+	the whole message fits. A read returns data of one message only; if
+	the buffer is too small the rest of the message is returned by the
+	following reads. @c msg_left is what remains of the message being read.
+ */
+#define MSG_HEADER ((unsigned int) sizeof(unsigned int))
+
+static inline unsigned int pipe_room(pipe_CB* pipe)
+{
+	return pipe->capacity - (unsigned int) pipe->bufferElementsCount;
+}
+
+static int pipe_send_locked(pipe_CB* pipe, const iovec_t* iov, int iovcnt)
+{
+	if(pipe->reader_closed || pipe->writer_closed) 
+		return -1;
+
+	unsigned int len = 0;
+	for(int i=0; i<iovcnt; i++) len += iov[i].len;
+
+	// There are no empty messages, they would read as the end of data.
+	if(len == 0) return 0;
+	if(len > pipe->max_capacity - MSG_HEADER) return -1;
+
+	pipe->ref_count_writer++;
+	while(pipe_room(pipe) < len + MSG_HEADER && pipe->reader_closed == 0 && pipe->writer_closed == 0) {
+		if(pipe_grow(pipe)) continue;
+		if(stream_nonblocking()) break;
+		pipe_wait(pipe, & pipe->cv_writers);
+	}
+	pipe->ref_count_writer--;
+
+	if(pipe->reader_closed || pipe->writer_closed) 
+		return -1;
+	if(pipe_room(pipe) < len + MSG_HEADER)
+		return WOULDBLOCK;
+
+	pipe_notify(pipe, pipe_copy_in(pipe, (const char*) &len, MSG_HEADER));
+	for(int i=0; i<iovcnt; i++)
+		pipe_copy_in(pipe, iov[i].base, iov[i].len);
+	return len;
+}
+
+/* Wait for a message. Return what is left of it, 0 at the end of data, or an error. */
+static int pipe_recv_wait(pipe_CB* pipe)
+{
+	if(pipe->reader_closed) return -1;
+
+	pipe->ref_count_reader++;
+	while(pipe->bufferElementsCount == 0 && pipe->writer_closed == 0 && pipe->reader_closed == 0) {
+		if(stream_nonblocking()) break;
+		pipe_wait(pipe, & pipe->cv_readers);
+	}
+	pipe->ref_count_reader--;
+
+	if(pipe->reader_closed) return 0;
+	if(pipe->bufferElementsCount == 0) 
+		return pipe->writer_closed ? 0 : WOULDBLOCK;
+
+	// Messages are written whole, so the data follows the header.
+	if(pipe->msg_left == 0)
+		pipe_copy_out(pipe, (char*) &pipe->msg_left, MSG_HEADER);
+	return pipe->msg_left;
+}
+
+static int pipe_recv_locked(pipe_CB* pipe, const iovec_t* iov, int iovcnt)
+{
+	unsigned int size = 0;
+	for(int i=0; i<iovcnt; i++) size += iov[i].len;
+	if(size == 0) return pipe->reader_closed ? -1 : 0;
+
+	int avail = pipe_recv_wait(pipe);
+	if(avail <= 0) return avail;
+
+	unsigned int count = 0;
+	for(int i=0; i<iovcnt && pipe->msg_left > 0; i++) {
+		unsigned int n = (iov[i].len < pipe->msg_left) ? iov[i].len : pipe->msg_left;
+		pipe_copy_out(pipe, iov[i].base, n);
+		pipe->msg_left -= n;
+		count += n;
+	}
+
+	pipe_broadcast(pipe, & pipe->cv_writers);
+	return count;
+}
+
+int pipe_message_size(pipe_CB* pipe)
+{
+	if(! pipe->message) return -1;
+
+	pipe_lock(pipe);
+	int retval = pipe_recv_wait(pipe);
+	pipe_unlock(pipe);
+	return retval;
+}
+
+
+static int pipe_read_locked(pipe_CB* pipe, char *buf, unsigned int size)
+{
+	if(pipe->message) {
+		iovec_t iov = { buf, size };
+		return pipe_recv_locked(pipe, &iov, 1);
+	}
+
 	unsigned int count = 0;
 
 	if(pipe->reader_closed == 1) return -1;
 
-  	for(; count < size; count++) {
+  	while(count < size) {
 
   		/*	If the buffer is empty and there is no one to write to, it must return with as much data as it managed to read. 
 		When it has reached eof it will return 0 */
@@ -25,75 +379,154 @@ int pipe_read(void* pipe_obj, char *buf, unsigned int size)
   		/*	If the buffer is empty and there is someone to write to, we sleep the read.  
 		It wakes up the write because no space is freed or the buffer is empty.	*/
   		while(pipe->bufferElementsCount == 0 && pipe->writer_closed == 0 && pipe->reader_closed == 0){
-			Cond_Broadcast(& pipe->cv_writers);
-  			kernel_wait(& pipe->cv_readers,SCHED_PIPE);
+			if(stream_nonblocking()) break;
+  			pipe_wait(pipe, & pipe->cv_readers);
   		}
   		pipe->ref_count_reader--;
 
   		// If his side is closed he must stop.
 		if(pipe->reader_closed == 1) return count;
 
-  		// If there is something to read, he takes it and continues to the next one.
-  		if(pipe->bufferElementsCount > 0){
-	  		pipe->last_read_pos++;
-	  		if (pipe->last_read_pos >= BUFFER_SIZE)
-	  			pipe->last_read_pos = 0; // Circle
+		// Non-blocking, return what has been read so far.
+		if(pipe->bufferElementsCount == 0 && pipe->writer_closed == 0) {
+			if(count == 0) return WOULDBLOCK;
+			break;
+		}
 
-	  		buf[count] = pipe->buffer[pipe->last_read_pos];
-	  		
-	  		pipe->bufferElementsCount--;
-	  	}
-  	}
+  		// Take as much as there is, up to what is still wanted.
+  		unsigned int n = size - count;
+  		if(n > (unsigned int) pipe->bufferElementsCount)
+  			n = pipe->bufferElementsCount;
 
-  	// Space has been freed so we are waking up the writer.
-	Cond_Broadcast(& pipe->cv_writers);
+  		// Space has been freed, a writer is woken up when the pipe is unlocked.
+  		pipe_notify(pipe, pipe_copy_out(pipe, buf + count, n));
+  		count += n;
+  	}
 	return count;
 }
 
+/* 
+	Read what the ring holds, holding only the reader token. Return the bytes
+	read, or 0 if the locked path must be taken.
+ */
+static unsigned int pipe_read_fast(pipe_CB* pipe, char* buf, unsigned int size)
+{
+	unsigned int n = 0;
+	int before = 0;
+
+	int preempt = preempt_off;
+	if(pipe_token_try(& pipe->reader_busy)) {
+		if(! pipe->reader_closed) {
+			n = __atomic_load_n(& pipe->bufferElementsCount, __ATOMIC_ACQUIRE);
+			if(n > size) n = size;
+			if(n > 0) before = pipe_copy_out(pipe, buf, n);
+		}
+		pipe_token_release(& pipe->reader_busy);
+	}
+	if(preempt) preempt_on;
+
+	// The ring was full, and a writer sleeps or someone polls.
+	if(n > 0 && before == (int) pipe->capacity
+			&& (__atomic_load_n(& pipe->writers_asleep, __ATOMIC_SEQ_CST) 
+				|| ! is_rlist_empty(& pipe->pollq.pollers))) {
+		pipe_lock(pipe);
+		poll_notify(& pipe->pollq);
+		pipe_unlock(pipe);
+	}
+	return n;
+}
+
+int pipe_read(void* pipe_obj, char *buf, unsigned int size)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+
+	unsigned int n = pipe->message ? 0 : pipe_read_fast(pipe, buf, size);
+	if(n > 0 && n == size) return n;
+
+	pipe_lock(pipe);
+	int retval = pipe_read_locked(pipe, buf + n, size - n);
+	pipe_unlock(pipe);
+
+	if(retval < 0) return n ? (int) n : retval;
+	return n + retval;
+}
+
+static int pipe_read_segment(void* pipe_obj, char* buf, unsigned int size)
+{
+	return pipe_read_locked((pipe_CB*) pipe_obj, buf, size);
+}
+
+/* All the segments are read under one lock acquisition */
+int pipe_readv(void* pipe_obj, const iovec_t* iov, int iovcnt)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+
+	pipe_lock(pipe);
+	int retval = pipe->message ? pipe_recv_locked(pipe, iov, iovcnt)
+		: stream_readv(pipe, pipe_read_segment, iov, iovcnt);
+	pipe_unlock(pipe);
+	return retval;
+}
+
 
 int pipe_reader_close(void* pipe_obj)
 {
 	pipe_CB* pipe = (pipe_CB*) pipe_obj;
 
+	pipe_lock(pipe);
+
 	// This side is closed.
-	if(pipe->reader_closed)
+	if(pipe->reader_closed) {
+		pipe_unlock(pipe);
 		return 0;
+	}
 
 	//Close first
 	if (!pipe->writer_closed){
 		if(!pipe->ref_count_reader)
 			pipe->reader_closed = 1;
-		Cond_Broadcast(& pipe->cv_writers);
+		pipe_broadcast(pipe, & pipe->cv_writers);
+		pipe_unlock(pipe);
 		return 0;
 	}
 
 	//Close second
-	if(!pipe->ref_count_reader) 
-		free(pipe);
+	int last = !pipe->ref_count_reader;
+	pipe_unlock(pipe);
+	if(last) 
+		pipe_free(pipe);
 	return 0;
 }
 
 
-int pipe_write(void* pipe_obj, const char *buf, unsigned int size)
+static int pipe_write_locked(pipe_CB* pipe, const char *buf, unsigned int size)
 {
-	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+	if(pipe->message) {
+		iovec_t iov = { (void*) buf, size };
+		return pipe_send_locked(pipe, &iov, 1);
+	}
+
 	unsigned int count = 0;
 
 	// The read is closed, no write should be done. Also if his side is closed, he must stop..
 	if(pipe->reader_closed || pipe->writer_closed) 
 		return -1;
 
-  	for(; count < size; count++) {
+  	while(count < size) {
 
   		pipe->ref_count_writer++;
 
   		/*	If the buffer is full and there is something to read, we sleep the write. 
 		Wake up the read because space is written or the buffer is full	*/
-  		while(pipe->bufferElementsCount == BUFFER_SIZE && pipe->reader_closed == 0 && pipe->writer_closed == 0){
+  		while(pipe->bufferElementsCount == (int) pipe->capacity && pipe->reader_closed == 0 && pipe->writer_closed == 0){
+
+			// The reader is slower, make room if the buffer may grow.
+			if(pipe_grow(pipe)) continue;
+
+			if(stream_nonblocking()) break;
 
-		  	// If he writes the table and wants more he has to wake up the readers before he falls asleep.
-			Cond_Broadcast(& pipe->cv_readers);
-  			kernel_wait(& pipe->cv_writers,SCHED_PIPE);
+		  	// A reader is woken up before we fall asleep.
+  			pipe_wait(pipe, & pipe->cv_writers);
   		}
   		pipe->ref_count_writer--;
 
@@ -105,63 +538,289 @@ int pipe_write(void* pipe_obj, const char *buf, unsigned int size)
 		if(pipe->writer_closed)
 			return count;
 
-		// Writes and continues to the next one if there is space.
-		if(pipe->bufferElementsCount < BUFFER_SIZE){
-	  		pipe->last_write_pos++;
-	  		if (pipe->last_write_pos >= BUFFER_SIZE)
-	  			pipe->last_write_pos = 0; //Circle
+		// Non-blocking, return what has been written so far.
+		if(pipe->bufferElementsCount == (int) pipe->capacity) {
+			if(count == 0) return WOULDBLOCK;
+			break;
+		}
 
-	  		pipe->buffer[pipe->last_write_pos] = buf[count];
-	  		pipe->bufferElementsCount ++;
-	  	}
-  	}
+		// Fill as much of the free space as needed.
+		unsigned int n = size - count;
+		if(n > pipe->capacity - pipe->bufferElementsCount)
+			n = pipe->capacity - pipe->bufferElementsCount;
 
-  	// New elements, so the writers need to wake up.
-  	if(pipe->ref_count_reader)
-		Cond_Broadcast(& pipe->cv_readers);
+		// New elements, a reader is woken up when the pipe is unlocked.
+		pipe_notify(pipe, pipe_copy_in(pipe, buf + count, n));
+		count += n;
+  	}
 	return count;
 }
 
+/* 
+	Write what fits in the ring, holding only the writer token. Return the bytes
+	written, or 0 if the locked path must be taken.
+ */
+static unsigned int pipe_write_fast(pipe_CB* pipe, const char* buf, unsigned int size)
+{
+	unsigned int n = 0;
+	int before = -1;
+
+	int preempt = preempt_off;
+	if(pipe_token_try(& pipe->writer_busy)) {
+		if(! pipe->reader_closed && ! pipe->writer_closed) {
+			n = pipe->capacity - __atomic_load_n(& pipe->bufferElementsCount, __ATOMIC_ACQUIRE);
+			if(n > size) n = size;
+			if(n > 0) before = pipe_copy_in(pipe, buf, n);
+		}
+		pipe_token_release(& pipe->writer_busy);
+	}
+	if(preempt) preempt_on;
+
+	// The ring was empty, and a reader sleeps or someone polls.
+	if(before == 0 && (__atomic_load_n(& pipe->readers_asleep, __ATOMIC_SEQ_CST) 
+			|| ! is_rlist_empty(& pipe->pollq.pollers))) {
+		pipe_lock(pipe);
+		poll_notify(& pipe->pollq);
+		pipe_unlock(pipe);
+	}
+	return n;
+}
+
+int pipe_write(void* pipe_obj, const char *buf, unsigned int size)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+
+	unsigned int n = pipe->message ? 0 : pipe_write_fast(pipe, buf, size);
+	if(n > 0 && n == size) return n;
+
+	pipe_lock(pipe);
+	int retval = pipe_write_locked(pipe, buf + n, size - n);
+	pipe_unlock(pipe);
+
+	if(retval < 0) return n ? (int) n : retval;
+	return n + retval;
+}
+
+static int pipe_write_segment(void* pipe_obj, const char* buf, unsigned int size)
+{
+	return pipe_write_locked((pipe_CB*) pipe_obj, buf, size);
+}
+
+/* All the segments are written under one lock acquisition */
+int pipe_writev(void* pipe_obj, const iovec_t* iov, int iovcnt)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+
+	pipe_lock(pipe);
+	int retval = pipe->message ? pipe_send_locked(pipe, iov, iovcnt)
+		: stream_writev(pipe, pipe_write_segment, iov, iovcnt);
+	pipe_unlock(pipe);
+	return retval;
+}
+
 
 int pipe_writer_close(void* pipe_obj)
 {
 	pipe_CB* pipe = (pipe_CB*) pipe_obj;
 
-	// Side closed
-	if(pipe->writer_closed)
+	pipe_lock(pipe);
+
+	// This side is closed.
+	if(pipe->writer_closed) {
+		pipe_unlock(pipe);
 		return 0;
+	}
 
 	//Close first
 	if (!pipe->reader_closed){
-		if(!pipe->ref_count_writer)//
+		if(!pipe->ref_count_writer)
 			pipe->writer_closed = 1;
-		Cond_Broadcast(& pipe->cv_readers);
+		pipe_broadcast(pipe, & pipe->cv_readers);
+		pipe_unlock(pipe);
 		return 0;
 	}
 
 	//Close second
-	if(!pipe->ref_count_writer) 
-		free(pipe);
+	int last = !pipe->ref_count_writer;
+	pipe_unlock(pipe);
+	if(last) 
+		pipe_free(pipe);
 	return 0;
 }
 
 
+/*
+	Splice support. 
+
+	The two pipes are never locked together while waiting: we wait for data 
+	at the source and for room at the destination one at a time, and then
+	lock both (in address order) to move the data.
+
+	Each end may be in non-blocking mode (@c nb), and then a wait that would 
+	block returns WOULDBLOCK instead.
+ */
+
+/* Wait for data, like a read. Return the bytes available, 0 at the end of data or -1 on error. */
+static int pipe_wait_data(pipe_CB* pipe, int nb)
+{
+	pipe_lock(pipe);
+	int retval = -1;
+	if(pipe->reader_closed == 0) {
+		pipe->ref_count_reader++;
+		while(pipe->bufferElementsCount == 0 && pipe->writer_closed == 0 && pipe->reader_closed == 0){
+			if(nb) break;
+			pipe_wait(pipe, & pipe->cv_readers);
+		}
+		pipe->ref_count_reader--;
+		if(pipe->reader_closed)
+			retval = 0;
+		else if(pipe->bufferElementsCount == 0 && pipe->writer_closed == 0)
+			retval = WOULDBLOCK;
+		else
+			retval = pipe->bufferElementsCount;
+	}
+	pipe_unlock(pipe);
+	return retval;
+}
+
+/* Wait for room, like a write. Return 0 if there is room, or -1 if the pipe is closed. */
+static int pipe_wait_room(pipe_CB* pipe, int nb)
+{
+	pipe_lock(pipe);
+	pipe->ref_count_writer++;
+	while(pipe->bufferElementsCount == (int) pipe->capacity && pipe->reader_closed == 0 && pipe->writer_closed == 0){
+		if(pipe_grow(pipe)) continue;
+		if(nb) break;
+		pipe_wait(pipe, & pipe->cv_writers);
+	}
+	pipe->ref_count_writer--;
+	int retval = 0;
+	if(pipe->reader_closed || pipe->writer_closed)
+		retval = -1;
+	else if(pipe->bufferElementsCount == (int) pipe->capacity)
+		retval = WOULDBLOCK;
+	pipe_unlock(pipe);
+	return retval;
+}
+
+static int pipe_splice(pipe_CB* src, pipe_CB* dst, unsigned int len, int nb_in, int nb_out)
+{
+	unsigned int moved = 0;
+	pipe_CB* first = (src < dst) ? src : dst;
+	pipe_CB* second = (src < dst) ? dst : src;
+
+	while(moved < len) {
+		/* Block for data only if nothing has been moved yet */
+		if(moved == 0) {
+			int avail = pipe_wait_data(src, nb_in);
+			if(avail <= 0) return avail;
+		}
+
+		int room = pipe_wait_room(dst, nb_out);
+		if(room < 0) 
+			return moved ? (int) moved : room;
+
+		pipe_lock(first);
+		pipe_lock(second);
+
+		/* The destination may have been closed in between */
+		if(dst->reader_closed || dst->writer_closed) {
+			pipe_unlock(second);
+			pipe_unlock(first);
+			return moved ? (int) moved : -1;
+		}
+
+		/* Another reader or writer may have come in between, n may be 0 */
+		unsigned int n = len - moved;
+		if(n > (unsigned int) src->bufferElementsCount)
+			n = src->bufferElementsCount;
+		if(n > dst->capacity - dst->bufferElementsCount)
+			n = dst->capacity - dst->bufferElementsCount;
+
+		int src_before = src->bufferElementsCount;
+		int dst_before = dst->bufferElementsCount;
+		pipe_transfer(src, dst, n);
+		moved += n;
+		int drained = (src->bufferElementsCount == 0);
+
+		if(n > 0) {
+			pipe_notify(src, src_before);
+			pipe_notify(dst, dst_before);
+		}
+		pipe_unlock(second);
+		pipe_unlock(first);
+
+		if(drained && moved > 0) break;
+	}
+	return moved;
+}
+
+
+int pipe_reader_poll(void* pipe_obj, int events, struct poll_table* pt)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+	int mask = 0;
+
+	pipe_lock(pipe);
+	if(pipe->reader_closed)
+		mask = POLL_ERROR;
+	else {
+		if(pipe->bufferElementsCount > 0 || pipe->writer_closed) mask |= POLL_READ;
+		if(pipe->writer_closed) mask |= POLL_HANGUP;
+	}
+	poll_wait(pt, & pipe->pollq);
+	pipe_unlock(pipe);
+
+	return mask & (events | POLL_HANGUP | POLL_ERROR);
+}
+
+int pipe_writer_poll(void* pipe_obj, int events, struct poll_table* pt)
+{
+	pipe_CB* pipe = (pipe_CB*) pipe_obj;
+	int mask = 0;
+
+	pipe_lock(pipe);
+	if(pipe->writer_closed)
+		mask = POLL_ERROR;
+	else if(pipe->reader_closed)
+		mask = POLL_HANGUP | POLL_ERROR;
+	else if(pipe->bufferElementsCount < (int) pipe->capacity || pipe->capacity < pipe->max_capacity)
+		mask = POLL_WRITE;
+	poll_wait(pt, & pipe->pollq);
+	pipe_unlock(pipe);
+
+	return mask & (events | POLL_HANGUP | POLL_ERROR);
+}
+
+
 static file_ops pipe_reader_ops = {
   .Open = NULL,
   .Read = pipe_read,
   .Write = NULL,
-  .Close = pipe_reader_close
+  .ReadV = pipe_readv,
+  .Poll = pipe_reader_poll,
+  .Close = pipe_reader_close,
+  .type = STREAM_PIPE
 };
 
 static file_ops pipe_writer_ops = {
   .Open = NULL,
   .Read = NULL,
   .Write = pipe_write,
-  .Close = pipe_writer_close
+  .WriteV = pipe_writev,
+  .Poll = pipe_writer_poll,
+  .Close = pipe_writer_close,
+  .type = STREAM_PIPE
 };
 
 
 int sys_Pipe(pipe_t* pipe_id)
+{
+	return sys_PipeEx(pipe_id, 0, 0);
+}
+
+
+int sys_PipeEx(pipe_t* pipe_id, unsigned int capacity, unsigned int max_capacity)
 {
 	Fid_t pipe_fids[2] = {0, 0};
 	FCB* pipe_FCBs[2] = {NULL, NULL};
@@ -170,7 +829,10 @@ int sys_Pipe(pipe_t* pipe_id)
 	if(!FCB_reserve(2, (Fid_t*) &pipe_fids, (FCB**) &pipe_FCBs))
 		return -1;
 
-	create_pipe(pipe_FCBs);
+	if(create_pipe_ex(pipe_FCBs, capacity, max_capacity) != 0) {
+		FCB_unreserve(2, pipe_fids, pipe_FCBs);
+		return -1;
+	}
 
 	// pipe's fids
 	pipe_id->read = pipe_fids[0];
@@ -180,10 +842,58 @@ int sys_Pipe(pipe_t* pipe_id)
 }
 
 
-void create_pipe(FCB** pipe_FCBs)
+/* Return the pipe that is read through fcb, or NULL */
+static pipe_CB* splice_source(FCB* fcb)
+{
+	pipe_CB* pipe = (fcb->streamfunc == &pipe_reader_ops) ? fcb->streamobj : socket_pipe_end(fcb, 0);
+	return (pipe && !pipe->message) ? pipe : NULL;
+}
+
+/* Return the pipe that is written through fcb, or NULL */
+static pipe_CB* splice_sink(FCB* fcb)
+{
+	pipe_CB* pipe = (fcb->streamfunc == &pipe_writer_ops) ? fcb->streamobj : socket_pipe_end(fcb, 1);
+	return (pipe && !pipe->message) ? pipe : NULL;
+}
+
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int len)
+{
+	int retcode = -1;
+
+	FCB* infcb = get_fcb(in);
+	FCB* outfcb = get_fcb(out);
+
+	pipe_CB* src = infcb ? splice_source(infcb) : NULL;
+	pipe_CB* dst = outfcb ? splice_sink(outfcb) : NULL;
+
+	if(src != NULL && dst != NULL && src != dst)
+		retcode = pipe_splice(src, dst, len, infcb->flags & FCB_NONBLOCK, outfcb->flags & FCB_NONBLOCK);
+	account_io(retcode, retcode);
+
+	if(infcb) FCB_decref(infcb);
+	if(outfcb) FCB_decref(outfcb);
+	return retcode;
+}
+
+
+int create_pipe(FCB** pipe_FCBs)
+{
+	return create_pipe_ex(pipe_FCBs, 0, 0);
+}
+
+
+static unsigned int pipe_capacity(unsigned int capacity)
 {
-	pipe_CB* pipe = (pipe_CB*) xmalloc(sizeof(pipe_CB));
+	if(capacity < PIPE_MIN_CAPACITY) return PIPE_MIN_CAPACITY;
+	if(capacity > PIPE_MAX_CAPACITY) return PIPE_MAX_CAPACITY;
+	return capacity;
+}
 
+
+/* Initialize the state of a pipe, whose buffer is set */
+static void pipe_init(pipe_CB* pipe)
+{
 	// Init pipe's variables. 
  	pipe->reader_closed = 0;
  	pipe->writer_closed = 0;
@@ -197,6 +907,43 @@ void create_pipe(FCB** pipe_FCBs)
   	pipe->cv_writers = COND_INIT;
   	pipe->ref_count_writer = 0;
   	pipe->ref_count_reader = 0;
+  	pipe->mx = MUTEX_INIT;
+  	pipe->reader_busy = 0;
+  	pipe->writer_busy = 0;
+  	pipe->readers_asleep = 0;
+  	pipe->writers_asleep = 0;
+  	pipe->readers_woken = 0;
+  	pipe->writers_woken = 0;
+  	poll_queue_init(& pipe->pollq);
+
+  	pipe->message = 0;
+  	pipe->msg_left = 0;
+}
+
+
+int create_pipe_ex(FCB** pipe_FCBs, unsigned int capacity, unsigned int max_capacity)
+{
+	// The buffer grows later, under the same account
+	mem_account* account = CURPROC->mem;
+	unsigned int size = (capacity == 0) ? BUFFER_SIZE : pipe_capacity(capacity);
+	if(mem_charge(account, MEM_KERNEL, pipe_bytes(size)) != 0)
+		return -1;
+
+	// Pooled pipes have a buffer of the default size.
+	pipe_CB* pipe = (capacity == 0) ? pool_get(& pipe_pool) : NULL;
+
+	if(pipe == NULL) {
+		pipe = (pipe_CB*) xmalloc(sizeof(pipe_CB));
+
+		// Size the buffer
+		pipe->capacity = size;
+		pipe->buffer = (char*) xmalloc(pipe->capacity);
+	}
+	pipe->max_capacity = (max_capacity > pipe->capacity) ? pipe_capacity(max_capacity) : pipe->capacity;
+	pipe->channel = NULL;
+	pipe->account = account;
+	account_hold(account);
+	pipe_init(pipe);
 
   	// Fill fcbs
   	pipe_FCBs[0]->streamobj = pipe;
@@ -204,4 +951,26 @@ void create_pipe(FCB** pipe_FCBs)
 
   	pipe_FCBs[1]->streamobj = pipe;
   	pipe_FCBs[1]->streamfunc = &pipe_writer_ops;
-}
\ No newline at end of file
+  	return 0;
+}
+
+
+channel_t* create_channel(int message, mem_account* account)
+{
+	channel_t* channel = (channel_t*) pool_alloc(& channel_pool);
+	channel->refcount = 2;
+	channel->account = account;
+	account_hold(account);
+	mem_force_charge(account, MEM_KERNEL, sizeof(channel_t));
+
+	for(int i=0; i<2; i++) {
+		pipe_CB* pipe = & channel->ring[i];
+		pipe->buffer = channel->buffers[i];
+		pipe->capacity = pipe->max_capacity = BUFFER_SIZE;
+		pipe->channel = channel;
+		pipe->account = NULL;
+		pipe_init(pipe);
+		pipe->message = message;
+	}
+	return channel;
+}
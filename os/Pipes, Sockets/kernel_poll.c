@@ -0,0 +1,164 @@
+#include <assert.h>
+
+#include "kernel_poll.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+
+/*
+	Poll queues and poll tables are locked with preemption off, because
+	streams (e.g., the serial driver) notify their pollers from interrupt
+	handlers. The lock order is queue, then table.
+ */
+
+void poll_queue_init(poll_queue* pq)
+{
+	pq->spinlock = MUTEX_INIT;
+	rlnode_init(& pq->pollers, NULL);
+}
+
+
+void poll_wait(poll_table* pt, poll_queue* pq)
+{
+	if(pt == NULL) return;
+
+	assert(pt->nentries < pt->maxentries);
+	poll_entry* e = & pt->entries[pt->nentries++];
+	e->queue = pq;
+	e->table = pt;
+	rlnode_init(& e->node, e);
+
+	int preempt = preempt_off;
+	Spin_Lock(& pq->spinlock);
+	rlist_push_back(& pq->pollers, & e->node);
+	Spin_Unlock(& pq->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+void poll_notify(poll_queue* pq)
+{
+	/* See kernel_poll.h on why this is safe */
+	if(is_rlist_empty(& pq->pollers)) return;
+
+	int preempt = preempt_off;
+	Spin_Lock(& pq->spinlock);
+	for(rlnode* n = pq->pollers.next; n != & pq->pollers; n = n->next) {
+		poll_table* pt = ((poll_entry*) n->obj)->table;
+		Spin_Lock(& pt->spinlock);
+		pt->triggered = 1;
+		if(pt->sleeping) wakeup(pt->thread);
+		Spin_Unlock(& pt->spinlock);
+	}
+	Spin_Unlock(& pq->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+/* Remove all the registrations of a poll table */
+static void poll_table_clear(poll_table* pt)
+{
+	int preempt = preempt_off;
+	for(int i=0; i<pt->nentries; i++) {
+		poll_queue* pq = pt->entries[i].queue;
+		Spin_Lock(& pq->spinlock);
+		rlist_remove(& pt->entries[i].node);
+		Spin_Unlock(& pq->spinlock);
+	}
+	pt->nentries = 0;
+	if(preempt) preempt_on;
+}
+
+
+/* Sleep until a registered queue is notified, or the timeout expires */
+static void poll_table_sleep(poll_table* pt, TimerDuration timeout)
+{
+	int preempt = preempt_off;
+	Spin_Lock(& pt->spinlock);
+	if(! pt->triggered) {
+		pt->sleeping = 1;
+		sleep_releasing(STOPPED, & pt->spinlock, SCHED_POLL, timeout);
+		Spin_Lock(& pt->spinlock);
+		pt->sleeping = 0;
+	}
+	pt->triggered = 0;
+	Spin_Unlock(& pt->spinlock);
+	if(preempt) preempt_on;
+}
+
+
+/* The ready events of a stream */
+static int poll_fcb(FCB* fcb, int events, poll_table* pt)
+{
+	file_ops* ops = fcb->streamfunc;
+	if(ops->Poll)
+		return ops->Poll(fcb->streamobj, events, pt);
+
+	/* Streams that cannot be polled are always ready */
+	int mask = 0;
+	if(ops->Read) mask |= POLL_READ;
+	if(ops->Write) mask |= POLL_WRITE;
+	return mask & events;
+}
+
+
+int sys_Poll(Fid_t* fids, int* events, int n, timeout_t timeout)
+{
+	if(n < 0 || n > MAX_POLL_FIDS || (n > 0 && (fids == NULL || events == NULL)))
+		return -1;
+
+	/* Hold all the streams for the duration of the call */
+	FCB** fcbs = (FCB**) xmalloc((n+1) * sizeof(FCB*));
+	for(int i=0; i<n; i++) {
+		fcbs[i] = get_fcb(fids[i]);
+		if(fcbs[i] == NULL) {
+			while(i-- > 0) FCB_decref(fcbs[i]);
+			free(fcbs);
+			return -1;
+		}
+	}
+
+	/* A stream registers to at most two queues (sockets have two pipes) */
+	poll_table pt = {
+		.thread = CURTHREAD, .spinlock = MUTEX_INIT, .triggered = 0, .sleeping = 0,
+		.nentries = 0, .maxentries = 2*n,
+		.entries = (poll_entry*) xmalloc((2*n+1) * sizeof(poll_entry))
+	};
+	int* ready = (int*) xmalloc((n+1) * sizeof(int));
+
+	TimerDuration deadline = (timeout == POLL_INFINITE) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+	int count;
+
+	for(;;) {
+		/* Register again on every pass, since a stream may change its queues
+		   (e.g., a connecting socket that becomes a peer) */
+		poll_table_clear(&pt);
+		count = 0;
+		for(int i=0; i<n; i++) {
+			ready[i] = poll_fcb(fcbs[i], events[i], &pt);
+			if(ready[i]) count++;
+		}
+
+		if(count > 0 || timeout == 0) break;
+
+		TimerDuration t = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) break;
+			t = deadline - now;
+		}
+		poll_table_sleep(&pt, t);
+	}
+
+	poll_table_clear(&pt);
+
+	for(int i=0; i<n; i++) {
+		events[i] = ready[i];
+		FCB_decref(fcbs[i]);
+	}
+
+	free(ready);
+	free(pt.entries);
+	free(fcbs);
+	return count;
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+/**
+	@file kernel_poll.h
+	@brief Readiness notification for streams.
+
+	@defgroup poll Polling
+	@ingroup kernel
+	@brief Readiness notification for streams.
+
+	A stream that supports @c Poll keeps a @c poll_queue. Its @c Poll method
+	reports which events are ready, and registers the calling @c poll_table
+	to the queue with @c poll_wait(). Whenever the readiness of the stream
+	may have changed, the stream calls @c poll_notify() on the queue, which
+	wakes up all the registered pollers. The pollers then scan their streams
+	again.
+
+	@c poll_notify() does not lock the queue when it is empty. This is safe, if
+	the stream calls @c poll_wait() and @c poll_notify() holding the same lock
+	of its own (e.g., the mutex of a pipe).
+
+	@{
+*/
+
+
+/** @brief The registration of a poll table to a poll queue. */
+typedef struct poll_entry {
+	rlnode node;                /**< Node in the @c pollers list of the queue */
+	poll_queue* queue;          /**< The queue registered to */
+	struct poll_table* table;   /**< The table that owns this entry */
+} poll_entry;
+
+
+/** @brief The state of a thread calling @c Poll. */
+typedef struct poll_table {
+	TCB* thread;                /**< The polling thread */
+	Mutex spinlock;             /**< Protects @c triggered and @c sleeping */
+	int triggered;              /**< Set by @c poll_notify() */
+	int sleeping;               /**< Set while the thread sleeps for notifications */
+
+	int nentries;               /**< Entries used in @c entries */
+	int maxentries;             /**< The size of @c entries */
+	poll_entry* entries;        /**< One for each registration */
+} poll_table;
+
+
+/** @brief Initialize a poll queue. */
+void poll_queue_init(poll_queue* pq);
+
+/**
+	@brief Register a poll table to a poll queue.
+
+	This is called by the @c Poll method of streams. If @c pt is NULL,
+	nothing happens.
+ */
+void poll_wait(poll_table* pt, poll_queue* pq);
+
+/** @brief Wake up all the poll tables registered to a queue. */
+void poll_notify(poll_queue* pq);
+
+/** @} */
+
+#endif
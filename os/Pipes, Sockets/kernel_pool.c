@@ -0,0 +1,51 @@
+#include <assert.h>
+
+#include "kernel_pool.h"
+#include "kernel_cc.h"
+
+
+void* pool_get(object_pool* pool)
+{
+	assert(pool->size >= sizeof(void*));
+
+	void* obj = NULL;
+	int preempt = preempt_off;
+	pool_slot* slot = & pool->core[cpu_core_id];
+	if(slot->free != NULL) {
+		obj = slot->free;
+		slot->free = *(void**) obj;
+		slot->count--;
+	}
+	if(preempt) preempt_on;
+	return obj;
+}
+
+
+int pool_put(object_pool* pool, void* obj)
+{
+	int kept = 0;
+	int preempt = preempt_off;
+	pool_slot* slot = & pool->core[cpu_core_id];
+	if(slot->count < pool->high_water) {
+		*(void**) obj = slot->free;
+		slot->free = obj;
+		slot->count++;
+		kept = 1;
+	}
+	if(preempt) preempt_on;
+	return kept;
+}
+
+
+void* pool_alloc(object_pool* pool)
+{
+	void* obj = pool_get(pool);
+	return (obj != NULL) ? obj : xmalloc(pool->size);
+}
+
+
+void pool_free(object_pool* pool, void* obj)
+{
+	if(! pool_put(pool, obj))
+		free(obj);
+}
@@ -0,0 +1,56 @@
+#ifndef __KERNEL_POOL_H
+#define __KERNEL_POOL_H
+
+#include "util.h"
+#include "bios.h"
+
+/**
+	@file kernel_pool.h
+	@brief Pools of fixed-size kernel objects.
+
+	@defgroup pool Object pools
+	@ingroup kernel
+	@brief Pools of fixed-size kernel objects.
+
+	Kernel objects that are created and released often (e.g., the parts of
+	a socket connection) are not returned to the system when released. 
+	Each core keeps up to @c high_water of them in a free list, linked 
+	through the first word of the released objects, and reuses them. 
+	This is the scheme of the thread pool of the scheduler: each core 
+	only accesses its own list, with preemption off, so no locking is 
+	needed.
+
+	@{
+*/
+
+/** @brief The free list of a core, in a cache line of its own. */
+typedef struct pool_slot {
+	void* free;                      /**< The free list */
+	unsigned int count;              /**< The length of the free list */
+} CACHE_ALIGNED pool_slot;
+
+/** @brief A pool of objects of the same size. */
+typedef struct object_pool {
+	size_t size;                     /**< The size of the objects */
+	unsigned int high_water;         /**< The most objects kept by each core */
+	pool_slot core[MAX_CORES];       /**< The free list of each core */
+} object_pool;
+
+/** @brief Initializer for a pool of objects of type @c type. */
+#define OBJECT_POOL_INIT(type, hw)  { .size = sizeof(type), .high_water = (hw) }
+
+/** @brief Take an object from the pool, or return NULL if it is empty. */
+void* pool_get(object_pool* pool);
+
+/** @brief Return an object to the pool. Return 0 if the pool is full. */
+int pool_put(object_pool* pool, void* obj);
+
+/** @brief Take an object from the pool, or allocate a new one. */
+void* pool_alloc(object_pool* pool);
+
+/** @brief Return an object to the pool, or free it if the pool is full. */
+void pool_free(object_pool* pool, void* obj);
+
+/** @} */
+
+#endif
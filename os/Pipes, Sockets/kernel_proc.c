@@ -2,6 +2,8 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_shm.h"
+#include "kernel_fs.h"
 
 
 /* 
@@ -14,13 +16,18 @@
 
  */
 
-/* The process table */
+/* 
+  The process table. Its entries are initialized lazily, in pid order, 
+  when they are first acquired; the entries from PT_next on have never 
+  been used.
+ */
 PCB PT[MAX_PROC];
+static Pid_t PT_next;
 unsigned int process_count;
 
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  return (pid<0 || pid>=PT_next || PT[pid].pstate==FREE) ? NULL : &PT[pid];
 }
 
 Pid_t get_pid(PCB* pcb)
@@ -34,9 +41,12 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
+  pcb->stack_size = 0;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  fidt_init(& pcb->FIDT);
+  pcb->fidt_lock = MUTEX_INIT;
+  rlnode_init(& pcb->shm_list, NULL);
+  rlnode_init(& pcb->map_list, NULL);
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -46,28 +56,35 @@ static inline void initialize_PCB(PCB* pcb)
 
   pcb->thread_count = 0;
   rlnode_init(& pcb->PTCB_list, NULL);
+  arena_init(& pcb->arena);
+  tidt_init(& pcb->TIDT, & pcb->arena);
 
 }
 
 
+/*
+  Released PCBs are kept in a list linked through the parent field.
+
+  With a PID_REUSE_DELAY of 0, the most recently released pid is reused
+  first, since its PCB is still in the cache. Else, released pids are
+  queued in FIFO order, and a pid is reused only after more than 
+  PID_REUSE_DELAY other pids have been released, or when the table has
+  no fresh entries left. This keeps a pid that a process is still waiting
+  on (or printing) from naming a new process too soon.
+ */
+#ifndef PID_REUSE_DELAY
+#define PID_REUSE_DELAY 0
+#endif
+
 static PCB* pcb_freelist;
+static PCB* pcb_freelist_tail;
+static unsigned int pcb_freecount;
 
 void initialize_processes()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
-  }
-
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
-  }
-
+  PT_next = 0;
+  pcb_freelist = pcb_freelist_tail = NULL;
+  pcb_freecount = 0;
   process_count = 0;
 
   /* Execute a null "idle" process */
@@ -83,10 +100,26 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
-  if(pcb_freelist != NULL) {
+  if(pcb_freelist != NULL && (pcb_freecount > PID_REUSE_DELAY || PT_next == MAX_PROC)) {
     pcb = pcb_freelist;
-    pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
+    if(pcb_freelist == NULL) pcb_freelist_tail = NULL;
+    pcb_freecount--;
+  }
+  else if(PT_next < MAX_PROC) {
+    pcb = & PT[PT_next];
+    initialize_PCB(pcb);
+    PT_next++;
+  }
+
+  if(pcb != NULL) {
+    pcb->pstate = ALIVE;
+    memset(& pcb->stats, 0, sizeof(pcb->stats));
+    memset(& pcb->io, 0, sizeof(pcb->io));
+    memset(& pcb->child_io, 0, sizeof(pcb->child_io));
+    pcb->last_core = -1;
+    pcb->mem = account_create();
+    pcb->arena.account = pcb->mem;
     process_count++;
   }
 
@@ -99,8 +132,18 @@ PCB* acquire_PCB()
 void release_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
+  account_put(pcb->mem);
+  pcb->mem = NULL;
+  if(PID_REUSE_DELAY == 0 || pcb_freelist == NULL) {
+    pcb->parent = pcb_freelist;
+    pcb_freelist = pcb;
+    if(pcb_freelist_tail == NULL) pcb_freelist_tail = pcb;
+  } else {
+    pcb->parent = NULL;
+    pcb_freelist_tail->parent = pcb;
+    pcb_freelist_tail = pcb;
+  }
+  pcb_freecount++;
   process_count--;
 }
 
@@ -132,13 +175,238 @@ void start_main_thread()
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecStack(call, argl, args, 0);
+}
+
+
+/*
+	System call to create a new process, with a given main stack size.
+ */
+Pid_t sys_ExecStack(Task call, int argl, void* args, unsigned int stack_size)
+{
+  return sys_ExecEx(call, argl, args, stack_size, NULL, 0);
+}
+
+
+/*
+  Give the child the streams of the parent. Without a map, all the fids 
+  are inherited. Else, the child gets fid i as a copy of parent fid fdmap[i]
+  (for i<nfds) and nothing else. Return 0, or -1 if the map is illegal.
+ */
+static int inherit_files(PCB* curproc, PCB* newproc, void* map, int nfds)
+{
+  const Fid_t* fdmap = map;
+  if(nfds > MAX_FILEID) 
+    return -1;
+
+  int retcode = 0;
+  Mutex_Lock(& curproc->fidt_lock);
+
+  if(fdmap == NULL) {
+    for(Fid_t i = fidt_next(& curproc->FIDT, 0); i != NOFILE; i = fidt_next(& curproc->FIDT, i+1)) {
+       FCB* fcb = fidt_get(& curproc->FIDT, i);
+       fidt_set(& newproc->FIDT, i, fcb);
+       FCB_incref(fcb);
+    }
+    goto finish;
+  }
+
+  /* Check the whole map before taking anything */
+  for(int i=0; i<nfds; i++)
+    if(fdmap[i] != NOFILE && fidt_get(& curproc->FIDT, fdmap[i]) == NULL) {
+      retcode = -1;
+      goto finish;
+    }
+
+  for(int i=0; i<nfds; i++) {
+    FCB* fcb = fidt_get(& curproc->FIDT, fdmap[i]);
+    if(fcb == NULL) continue;
+    fidt_set(& newproc->FIDT, i, fcb);
+    FCB_incref(fcb);
+  }
+
+finish:
+  Mutex_Unlock(& curproc->fidt_lock);
+  return retcode;
+}
+
+
+/* Return 1 iff fid is one of the n fids */
+static inline int fid_among(Fid_t fid, const Fid_t* fids, int n)
+{
+  for(int i=0; i<n; i++)
+    if(fids[i] == fid) return 1;
+  return 0;
+}
+
+/* Put fcb at fid of the child, closing what was there */
+static void spawn_set(PCB* newproc, Fid_t fid, FCB* fcb)
+{
+  FCB* old = fidt_set(& newproc->FIDT, fid, fcb);
+  if(old) FCB_decref(old);
+}
+
+/*
+  Give the child the streams of the actions of Spawn. The child starts 
+  with no streams. The pipes are made first, with both ends at new fids 
+  of the parent; then, with the fid table of the parent locked, the 
+  sources are checked and the actions applied in order. The fid of the
+  parent's end of each pipe is stored into its action.
+  Return 0, or -1 if the actions are illegal or the pipes are over the
+  memory limit, leaving everything unchanged.
+ */
+static int spawn_files(PCB* curproc, PCB* newproc, void* map, int n)
+{
+  fd_action* actions = map;
+  if(n > SPAWN_MAX_ACTIONS)
+    return -1;
+
+  /* Check what does not depend on the fid table */
+  int npipes = 0;
+  for(int i=0; i<n; i++) {
+    fd_action* a = & actions[i];
+    switch(a->op) {
+      case SPAWN_INHERIT: 
+        continue;
+      case SPAWN_DUP:
+      case SPAWN_MOVE:
+        if(a->src < 0 || a->src >= MAX_FILEID) return -1;
+        break;
+      case SPAWN_CLOSE:
+        break;
+      case SPAWN_PIPE_READ:
+      case SPAWN_PIPE_WRITE:
+        npipes++;
+        break;
+      default:
+        return -1;
+    }
+    if(a->fid < 0 || a->fid >= MAX_FILEID) return -1;
+  }
+
+  /* Make the pipes: reserve all the ends, then build them */
+  Fid_t pipe_fid[2*SPAWN_MAX_ACTIONS];
+  FCB* pipe_fcb[2*SPAWN_MAX_ACTIONS];
+  for(int p=0; p<npipes; p++)
+    if(! FCB_reserve(2, pipe_fid+2*p, pipe_fcb+2*p)) {
+      while(p-- > 0) FCB_unreserve(2, pipe_fid+2*p, pipe_fcb+2*p);
+      return -1;
+    }
+  for(int p=0; p<npipes; p++)
+    if(create_pipe(pipe_fcb+2*p) != 0) {
+      /* Over the memory limit: release the ends left, close the pipes made */
+      FCB_unreserve(2*(npipes-p), pipe_fid+2*p, pipe_fcb+2*p);
+      Mutex_Lock(& curproc->fidt_lock);
+      for(int e=0; e<2*p; e++)
+        fidt_set(& curproc->FIDT, pipe_fid[e], NULL);
+      Mutex_Unlock(& curproc->fidt_lock);
+      for(int e=0; e<2*p; e++)
+        FCB_decref(pipe_fcb[e]);
+      return -1;
+    }
+
+  Mutex_Lock(& curproc->fidt_lock);
+
+  /* The sources must be open, and not the new pipes */
+  for(int i=0; i<n; i++)
+    if((actions[i].op == SPAWN_DUP || actions[i].op == SPAWN_MOVE)
+        && (fidt_get(& curproc->FIDT, actions[i].src) == NULL 
+            || fid_among(actions[i].src, pipe_fid, 2*npipes))) {
+      for(int e=0; e<2*npipes; e++)
+        fidt_set(& curproc->FIDT, pipe_fid[e], NULL);
+      Mutex_Unlock(& curproc->fidt_lock);
+      for(int e=0; e<2*npipes; e++)
+        FCB_decref(pipe_fcb[e]);
+      return -1;
+    }
+
+  int p = 0;
+  for(int i=0; i<n; i++) {
+    fd_action* a = & actions[i];
+    FCB* fcb;
+    switch(a->op) {
+      case SPAWN_INHERIT:
+        for(Fid_t f = fidt_next(& curproc->FIDT, 0); f != NOFILE; f = fidt_next(& curproc->FIDT, f+1)) {
+          if(fid_among(f, pipe_fid, 2*npipes)) continue;
+          fcb = fidt_get(& curproc->FIDT, f);
+          FCB_incref(fcb);
+          spawn_set(newproc, f, fcb);
+        }
+        break;
+      case SPAWN_DUP:
+      case SPAWN_MOVE:
+        fcb = fidt_get(& curproc->FIDT, a->src);
+        FCB_incref(fcb);
+        spawn_set(newproc, a->fid, fcb);
+        break;
+      case SPAWN_CLOSE:
+        spawn_set(newproc, a->fid, NULL);
+        break;
+      default: {
+        /* The child's end moves over, with its reference */
+        int mine = (a->op == SPAWN_PIPE_READ) ? 0 : 1;
+        fidt_set(& curproc->FIDT, pipe_fid[2*p+mine], NULL);
+        spawn_set(newproc, a->fid, pipe_fcb[2*p+mine]);
+        a->src = pipe_fid[2*p+1-mine];
+        p++;
+      }
+    }
+  }
+
+  /* The moved sources leave the parent; the child holds them */
+  FCB* moved[SPAWN_MAX_ACTIONS];
+  int nmoved = 0;
+  for(int i=0; i<n; i++)
+    if(actions[i].op == SPAWN_MOVE 
+        && (moved[nmoved] = fidt_set(& curproc->FIDT, actions[i].src, NULL)) != NULL)
+      nmoved++;
+
+  Mutex_Unlock(& curproc->fidt_lock);
+
+  while(nmoved > 0)
+    FCB_decref(moved[--nmoved]);
+  return 0;
+}
+
+
+/*
+	System call to create a new process, with a given main stack size
+  and the streams of a map.
+ */
+/* Free the arguments of a process, unless they are inline */
+static void release_args(PCB* pcb)
+{
+  if(pcb->args != NULL && pcb->args != pcb->args_inline) {
+    mem_uncharge(pcb->mem, MEM_KERNEL, pcb->argl);
+    free(pcb->args);
+  }
+  pcb->args = NULL;
+}
+
+
+/* 
+  Create a process. If given is set, the new process takes the args, and
+  they are released on error. The child gets its streams from files(), 
+  by the map of n entries (see inherit_files() and spawn_files()).
+ */
+static Pid_t exec_process(Task call, int argl, void* args, int given, unsigned int stack_size, 
+  int (*files)(PCB*, PCB*, void*, int), void* map, int n)
 {
   PCB *curproc, *newproc;
+
+  if(n < 0 || (n > 0 && map == NULL)) {
+    if(given) free(args);
+    return NOPROC;
+  }
   
   /* The new process PCB */
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {  /* We have run out of PIDs! */
+    if(given) free(args);
+    goto finish;
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
@@ -150,30 +418,34 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Inherit parent */
     curproc = CURPROC;
 
+    /* Inherit file streams from parent */
+    if(files(curproc, newproc, map, n) != 0) {
+      release_PCB(newproc);
+      if(given) free(args);
+      return NOPROC;
+    }
+
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
-
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
 
-  /* Copy the arguments to new storage, owned by the new process */
+  /* Take the given arguments, or copy them to storage owned by the new process */
   newproc->argl = argl;
-  if(args!=NULL) {
-    newproc->args = malloc(argl);
+  if(args==NULL)
+    newproc->args = NULL;
+  else if(given)
+    newproc->args = args;
+  else {
+    newproc->args = (argl <= EXEC_INLINE_ARGS) ? newproc->args_inline : xmalloc(argl);
     memcpy(newproc->args, args, argl);
   }
-  else
-    newproc->args=NULL;
+  if(newproc->args != NULL && newproc->args != newproc->args_inline)
+    mem_force_charge(newproc->mem, MEM_KERNEL, argl);
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -184,20 +456,46 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
     //Make main thread
     newproc->thread_count++;
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread_stack(newproc, start_main_thread, stack_size);
+    newproc->stack_size = newproc->main_thread->stack_size;
 
     //the main thread is unique because it does not have ptcb
     newproc->main_thread->owner_ptcb = NULL;
-    
-    wakeup(newproc->main_thread);
   }
 
+  /* The limits are inherited after the main thread is made, so that
+     they only hold the child to what it creates itself */
+  if(newproc->parent != NULL)
+    for(int k=0; k<MEM_KINDS; k++)
+      newproc->mem->limit[k] = newproc->parent->mem->limit[k];
+
+  if(call != NULL)
+    wakeup(newproc->main_thread);
+
 
 finish:
   return get_pid(newproc);
 }
 
 
+Pid_t sys_ExecEx(Task call, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds)
+{
+  return exec_process(call, argl, args, 0, stack_size, inherit_files, (void*) fdmap, nfds);
+}
+
+
+Pid_t sys_ExecGive(Task call, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds)
+{
+  return exec_process(call, argl, args, 1, stack_size, inherit_files, (void*) fdmap, nfds);
+}
+
+
+Pid_t sys_Spawn(Task call, int argl, void* args, fd_action* actions, int n)
+{
+  return exec_process(call, argl, args, 0, 0, spawn_files, actions, n);
+}
+
+
 /* System call */
 Pid_t sys_GetPid()
 {
@@ -216,6 +514,11 @@ static void cleanup_zombie(PCB* pcb, int* status)
   if(status != NULL)
     *status = pcb->exitval;
 
+  /* All the threads are gone, so the counts are final */
+  PCB* parent = pcb->parent;
+  parent->child_io.read += pcb->io.read + pcb->child_io.read;
+  parent->child_io.written += pcb->io.written + pcb->child_io.written;
+
   rlist_remove(& pcb->children_node);
   rlist_remove(& pcb->exited_node);
 
@@ -240,8 +543,9 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
     goto finish;
   }
 
-  /* Ok, child is a legal child of mine. Wait for it to exit. */
-  while(child->pstate == ALIVE)
+  /* Ok, child is a legal child of mine. Wait for it to exit,
+     together with all its threads. */
+  while(child->pstate == ALIVE || child->thread_count > 0)
     kernel_wait(& parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
@@ -291,6 +595,52 @@ Pid_t sys_WaitChild(Pid_t cpid, int* status)
 }
 
 
+int sys_WaitChildren(Pid_t* pids, int* exitvals, int n)
+{
+  if(n <= 0) return -1;
+
+  PCB* parent = CURPROC;
+
+  if(is_rlist_empty(& parent->children_list))
+    return 0;
+
+  while(is_rlist_empty(& parent->exited_list)) {
+    kernel_wait(& parent->child_exit, SCHED_USER);
+  }
+
+  int count = 0;
+  while(count < n && !is_rlist_empty(& parent->exited_list)) {
+    PCB* child = parent->exited_list.next->pcb;
+    assert(child->pstate == ZOMBIE);
+    if(pids) pids[count] = get_pid(child);
+    cleanup_zombie(child, exitvals ? & exitvals[count] : NULL);
+    count++;
+  }
+
+  return count;
+}
+
+
+_Static_assert((int) LIMIT_KERNEL_MEMORY == (int) MEM_KERNEL && (int) LIMIT_STACK_MEMORY == (int) MEM_STACK,
+  "limit_resource does not follow mem_kind");
+
+/* A limit is read without locks by the threads that charge the account */
+int sys_SetLimit(limit_resource resource, unsigned long bytes)
+{
+  if((unsigned int) resource >= MEM_KINDS) return -1;
+  __atomic_store_n(& CURPROC->mem->limit[resource], bytes, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+int sys_GetLimit(limit_resource resource, unsigned long* bytes)
+{
+  if((unsigned int) resource >= MEM_KINDS || bytes == NULL) return -1;
+  *bytes = __atomic_load_n(& CURPROC->mem->limit[resource], __ATOMIC_RELAXED);
+  return 0;
+}
+
+
 void sys_Exit(int exitval)
 {
   /* Right here, we must check that we are not the boot task. If we are, 
@@ -302,27 +652,30 @@ void sys_Exit(int exitval)
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* Do all the other cleanup we want here, close files etc. */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
-  }
-
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+  release_args(curproc);
+
+  /* Clean up FIDT. The streams are closed outside the kernel lock 
+     and the table lock, since closing may block. */
+  kernel_unlock();
+  Mutex_Lock(& curproc->fidt_lock);
+  for(Fid_t i; (i = fidt_next(& curproc->FIDT, 0)) != NOFILE; ) {
+    FCB* fcb = fidt_set(& curproc->FIDT, i, NULL);
+    Mutex_Unlock(& curproc->fidt_lock);
+    FCB_decref(fcb);
+    Mutex_Lock(& curproc->fidt_lock);
   }
+  fidt_destroy(& curproc->FIDT);
+  Mutex_Unlock(& curproc->fidt_lock);
+  shm_detach_all(curproc);
+  fs_unmap_all(curproc);
+  kernel_lock();
 
   /* Reparent any children of the exiting process to the 
-     initial task */
+     initial task. The list is moved as a whole. */
   PCB* initpcb = get_pcb(1);
-  while(!is_rlist_empty(& curproc->children_list)) {
-    rlnode* child = rlist_pop_front(& curproc->children_list);
+  for(rlnode* child = curproc->children_list.next; child != & curproc->children_list; child = child->next)
     child->pcb->parent = initpcb;
-    rlist_push_front(& initpcb->children_list, child);
-  }
+  rlist_append(& initpcb->children_list, & curproc->children_list);
 
   /* Add exited children to the initial task's exited list 
      and signal the initial task */
@@ -331,12 +684,6 @@ void sys_Exit(int exitval)
     kernel_broadcast(& initpcb->child_exit);
   }
 
-  /* Put me into my parent's exited list */
-  if(curproc->parent != NULL) {   /* Maybe this is init */
-    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    kernel_broadcast(& curproc->parent->child_exit);
-  }
-
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
 
@@ -344,82 +691,110 @@ void sys_Exit(int exitval)
   curproc->pstate = ZOMBIE;
   curproc->exitval = exitval;
 
-  /* Free remaining PTCBs */
-  rlnode* sel;
-  while(! is_rlist_empty(& (curproc->PTCB_list))){
-    sel = rlist_pop_front(&(curproc->PTCB_list));
-    free(sel->ptcb);
-  }
   /* Bye-bye cruel world */
-  curproc->thread_count--;
+  process_thread_exit();
   kernel_sleep(EXITED, SCHED_USER);
 }
 
 
-
-  /************** Process Info ****************/
-
-
-//  Look at the pcb just before we display them to make them as recent as possible.
-int procinfo_read(void* procinfo_obj, char* buf, unsigned int size)
+void process_thread_exit()
 {
-  procinfo_CB* pi_CB = (procinfo_CB*) procinfo_obj;
+  PCB* curproc = CURPROC;
+  if(--curproc->thread_count > 0 || curproc->pstate != ZOMBIE)
+    return;
 
-  // Check process table. Take info from all no free positions.
-  while(1){
-    if(PT[pi_CB->count].pstate != FREE){
+  /* The remaining PTCBs, e.g., those of detached threads, go with the arena,
+     which takes along any kernel object the process did not release */
+  rlnode_init(& curproc->PTCB_list, NULL);
+  tidt_destroy(& curproc->TIDT);
+  arena_release(& curproc->arena);
 
-      // Allocate space for procinfos.
-      pi_CB->data = (procinfo*) xmalloc(sizeof(procinfo));
+  /* Put me into my parent's exited list */
+  if(curproc->parent != NULL) {   /* Maybe this is init */
+    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
+    kernel_broadcast(& curproc->parent->child_exit);
+  }
+}
 
-      // Save process' variables.
-      pi_CB->data->pid = get_pid(& PT[pi_CB->count]);
-      pi_CB->data->ppid = get_pid(PT[pi_CB->count].parent);
 
-      pi_CB->data->alive = (PT[pi_CB->count].pstate == ALIVE)? 1: 0;
 
-      pi_CB->data->thread_count = PT[pi_CB->count].thread_count;
-      pi_CB->data->main_task = PT[pi_CB->count].main_task;
+  /************** Process Info ****************/
 
-      pi_CB->data->argl = PT[pi_CB->count].argl;
 
-      // Check that argl max size = 128 byte. Keep the first 128 if bigger.
-      if(PT[pi_CB->count].argl > PROCINFO_MAX_ARGS_SIZE) 
-        memcpy(pi_CB->data->args, PT[pi_CB->count].args, PROCINFO_MAX_ARGS_SIZE);
-      else
-        memcpy(pi_CB->data->args, PT[pi_CB->count].args, PT[pi_CB->count].argl);
+/*
+  An information stream holds a snapshot of the process table, taken 
+  when the stream is opened. It is a single block, holding the records
+  of all the used PCBs (except the idle process).
+ */
+typedef struct procinfo_snapshot
+{
+  unsigned int count;     /* The number of records */
+  unsigned int pos;       /* The next record to read */
+  procinfo info[];        /* The records */
+} procinfo_snapshot;
 
-      // Next PCB.
-      pi_CB->count++;
 
-      // Remove a procinfo and copy it to the buf.
-      memcpy(buf, pi_CB->data, size);
+/* Fill the record of an used PCB */
+static void procinfo_fill(procinfo* info, PCB* pcb)
+{
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE) ? 1 : 0;
+  info->thread_count = pcb->thread_count;
+  info->stack_size = pcb->stack_size;
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+
+  _Static_assert(SCHED_CAUSES == PROCINFO_SCHED_CAUSES, "procinfo does not follow SCHED_CAUSE");
+  info->cpu_time = __atomic_load_n(& pcb->stats.runtime, __ATOMIC_RELAXED);
+  info->voluntary_switches = info->involuntary_switches = 0;
+  for(int c=0; c<SCHED_CAUSES; c++) {
+    info->sched_switches[c] = __atomic_load_n(& pcb->stats.switches[c], __ATOMIC_ACQUIRE);
+    if(c == SCHED_QUANTUM || c == SCHED_PREEMPT)
+      info->involuntary_switches += info->sched_switches[c];
+    else
+      info->voluntary_switches += info->sched_switches[c];
+  }
+  /* A thread gains a core before it leaves it, so reading the runs last 
+     gives at least as many runs as the switches read. */
+  info->run_count = __atomic_load_n(& pcb->stats.runs, __ATOMIC_RELAXED);
+  info->io_read = __atomic_load_n(& pcb->io.read, __ATOMIC_RELAXED);
+  info->io_written = __atomic_load_n(& pcb->io.written, __ATOMIC_RELAXED);
+  info->child_io_read = pcb->child_io.read;
+  info->child_io_written = pcb->child_io.written;
+  info->priority = pcb->main_thread ? sched_priority(pcb->main_thread) : -1;
+  info->last_core = __atomic_load_n(& pcb->last_core, __ATOMIC_RELAXED);
+  info->kernel_mem = mem_charged(pcb->mem, MEM_KERNEL);
+  info->stack_mem = mem_charged(pcb->mem, MEM_STACK);
+
+  /* The args of a zombie have been released; keep the first bytes, if bigger */
+  unsigned int argl = (pcb->argl > PROCINFO_MAX_ARGS_SIZE) ? PROCINFO_MAX_ARGS_SIZE : pcb->argl;
+  if(pcb->args != NULL)
+    memcpy(info->args, pcb->args, argl);
+}
 
-      // Clear space. They are not needed after one use.
-      free(pi_CB->data);
 
-      break;
-    }
+/* Return as many whole records as fit into buf */
+static int procinfo_read(void* procinfo_obj, char* buf, unsigned int size)
+{
+  procinfo_snapshot* snap = (procinfo_snapshot*) procinfo_obj;
 
-    // Next PCB.
-    pi_CB->count++;
+  unsigned int left = snap->count - snap->pos;
+  if(left == 0) return 0;
 
-    // Return 0 when we looked the whole PT. 
-    if(pi_CB->count == MAX_PROC - 1){
-      return 0;
-    }
-  }
+  unsigned int n = size / sizeof(procinfo);
+  if(n == 0) return -1;
+  if(n > left) n = left;
 
-  return size;
+  memcpy(buf, & snap->info[snap->pos], n*sizeof(procinfo));
+  snap->pos += n;
+  return n*sizeof(procinfo);
 }
 
 
-int procinfo_close(void* procinfo_obj)
+static int procinfo_close(void* procinfo_obj)
 {
-  procinfo_CB* pi_CB = (procinfo_CB*) procinfo_obj;
-  
-  free(pi_CB);
-
+  free(procinfo_obj);
   return 0;
 }
 
@@ -434,22 +809,30 @@ static file_ops procinfo_ops = {
 
 Fid_t sys_OpenInfo()
 {
-
-  // Reserve FCB
-  Fid_t fid = 0;
-  FCB* fcb = NULL;
+  Fid_t fid;
+  FCB* fcb;
   if(!FCB_reserve(1, &fid, &fcb))
     return NOFILE;
 
-  // Allocate space for piCB.
-  procinfo_CB* pi_CB = (procinfo_CB*) xmalloc(sizeof(procinfo_CB));
+  /* The process table is protected by the kernel lock. */
+  kernel_lock();
 
-  // Fill fcb.
-  fcb->streamobj = pi_CB;
-  fcb->streamfunc = &procinfo_ops;
+  procinfo_snapshot* snap = (procinfo_snapshot*) 
+    xmalloc(sizeof(procinfo_snapshot) + process_count*sizeof(procinfo));
+  snap->count = 0;
+  snap->pos = 0;
 
-  // Start from init.
-  pi_CB->count = 1;
+  /* Start from init */
+  for(Pid_t p=1; p<PT_next; p++) {
+    if(PT[p].pstate != FREE) {
+      assert(snap->count < process_count);
+      procinfo_fill(& snap->info[snap->count++], & PT[p]);
+    }
+  }
+
+  kernel_unlock();
 
+  fcb->streamobj = snap;
+  fcb->streamfunc = &procinfo_ops;
   return fid;
-}
\ No newline at end of file
+}
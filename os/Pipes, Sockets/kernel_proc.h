@@ -17,6 +17,9 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
+#include "kernel_threads.h"
+#include "kernel_account.h"
 
 /**
   @brief PID state
@@ -30,6 +33,12 @@ typedef enum pid_state_e {
   ZOMBIE  /**< The PID is held by a zombie */
 } pid_state;
 
+/** @brief Byte counts of I/O */
+typedef struct io_stats {
+  unsigned long read;     /**< Bytes returned by Read, ReadV and Splice */
+  unsigned long written;  /**< Bytes accepted by Write, WriteV and Splice */
+} io_stats;
+
 /**
   @brief Process Control Block.
 
@@ -45,6 +54,8 @@ typedef struct process_control_block {
   Task main_task;         /**< The main thread's function */
   int argl;               /**< The main thread's argument length */
   void* args;             /**< The main thread's argument string */
+  char args_inline[EXEC_INLINE_ARGS]; /**< Holds @c args when they are small */
+  size_t stack_size;      /**< The main thread's stack size */
 
   rlnode children_list;   /**< List of children */
   rlnode exited_list;     /**< List of exited children */
@@ -53,13 +64,38 @@ typedef struct process_control_block {
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
 
-  FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  fid_table FIDT;         /**< The fileid table of the process */
+  Mutex fidt_lock;        /**< Protects @c FIDT, @c shm_list and @c map_list */
+  rlnode shm_list;        /**< The shared memory attachments, @see kernel_shm.h */
+  rlnode map_list;        /**< The file mappings, @see kernel_fs.h */
 
   rlnode PTCB_list;       /**< List of PTCBs*****************************************************************************************************************************/
+  tid_table TIDT;         /**< Maps the Tids of the process to its PTCBs */
+  kernel_arena arena;     /**< The small kernel objects of the process, @see kernel_arena.h */
   int thread_count; //Thread counter for process
 
+  sched_stats stats;      /**< CPU accounting of all the threads, updated atomically */
+  io_stats io;            /**< Bytes moved by the threads, updated atomically */
+  io_stats child_io;      /**< Bytes moved by the reaped children and their own */
+  int last_core;          /**< The core a thread of the process last gained, or -1 */
+  mem_account* mem;       /**< The memory account, @see kernel_account.h */
+
 } PCB;
 
+/**
+  @brief Add to the bytes read and written by the current process.
+
+  This is called by the I/O system calls, with the bytes they moved.
+*/
+static inline void account_io(int nread, int nwritten)
+{
+  PCB* cur = CURPROC;
+  if(nread > 0)
+    __atomic_add_fetch(& cur->io.read, (unsigned long) nread, __ATOMIC_RELAXED);
+  if(nwritten > 0)
+    __atomic_add_fetch(& cur->io.written, (unsigned long) nwritten, __ATOMIC_RELAXED);
+}
+
 /**
   @brief Initialize the process table.
 
@@ -92,6 +128,16 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Count out a thread of the current process, as it exits.
+
+  When the last thread of an exited process leaves, its PTCBs and arena
+  are released, and the process is passed to its parent to be reaped.
+  Until then, the threads that outlive @c Exit() keep running in a 
+  valid process. This must be called with the kernel lock held.
+*/
+void process_thread_exit();
+
 /** @} */
 
 #endif
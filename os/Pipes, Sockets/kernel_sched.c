@@ -7,6 +7,8 @@
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_threads.h"
+#include "kernel_trace.h"
+#include "kernel_sys.h"
 
 
 #ifndef NVALGRIND
@@ -39,6 +41,10 @@
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
+
+  When MMAPPED_THREAD_MEM and THREAD_GUARD_PAGE are both defined, a page with
+  no access rights is placed between the TCB and the stack, so that a stack
+  overflow is caught as a seg.fault, before it corrupts the TCB.
  */
 
 
@@ -46,8 +52,14 @@
   A counter for active threads. By "active", we mean 'existing', 
   with the exception of idle threads (they don't count).
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+/* The threads that have been spawned and not released, over all cores */
+static long sched_active_threads()
+{
+  long n = 0;
+  for(uint c = 0; c < cpu_cores(); c++)
+    n += __atomic_load_n(& cctx[c].active_threads, __ATOMIC_RELAXED);
+  return n;
+}
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE  (1<<12)
@@ -55,347 +67,1597 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
+/* The stacks hold the trampolines of nested functions, and heap memory is
+   not executable on current hosts, so thread blocks are mapped */
+#define MMAPPED_THREAD_MEM
+//#define THREAD_GUARD_PAGE
+
+#if defined(MMAPPED_THREAD_MEM) && defined(THREAD_GUARD_PAGE)
+#define THREAD_GUARD_SIZE  SYSTEM_PAGE_SIZE
+#else
+#define THREAD_GUARD_SIZE  0
+#endif
+
+#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_GUARD_SIZE+THREAD_STACK_SIZE)
+
+#ifdef MMAPPED_THREAD_MEM 
+
+/*
+  Use mmap to allocate a thread. If THREAD_GUARD_PAGE is defined, the
+  "sentinel page" betweeen the TCB and the stack gets PROT_NONE access, 
+  so that a stack overflow is detected as seg.fault.
+ */
+void free_thread(void* ptr, size_t size)
+{
+  CHECK(munmap(ptr, size));
+}
+
+void* allocate_thread(size_t size)
+{
+  void* ptr = mmap(NULL, size, 
+      PROT_READ|PROT_WRITE|PROT_EXEC,  
+      MAP_ANONYMOUS  | MAP_PRIVATE | MAP_NORESERVE
+      , -1,0);
+  
+  CHECK((ptr==MAP_FAILED)?-1:0);
+
+#if THREAD_GUARD_SIZE > 0
+  CHECK(mprotect(ptr+THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
+#endif
+
+  return ptr;
+}
+#else
+/*
+  Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
+  be made easily to 'detect' stack overflow.
+ */
+void free_thread(void* ptr, size_t size)
+{
+  free(ptr);
+}
+
+void* allocate_thread(size_t size)
+{
+  void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+  CHECK((ptr==NULL)?-1:0);
+  return ptr;
+}
+#endif
+
+
+/*
+  Threads with a non-default stack size are always mapped, with a guard page 
+  between the TCB and the stack. The stack is reserved with MAP_NORESERVE, so
+  that its pages are only committed when touched.
+ */
+#define SIZED_THREAD_SIZE(stack_size)  (THREAD_TCB_SIZE+SYSTEM_PAGE_SIZE+(stack_size))
+
+static void* allocate_sized_thread(size_t stack_size)
+{
+  size_t size = SIZED_THREAD_SIZE(stack_size);
+  void* ptr = mmap(NULL, size, 
+      PROT_READ|PROT_WRITE|PROT_EXEC,  
+      MAP_ANONYMOUS  | MAP_PRIVATE | MAP_NORESERVE
+      , -1,0);
+  CHECK((ptr==MAP_FAILED)?-1:0);
+  CHECK(mprotect(ptr+THREAD_TCB_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE));
+  return ptr;
+}
+
+static void free_sized_thread(TCB* tcb)
+{
+  CHECK(munmap(tcb, SIZED_THREAD_SIZE(tcb->stack_size)));
+}
+
+/* Turn a stack size hint into an actual stack size */
+static size_t thread_stack_size(size_t hint)
+{
+  if(hint == 0) return THREAD_STACK_SIZE;
+  if(hint < THREAD_MIN_STACK_SIZE) hint = THREAD_MIN_STACK_SIZE;
+  if(hint > THREAD_MAX_STACK_SIZE) hint = THREAD_MAX_STACK_SIZE;
+  return ((hint+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE;
+}
+
+
+/*
+  The thread pool.
+  ----------------
+
+  Released thread blocks are not returned to the system immediately. Each core 
+  keeps up to THREAD_POOL_HIGH_WATER of them in a free list (linked through the
+  @c sched_node of the dead TCB), and spawn_thread() reuses them.
+
+  Each core only accesses its own pool, with preemption off, so no locking
+  is needed.
+ */
+#ifndef THREAD_POOL_HIGH_WATER
+#define THREAD_POOL_HIGH_WATER 16
+#endif
+
+static TCB* thread_pool_get()
+{
+  TCB* tcb = NULL;
+  int preempt = preempt_off;
+  CCB* ccb = & CURCORE;
+  if(! is_rlist_empty(& ccb->thread_pool)) {
+    tcb = rlist_pop_front(& ccb->thread_pool)->tcb;
+    ccb->thread_pool_size--;
+  }
+  if(preempt) preempt_on;
+
+  if(tcb == NULL)
+    tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  return tcb;
+}
+
+static void thread_pool_put(TCB* tcb)
+{
+  int preempt = preempt_off;
+  CCB* ccb = & CURCORE;
+  if(ccb->thread_pool_size < THREAD_POOL_HIGH_WATER) {
+    rlnode_init(& tcb->sched_node, tcb);
+    rlist_push_front(& ccb->thread_pool, & tcb->sched_node);
+    ccb->thread_pool_size++;
+    tcb = NULL;
+  }
+  if(preempt) preempt_on;
+
+  if(tcb != NULL)
+    free_thread(tcb, THREAD_SIZE);
+}
+
+/* Return the pooled blocks of the current core to the system */
+static void thread_pool_drain()
+{
+  CCB* ccb = & CURCORE;
+  while(! is_rlist_empty(& ccb->thread_pool)) {
+    TCB* tcb = rlist_pop_front(& ccb->thread_pool)->tcb;
+    free_thread(tcb, THREAD_SIZE);
+  }
+  ccb->thread_pool_size = 0;
+}
+
+
+/*
+  This is the function that is used to start normal threads.
+*/
+void gain(int preempt); /* forward */
+
+static void thread_start()
+{
+  gain(1);
+  CURTHREAD->thread_func();
+
+  /* We are not supposed to get here! */
+  assert(0);
+}
+
+
+static TCB* spawn(PCB* pcb, void (*func)(), size_t stack_size, int limited);
+
+/*
+  Initialize and return a new TCB
+*/
+TCB* spawn_thread(PCB* pcb, void (*func)())  
+{
+  return spawn(pcb, func, 0, 0);
+}
+
+
+/*
+  Initialize and return a new TCB, whose stack has the given size
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+  return spawn(pcb, func, stack_size, 1);
+}
+
+
+/*
+  Charge the TCB and stack of a new thread to the account of its process,
+  within the limits if limited. Return -1 if a limit was hit.
+ */
+static int thread_charge(mem_account* acct, size_t stack_size, int limited)
+{
+  if(! limited) {
+    mem_force_charge(acct, MEM_KERNEL, THREAD_TCB_SIZE);
+    mem_force_charge(acct, MEM_STACK, stack_size);
+    return 0;
+  }
+  if(mem_charge(acct, MEM_KERNEL, THREAD_TCB_SIZE) != 0)
+    return -1;
+  if(mem_charge(acct, MEM_STACK, stack_size) != 0) {
+    mem_uncharge(acct, MEM_KERNEL, THREAD_TCB_SIZE);
+    return -1;
+  }
+  return 0;
+}
+
+
+static TCB* spawn(PCB* pcb, void (*func)(), size_t stack_size, int limited)
+{
+  stack_size = thread_stack_size(stack_size);
+
+  if(thread_charge(pcb->mem, stack_size, limited) != 0)
+    return NULL;
+
+  /* The allocated thread size must be a multiple of page size */
+  TCB* tcb;
+  void* sp;
+  if(stack_size == THREAD_STACK_SIZE) {
+    tcb = thread_pool_get();
+    sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
+  } else {
+    tcb = (TCB*) allocate_sized_thread(stack_size);
+    sp = ((void*)tcb) + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE;
+  }
+  tcb->stack_size = stack_size;
+  tcb->account = pcb->mem;
+  account_hold(tcb->account);
+
+  /* Set the owner */
+  tcb->owner_pcb = pcb;
+  //ptcb init
+
+  /* Initialize the other attributes */
+  tcb->type = NORMAL_THREAD;
+  tcb->state = INIT;
+  tcb->phase = CTX_CLEAN;
+  tcb->state_spinlock = MUTEX_INIT;
+  tcb->thread_func = func;
+  tcb->thread_arg = NULL;
+  tcb->wake_channel = NULL;
+  tcb->dl_period = tcb->dl_runtime = 0;
+  tcb->dl_deadline = tcb->dl_budget = 0;
+  tcb->dl_util = 0;
+  tcb->dl_queued = 0;
+  tcb->wakeup_time = NO_TIMEOUT;
+  rhnode_init(& tcb->timeout_node, tcb);
+  tcb->nonblocking_io = 0;
+  memset(& tcb->stats, 0, sizeof(tcb->stats));
+  tcb->vruntime = 0;
+
+  /* Init priority for the first list. */
+  tcb->priority = TOP_PRIORITY;
+
+  /* No priority is lent to it */
+  tcb->pi_priority = -1;
+  tcb->pi_lock = NULL;
+  tcb->sched_core = cpu_core_id;
+  tcb->affinity = ~0u;
+
+  rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
+
+  /* Init the context */
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
+
+#ifndef NVALGRIND
+  tcb->valgrind_stack_id = 
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
+#endif
+
+  /* increase the count of active threads */
+  __atomic_add_fetch(& CURCORE.active_threads, 1, __ATOMIC_RELAXED);
+ 
+  return tcb;
+}
+
+
+/*
+  This is called from gain(), with preemption off, once the exited 
+  thread has been switched out.
+ */
+void release_TCB(TCB* tcb)
+{
+#ifndef NVALGRIND
+  VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
+#endif
+
+  /* The process may have been reaped, but the account is still held */
+  mem_uncharge(tcb->account, MEM_KERNEL, THREAD_TCB_SIZE);
+  mem_uncharge(tcb->account, MEM_STACK, tcb->stack_size);
+  account_put(tcb->account);
+
+  if(tcb->stack_size == THREAD_STACK_SIZE)
+    thread_pool_put(tcb);
+  else
+    free_sized_thread(tcb);
+
+  __atomic_sub_fetch(& CURCORE.active_threads, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+
+/* Core control blocks */
+CCB cctx[MAX_CORES];
+
+
+/*
+  Each core keeps its own scheduler queue, an array of doubly linked 
+  lists (one per priority level) stored in its CCB and protected by
+  the core's @c sched_spinlock. The order of the queue is up to the
+  scheduling policy (see below).
+  
+  Also, the scheduler contains a pairing heap of all the sleeping
+  threads with a timeout, keyed on @c wakeup_time. The heap node is
+  embedded in the TCB (@c timeout_node), so insertion is O(1), removal
+  is O(log n) amortized, and nothing is allocated. The heap is shared 
+  among cores and is protected by @c timeout_spinlock.
+
+  The state and phase of each thread are protected by the thread's
+  own @c state_spinlock.
+
+  Lock order:  dl_spinlock  ->  tcb->state_spinlock  ->  timeout_spinlock  ->  ccb->sched_spinlock
+  No code ever holds the @c sched_spinlock of two cores at the same time.
+*/
+
+
+rheap TIMEOUT_HEAP;                   /* The heap of threads with a timeout */
+Mutex timeout_spinlock = MUTEX_INIT;  /* spinlock for the timeout heap */
+
+/* The wakeup time at the top of the heap, readable without locking */
+TimerDuration timeout_next = NO_TIMEOUT;
+
+/*
+  The timeouts are served by the TIMEOUT timer of one core at a time, set
+  for the earliest of them. A core that moves the earliest timeout earlier 
+  sets its own timer, and the core whose timer expires sets it for the next
+  timeout. Timers left behind on other cores expire to no effect.
+  This is the time the timer is set for, protected by timeout_spinlock.
+ */
+static TimerDuration timeout_alarm = NO_TIMEOUT;
+
+
+
+static TimerDuration sched_quantum(TCB* tcb);
+static void sched_timeout_expired();
+
+/* Set the quantum alarm of the core to go off in usec, or never if 0 */
+static inline void sched_set_alarm(TimerDuration usec)
+{
+  bios_set_core_timer(SCHED_TIMER_QUANTUM, (usec == 0) ? CORE_TIMER_OFF : bios_clock() + usec);
+}
+
+/* Interrupt handler for ALARM */
+void yield_handler()
+{
+  uint expired = bios_core_timers_expired();
+  if(expired & (1u << SCHED_TIMER_TIMEOUT))
+    sched_timeout_expired();
+
+  if(expired & (1u << SCHED_TIMER_QUANTUM))
+    yield(SCHED_QUANTUM);
+  else if(CURTHREAD->type != IDLE_THREAD && __atomic_exchange_n(& CURCORE.need_resched, 0, __ATOMIC_RELAXED))
+    yield(SCHED_PREEMPT);
+}
+
+/* 
+  Interrupt handle for inter-core interrupts. Another core queued a thread
+  on this core, which may be running its thread without an alarm, or the
+  thread may be preempted by one of higher priority. The idle thread looks 
+  at its queue anyway, once the core is restarted.
+ */
+void ici_handler() 
+{
+  TCB* current = CURTHREAD;
+  if(current->type == IDLE_THREAD)
+    return;
+  if(__atomic_exchange_n(& CURCORE.need_resched, 0, __ATOMIC_RELAXED))
+    yield(SCHED_PREEMPT);
+  else
+    sched_set_alarm(sched_quantum(current));
+}
+
+
+/*
+  Timeout heap primitives.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+
+static int timeout_earlier(rhnode* a, rhnode* b)
+{
+  return a->tcb->wakeup_time < b->tcb->wakeup_time;
+}
+
+static inline void timeout_alarm_set(TimerDuration when)
+{
+  bios_set_core_timer(SCHED_TIMER_TIMEOUT, when);
+  timeout_alarm = when;
+}
+
+static inline void timeout_heap_update_next()
+{
+  TimerDuration next = is_rheap_empty(&TIMEOUT_HEAP) ? NO_TIMEOUT : rheap_min(&TIMEOUT_HEAP)->tcb->wakeup_time;
+  __atomic_store_n(&timeout_next, next, __ATOMIC_RELAXED);
+  if(next < timeout_alarm)
+    timeout_alarm_set(next);
+}
+
+static void timeout_heap_insert(TCB* tcb)
+{
+  rheap_insert(&TIMEOUT_HEAP, &tcb->timeout_node);
+  timeout_heap_update_next();
+}
+
+static void timeout_heap_remove(TCB* tcb)
+{
+  rheap_remove(&TIMEOUT_HEAP, &tcb->timeout_node);
+  timeout_heap_update_next();
+}
+
+
+TimerDuration sched_next_timeout()
+{
+  return __atomic_load_n(&timeout_next, __ATOMIC_RELAXED);
+}
+
+
+/*
+  Possibly add TCB to the scheduler timeout heap.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+  if(timeout!=NO_TIMEOUT){
+
+    Spin_Lock(& timeout_spinlock);
+
+    /* set the wakeup time */
+    TimerDuration curtime = bios_clock();
+    tcb->wakeup_time = curtime+timeout;
+
+    /* add to the heap */
+    timeout_heap_insert(tcb);
+
+    Spin_Unlock(& timeout_spinlock);
+  }
+}
+
+
+/* Bit mask for the priority bitmap */
+#define PRIORITY_BIT(i)  (1u << (i))
+#define PRIORITY_MASK    (PRIORITY_BIT(PRIORITY_LISTS) - 1)
+
+/* The highest priority level set in a non-empty bitmap */
+static inline int sched_bitmap_top(unsigned int bitmap)
+{
+  assert(bitmap != 0);
+  return (int)(sizeof(unsigned int)*8 - 1) - __builtin_clz(bitmap);
+}
+
+
+/* Return non-zero iff the thread may run on the core */
+static inline int sched_allowed(TCB* tcb, uint core)
+{
+  return (__atomic_load_n(& tcb->affinity, __ATOMIC_RELAXED) >> core) & 1;
+}
+
+/* The mask of the cores of the machine */
+static inline unsigned int sched_all_cores()
+{
+  return (unsigned int) ((1ull << cpu_cores()) - 1);
+}
+
+/* The first thread of a list that may run on the core, or NULL */
+static inline TCB* sched_list_first(rlnode* list, uint core)
+{
+  for(rlnode* n = list->next; n != list; n = n->next)
+    if(sched_allowed(n->tcb, core)) return n->tcb;
+  return NULL;
+}
+
+
+/*
+  Push a TCB at the back of the queue of its priority, counting any
+  priority lent to it.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static inline void sched_list_push(CCB* ccb, TCB* tcb)
+{
+  int prio = sched_priority(tcb);
+  rlist_push_back(& ccb->SCHED[prio], & tcb->sched_node);
+  ccb->sched_bitmap |= PRIORITY_BIT(prio);
+}
+
+
+/*
+  Remove a TCB from list SCHED[i]. The priority of the TCB is set to 
+  @c i, since it may have been boosted, unless the list was chosen by 
+  a lent priority.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static inline TCB* sched_list_take(CCB* ccb, int i, TCB* tcb)
+{
+  assert(ccb->sched_bitmap & PRIORITY_BIT(i));
+  rlist_remove(& tcb->sched_node);
+  if(is_rlist_empty(& ccb->SCHED[i]))
+    ccb->sched_bitmap &= ~PRIORITY_BIT(i);
+  if(__atomic_load_n(& tcb->pi_priority, __ATOMIC_RELAXED) < 0)
+    tcb->priority = i;
+  return tcb;
+}
+
+/* Pop the TCB at the front of non-empty list SCHED[i] */
+static inline TCB* sched_list_pop(CCB* ccb, int i)
+{
+  return sched_list_take(ccb, i, ccb->SCHED[i].next->tcb);
+}
+
+
+/*
+  Deadline threads.
+  -----------------
+
+  A thread with a reservation (see sched_set_deadline()) gets dl_runtime 
+  usec of every dl_period usec. When it becomes ready after its deadline,
+  a new period starts: the deadline moves one period past the current 
+  time, and the budget is refilled. While it has budget, the thread is 
+  queued in the dl_queue of its core, ordered by deadline, which is served
+  before the queue of the policy. It preempts the threads of the policy, 
+  and deadline threads with a later deadline, and runs until it sleeps or
+  spends its budget, without a quantum. A thread without budget is 
+  throttled: instead of being queued, it sleeps in the timeout heap until
+  its deadline. While there are reservations, the alarms of busy cores 
+  come in time for the timeouts, so that throttled threads start their 
+  periods on time.
+
+  The reservations are admitted while their sum stays within DL_MAX_UTIL
+  percent of the cores. This does not guarantee that every deadline is 
+  met, since a core serves only its own dl_queue, but it keeps the 
+  deadline threads from starving the others.
+ */
+
+/* Return non-zero iff the thread is served as a deadline thread */
+static inline int sched_dl_ready(TCB* tcb)
+{
+  return tcb->dl_period != 0 && tcb->dl_budget > 0;
+}
+
+/* The priority a thread preempts with, DL_PRIORITY for a deadline thread */
+static inline int sched_class_priority(TCB* tcb)
+{
+  return sched_dl_ready(tcb) ? DL_PRIORITY : sched_priority(tcb);
+}
+
+/* Return non-zero iff the thread has spent its budget before its deadline */
+static inline int sched_dl_throttled(TCB* tcb)
+{
+  return tcb->dl_period != 0 && tcb->dl_budget == 0 && bios_clock() < tcb->dl_deadline;
+}
+
+/*
+  Start a new period, if the deadline of a ready thread has passed, or
+  else put it to sleep until its deadline, if it is throttled. Return 1
+  in the latter case.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int sched_dl_replenish(TCB* tcb)
+{
+  if(tcb->dl_period == 0)
+    return 0;
+  TimerDuration now = bios_clock();
+  if(now >= tcb->dl_deadline) {
+    tcb->dl_deadline = now + tcb->dl_period;
+    tcb->dl_budget = tcb->dl_runtime;
+    return 0;
+  }
+  if(tcb->dl_budget > 0)
+    return 0;
+
+  tcb->state = STOPPED;
+  Spin_Lock(& timeout_spinlock);
+  tcb->wakeup_time = tcb->dl_deadline;
+  timeout_heap_insert(tcb);
+  Spin_Unlock(& timeout_spinlock);
+  return 1;
+}
+
+/*
+  Charge the time that a thread ran to its budget.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static inline void sched_dl_charge(TCB* tcb, TimerDuration ran)
+{
+  if(tcb->dl_budget > 0)
+    tcb->dl_budget = (ran < tcb->dl_budget) ? tcb->dl_budget - ran : 0;
+}
+
+/*
+  Add a ready thread to the queue of a core: the dl_queue, behind the 
+  threads with the same or an earlier deadline, if it has budget, else 
+  the queue of the policy.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static void sched_enqueue(CCB* ccb, TCB* tcb)
+{
+  if(! sched_dl_ready(tcb)) {
+    sched->enqueue(ccb, tcb);
+    return;
+  }
+  rlnode* q = & ccb->dl_queue;
+  rlnode* n = q->prev;
+  while(n != q && n->tcb->dl_deadline > tcb->dl_deadline)
+    n = n->prev;
+  rlist_push_front(n, & tcb->sched_node);   /* insert after n */
+  tcb->dl_queued = 1;
+}
+
+/* Remove a thread from the dl_queue of its core. sched_spinlock held. */
+static inline TCB* sched_dl_take(TCB* tcb)
+{
+  rlist_remove(& tcb->sched_node);
+  tcb->dl_queued = 0;
+  return tcb;
+}
+
+/* 
+  The length of the next timeslice of a thread: the quantum of the 
+  policy, or the budget of a deadline thread.
+ */
+static TimerDuration sched_quantum(TCB* tcb)
+{
+  if(! sched_dl_ready(tcb))
+    return sched->quantum(tcb);
+  return (tcb->dl_budget > TICKLESS_MIN_ALARM) ? tcb->dl_budget : TICKLESS_MIN_ALARM;
+}
+
+
+/* 
+  Bit c is set while core c runs its idle thread. A core sets its bit
+  before it looks for work for the last time and halts, and those who
+  queue threads look at the bits after they queue, so one of them always
+  sees the other.
+ */
+static unsigned int idle_cores = 0;
+
+/* 
+  Bit c is set while idle core c polls for work, see sched_idle_poll().
+  It is not interrupted for the threads queued meanwhile.
+ */
+static unsigned int polling_cores = 0;
+
+/* The first core of a non-empty mask after core c, going round */
+static inline uint sched_mask_next(unsigned int mask, uint c)
+{
+  unsigned int after = (c+1 < 32) ? mask & ~((2u << c) - 1) : 0;
+  return (uint) __builtin_ctz(after ? after : mask);
+}
+
+/*
+  Choose the core to queue a ready thread on. A thread woken up by its 
+  partner (see sched_wake_affine()) goes to the current core, if nothing
+  else is queued there; *affine is set then. Else, an idle core that it 
+  may run on is best: the current core, the core it last ran on, or the 
+  next one. Idle cores with an empty queue are preferred, so that threads 
+  woken up together spread over the idle cores. Else, it goes to the 
+  current core, or the core it last ran on, or the first core that it 
+  may run on.
+ */
+static uint sched_target(TCB* tcb, int woken, int* affine)
+{
+  uint self = cpu_core_id;
+  uint last = tcb->sched_core;
+  unsigned int allowed = __atomic_load_n(& tcb->affinity, __ATOMIC_RELAXED) & sched_all_cores();
+  unsigned int idle = __atomic_load_n(& idle_cores, __ATOMIC_RELAXED) & allowed;
+
+  CCB* ccb = & CURCORE;
+  TCB* waker = ccb->current_thread;
+  *affine = 0;
+  if(woken && waker != NULL && waker->type != IDLE_THREAD
+      && tcb->wake_channel != NULL && waker->wake_channel == tcb->wake_channel) {
+    if((allowed & (1u << self)) && __atomic_load_n(& ccb->sched_count, __ATOMIC_RELAXED) == 0) {
+      __atomic_store_n(& ccb->wake_affine_hits, ccb->wake_affine_hits + 1, __ATOMIC_RELAXED);
+      *affine = 1;
+      return self;
+    }
+    __atomic_store_n(& ccb->wake_affine_misses, ccb->wake_affine_misses + 1, __ATOMIC_RELAXED);
+  }
+
+  unsigned int empty = idle;
+  for(unsigned int m = idle; m; m &= m-1) {
+    uint c = __builtin_ctz(m);
+    if(__atomic_load_n(& cctx[c].sched_count, __ATOMIC_RELAXED) > 0)
+      empty &= ~(1u << c);
+  }
+  if(empty) idle = empty;
+
+  if(idle) {
+    if(idle & (1u << self)) return self;
+    if(idle & (1u << last)) return last;
+    return sched_mask_next(idle, self);
+  }
+  if(allowed & (1u << self)) return self;
+  if(allowed & (1u << last)) return last;
+  return sched_mask_next(allowed, self);
+}
+
+/*
+  Add TCB to the end of the scheduler list of the core chosen by 
+  sched_target(), unless it is a throttled deadline thread, which is put
+  to sleep (see sched_dl_replenish()). Return the core that must be interrupted for the 
+  thread, or -1: an idle core, a core whose thread runs without an alarm,
+  or a core whose thread is preempted by this one. A deadline thread that 
+  preempts the current thread sets need_resched, see wakeup_many(). When the thread stays
+  on the current core, a core that went idle meanwhile is returned, to 
+  steal it, unless the thread was placed there by wake affinity. 
+  @c woken is set for a thread woken up by the current thread.
+
+  The caller should call sched_notify() afterwards, once it has released 
+  tcb->state_spinlock. Interrupting a core can be slow, and it must not 
+  be done holding spinlocks.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int sched_queue_add(TCB* tcb, int woken)
+{
+  if(sched_dl_replenish(tcb))
+    return -1;
+
+  uint self = cpu_core_id;
+  int affine;
+  uint core = sched_target(tcb, woken, &affine);
+  CCB* ccb = & cctx[core];
+  int kick = 0;
+
+  Spin_Lock(& ccb->sched_spinlock);
+
+  sched_enqueue(ccb, tcb);
+  ccb->sched_count++;
+  tcb->sched_core = ccb->id;
+
+#if SCHED_TICKLESS
+  /* The current thread no longer runs alone, it gets a quantum. 
+     Another core sets its own alarm, when interrupted. */
+  if(ccb->tickless) {
+    ccb->tickless = 0;
+    if(core == self)
+      sched_set_alarm(sched_quantum(ccb->current_thread));
+    else
+      kick = 1;
+  }
+#endif
+
+  /* The thread of another core is preempted by a thread of higher priority,
+     or by a deadline thread with an earlier deadline */
+  int running = __atomic_load_n(& ccb->current_priority, __ATOMIC_RELAXED);
+  int prio = sched_class_priority(tcb);
+  if(running >= 0 && (prio > running || (prio == DL_PRIORITY && running == DL_PRIORITY
+      && tcb->dl_deadline < __atomic_load_n(& ccb->current_deadline, __ATOMIC_RELAXED)))) {
+    if(core != self) {
+      __atomic_store_n(& ccb->need_resched, 1, __ATOMIC_RELAXED);
+      kick = 1;
+    }
+    else if(prio == DL_PRIORITY)
+      __atomic_store_n(& ccb->need_resched, 1, __ATOMIC_RELAXED);
+  }
+
+  Spin_Unlock(& ccb->sched_spinlock);
+
+  if(kick) return core;
+
+#if CONFIG_UP
+  /* The thread is queued here, and we are not halted */
+  return -1;
+#else
+  /* Pairs with the fences of sched_idle_enter() and sched_idle_poll() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned int idle = __atomic_load_n(& idle_cores, __ATOMIC_RELAXED)
+    & ~__atomic_load_n(& polling_cores, __ATOMIC_RELAXED);
+  if(core != self)
+    return (idle & (1u << core)) ? (int) core : -1;
+  idle &= tcb->affinity & sched_all_cores();
+  if(idle == 0 || (idle & (1u << self)) || affine)
+    return -1;           /* Nobody can steal it, or we are idle and will run it, or we keep it */
+  return sched_mask_next(idle, self);
+#endif
+}
+
+
+/*
+  Interrupt the core returned by sched_queue_add(), unless it is -1 or 
+  the current core. Only the given core is touched.
+ */
+static void sched_notify(int core)
+{
+  if(core >= 0 && (uint) core != cpu_core_id)
+    cpu_ici(core);
+}
+
+
+/* The idle thread of the current core is about to look for work and halt */
+static void sched_idle_enter()
+{
+#if ! CONFIG_UP
+  unsigned int bit = 1u << cpu_core_id;
+  if(! (__atomic_load_n(& idle_cores, __ATOMIC_RELAXED) & bit))
+    __atomic_or_fetch(& idle_cores, bit, __ATOMIC_RELAXED);
+  /* Pairs with the fence of sched_queue_add() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/*
+  Idle polling.
+  -------------
+
+  Restarting a halted core takes an interrupt and a hop through the host
+  scheduler, which is slow next to a context switch. If idle_poll_usec is
+  not 0, an idle core first looks at the queues for that long, backing off
+  between looks, and halts only if no work shows up. 
+
+  A polling core sets its bit in polling_cores, and is not interrupted by
+  those who queue threads. Before it halts, it clears the bit and looks 
+  again, so one of them always sees the other, as with idle_cores.
+ */
+
+/* The polling window in usec, 0 to halt at once */
+static unsigned int idle_poll_usec = 0;
+static int idle_poll_requested = -1;
+
+/* The most rounds of cpu_relax() between two looks at the queues */
+#define IDLE_POLL_BACKOFF 64
+
+static int sched_steal();
+
+/* Look for a thread to run, in our queue and the queues of the others */
+static int sched_idle_has_work()
+{
+  return __atomic_load_n(& CURCORE.sched_count, __ATOMIC_RELAXED) != 0 || sched_steal();
+}
+
+/* Poll for work before halting. Return 1 if some was found. */
+static int sched_idle_poll()
+{
+  /* With one core, work can only come from an interrupt, which must not wait */
+  if(CONFIG_UP || idle_poll_usec == 0) 
+    return 0;
+
+  CCB* ccb = & CURCORE;
+  unsigned int bit = 1u << cpu_core_id;
+  TimerDuration deadline = bios_clock() + idle_poll_usec;
+  unsigned long round = 0;
+  int found = 0;
+
+  /* Interrupts wait, the queued threads are found by looking */
+  int preempt = preempt_off;
+  __atomic_or_fetch(& polling_cores, bit, __ATOMIC_RELAXED);
+
+  for(unsigned int backoff = 1; !(found = sched_idle_has_work()); ) {
+    if(bios_clock() >= deadline) break;
+    for(unsigned int i = 0; i < backoff; i++)
+      cpu_spin(round++);
+    if(backoff < IDLE_POLL_BACKOFF) backoff *= 2;
+  }
+
+  __atomic_and_fetch(& polling_cores, ~bit, __ATOMIC_RELAXED);
+  /* Pairs with the fence of sched_queue_add() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(! found) 
+    found = sched_idle_has_work();
+  if(preempt) preempt_on;
+
+  if(found)
+    __atomic_store_n(& ccb->idle_poll_hits, ccb->idle_poll_hits + 1, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n(& ccb->idle_poll_misses, ccb->idle_poll_misses + 1, __ATOMIC_RELAXED);
+  return found;
+}
+
+int set_idle_poll(unsigned int usec)
+{
+  if(usec > IDLE_POLL_MAX) return -1;
+  idle_poll_requested = usec;
+  return 0;
+}
+
+
+/* A thread other than the idle thread gained the current core */
+static void sched_idle_leave()
+{
+#if ! CONFIG_UP
+  unsigned int bit = 1u << cpu_core_id;
+  if(__atomic_load_n(& idle_cores, __ATOMIC_RELAXED) & bit)
+    __atomic_and_fetch(& idle_cores, ~bit, __ATOMIC_RELAXED);
+#endif
+}
+
+
+/*
+  Adjust the state of a thread to make it READY. The thread must
+  already be out of the timeout heap. @c woken is as for sched_queue_add().
+
+  Return the core whose queue the thread was added to, or -1.
+
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD *** 
+ */
+static int sched_mark_ready(TCB* tcb, int woken)
+{
+  /* Mark as ready */
+  tcb->state = READY;
+
+  /* Possibly add to the scheduler queue */
+  if(tcb->phase != CTX_CLEAN) 
+    return -1;
+  return sched_queue_add(tcb, woken);
+}
+
+
+/*
+  Adjust the state of a thread to make it READY.
+  Return the core whose queue the thread was added to, or -1.
+
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD *** 
+ */
+static int sched_make_ready(TCB* tcb)
+{
+  assert(tcb->state == STOPPED || tcb->state == INIT);
+
+  /* Possibly remove from the timeout heap */
+  if(tcb->wakeup_time != NO_TIMEOUT) {
+    /* tcb is in the timeout heap, fix it */
+    Spin_Lock(& timeout_spinlock);
+    assert(rhnode_linked(& tcb->timeout_node) && tcb->state == STOPPED);
+    timeout_heap_remove(tcb);
+    tcb->wakeup_time = NO_TIMEOUT;
+    Spin_Unlock(& timeout_spinlock);
+  }
+
+  return sched_mark_ready(tcb, 1);
+}
+
+
+/*
+  Empty the timeout heap up to the current time and wake up each thread.
+
+  Since we take the locks in reverse order here, we only try to lock
+  each expired thread. If this fails, someone else is handling the 
+  thread right now, and we just retry at the next selection.
+*/
+static void sched_wakeup_expired_timeouts()
+{
+  TimerDuration curtime = bios_clock();
+
+  /* Usually, nothing has expired */
+  if(sched_next_timeout() > curtime)
+    return;
+
+  Spin_Lock(& timeout_spinlock);
+  while(! is_rheap_empty(&TIMEOUT_HEAP)) {
+    TCB* tcb = rheap_min(&TIMEOUT_HEAP)->tcb;
+    if(tcb->wakeup_time > curtime)
+      break;
+    if(! Spin_TryLock(& tcb->state_spinlock))
+      break;
+
+    assert(tcb->state == STOPPED);
+    timeout_heap_remove(tcb);
+    tcb->wakeup_time = NO_TIMEOUT;
+    sched_trace(TRACE_TIMEOUT, 0, tcb, NULL);
+
+    Spin_Unlock(& timeout_spinlock);
+    int core = sched_mark_ready(tcb, 0);
+    Spin_Unlock(& tcb->state_spinlock);
+    sched_notify(core);
+    Spin_Lock(& timeout_spinlock);
+  }
+  Spin_Unlock(& timeout_spinlock);
+}
+
+
+/* 
+  The TIMEOUT timer of this core has expired. Unless another core has set
+  its timer meanwhile, ours is set for the next timeout. A timeout that 
+  could not be handled now is retried a little later.
+ */
+static void sched_timeout_expired()
+{
+  sched_wakeup_expired_timeouts();
+
+  Spin_Lock(& timeout_spinlock);
+  TimerDuration now = bios_clock();
+  if(timeout_alarm <= now) {
+    timeout_alarm = NO_TIMEOUT;
+    TimerDuration next = sched_next_timeout();
+    if(next != NO_TIMEOUT)
+      timeout_alarm_set((next > now + TICKLESS_MIN_ALARM) ? next : now + TICKLESS_MIN_ALARM);
+  }
+  Spin_Unlock(& timeout_spinlock);
+}
+
+
+/*
+  Scheduling policies.
+  ---------------------
+
+  A policy decides the order of the ready queue of each core, the
+  priority changes of a thread when it leaves its core, and the length
+  of its timeslices. The policy is chosen at boot time. All queue
+  methods are called with the sched_spinlock of the core held.
+ */
+
+
+/*
+  The multilevel feedback queue.
+
+  A thread loses a priority level when its quantum expires, and gains
+  one when it waits for I/O. Threads of higher priority have shorter 
+  quanta. When the queue of a core gets congested (ready threads keep 
+  waiting behind higher priorities), or after a number of selections, 
+  all its threads are boosted one level up.
+ */
+
+static void mlfq_enqueue(CCB* ccb, TCB* tcb)
+{
+  /* Insert at the end of the CORRECT scheduling list */ 
+  sched_list_push(ccb, tcb);
+}
+
+static void mlfq_boost(CCB* ccb);
+
+static TCB* mlfq_dequeue(CCB* ccb)
+{
+  TCB* sel = NULL;
+  unsigned int bitmap = ccb->sched_bitmap;
+
+  if(bitmap == 0 || bitmap == PRIORITY_BIT(LOWEST_PRIORITY)) {
+    /* No thread is found or it is in the last list. Congestion drops. */
+    ccb->counter_congestion--;
+    if(bitmap != 0)
+      sel = sched_list_pop(ccb, LOWEST_PRIORITY);
+  } else {
+    /* A thread is found somewhere else. If the next lists have ready 
+       threads congestion grows. Else it drops. */
+    int top = sched_bitmap_top(bitmap);
+    if(bitmap & (PRIORITY_BIT(top) - 1))
+      ccb->counter_congestion++;
+    else
+      ccb->counter_congestion--;
+    sel = sched_list_pop(ccb, top);
+  }
+  
+  /* Counter must not get too low. */
+  if (ccb->counter_congestion < 0) 
+    ccb->counter_congestion = 0;
+
+  ccb->fail_safe++;
+
+  /* Boost when needed. */
+  if (ccb->counter_congestion >= MAX_CONGESTION || ccb->fail_safe == 500)
+    boost(ccb);
+
+  /* When all lists are empty, this is NULL */
+  return sel;
+}
+
+/* A stolen thread keeps its priority */
+static TCB* mlfq_steal(CCB* victim, uint core)
+{
+  unsigned int bitmap = victim->sched_bitmap;
+  while(bitmap) {
+    int top = sched_bitmap_top(bitmap);
+    TCB* tcb = sched_list_first(& victim->SCHED[top], core);
+    if(tcb != NULL)
+      return sched_list_take(victim, top, tcb);
+    bitmap &= ~PRIORITY_BIT(top);
+  }
+  return NULL;
+}
+
+static void mlfq_on_yield(TCB* current, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+  /* Change priority according the cause */
+  switch(cause) 
+  {
+    case SCHED_QUANTUM: /* End of quantum. Lower priority */
+      current->priority--;
+      break;
+    case SCHED_IO: /* IO interrupt. Raise priority. */
+      current->priority++;
+      break;
+    case SCHED_MUTEX: /* Mutex owners are raised by priority inheritance instead */
+    case SCHED_PIPE:
+    case SCHED_POLL:
+    case SCHED_IDLE:
+    case SCHED_USER:
+    case SCHED_PREEMPT: /* A thread of higher priority came, this one keeps its level */
+      break;
+  }
 
-int fail_safe = 0;
-//#define MMAPPED_THREAD_MEM 
-#ifdef MMAPPED_THREAD_MEM 
+  /* Check if priority is out of bounds and fix it. */
+  if(current->priority < LOWEST_PRIORITY)
+    current->priority = LOWEST_PRIORITY;
+  else if(current->priority >TOP_PRIORITY)
+    current->priority = TOP_PRIORITY;
+}
 
-/*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
-void free_thread(void* ptr, size_t size)
+static TimerDuration mlfq_quantum(TCB* tcb)
 {
-  CHECK(munmap(ptr, size));
+  return QUANTUM / (tcb->priority + 1);
 }
 
-void* allocate_thread(size_t size)
+static void mlfq_boost(CCB* ccb)
 {
-  void* ptr = mmap(NULL, size, 
-      PROT_READ|PROT_WRITE|PROT_EXEC,  
-      MAP_ANONYMOUS  | MAP_PRIVATE 
-      , -1,0);
-  
-  CHECK((ptr==MAP_FAILED)?-1:0);
+  ccb->counter_congestion = 0;
+  ccb->fail_safe = 0;
 
-  return ptr;
-}
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
-  be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size)
-{
-  free(ptr);
+  /* Push all the lists one priority up.
+     Start from the second list. */
+  for(int i = TOP_PRIORITY - 1; i >= LOWEST_PRIORITY; i--)
+    rlist_append(& ccb->SCHED[i+1], & ccb->SCHED[i]);
+
+  /* The top list absorbs the one below it, the lowest list is now empty */
+  unsigned int bitmap = ccb->sched_bitmap;
+  ccb->sched_bitmap = ((bitmap << 1) | (bitmap & PRIORITY_BIT(TOP_PRIORITY))) & PRIORITY_MASK;
 }
 
-void* allocate_thread(size_t size)
+/* Move a queued thread to the list of its new priority */
+static void mlfq_requeue(CCB* ccb, TCB* tcb)
 {
-  void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-  CHECK((ptr==NULL)?-1:0);
-  return ptr;
+  rlist_remove(& tcb->sched_node);
+  for(int i = LOWEST_PRIORITY; i <= TOP_PRIORITY; i++)
+    if(is_rlist_empty(& ccb->SCHED[i]))
+      ccb->sched_bitmap &= ~PRIORITY_BIT(i);
+  sched_list_push(ccb, tcb);
 }
-#endif
+
+static const sched_policy mlfq_policy = {
+  .name = "mlfq",
+  .enqueue = mlfq_enqueue,
+  .dequeue = mlfq_dequeue,
+  .steal = mlfq_steal,
+  .on_yield = mlfq_on_yield,
+  .quantum = mlfq_quantum,
+  .boost = mlfq_boost,
+  .requeue = mlfq_requeue
+};
 
 
 /*
-  This is the function that is used to start normal threads.
-*/
-void gain(int preempt); /* forward */
+  Round robin: a single FIFO list per core (SCHED[0]), and a fixed
+  quantum. Priorities are not used.
+ */
 
-static void thread_start()
+static void rr_enqueue(CCB* ccb, TCB* tcb)
 {
-  gain(1);
-  CURTHREAD->thread_func();
-
-  /* We are not supposed to get here! */
-  assert(0);
+  rlist_push_back(& ccb->SCHED[0], & tcb->sched_node);
 }
 
-
-/*
-  Initialize and return a new TCB
-*/
-TCB* spawn_thread(PCB* pcb, void (*func)())  
+static TCB* rr_dequeue(CCB* ccb)
 {
-  /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
-
-  /* Set the owner */
-  tcb->owner_pcb = pcb;
-  //ptcb init
+  return is_rlist_empty(& ccb->SCHED[0]) ? NULL : rlist_pop_front(& ccb->SCHED[0])->tcb;
+}
 
-  /* Initialize the other attributes */
-  tcb->type = NORMAL_THREAD;
-  tcb->state = INIT;
-  tcb->phase = CTX_CLEAN;
-  tcb->thread_func = func;
-  tcb->wakeup_time = NO_TIMEOUT;
+/* Take the first thread that may run on the core (for all single-list policies) */
+static TCB* rr_steal(CCB* victim, uint core)
+{
+  TCB* tcb = sched_list_first(& victim->SCHED[0], core);
+  if(tcb != NULL) rlist_remove(& tcb->sched_node);
+  return tcb;
+}
 
-  /* Init priority for the first list. */
-  tcb->priority = TOP_PRIORITY;
+static void rr_on_yield(TCB* current, enum SCHED_CAUSE cause, TimerDuration ran) { }
 
-  /* Init vars for mutex inversion */
-  tcb->mutex_flag = 0;
-  tcb->prev_queue = TOP_PRIORITY;
+/* The idle thread polls for stolen work as often as the top MLFQ level */
+static TimerDuration rr_quantum(TCB* tcb) 
+{ 
+  return (tcb->type == IDLE_THREAD) ? QUANTUM / PRIORITY_LISTS : QUANTUM; 
+}
 
-  rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
+static const sched_policy rr_policy = {
+  .name = "rr",
+  .enqueue = rr_enqueue,
+  .dequeue = rr_dequeue,
+  .steal = rr_steal,
+  .on_yield = rr_on_yield,
+  .quantum = rr_quantum,
+  .boost = NULL,
+  .requeue = NULL
+};
 
-  /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
 
-  /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+/*
+  Fair scheduling, in the style of CFS: every thread is charged with
+  the time it runs (its virtual runtime), and the thread with the least
+  virtual runtime runs next. The list SCHED[0] is kept sorted by virtual 
+  runtime; insertion scans from the back, where a thread coming off a 
+  core usually goes.
+
+  A thread that has slept (or is new, or comes from another core) 
+  must not hog the core to catch up, so its virtual runtime is lifted
+  to at most one quantum below the smallest one that ran on the core.
+ */
 
-#ifndef NVALGRIND
-  tcb->valgrind_stack_id = 
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
-#endif
+static void fair_enqueue(CCB* ccb, TCB* tcb)
+{
+  TimerDuration floor = (ccb->min_vruntime > QUANTUM) ? ccb->min_vruntime - QUANTUM : 0;
+  if(tcb->vruntime < floor)
+    tcb->vruntime = floor;
+
+  rlnode* q = & ccb->SCHED[0];
+  rlnode* n = q->prev;
+  while(n != q && n->tcb->vruntime > tcb->vruntime)
+    n = n->prev;
+  rlist_push_front(n, & tcb->sched_node);   /* insert after n */
+}
 
-  /* increase the count of active threads */
-  Mutex_Lock(&active_threads_spinlock);
-  active_threads++;
-  Mutex_Unlock(&active_threads_spinlock);
- 
+static TCB* fair_dequeue(CCB* ccb)
+{
+  TCB* tcb = rr_dequeue(ccb);
+  if(tcb != NULL && tcb->vruntime > ccb->min_vruntime)
+    ccb->min_vruntime = tcb->vruntime;
   return tcb;
 }
 
-
-/*
-  This is called with tcb->state_spinlock locked !
- */
-void release_TCB(TCB* tcb)
+static void fair_on_yield(TCB* current, enum SCHED_CAUSE cause, TimerDuration ran)
 {
-#ifndef NVALGRIND
-  VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
-#endif
-
-  free_thread(tcb, THREAD_SIZE);
-
-  Mutex_Lock(&active_threads_spinlock);
-  active_threads--;
-  Mutex_Unlock(&active_threads_spinlock);
+  current->vruntime += ran;
 }
 
+static const sched_policy fair_policy = {
+  .name = "fair",
+  .enqueue = fair_enqueue,
+  .dequeue = fair_dequeue,
+  .steal = rr_steal,
+  .on_yield = fair_on_yield,
+  .quantum = rr_quantum,
+  .boost = NULL,
+  .requeue = NULL
+};
 
-/*
- *
- * Scheduler
- *
- */
 
+static const sched_policy* sched_policies[] = { &mlfq_policy, &rr_policy, &fair_policy, NULL };
 
-/*
- *  Note: the scheduler routines are all in the non-preemptive domain.
- */
+/* The policy in use, and the one requested for the next boot */
+const sched_policy* sched = &mlfq_policy;
+static const sched_policy* sched_requested = NULL;
 
+static const sched_policy* sched_find_policy(const char* name)
+{
+  for(int i=0; sched_policies[i]; i++)
+    if(strcmp(sched_policies[i]->name, name)==0)
+      return sched_policies[i];
+  return NULL;
+}
 
-/* Core control blocks */
-CCB cctx[MAX_CORES];
+int set_sched_policy(const char* name)
+{
+  const sched_policy* p = (name == NULL) ? NULL : sched_find_policy(name);
+  if(p == NULL) return -1;
+  sched_requested = p;
+  return 0;
+}
 
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-  
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Set the cores a thread may run on, keeping only the existing ones.
+  Return -1 if none is left.
 */
-
-
-rlnode SCHED[PRIORITY_LISTS];         /* The scheduler queue */ 
-rlnode TIMEOUT_LIST;                  /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
-
-int counter_congestion = 0;            /* Counter gia thn sumforish tou sceduler */
-
-
-
-/* Interrupt handler for ALARM */
-void yield_handler()
+int sched_set_affinity(TCB* tcb, unsigned int mask)
 {
-  yield(SCHED_QUANTUM);
+  mask &= sched_all_cores();
+  if(mask == 0) return -1;
+  __atomic_store_n(& tcb->affinity, mask, __ATOMIC_RELAXED);
+  return 0;
 }
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler() 
+unsigned int sched_get_affinity(TCB* tcb)
 {
-  /* noop for now... */
+  return __atomic_load_n(& tcb->affinity, __ATOMIC_RELAXED) & sched_all_cores();
 }
 
 
-/*
-  Possibly add TCB to the scheduler timeout list.
+static TimerDuration sched_timeslice(CCB* ccb, TCB* current);
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+/* The sum of the reservations of all threads, in units of DL_UTIL_ONE */
+static unsigned long dl_total_util = 0;
+static Mutex dl_spinlock = MUTEX_INIT;
+
+int sched_set_deadline(TCB* tcb, TimerDuration period, TimerDuration runtime)
 {
-  if(timeout!=NO_TIMEOUT){
+  if(period != 0 && (period > DEADLINE_MAX_PERIOD || runtime < DEADLINE_MIN_RUNTIME || runtime > period))
+    return -1;
+  unsigned long util = (period != 0) ? runtime * DL_UTIL_ONE / period : 0;
+  unsigned long capacity = cpu_cores() * DL_UTIL_ONE * DL_MAX_UTIL / 100;
+  int ret = -1;
 
-    /* set the wakeup time */
-    TimerDuration curtime = bios_clock();
-    tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+  int preempt = preempt_off;
+  Spin_Lock(& dl_spinlock);
+  if(dl_total_util - tcb->dl_util + util <= capacity) {
+    dl_total_util = dl_total_util - tcb->dl_util + util;
+
+    /* The first period starts when the thread is next queued */
+    Spin_Lock(& tcb->state_spinlock);
+    tcb->dl_period = period;
+    tcb->dl_runtime = runtime;
+    tcb->dl_util = util;
+    tcb->dl_deadline = 0;
+    if(period == 0)
+      tcb->dl_budget = 0;
+    else if(tcb == CURTHREAD) {
+      /* The current thread starts its first period at once */
+      tcb->dl_deadline = bios_clock() + period;
+      tcb->dl_budget = runtime;
+    }
+    Spin_Unlock(& tcb->state_spinlock);
+    ret = 0;
+  }
+  Spin_Unlock(& dl_spinlock);
 
-    /* add to the TIMEOUT_LIST in sorted order */
-    rlnode* n = TIMEOUT_LIST.next;
-    for( ; n!=&TIMEOUT_LIST; n=n->next) 
-      /* skip earlier entries */
-      if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-    /* insert before n */
-  rl_splice(n->prev, & tcb->sched_node);
+  if(ret == 0 && tcb == CURTHREAD) {
+    CCB* ccb = & CURCORE;
+    __atomic_store_n(& ccb->current_deadline, tcb->dl_deadline, __ATOMIC_RELAXED);
+    __atomic_store_n(& ccb->current_priority, sched_class_priority(tcb), __ATOMIC_RELAXED);
+    sched_set_alarm(sched_timeslice(ccb, tcb));
   }
+  if(preempt) preempt_on;
+  return ret;
 }
 
 
 /*
-  Add TCB to the end of the scheduler list.
+  Remove the head of the scheduler queue of a core, if any, and
+  return it. Return NULL if the queue is empty.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static TCB* sched_queue_select(CCB* ccb)
 {
-  /* Insert at the end of the CORRECT scheduling list */ 
-  rlist_push_back(& SCHED[tcb->priority], & tcb->sched_node);   
+  TCB* sel = is_rlist_empty(& ccb->dl_queue) ? sched->dequeue(ccb) 
+    : sched_dl_take(ccb->dl_queue.next->tcb);
+  if(sel != NULL) ccb->sched_count--;
+  return sel;
+}
+
+
+void boost(CCB* ccb)
+{
+  sched_trace(TRACE_BOOST, 0, NULL, NULL);
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+  if(sched->boost) sched->boost(ccb);
 }
 
 
 /*
-  Adjust the state of a thread to make it READY.
+  Priority inheritance.
 
-    *** MUST BE CALLED WITH sched_spinlock HELD *** 
+  The priority lent to a thread is kept apart from its own priority, so
+  that the MLFQ heuristics keep working on the latter while the loan
+  lasts. A thread carries one loan at a time: a higher loan for another
+  lock replaces it, and it ends when that lock is released.
  */
-static void sched_make_ready(TCB* tcb)
+void sched_inherit_priority(TCB* owner, void* lock)
 {
-  assert(tcb->state == STOPPED || tcb->state == INIT);
+  TCB* tcb = CURTHREAD;
+  if(owner == NULL || tcb == NULL || owner == tcb)
+    return;
+  int prio = sched_priority(tcb);
+  if(sched_priority(owner) >= prio)
+    return;
 
-  /* Possibly remove from TIMEOUT_LIST */
-  if(tcb->wakeup_time != NO_TIMEOUT) {
-    /* tcb is in TIMEOUT_LIST, fix it */
-    assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-    rlist_remove(& tcb->sched_node);
-    tcb->wakeup_time = NO_TIMEOUT;
+  int preempt = preempt_off;
+  Spin_Lock(& owner->state_spinlock);
+
+  if(sched_priority(owner) < prio) {
+    __atomic_store_n(& owner->pi_priority, prio, __ATOMIC_RELAXED);
+    owner->pi_lock = lock;
+    sched_trace(TRACE_INHERIT, prio, owner, lock);
+
+    /* A queued owner must move up in its queue */
+    if(owner->state == READY && sched->requeue != NULL) {
+      CCB* ccb = & cctx[__atomic_load_n(& owner->sched_core, __ATOMIC_RELAXED)];
+      Spin_Lock(& ccb->sched_spinlock);
+      /* It may have been selected, or stolen by another core */
+      if(owner->sched_core == ccb->id && !owner->dl_queued && owner->sched_node.next != & owner->sched_node)
+        sched->requeue(ccb, owner);
+      Spin_Unlock(& ccb->sched_spinlock);
+    }
   }
 
-  /* Mark as ready */
-  tcb->state = READY;
-
-  /* Possibly add to the scheduler queue */
-  if(tcb->phase == CTX_CLEAN) 
-    sched_queue_add(tcb);
+  Spin_Unlock(& owner->state_spinlock);
+  if(preempt) preempt_on;
 }
 
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select()
+void sched_restore_priority(void* lock)
 {
-  rlnode * sel;
-  int i;
+  TCB* tcb = CURTHREAD;
 
-  /* Empty the timeout list up to the current time and wake up each thread */
-  TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-      TCB* tcb = TIMEOUT_LIST.next->tcb;
-      if(tcb->wakeup_time > curtime)
-        break;
-      sched_make_ready(tcb);
-  }
+  /* Lenders set pi_lock while the lock is held by us, so this is safe.
+     At boot, locks are used before there is a current thread. */
+  if(tcb == NULL || tcb->pi_lock != lock)
+    return;
 
-  /* search all the lists from top to bottom and break when a thread is found. */
-  for(i = TOP_PRIORITY; i >= LOWEST_PRIORITY; i--){
-    sel = rlist_pop_front(& SCHED[i]);
-    if (sel != NULL)
-      break;
+  int preempt = preempt_off;
+  Spin_Lock(& tcb->state_spinlock);
+  if(tcb->pi_lock == lock) {
+    __atomic_store_n(& tcb->pi_priority, -1, __ATOMIC_RELAXED);
+    tcb->pi_lock = NULL;
   }
+  Spin_Unlock(& tcb->state_spinlock);
+  if(preempt) preempt_on;
+}
 
-  /* No thread is found or it was in the last list. Congestion drops. */
-  if(i <= LOWEST_PRIORITY)
-    counter_congestion--;
-  else{
-    /* A thread is found somewhere else. Check if the next lists have threads. 
-       If ready threads exists congestion grows. Else it drops. */
-    for (i--; i >= LOWEST_PRIORITY; i--){
-      if(! is_rlist_empty(& SCHED[i])){
-        counter_congestion++;
-        break;
-      }else if (i == LOWEST_PRIORITY){
-        counter_congestion--;
-        break;
-      }
-    }
-  }
-  
-  /* Counter must not get too low. */
-  if (counter_congestion < 0) 
-    counter_congestion = 0;
 
-  fail_safe++;
+/*
+  Steal a ready thread from some other core and put it into the queue of 
+  the current core. The neighbours are visited in order, starting with 
+  the next core.
 
-  /* Boost when needed. */
-  if (counter_congestion >= MAX_CONGESTION || fail_safe == 500)
-    boost();
+  Return 1 if a thread was stolen, else 0.
+ */
+static int sched_steal()
+{
+  if(CONFIG_UP) return 0;
 
-  /* When all lists are empty, this is NULL */
-  return sel->tcb;
-}
+  CCB* self = & CURCORE;
+  uint ncores = cpu_cores();
+  int stolen = 0;
 
+  /* The idle loop runs preemptively, but the queue locks are spinlocks */
+  int preempt = preempt_off;
 
-void boost()
-{
-  counter_congestion = 0;
-  rlnode * sel;
-  /* Push all the threads one priority up.
-     Start from the second list. */
-  for(int i = TOP_PRIORITY - 1; i >= LOWEST_PRIORITY; i--){
-    while (! is_rlist_empty(& SCHED[i])){
-      sel = rlist_pop_front(& SCHED[i]);
-      sel->tcb->priority++;
-      rlist_push_back(& SCHED[i+1], sel);
+  for(uint k=1; k<ncores && !stolen; k++) {
+    CCB* victim = & cctx[(self->id + k) % ncores];
+
+    /* Do not bother locking empty queues */
+    if(__atomic_load_n(& victim->sched_count, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    /* Deadline threads are taken first */
+    TCB* tcb = NULL;
+    Spin_Lock(& victim->sched_spinlock);
+    if(victim->sched_count != 0) {
+      tcb = sched_list_first(& victim->dl_queue, self->id);
+      if(tcb != NULL) 
+        sched_dl_take(tcb);
+      else
+        tcb = sched->steal(victim, self->id);
+      if(tcb != NULL)
+        victim->sched_count--;
+    }
+    Spin_Unlock(& victim->sched_spinlock);
+
+    if(tcb != NULL) {
+      /* The thread is READY and in no list, so nobody else can touch it */
+      Spin_Lock(& self->sched_spinlock);
+      sched_enqueue(self, tcb);
+      self->sched_count++;
+      tcb->sched_core = self->id;
+      Spin_Unlock(& self->sched_spinlock);
+      __atomic_store_n(& self->steals, self->steals + 1, __ATOMIC_RELAXED);
+      stolen = 1;
     }
   }
+
+  if(preempt) preempt_on;
+  return stolen;
 }
 
 
 /*
   Make the process ready. 
  */
-int wakeup(TCB* tcb)
+int wakeup_many(TCB** tcbs, int n)
 {
   int ret = 0;
+  unsigned int kick = 0;
 
   /* Preemption off */
   int oldpre = preempt_off;
 
-  /* To touch tcb->state, we must get the spinlock. */
-  Mutex_Lock(& sched_spinlock);
+  for(int i = 0; i < n; i++) {
+    TCB* tcb = tcbs[i];
 
-  if(tcb->state==STOPPED || tcb->state==INIT) {
-    sched_make_ready(tcb);
-    ret = 1;    
-  }
+    /* To touch tcb->state, we must get the spinlock. */
+    Spin_Lock(& tcb->state_spinlock);
+
+    if(tcb->state==STOPPED || tcb->state==INIT) {
+      int core = sched_make_ready(tcb);
+      if(core >= 0) kick |= 1u << core;
+      ret++;
+      sched_trace(TRACE_WAKEUP, sched_priority(tcb), tcb, NULL);
+    }
+    else
+      tcbs[i] = NULL;
 
-  Mutex_Unlock(& sched_spinlock);
+    Spin_Unlock(& tcb->state_spinlock);
+  }
 
-  /* Restore preemption state */
-  if(oldpre) preempt_on;
+  /* Restart possibly halted cores, each once. They will steal the threads if we are busy */
+  for(; kick; kick &= kick-1)
+    sched_notify(__builtin_ctz(kick));
 
+  sched_preempt_restore(oldpre);
   return ret;
 }
 
 
+void sched_preempt_restore(int preempt)
+{
+  /* Give way to a deadline thread queued here while preemption was off */
+  if(preempt) {
+    preempt_on;
+    if(__atomic_load_n(& CURCORE.need_resched, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(& CURCORE.need_resched, 0, __ATOMIC_RELAXED))
+      yield(SCHED_PREEMPT);
+  }
+}
+
+
+int wakeup(TCB* tcb)
+{
+  return wakeup_many(&tcb, 1);
+}
+
+
+/*
+  Charge a thread leaving its core with the time since it gained it.
+  The threads of a process run on several cores, so the process totals
+  are updated atomically.
+ */
+static TimerDuration sched_account(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  TimerDuration t = bios_clock() - tcb->run_start;
+  tcb->stats.runtime += t;
+  tcb->stats.switches[cause]++;
+
+  /* Only this core updates its counters */
+  CCB* ccb = & CURCORE;
+  if(tcb->type == IDLE_THREAD)
+    __atomic_store_n(& ccb->idle_time, ccb->idle_time + t, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n(& ccb->busy_time, ccb->busy_time + t, __ATOMIC_RELAXED);
+  __atomic_store_n(& ccb->switches, ccb->switches + 1, __ATOMIC_RELAXED);
+
+  PCB* pcb = tcb->owner_pcb;
+  if(pcb) {
+    __atomic_add_fetch(& pcb->stats.runtime, t, __ATOMIC_RELAXED);
+    __atomic_add_fetch(& pcb->stats.switches[cause], 1, __ATOMIC_RELEASE);
+  }
+  return t;
+}
+
+
+int sys_GetCoreStats(core_stats* stats, unsigned int n)
+{
+  if(stats == NULL) return -1;
+
+  if(n > cpu_cores()) n = cpu_cores();
+  for(uint c = 0; c < n; c++) {
+    CCB* ccb = & cctx[c];
+    stats[c].busy_time = __atomic_load_n(& ccb->busy_time, __ATOMIC_RELAXED);
+    stats[c].idle_time = __atomic_load_n(& ccb->idle_time, __ATOMIC_RELAXED);
+    stats[c].switches = __atomic_load_n(& ccb->switches, __ATOMIC_RELAXED);
+    stats[c].steals = __atomic_load_n(& ccb->steals, __ATOMIC_RELAXED);
+    stats[c].idle_poll_hits = __atomic_load_n(& ccb->idle_poll_hits, __ATOMIC_RELAXED);
+    stats[c].idle_poll_misses = __atomic_load_n(& ccb->idle_poll_misses, __ATOMIC_RELAXED);
+    stats[c].wake_affine_hits = __atomic_load_n(& ccb->wake_affine_hits, __ATOMIC_RELAXED);
+    stats[c].wake_affine_misses = __atomic_load_n(& ccb->wake_affine_misses, __ATOMIC_RELAXED);
+    stats[c].interrupts = cpu_core_interrupts(c);
+  }
+  return n;
+}
+
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -404,14 +1666,17 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   assert(state==STOPPED || state==EXITED);
 
   TCB* tcb = CURTHREAD;
+
+  /* An exiting thread gives back its reservation, before mx lets its joiners go */
+  if(state==EXITED && tcb->dl_util != 0)
+    sched_set_deadline(tcb, 0, 0);
   
   /* 
-    The tcb->state_spinlock guarantees atomic sleep-and-release.
-    But, to access it safely, we need to go into the non-preemptive
-    domain.
+    To access tcb->state_spinlock safely, we need to go into the 
+    non-preemptive domain.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  Spin_Lock(& tcb->state_spinlock);
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
@@ -420,11 +1685,23 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   if(state!=EXITED) 
     sched_register_timeout(tcb, timeout);
 
-  /* Release mx */
-  if(mx!=NULL) Mutex_Unlock(mx);
+  /* Release the state spinlock before calling yield() !!! */
+  Spin_Unlock(& tcb->state_spinlock);
 
-  /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  /* 
+    Once mx is released, the process of an exiting thread may be 
+    cleaned up, so the thread is charged here instead of in yield().
+   */
+  if(state==EXITED)
+    sched_account(tcb, cause);
+
+  /* 
+    Release mx. Sleep-and-release is still atomic: we are marked as
+    sleeping, so a wakeup that comes after this makes us READY and 
+    yield() returns at once. Releasing mx may wake up one of its waiters,
+    so it must not be done while holding our own state spinlock.
+   */
+  if(mx!=NULL) Mutex_Unlock(mx);
   
   /* call this to schedule someone else */
   yield(cause);
@@ -437,54 +1714,23 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
 /* This function is the entry point to the scheduler's context switching */
 void yield(enum SCHED_CAUSE cause)
 { 
-  /* Reset the timer, so that we are not interrupted by ALARM */
-  bios_cancel_timer();
-
   /* We must stop preemption but save it! */
   int preempt = preempt_off;
 
+  /* Stop the quantum, so that we are not interrupted by ALARM */
+  sched_set_alarm(0);
+
   TCB* current = CURTHREAD;  /* Make a local copy of current process, for speed */
+  CCB* ccb = & CURCORE;
 
   int current_ready = 0;
 
-  Mutex_Lock(& sched_spinlock);
-
-  /* Change priority according the cause */
-  switch(cause) 
-  {
-    case SCHED_QUANTUM: /* End of quantum. Lower priority */
-      current->priority--;
-      break;
-    case SCHED_IO: /* IO interrupt. Raise priority. */
-      current->priority++;
-      break;
-    case SCHED_MUTEX:
-
-      /* Save the priority before the first SCHED_MUTEX. */
-      if(current->mutex_flag == 0)
-        current->prev_queue = current->priority;
-      
-      current->priority = LOWEST_PRIORITY;
-      /* Flags that the priority has changed because of a mutex. */
-      current->mutex_flag = 1;
-      break;
-    case SCHED_PIPE:
-    case SCHED_POLL:
-    case SCHED_IDLE:
-    case SCHED_USER:
-      break;
-  }
-
-  /* Check if priority is out of bounds and fix it. */
-  if(current->priority < LOWEST_PRIORITY)
-    current->priority = LOWEST_PRIORITY;
-  else if(current->priority >TOP_PRIORITY)
-    current->priority = TOP_PRIORITY;
+  Spin_Lock(& current->state_spinlock);
 
-  /* Reinstate priority after the MUTEX lock has been solved. */
-  if (current->mutex_flag == 1 && cause != SCHED_MUTEX){
-    current->mutex_flag = 0;
-    current->priority = current->prev_queue;
+  if(current->state != EXITED) {
+    TimerDuration ran = sched_account(current, cause);
+    sched->on_yield(current, cause, ran);
+    sched_dl_charge(current, ran);
   }
 
   switch(current->state)
@@ -504,26 +1750,36 @@ void yield(enum SCHED_CAUSE cause)
       assert(0);  /* It should not be READY or EXITED ! */
   }
 
-  /* Get next */
-  TCB* next = sched_queue_select();
+  Spin_Unlock(& current->state_spinlock);
+
+  /* Wake up any threads whose timeout has expired */
+  sched_wakeup_expired_timeouts();
 
-  /* Maybe there was nothing ready in the scheduler queue ? */
+  /* Get next. A preemption asked for the threads queued so far is done by the selection. */
+  Spin_Lock(& ccb->sched_spinlock);
+  __atomic_store_n(& ccb->need_resched, 0, __ATOMIC_RELAXED);
+  TCB* next = sched_queue_select(ccb);
+  Spin_Unlock(& ccb->sched_spinlock);
+
+  /* Maybe there was nothing ready in the scheduler queue ? 
+     The current thread keeps the core, unless it may no longer run here,
+     or it is throttled. */
   if(next==NULL) {
-    if(current_ready)
+    if(current_ready && sched_allowed(current, ccb->id) && !sched_dl_throttled(current))
       next = current;
     else
-      next = & CURCORE.idle_thread;
+      next = & ccb->idle_thread;
   }
 
+  sched_trace(TRACE_SWITCH, cause, current, next);
+
   /* ok, link the current and next TCB, for the gain phase */
   current->next = next; 
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
-
   /* Switch contexts */
   if(current!=next) {
-    CURTHREAD = next;
+    ccb->current_thread = next;
     cpu_swap_context( & current->context , & next->context );
   }
 
@@ -534,6 +1790,25 @@ void yield(enum SCHED_CAUSE cause)
 }
 
 
+/*
+  Return the alarm for the timeslice of the current thread, or 0 for
+  no alarm. In tickless mode, a thread that runs alone on its core (or
+  the idle thread) needs an alarm only for the end of its budget. The 
+  timeouts, including those of throttled threads, have their own timer.
+ */
+static TimerDuration sched_timeslice(CCB* ccb, TCB* current)
+{
+#if SCHED_TICKLESS
+  if(current->type == IDLE_THREAD || ccb->sched_count == 0) {
+    ccb->tickless = 1;
+    return sched_dl_ready(current) ? sched_quantum(current) : 0;
+  }
+  ccb->tickless = 0;
+#endif
+  return sched_quantum(current);
+}
+
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield(). 
@@ -547,45 +1822,60 @@ void yield(enum SCHED_CAUSE cause)
 */
 void gain(int preempt) 
 {
-  Mutex_Lock(& sched_spinlock);
-
   /* Mark current state */
   TCB* current = CURTHREAD; 
   TCB* prev = current->prev;
 
+  Spin_Lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  Spin_Unlock(& current->state_spinlock);
+
+  current->run_start = bios_clock();
+  current->stats.runs++;
+  __atomic_store_n(& CURCORE.current_deadline, current->dl_deadline, __ATOMIC_RELAXED);
+  __atomic_store_n(& CURCORE.current_priority, 
+    (current->type == IDLE_THREAD) ? -1 : sched_class_priority(current), __ATOMIC_RELAXED);
+  if(current->type != IDLE_THREAD)
+    sched_idle_leave();
+
+  if(current->owner_pcb) {
+    __atomic_add_fetch(& current->owner_pcb->stats.runs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(& current->owner_pcb->last_core, (int) cpu_core_id, __ATOMIC_RELAXED);
+  }
 
   if(current != prev) {
     /* Take care of the previous thread */
+    Spin_Lock(& prev->state_spinlock);
     prev->phase = CTX_CLEAN;
-    switch(prev->state) 
+    Thread_state prev_state = prev->state;
+    int core = -1;
+    switch(prev_state) 
     {
       case READY:
-        if(prev->type != IDLE_THREAD) sched_queue_add(prev);
+        if(prev->type != IDLE_THREAD)
+          core = sched_queue_add(prev, 0);
         break;
       case EXITED: 
-        //tsekaroyme oti den einai to main thread.
-        if(prev->owner_ptcb != NULL) {
-          // To thread pe8ane kai prepei na to kseroun auta pou to perimenoun.
-          prev->owner_ptcb->thread_exited = 1; 
-        }
-        release_TCB(prev);
-        break;
       case STOPPED:
         break;
       default:
         assert(0);  /* prev->state should not be INIT or RUNNING ! */
     }
+    Spin_Unlock(& prev->state_spinlock);
+
+    sched_notify(core);
+
+    /* Nobody can reach an exited thread, release it outside its lock */
+    if(prev_state == EXITED)
+      release_TCB(prev);
   }
 
-  Mutex_Unlock(& sched_spinlock);
+  /* Set the alarm before preemption is on, the queue must not change */
+  sched_set_alarm(sched_timeslice(& CURCORE, current));
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
-
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM / (current->priority + 1));
 }
 
 
@@ -595,28 +1885,83 @@ static void idle_thread()
   yield(SCHED_IDLE);
 
   /* We come here whenever we cannot find a ready thread for our core */
-  while(active_threads>0) {
-    cpu_core_halt();
+  while(sched_active_threads()>0) {
+    /* Before halting, look at our queue again, and try to take some work 
+       from our neighbours. Threads queued from now on interrupt us. */
+    sched_idle_enter();
+    if(! sched_idle_has_work() && ! sched_idle_poll())
+      cpu_core_halt();
     yield(SCHED_IDLE);
   }
 
   /* If the idle thread exits here, we are leaving the scheduler! */
-  bios_cancel_timer();
+  sched_set_alarm(0);
   cpu_core_restart_all();
 }
 
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of every core
  */
 void initialize_scheduler()
 {
   /* init scheduler's lists*/
-  for(int i = 0; i < PRIORITY_LISTS; i ++)
-    rlnode_init(&SCHED[i], NULL);
+  for(uint c = 0; c < MAX_CORES; c++) {
+    CCB* ccb = & cctx[c];
+    for(int i = 0; i < PRIORITY_LISTS; i ++)
+      rlnode_init(& ccb->SCHED[i], NULL);
+    rlnode_init(& ccb->dl_queue, NULL);
+    ccb->sched_spinlock = MUTEX_INIT;
+    lock_profile_name(& ccb->sched_spinlock, "sched_spinlock", c);
+    ccb->sched_bitmap = 0;
+    ccb->sched_count = 0;
+    ccb->tickless = 0;
+    ccb->current_priority = -1;
+    ccb->current_deadline = 0;
+    ccb->need_resched = 0;
+    ccb->min_vruntime = 0;
+    ccb->counter_congestion = 0;
+    ccb->fail_safe = 0;
+    rlnode_init(& ccb->thread_pool, NULL);
+    ccb->thread_pool_size = 0;
+    ccb->busy_time = ccb->idle_time = 0;
+    ccb->switches = 0;
+    ccb->steals = 0;
+    ccb->idle_poll_hits = ccb->idle_poll_misses = 0;
+    ccb->wake_affine_hits = ccb->wake_affine_misses = 0;
+    ccb->active_threads = 0;
+  }
 
-  rlnode_init(&TIMEOUT_LIST, NULL);
+  /* Choose the policy */
+  const char* env = getenv("TINYOS_SCHED");
+  if(sched_requested != NULL)
+    sched = sched_requested;
+  else if(env != NULL && (sched = sched_find_policy(env)) != NULL)
+    ;
+  else {
+    if(env != NULL)
+      fprintf(stderr, "Unknown scheduling policy TINYOS_SCHED=%s, using mlfq\n", env);
+    sched = &mlfq_policy;
+  }
 
+  /* Choose the idle polling window */
+  const char* poll_env = getenv("TINYOS_IDLE_POLL");
+  if(idle_poll_requested >= 0)
+    idle_poll_usec = idle_poll_requested;
+  else if(poll_env != NULL)
+    idle_poll_usec = (unsigned int) strtoul(poll_env, NULL, 10);
+  else
+    idle_poll_usec = 0;
+  if(idle_poll_usec > IDLE_POLL_MAX)
+    idle_poll_usec = IDLE_POLL_MAX;
+  polling_cores = 0;
+  dl_total_util = 0;
+
+  rheap_init(&TIMEOUT_HEAP, timeout_earlier);
+  timeout_next = NO_TIMEOUT;
+  timeout_alarm = NO_TIMEOUT;
+  timeout_spinlock = MUTEX_INIT;
+  lock_profile_name(& timeout_spinlock, "timeout_spinlock", -1);
 }
 
 
@@ -633,16 +1978,21 @@ void run_scheduler()
   curcore->idle_thread.type = IDLE_THREAD;
   curcore->idle_thread.state = RUNNING;
   curcore->idle_thread.phase = CTX_DIRTY;
+  curcore->idle_thread.state_spinlock = MUTEX_INIT;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+  rhnode_init(& curcore->idle_thread.timeout_node, & curcore->idle_thread);
+  curcore->idle_thread.run_start = bios_clock();
+  memset(& curcore->idle_thread.stats, 0, sizeof(sched_stats));
 
   curcore->idle_thread.priority = TOP_PRIORITY;
-  curcore->idle_thread.mutex_flag = 0;
-  curcore->idle_thread.prev_queue = TOP_PRIORITY;
+  curcore->idle_thread.vruntime = 0;
+  curcore->idle_thread.pi_priority = -1;
+  curcore->idle_thread.pi_lock = NULL;
+  curcore->idle_thread.sched_core = curcore->id;
+  curcore->idle_thread.affinity = 1u << curcore->id;
 
   /* Den 8eloume na afisoume metablhtes xwris initialization */
   curcore->idle_thread.owner_ptcb = NULL;
-  curcore->idle_thread.prev_queue = TOP_PRIORITY;
-  curcore->idle_thread.mutex_flag = 0;
 
   rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
@@ -656,6 +2006,7 @@ void run_scheduler()
 
   /* Finished scheduling */
   assert(CURTHREAD == &CURCORE.idle_thread);
+  thread_pool_drain();
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
-}
\ No newline at end of file
+}
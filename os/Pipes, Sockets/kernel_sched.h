@@ -24,6 +24,7 @@
 #include "util.h"
 #include "bios.h"
 #include "tinyos.h"
+#include "kernel_account.h"
 
 /*****************************
  *
@@ -74,17 +75,38 @@ enum SCHED_CAUSE {
   SCHED_PIPE,     /**< Sleep at a pipe or socket */
   SCHED_POLL,     /**< The thread is polling a device */
   SCHED_IDLE,     /**< The idle thread called yield */
-  SCHED_USER      /**< User-space code called yield */
+  SCHED_USER,     /**< User-space code called yield */
+  SCHED_PREEMPT   /**< A thread of higher priority was queued on the core */
 };
 
+/** @brief The number of values of @c SCHED_CAUSE */
+#define SCHED_CAUSES (SCHED_PREEMPT+1)
+
+
+/**
+  @brief CPU accounting of a thread, or of all the threads of a process.
+
+  A thread is charged when it leaves its core, with the time since it 
+  gained it. Times are read from @c bios_clock(), so single runs shorter
+  than its resolution are not measured exactly, but the sums are right on
+  average.
+ */
+typedef struct sched_stats {
+  TimerDuration runtime;                  /**< Microseconds spent on a core */
+  unsigned long runs;                     /**< Times a core was gained */
+  unsigned long switches[SCHED_CAUSES];   /**< Times a core was left, per cause */
+} sched_stats;
+
 
 
 #define MAX_CONGESTION 25
 
-#define PRIORITY_LISTS 10
 #define TOP_PRIORITY (PRIORITY_LISTS - 1)
 #define LOWEST_PRIORITY 0
 
+/** @brief The priority of a deadline thread with budget, above all the policy levels */
+#define DL_PRIORITY PRIORITY_LISTS
+
 /**
   @brief The thread control block
 
@@ -106,8 +128,15 @@ typedef struct thread_control_block
   Thread_phase phase;                  /**< The phase of the thread */
 
   void (*thread_func)();               /**< The function executed by this thread */
+  void* thread_arg;                    /**< The argument of a kernel thread, e.g., an aio worker */
+
+  Mutex state_spinlock;                /**< Protects @c state and @c phase of this thread */
+
+  size_t stack_size;                   /**< The size of the thread stack */
+  mem_account* account;                /**< The account charged for the TCB and stack */
 
   TimerDuration wakeup_time;           /**< The time this thread will be woken up by the scheduler */
+  rhnode timeout_node;                 /**< Node in the scheduler timeout heap */
   rlnode sched_node;                   /**< node to use when queueing in the scheduler lists */
 
   struct thread_control_block * prev;  /**< previous context */
@@ -115,9 +144,25 @@ typedef struct thread_control_block
   
   int priority;
 
-  /* Variables used for resetting the priority during priority inversion */
-  int prev_queue;
-  int mutex_flag;
+  int nonblocking_io;                  /**< Set while a system call operates on a non-blocking stream */
+
+  TimerDuration run_start;             /**< The time this thread last gained its core */
+  sched_stats stats;                   /**< The CPU accounting of this thread */
+
+  TimerDuration vruntime;              /**< Virtual runtime, for the fair policy */
+  uint sched_core;                     /**< The core whose queue holds the thread, while it is queued, else the core it last ran on */
+  unsigned int affinity;               /**< Bit @c c is set iff the thread may run on core @c c */
+  void* wake_channel;                  /**< The channel this thread last slept on or signalled, see @c sched_wake_affine */
+
+  int pi_priority;                     /**< The priority lent by the waiters of @c pi_lock, or -1 */
+  void* pi_lock;                       /**< The lock held by this thread that @c pi_priority is lent for */
+
+  TimerDuration dl_period;             /**< The period of a deadline thread, or 0, see @c sched_set_deadline */
+  TimerDuration dl_runtime;            /**< The time reserved for the thread in each period */
+  TimerDuration dl_deadline;           /**< The end of the current period */
+  TimerDuration dl_budget;             /**< The reserved time left in the current period */
+  unsigned long dl_util;               /**< The share of a core reserved, in units of @c DL_UTIL_ONE */
+  int dl_queued;                       /**< Set while the thread is in the @c dl_queue of a core */
 } TCB;
 
 
@@ -134,31 +179,136 @@ typedef struct thread_control_block
 
 /** @brief Core control block.
 
-  Per-core info in memory (basically scheduler-related)
+  Per-core info in memory (basically scheduler-related).
+
+  Each core owns its own set of scheduler lists, protected by its own
+  @c sched_spinlock. A thread made ready goes to an idle core, if one is
+  allowed by its @c affinity, preferably the core it last ran on. Else 
+  it is queued on the core that made it ready, or the core it last ran 
+  on, or the first core it may run on. Only the chosen core is 
+  interrupted (by @c cpu_ici()), if it is idle, or runs without an 
+  alarm, or runs a thread of lower priority, which is then preempted.
+  Idle cores also steal work from their neighbours, but never a thread
+  that may not run on them. How the lists are used is up to the 
+  scheduling policy.
+
+  A CCB takes whole cache lines, and the fields that other cores write
+  (the queues and what goes with them) start a line of their own, so 
+  that a core switching threads does not invalidate the lines of others.
+  Counters that all cores update are kept per core, and summed on read.
  */
 typedef struct core_control_block {
+  /* Written only by the core itself */
   uint id;                    /**< The core id */
 
   TCB* current_thread;        /**< Points to the thread currently owning the core */
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
-} CCB;
+  rlnode thread_pool;             /**< Released thread blocks, kept for reuse */
+  unsigned int thread_pool_size;  /**< Number of blocks in @c thread_pool */
+
+  long active_threads;            /**< Threads spawned, less threads released, on this core */
+  TimerDuration busy_time;        /**< Time charged to threads other than the idle thread */
+  TimerDuration idle_time;        /**< Time charged to the idle thread */
+  unsigned long switches;         /**< Times a thread left this core */
+  unsigned long steals;           /**< Threads this core took from the queues of others */
+  unsigned long idle_poll_hits;   /**< Idle polls that found work */
+  unsigned long idle_poll_misses; /**< Idle polls that ended in a halt */
+  unsigned long wake_affine_hits;   /**< Partners woken up by this core and queued on it */
+  unsigned long wake_affine_misses; /**< Partners woken up by this core and queued elsewhere */
+
+  /* Written by other cores too */
+  Mutex sched_spinlock CACHE_ALIGNED;  /**< Protects the scheduler queues of this core */
+  rlnode SCHED[PRIORITY_LISTS];   /**< The core's scheduler queues, one per priority */
+  rlnode dl_queue;                /**< The deadline threads with budget, earliest deadline first */
+  unsigned int sched_bitmap;      /**< Bit @c i is set iff @c SCHED[i] is not empty (MLFQ) */
+  unsigned int sched_count;       /**< Number of threads in the queues of this core */
+  int tickless;                   /**< The current thread runs without a quantum alarm */
+  int current_priority;           /**< The priority the current thread gained the core with, @c DL_PRIORITY, or -1 for the idle thread */
+  TimerDuration current_deadline; /**< The deadline of the current thread, when it runs with @c DL_PRIORITY */
+  int need_resched;               /**< A thread of higher priority than the current one was queued */
+  TimerDuration min_vruntime;     /**< Least virtual runtime selected on this core (fair policy) */
+  int counter_congestion;         /**< Congestion counter, used to decide on @c boost() */
+  int fail_safe;                  /**< Selections since the last @c boost() */
+
+} CACHE_ALIGNED CCB;
  
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
 
+/**
+  @brief A scheduling policy.
+
+  A policy orders the ready queue of each core, adjusts a thread when it
+  leaves its core, and sets the length of its timeslices. The policies 
+  are the multilevel feedback queue ("mlfq", the default), round robin
+  ("rr") and a fair scheduler on virtual runtimes ("fair"). The policy
+  is chosen at boot, by @c set_sched_policy() or the environment variable
+  @c TINYOS_SCHED.
+
+  The queue methods (@c enqueue, @c dequeue, @c steal, @c boost and
+  @c requeue) are called with the @c sched_spinlock of the core held. @c on_yield is 
+  called with the @c state_spinlock of the thread held. 
+ */
+typedef struct sched_policy {
+  const char* name;                       /**< The name of the policy */
+
+  /** @brief Add a ready thread to the queue of a core. */
+  void (*enqueue)(CCB* ccb, TCB* tcb);
+
+  /** @brief Remove and return the thread to run next on a core, or NULL. */
+  TCB* (*dequeue)(CCB* ccb);
+
+  /** @brief Remove and return a thread that may run on @c core, or NULL. */
+  TCB* (*steal)(CCB* victim, uint core);
+
+  /** @brief A thread leaves its core, after running for @c ran usec. */
+  void (*on_yield)(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran);
+
+  /** @brief The length of the next timeslice of a thread, in usec. */
+  TimerDuration (*quantum)(TCB* tcb);
+
+  /** @brief Raise the priority of all the threads of a core, or NULL. */
+  void (*boost)(CCB* ccb);
+
+  /** @brief Move a queued thread whose priority was changed, or NULL. */
+  void (*requeue)(CCB* ccb, TCB* tcb);
+} sched_policy;
+
+/** @brief The scheduling policy in use. */
+extern const sched_policy* sched;
+
+
 /** @brief The current core's CCB */
 #define CURCORE  (cctx[cpu_core_id])
 
-/** 
+/**
+  @brief Return the thread currently executing on this core.
+
+  With preemption on, the caller may be switched to another core between
+  reading @c cpu_core_id and reading that core's current thread, and it
+  would then get some other thread. Re-reading the core id catches this.
+*/
+static inline struct thread_control_block* cur_thread()
+{
+  uint c;
+  struct thread_control_block* tcb;
+  do {
+    c = cpu_core_id;
+    tcb = __atomic_load_n(& cctx[c].current_thread, __ATOMIC_RELAXED);
+  } while(c != *(volatile uint*) & cpu_core_id);
+  return tcb;
+}
+
+/**
   @brief The current thread.
 
   This is a pointer to the TCB of the thread currently executing on this core.
 */
-#define CURTHREAD  (CURCORE.current_thread)
+#define CURTHREAD  (cur_thread())
 
 /** 
   @brief The current thread.
@@ -182,9 +332,28 @@ extern CCB cctx[MAX_CORES];
 	The thread will belong to process @c pcb and execute @c func.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
+
+  The TCB and stack are charged to the account of @c pcb, regardless of
+  its limits, since this is for threads the kernel needs, e.g., the aio
+  workers.
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+  @brief Create a new thread with a given stack size.
+
+  This is like @c spawn_thread(), but the stack of the new thread has
+  (approximately) @c stack_size bytes. A size of 0 selects the default, 
+  @c THREAD_STACK_SIZE. Other sizes are rounded up to a whole page, are
+  kept within @c THREAD_MIN_STACK_SIZE and @c THREAD_MAX_STACK_SIZE, and
+  are mapped with a guard page and lazily committed memory.
+
+  The TCB and stack are charged to the account of @c pcb, within its
+  limits. If either is over its limit, no thread is made and NULL is
+  returned.
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -197,6 +366,31 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a number of blocked threads.
+
+  This is @c wakeup for each thread of the array, with preemption turned
+  off once, and each core that must run some of them interrupted once.
+  The threads that were not @c STOPPED or @c INIT are set to NULL in the
+  array.
+
+  @param tcbs the threads to be made @c READY.
+  @param n the size of @c tcbs
+  @returns the number of threads made @c READY
+*/
+int wakeup_many(TCB** tcbs, int n);
+
+/**
+  @brief Restore the preemption state saved by @c preempt_off.
+
+  When preemption is turned back on, and a thread queued on this core
+  meanwhile must preempt the current one (see @c wakeup_many), the
+  current thread yields.
+
+  @param preempt the value returned by @c preempt_off
+*/
+void sched_preempt_restore(int preempt);
+
 
 /** 
   @brief Block the current thread.
@@ -255,8 +449,121 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void); 
 
+/**
+  @brief The earliest wakeup time of all sleeping threads.
+
+  This is a cheap query, it does not take any lock. If no thread 
+  is sleeping with a timeout, @c NO_TIMEOUT is returned.
+ */
+TimerDuration sched_next_timeout(void);
+
+
+/**
+  @brief Raise the priority of all threads queued on a core.
+
+  With the MLFQ policy, every ready thread of the core moves one priority
+  level up. Whole lists are spliced, the @c priority field of a boosted 
+  thread is brought up to date when it is removed from the queue. Other
+  policies do not boost.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+ */
+void boost(CCB* ccb);
 
-void boost(); /**/
+
+/**
+  @brief The priority a thread is scheduled with.
+
+  This is the priority of the thread, or the priority lent to it by 
+  the threads waiting on a lock that it holds, whichever is higher.
+ */
+static inline int sched_priority(TCB* tcb)
+{
+  int lent = __atomic_load_n(& tcb->pi_priority, __ATOMIC_RELAXED);
+  return (lent > tcb->priority) ? lent : tcb->priority;
+}
+
+/**
+  @brief Lend the priority of the current thread to the holder of a lock.
+
+  This is called by a thread that is about to sleep until @c lock is 
+  released by @c owner. If the owner is scheduled with a lower priority,
+  it is raised to that of the caller, until it calls 
+  @c sched_restore_priority() for @c lock. If the owner is queued, it is
+  moved to its new place in the queue. 
+
+  Priorities are not lent along chains of locks, only to the direct owner.
+  The caller must make sure that @c owner cannot exit during the call,
+  typically by holding the lock that protects the lock word.
+ */
+void sched_inherit_priority(TCB* owner, void* lock);
+
+/**
+  @brief Return the priority lent for a lock.
+
+  This is called by the current thread when it releases @c lock. If a 
+  priority was lent to it for @c lock, it goes back to its own priority.
+ */
+void sched_restore_priority(void* lock);
+
+/**
+  @brief Set the cores a thread may run on.
+
+  Bit @c c of @c mask allows core @c c; the bits of cores that do not exist
+  are ignored. The mask applies the next time the thread is queued, so a
+  queued thread may run once more where it is, and the current thread 
+  leaves a core it no longer may run on at its next yield.
+
+  The caller must make sure that @c tcb cannot exit during the call.
+
+  @returns 0 on success, or -1 if the mask allows no core of the machine.
+ */
+int sched_set_affinity(TCB* tcb, unsigned int mask);
+
+/**
+  @brief Note that the current thread communicates through @c channel.
+
+  Threads call this before they sleep at a channel (e.g., a pipe) and 
+  before they wake up its sleepers. A thread woken up by a thread that 
+  used the same channel last is its partner: it is queued on the core of
+  the waker, if nothing else is queued there, so that the data they share 
+  stays in the cache of the core. 
+ */
+static inline void sched_wake_affine(void* channel)
+{
+  TCB* tcb = CURTHREAD;
+  if(tcb->wake_channel != channel)
+    tcb->wake_channel = channel;
+}
+
+/** @brief Return the cores a thread may run on, as in @c sched_set_affinity */
+unsigned int sched_get_affinity(TCB* tcb);
+
+/** @brief A whole core, in the units of @c dl_util */
+#define DL_UTIL_ONE (1ul << 20)
+
+/** @brief The share of each core (in percent) that deadline threads may reserve */
+#define DL_MAX_UTIL 95
+
+/**
+  @brief Reserve @c runtime usec of every @c period usec for a thread.
+
+  A deadline thread with budget left in its period is served before the
+  threads of the scheduling policy, earliest deadline first. Once its
+  budget is spent, it sleeps until its period ends. A period of 0 drops
+  the reservation. The new parameters apply the next time the thread
+  becomes ready, or at once for the current thread.
+
+  The reservation is admitted only if the reservations of all threads 
+  stay within @c DL_MAX_UTIL percent of the cores. An exiting thread
+  drops its reservation.
+
+  The caller must make sure that @c tcb cannot exit during the call.
+
+  @returns 0 on success, or -1 if the arguments are bad (see @c SetDeadline)
+    or the reservation is not admitted.
+ */
+int sched_set_deadline(TCB* tcb, TimerDuration period, TimerDuration runtime);
 
 /**
   @brief Quantum (in microseconds) 
@@ -265,6 +572,29 @@ void boost(); /**/
   */
 #define QUANTUM (10000L)
 
+/** @brief The soft timers of each core used by the scheduler (see @c bios_set_core_timer) */
+enum SCHED_TIMER {
+  SCHED_TIMER_QUANTUM,  /**< The end of the timeslice of the current thread */
+  SCHED_TIMER_TIMEOUT   /**< The earliest timeout of a sleeping thread, on one core */
+};
+
+/**
+  @brief Tickless scheduling.
+
+  When this is non-zero (the default), a core does not set the quantum
+  alarm while no other thread is ready in its queue, and an idle core
+  sleeps until it is interrupted, e.g., by the timer of the earliest 
+  timeout of a sleeping thread. If a thread 
+  becomes ready on the core, the alarm is set at once. Build with 
+  <tt>make TICKLESS=0</tt> to set the quantum alarm on every timeslice.
+  */
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS 1
+#endif
+
+/** @brief The shortest alarm set for a timeout, in microseconds */
+#define TICKLESS_MIN_ALARM (100L)
+
 /** @} */
 
 #endif
\ No newline at end of file
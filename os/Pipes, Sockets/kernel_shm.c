@@ -0,0 +1,122 @@
+#include <string.h>
+#include "kernel_shm.h"
+#include "kernel_proc.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+
+static void shm_incref(shm_region* shm)
+{
+	__atomic_add_fetch(& shm->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void shm_decref(shm_region* shm)
+{
+	if(__atomic_sub_fetch(& shm->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(shm->base);
+		free(shm);
+	}
+}
+
+
+/* The region lives on after the stream is closed, as long as it is attached */
+static int shm_close(void* obj)
+{
+	shm_decref((shm_region*) obj);
+	return 0;
+}
+
+static file_ops shm_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = shm_close
+};
+
+
+Fid_t sys_ShmCreate(unsigned int size)
+{
+	if(size == 0 || size > SHM_MAX_SIZE)
+		return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	shm_region* shm = xmalloc(sizeof(shm_region));
+	shm->refcount = 1;
+	shm->size = size;
+	shm->base = xmalloc(size);
+	memset(shm->base, 0, size);
+
+	fcb->streamobj = shm;
+	fcb->streamfunc = & shm_ops;
+	return fid;
+}
+
+
+void* sys_ShmAttach(Fid_t fid, unsigned int* size)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL)
+		return NULL;
+
+	void* base = NULL;
+	if(fcb->streamfunc == & shm_ops) {
+		shm_region* shm = fcb->streamobj;
+		shm_incref(shm);
+
+		PCB* pcb = CURPROC;
+		shm_attachment* att = arena_alloc(& pcb->arena, sizeof(shm_attachment));
+		att->region = shm;
+		rlnode_init(& att->node, att);
+
+		Mutex_Lock(& pcb->fidt_lock);
+		rlist_push_back(& pcb->shm_list, & att->node);
+		Mutex_Unlock(& pcb->fidt_lock);
+
+		if(size) *size = shm->size;
+		base = shm->base;
+	}
+
+	FCB_decref(fcb);
+	return base;
+}
+
+
+int sys_ShmDetach(void* addr)
+{
+	PCB* pcb = CURPROC;
+	shm_attachment* att = NULL;
+
+	Mutex_Lock(& pcb->fidt_lock);
+	for(rlnode* p = pcb->shm_list.next; p != & pcb->shm_list; p = p->next) {
+		shm_attachment* a = p->obj;
+		if(a->region->base == addr) {
+			att = a;
+			rlist_remove(p);
+			break;
+		}
+	}
+	Mutex_Unlock(& pcb->fidt_lock);
+
+	if(att == NULL)
+		return -1;
+
+	shm_decref(att->region);
+	arena_free(& pcb->arena, att, sizeof(shm_attachment));
+	return 0;
+}
+
+
+void shm_detach_all(PCB* pcb)
+{
+	Mutex_Lock(& pcb->fidt_lock);
+	while(! is_rlist_empty(& pcb->shm_list)) {
+		shm_attachment* att = rlist_pop_front(& pcb->shm_list)->obj;
+		shm_decref(att->region);
+		arena_free(& pcb->arena, att, sizeof(shm_attachment));
+	}
+	Mutex_Unlock(& pcb->fidt_lock);
+}
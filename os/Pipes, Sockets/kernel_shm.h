@@ -0,0 +1,51 @@
+#ifndef __KERNEL_SHM_H
+#define __KERNEL_SHM_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_streams.h"
+
+/**
+	@file kernel_shm.h
+	@brief Shared memory regions.
+
+	@defgroup shm Shared memory
+	@ingroup kernel
+	@brief Shared memory regions.
+
+	A region is a block of memory, created by @c ShmCreate() and held
+	by a stream, so that it is passed to other processes like any other
+	stream (e.g., inherited by @c Exec). Since all processes run in the 
+	same address space, attaching to a region simply returns its address.
+
+	A region is released when the last stream to it is closed and the
+	last attachment is detached. The attachments of a process are kept
+	in its @c shm_list, protected by its @c fidt_lock, and are detached
+	when the process exits.
+
+	@{
+*/
+
+/** @brief A shared memory region */
+typedef struct shm_region
+{
+	unsigned int refcount;  /**< @brief The streams and the attachments to the region */
+	unsigned int size;      /**< @brief The size of the region in bytes */
+	void* base;             /**< @brief The memory of the region */
+} shm_region;
+
+
+/** @brief An attachment of a process to a region, in the @c shm_list of the process */
+typedef struct shm_attachment
+{
+	rlnode node;            /**< @brief Node in @c shm_list, pointing to the attachment */
+	shm_region* region;     /**< @brief The attached region */
+} shm_attachment;
+
+
+/** @brief Detach the process from all its regions. This is called at process exit. */
+void shm_detach_all(PCB* pcb);
+
+/** @} */
+
+#endif
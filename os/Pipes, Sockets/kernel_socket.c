@@ -5,64 +5,230 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_threads.h"
+#include "kernel_poll.h"
+#include "kernel_pool.h"
+#include "kernel_net.h"
 
 
 /*
 * All threads are created as unbound and only if they were given a port at that time can they become listeners
 * When a socket wants to connect it creates a struct, so that there is synchronization between server and client
 * After it creates it, it waits until it is returned with the fcb of the server copy where the peer to peer connection will be made
-* Shutdown cuts the communication by closing the pipes. To delete the sockets, close must be called
+* The two peers share one channel, with a ring (pipe) for each direction
+* A peer connected to another node has a connection of the network driver instead, see kernel_net.h
+* Shutdown cuts the communication by closing the rings. To delete the sockets, close must be called
 * close does different things depending on the type of socket
 * About 2-3% of connections fail because of thread_join. In validate_api it shows up as test timed out
 
 */
 
 
-/******************** Socket ops *********************/
+/*
+	The objects of a connection are pooled, since RPC-style traffic creates 
+	and releases connections at a high rate. The pipes of the connection 
+	are pooled by kernel_pipe.c.
+ */
+#ifndef SOCKET_POOL_HIGH_WATER
+#define SOCKET_POOL_HIGH_WATER 64
+#endif
+
+static object_pool socket_pool = OBJECT_POOL_INIT(SCB, SOCKET_POOL_HIGH_WATER);
+static object_pool peer_pool = OBJECT_POOL_INIT(peer_t, SOCKET_POOL_HIGH_WATER);
+static object_pool request_pool = OBJECT_POOL_INIT(request_t, SOCKET_POOL_HIGH_WATER);
 
-// The read and write simply call the appropriate pipe_read and pipe_write.
-int socket_write(void* socket_obj, const char* buf, unsigned int size)
+/*
+	A socket is charged to the process that made it, with room for the
+	peer or listener it may get, so that it never needs a charge later.
+ */
+#define SOCKET_BYTES (sizeof(SCB) + \
+	(sizeof(peer_t) > sizeof(listener_t) ? sizeof(peer_t) : sizeof(listener_t)))
+
+/* Take a socket from the pool, charged to the current process, or return NULL */
+static SCB* socket_alloc()
 {
-	SCB* socket = (SCB*) socket_obj;
+	mem_account* account = CURPROC->mem;
+	if(mem_charge(account, MEM_KERNEL, SOCKET_BYTES) != 0)
+		return NULL;
+	SCB* socket = (SCB*) pool_alloc(& socket_pool);
+	socket->account = account;
+	account_hold(account);
+	return socket;
+}
 
-	int retcode = -1;
-	int (*devwrite)(void*, const char*, uint) = NULL;
-	void* sobj = NULL;
+static void socket_free(SCB* socket)
+{
+	mem_uncharge(socket->account, MEM_KERNEL, SOCKET_BYTES);
+	account_put(socket->account);
+	pool_free(& socket_pool, socket);
+}
 
-  /* Get the fields from the stream */
-	FCB* fcb = socket->peer->pipes_FCBs[1];
 
-	if(fcb) {
+/******************** The port table *********************/
 
-		sobj = fcb->streamobj;
-		devwrite = fcb->streamfunc->Write;
+typedef struct port_stripe
+{
+	Mutex lock;
+	SCB* listeners;		/**< Chain of listeners, through @c hash_next */
+} port_stripe;
+
+static port_stripe PORT_TABLE[PORT_STRIPES];
+
+/* Consecutive ports fall into different stripes */
+static inline port_stripe* port_stripe_of(port_t port)
+{
+	return & PORT_TABLE[port % PORT_STRIPES];
+}
 
-		if(devwrite)
-			retcode = devwrite(sobj, buf, size);
+static inline Mutex* port_lock(port_t port)
+{
+	return & port_stripe_of(port)->lock;
+}
+
+/* The listener of a port, or NULL. The caller holds port_lock(port). */
+static SCB* port_listener(port_t port)
+{
+	SCB* s = port_stripe_of(port)->listeners;
+	while(s != NULL && s->portNum != port)
+		s = s->listener->hash_next;
+	return s;
+}
+
+static void port_bind(SCB* lsocket)
+{
+	port_stripe* stripe = port_stripe_of(lsocket->portNum);
+	lsocket->listener->hash_next = stripe->listeners;
+	stripe->listeners = lsocket;
+}
+
+static void port_unbind(SCB* lsocket)
+{
+	SCB** p = & port_stripe_of(lsocket->portNum)->listeners;
+	while(*p != lsocket)
+		p = & (*p)->listener->hash_next;
+	*p = lsocket->listener->hash_next;
+}
+
+
+/*
+	Ephemeral ports are taken from a stack of released ports, or else
+	from the ports never used so far. Both are O(1).
+ */
+static Mutex ephemeral_mx = MUTEX_INIT;
+static port_t ephemeral_free[MAX_PORT - EPHEMERAL_PORT_MIN + 1];
+static int ephemeral_nfree = 0;
+static int ephemeral_next = EPHEMERAL_PORT_MIN;
+
+static port_t ephemeral_alloc()
+{
+	port_t port = NOPORT;
+	Mutex_Lock(& ephemeral_mx);
+	if(ephemeral_nfree > 0)
+		port = ephemeral_free[--ephemeral_nfree];
+	else if(ephemeral_next <= MAX_PORT)
+		port = ephemeral_next++;
+	Mutex_Unlock(& ephemeral_mx);
+	return port;
+}
+
+static void ephemeral_release(port_t port)
+{
+	Mutex_Lock(& ephemeral_mx);
+	ephemeral_free[ephemeral_nfree++] = port;
+	Mutex_Unlock(& ephemeral_mx);
+}
+
+/* Give the ephemeral port of a socket back, after a failed connect or at close */
+static void socket_release_port(SCB* socket)
+{
+	if(socket->ephemeral) {
+		ephemeral_release(socket->portNum);
+		socket->portNum = NOPORT;
+		socket->ephemeral = 0;
 	}
-	return retcode;
+}
+
+
+/* The request list of a listener */
+static void listener_push_request(listener_t* listener, request_t* request)
+{
+	request->listener = listener;
+	rlist_push_back(& listener->request_list, rlnode_init(& request->node, request));
+	listener->request_count++;
+}
+
+static request_t* listener_pop_request(listener_t* listener)
+{
+	listener->request_count--;
+	return rlist_pop_front(& listener->request_list)->request;
+}
+
+static void listener_remove_request(request_t* request)
+{
+	rlist_remove(& request->node);
+	request->listener->request_count--;
+}
+
+
+
+/******************** Socket ops *********************/
+
+/* The connection of a peer of another node, or NULL */
+static inline net_conn* socket_remote(SCB* socket)
+{
+	return (socket->type == PEER) ? socket->peer->remote : NULL;
+}
+
+/* The ring read (end 0) or written (end 1) by a connected socket, or NULL if shut down */
+static inline pipe_CB* socket_ring(SCB* socket, int end)
+{
+	/* Only connected sockets have streams, and remote peers have none */
+	if(socket->type != PEER || socket->peer->end_closed[end] || socket->peer->remote != NULL)
+		return NULL;
+	return & socket->peer->channel->ring[end ^ socket->peer->side];
+}
+
+/* Close one end of a peer, without checking if it is closed already */
+static int peer_close_end(peer_t* peer, int end)
+{
+	pipe_CB* ring = & peer->channel->ring[end ^ peer->side];
+	return (end == 0) ? pipe_reader_close(ring) : pipe_writer_close(ring);
+}
+
+
+// The read and write simply call the appropriate pipe_read and pipe_write.
+int socket_write(void* socket_obj, const char* buf, unsigned int size)
+{
+	net_conn* remote = socket_remote((SCB*) socket_obj);
+	if(remote) return net_write(remote, buf, size);
+	pipe_CB* ring = socket_ring((SCB*) socket_obj, 1);
+	return ring ? pipe_write(ring, buf, size) : -1;
 }
 
 
 int socket_read(void* socket_obj, char* buf, unsigned int size)
 {
-	SCB* socket = (SCB*) socket_obj;
+	net_conn* remote = socket_remote((SCB*) socket_obj);
+	if(remote) return net_read(remote, buf, size);
+	pipe_CB* ring = socket_ring((SCB*) socket_obj, 0);
+	return ring ? pipe_read(ring, buf, size) : -1;
+}
 
-	int retcode = -1;
-	int (*devread)(void*, char*, uint) = NULL;
-	void* sobj = NULL;
 
-	/* Get the fields from the stream */
-	FCB* fcb = socket->peer->pipes_FCBs[0];
+int socket_writev(void* socket_obj, const iovec_t* iov, int iovcnt)
+{
+	net_conn* remote = socket_remote((SCB*) socket_obj);
+	if(remote) return net_writev(remote, iov, iovcnt);
+	pipe_CB* ring = socket_ring((SCB*) socket_obj, 1);
+	return ring ? pipe_writev(ring, iov, iovcnt) : -1;
+}
 
-	if(fcb) {
-		sobj = fcb->streamobj;
-		devread = fcb->streamfunc->Read;
 
-		if(devread)
-			retcode = devread(sobj, buf, size);
-	}
-	return retcode;
+int socket_readv(void* socket_obj, const iovec_t* iov, int iovcnt)
+{
+	net_conn* remote = socket_remote((SCB*) socket_obj);
+	if(remote) return net_readv(remote, iov, iovcnt);
+	pipe_CB* ring = socket_ring((SCB*) socket_obj, 0);
+	return ring ? pipe_readv(ring, iov, iovcnt) : -1;
 }
 
 
@@ -70,89 +236,243 @@ int socket_close(void* socket_obj)
 {
 	SCB* socket = (SCB*) socket_obj;
 
+	// A non-blocking connect that is still queued is withdrawn.
+	if(socket->pending != NULL) {
+		Mutex* lock = port_lock(socket->connect_port);
+		Mutex_Lock(lock);
+		if(socket->pending->server_copy_fcb == NULL && !socket->pending->failed)
+			listener_remove_request(socket->pending);
+		Mutex_Unlock(lock);
+		pool_free(& request_pool, socket->pending);
+	}
+
+	socket_release_port(socket);
+
 	if(socket->type == UNBOUND){
 
 		// If close is called a copy of the server must be deleted.
 		if(socket->peer != NULL)
-			free(socket->peer);
+			pool_free(& peer_pool, socket->peer);
 
-		free(socket);
+		socket_free(socket);
 	}
 	else if(socket->type == PEER){
 
-		// Close connection and free socket.
-
-		/* The pipes are closed when all the threads are finished. We can 
-		 * use them to know if the threads of the peer socket are finished. */
-		pipe_CB* pipes[2] = {(pipe_CB*) socket->peer->pipes_FCBs[0]->streamobj, (pipe_CB*) socket->peer->pipes_FCBs[1]->streamobj};
-		socket->peer->pipes_FCBs[0]->streamfunc->Close(socket->peer->pipes_FCBs[0]->streamobj);
-		socket->peer->pipes_FCBs[1]->streamfunc->Close(socket->peer->pipes_FCBs[1]->streamobj);
-
-		/* Closed both the 2 pipes from both the 2 sides.
-		 * It has closed one pipe from side and the other from both sides.
-		 *  -||-
-		 * Both 2 pipes have been closed from this section only.	*/
-		if( (pipes[0] == NULL && pipes[1] == NULL)
-			|| (pipes[0] == NULL && pipes[1]->writer_closed == 1)
-			|| (pipes[0]->reader_closed == 1 && pipes[1] == NULL)
-			|| (pipes[0]->reader_closed == 1 && pipes[1]->writer_closed == 1)){
-
-			free(socket->peer);
-			free(socket);
+		// Close the ends that were not shut down and free socket.
+		if(socket->peer->remote != NULL)
+			net_close(socket->peer->remote);
+		else for(int i=0; i<2; i++) {
+			if(! socket->peer->end_closed[i])
+				peer_close_end(socket->peer, i);
 		}
+
+		pool_free(& peer_pool, socket->peer);
+		socket_free(socket);
 	}
 	else{// listener
 	
+		Mutex* lock = port_lock(socket->portNum);
+		Mutex_Lock(lock);
+
 		// Closed the thread, so we woke up the rest of them and let them know what happened.
 		socket->listener->closing = 1;
 		Cond_Broadcast(& socket->listener->server_cv);
+		poll_notify(& socket->listener->pollq);
 
 		//Wake clients.
 		while(!is_rlist_empty(& socket->listener->request_list)){
-			rlnode* sel = rlist_pop_front(& socket->listener->request_list);
-			Cond_Signal(& sel->request->client_cv);
+			request_t* request = listener_pop_request(socket->listener);
+			if(request->remote != NULL) {
+				net_refuse(request);
+				continue;
+			}
+			request->failed = 1;
+			Cond_Signal(& request->client_cv);
+			poll_notify(& request->client->pollq);
 		}
 
 		// Free port 
-		PORT_MAP[socket->portNum] = NULL;
+		port_unbind(socket);
 
-		// Waiting for the cv. sched_mutex to empty to give priority to the others
-		while(socket->listener->server_thread_count > 0){
-			kernel_wait(& socket->listener->close_cv, SCHED_MUTEX);
+		// Waiting for the servers and the clients to leave, before the listener is freed
+		while(socket->listener->server_thread_count > 0 || socket->listener->client_count > 0){
+			kernel_mxwait(lock, & socket->listener->close_cv, SCHED_MUTEX);
 		}
 
+		Mutex_Unlock(lock);
+
 		//free listener kai socket
 		free(socket->listener);
-		free(socket);	
+		socket_free(socket);
 	}
 	return 0;
 }
 
+/* A peer socket is polled through its pipes, a listener is ready when Accept will not block. 
+   An unbound socket with a pending connect waits until it becomes a peer. */
+int socket_poll(void* socket_obj, int events, struct poll_table* pt)
+{
+	SCB* socket = (SCB*) socket_obj;
+	int mask = 0;
+
+	// Accept may turn the socket into a peer, so check under the lock.
+	if(socket->type != PEER) {
+		Mutex* lock = port_lock(socket->type == LISTENER ? socket->portNum : socket->connect_port);
+		Mutex_Lock(lock);
+		if(socket->type == LISTENER) {
+			if(!is_rlist_empty(& socket->listener->request_list) || socket->listener->closing)
+				mask = POLL_READ & events;
+			poll_wait(pt, & socket->listener->pollq);
+		}
+		else if(socket->type == UNBOUND) {
+			if(socket->pending == NULL || socket->pending->failed)
+				mask = POLL_ERROR;
+			else
+				poll_wait(pt, & socket->pollq);
+		}
+		int peer = (socket->type == PEER);
+		Mutex_Unlock(lock);
+
+		if(! peer) return mask;
+	}
+
+	if(socket->peer->remote != NULL)
+		return net_poll(socket->peer->remote, events, pt);
+
+	for(int i=0; i<2; i++) {
+		int ev = events & (i==0 ? POLL_READ : POLL_WRITE);
+		if(! ev) continue;
+		pipe_CB* ring = socket_ring(socket, i);
+		if(ring == NULL)
+			mask |= POLL_ERROR;
+		else
+			mask |= (i==0) ? pipe_reader_poll(ring, ev, pt) : pipe_writer_poll(ring, ev, pt);
+	}
+
+	return mask;
+}
+
+
 static file_ops socket_ops = {
   .Open = NULL,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .ReadV = socket_readv,
+  .WriteV = socket_writev,
+  .Poll = socket_poll,
+  .Close = socket_close,
+  .type = STREAM_SOCKET
 };
 
 
+pipe_CB* socket_pipe_end(FCB* fcb, int end)
+{
+	if(fcb->streamfunc != &socket_ops)
+		return NULL;
+	return socket_ring((SCB*) fcb->streamobj, end);
+}
+
+
 /********************	System calls.	********************/
 
 
+/* Get the socket of a file id, or NULL. The caller holds a reference to 
+   @c *fcbp, which must be released with @c FCB_decref. */
+static SCB* get_scb(Fid_t fid, FCB** fcbp)
+{
+	FCB* fcb = get_fcb(fid);
+	*fcbp = fcb;
+	if(fcb == NULL) 
+		return NULL;
+	if(fcb->streamfunc != &socket_ops) {
+		FCB_decref(fcb);
+		*fcbp = NULL;
+		return NULL;
+	}
+	return (SCB*) fcb->streamobj;
+}
+
+
+/* The last server or client to leave a closing listener wakes up the closer */
+static void listener_leave(listener_t* listener)
+{
+	if(listener->closing && listener->server_thread_count == 0 && listener->client_count == 0)
+		Cond_Broadcast(& listener->close_cv);
+}
+
+
+/* Make two unbound sockets into connected peers. Called by accept. */
+static void connect_peers(SCB* socket_client, SCB* socket_server)
+{
+	//	socket_client convert to peer
+	socket_client->peer = (peer_t*) pool_alloc(& peer_pool);
+
+	// One channel for both directions: the client reads ring 0, the server reads ring 1.
+	channel_t* channel = create_channel(socket_client->mode == SOCKET_MESSAGE, socket_client->account);
+	socket_client->peer->channel = channel;
+	socket_client->peer->side = 0;
+	socket_server->peer->channel = channel;
+	socket_server->peer->side = 1;
+
+	for(int i=0; i<2; i++) {
+		socket_client->peer->end_closed[i] = 0;
+		socket_server->peer->end_closed[i] = 0;
+	}
+	socket_client->peer->remote = NULL;
+	socket_server->peer->remote = NULL;
+
+	socket_client->peer->port_accepted = 1;
+	socket_server->peer->port_accepted = 1;
+
+	socket_client->peer->peer_port = socket_server->portNum;
+	socket_server->peer->peer_port = socket_client->portNum;
+
+	// Peers are polled without the socket lock, so they are marked last.
+	socket_client->type = PEER;
+	socket_server->type = PEER;
+}
+
+
 Fid_t sys_Socket(port_t port)
+{
+	return sys_SocketEx(port, SOCKET_STREAM);
+}
+
+
+Fid_t sys_SocketEx(port_t port, socket_mode mode)
 {	
-	// Port out of bounds or taken.
-	if (port < 0 || port > MAX_PORT || PORT_MAP[port] != NULL)
+	// Port out of bounds.
+	if (port < 0 || port > MAX_PORT)
 		return -1;
 
+	if (mode != SOCKET_STREAM && mode != SOCKET_MESSAGE)
+		return -1;
+
+	// Port taken.
+	if (port != NOPORT) {
+		Mutex_Lock(port_lock(port));
+		int taken = (port_listener(port) != NULL);
+		Mutex_Unlock(port_lock(port));
+		if(taken)
+			return -1;
+	}
+
 	// Allocate space for socket.
-	SCB* socket = (SCB*) xmalloc(sizeof(SCB));
+	SCB* socket = socket_alloc();
+	if(socket == NULL)
+		return NOFILE;
 
 	// Allocate for unbound if needed
 
 	// Init socket.
 	socket->type = UNBOUND;
 	socket->portNum = port;
+	socket->peer = NULL;
+	socket->ephemeral = 0;
+	socket->mode = mode;
+	socket->pending = NULL;
+	socket->connect_port = NOPORT;
+	poll_queue_init(& socket->pollq);
 	
 	// Reserve FCB
 	Fid_t socket_fid = 0;
@@ -160,7 +480,7 @@ Fid_t sys_Socket(port_t port)
 
 	// Condition for the reserve
 	if(!FCB_reserve(1, &socket_fid, &(socket->fcb))){
-		free(socket);
+		socket_free(socket);
 		return -1;
 	} 
 
@@ -172,20 +492,14 @@ Fid_t sys_Socket(port_t port)
 }
 
 
-int sys_Listen(Fid_t sock)
+static int listen_locked(SCB* socket, int backlog)
 {
-	// Get fcb. Check legality and if it has a socket. Then get it.
-	FCB* fcb = get_fcb(sock);
-	if (fcb == NULL || fcb->streamfunc != &socket_ops)
+	// A socket cannot become a listener on a busy port.
+	if (port_listener(socket->portNum) != NULL)
 		return -1;
-	SCB* socket = (SCB*) fcb->streamobj;
 
-	// A socket without a port cannot become a listener or become a listener on a busy port.
-	if (socket->portNum == NOPORT || PORT_MAP[socket->portNum] != NULL)
-		return -1;
-
-	// Socket already init.
-	if (socket->type != UNBOUND)
+	// Socket already init, or connecting.
+	if (socket->type != UNBOUND || socket->pending != NULL)
 		return -1;
 
 	// Make socket a listener.
@@ -199,57 +513,99 @@ int sys_Listen(Fid_t sock)
 	socket->listener->close_cv = COND_INIT; //Sleep listener, till its cv is empty
 
 	socket->listener->server_thread_count = 0;
+	socket->listener->client_count = 0;
 
 	rlnode_init(&(socket->listener->request_list), NULL);
+	socket->listener->request_count = 0;
+	socket->listener->backlog = backlog;
 
 	socket->listener->closing = 0;
+	poll_queue_init(& socket->listener->pollq);
 
 	// Acquire port.
-	PORT_MAP[socket->portNum] = socket;
-
-	// Forbit join the thread that created the listener.
-	sys_ThreadDetach(sys_ThreadSelf());
+	port_bind(socket);
 
 	// Success.
 	return 0;
 }
 
 
-Fid_t sys_Accept(Fid_t lsock)
+int sys_Listen(Fid_t sock)
 {
+	return sys_ListenEx(sock, 0);
+}
 
-	/***************** Control socket ********************************/
+
+int sys_ListenEx(Fid_t sock, int backlog)
+{
+	if (backlog < 0)
+		return -1;
 
 	// Get fcb. Check legality and if it has a socket. Then get it.
-	FCB* fcb = get_fcb(lsock);
-	if (fcb == NULL || fcb->streamfunc != &socket_ops)
-		return NOFILE;
-	SCB* lsocket = (SCB*) fcb->streamobj;
+	FCB* fcb;
+	SCB* socket = get_scb(sock, &fcb);
+	if (socket == NULL)
+		return -1;
+
+	// A socket without a port cannot become a listener.
+	int retcode = -1;
+	if (socket->portNum != NOPORT) {
+		Mutex_Lock(port_lock(socket->portNum));
+		retcode = listen_locked(socket, backlog);
+		Mutex_Unlock(port_lock(socket->portNum));
+	}
+
+	FCB_decref(fcb);
+
+	// Forbit join the thread that created the listener.
+	if(retcode == 0) {
+		kernel_lock();
+		sys_ThreadDetach(sys_ThreadSelf());
+		kernel_unlock();
+	}
+
+	return retcode;
+}
 
+
+/* Wait until the listener has a request. Return 0, or NOFILE or WOULDBLOCK. */
+static int accept_wait(SCB* lsocket, Mutex* lock)
+{
 	// Check if socket is a listener.
 	if(lsocket->type != LISTENER)
 		return NOFILE;
 
+	listener_t* listener = lsocket->listener;
+
 	/****************** Waiting for connection ***********************/
 
-	lsocket->listener->server_thread_count++;
+	// A non-blocking accept does not wait for a request.
+	if(is_rlist_empty(& listener->request_list) && !listener->closing && stream_nonblocking())
+		return WOULDBLOCK;
+
+	listener->server_thread_count++;
 
 	// The server threads should sleep if they don't have any connections to serve. It wakes one up when a request appears
-	while(is_rlist_empty(& lsocket->listener->request_list)){
-		kernel_wait(& lsocket->listener->server_cv,SCHED_PIPE);
+	while(is_rlist_empty(& listener->request_list) && !listener->closing)
+		kernel_mxwait(lock, & listener->server_cv, SCHED_PIPE);
 
-		// While waiting, the listening socket @c lsock was closed.
-		if(lsocket->listener->closing){
-			lsocket->listener->server_thread_count--;
+	listener->server_thread_count--;
 
-			// The last thread to leave due to close will wake up the one that will delete the listener
-			if(lsocket->listener->server_thread_count == 0)
-				Cond_Broadcast(& lsocket->listener->close_cv);
-			return NOFILE;
-		}
+	// While waiting, the listening socket @c lsock was closed.
+	if(listener->closing){
+		// The last thread to leave due to close will wake up the one that will delete the listener
+		listener_leave(listener);
+		return NOFILE;
 	}
 
-	lsocket->listener->server_thread_count--;
+	return 0;
+}
+
+
+/* Serve the first request of a listener. */
+static Fid_t accept_one(SCB* lsocket)
+{
+	listener_t* listener = lsocket->listener;
 
 	/******************	Make copy	*******************/
 
@@ -257,20 +613,23 @@ Fid_t sys_Accept(Fid_t lsock)
 	Fid_t socket_fid = 0;
 	FCB* new_fcb = NULL;
 
+	// Allocate space for socket.
+	SCB* new_socket = socket_alloc();
+	if(new_socket == NULL)
+		return NOFILE;
+
 	// Since it did not serve the request, it has to read it again.
 	if(!FCB_reserve(1, &socket_fid, &new_fcb)){
+		socket_free(new_socket);
 		return NOFILE;
 	}
 
 	// Takes a request.
-	rlnode* sel = rlist_pop_front(& lsocket->listener->request_list);
-	request_t* request = sel->request;
+	request_t* request = listener_pop_request(listener);
 
 	new_fcb->streamfunc = lsocket->fcb->streamfunc;
 
-	// Allocate space for socket.
-	SCB* new_socket = (SCB*) xmalloc(sizeof(SCB));
-	new_socket->peer = (peer_t*) xmalloc(sizeof(peer_t));
+	new_socket->peer = (peer_t*) pool_alloc(& peer_pool);
 
 	new_socket->fcb = new_fcb;
 	new_fcb->streamobj = new_socket;
@@ -278,110 +637,374 @@ Fid_t sys_Accept(Fid_t lsock)
 	// Init as peer.
 	new_socket->type = UNBOUND;
 	new_socket->portNum = lsocket->portNum;
+	new_socket->ephemeral = 0;
+	new_socket->mode = lsocket->mode;
+	new_socket->pending = NULL;
+	new_socket->connect_port = NOPORT;
+	poll_queue_init(& new_socket->pollq);
 
 	new_socket->peer->port_accepted = 0;
 
+	/******************	Establish connection	*******************/
+
+	// A request from another node is completed by the network driver.
+	if(request->remote != NULL) {
+		net_accept(request, new_socket);
+		return socket_fid;
+	}
+
+	// Both sides are connected before any of them returns.
+	connect_peers(request->client, new_socket);
+
 	// We put in the request the copy of the listener.
 	request->server_copy_fcb = new_fcb;
 
 	// Wake up client that made the request.
 	Cond_Signal(& request->client_cv);
+	poll_notify(& request->client->pollq);
 
 	return socket_fid;
 }
 
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+static Fid_t accept_locked(SCB* lsocket, Mutex* lock)
 {
+	int retcode = accept_wait(lsocket, lock);
+	return (retcode == 0) ? accept_one(lsocket) : retcode;
+}
+
+
+/* Serve up to max requests, waiting only for the first */
+static int accept_many_locked(SCB* lsocket, Mutex* lock, Fid_t* fids, int max)
+{
+	int retcode = accept_wait(lsocket, lock);
+	if(retcode != 0)
+		return retcode;
+
+	int count = 0;
+	while(count < max && !is_rlist_empty(& lsocket->listener->request_list)) {
+		Fid_t fid = accept_one(lsocket);
+		if(fid == NOFILE)
+			break;
+		fids[count++] = fid;
+	}
+	return (count > 0) ? count : -1;
+}
 
-	/***************** Control socket and port. ************************/
+
+Fid_t sys_Accept(Fid_t lsock)
+{
+
+	/***************** Control socket ********************************/
 
 	// Get fcb. Check legality and if it has a socket. Then get it.
-	FCB* fcb = get_fcb(sock);
-	if (fcb == NULL || fcb->streamfunc != &socket_ops)
+	FCB* fcb;
+	SCB* lsocket = get_scb(lsock, &fcb);
+	if (lsocket == NULL)
+		return NOFILE;
+
+	/* A listener keeps its port, this is the lock of its requests */
+	Mutex* lock = port_lock(lsocket->portNum);
+
+	int nb = stream_enter(fcb);
+	Mutex_Lock(lock);
+	Fid_t retcode = accept_locked(lsocket, lock);
+	Mutex_Unlock(lock);
+	stream_leave(nb);
+
+	FCB_decref(fcb);
+	return retcode;
+}
+
+
+int sys_AcceptMany(Fid_t lsock, Fid_t* fids, int max)
+{
+	if (fids == NULL || max <= 0)
 		return -1;
-	SCB* socket_client = (SCB*) fcb->streamobj;
 
-	// Check if socket is unbound.
-	if(socket_client->type != UNBOUND)
+	FCB* fcb;
+	SCB* lsocket = get_scb(lsock, &fcb);
+	if (lsocket == NULL)
+		return -1;
+
+	Mutex* lock = port_lock(lsocket->portNum);
+
+	int nb = stream_enter(fcb);
+	Mutex_Lock(lock);
+	int retcode = accept_many_locked(lsocket, lock, fids, max);
+	Mutex_Unlock(lock);
+	stream_leave(nb);
+
+	FCB_decref(fcb);
+	return retcode;
+}
+
+
+/* Complete the request of an earlier non-blocking connect. */
+static int connect_pending(SCB* socket_client, Mutex* lock, TimerDuration timeout)
+{
+	request_t* request = socket_client->pending;
+
+	while(request->server_copy_fcb == NULL && !request->failed) {
+		if(stream_nonblocking())
+			return WOULDBLOCK;
+
+		if(!kernel_mxtimedwait(lock, & request->client_cv, SCHED_PIPE, timeout)
+			&& request->server_copy_fcb == NULL && !request->failed){
+			listener_remove_request(request);
+			request->failed = 1;
+		}
+	}
+
+	int retcode = 0;
+	if(request->server_copy_fcb == NULL) {
+		socket_release_port(socket_client);
+		retcode = -1;
+	}
+	socket_client->pending = NULL;
+	pool_free(& request_pool, request);
+	return retcode;
+}
+
+
+static int connect_locked(SCB* socket_client, port_t port, Mutex* lock, TimerDuration timeout)
+{
+	// Port empty.
+	SCB* lsocket = port_listener(port);
+	if (lsocket == NULL)
 		return -1;
 
-	// Port out of bounds or empty.
-	if (port < 0 || port > MAX_PORT || PORT_MAP[port] == NULL)
+	/* The port may be freed while we wait, keep the listener */
+	listener_t* listener = lsocket->listener;
+
+	// Stream and message sockets do not mix.
+	if(socket_client->mode != lsocket->mode)
 		return -1;
 
-	// No timeout.
-	if(timeout <= 0)
-		timeout = NO_TIMEOUT;
+	// Fail fast when the backlog is full.
+	if(listener->backlog > 0 && listener->request_count >= listener->backlog)
+		return -1;
 
-	// A timeout of at least 500 msec is reasonable.
-	if(timeout != NO_TIMEOUT && timeout < 500)
-		timeout = 500;
+	// A client without a port is given an ephemeral one.
+	if(socket_client->portNum == NOPORT) {
+		port_t eport = ephemeral_alloc();
+		if(eport == NOPORT)
+			return -1;
+		socket_client->portNum = eport;
+		socket_client->ephemeral = 1;
+	}
 
 	/****************** Waiting for connection ***********************/
 
 	// Make request
-	request_t* request = (request_t*) xmalloc(sizeof(request_t));
+	request_t* request = (request_t*) pool_alloc(& request_pool);
 	request->client_cv = COND_INIT;
+	request->client = socket_client;
 	request->server_copy_fcb = NULL;
+	request->failed = 0;
+	request->remote = NULL;
 
 	//Send request.
-	rlist_push_front(& PORT_MAP[port]->listener->request_list, rlnode_init(&(request->node), request));
+	listener_push_request(listener, request);
 
 	// Informing the server that the client is requesting service.
-	Cond_Signal(& PORT_MAP[port]->listener->server_cv);
+	Cond_Signal(& listener->server_cv);
+	poll_notify(& listener->pollq);
+
+	// A non-blocking client does not wait, the request is completed by a later call.
+	if(stream_nonblocking()) {
+		socket_client->pending = request;
+		socket_client->connect_port = port;
+		return WOULDBLOCK;
+	}
+
+	listener->client_count++;
 
 	// As long as there are no copies of the server to serve the client, the client waits.
+	int retcode = 0;
 	while(request->server_copy_fcb == NULL)
 	{
-		if(!kernel_timedwait(& request->client_cv, SCHED_PIPE, timeout)){
-			rlist_remove(& request->node);
-			free(request);
-			return -1;
-		}
-		
 		// while waiting, the listening socket was closed.
-		if(PORT_MAP[port]->listener->closing){			
-			free(request);
-			return -1;		
+		if(listener->closing){			
+			retcode = -1;
+			break;
+		}
+
+		if(!kernel_mxtimedwait(lock, & request->client_cv, SCHED_PIPE, timeout)
+			&& request->server_copy_fcb == NULL){
+			listener_remove_request(request);
+			retcode = -1;
+			break;
 		}
 	}
 
-	/******************	Establish connection	*******************/
+	// After the client gets the server copy, the request is useless and deleted.
+	pool_free(& request_pool, request);
 
-	// Passes the socket created by the server.
-	SCB* socket_server = (SCB*) request->server_copy_fcb->streamobj;
-	socket_server->type = PEER;
+	if(retcode != 0)
+		socket_release_port(socket_client);
 
-	// After the client gets the server copy, the request is useless and deleted.
-	rlist_remove(& request->node);
-	free(request);
+	listener->client_count--;
+	listener_leave(listener);
 
-	//	socket_client convert to peer
-	socket_client->peer = (peer_t*) xmalloc(sizeof(peer_t));
-	socket_client->type = PEER;
+	return retcode;
+}
 
-	// Make pipes their fcbs.
-	socket_client->peer->pipes_FCBs[0] = (FCB*) xmalloc(sizeof(FCB));	//reader client
-	socket_client->peer->pipes_FCBs[1] = (FCB*) xmalloc(sizeof(FCB));	//writer client
 
-	socket_server->peer->pipes_FCBs[0] = (FCB*) xmalloc(sizeof(FCB));	//reader server
-	socket_server->peer->pipes_FCBs[1] = (FCB*) xmalloc(sizeof(FCB));	//writer server
+/* A timeout of at least 500 msec is reasonable. The wait is in usec. */
+static TimerDuration connect_wait(timeout_t timeout)
+{
+	if(timeout <= 0)
+		return NO_TIMEOUT;
+	return ((timeout < 500) ? 500 : timeout) * 1000ul;
+}
 
-	FCB* temp_fcb_array[2];
-	
-	// Make pipes and establish their connections.
-	temp_fcb_array[0] = socket_client->peer->pipes_FCBs[0];
-	temp_fcb_array[1] = socket_server->peer->pipes_FCBs[1];
-	create_pipe(temp_fcb_array);
 
-	temp_fcb_array[0] = socket_server->peer->pipes_FCBs[0];
-	temp_fcb_array[1] = socket_client->peer->pipes_FCBs[1];
-	create_pipe(temp_fcb_array);
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
 
-	socket_client->peer->port_accepted = 1;
-	socket_server->peer->port_accepted = 1;
+	/***************** Control socket and port. ************************/
+
+	// Get fcb. Check legality and if it has a socket. Then get it.
+	FCB* fcb;
+	SCB* socket_client = get_scb(sock, &fcb);
+	if (socket_client == NULL)
+		return -1;
+
+	TimerDuration wait = connect_wait(timeout);
+
+	int retcode = -1;
+	int nb = stream_enter(fcb);
+
+	if(socket_client->pending != NULL) {
+		// A non-blocking connect was started before.
+		Mutex* lock = port_lock(socket_client->connect_port);
+		Mutex_Lock(lock);
+		retcode = connect_pending(socket_client, lock, wait);
+		Mutex_Unlock(lock);
+	}
+	else if(socket_client->type == UNBOUND && port > NOPORT && port <= MAX_PORT) {
+		Mutex* lock = port_lock(port);
+		Mutex_Lock(lock);
+		retcode = connect_locked(socket_client, port, lock, wait);
+		Mutex_Unlock(lock);
+	}
+
+	stream_leave(nb);
+
+	FCB_decref(fcb);
+	return retcode;
+}
+
+
+int sys_ConnectNode(Fid_t sock, int node, port_t port, timeout_t timeout)
+{
+	// A connect on this node is local.
+	if(node == bios_net_node())
+		return sys_Connect(sock, port, timeout);
+
+	FCB* fcb;
+	SCB* socket_client = get_scb(sock, &fcb);
+	if (socket_client == NULL)
+		return -1;
+
+	// Only unbound stream sockets connect to other nodes, and they always block.
+	int retcode = -1;
+	if(node >= 0 && (uint) node < bios_net_nodes() && port > NOPORT && port <= MAX_PORT
+			&& socket_client->type == UNBOUND && socket_client->pending == NULL
+			&& socket_client->mode == SOCKET_STREAM) {
+
+		if(socket_client->portNum == NOPORT) {
+			socket_client->portNum = ephemeral_alloc();
+			socket_client->ephemeral = (socket_client->portNum != NOPORT);
+		}
+
+		if(socket_client->portNum != NOPORT)
+			retcode = net_connect(socket_client, node, port, connect_wait(timeout));
+		if(retcode != 0)
+			socket_release_port(socket_client);
+	}
+
+	FCB_decref(fcb);
+	return retcode;
+}
+
+
+int socket_remote_request(port_t port, request_t* request)
+{
+	if(port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	Mutex* lock = port_lock(port);
+	if(! Mutex_TryLock(lock))
+		return 1;
+
+	int retcode = -1;
+	SCB* lsocket = port_listener(port);
+	if(lsocket != NULL && lsocket->mode == SOCKET_STREAM) {
+		listener_t* listener = lsocket->listener;
+		if(listener->backlog == 0 || listener->request_count < listener->backlog) {
+			request->client = NULL;
+			request->server_copy_fcb = NULL;
+			request->failed = 0;
+			listener_push_request(listener, request);
+			Cond_Signal(& listener->server_cv);
+			poll_notify(& listener->pollq);
+			retcode = 0;
+		}
+	}
+
+	Mutex_Unlock(lock);
+	return retcode;
+}
+
+
+void socket_remote_peer(SCB* socket, net_conn* conn)
+{
+	if(socket->peer == NULL)
+		socket->peer = (peer_t*) pool_alloc(& peer_pool);
+
+	socket->peer->channel = NULL;
+	socket->peer->side = 0;
+	socket->peer->end_closed[0] = socket->peer->end_closed[1] = 0;
+	socket->peer->remote = conn;
+	socket->peer->port_accepted = 1;
+	socket->peer->peer_port = net_peer_port(conn);
+
+	// Peers are polled without the socket lock, so they are marked last.
+	socket->type = PEER;
+}
+
+
+int sys_MessageSize(Fid_t sock)
+{
+	FCB* fcb;
+	SCB* socket = get_scb(sock, &fcb);
+	if (socket == NULL)
+		return -1;
+
+	pipe_CB* ring = socket_ring(socket, 0);
+
+	int nb = stream_enter(fcb);
+	int retcode = ring ? pipe_message_size(ring) : -1;
+	stream_leave(nb);
+
+	FCB_decref(fcb);
+	return retcode;
+}
 
+
+int sys_SocketPorts(Fid_t sock, port_t* local, port_t* peer)
+{
+	FCB* fcb;
+	SCB* socket = get_scb(sock, &fcb);
+	if (socket == NULL)
+		return -1;
+
+	if(local) *local = socket->portNum;
+	if(peer) *peer = (socket->type == PEER) ? socket->peer->peer_port : NOPORT;
+
+	FCB_decref(fcb);
 	return 0;
 }
 
@@ -393,30 +1016,39 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	int retcode = -1;
 
 	// Get fcb. Check legality and if it has a socket. Then get it.
-	FCB* fcb = get_fcb(sock);
-	if (fcb == NULL || fcb->streamfunc != &socket_ops)
+	FCB* fcb;
+	SCB* socket = get_scb(sock, &fcb);
+	if (socket == NULL)
 		return retcode;
-	SCB* socket = (SCB*) fcb->streamobj;
 
 	// Check if socket is peer and connected.
 	if(socket->type != PEER || !socket->peer->port_accepted)
-		return retcode;
+		goto finish;
 
 	// Illegal shutdown mode.
 	if(how < 1 || how > 3)
-		return retcode;
+		goto finish;
 
 	/***************** Shutdown pipes ************************/
 
-	FCB* pipe_fcb[2] = {socket->peer->pipes_FCBs[0], socket->peer->pipes_FCBs[1]}; 
+	// The network driver keeps the state of a remote peer.
+	if(socket->peer->remote != NULL) {
+		retcode = net_shutdown(socket->peer->remote, how);
+		goto finish;
+	}
 
-	if(how == SHUTDOWN_READ)
-		retcode = pipe_fcb[0]->streamfunc->Close(pipe_fcb[0]->streamobj);
-	else if(how == SHUTDOWN_WRITE)
-		retcode = pipe_fcb[1]->streamfunc->Close(pipe_fcb[1]->streamobj);
-	else{
-		retcode = pipe_fcb[0]->streamfunc->Close(pipe_fcb[0]->streamobj);
-		retcode =+ pipe_fcb[1]->streamfunc->Close(pipe_fcb[1]->streamobj);
+	/* Each end is closed once, by the first one to mark it. Shutting 
+	   down multiple times is not an error. */
+	retcode = 0;
+	for(int i=0; i<2; i++) {
+		if(! (how & (1<<i)))
+			continue;
+		if(__atomic_exchange_n(& socket->peer->end_closed[i], 1, __ATOMIC_ACQ_REL))
+			continue;
+		retcode += peer_close_end(socket->peer, i);
 	}
+
+finish:
+	FCB_decref(fcb);
 	return retcode;
 }
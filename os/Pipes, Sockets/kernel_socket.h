@@ -4,6 +4,7 @@
 #include "tinyos.h"
 #include "util.h"
 #include "kernel_streams.h"
+#include "kernel_account.h"
 
 
 
@@ -20,20 +21,37 @@ typedef struct listener_s
 	CondVar server_cv;
 	int server_thread_count;
 
-	// List for requests.
+	// List for requests, served in FIFO order.
 	rlnode request_list;
+	int request_count;
+
+	// The maximum length of request_list, or 0 for no limit.
+	int backlog;
+
+	// Clients in connect, waiting for a server copy.
+	int client_count;
 
 	// Used at closing. We wake up the threads that are on accept and then release the structures
 	CondVar close_cv;
 	int closing;
 
+	// Threads polling for Accept.
+	poll_queue pollq;
+
+	// Next listener in the same chain of the port table.
+	struct socket_control_block* hash_next;
+
 } listener_t;
 
 
 typedef struct peer_s
 {
 	int port_accepted;
-	FCB* pipes_FCBs[2];
+	port_t peer_port;		/**< The local port of the other end */
+	channel_t* channel;		/**< The stream, shared with the other end */
+	int side;				/**< This end reads @c channel->ring[side] and writes the other ring */
+	int end_closed[2];		/**< Set when the read (0) or write (1) end has been closed by @c ShutDown */
+	struct net_conn* remote;	/**< The connection to another node, in place of @c channel, or NULL */
 
 } peer_t;
 
@@ -50,6 +68,14 @@ typedef struct socket_control_block
 		peer_t* peer;
 	};
 
+	int ephemeral;					/**< Set if @c portNum was given by @c Connect */
+	socket_mode mode;				/**< Stream or message socket */
+
+	struct request_struct* pending;	/**< The request of a non-blocking @c Connect, until it completes */
+	port_t connect_port;			/**< The port of the last @c Connect, whose lock protects @c pending */
+	poll_queue pollq;				/**< Threads polling for the completion of @c pending */
+	mem_account* account;			/**< The account charged for the socket */
+
 } SCB;
 
 
@@ -58,7 +84,12 @@ typedef struct request_struct
 {
 	rlnode node;
 	CondVar client_cv;
-	FCB* server_copy_fcb;
+	SCB* client;			/**< The socket that made the request */
+	listener_t* listener;	/**< The listener whose list holds the request */
+	FCB* server_copy_fcb;	/**< Set by accept, when the connection is established */
+	int failed;				/**< Set when the request is dropped, because the listener closed */
+	struct net_conn* remote;	/**< The connection of a request from another node, or NULL. 
+								     Such a request has no @c client, and is completed by the driver. */
 
 }request_t;
 
@@ -68,7 +99,16 @@ typedef struct request_struct
 
 ***********************************/
 
-SCB* PORT_MAP[MAX_PORT + 1];
+/**
+  @brief The number of lock stripes of the port table.
+
+  The listeners are hashed by port into this many chains, each with its 
+  own lock. The lock of a port protects its listener, the requests of 
+  the listener and the pending connects to the port. Connects to 
+  different ports thus proceed in parallel. The socket streams themselves 
+  are pipes, and are protected by their own locks.
+  */
+#define PORT_STRIPES 64
 
 
 /************** Socket operations *****************/ 
@@ -80,7 +120,47 @@ int socket_write(void* socket_obj, const char* buf, unsigned int size);
 int socket_read(void* socket_obj, char* buf, unsigned int size);
 
 
+int socket_writev(void* socket_obj, const iovec_t* iov, int iovcnt);
+
+
+int socket_readv(void* socket_obj, const iovec_t* iov, int iovcnt);
+
+
+int socket_poll(void* socket_obj, int events, struct poll_table* pt);
+
+
 int socket_close(void* socket_obj);
 
 
+/**
+  @brief Return a ring of a connected socket.
+
+  For @c end 0 the ring read by the socket is returned, for 
+  @c end 1 the ring written by the socket. If @c fcb is not a 
+  connected socket, or the end has been shut down, NULL is returned.
+  */
+pipe_CB* socket_pipe_end(FCB* fcb, int end);
+
+
+/**
+  @brief Queue a request from another node on the listener of a port.
+
+  This is called by the network driver, in an interrupt handler, so it 
+  does not wait for the lock of the port.
+
+  @returns 0 if the request was queued, 1 if the port is busy and the 
+    request may be made again, and -1 if it is refused, since there is no
+    stream listener on the port, or its backlog is full.
+  */
+int socket_remote_request(port_t port, request_t* request);
+
+
+/**
+  @brief Make an unbound socket a peer of a connection to another node.
+
+  This is called by the network driver, when a connection is established.
+  */
+void socket_remote_peer(SCB* socket, struct net_conn* conn);
+
+
 #endif
\ No newline at end of file
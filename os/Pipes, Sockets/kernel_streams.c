@@ -8,50 +8,130 @@
 
 #define MAX_FILES MAX_PROC
 
+/*
+  The FCB slab.
+
+  All FCBs are in the table FT. Each core keeps a magazine of free FCBs, 
+  accessed with preemption off. An empty magazine is refilled with half 
+  a magazine from the shared depot, and a full one gives half of it back,
+  under FCB_freelist_lock. FCBs that were never used are in FT from 
+  FT_next on, so boot does not have to touch the table. Near exhaustion,
+  an allocation may fail while other cores still cache a few free FCBs.
+ */
+#define FCB_MAGAZINE 32
+
+typedef struct fcb_magazine {
+  FCB* fcb[FCB_MAGAZINE];
+  unsigned int count;
+  unsigned long allocs, frees, refills, flushes, failures;
+} CACHE_ALIGNED fcb_magazine;
+
 FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+static unsigned int FT_next;              /* The first FCB never used */
+static rlnode FCB_freelist;               /* The depot */
+Mutex FCB_freelist_lock = MUTEX_INIT;     /* Protects FCB_freelist and FT_next */
+static fcb_magazine FCB_magazine[MAX_CORES];
 
 
 void initialize_files()
 {
   rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
+  FT_next = 0;
+  lock_profile_name(& FCB_freelist_lock, "FCB_freelist_lock", -1);
+}
 
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
+
+/* Move up to n FCBs from the depot to the magazine. */
+static void magazine_refill(fcb_magazine* mag, unsigned int n)
+{
+  Mutex_Lock(& FCB_freelist_lock);
+  while(n-- > 0) {
+    FCB* fcb;
+    if(! is_rlist_empty(& FCB_freelist))
+      fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    else if(FT_next < MAX_FILES) {
+      fcb = & FT[FT_next++];
+      rlnode_init(& fcb->freelist_node, fcb);
+    }
+    else break;
+    mag->fcb[mag->count++] = fcb;
   }
+  Mutex_Unlock(& FCB_freelist_lock);
+  mag->refills++;
+}
+
+/* Move n FCBs from the magazine to the depot. */
+static void magazine_flush(fcb_magazine* mag, unsigned int n)
+{
+  Mutex_Lock(& FCB_freelist_lock);
+  while(n-- > 0)
+    rlist_push_front(& FCB_freelist, & mag->fcb[--mag->count]->freelist_node);
+  Mutex_Unlock(& FCB_freelist_lock);
+  mag->flushes++;
 }
 
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  FCB* fcb = NULL;
+
+  int preempt = preempt_off;
+  fcb_magazine* mag = & FCB_magazine[cpu_core_id];
+  if(mag->count == 0)
+    magazine_refill(mag, FCB_MAGAZINE/2);
+  if(mag->count > 0) {
+    fcb = mag->fcb[--mag->count];
     fcb->refcount = 0;
-    return fcb;
+    fcb->flags = 0;
+    mag->allocs++;
   }
   else
-    return NULL;
+    mag->failures++;
+  if(preempt) preempt_on;
+
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  int preempt = preempt_off;
+  fcb_magazine* mag = & FCB_magazine[cpu_core_id];
+  if(mag->count == FCB_MAGAZINE)
+    magazine_flush(mag, FCB_MAGAZINE/2);
+  mag->fcb[mag->count++] = fcb;
+  mag->frees++;
+  if(preempt) preempt_on;
+}
+
+
+int sys_GetFileStats(file_stats* stats)
+{
+  if(stats == NULL) return -1;
+
+  *stats = (file_stats) { .total = MAX_FILES };
+  for(uint c=0; c<MAX_CORES; c++) {
+    fcb_magazine* mag = & FCB_magazine[c];
+    stats->allocs += mag->allocs;
+    stats->frees += mag->frees;
+    stats->refills += mag->refills;
+    stats->flushes += mag->flushes;
+    stats->failures += mag->failures;
+  }
+  stats->in_use = stats->allocs - stats->frees;
+  return 0;
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     
     //Call special close.
     //If the children have inherited the Pipe, they must also close it in order to delete it.
@@ -66,20 +146,111 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+	File id tables.
+ */
+
+_Static_assert(FIDT_WORDS(MAX_FILEID) <= 64, "the full mask of fid_table is too small");
+_Static_assert(FIDT_INLINE <= 64, "the inline bitmap of fid_table is too small");
+
+void fidt_init(fid_table* t)
+{
+  t->fcb = t->inline_fcb;
+  t->size = FIDT_INLINE;
+  t->used = & t->inline_used;
+  t->inline_used = 0;
+  t->full = 0;
+  for(int i=0; i<FIDT_INLINE; i++)
+    t->inline_fcb[i] = NULL;
+}
+
+void fidt_destroy(fid_table* t)
+{
+  assert(fidt_next(t, 0) == NOFILE);
+  if(t->fcb != t->inline_fcb) free(t->fcb);
+  if(t->used != & t->inline_used) free(t->used);
+  fidt_init(t);
+}
+
+/* Double the table until it holds fid */
+static void fidt_grow(fid_table* t, Fid_t fid)
+{
+  unsigned int size = t->size;
+  while(size <= (unsigned int) fid) size *= 2;
+  if(size > MAX_FILEID) size = MAX_FILEID;
+
+  FCB** fcb = (FCB**) xmalloc(size * sizeof(FCB*));
+  memcpy(fcb, t->fcb, t->size * sizeof(FCB*));
+  memset(fcb + t->size, 0, (size - t->size) * sizeof(FCB*));
+  if(t->fcb != t->inline_fcb) free(t->fcb);
+  t->fcb = fcb;
+
+  unsigned int words = FIDT_WORDS(size), oldwords = FIDT_WORDS(t->size);
+  if(words > oldwords) {
+    uint64_t* used = (uint64_t*) xmalloc(words * sizeof(uint64_t));
+    memcpy(used, t->used, oldwords * sizeof(uint64_t));
+    memset(used + oldwords, 0, (words - oldwords) * sizeof(uint64_t));
+    if(t->used != & t->inline_used) free(t->used);
+    t->used = used;
+  }
+  t->size = size;
+}
+
+FCB* fidt_set(fid_table* t, Fid_t fid, FCB* fcb)
+{
+  assert(fid >= 0 && fid < MAX_FILEID);
+  if((unsigned int) fid >= t->size) {
+    if(fcb == NULL) return NULL;
+    fidt_grow(t, fid);
+  }
+
+  FCB* old = t->fcb[fid];
+  t->fcb[fid] = fcb;
+
+  unsigned int w = fid / 64;
+  if(fcb) {
+    bitmap_set(t->used, fid);
+    if(t->used[w] == ~0ull) bitmap_set(& t->full, w);
+  } else {
+    bitmap_clear(t->used, fid);
+    bitmap_clear(& t->full, w);
+  }
+  return old;
+}
+
+Fid_t fidt_alloc(fid_table* t, FCB* fcb)
+{
+  uint64_t notfull = ~t->full;
+  if(notfull == 0) return NOFILE;
+
+  /* Words past the end of the table are empty */
+  unsigned int w = __builtin_ctzll(notfull);
+  Fid_t fid = 64*w;
+  if(w < FIDT_WORDS(t->size))
+    fid += __builtin_ctzll(~t->used[w]);
+
+  if(fid >= MAX_FILEID) return NOFILE;
+  fidt_set(t, fid, fcb);
+  return fid;
+}
+
+Fid_t fidt_next(fid_table* t, Fid_t fid)
+{
+  if(fid < 0) fid = 0;
+  int next = bitmap_next_set(t->used, t->size, fid);
+  return (next < 0) ? NOFILE : next;
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
     uint i;
+    int ret = 0;
+
+    Mutex_Lock(& cur->fidt_lock);
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
-    }
-    if(i<num) return 0;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -90,14 +261,30 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
+    }
+    /* Give them the lowest free fids */
+    for(i=0; i<num; i++)
+	if((fid[i] = fidt_alloc(& cur->FIDT, fcb[i])) == NOFILE)
+	    break;
+    if(i<num) {
+	/* Roll back */
+	while(i>0) {
+	    fidt_set(& cur->FIDT, fid[i-1], NULL);
+	    i--;
+	}
+	for(i=0;i<num;i++)
+	    release_FCB(fcb[i]);
+	goto finish;
     }
     /* Found all */
-    for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
+    for(i=0;i<num;i++)
 	FCB_incref(fcb[i]);
-    }
-    return 1;
+    ret = 1;
+
+finish:
+    Mutex_Unlock(& cur->fidt_lock);
+    return ret;
 }
 
 
@@ -105,11 +292,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(& cur->fidt_lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(fidt_get(& cur->FIDT, fid[i])==fcb[i]);
+	fidt_set(& cur->FIDT, fid[i], NULL);
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(& cur->fidt_lock);
 }
 
 
@@ -128,7 +317,15 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_lock);
+  FCB* fcb = fidt_get(& cur->FIDT, fid);
+  /* make sure that the stream will not be closed (by another thread) 
+     while the caller is using it! */
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(& cur->fidt_lock);
+
+  return fcb;
 }
 
 
@@ -146,20 +343,17 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    if(devread)
+    if(devread) {
+      int nb = stream_enter(fcb);
       retcode = devread(sobj, buf, size);
+      stream_leave(nb);
+      account_io(retcode, 0);
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
   
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
-
   return retcode;
 }
 
@@ -179,13 +373,12 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
+    if(devwrite) {
+      int nb = stream_enter(fcb);
       retcode = devwrite(sobj, buf, size);
+      stream_leave(nb);
+      account_io(0, retcode);
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
@@ -196,24 +389,139 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   return retcode;
 }
 
-//kaloume eidika close*******************************************************************************************
-int sys_Close(int fd)
+int stream_readv(void* obj, int (*read)(void*, char*, unsigned int), const iovec_t* iov, int iovcnt)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  int total = 0;
+  for(int i=0; i<iovcnt; i++) {
+    int rc = read(obj, iov[i].base, iov[i].len);
+    if(rc < 0) return (i==0) ? rc : total;
+    total += rc;
+    if((unsigned int) rc < iov[i].len) break;
+  }
+  return total;
+}
+
 
+int stream_writev(void* obj, int (*write)(void*, const char*, unsigned int), const iovec_t* iov, int iovcnt)
+{
+  int total = 0;
+  for(int i=0; i<iovcnt; i++) {
+    int rc = write(obj, iov[i].base, iov[i].len);
+    if(rc < 0) return (i==0) ? rc : total;
+    total += rc;
+    if((unsigned int) rc < iov[i].len) break;
+  }
+  return total;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, int iovcnt)
+{
+  int retcode = -1;
+
+  if(iovcnt < 0 || iovcnt > MAX_IOVEC || (iovcnt > 0 && iov == NULL))
+    return -1;
+
+  /* Get the fields from the stream */
   FCB* fcb = get_fcb(fd);
 
-  if(fcb) {   
+  if(fcb) {
+    void* sobj = fcb->streamobj;
+    file_ops* ops = fcb->streamfunc;
+    int nb = stream_enter(fcb);
 
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    if(ops->ReadV)
+      retcode = ops->ReadV(sobj, iov, iovcnt);
+    else if(ops->Read)
+      retcode = stream_readv(sobj, ops->Read, iov, iovcnt);
+
+    stream_leave(nb);
+    account_io(retcode, 0);
+
+    /* Need to decrease the reference to FCB */
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, int iovcnt)
+{
+  int retcode = -1;
+
+  if(iovcnt < 0 || iovcnt > MAX_IOVEC || (iovcnt > 0 && iov == NULL))
+    return -1;
 
+  /* Get the fields from the stream */
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb) {
+    void* sobj = fcb->streamobj;
+    file_ops* ops = fcb->streamfunc;
+    int nb = stream_enter(fcb);
+
+    if(ops->WriteV)
+      retcode = ops->WriteV(sobj, iov, iovcnt);
+    else if(ops->Write)
+      retcode = stream_writev(sobj, ops->Write, iov, iovcnt);
+
+    stream_leave(nb);
+    account_io(0, retcode);
+
+    /* Need to decrease the reference to FCB */
+    FCB_decref(fcb);
   }
 
   return retcode;
 }
 
 
+int sys_SetNonBlocking(Fid_t fd, int nonblocking)
+{
+  FCB* fcb = get_fcb(fd);
+  if(fcb == NULL) return -1;
+
+  if(nonblocking)
+    __atomic_or_fetch(& fcb->flags, FCB_NONBLOCK, __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch(& fcb->flags, ~FCB_NONBLOCK, __ATOMIC_RELAXED);
+
+  FCB_decref(fcb);
+  return 0;
+}
+
+
+int sys_StreamType(Fid_t fd)
+{
+  FCB* fcb = get_fcb(fd);
+  if(fcb == NULL) return -1;
+
+  int type = fcb->streamfunc->type;
+  FCB_decref(fcb);
+  return type;
+}
+
+
+//kaloume eidika close*******************************************************************************************
+int sys_Close(int fd)
+{
+  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(retcode) return retcode;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_lock);
+  FCB* fcb = fidt_set(& cur->FIDT, fd, NULL);
+  Mutex_Unlock(& cur->fidt_lock);
+
+  /* The close operation may block, it is done without the lock */
+  if(fcb) 
+    retcode = FCB_decref(fcb);    
+
+  return retcode;
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -227,18 +535,26 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_lock);
+  FCB* old = fidt_get(& cur->FIDT, oldfd);
+  FCB* new = fidt_get(& cur->FIDT, newfd);
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_set(& cur->FIDT, newfd, old);
   }
+  else
+    new = NULL;
+  Mutex_Unlock(& cur->fidt_lock);
+
+  /* Release the stream that was replaced */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -287,3 +603,21 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+Fid_t sys_OpenTrace()
+{
+  return open_stream(DEV_TRACE, 0);
+}
+
+
+unsigned int sys_GetBlockDevices()
+{
+  return device_no(DEV_BLOCK);
+}
+
+
+Fid_t sys_OpenBlock(unsigned int devno)
+{
+  return open_stream(DEV_BLOCK, devno);
+}
+
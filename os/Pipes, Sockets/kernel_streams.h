@@ -3,6 +3,7 @@
 
 #include "tinyos.h"
 #include "kernel_dev.h"
+#include "kernel_sched.h"
 
 /**
 	@file kernel_streams.h
@@ -32,6 +33,9 @@
 
 
 
+/** @brief The stream is in non-blocking mode. @see SetNonBlocking */
+#define FCB_NONBLOCK 1
+
 /** @brief The file control block.
 
 	A file control block provides a uniform object to the
@@ -41,6 +45,7 @@
 typedef struct file_control_block
 {
   uint refcount;  			/**< @brief Reference counter. */
+  int flags;				/**< @brief Stream flags, e.g., @c FCB_NONBLOCK */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
@@ -48,6 +53,64 @@ typedef struct file_control_block
 
 
 
+/** @brief The initial size of a file id table, kept inside the table. */
+#define FIDT_INLINE 16
+
+/** @brief The words of a bitmap of @c n bits */
+#define FIDT_WORDS(n) BITMAP_WORDS(n)
+
+/** @brief The file id table of a process.
+
+	The table starts with @c FIDT_INLINE entries, stored in the table
+	itself, and doubles when a larger fid is needed, up to @c MAX_FILEID.
+	The populated entries are marked in the bitmap @c used, which makes
+	finding the lowest free fid, and walking the open fids, cheap. 
+	Bit @c w of @c full is set when word @c w of @c used is all ones.
+
+	The table is protected by the @c fidt_lock of the process.
+ */
+typedef struct fid_table
+{
+  FCB** fcb;                      /**< @brief The entries, @c size of them */
+  unsigned int size;              /**< @brief The current size of the table */
+  uint64_t* used;                 /**< @brief Bit @c i is set iff @c fcb[i] is not NULL */
+  uint64_t full;                  /**< @brief Bit @c w is set iff @c used[w] is full */
+
+  FCB* inline_fcb[FIDT_INLINE];   /**< @brief The initial storage of @c fcb */
+  uint64_t inline_used;           /**< @brief The initial storage of @c used */
+} fid_table;
+
+
+/** @brief Initialize an empty table. */
+void fidt_init(fid_table* t);
+
+/** @brief Release the storage of an empty table, making it as new. */
+void fidt_destroy(fid_table* t);
+
+/** @brief Return the entry of @c fid, or NULL if it is not in use or illegal. */
+static inline FCB* fidt_get(fid_table* t, Fid_t fid)
+{
+	return (fid >= 0 && (unsigned int) fid < t->size) ? t->fcb[fid] : NULL;
+}
+
+/** 
+	@brief Set the entry of a legal fid, and return the previous entry.
+
+	The table grows if needed. A NULL @c fcb frees the entry.
+*/
+FCB* fidt_set(fid_table* t, Fid_t fid, FCB* fcb);
+
+/** 
+	@brief Give the lowest free fid to @c fcb.
+
+	@returns the fid, or @c NOFILE if the table has @c MAX_FILEID entries in use.
+*/
+Fid_t fidt_alloc(fid_table* t, FCB* fcb);
+
+/** @brief Return the first fid in use that is not less than @c fid, or @c NOFILE. */
+Fid_t fidt_next(fid_table* t, Fid_t fid);
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -120,7 +183,10 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 /** @brief Translate an fid to an FCB.
 
-	This routine will return NULL if the fid is not legal.
+	This routine will return NULL if the fid is not legal. Else, the
+	reference count of the returned FCB has been increased, so that the
+	stream cannot be closed (by another thread) while it is in use; the
+	caller must release it with @c FCB_decref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -128,6 +194,56 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Start an operation on a stream.
+
+	This is called by system calls before they call the methods of @c fcb.
+	It makes the mode of the stream visible to the methods, through
+	@c stream_nonblocking(). The returned value must be passed to 
+	@c stream_leave() after the operation.
+*/
+static inline int stream_enter(FCB* fcb)
+{
+	TCB* tcb = CURTHREAD;
+	int old = tcb->nonblocking_io;
+	tcb->nonblocking_io = (fcb->flags & FCB_NONBLOCK) != 0;
+	return old;
+}
+
+/** @brief End an operation started by @c stream_enter(). */
+static inline void stream_leave(int old)
+{
+	CURTHREAD->nonblocking_io = old;
+}
+
+/** @brief Return 1 if the current stream operation must not block. */
+static inline int stream_nonblocking()
+{
+	return CURTHREAD->nonblocking_io;
+}
+
+
+/** @brief Vectored read, by calling a read method once per segment.
+
+	This implements the semantics of @c ReadV, and can be used by streams
+	that provide a native @c ReadV method, or when they do not provide one.
+	The array @c iov must be legal.
+
+	@param obj the stream object passed to @c read
+	@param read the read method of the stream
+	@param iov the array of segments
+	@param iovcnt the number of segments
+	@returns the total number of bytes read, or the error of the first read, if it failed.
+*/
+int stream_readv(void* obj, int (*read)(void*, char*, unsigned int), const iovec_t* iov, int iovcnt);
+
+
+/** @brief Vectored write, by calling a write method once per segment.
+
+	@see stream_readv
+*/
+int stream_writev(void* obj, int (*write)(void*, const char*, unsigned int), const iovec_t* iov, int iovcnt);
+
+
 /** @} */
 
 #endif
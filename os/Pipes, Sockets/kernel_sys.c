@@ -21,9 +21,23 @@ kernel_lock();\
 kernel_unlock();\
 
 
-/* with return */
+/* with return, no kernel lock */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
+/* without return, no kernel lock */
+#define SYSCALLV(NAME, SIG, ARGS)\
+void NAME SIG \
+{\
+	sys_##NAME ARGS;\
+}\
+
+/* with return, holding the kernel lock */
+#define SYSCALL_PROC(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
 {\
 	RET __ret;\
 	PRE_CALL\
@@ -32,8 +46,8 @@ RET NAME SIG \
 	return __ret;\
 }\
 
-/* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+/* without return, holding the kernel lock */
+#define SYSCALLV_PROC(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
 	PRE_CALL\
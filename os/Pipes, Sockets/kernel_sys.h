@@ -4,31 +4,83 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+  The system call table. 
+
+  Calls declared with SYSCALL_PROC/SYSCALLV_PROC operate on the process tree, 
+  and are executed holding the kernel lock. All other calls rely on the
+  locks of the objects they access (pipes, sockets, file tables etc).
+ */
 #define SYSCALLS \
-SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALLV(Exit, (int exitval), (exitval))\
+SYSCALL_PROC(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL_PROC(ExecStack, int, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
+SYSCALL_PROC(ExecEx, int, (Task task, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds), (task, argl, args, stack_size, fdmap, nfds))\
+SYSCALL_PROC(ExecGive, int, (Task task, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds), (task, argl, args, stack_size, fdmap, nfds))\
+SYSCALL_PROC(Spawn, int, (Task task, int argl, void* args, fd_action* actions, int n), (task, argl, args, actions, n))\
+SYSCALLV_PROC(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
-SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
-SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(Futex, int, (int* addr, futex_op op, int val, timeout_t timeout), (addr, op, val, timeout))\
+SYSCALL_PROC(GetPPid, int, (void), ())\
+SYSCALL_PROC(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
+SYSCALL_PROC(WaitChildren, int, (Pid_t* pids, int* exitvals, int n), (pids, exitvals, n))\
+SYSCALL(SetLimit, int, (limit_resource resource, unsigned long bytes), (resource, bytes))\
+SYSCALL(GetLimit, int, (limit_resource resource, unsigned long* bytes), (resource, bytes))\
+SYSCALL_PROC(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL_PROC(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
-SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
-SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
-SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL_PROC(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
+SYSCALL_PROC(ThreadDetach, int, (Tid_t tid), (tid))\
+SYSCALLV_PROC(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, unsigned int mask), (tid, mask))\
+SYSCALL(GetAffinity, int, (Tid_t tid, unsigned int* mask), (tid, mask))\
+SYSCALL(SetDeadline, int, (Tid_t tid, unsigned long period, unsigned long runtime), (tid, period, runtime))\
+SYSCALL(Sleep, int, (unsigned long usec), (usec))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
+SYSCALL(OpenTrace, Fid_t, (), ())\
+SYSCALL(GetBlockDevices, unsigned int, (), ())\
+SYSCALL(OpenBlock, Fid_t, (unsigned int devno), (devno))\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV,int,(Fid_t fd, const iovec_t* iov, int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(WriteV,int,(Fid_t fd, const iovec_t* iov, int iovcnt), (fd,iov,iovcnt))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
+SYSCALL(Poll,int,(Fid_t* fids, int* events, int n, timeout_t timeout), (fids,events,n,timeout))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(SetNonBlocking,int, (Fid_t fd, int nonblocking), (fd,nonblocking))\
+SYSCALL(StreamType,int, (Fid_t fd), (fd))\
+SYSCALL(GetFileStats,int, (file_stats* stats), (stats))\
+SYSCALL(GetBlockStats,int, (block_stats* stats), (stats))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeEx, int, (pipe_t* pipe, unsigned int capacity, unsigned int max_capacity), (pipe, capacity, max_capacity))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int len), (in, out, len))\
+SYSCALL(ShmCreate, Fid_t, (unsigned int size), (size))\
+SYSCALL(ShmAttach, void*, (Fid_t fid, unsigned int* size), (fid, size))\
+SYSCALL(ShmDetach, int, (void* addr), (addr))\
+SYSCALL(Open, Fid_t, (const char* path, int flags), (path, flags))\
+SYSCALL(Seek, long, (Fid_t fid, long offset, seek_whence whence), (fid, offset, whence))\
+SYSCALL(Stat, int, (const char* path, file_info* info), (path, info))\
+SYSCALL(MkDir, int, (const char* path), (path))\
+SYSCALL(Unlink, int, (const char* path), (path))\
+SYSCALL(MapFile, void*, (Fid_t fid, unsigned long offset, unsigned int* len), (fid, offset, len))\
+SYSCALL(UnmapFile, int, (void* addr), (addr))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
+SYSCALL(ListenEx, int, (Fid_t sock, int backlog), (sock, backlog))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL(AcceptMany, int, (Fid_t lsock, Fid_t* fids, int max), (lsock, fids, max))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL(ConnectNode, int, (Fid_t sock, int node, port_t port, timeout_t timeout), (sock, node, port, timeout))\
+SYSCALL(GetNodeId, int, (), ())\
+SYSCALL(SocketEx, Fid_t, (port_t port, socket_mode mode), (port, mode))\
+SYSCALL(MessageSize, int, (Fid_t sock), (sock))\
+SYSCALL(SocketPorts, int, (Fid_t sock, port_t* local, port_t* peer), (sock, local, peer))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(AioSetup, Fid_t, (unsigned int entries, aio_ring** ring), (entries, ring))\
+SYSCALL(AioEnter, int, (Fid_t fid, unsigned int to_submit, unsigned int min_complete, timeout_t timeout), (fid, to_submit, min_complete, timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(GetCoreStats, int, (core_stats* stats, unsigned int n), (stats, n))\
 
 
 
@@ -39,9 +91,14 @@ RET sys_ ## NAME SIG;
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+#define SYSCALL_PROC(NAME, RET, SIG, ARGS) SYSCALL(NAME, RET, SIG, ARGS)
+#define SYSCALLV_PROC(NAME, SIG, ARGS) SYSCALLV(NAME, SIG, ARGS)
+
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_PROC
+#undef SYSCALLV_PROC
 
 #endif
\ No newline at end of file
@@ -10,6 +10,87 @@
 #define SYSTEM_PAGE_SIZE  (1<<12)
 
 
+/*
+  The thread table.
+
+  The free slots form a list through next_free, and the unused slots
+  beyond the ones ever handed out are on this list too.
+ */
+
+_Static_assert(sizeof(PTCB) <= ARENA_MAX_OBJECT, "a PTCB does not fit in an arena");
+
+/* The generation of the next Tid. Every Tid in the system is different. */
+static Tid_t tid_generation = 0;
+
+void tidt_init(tid_table* t, kernel_arena* arena)
+{
+  t->slot = NULL;
+  t->size = 0;
+  t->free_head = 0;
+  t->arena = arena;
+}
+
+void tidt_destroy(tid_table* t)
+{
+  free(t->slot);
+  tidt_init(t, t->arena);
+}
+
+/* Double the table, putting the new slots on the free list */
+static int tidt_grow(tid_table* t)
+{
+  if(t->size == MAX_TIDS) return 0;
+  unsigned int size = t->size ? 2*t->size : 16;
+  if(size > MAX_TIDS) size = MAX_TIDS;
+
+  t->slot = (tid_slot*) xrealloc(t->slot, size * sizeof(tid_slot));
+  for(unsigned int i = t->size; i < size; i++) {
+    t->slot[i].ptcb = NULL;
+    t->slot[i].next_free = (i+1 < size) ? i+2 : t->free_head;
+  }
+  t->free_head = t->size + 1;
+  t->size = size;
+  return 1;
+}
+
+PTCB* tidt_alloc(tid_table* t)
+{
+  if(t->free_head == 0 && ! tidt_grow(t))
+    return NULL;
+
+  unsigned int idx = t->free_head - 1;
+  tid_slot* s = & t->slot[idx];
+  t->free_head = s->next_free;
+
+  PTCB* ptcb = (PTCB*) arena_alloc(t->arena, sizeof(PTCB));
+
+  Tid_t gen = __atomic_add_fetch(& tid_generation, 1, __ATOMIC_RELAXED);
+  ptcb->tid = (gen << TID_INDEX_BITS) | (idx + 1);
+  s->ptcb = ptcb;
+  return ptcb;
+}
+
+PTCB* tidt_get(tid_table* t, Tid_t tid)
+{
+  unsigned int idx = (tid & MAX_TIDS) - 1;
+  if(tid == NOTHREAD || idx >= t->size) return NULL;
+  PTCB* ptcb = t->slot[idx].ptcb;
+  return (ptcb != NULL && ptcb->tid == tid) ? ptcb : NULL;
+}
+
+void tidt_release(tid_table* t, PTCB* ptcb)
+{
+  unsigned int idx = (ptcb->tid & MAX_TIDS) - 1;
+  assert(idx < t->size && t->slot[idx].ptcb == ptcb);
+  t->slot[idx].ptcb = NULL;
+  t->slot[idx].next_free = t->free_head;
+  t->free_head = idx + 1;
+
+  ptcb->tid = NOTHREAD;
+  arena_free(t->arena, ptcb, sizeof(PTCB));
+}
+
+
 /** 
   @brief Function that starts a new thread.
   */
@@ -30,10 +111,21 @@ void start_thread(){
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
 {
 
-  /* Allocate memory for ptcb. */
-  PTCB* ptcb = (PTCB*) xmalloc(sizeof(PTCB));
+  /* Get a ptcb and its tid. */
+  PTCB* ptcb = tidt_alloc(& CURPROC->TIDT);
+  if(ptcb == NULL)
+    return NOTHREAD;
 
   /* Init ptcb */
   ptcb->ref_count = 0;
@@ -44,9 +136,6 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   ptcb->args = args;
   ptcb->thread_exited = 0;
 
-  /* The tid is the address of the ptcb. */
-  ptcb->tid = (Tid_t) ptcb;
-
   /* Make node. */
   rlnode_init(& ptcb->ptcb_node, ptcb);
 
@@ -56,8 +145,14 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   /* Creating a thread and connecting it to ptcb. */
   if(task != NULL) {
+    ptcb->thread = spawn_thread_stack(CURPROC, start_thread, stack_size);
+    if(ptcb->thread == NULL) {
+      /* Over a memory limit */
+      rlist_remove(& ptcb->ptcb_node);
+      tidt_release(& CURPROC->TIDT, ptcb);
+      return NOTHREAD;
+    }
     CURPROC->thread_count++;
-    ptcb->thread = spawn_thread(CURPROC, start_thread);
     ptcb->thread->owner_ptcb = ptcb;
     wakeup(ptcb->thread);
   }
@@ -70,7 +165,8 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) CURPTCB;
+	PTCB* ptcb = CURPTCB;
+	return ptcb ? ptcb->tid : NOTHREAD;
 }
 
 
@@ -79,9 +175,9 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
-  PTCB* ptcb = (PTCB*)tid;
+  PTCB* ptcb = tidt_get(& CURPROC->TIDT, tid);
   //For valid tid.
-  if(rlist_find(& CURPROC->PTCB_list, ptcb, NULL) != NULL){
+  if(ptcb != NULL){
     // If it's not itself, the thread it wants to join is not detached and hasn't joined somewhere else.
     if((tid != sys_ThreadSelf()) && (ptcb->thread_detached == 0)){
 
@@ -104,8 +200,8 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
         // Remove from the ptcb list of the process
         rlist_remove(& ptcb->ptcb_node);
 
-        // Release ptcb memory.
-        free(ptcb);
+        // Release the tid and the ptcb.
+        tidt_release(& CURPROC->TIDT, ptcb);
       }
       return 0;
     }
@@ -115,8 +211,8 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
       // Remove from the ptcb list of the process
       rlist_remove(& ptcb->ptcb_node);
 
-      // Release ptcb memory.
-      free(ptcb);
+      // Release the tid and the ptcb.
+      tidt_release(& CURPROC->TIDT, ptcb);
     }  
   }
 	return -1;
@@ -128,10 +224,10 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  PTCB* ptcb = (PTCB*)tid;
+  PTCB* ptcb = tidt_get(& CURPROC->TIDT, tid);
 
   // Wakes up the thread waiting for it and makes it detached
-  if(rlist_find(& CURPROC->PTCB_list, ptcb, NULL) != NULL){
+  if(ptcb != NULL){
     ptcb->thread_detached = 1;
     Cond_Broadcast(& ptcb->cv);
     return 0;
@@ -140,6 +236,75 @@ int sys_ThreadDetach(Tid_t tid)
 }
 
 
+/*
+  The TCB of a thread of the current process, or NULL if it has exited. 
+  NOTHREAD stands for the calling thread. The kernel lock must be held.
+ */
+static TCB* thread_of(Tid_t tid)
+{
+  if(tid == NOTHREAD) return CURTHREAD;
+  PTCB* ptcb = tidt_get(& CURPROC->TIDT, tid);
+  return (ptcb != NULL && ! ptcb->thread_exited) ? ptcb->thread : NULL;
+}
+
+
+/**
+  @brief Set the cores a thread may run on.
+  */
+int sys_SetAffinity(Tid_t tid, unsigned int mask)
+{
+  kernel_lock();
+  TCB* tcb = thread_of(tid);
+  int ret = (tcb != NULL) ? sched_set_affinity(tcb, mask) : -1;
+  kernel_unlock();
+
+  /* Leave the core at once, if it is no longer allowed */
+  if(ret == 0 && tcb == CURTHREAD && !(mask & (1u << cpu_core_id)))
+    yield(SCHED_USER);
+  return ret;
+}
+
+
+/**
+  @brief Return the cores a thread may run on.
+  */
+int sys_GetAffinity(Tid_t tid, unsigned int* mask)
+{
+  if(mask == NULL) return -1;
+  kernel_lock();
+  TCB* tcb = thread_of(tid);
+  if(tcb != NULL) *mask = sched_get_affinity(tcb);
+  kernel_unlock();
+  return (tcb != NULL) ? 0 : -1;
+}
+
+
+/**
+  @brief Reserve some time of every period for a thread.
+  */
+int sys_SetDeadline(Tid_t tid, unsigned long period, unsigned long runtime)
+{
+  kernel_lock();
+  TCB* tcb = thread_of(tid);
+  int ret = (tcb != NULL) ? sched_set_deadline(tcb, period, runtime) : -1;
+  kernel_unlock();
+  return ret;
+}
+
+
+/**
+  @brief Sleep for some microseconds.
+  */
+int sys_Sleep(unsigned long usec)
+{
+  /* Nobody wakes us up but the timeout, except by accident */
+  TimerDuration deadline = bios_clock() + usec;
+  for(TimerDuration now = bios_clock(); now < deadline; now = bios_clock())
+    sleep_releasing(STOPPED, NULL, SCHED_USER, deadline - now);
+  return 0;
+}
+
+
 /**
   @brief Terminate the current thread.
   */
@@ -148,10 +313,14 @@ void sys_ThreadExit(int exitval)
 
   CURPTCB->exitval = exitval;
 
+  /* Mark the exit before the joiners wake up. The ptcb may be freed by a
+     joiner as soon as we sleep, so it must not be touched after that. */
+  CURPTCB->thread_exited = 1;
+
   // Wake up as many threads waiting for what we're going to kill
   Cond_Broadcast(& CURPTCB->cv);
 
-  CURPROC->thread_count--;
+  process_thread_exit();
 
   /* Kill the thread. */
   kernel_sleep(EXITED, SCHED_USER);
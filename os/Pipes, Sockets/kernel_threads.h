@@ -11,6 +11,7 @@
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_arena.h"
 
 
 typedef struct pointer_thread_control_block{ 
@@ -35,6 +36,60 @@ typedef struct pointer_thread_control_block{
 
 #define CURPTCB (CURTHREAD->owner_ptcb)
 
+
+/** @brief The low bits of a Tid hold the slot of the thread, plus one */
+#define TID_INDEX_BITS 20
+
+/** @brief The largest number of PTCBs of a process */
+#define MAX_TIDS ((1u << TID_INDEX_BITS) - 1)
+
+/** @brief A slot of a thread table */
+typedef struct tid_slot {
+  PTCB* ptcb;                 /**< @brief The PTCB, or NULL if the slot is free */
+  unsigned int next_free;     /**< @brief The next free slot plus one, when free */
+} tid_slot;
+
+/** @brief The thread table of a process.
+
+  The table maps Tids to PTCBs in O(1). A Tid holds the index of its
+  slot, plus one, in the low @c TID_INDEX_BITS bits, and a generation number,
+  taken from a system-wide counter, in the rest. A slot is valid for a Tid
+  only while its PTCB carries the Tid, so stale Tids, and the Tids of other
+  processes, are rejected.
+
+  The PTCBs are allocated from the arena of the process, where released
+  PTCBs are reused by new threads. Any PTCB left when the process exits
+  goes with the arena.
+
+  The table is protected by the kernel lock.
+ */
+typedef struct tid_table {
+  tid_slot* slot;             /**< @brief The slots, @c size of them */
+  unsigned int size;          /**< @brief The current size of the table */
+  unsigned int free_head;     /**< @brief The first free slot plus one, or 0 */
+  kernel_arena* arena;        /**< @brief The arena of the PTCBs */
+} tid_table;
+
+/** @brief Initialize an empty table, allocating PTCBs from @c arena. */
+void tidt_init(tid_table* t, kernel_arena* arena);
+
+/** @brief Release a table whose PTCBs have all been released, making it as new. */
+void tidt_destroy(tid_table* t);
+
+/** 
+  @brief Get a PTCB with a new Tid in its @c tid field.
+
+  The rest of the PTCB is not initialized.
+  @returns the PTCB, or NULL if the process has @c MAX_TIDS threads.
+ */
+PTCB* tidt_alloc(tid_table* t);
+
+/** @brief Return the PTCB of @c tid, or NULL if @c tid is not in the table. */
+PTCB* tidt_get(tid_table* t, Tid_t tid);
+
+/** @brief Free the slot of a PTCB, and keep or free the PTCB. */
+void tidt_release(tid_table* t, PTCB* ptcb);
+
 void start_thread();
 
 
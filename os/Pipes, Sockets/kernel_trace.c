@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "kernel_trace.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+
+#ifdef SCHED_TRACE
+
+/* A traced event */
+typedef struct trace_record {
+	TimerDuration ts;       /* usec since boot */
+	trace_event event;
+	int arg;
+	void* a;
+	void* b;
+} trace_record;
+
+/* The records of a core. Only the core writes to it, with preemption off. */
+typedef struct trace_ring {
+	unsigned long head;     /* The records ever written */
+	trace_record rec[TRACE_RING_SIZE];
+} CACHE_ALIGNED trace_ring;
+
+static trace_ring trace_rings[MAX_CORES];
+
+/* bios_clock() is too coarse for tracing, the host clock is used instead */
+static struct timespec trace_epoch;
+
+static TimerDuration trace_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - trace_epoch.tv_sec)*1000000ul + (t.tv_nsec - trace_epoch.tv_nsec)/1000;
+}
+
+
+void initialize_trace()
+{
+	for(uint c=0; c<MAX_CORES; c++)
+		trace_rings[c].head = 0;
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+}
+
+
+void sched_trace(trace_event event, int arg, void* a, void* b)
+{
+	int preempt = preempt_off;
+
+	trace_ring* ring = & trace_rings[cpu_core_id];
+	unsigned long h = ring->head;
+	trace_record* r = & ring->rec[h % TRACE_RING_SIZE];
+	r->ts = trace_clock();
+	r->event = event;
+	r->arg = arg;
+	r->a = a;
+	r->b = b;
+
+	/* Make the record visible to readers */
+	__atomic_store_n(& ring->head, h+1, __ATOMIC_RELEASE);
+
+	if(preempt) preempt_on;
+}
+
+
+/*
+	A trace stream holds a copy of the rings, taken at open time, and
+	formats one record at a time into a line of text.
+ */
+typedef struct trace_stream {
+	trace_record* rec;      /* The records of all the cores */
+	unsigned int* core;     /* The core of each record */
+	unsigned int count;     /* The number of records */
+	unsigned int pos;       /* The next record to format */
+
+	char line[256];         /* The formatted text not read yet */
+	unsigned int len;
+	unsigned int off;
+	int done;               /* The closing bracket has been formatted */
+} trace_stream;
+
+
+static void* trace_open(uint minor)
+{
+	uint ncores = cpu_cores();
+	trace_stream* ts = xmalloc(sizeof(trace_stream));
+	ts->rec = xmalloc(ncores * TRACE_RING_SIZE * sizeof(trace_record));
+	ts->core = xmalloc(ncores * TRACE_RING_SIZE * sizeof(unsigned int));
+	ts->count = ts->pos = 0;
+	ts->len = ts->off = 0;
+	ts->done = 0;
+
+	for(uint c=0; c<ncores; c++) {
+		trace_ring* ring = & trace_rings[c];
+		unsigned long head = __atomic_load_n(& ring->head, __ATOMIC_ACQUIRE);
+		unsigned long start = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+		unsigned int first = ts->count;
+		for(unsigned long i = start; i < head; i++) {
+			ts->rec[ts->count] = ring->rec[i % TRACE_RING_SIZE];
+			ts->core[ts->count] = c;
+			ts->count++;
+		}
+
+		/* Drop the records that the core may have overwritten while we copied */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		unsigned long now = __atomic_load_n(& ring->head, __ATOMIC_RELAXED);
+		if(now >= start + TRACE_RING_SIZE) {
+			unsigned long lost = now - (start + TRACE_RING_SIZE) + 1;
+			if(lost > head - start) lost = head - start;
+			memmove(& ts->rec[first], & ts->rec[first+lost], (head - start - lost)*sizeof(trace_record));
+			memmove(& ts->core[first], & ts->core[first+lost], (head - start - lost)*sizeof(unsigned int));
+			ts->count -= lost;
+		}
+	}
+
+	return ts;
+}
+
+
+static const char* trace_cause_name(int cause)
+{
+	static const char* names[SCHED_CAUSES] = {
+		"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+	};
+	return (cause >= 0 && cause < SCHED_CAUSES) ? names[cause] : "?";
+}
+
+
+/* Format the next piece of the JSON array */
+static void trace_format(trace_stream* ts)
+{
+	ts->off = 0;
+	if(ts->pos == ts->count) {
+		ts->len = snprintf(ts->line, sizeof(ts->line), "%s]\n", ts->count ? "\n" : "[");
+		ts->done = 1;
+		return;
+	}
+
+	trace_record* r = & ts->rec[ts->pos];
+	const char* sep = (ts->pos == 0) ? "[\n" : ",\n";
+	static const char* names[] = { "switch", "wakeup", "boost", "mutex", "timeout", "inherit" };
+
+	int n = snprintf(ts->line, sizeof(ts->line),
+		"%s{\"name\":\"%s\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":0,\"tid\":%u",
+		sep, names[r->event], (unsigned long) r->ts, ts->core[ts->pos]);
+
+	switch(r->event) {
+		case TRACE_SWITCH:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n,
+				",\"args\":{\"prev\":\"%p\",\"next\":\"%p\",\"cause\":\"%s\"}}",
+				r->a, r->b, trace_cause_name(r->arg));
+			break;
+		case TRACE_WAKEUP:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n,
+				",\"args\":{\"thread\":\"%p\",\"priority\":%d}}", r->a, r->arg);
+			break;
+		case TRACE_MUTEX:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n,
+				",\"args\":{\"mutex\":\"%p\",\"owner\":\"%p\"}}", r->a, r->b);
+			break;
+		case TRACE_TIMEOUT:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n,
+				",\"args\":{\"thread\":\"%p\"}}", r->a);
+			break;
+		case TRACE_INHERIT:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n,
+				",\"args\":{\"thread\":\"%p\",\"lock\":\"%p\",\"priority\":%d}}", r->a, r->b, r->arg);
+			break;
+		default:
+			n += snprintf(ts->line+n, sizeof(ts->line)-n, "}");
+	}
+
+	ts->len = n;
+	ts->pos++;
+}
+
+
+static int trace_read(void* obj, char* buf, unsigned int size)
+{
+	trace_stream* ts = obj;
+	unsigned int count = 0;
+
+	while(count < size) {
+		if(ts->off == ts->len) {
+			if(ts->done) break;
+			trace_format(ts);
+		}
+		unsigned int n = ts->len - ts->off;
+		if(n > size - count) n = size - count;
+		memcpy(buf+count, ts->line+ts->off, n);
+		ts->off += n;
+		count += n;
+	}
+	return count;
+}
+
+
+static int trace_close(void* obj)
+{
+	trace_stream* ts = obj;
+	free(ts->rec);
+	free(ts->core);
+	free(ts);
+	return 0;
+}
+
+
+file_ops trace_fops = {
+	.Open = trace_open,
+	.Read = trace_read,
+	.Write = NULL,
+	.Close = trace_close
+};
+
+
+#else
+
+void initialize_trace() { }
+
+/* There are no trace devices to open */
+file_ops trace_fops = { .Open = NULL };
+
+#endif
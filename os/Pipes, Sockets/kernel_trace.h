@@ -0,0 +1,69 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+#include "kernel_dev.h"
+
+/**
+	@file kernel_trace.h
+	@brief Tracing of scheduler events.
+
+	@defgroup trace Scheduler tracing
+	@ingroup kernel
+	@brief Tracing of scheduler events.
+
+	When the kernel is built with @c SCHED_TRACE defined (e.g., by
+	<tt>make SCHED_TRACE=1</tt>), the scheduler records timestamped events
+	into a ring of @c TRACE_RING_SIZE records per core. Each core only
+	writes to its own ring, with preemption off, so recording takes no
+	locks. When a ring is full, the oldest records are overwritten.
+
+	The rings are read through the @c DEV_TRACE device. Opening it takes
+	a snapshot of all the rings, which reads as a JSON array of events in
+	the Chrome trace format (the @c chrome://tracing and Perfetto viewers
+	load it as is). Each core is shown as a thread of pid 0.
+
+	Without @c SCHED_TRACE, @c sched_trace() compiles to nothing, and there
+	are no @c DEV_TRACE devices to open.
+
+	@{
+*/
+
+/** @brief The traced events */
+typedef enum {
+	TRACE_SWITCH,   /**< A core switched threads: @c a is the previous, @c b the next, @c arg the cause */
+	TRACE_WAKEUP,   /**< A thread @c a was made ready, with priority @c arg */
+	TRACE_BOOST,    /**< The queues of the core were boosted */
+	TRACE_MUTEX,    /**< A thread parked on mutex @c a, owned by thread @c b */
+	TRACE_TIMEOUT,  /**< The timeout of a sleeping thread @c a expired */
+	TRACE_INHERIT   /**< Thread @c a, holding lock @c b, was lent priority @c arg */
+} trace_event;
+
+/** @brief The records kept for each core */
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096
+#endif
+
+#ifdef SCHED_TRACE
+
+/** @brief Non-zero if the kernel records traces */
+#define SCHED_TRACE_ENABLED 1
+
+/** @brief Record an event into the ring of the current core. */
+void sched_trace(trace_event event, int arg, void* a, void* b);
+
+#else
+
+#define SCHED_TRACE_ENABLED 0
+#define sched_trace(event, arg, a, b) ((void)0)
+
+#endif
+
+/** @brief Clear the rings. This is called at kernel startup. */
+void initialize_trace();
+
+/** @brief The operations of the @c DEV_TRACE device. */
+extern file_ops trace_fops;
+
+/** @} */
+
+#endif
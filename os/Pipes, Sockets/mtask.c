@@ -1,6 +1,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
@@ -57,12 +58,14 @@ int boot_symposium(int argl, void* args)
 
 void usage(const char* pname)
 {
-  printf("usage:\n  %s <ncores> <nterm> <philosophers> <bites>\n\n  \
+  printf("usage:\n  %s [--quiet] [--stats] <ncores> <nterm> <philosophers> <bites>\n\n  \
     where:\n\
     <ncores> is the number of cpu cores to use,\n\
     <nterm> is the number of terminals to use,\n\
     <philosiphers> is from 1 to %d\n\
-    <bites> is the number of times each philisopher eats.\n",
+    <bites> is the number of times each philisopher eats.\n\
+    --quiet does not print the state of the table at every event,\n\
+    --stats prints the throughput, the hungry waits and the core utilization.\n",
 	 pname, MAX_PROC);
   exit(1);
 }
@@ -76,8 +79,18 @@ int main(int argc, const char** argv)
 {
   unsigned int ncores, nterm;
   int nphil, bites;
+  int flags = 0;
+  const char* pname = argv[0];
+
+  /* options come first */
+  while(argc>1 && strncmp(argv[1], "--", 2)==0) {
+    if(strcmp(argv[1], "--quiet")==0) flags |= SYMPOSIUM_QUIET;
+    else if(strcmp(argv[1], "--stats")==0) flags |= SYMPOSIUM_STATS;
+    else usage(pname);
+    argc--; argv++;
+  }
 
-  if(argc!=5) usage(argv[0]); 
+  if(argc!=5) usage(pname); 
   ncores = atoi(argv[1]);
   nterm = atoi(argv[2]);
   nphil = atoi(argv[3]);
@@ -85,14 +98,15 @@ int main(int argc, const char** argv)
 
   /* check arguments */
 
-  if( (nphil <= 0) || (nphil > MAX_PROC) ) usage(argv[0]); 
-  if( (bites <= 0) ) usage(argv[0]); 
+  if( (nphil <= 0) || (nphil > MAX_PROC) ) usage(pname); 
+  if( (bites <= 0) ) usage(pname); 
 
   /* adjust work per fibo call (to adapt to many philosophers/bites) */
   symposium_t symp;
   symp.N = nphil;
   symp.bites = bites;
   adjust_symposium(&symp, 0, 0);
+  symp.flags = flags;
   printf("FMIN = %d    FMAX = %d\n",symp.fmin,symp.fmax);
 
   /* boot TinyOS */
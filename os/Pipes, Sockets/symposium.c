@@ -21,6 +21,7 @@ void adjust_symposium(symposium_t* symp, int dBASE, int dGAP)
 	symp->fmin = FBASE + dBASE - 
 		(int)( log((double)(2*symp->N*symp->bites))/log(.5+.5*sqrt(5.)));
 	symp->fmax = symp->fmin + FGAP +dGAP;
+	symp->flags = 0;
 }
 
 
@@ -29,7 +30,17 @@ void adjust_symposium(symposium_t* symp, int dBASE, int dGAP)
   to "burn" CPU cycles. The complexity of the routine is exponential in n.
 */
 
-int fiborand(int fmin, int fmax) { return lrand48() % (fmax-fmin+1) + fmin; }
+/* Each philosopher draws from its own xorshift generator, lrand48() takes a global lock */
+static unsigned int symp_rand(unsigned int* seed)
+{
+  unsigned int x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *seed = x;
+}
+
+int fiborand(unsigned int* seed, int fmin, int fmax) { return symp_rand(seed) % (fmax-fmin+1) + fmin; }
 unsigned int fibo(unsigned int n) /* Very slow routine */
 {
   if(n<2) return n;
@@ -53,10 +64,13 @@ int RIGHT(int i, int N) { return (i+N-1) % N; }
 
 /* Prints the current state given a change (described by fmt) for
  philosopher ph */
-void print_state(int N, PHIL* state, const char* fmt, int ph)
+void print_state(SymposiumTable* S, const char* fmt, int ph)
 {
 #if QUIET==0
+  int N = S->symp->N;
+  PHIL* state = S->state;
   int i;
+  if(S->symp->flags & SYMPOSIUM_QUIET) return;
   if(N<100) {
     for(i=0;i<N;i++) {
       char c= (".THE")[state[i]];
@@ -69,8 +83,24 @@ void print_state(int N, PHIL* state, const char* fmt, int ph)
 }
 
 /* Functions think and eat (just burn CPU cycles). */
-void think(int fmin, int fmax) { fibo(fiborand(fmin, fmax)); }
-void eat(int fmin, int fmax)  { think(fmin, fmax); }
+void think(unsigned int* seed, int fmin, int fmax) { fibo(fiborand(seed, fmin, fmax)); }
+void eat(unsigned int* seed, int fmin, int fmax)  { think(seed, fmin, fmax); }
+
+
+/* Count a bite of philosopher i, who was hungry since hungry_since[i] */
+static void count_bite(SymposiumTable* S, int i)
+{
+  symposium_stats* st = & S->stats;
+  unsigned long w = bios_clock() - S->hungry_since[i];
+  st->bites++;
+  st->waits++;
+  st->wait_total += w;
+  if(w > st->wait_max) st->wait_max = w;
+
+  int b = 0;
+  while(b < SYMPOSIUM_WAIT_BUCKETS-1 && (1ul << b) <= w) b++;
+  st->wait_hist[b]++;
+}
 
 /* Attempt to make a (hungry) philosopher i to start eating */
 void trytoeat(SymposiumTable* S, int i)
@@ -80,7 +110,8 @@ void trytoeat(SymposiumTable* S, int i)
 
   if(state[i]==HUNGRY && state[LEFT(i,N)]!=EATING && state[RIGHT(i,N)]!=EATING) {
     state[i] = EATING;
-    print_state(N, state, "     %d is eating\n",i);
+    count_bite(S, i);
+    print_state(S, "     %d is eating\n",i);
     Cond_Signal(&(S->hungry[i]));
   }
 }
@@ -94,30 +125,32 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
   int fmin = S->symp->fmin;
   int fmax = S->symp->fmax;
   PHIL* state = S->state;
+  unsigned int seed = 2654435761u * (i+1);
 
   Mutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
   state[i] = THINKING;
-  print_state(N, state, "     %d has arrived\n",i);
+  print_state(S, "     %d has arrived\n",i);
   Mutex_Unlock(& S->mx);
 
   for(int j=0; j<bites; j++) {	/* Number of bites (mpoykies) */
-    think(fmin, fmax);
+    think(&seed, fmin, fmax);
 
     Mutex_Lock(& S->mx);
     state[i] = HUNGRY;
+    S->hungry_since[i] = bios_clock();
     trytoeat(S,i);		/* This may not succeed */
     while(state[i]==HUNGRY) {
-      print_state(N, state, "     %d waits hungry\n",i);
+      print_state(S, "     %d waits hungry\n",i);
       Cond_Wait(& S->mx, &(S->hungry[i])); /* If hungry we sleep. trytoeat(i) will wake us. */
     }
     assert(state[i]==EATING); 
     Mutex_Unlock(& S->mx);
     
-    eat(fmin, fmax);
+    eat(&seed, fmin, fmax);
 
     Mutex_Lock(& S->mx);
     state[i] = THINKING;	/* We are done eating, think again */
-    print_state(N, state, "     %d is thinking\n",i);
+    print_state(S, "     %d is thinking\n",i);
     trytoeat(S, LEFT(i,N));		/* Check if our left and right can eat NOW. */
     trytoeat(S, RIGHT(i,N));
     Mutex_Unlock(& S->mx);
@@ -125,7 +158,7 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 
   Mutex_Lock(& S->mx);
   state[i] = NOTHERE;		/* We are done (eaten all the bites) */
-  print_state(N, state, "     %d is leaving\n",i);
+  print_state(S, "     %d is leaving\n",i);
   Mutex_Unlock(& S->mx);
 }
 
@@ -137,16 +170,69 @@ void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 	table->mx = MUTEX_INIT;
 	table->state = (PHIL*) xmalloc(symp->N * sizeof(PHIL));
 	table->hungry = (CondVar*) xmalloc(symp->N * sizeof(CondVar));
+	table->hungry_since = (unsigned long*) xmalloc(symp->N * sizeof(unsigned long));
 	for(int i=0; i<symp->N; i++) {
 		table->state[i] = NOTHERE;
 		table->hungry[i] = COND_INIT;
 	}
+	memset(& table->stats, 0, sizeof(symposium_stats));
 }
 
 void SymposiumTable_destroy(SymposiumTable* table)
 {
 	free(table->state);
 	free(table->hungry);
+	free(table->hungry_since);
+}
+
+
+/* Return the upper bound of the bucket holding the p-th percentile of the waits */
+static unsigned long wait_percentile(symposium_stats* st, double p)
+{
+	unsigned long rank = (unsigned long)(p/100.0 * st->waits);
+	unsigned long seen = 0;
+	int b;
+	for(b=0; b<SYMPOSIUM_WAIT_BUCKETS-1; b++) {
+		seen += st->wait_hist[b];
+		if(seen > rank) break;
+	}
+	unsigned long bound = 1ul << b;
+	return bound < st->wait_max ? bound : st->wait_max;
+}
+
+
+/* The time and core counters at the start of a symposium */
+typedef struct {
+	TimerDuration start;
+	unsigned int ncores;
+	core_stats core[MAX_CORES];
+} symposium_clock;
+
+static void symposium_start(symposium_clock* clk)
+{
+	clk->ncores = GetCoreStats(clk->core, MAX_CORES);
+	clk->start = bios_clock();
+}
+
+/* Print the report of SYMPOSIUM_STATS */
+static void symposium_report(SymposiumTable* S, symposium_clock* clk)
+{
+	TimerDuration elapsed = bios_clock() - clk->start;
+	core_stats core[MAX_CORES];
+	GetCoreStats(core, clk->ncores);
+
+	symposium_stats* st = & S->stats;
+	double secs = elapsed / 1E6;
+	printf("*** Symposium of %d philosophers, %d bites each\n", S->symp->N, S->symp->bites);
+	printf("  bites:   %lu in %.3f sec, %.1f bites/sec\n", st->bites, secs, st->bites / secs);
+	printf("  hungry:  mean %.1f usec, p50 <= %lu usec, p90 <= %lu usec, p99 <= %lu usec, max %lu usec\n",
+		st->waits ? (double)st->wait_total / st->waits : 0.0,
+		wait_percentile(st, 50), wait_percentile(st, 90), wait_percentile(st, 99), st->wait_max);
+	for(unsigned int c=0; c<clk->ncores; c++) {
+		unsigned long busy = core[c].busy_time - clk->core[c].busy_time;
+		printf("  core %u:  %5.1f%% busy, %lu switches\n", c, 
+			elapsed ? 100.0 * busy / elapsed : 0.0, core[c].switches - clk->core[c].switches);
+	}
 }
 
 
@@ -175,6 +261,8 @@ int SymposiumOfProcesses(int argl, void* args)
   /* Initialize structures */
   SymposiumTable S;
   SymposiumTable_init(&S, symp);
+  symposium_clock clk;
+  symposium_start(&clk);
   
   /* Execute philosophers */
   for(int i=0;i<N;i++) {
@@ -185,10 +273,10 @@ int SymposiumOfProcesses(int argl, void* args)
   }  
 
   /* Wait for philosophers to exit */  
-  for(int i=0;i<N;i++) {
-    WaitChild(NOPROC, NULL);
-  }
+  while(WaitChildren(NULL, NULL, N) > 0);
 
+  if(symp->flags & SYMPOSIUM_STATS)
+    symposium_report(&S, &clk);
   SymposiumTable_destroy(&S);
   return 0;
 }
@@ -213,6 +301,8 @@ int SymposiumOfThreads(int argl, void* args)
 	/* Initialize structures */
 	SymposiumTable S;
 	SymposiumTable_init(&S, symp);
+	symposium_clock clk;
+	symposium_start(&clk);
 
 	/* Execute philosophers */
 	Tid_t thread[symp->N];
@@ -224,6 +314,8 @@ int SymposiumOfThreads(int argl, void* args)
 		ThreadJoin(thread[i],NULL);
 	}
 
+	if(symp->flags & SYMPOSIUM_STATS)
+		symposium_report(&S, &clk);
 	SymposiumTable_destroy(&S);
 
 	return 0;
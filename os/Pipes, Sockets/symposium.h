@@ -48,6 +48,12 @@
 	The constants \f$F_\text{BASE}\f$ and \f$F_\text{GAP}\f$ are defined in the source
 	code. 
 
+	A symposium can also be used as a load test of the scheduler. With
+	@c SYMPOSIUM_QUIET, the state of the table is not printed at every event,
+	and with @c SYMPOSIUM_STATS, a report is printed at the end, with the
+	bites per second, the distribution of the time that philosophers wait 
+	hungry, and the utilization of each core.
+
 	@see FBASE
 	@see FGAP
 */
@@ -75,14 +81,21 @@ extern unsigned int fibo(unsigned int n);
 typedef enum { NOTHERE=0, THINKING, HUNGRY, EATING } PHIL;
 
 
+/** @brief Do not print the state of the table at every event */
+#define SYMPOSIUM_QUIET 1
+
+/** @brief Print statistics at the end of the symposium */
+#define SYMPOSIUM_STATS 2
+
 /** @brief A symposium definition.
 
-	The four numbers defining a symposium.
+	The four numbers defining a symposium, and the flags of the run.
 */
 typedef struct {
 	int N;				/**< Number of philosophers */
 	int bites;			/**< Number of bites each philosopher takes. */
 	int fmin, fmax;		/**< Values used by the Fibbonacci routines */
+	int flags;			/**< @c SYMPOSIUM_QUIET and/or @c SYMPOSIUM_STATS */
 } symposium_t;
 
 
@@ -94,7 +107,7 @@ typedef struct {
 	and 
 	\f[  F_\text{GAP} = \text{FGAP}+\text{dGAP}.  \f]
 	
-	The computed values are stored in @c table.
+	The computed values are stored in @c table, and its flags are cleared.
 
 	@param table the symposium table whose \f$f\f$-values are computed.
 	@param dBASE added to @ref FBASE 
@@ -105,6 +118,18 @@ typedef struct {
 void adjust_symposium(symposium_t* table, int dBASE, int dGAP);
 
 
+/** @brief The buckets of the histogram of hungry waits, by powers of 2 in usec */
+#define SYMPOSIUM_WAIT_BUCKETS 32
+
+/** @brief The statistics of a symposium, gathered in the monitor. */
+typedef struct {
+	unsigned long bites;							/**< Bites eaten */
+	unsigned long waits;							/**< Times a philosopher got hungry */
+	unsigned long wait_total;						/**< Total time waited hungry, in usec */
+	unsigned long wait_max;							/**< Longest time waited hungry, in usec */
+	unsigned long wait_hist[SYMPOSIUM_WAIT_BUCKETS];	/**< Bucket @c b counts waits less than 2^b usec */
+} symposium_stats;
+
 /** @brief A symposium monitor.
 
 	Such an object must be shared between all philosopher
@@ -115,6 +140,8 @@ typedef struct {
 	symposium_t* symp; 	/**< The symposium definition */
 	PHIL* state;		/**< state[i] i=1...N]: Philosopher state */
 	CondVar* hungry;    /**< hungry[i] i=...N: condition var for philosophers */
+	unsigned long* hungry_since;	/**< hungry_since[i]: the time philosopher i got hungry */
+	symposium_stats stats;			/**< The statistics of the symposium */
 } SymposiumTable;
 
 
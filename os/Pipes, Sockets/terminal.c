@@ -8,6 +8,8 @@
 #include <assert.h>
 #include <error.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 /* 
 	Tests that there is still input to the terminal. 
@@ -19,53 +21,130 @@ int INPUT_OPEN=1;
 
 int confd, kbdfd;  /* The pipe file descriptors */
 
-/* Polling array */
+/* Polling array: stdin, stdout, the keyboard and the console FIFOs */
 struct pollfd fds[4] = {
-	{ 0, POLLIN, 0 },
-	{ 1, POLLOUT, 0 },
-	{ 0, POLLOUT, 0 },
-	{ 0, POLLIN, 0 },
+	{ 0, 0, 0 },
+	{ 1, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
 };
 
-/* some operations on the polling  array */
-
-/* Flip/negate fd field; poll ignores negative fds */
-#define flip(i) (fds[i].fd = - fds[i].fd - 1)
-#define ready(i)  (fds[i].revents & fds[i].events)
 #define err(i)  (fds[i].revents & (POLLERR|POLLHUP))
-#define polled(i)  (fds[i].fd>=0)
 
-int state[4];  /* Last poll result */
-int errst[4];  /* Whether error was detected */
 
-/* Mnemonic macros */
-#define IN state[0]
-#define OUT state[1]
-#define KBD state[2]
-#define CON state[3]
+/*
+	A bridge moves the bytes of one direction, from stdin to the keyboard
+	FIFO, or from the console FIFO to stdout. The bytes are moved in bulk:
+	by splice(2), when the kernel can splice the two files (one of them is
+	a FIFO), else by read/write through a buffer.
+*/
+#define BRIDGE_BUFFER PIPE_BUF
+
+/* The most bytes spliced at a time */
+#define SPLICE_CHUNK (64*1024)
+
+typedef struct bridge {
+	const char* name;
+	int from, to;             /* indices of the source and the destination in fds */
+	int splice;               /* splice(2) works for the two files */
+	int stalled;              /* the destination was full for a splice */
+	char buf[BRIDGE_BUFFER];
+	size_t pos, len;          /* buf[pos..len) is not written yet */
+	unsigned long long bytes; /* moved since the VM connected */
+} bridge;
+
+bridge KBD = { .name = "kbd", .from = 0, .to = 2 };
+bridge CON = { .name = "con", .from = 3, .to = 1 };
+
+/* The bridge waits for room at the destination */
+#define blocked(b) ((b)->stalled || (b)->pos < (b)->len)
+
+/* The time the VM connected, in usec */
+unsigned long long connect_time;
+
+unsigned long long now_usec()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000000ull + t.tv_nsec/1000;
+}
+
+/* Ask poll for what the bridge waits for: bytes at the source, or room at the destination */
+void bridge_poll(bridge* b)
+{
+	fds[b->from].events = blocked(b) ? 0 : POLLIN;
+	fds[b->to].events = blocked(b) ? POLLOUT : 0;
+}
+
+/* Write out the buffered bytes. Return the bytes written. */
+ssize_t bridge_write(bridge* b)
+{
+	ssize_t rc;
+	while((rc = write(fds[b->to].fd, b->buf+b->pos, b->len-b->pos))==-1 && errno==EINTR);
+	if(rc <= 0) return 0;
+	b->pos += rc;
+	b->bytes += rc;
+	return rc;
+}
+
+/* Move bytes from the source. Return the bytes taken, 0 at end of file, or -1. */
+ssize_t bridge_read(bridge* b)
+{
+	ssize_t rc;
+	int fromfd = fds[b->from].fd, tofd = fds[b->to].fd;
+
+	if(b->splice) {
+		while((rc = splice(fromfd, NULL, tofd, NULL, SPLICE_CHUNK, 
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK))==-1 && errno==EINTR);
+		if(rc > 0) b->bytes += rc;
+		if(rc==-1 && errno==EAGAIN) b->stalled = 1;
+		if(rc >= 0 || (errno != EINVAL && errno != ENOSYS)) return rc;
+		/* These files cannot be spliced, use the buffer from now on */
+		b->splice = 0;
+	}
 
-#define INERR errst[0]
-#define OUTERR errst[1]
-#define KBDERR errst[2]
-#define CONERR errst[3]
+	while((rc = read(fromfd, b->buf, BRIDGE_BUFFER))==-1 && errno==EINTR);
+	if(rc > 0) {
+		b->pos = 0;
+		b->len = rc;
+		bridge_write(b);
+	}
+	return rc;
+}
 
-/* Helper */
-void transfer_byte(int from, int to, int fromfd, int tofd)
+/* Move the bytes that can be moved now. Return 1 if some were moved. */
+int bridge_transfer(bridge* b)
 {
-	int rc;
-	char buf;
-	rc=read(fromfd, &buf, 1);
-	if(rc==1) rc=write(tofd, &buf, 1);
+	if(blocked(b)) {
+		if(! (fds[b->to].revents & POLLOUT)) return 0;
+		if(! b->stalled) return bridge_write(b) > 0;
+		b->stalled = 0;
+	}
+	else if(! (fds[b->from].revents & (POLLIN|POLLHUP)))
+		return 0;
+
+	ssize_t rc = bridge_read(b);
+	if(rc==0 && b == &KBD && ! isatty(0)) {
+		/* Stdin is over for good, stop polling it */
+		fds[0].fd = -1;
 #if EXIT_ON_STDIN_CLOSE
-	if(rc==0) { 
-		assert(fromfd==0); 
-		if(! isatty(0)) { 
-			INPUT_OPEN=0; close(0); 
-		}
-		fprintf(stderr, "Stdin closed\n"); 
+		INPUT_OPEN=0; close(0); 
+#endif
 	}
+#if EXIT_ON_STDIN_CLOSE
+	if(rc==0 && b == &KBD) fprintf(stderr, "Stdin closed\n"); 
 #endif
-	flip(from); flip(to);  /* They are not ready any more */	
+	return rc > 0;
+}
+
+/* Report the bytes moved each way, and their rate */
+void bridge_report()
+{
+	double secs = (now_usec() - connect_time) / 1e6;
+	if(secs <= 0) secs = 1e-6;
+	fprintf(stderr, "%s: %llu bytes (%.1f KB/s), %s: %llu bytes (%.1f KB/s)\n",
+		KBD.name, KBD.bytes, KBD.bytes/secs/1024, 
+		CON.name, CON.bytes, CON.bytes/secs/1024);
 }
 
 /* Loop transferring bytes between the streams */
@@ -75,32 +154,37 @@ void io_loop()
 	fds[2].fd = kbdfd;
 	fds[3].fd = confd;
 
+	/* A full FIFO must not block the other direction */
+	fcntl(kbdfd, F_SETFL, fcntl(kbdfd, F_GETFL) | O_NONBLOCK);
+	fcntl(confd, F_SETFL, fcntl(confd, F_GETFL) | O_NONBLOCK);
+
+	KBD.splice = CON.splice = 1;
+	KBD.stalled = CON.stalled = 0;
+	KBD.pos = KBD.len = CON.pos = CON.len = 0;
+	KBD.bytes = CON.bytes = 0;
+	connect_time = now_usec();
+
 	while(1) {
-		/* Poll the files */
+		/* Poll the files. Errors are reported even for no events. */
+		bridge_poll(&KBD);
+		bridge_poll(&CON);
 		poll(fds, 4, -1);
 
-		/* Update indicators */
-		for(int i=0; i<4; i++) {
-			if(polled(i)) { 
-				state[i]=ready(i);  
-				if(state[i]) flip(i);  /* Flip ready files */
-				errst[i]=err(i); 
-			}
-		}
-		if(errst[0]) fprintf(stderr,"Error in 0\n");
-		if(errst[1]) fprintf(stderr,"Error in 1\n");
+		if(fds[0].revents & POLLERR) fprintf(stderr,"Error in 0\n");
+		if(fds[1].revents & POLLERR) fprintf(stderr,"Error in 1\n");
 
-		int XKBD = IN && KBD;
-		int XCON = OUT && CON;
+		/* Do ready transfers */
+		int moved = bridge_transfer(&KBD);
+		moved |= bridge_transfer(&CON);
 
 		/* Break if we have no transfers and some error */
-		if(!XKBD && !XCON && (KBDERR||CONERR)) break;
-
-		/* Do ready transfers */
-		if( XKBD ) transfer_byte(0, 2, 0, kbdfd);
-		if( XCON ) transfer_byte(3, 1, confd, 1);
+		if(!moved && (err(2) || err(3))) break;
 	}
 
+	/* What the VM wrote last still goes out */
+	while(CON.pos < CON.len && bridge_write(&CON) > 0);
+	if(KBD.bytes || CON.bytes) bridge_report();
+
 	close(confd);
 	close(kbdfd);
 }
@@ -4,7 +4,10 @@
 #include <string.h>
 #include <time.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
 #include "util.h"
+#include "bios.h"
 
 #include "unit_testing.h"
 
@@ -131,6 +134,7 @@ BARE_TEST(test_list_queue,
 		I++;
 	}
 
+	ASSERT(I==n+10);
 	ASSERT(is_rlist_empty(&L));
 
 	I = rlist_pop_back(&L);   /* The list is empty, but the pop_back method does not mind! */
@@ -266,6 +270,244 @@ TEST_SUITE(rlist_tests,
 
 
 
+/* Unit tests for the indexed containers */
+
+static int heap_less(rhnode* a, rhnode* b) { return a->num < b->num; }
+
+BARE_TEST(test_heap_order,
+	"Test that a heap pops its nodes in order, after random insertions and removals"
+	)
+{
+	enum { N = 1000 };
+	static rhnode nodes[N];
+	rheap H;
+	rheap_init(&H, heap_less);
+	ASSERT(is_rheap_empty(&H));
+	ASSERT(rheap_pop(&H) == NULL);
+
+	srand(3);
+	for(int i=0; i<N; i++) {
+		rhnode_init(nodes+i, NULL)->num = rand() % 100;
+		ASSERT(! rhnode_linked(nodes+i));
+		rheap_insert(&H, nodes+i);
+		ASSERT(rhnode_linked(nodes+i));
+	}
+	ASSERT(H.size == N);
+
+	/* Remove every third node, including some minimums */
+	for(int i=0; i<N; i+=3) {
+		rheap_remove(&H, nodes+i);
+		ASSERT(! rhnode_linked(nodes+i));
+	}
+	rheap_remove(&H, rheap_min(&H));
+	size_t left = H.size;
+
+	intptr_t last = -1;
+	size_t count = 0;
+	rhnode* n;
+	while((n = rheap_pop(&H)) != NULL) {
+		ASSERT(n->num >= last);
+		ASSERT(! rhnode_linked(n));
+		last = n->num;
+		count++;
+	}
+	ASSERT(count == left);
+	ASSERT(is_rheap_empty(&H) && H.size == 0);
+}
+
+
+BARE_TEST(test_hash_map,
+	"Test a hash map against a direct table, with insertions, removals and rehashing"
+	)
+{
+	enum { K = 512 };
+	static int present[K];
+	static rhash_slot small[256], large[1024];
+	rhash M;
+	rhash_init(&M, small, 256);
+	memset(present, 0, sizeof(present));
+
+	/* The keys are aligned addresses, i.e., multiples of 64 */
+	srand(5);
+	for(int round=0; round<20000; round++) {
+		int k = rand() % K;
+		uintptr_t key = 64*(k+1);
+		if(present[k]) {
+			rhash_slot* s = rhash_find(&M, key);
+			ASSERT(s != NULL && s->num == k);
+			ASSERT(rhash_remove(&M, key) == 0);
+			ASSERT(rhash_find(&M, key) == NULL);
+			present[k] = 0;
+		} else {
+			ASSERT(rhash_find(&M, key) == NULL);
+			rhash_slot* s = rhash_insert(&M, key);
+			if(s == NULL) {
+				/* Too full, move to a larger table */
+				ASSERT(M.slot == small && 4*(M.size+1) > 3*256);
+				ASSERT(rhash_rehash(&M, large, 1024) == small);
+				s = rhash_insert(&M, key);
+			}
+			ASSERT(s != NULL && s->unum == 0);
+			s->num = k;
+			ASSERT(rhash_insert(&M, key) == s);
+			present[k] = 1;
+		}
+	}
+
+	size_t count = 0;
+	for(int k=0; k<K; k++) {
+		rhash_slot* s = rhash_find(&M, 64*(k+1));
+		ASSERT((s != NULL) == present[k]);
+		count += present[k];
+	}
+	ASSERT(count == M.size);
+	ASSERT(rhash_remove(&M, 64*(K+1)) == -1);
+}
+
+
+BARE_TEST(test_bitmap_alloc,
+	"Test the bitmap allocator"
+	)
+{
+	enum { N = 200 };
+	uint64_t bm[BITMAP_WORDS(N)];
+	memset(bm, 0, sizeof(bm));
+
+	ASSERT(bitmap_next_set(bm, N, 0) == -1);
+	for(int i=0; i<N; i++)
+		ASSERT(bitmap_alloc(bm, N) == i);
+	ASSERT(bitmap_alloc(bm, N) == -1);
+	ASSERT(bitmap_next_clear(bm, N, 0) == -1);
+
+	bitmap_clear(bm, 130);
+	bitmap_clear(bm, 63);
+	ASSERT(! bitmap_test(bm, 63) && bitmap_test(bm, 64));
+	ASSERT(bitmap_next_clear(bm, N, 0) == 63);
+	ASSERT(bitmap_next_clear(bm, N, 64) == 130);
+	ASSERT(bitmap_alloc(bm, N) == 63);
+	ASSERT(bitmap_alloc(bm, N) == 130);
+
+	memset(bm, 0, sizeof(bm));
+	bitmap_set(bm, 5);
+	bitmap_set(bm, 199);
+	ASSERT(bitmap_next_set(bm, N, 0) == 5);
+	ASSERT(bitmap_next_set(bm, N, 5) == 5);
+	ASSERT(bitmap_next_set(bm, N, 6) == 199);
+	ASSERT(bitmap_next_set(bm, N, 200) == -1);
+
+	/* Bits past n are never returned */
+	bm[BITMAP_WORDS(N)-1] |= ~0ull << (N % 64);
+	ASSERT(bitmap_next_set(bm, N, 6) == 199);
+	bitmap_clear(bm, 199);
+	ASSERT(bitmap_next_set(bm, N, 6) == -1);
+}
+
+
+enum { RING_PRODUCERS = 4, RING_ITEMS = 100000 };
+static mpsc_ring test_ring;
+
+static void* ring_producer(void* arg)
+{
+	uintptr_t p = (uintptr_t) arg;
+	for(uintptr_t i=0; i<RING_ITEMS; i++)
+		while(mpsc_push(&test_ring, (void*)(p*RING_ITEMS + i)) != 0)
+			sched_yield();
+	return NULL;
+}
+
+BARE_TEST(test_mpsc_ring,
+	"Test a bounded MPSC ring, alone and with concurrent producers"
+	)
+{
+	static mpsc_slot slots[64];
+	void* obj = NULL;
+
+	mpsc_init(&test_ring, slots, 64);
+	ASSERT(mpsc_pop(&test_ring, &obj) == -1);
+	for(uintptr_t i=0; i<64; i++)
+		ASSERT(mpsc_push(&test_ring, (void*) i) == 0);
+	ASSERT(mpsc_push(&test_ring, NULL) == -1);
+	for(uintptr_t i=0; i<64; i++) {
+		ASSERT(mpsc_pop(&test_ring, &obj) == 0);
+		ASSERT(obj == (void*) i);
+	}
+	ASSERT(mpsc_pop(&test_ring, &obj) == -1);
+
+	/* Each producer's values must arrive in order, and none are lost */
+	pthread_t prod[RING_PRODUCERS];
+	uintptr_t next[RING_PRODUCERS] = { 0 };
+	for(uintptr_t p=0; p<RING_PRODUCERS; p++)
+		ASSERT(pthread_create(prod+p, NULL, ring_producer, (void*) p) == 0);
+
+	for(unsigned long n=0; n < RING_PRODUCERS*RING_ITEMS; ) {
+		if(mpsc_pop(&test_ring, &obj) != 0) { sched_yield(); continue; }
+		uintptr_t p = (uintptr_t) obj / RING_ITEMS;
+		ASSERT(p < RING_PRODUCERS);
+		ASSERT((uintptr_t) obj % RING_ITEMS == next[p]);
+		next[p]++;
+		n++;
+	}
+	for(int p=0; p<RING_PRODUCERS; p++)
+		pthread_join(prod[p], NULL);
+	ASSERT(mpsc_pop(&test_ring, &obj) == -1);
+}
+
+
+TEST_SUITE(container_tests,
+	"Tests for the heaps, hash maps, bitmaps and rings")
+{
+	&test_heap_order,
+	&test_hash_map,
+	&test_bitmap_alloc,
+	&test_mpsc_ring,
+	NULL
+};
+
+
+/* Unit tests for the CPU affinity of the bios */
+
+static int boot_cpu[MAX_CORES];
+
+static void record_cpu()
+{
+	boot_cpu[cpu_core_id] = sched_getcpu();
+}
+
+BARE_TEST(test_cpu_affinity,
+	"Test that the core threads are pinned to the configured host CPUs"
+	)
+{
+	cpu_set_t allowed;
+	ASSERT(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+	int first = 0;
+	while(! CPU_ISSET(first, &allowed)) first++;
+
+	ASSERT(vm_config_affinity("1-", -1) == -1);
+	ASSERT(vm_config_affinity("3-1", -1) == -1);
+	ASSERT(vm_config_affinity("x", -1) == -1);
+	ASSERT(vm_config_affinity(NULL, CPU_SETSIZE) == -1);
+	ASSERT(vm_config_affinity(NULL, -1) == 0);
+	ASSERT(bios_core_cpu(0) == -1);
+
+	char list[16];
+	snprintf(list, sizeof(list), "%d", first);
+	ASSERT(vm_config_affinity(list, first) == 0);
+	for(uint c=0; c<MAX_CORES; c++)
+		ASSERT(bios_core_cpu(c) == first);
+
+	vm_boot(record_cpu, 3, 0);
+	for(uint c=0; c<3; c++)
+		ASSERT(boot_cpu[c] == first);
+
+	/* auto pins each core to some allowed CPU */
+	ASSERT(vm_config_affinity("auto", -1) == 0);
+	for(uint c=0; c<MAX_CORES; c++)
+		ASSERT(CPU_ISSET(bios_core_cpu(c), &allowed));
+	ASSERT(vm_config_affinity(NULL, -1) == 0);
+}
+
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -548,7 +790,9 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&container_tests,
 	&test_pack_unpack,
+	&test_cpu_affinity,
 	&exception_tests,	
 	NULL
 };
@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include "tinyos_config.h"
 
 #include "kernel_dev.h"
 
@@ -41,16 +42,9 @@ typedef unsigned long timeout_t;
 /** @brief The invalid PID */
 #define NOPROC (-1)
 
-/** @brief The maximum number of processes */
-#define MAX_PROC 65536
-
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
-/** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
-#define MAX_FILEID 16
-
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
@@ -74,11 +68,14 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex is a single word. When locked, it holds the identity of its owner,
+    and a flag that shows whether other threads are waiting for it.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -94,7 +91,9 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking thread spins only while the owner
+  of the mutex is running on another core; else, it sleeps until @c Mutex_Unlock 
+  wakes it up, and then tries again to lock the mutex.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -105,7 +104,9 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. The mutex is freed. If there are threads 
+    waiting for it, the one that has been waiting the longest is woken up, and 
+    competes for the mutex with any other thread that tries to lock it.
     @see Mutex
     @see Mutex_Lock
 */
@@ -204,6 +205,127 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A counting semaphore.
+
+  The semaphore is a monitor, built from a mutex and a condition variable.
+  Like them, it can be used in user code and in the kernel.
+
+  @see Sem_Down
+  @see Sem_Up
+  @see SEM_INIT
+ */
+typedef struct {
+  Mutex lock;           /**< Protects @c value */
+  CondVar cv;           /**< Signalled when @c value is raised */
+  int value;            /**< The count */
+} Semaphore;
+
+/** @brief Initializer for a semaphore with count @c n.
+  @code
+  Semaphore sem = SEM_INIT(3);
+  @endcode
+ */
+#define SEM_INIT(n) ((Semaphore){ MUTEX_INIT, COND_INIT, (n) })
+
+/** @brief Decrement the count of a semaphore, sleeping while it is 0. */
+void Sem_Down(Semaphore* sem);
+
+/** @brief Decrement the count of a semaphore, sleeping up to @c timeout msec while it is 0.
+  @returns 1 if the count was decremented, 0 if the timeout expired.
+ */
+int Sem_TimedDown(Semaphore* sem, timeout_t timeout);
+
+/** @brief Increment the count of a semaphore, waking up a sleeper. */
+void Sem_Up(Semaphore* sem);
+
+
+/** @brief A reader-writer lock.
+
+  Many readers or one writer can hold the lock. Writers are preferred: 
+  once a writer waits for the lock, new readers wait until no writers 
+  are left waiting, so that a stream of readers cannot starve writers.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  Mutex lock;           /**< Protects the fields */
+  CondVar readers_cv;   /**< Readers wait here */
+  CondVar writers_cv;   /**< Writers wait here */
+  int readers;          /**< The readers holding the lock */
+  int writer;           /**< 1 if a writer holds the lock */
+  int writers_waiting;  /**< The writers waiting for the lock */
+} RWLock;
+
+/** @brief Initializer for a reader-writer lock.
+  @code
+  RWLock rw = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ MUTEX_INIT, COND_INIT, COND_INIT, 0, 0, 0 })
+
+/** @brief Lock for reading, sleeping while a writer holds or waits for the lock. */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Lock for reading, sleeping up to @c timeout msec.
+  @returns 1 if the lock was taken, 0 if the timeout expired.
+ */
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Release a read lock. */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock for writing, sleeping while readers or a writer hold the lock. */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Lock for writing, sleeping up to @c timeout msec.
+  @returns 1 if the lock was taken, 0 if the timeout expired.
+ */
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Release a write lock. */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
+/** @brief The operations of @c Futex */
+typedef enum futex_op {
+  FUTEX_WAIT,   /**< Sleep while the word holds a value */
+  FUTEX_WAKE    /**< Wake up threads sleeping on the word */
+} futex_op;
+
+/** @brief A timeout for @c Futex meaning "wait for ever" */
+#define FUTEX_INFINITE ((timeout_t)-1)
+
+/** @brief Wait and wake up on an integer word.
+
+  This is the building block for fast synchronization in user code: the
+  uncontended case is handled with atomic operations on the word, and the
+  kernel is called only to sleep and to wake up sleepers.
+
+  - @c FUTEX_WAIT: if @c *addr equals @c val, the thread sleeps until it is
+    woken up by a @c FUTEX_WAKE on @c addr, or until @c timeout msec have 
+    passed. The check and the sleep are atomic with respect to @c FUTEX_WAKE.
+    There can also be spurious wakeups, so callers must check their 
+    condition again.
+  - @c FUTEX_WAKE: up to @c val threads sleeping on @c addr are woken up.
+    The timeout is ignored.
+
+  Sleepers are found by the address of the word, so any word shared by the
+  threads can be used, e.g., in a shared memory region.
+
+  @param addr the word
+  @param op the operation
+  @param val the value expected at @c *addr, or the threads to wake up
+  @param timeout the largest time to sleep in msec, or @c FUTEX_INFINITE
+  @returns for @c FUTEX_WAIT, 0 if the thread was woken up, or -1 if 
+     @c *addr was not @c val, or the timeout expired. For @c FUTEX_WAKE,
+     the number of threads woken up. On a NULL @c addr or an illegal 
+     @c op, -1 is returned.
+  */
+int Futex(int* addr, futex_op op, int val, timeout_t timeout);
+
+
 /*******************************************
  *
  * Process creation
@@ -217,6 +339,12 @@ void Cond_Broadcast(CondVar*);
   */
 typedef int (*Task)(int, void*);
 
+/** @brief The smallest stack size granted by @c ExecStack and @c CreateThreadStack */
+#define THREAD_MIN_STACK_SIZE  (16*1024)
+
+/** @brief The largest stack size granted by @c ExecStack and @c CreateThreadStack */
+#define THREAD_MAX_STACK_SIZE  (64*1024*1024)
+
 
 /** @brief Create a new process.
 
@@ -242,6 +370,138 @@ typedef int (*Task)(int, void*);
   */
 Pid_t Exec(Task task, int argl, void* args);
 
+/** @brief Create a new process, with a given stack size for its main thread.
+
+  This call is like @c Exec, but the stack of the main thread 
+  of the new process is given size @c stack_size, in bytes. This 
+  is a hint: it is rounded up to a multiple of the page size, and is
+  kept between @c THREAD_MIN_STACK_SIZE and @c THREAD_MAX_STACK_SIZE.
+  The pages of such a stack are committed on demand.
+  A value of 0 selects the default stack size.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the requested stack size of the main thread
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+  @see Exec
+  */
+Pid_t ExecStack(Task task, int argl, void* args, unsigned int stack_size);
+
+/** @brief Create a new process, giving it only the streams of a map.
+
+  This call is like @c ExecStack, but the child does not inherit all the
+  open streams of the caller. Instead, fid @c i of the child, for 
+  @c i<nfds, is a copy of the caller's fid @c fdmap[i], or is closed if 
+  @c fdmap[i] is @c NOFILE. All other fids of the child are closed. 
+  Thus, a stream can be moved to a different fid of the child, and 
+  streams left out of the map are closed-on-exec.
+  A NULL @c fdmap (with @c nfds 0) inherits all the streams, as @c ExecStack does.
+
+  For example, the following runs @c task with the read end of a pipe 
+  as its fid 0 and the caller's fid 1 as its fid 1:
+  @code
+  Fid_t fdmap[2] = { pipe.read, 1 };
+  ExecEx(task, 0, NULL, 0, fdmap, 2);
+  @endcode
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the requested stack size of the main thread, or 0
+  @param fdmap the fids of the caller that the child will have
+  @param nfds the length of @c fdmap, at most @c MAX_FILEID
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c nfds is illegal, or @c fdmap contains an fid that is not open.
+  @see ExecStack
+  */
+Pid_t ExecEx(Task task, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds);
+
+/** @brief Arguments of at most this many bytes are kept inside the process
+  table, so that copying them takes no allocation. */
+#define EXEC_INLINE_ARGS 64
+
+/** @brief Create a new process, giving it the argument buffer.
+
+  This call is like @c ExecEx, but @c args is not copied. Instead, the new
+  process takes the buffer, and releases it with @c free when it exits. 
+  Thus, @c args must have been allocated by @c malloc, and the caller must 
+  not use it after the call. On error, the buffer is released at once.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args a buffer from @c malloc, given to the new process, or NULL
+  @param stack_size the requested stack size of the main thread, or 0
+  @param fdmap the fids of the caller that the child will have, or NULL
+  @param nfds the length of @c fdmap, at most @c MAX_FILEID
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned, as for @c ExecEx.
+  @see ExecEx
+  */
+Pid_t ExecGive(Task task, int argl, void* args, unsigned int stack_size, const Fid_t* fdmap, int nfds);
+
+
+/** @brief The kinds of action of @c Spawn on the streams of the child */
+typedef enum {
+  SPAWN_INHERIT,     /**< The child gets all the streams of the caller, at the same fids */
+  SPAWN_DUP,         /**< Fid @c fid of the child is a copy of fid @c src of the caller */
+  SPAWN_MOVE,        /**< As @c SPAWN_DUP, and fid @c src of the caller is closed */
+  SPAWN_CLOSE,       /**< Fid @c fid of the child is closed */
+  SPAWN_PIPE_READ,   /**< Fid @c fid of the child is the read end of a new pipe, the caller gets the write end */
+  SPAWN_PIPE_WRITE   /**< Fid @c fid of the child is the write end of a new pipe, the caller gets the read end */
+} fd_action_op;
+
+/** @brief An action of @c Spawn on the streams of the child */
+typedef struct fd_action {
+  fd_action_op op;   /**< What to do */
+  Fid_t fid;         /**< The fid of the child */
+  Fid_t src;         /**< The fid of the caller to copy or move, or the caller's end of a new pipe (set by @c Spawn) */
+} fd_action;
+
+/** @brief The most actions of a @c Spawn call */
+#define SPAWN_MAX_ACTIONS 64
+
+/** @brief Create a new process, building its streams by a list of actions.
+
+  This call is like @c Exec, but the child starts with no streams, and 
+  gets them from @c actions, which are applied in order, as one step.
+  The sources of @c SPAWN_DUP and @c SPAWN_MOVE are fids of the caller as
+  they were before the call. For each @c SPAWN_PIPE_READ and 
+  @c SPAWN_PIPE_WRITE, a new pipe is made, and the fid of the caller's 
+  end is stored into the @c src field of the action. 
+  On error, the streams of the caller are unchanged.
+
+  Thus, a pipeline is started by one call for each stage. Stage i moves
+  the caller's end of the pipe of stage i-1 to its fid 0, and gets the
+  write end of a new pipe as its fid 1:
+  @code
+  fd_action actions[2] = {
+    { SPAWN_MOVE, 0, prev },
+    { SPAWN_PIPE_WRITE, 1, NOFILE }
+  };
+  Spawn(task, 0, NULL, actions, 2);
+  prev = actions[1].src;
+  @endcode
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param actions the actions on the streams of the child
+  @param n the number of actions, at most @c SPAWN_MAX_ACTIONS
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  An action is illegal, or the source of an action is not open.
+   -  The pipes could not be made.
+  @see ExecEx
+  */
+Pid_t Spawn(Task task, int argl, void* args, fd_action* actions, int n);
+
 
 /** @brief Exit the current process.
 
@@ -281,6 +541,26 @@ void Exit(int val);
 */
 Pid_t WaitChild(Pid_t pid, int* exitval);
 
+/** @brief Wait on several terminating children.
+
+   This function waits until at least one child process has exited,
+   and then reaps up to @c n exited children, as if by calling
+   @c WaitChild(NOPROC, ...) once for each of them, but without blocking
+   after the first.
+
+   The pid of the i-th reaped child is stored in @c pids[i] and its exit
+   status in @c exitvals[i]. Either array can be NULL.
+
+    @param pids an array of at least @c n pids, or NULL
+    @param exitvals an array of at least @c n exit values, or NULL
+    @param n the maximum number of children to reap
+   @return On success, the number of reaped children, which is 0 if this
+   process has no child processes. On error, -1 is returned; this
+   happens if @c n is not positive.
+   @see WaitChild
+*/
+int WaitChildren(Pid_t* pids, int* exitvals, int n);
+
 /** @brief Return the PID of the caller.
 
  This function returns the pid of the current process 
@@ -293,6 +573,47 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The resources of a process that can be limited.
+
+  @see SetLimit
+ */
+typedef enum limit_resource {
+  LIMIT_KERNEL_MEMORY,  /**< Bytes of kernel objects: TCBs, PTCBs, the copy of the args, pipes, sockets */
+  LIMIT_STACK_MEMORY    /**< Bytes of thread stacks */
+} limit_resource;
+
+/** @brief Set a limit on the memory of the current process.
+
+  The kernel memory that a process makes the kernel allocate is charged
+  to it, and is shown in the @c kernel_mem and @c stack_mem fields of 
+  its @c procinfo. Once a limit is set, a @c CreateThread, @c Pipe or 
+  @c Socket call that would take the process over it fails, and a pipe
+  buffer does not grow over it. The memory of a pipe or socket is
+  charged to the process that made it, for as long as it exists, 
+  and the memory of a thread until it exits.
+
+  A limit below the current usage does not release any memory, it only
+  makes the following calls fail. The children made by @c Exec after
+  this call inherit the limits, but their main thread is not held to 
+  them.
+
+  @param resource the resource to limit
+  @param bytes the limit, or 0 for no limit
+  @returns 0 on success, or -1 if @c resource is illegal.
+  @see GetLimit
+ */
+int SetLimit(limit_resource resource, unsigned long bytes);
+
+/** @brief Return a limit of the current process.
+
+  @param resource the resource whose limit is returned
+  @param bytes the location where the limit is stored, which is 0 for 
+    no limit
+  @returns 0 on success, or -1 if @c resource is illegal or @c bytes is NULL.
+  @see SetLimit
+ */
+int GetLimit(limit_resource resource, unsigned long* bytes);
+
 /*******************************************
  *
  * Threads
@@ -317,10 +638,27 @@ Pid_t GetPPid(void);
   programmer to define their meaning.
 
   @param task a function to execute
+  @returns the Tid of the new thread, or NOTHREAD on error. Possible
+    reasons for error:
+    - the thread table of the process is full.
+    - the new thread would take the process over a memory limit,
+      see @c SetLimit.
 
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread with a given stack size.
+
+  This call is like @c CreateThread, but the new thread gets a stack 
+  of size @c stack_size bytes. The size is treated as in @c ExecStack.
+
+  @param task a function to execute
+  @param stack_size the requested stack size, or 0 for the default
+  @see ExecStack
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -376,6 +714,76 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Restrict a thread to some of the cores.
+
+  Bit @c c of @c mask allows the thread to run on core @c c. The bits of
+  cores that the machine does not have are ignored. A thread that is not
+  running is placed on an allowed core the next time it becomes ready; 
+  the calling thread moves at once, if its core is excluded. Idle cores
+  do not steal a thread they are not allowed to run.
+
+  A new thread may run on any core.
+
+  @param tid a thread of the current process, or NOTHREAD for the calling thread
+  @param mask the cores allowed for the thread
+  @returns 0 on success, or -1 if there is no such (non-exited) thread, or
+    the mask allows no core of the machine.
+  @see GetAffinity
+  */
+int SetAffinity(Tid_t tid, unsigned int mask);
+
+/**
+  @brief Return the cores a thread may run on.
+
+  @param tid a thread of the current process, or NOTHREAD for the calling thread
+  @param mask the location to store the mask of allowed cores, as in @c SetAffinity
+  @returns 0 on success, or -1 if there is no such (non-exited) thread, or 
+    @c mask is NULL.
+  */
+int GetAffinity(Tid_t tid, unsigned int* mask);
+
+/** @brief The least runtime of a @c SetDeadline reservation, in usec */
+#define DEADLINE_MIN_RUNTIME 100
+
+/** @brief The longest period of a @c SetDeadline reservation, in usec */
+#define DEADLINE_MAX_PERIOD 10000000
+
+/**
+  @brief Reserve some time of every period for a thread.
+
+  The thread gets @c runtime usec of every @c period usec, ahead of the 
+  threads without a reservation: it runs before them and preempts them,
+  and threads with reservations run earliest deadline (end of period) 
+  first. When it has used up its runtime, it does not run again until 
+  the period ends. A period starts when the thread becomes ready after 
+  the end of the previous one, and the calling thread starts its first 
+  period at once.
+
+  The reservations of all threads together may take up to 95% of the cores. A
+  period of 0 drops the reservation of the thread, and so does its exit.
+
+  @param tid a thread of the current process, or NOTHREAD for the calling thread
+  @param period the period in usec, up to @c DEADLINE_MAX_PERIOD, or 0
+  @param runtime the time reserved in each period in usec, from 
+    @c DEADLINE_MIN_RUNTIME up to @c period
+  @returns 0 on success, or -1 if there is no such (non-exited) thread, 
+    the arguments are out of range, or the cores cannot take the reservation.
+  */
+int SetDeadline(Tid_t tid, unsigned long period, unsigned long runtime);
+
+/**
+  @brief Sleep for some microseconds.
+
+  The calling thread is woken up by a timer of the cores, as soon as 
+  the time has passed, and not at the end of the quantum of some other
+  thread. A time of 0 returns at once.
+
+  @param usec the time to sleep, in usec
+  @returns 0
+  */
+int Sleep(unsigned long usec);
+
 
 
 /*******************************************
@@ -416,6 +824,49 @@ Fid_t OpenTerminal(unsigned int termno);
 Fid_t OpenNull();
 
 
+/** @brief Open a stream on the scheduler trace.
+
+  The stream returns the scheduler events recorded recently, as a JSON
+  array in the Chrome trace event format. The events are a snapshot of
+  the trace, taken when the stream is opened. 
+
+  The trace is only recorded when the kernel has been built with
+  @c SCHED_TRACE defined.
+
+  @return On success, the file id of a new stream. On error, NOFILE is 
+    returned. Possible errors are:
+   - The kernel does not record traces.
+   - The maximum number of file descriptors has been reached.
+*/
+Fid_t OpenTrace();
+
+
+/** @brief Return the number of block devices available. 
+
+  Block devices are numbered starting from 0. They are the disks given
+  to the bios by @c vm_config_disks(), or by the @c TINYOS_DISKS environment
+  variable.
+ */
+unsigned int GetBlockDevices();
+
+/** @brief Open a stream on block device 'devno'.
+
+  The stream reads and writes the device as a sequence of bytes, from
+  the start of the device. A read at the end of the device returns 0, and a
+  write there returns -1. The data goes through the buffer cache of the 
+  kernel, and is written to the device at the latest when the stream 
+  is closed. @c Close returns -1 if some write to the device failed.
+
+  @param devno the block device to open
+  @return the file ID of the new descriptor, or  @c NOFILE on error. 
+   Possible errors are:
+   - The block device does not exist.
+   - The maximum number of file descriptors has been reached.
+  @see GetBlockStats
+ */
+Fid_t OpenBlock(unsigned int devno);
+
+
 /** 
   @brief Read bytes from a stream. 
 
@@ -460,6 +911,101 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief Poll events. 
+
+  @c POLL_HANGUP and @c POLL_ERROR are reported even if not requested.
+  @see Poll
+ */
+enum poll_events {
+  POLL_READ = 1,      /**< @c Read will not block (there is data, or the end of data) */
+  POLL_WRITE = 2,     /**< @c Write will not block */
+  POLL_HANGUP = 4,    /**< The other end of the stream has been closed */
+  POLL_ERROR = 8      /**< The stream is in error, @c Read or @c Write will fail */
+};
+
+/** @brief A timeout for @c Poll, to wait for ever */
+#define POLL_INFINITE ((timeout_t)-1)
+
+/** @brief The largest number of file ids accepted by @c Poll */
+#define MAX_POLL_FIDS 1024
+
+/** @brief Wait for some streams to become ready.
+
+  For each @c i from 0 to @c n-1, @c events[i] is a bitmask of @c poll_events 
+  requested for stream @c fids[i]. The call blocks until at least one of these
+  events is ready, or the timeout has expired. On return, @c events[i] holds
+  the events that are ready for @c fids[i].
+
+  Pipes, sockets and terminals can be polled. A listening socket is ready for
+  @c POLL_READ when @c Accept will not block. Other streams never block, and are 
+  always ready.
+
+  @param fids the file ids to poll
+  @param events the requested events, replaced by the ready events
+  @param n the number of file ids, at most @c MAX_POLL_FIDS
+  @param timeout the time to wait in milliseconds, 0 to return at once, or 
+     @c POLL_INFINITE to wait for ever.
+  @returns the number of ready file ids, 0 if the timeout expired, or -1 on 
+    error. Possible errors are:
+    - A file id is invalid.
+    - @c n is negative or larger than @c MAX_POLL_FIDS.
+ */
+int Poll(Fid_t* fids, int* events, int n, timeout_t timeout);
+
+
+/** @brief The largest number of segments accepted by @c ReadV and @c WriteV */
+#define MAX_IOVEC 64
+
+/** @brief A buffer segment, for vectored I/O.
+
+  @see ReadV
+  @see WriteV
+ */
+typedef struct io_vector {
+  void* base;         /**< Start of the segment */
+  unsigned int len;   /**< Size of the segment, in bytes */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into a number of buffers.
+
+  This is like @c Read, but the data is placed into the @c iovcnt
+  segments of @c iov, one after the other. Each segment is filled 
+  before the next one is used, and the call stops at the first segment 
+  that is not filled completely (e.g., at the end of data).
+
+  @param fd the file ID of the stream to read from
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOVEC
+  @return the total number of bytes copied, 0 if we have reached EOF, or -1, 
+    indicating some error. Possible errors are:
+    - The file descriptor is invalid.
+    - @c iovcnt is negative or larger than @c MAX_IOVEC.
+    - There was a I/O runtime problem.
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, int iovcnt);
+
+
+/** @brief Write bytes to a stream from a number of buffers.
+
+  This is like @c Write, but the data is taken from the @c iovcnt
+  segments of @c iov, one after the other. The call stops at the first 
+  segment that is not written completely.
+
+  @param fd the file ID of the stream to write to
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOVEC
+  @return the total number of bytes copied, or -1 on error. 
+    Possible errors are:
+    - The file descriptor is invalid.
+    - @c iovcnt is negative or larger than @c MAX_IOVEC.
+    - There was a I/O runtime problem.
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -474,6 +1020,57 @@ int Write(Fid_t fd, const char* buf, unsigned int size);
 int Close(Fid_t fd);
 
 
+/** @brief Returned by calls on a non-blocking stream, that would have to block.
+
+  @see SetNonBlocking
+ */
+#define WOULDBLOCK (-2)
+
+
+/** @brief Set or clear the non-blocking mode of a file id.
+
+  In non-blocking mode, calls on the stream return @c WOULDBLOCK instead of 
+  sleeping. This holds for @c Read, @c Write and their vectored versions on 
+  pipes and sockets, @c Read on terminals, @c Splice, @c Accept and @c Connect. 
+  A read or write that has transferred some data returns what it has 
+  transferred. Use @c Poll to wait until a call will not block.
+
+  A non-blocking @c Connect sends its request and returns @c WOULDBLOCK. The
+  socket becomes ready for @c POLL_WRITE when the request is accepted, and 
+  reports @c POLL_ERROR if it is refused. Calling @c Connect again on the 
+  socket returns 0, -1 or @c WOULDBLOCK, respectively.
+
+  The mode belongs to the stream, and is shared by the file ids that 
+  @c Dup2 has copied.
+
+  @param fd the file id
+  @param nonblocking 1 to set the non-blocking mode, 0 to clear it
+  @returns 0 on success, or -1 if @c fd is not a legal file id.
+ */
+int SetNonBlocking(Fid_t fd, int nonblocking);
+
+
+/** @brief The kinds of stream, returned by @c StreamType. */
+typedef enum stream_type {
+  STREAM_OTHER = 0,   /**< Any other stream, e.g., the null device or a kernel info stream */
+  STREAM_PIPE,        /**< An end of a pipe */
+  STREAM_SOCKET,      /**< A socket */
+  STREAM_TERMINAL,    /**< A terminal, or the console */
+  STREAM_BLOCK,       /**< A block device */
+  STREAM_FILE         /**< A file, @see Open */
+} stream_type;
+
+/** @brief Return the kind of stream of a file id.
+
+  This lets a program choose how to do I/O on a stream, e.g., to buffer
+  its data when it is a pipe or socket.
+
+  @param fd the file id
+  @returns a @c stream_type, or -1 if @c fd is not a legal file id.
+ */
+int StreamType(Fid_t fd);
+
+
 /** @brief Make a copy of a stream to a new file ID.
 
   If @c newfd is already in use by another file, it is first
@@ -491,13 +1088,69 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Counters of the file control blocks of the system.
+
+  @see GetFileStats
+ */
+typedef struct file_stats {
+  unsigned long total;        /**< The number of FCBs in the system */
+  unsigned long in_use;       /**< FCBs that are held by streams */
+  unsigned long allocs;       /**< FCBs taken since boot */
+  unsigned long frees;        /**< FCBs released since boot */
+  unsigned long refills;      /**< Times a core refilled its cache from the shared depot */
+  unsigned long flushes;      /**< Times a core returned part of its cache to the depot */
+  unsigned long failures;     /**< FCB allocations that failed */
+} file_stats;
+
+
+/** @brief Return the counters of the file control blocks.
+
+  The counters are gathered without stopping the system, so they may 
+  be slightly inconsistent while other cores open and close streams.
+
+  @param stats the location to store the counters
+  @returns 0 on success, or -1 if @c stats is NULL.
+ */
+int GetFileStats(file_stats* stats);
+
+
+/** @brief Counters of the buffer cache of the block devices.
+
+  @see GetBlockStats
+ */
+typedef struct block_stats {
+  unsigned long hits;           /**< Blocks found in the cache, including those read ahead */
+  unsigned long misses;         /**< Blocks that were not in the cache */
+  unsigned long readahead;      /**< Blocks read before they were asked for */
+  unsigned long read_requests;  /**< Read requests sent to the devices */
+  unsigned long blocks_read;    /**< Blocks read by these requests */
+  unsigned long write_requests; /**< Write requests sent to the devices */
+  unsigned long blocks_written; /**< Blocks written by these requests */
+} block_stats;
+
+
+/** @brief Return the counters of the buffer cache, since boot.
+
+  A request transfers a run of contiguous blocks, so there are usually
+  far fewer requests than blocks.
+
+  @param stats the location to store the counters
+  @returns 0 on success, or -1 if @c stats is NULL.
+ */
+int GetBlockStats(block_stats* stats);
+
 /*******************************************
  *
  * Pipes
  *
  *******************************************/
 
-#define BUFFER_SIZE 8000 // 8 KBytes
+/** @brief The smallest buffer capacity granted by @c PipeEx */
+#define PIPE_MIN_CAPACITY  512
+
+/** @brief The largest buffer capacity granted by @c PipeEx */
+#define PIPE_MAX_CAPACITY  (64*1024*1024)
 
 /**
 	@brief A pair of file ids, describing a pipe.
@@ -514,13 +1167,24 @@ typedef struct pipe_s {
 
 } pipe_t;
 
+/** @brief A list of threads polling a stream (kernel side).
+
+  @see kernel_poll.h
+ */
+typedef struct poll_queue {
+  Mutex spinlock;             /**< Protects @c pollers, locked with preemption off */
+  rlnode pollers;             /**< The registrations of polling threads */
+} poll_queue;
+
 typedef struct pipe_Control_Block{
 
 
   int reader_closed;
   int writer_closed;
 
-  char buffer[BUFFER_SIZE];
+  char* buffer;               /**< The ring buffer, of size @c capacity */
+  unsigned int capacity;      /**< The current size of @c buffer */
+  unsigned int max_capacity;  /**< @c buffer may grow up to this size */
   int bufferElementsCount;    /**< Metrame posa stoixeia exei o buffer gia na kseroume an einai adeios h gematos */
 
   int last_read_pos;
@@ -534,8 +1198,36 @@ typedef struct pipe_Control_Block{
   int ref_count_reader;
   int ref_count_writer;
 
+  Mutex mx;                   /**< Protects the pipe, together with the two tokens */
+  int reader_busy;            /**< Token of the reader side of the ring */
+  int writer_busy;            /**< Token of the writer side of the ring */
+  int readers_asleep;         /**< Threads sleeping at @c cv_readers */
+  int writers_asleep;         /**< Threads sleeping at @c cv_writers */
+  int readers_woken;          /**< Threads signalled at @c cv_readers, not yet running */
+  int writers_woken;          /**< Threads signalled at @c cv_writers, not yet running */
+
+  poll_queue pollq;           /**< Threads polling either end */
+
+  struct channel_s* channel;  /**< The channel that contains the pipe, or NULL */
+  struct mem_account* account; /**< The account charged for a pipe not in a channel */
+
+  int message;                /**< Set for the rings of message sockets */
+  unsigned int msg_left;      /**< The unread bytes of the current message */
+
 }pipe_CB;
 
+/** @brief Two pipes of opposite directions, in one allocation (kernel side).
+
+  This is the stream of a pair of connected sockets. The buffers of the
+  two rings are part of the object. 
+ */
+typedef struct channel_s {
+  pipe_CB ring[2];            /**< The two directions */
+  int refcount;               /**< The rings not released yet */
+  struct mem_account* account; /**< The account charged for the channel */
+  char buffers[2][BUFFER_SIZE];
+} channel_t;
+
 /**
 	@brief Construct and return a pipe.
 
@@ -553,10 +1245,64 @@ typedef struct pipe_Control_Block{
 	@param pipe a pointer to a pipe_t structure for storing the file ids.
 	@returns 0 on success, or -1 on error. Possible reasons for error:
 		- the available file ids for the process are exhausted.
+		- the pipe would take the process over its kernel memory limit,
+		  see @c SetLimit.
 */
 int Pipe(pipe_t* pipe_str);
 
-void create_pipe(FCB** pipe_FCBs);
+/**
+	@brief Construct and return a pipe with a given buffer capacity.
+
+	This call is like @c Pipe, but the buffer of the pipe initially holds
+	@c capacity bytes. When a writer finds the buffer full, the buffer
+	is doubled, up to @c max_capacity bytes. Sizes are hints: they are kept 
+	between @c PIPE_MIN_CAPACITY and @c PIPE_MAX_CAPACITY. A @c capacity of 0
+	selects the default size of @c Pipe, and a @c max_capacity not larger 
+	than @c capacity gives a buffer that does not grow.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the initial size of the buffer, in bytes
+	@param max_capacity the largest size of the buffer, in bytes
+	@returns 0 on success, or -1 on error. The reasons for error are
+		those of @c Pipe. A buffer that would take the process that made
+		the pipe over its kernel memory limit does not grow.
+	@see Pipe
+*/
+int PipeEx(pipe_t* pipe, unsigned int capacity, unsigned int max_capacity);
+
+/**
+	@brief Move data from one stream to another, without copying it to the caller.
+
+	Up to @c len bytes are moved from stream @c in to stream @c out. Stream 
+	@c in must be the read end of a pipe or a connected socket, and stream
+	@c out must be the write end of a pipe or a connected socket. The data
+	is copied directly from the buffer of one stream to the buffer of the other.
+
+	Like @c Read, the call blocks until some data is available at @c in,
+	and then moves as much as is available, up to @c len bytes, possibly
+	waiting for room at @c out.
+
+	@param in the file id to read from
+	@param out the file id to write to
+	@param len the largest number of bytes to move
+	@returns the number of bytes moved, 0 at the end of data of @c in, 
+	   or -1 on error. Possible reasons for error:
+		- @c in or @c out are not legal, or are not pipe or socket streams
+		- @c in and @c out are the two ends of the same pipe
+		- @c in or @c out have been closed
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int len);
+
+/** @brief Make a pipe of the default size at two reserved FCBs, as for @c Pipe.
+  
+  The pipe is charged to the current process.
+  @returns 0 on success, or -1 if the pipe would take the process over 
+    its kernel memory limit.
+ */
+int create_pipe(FCB** pipe_FCBs);
+
+/** @brief Make a pipe at two reserved FCBs, as for @c PipeEx. Return as @c create_pipe. */
+int create_pipe_ex(FCB** pipe_FCBs, unsigned int capacity, unsigned int max_capacity);
 
 int pipe_read(void* pipe_obj, char *buf, unsigned int size);
 
@@ -564,8 +1310,230 @@ int pipe_reader_close(void* pipe_obj);
 
 int pipe_write(void* pipe_obj, const char *buf, unsigned int size);
 
+int pipe_readv(void* pipe_obj, const iovec_t* iov, int iovcnt);
+
+int pipe_writev(void* pipe_obj, const iovec_t* iov, int iovcnt);
+
 int pipe_writer_close(void* pipe_obj);
 
+struct poll_table;
+
+int pipe_reader_poll(void* pipe_obj, int events, struct poll_table* pt);
+
+int pipe_writer_poll(void* pipe_obj, int events, struct poll_table* pt);
+
+/** @brief Create a channel. Each ring is read at one end and written at the other. 
+
+  If @c message is set, the rings keep the boundaries of messages.
+  The channel is charged to @c account, regardless of its limit, until
+  both rings are released.
+ */
+channel_t* create_channel(int message, struct mem_account* account);
+
+/** @brief Wait for a message at a message ring, and return its unread size. */
+int pipe_message_size(pipe_CB* pipe);
+
+/*******************************************
+ *
+ * Shared memory
+ *
+ *******************************************/
+
+/** @brief The largest shared memory region granted by @c ShmCreate */
+#define SHM_MAX_SIZE  (64*1024*1024)
+
+/**
+	@brief Create a shared memory region.
+
+	A region of @c size bytes, initialized to zero, is created and a
+	stream to it is returned. The stream is passed to other processes like
+	any other stream, e.g., it is inherited by the children of the process,
+	and each process with access to the stream can attach to the region, 
+	with @c ShmAttach.
+
+	A region is a plain piece of memory: the processes sharing it can
+	place in it @c Mutex and @c CondVar objects, to synchronize. 
+	The region is released when all the streams to it are closed and all
+	the attachments to it are detached.
+
+	The stream cannot be read from or written to.
+
+	@param size the size of the region in bytes
+	@returns the file id of the new stream, or @c NOFILE on error. 
+	   Possible reasons for error:
+		- @c size is 0 or larger than @c SHM_MAX_SIZE
+		- the available file ids for the process are exhausted
+*/
+Fid_t ShmCreate(unsigned int size);
+
+/**
+	@brief Attach to a shared memory region.
+
+	Return the address of the region that @c fid refers to. The region
+	remains valid until the address is passed to @c ShmDetach, even if the 
+	stream is closed. Each call to @c ShmAttach must be matched 
+	by a call to @c ShmDetach; the attachments that remain at the exit of 
+	the process are detached.
+
+	@param fid a stream created by @c ShmCreate
+	@param size if not NULL, the size of the region is stored here
+	@returns the address of the region, or NULL if @c fid is not a
+		legal shared memory stream.
+*/
+void* ShmAttach(Fid_t fid, unsigned int* size);
+
+/**
+	@brief Detach from a shared memory region.
+
+	Undo one call to @c ShmAttach of the current process that returned @c addr.
+
+	@param addr the address of the region
+	@returns 0 on success, or -1 if the process is not attached to a region
+		at @c addr.
+*/
+int ShmDetach(void* addr);
+
+/*******************************************
+ *
+ * Files
+ *
+ *******************************************/
+
+/** @brief The longest name of a file or directory, in bytes */
+#define MAX_NAME_LENGTH 63
+
+/** @brief The largest file, in bytes */
+#define MAX_FILE_SIZE (256ul*1024*1024)
+
+/** @brief The flags of @c Open, or-ed together */
+typedef enum open_flags {
+  OPEN_RDONLY = 1,                        /**< Open for reading */
+  OPEN_WRONLY = 2,                        /**< Open for writing */
+  OPEN_RDWR = OPEN_RDONLY|OPEN_WRONLY,    /**< Open for reading and writing */
+  OPEN_APPEND = 4,                        /**< Every write goes to the end of the file */
+  OPEN_CREAT = 8,                         /**< Create the file if it does not exist */
+  OPEN_EXCL = 16,                         /**< With @c OPEN_CREAT, fail if the file exists */
+  OPEN_TRUNC = 32                         /**< Make the file empty, when opened for writing */
+} open_flags;
+
+/**
+	@brief Open a file.
+
+	Files live in a tree of directories held in memory, which is empty at
+	boot and lost at shutdown. A path is absolute, i.e., it starts with 
+	'/', and its names are separated by '/'. The names "." and ".." have
+	no special meaning.
+
+	The stream reads and writes the file from a position, which starts at 0
+	and is moved by @c Seek. Writing past the end of the file extends it,
+	and a gap left by seeking past the end reads as zeros. The stream is
+	passed to other processes like any other stream; all the copies share 
+	the position.
+
+	@param path the path of the file
+	@param flags @c OPEN_RDONLY, @c OPEN_WRONLY or @c OPEN_RDWR, or-ed with
+		any of @c OPEN_APPEND, @c OPEN_CREAT, @c OPEN_EXCL and @c OPEN_TRUNC
+	@returns the file id of the new stream, or @c NOFILE on error. 
+	   Possible reasons for error:
+		- the path is illegal, or a directory on it does not exist
+		- the file does not exist, and @c OPEN_CREAT was not given
+		- the file exists, and @c OPEN_CREAT and @c OPEN_EXCL were given
+		- the path names a directory
+		- the available file ids for the process are exhausted
+*/
+Fid_t Open(const char* path, int flags);
+
+/** @brief The origin of a @c Seek */
+typedef enum seek_whence {
+  SEEK_FROM_START,     /**< From the start of the file */
+  SEEK_FROM_CURRENT,   /**< From the current position */
+  SEEK_FROM_END        /**< From the end of the file */
+} seek_whence;
+
+/**
+	@brief Move the position of a file stream.
+
+	@param fid a stream returned by @c Open
+	@param offset the new position, relative to @c whence
+	@param whence the origin of @c offset
+	@returns the new position, or -1 if @c fid is not a file stream, or
+		the new position would be negative or past @c MAX_FILE_SIZE.
+*/
+long Seek(Fid_t fid, long offset, seek_whence whence);
+
+/** @brief The kind of a file */
+typedef enum file_type {
+  FILE_REGULAR = 1,    /**< A file created by @c Open */
+  FILE_DIRECTORY       /**< A directory created by @c MkDir, or the root */
+} file_type;
+
+/** @brief The information returned by @c Stat */
+typedef struct file_info {
+  file_type type;          /**< The kind of file */
+  unsigned long size;      /**< The bytes of a file, or the entries of a directory */
+  unsigned int extents;    /**< The pieces of contiguous memory that hold a file */
+} file_info;
+
+/**
+	@brief Return information on a file or directory.
+
+	@param path the path of the file
+	@param info the location to store the information
+	@returns 0 on success, or -1 if @c info is NULL or the path does not exist.
+*/
+int Stat(const char* path, file_info* info);
+
+/**
+	@brief Create an empty directory.
+
+	@param path the path of the new directory
+	@returns 0 on success, or -1 if the path is illegal, its parent 
+		directory does not exist, or the path exists.
+*/
+int MkDir(const char* path);
+
+/**
+	@brief Remove a file, or an empty directory.
+
+	The streams and the mappings of a file that is removed remain usable,
+	and the file is released when they are all closed and unmapped.
+
+	@param path the path of the file
+	@returns 0 on success, or -1 if the path does not exist, or names the 
+		root or a directory that is not empty.
+*/
+int Unlink(const char* path);
+
+/**
+	@brief Map the contents of a file into memory.
+
+	Return the address of the byte at @c offset of the file, without 
+	copying it. The bytes that follow it in memory are the next bytes of
+	the file; their number, up to the end of the file, is stored in @c len.
+	Mapping the following bytes continues from @c offset + @c len.
+
+	The address remains valid until it is passed to @c UnmapFile, even if
+	the stream is closed or the file is removed. Writes to the file are seen
+	through it, and a truncated file keeps its memory. The mapped bytes must 
+	not be written, unless the stream was opened for writing. The mappings 
+	that remain at the exit of the process are unmapped.
+
+	@param fid a stream returned by @c Open
+	@param offset the offset of the first byte to map
+	@param len the location to store the number of bytes mapped
+	@returns the address of the byte, or NULL if @c fid is not a file stream,
+		@c len is NULL, or @c offset is not before the end of the file.
+*/
+void* MapFile(Fid_t fid, unsigned long offset, unsigned int* len);
+
+/**
+	@brief Undo one call to @c MapFile of the current process that returned @c addr.
+
+	@param addr the mapped address
+	@returns 0 on success, or -1 if the process has no mapping at @c addr.
+*/
+int UnmapFile(void* addr);
+
 /*******************************************
  *
  * Sockets (local)
@@ -582,7 +1550,15 @@ typedef int16_t port_t;
 /**
 	@brief the maximum legal port 
 */
-#define MAX_PORT 1023
+#define MAX_PORT 32767
+
+/**
+	@brief The first ephemeral port.
+
+	Sockets created on @c NOPORT are given a port from 
+	@c EPHEMERAL_PORT_MIN to @c MAX_PORT when they connect.
+*/
+#define EPHEMERAL_PORT_MIN 16384
 
 /**
 	@brief a null value for a port
@@ -603,9 +1579,56 @@ typedef int16_t port_t;
 		reasons for error:
 		- the port is ilegal
 		- the available file ids for the process are exhausted
+		- the socket would take the process over its kernel memory limit,
+		  see @c SetLimit.
 */
 Fid_t Socket(port_t port);
 
+
+/**
+	@brief Socket modes.
+
+	@see SocketEx
+*/
+typedef enum {
+  SOCKET_STREAM=0,    /**< A byte stream, like a pipe. This is the mode of @c Socket. */
+  SOCKET_MESSAGE=1    /**< A stream of messages, each written by one @c Write. */
+} socket_mode;
+
+
+/**
+	@brief Return a new socket of a given mode.
+
+	This is like @c Socket, but the socket may be a message socket. 
+	A message socket keeps the boundaries of messages: each @c Write (or 
+	@c WriteV) on it is delivered whole to the other end, as one message. 
+	A @c Read returns data of one message only. If the buffer is smaller 
+	than the message, the following reads return the rest of it. The 
+	size of the next message can be found with @c MessageSize.
+
+	A message must fit in the stream buffer, else @c Write fails. 
+	Message sockets only connect to message listeners, and they cannot 
+	be used with @c Splice.
+
+	@param port the port the new socket will be bound to
+	@param mode the mode of the socket
+	@returns a file id for the new socket, or NOFILE on error. The reasons
+		for error are those of @c Socket, or an illegal @c mode.
+*/
+Fid_t SocketEx(port_t port, socket_mode mode);
+
+
+/**
+	@brief Wait for a message at a message socket, and return its size.
+
+	If a part of the message has been read, the size of the rest is returned.
+
+	@param sock a connected message socket
+	@returns the size of the message, 0 at the end of data, or -1 on error.
+		On a non-blocking socket, @c WOULDBLOCK may be returned.
+*/
+int MessageSize(Fid_t sock);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -629,6 +1652,24 @@ Fid_t Socket(port_t port);
 int Listen(Fid_t sock);
 
 
+/**
+	@brief Initialize a listening socket with a bounded backlog.
+
+	This is like @c Listen, but at most @c backlog connection requests may 
+	be waiting for @c Accept. When that many are waiting, further calls to 
+	@c Connect fail immediately. A @c backlog of 0 means no limit, as with
+	@c Listen. In both cases, the requests are accepted in the order they 
+	were made.
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the maximum number of waiting requests, or 0
+	@returns 0 on success, -1 on error. The reasons for error are those of
+		@c Listen, or a negative @c backlog.
+	@see Listen
+ */
+int ListenEx(Fid_t sock, int backlog);
+
+
 /**
 	@brief Wait for a connection.
 
@@ -655,6 +1696,23 @@ int Listen(Fid_t sock);
 Fid_t Accept(Fid_t lsock);
 
 
+/**
+	@brief Accept a number of connections at once.
+
+	This call waits like @c Accept, until there is at least one connection 
+	request. Then it accepts up to @c max of the waiting requests, storing
+	the new socket file ids in @c fids.
+
+	@param lsock the listening socket
+	@param fids an array of at least @c max file ids
+	@param max the maximum number of connections to accept
+	@returns the number of connections accepted, or -1 on error. The reasons
+		for error are those of @c Accept, or @c max not being positive.
+	@see Accept
+ */
+int AcceptMany(Fid_t lsock, Fid_t* fids, int max);
+
+
 
 /**
 	@brief Create a connection to a listener at a specific port.
@@ -666,6 +1724,9 @@ Fid_t Accept(Fid_t lsock);
 	The two connected sockets communicate by virtue of two pipes of opposite directions, 
 	but with one file descriptor servicing both pipes at each end.
 
+	If @c sock was created on @c NOPORT, it is given an ephemeral port, which
+	is released when the socket is closed, or when the connection fails.
+
 	The connect call will block for approximately the specified amount of time.
 	The resolution of this timeout is implementation specific, but should be
 	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
@@ -680,10 +1741,65 @@ Fid_t Accept(Fid_t lsock);
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
 	   - the timeout has expired without a successful connection.
+	   - the backlog of the listener is full.
+	   - the mode of @c sock is not the mode of the listener.
+	   - the ephemeral ports are exhausted.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
 
+/**
+	@brief Create a connection to a listener on a node of the network.
+
+	This is @c Connect, for a listener on another machine, when the machine
+	is a node of a network (see @c vm_config_network). The connected 
+	socket is read, written, polled, shut down and closed as a local one.
+
+	A connect to the node of this machine is a local @c Connect. A 
+	connect to another node always blocks, and only stream sockets may 
+	connect to other nodes. The port given to the socket is a port of this
+	node, and the listener sees it as the peer port.
+
+	@params sock the socket to connect to the other end
+	@params node the node of the listener
+	@params port the port of the listener on that node
+	@params timeout the approximate amount of time to wait for a
+	        connection, as for @c Connect.
+	@returns 0 on success and -1 on error. Possible reasons for error are
+	   those of @c Connect, and also:
+	   - @c node is not a node of the network.
+	   - @c sock is a message socket, or is non-blocking with a pending connect.
+	   - the node cannot be reached.
+	   - too many connections to other nodes are open.
+	@see GetNodeId
+*/
+int ConnectNode(Fid_t sock, int node, port_t port, timeout_t timeout);
+
+
+/**
+	@brief Return the node of this machine in its network.
+
+	@returns the node, or -1 if the machine is not on a network.
+	@see ConnectNode
+*/
+int GetNodeId();
+
+
+/**
+	@brief Return the ports of a socket.
+
+	The local port is the port of the socket, given to @c Socket, or the 
+	ephemeral port it was given by @c Connect. For connected sockets, the
+	peer port is the local port of the other end, else it is @c NOPORT.
+
+	@param sock the socket
+	@param local if not NULL, the local port is stored here
+	@param peer if not NULL, the peer port is stored here
+	@returns 0 on success, or -1 if @c sock is not a socket.
+ */
+int SocketPorts(Fid_t sock, port_t* local, port_t* peer);
+
+
 /**
    @brief Socket shutdown modes.
 
@@ -730,6 +1846,120 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Asynchronous I/O
+ *
+ *******************************************/
+
+/** @brief The most submission entries of a ring */
+#define AIO_MAX_ENTRIES 256
+
+/** @brief The most operations of a ring that are performed at the same time */
+#define AIO_MAX_WORKERS 16
+
+/** @brief A timeout of @c AioEnter that waits for ever */
+#define AIO_INFINITE ((timeout_t)-1)
+
+/** @brief The operations of an asynchronous I/O ring */
+typedef enum aio_op {
+  AIO_NOP,         /**< Do nothing, and complete with 0 */
+  AIO_READ,        /**< @c Read(fid, buf, len) */
+  AIO_WRITE,       /**< @c Write(fid, buf, len) */
+  AIO_ACCEPT,      /**< @c Accept(fid) */
+  AIO_CONNECT      /**< @c Connect(fid, port, timeout) */
+} aio_op;
+
+/** @brief A submission entry: an operation and its arguments */
+typedef struct aio_sqe {
+  aio_op op;                /**< The operation */
+  Fid_t fid;                /**< The stream */
+  void* buf;                /**< The buffer of @c AIO_READ and @c AIO_WRITE */
+  unsigned int len;         /**< The size of @c buf */
+  port_t port;              /**< The port of @c AIO_CONNECT */
+  timeout_t timeout;        /**< The timeout of @c AIO_CONNECT */
+  void* user_data;          /**< Copied to the completion entry */
+} aio_sqe;
+
+/** @brief A completion entry */
+typedef struct aio_cqe {
+  void* user_data;          /**< The @c user_data of the submission */
+  int result;               /**< The value returned by the operation */
+} aio_cqe;
+
+/**
+  @brief An asynchronous I/O ring, shared by the process and the kernel.
+
+  The submission queue @c sq and the completion queue @c cq are circular
+  arrays of @c entries and @c 2*entries entries, indexed by free-running
+  counters modulo their size. The process adds a submission at
+  @c sq[sq_tail % entries] and then advances @c sq_tail; the kernel takes
+  the submissions from @c sq_head on, when @c AioEnter is called. 
+  The kernel adds completions at @c cq_tail; the process takes them from 
+  @c cq_head on, and then advances @c cq_head. Each side should advance 
+  its counters with @c __atomic_store_n(...,__ATOMIC_RELEASE), and read 
+  those of the other side with @c __atomic_load_n(...,__ATOMIC_ACQUIRE).
+ */
+typedef struct aio_ring {
+  unsigned int entries;     /**< The size of @c sq, a power of 2 */
+  unsigned int sq_head;     /**< The next submission the kernel will take */
+  unsigned int sq_tail;     /**< The next free submission entry */
+  unsigned int cq_head;     /**< The next completion the process will take */
+  unsigned int cq_tail;     /**< The next free completion entry */
+  aio_sqe* sq;              /**< The submission queue */
+  aio_cqe* cq;              /**< The completion queue */
+} aio_ring;
+
+/**
+  @brief Create an asynchronous I/O ring.
+
+  A ring lets a single thread keep many operations in flight, on any 
+  streams of the process, e.g., reads of several pipes and sockets, and
+  the accepts and connects of sockets. The operations are performed by 
+  kernel threads of the process, up to @c AIO_MAX_WORKERS at the same
+  time, which exist only while the ring has operations to perform. The 
+  operations of a ring are started in the order they are submitted, but
+  may complete in any order.
+
+  The ring is created empty, and is held by a stream, so that it is
+  released by @c Close. The stream cannot be read from or written to.
+
+  @param entries the size of the submission queue, rounded up to a power
+     of 2, at most @c AIO_MAX_ENTRIES
+  @param ring the location to store the address of the ring, which is
+     valid until the stream is closed
+  @returns the file id of the new stream, or @c NOFILE on error. 
+     Possible reasons for error:
+     - @c entries is 0 or larger than @c AIO_MAX_ENTRIES
+     - @c ring is NULL
+     - the available file ids for the process are exhausted
+ */
+Fid_t AioSetup(unsigned int entries, aio_ring** ring);
+
+/**
+  @brief Submit operations to a ring, and wait for completions.
+
+  Take up to @c to_submit entries from the submission queue of the ring,
+  and start their operations. Fewer entries are taken if there are fewer
+  in the queue, or if the completion queue could not hold the completions
+  of all the operations in flight. The streams are looked up when each 
+  operation starts. Then wait until the completion queue holds at least
+  @c min_complete entries, or no operation is in flight, or the timeout
+  expires.
+
+  Closing the ring discards the operations that have not started; those
+  that have started are completed, but the completions are discarded.
+
+  @param fid a stream returned by @c AioSetup of the current process
+  @param to_submit the most entries to take from the submission queue
+  @param min_complete the completions to wait for, 0 to return at once
+  @param timeout the longest wait in milliseconds, or @c AIO_INFINITE
+  @returns the number of entries taken, or -1 if @c fid is not a ring
+     of the current process.
+ */
+int AioEnter(Fid_t fid, unsigned int to_submit, unsigned int min_complete, timeout_t timeout);
+
+
 /*******************************************
  *
  * System information
@@ -741,6 +1971,11 @@ int ShutDown(Fid_t sock, shutdown_mode how);
   */
 #define PROCINFO_MAX_ARGS_SIZE (128)
 
+/**
+  @brief The number of scheduler causes counted in a procinfo structure.
+  */
+#define PROCINFO_SCHED_CAUSES (8)
+
 /**
 	@brief A struct containing process-related information for a non-free
 	pid.
@@ -758,9 +1993,32 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long stack_size;   /**< Stack size of the main thread, in bytes. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
+  unsigned long cpu_time;   /**< @brief Microseconds of CPU time used by the threads of the process. */
+  unsigned long run_count;  /**< @brief Times a thread of the process gained a core. */
+
+  unsigned long voluntary_switches;   /**< @brief Times a thread left its core before its quantum expired. */
+  unsigned long involuntary_switches; /**< @brief Times a thread was preempted at the end of its quantum, or by a thread of higher priority. */
+
+  /** @brief Times a thread left its core, per cause of the scheduler invocation
+    (quantum, I/O, mutex, pipe, poll, idle, user, preempt, in this order). */
+  unsigned long sched_switches[PROCINFO_SCHED_CAUSES];
+
+  unsigned long io_read;      /**< @brief Bytes read by the process, with @c Read, @c ReadV or @c Splice. */
+  unsigned long io_written;   /**< @brief Bytes written by the process, with @c Write, @c WriteV or @c Splice. */
+  unsigned long child_io_read;    /**< @brief Bytes read by the children reaped with @c WaitChild, and by their own. */
+  unsigned long child_io_written; /**< @brief Bytes written by the children reaped with @c WaitChild, and by their own. */
+
+  int priority;    /**< @brief The priority level of the main thread, including any lent to it, or -1 for a zombie. */
+  int last_core;   /**< @brief The core a thread of the process last gained, or -1 if none has run yet. */
+
+  unsigned long kernel_mem;  /**< @brief Bytes of kernel memory charged to the process, see @c SetLimit. */
+  unsigned long stack_mem;   /**< @brief Bytes of thread stacks charged to the process. */
+
   int argl;        /**< @brief Argument length of main task. 
 
             Note that this is the
@@ -775,15 +2033,6 @@ typedef struct procinfo
 } procinfo;
 
 
-// Used to save procinfos in a list.
-typedef struct process_info_Control_Block{
-
-    procinfo* data;
-
-    int count;
-
-}procinfo_CB;
-
 /**
 	@brief Open a kernel information stream.
 
@@ -792,11 +2041,12 @@ typedef struct process_info_Control_Block{
 	each packed into a block of size @c sizeof(procinfo).
 
 	Each procinfo structure contains information pertaining to some
-	used PCB (active or zombie) during the time of the stream. 
+	used PCB (active or zombie) at the time the stream was opened;
+	the records are a consistent snapshot of the process table.
 
-	There is no guarantee of the timeliness of the information.
-	A best-effort approach to return relevant system information is
-	made. 
+	A read returns as many whole records as fit in its buffer, and 0
+	after the last record. A read with a buffer smaller than 
+	@c sizeof(procinfo) fails with -1.
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -804,8 +2054,37 @@ typedef struct process_info_Control_Block{
  */
 Fid_t OpenInfo();
 
-int procinfo_close(void* procinfo_obj);
-int procinfo_read(void* procinfo_obj, char* buf, unsigned int size);
+
+/** @brief Counters of the scheduling of a core.
+
+  @see GetCoreStats
+ */
+typedef struct core_stats {
+  unsigned long busy_time;    /**< usec the core ran threads other than its idle thread */
+  unsigned long idle_time;    /**< usec the core ran its idle thread */
+  unsigned long switches;     /**< Times a thread left the core */
+  unsigned long steals;       /**< Ready threads the core took from the queues of other cores */
+  unsigned long interrupts;   /**< Interrupts delivered to the core */
+  unsigned long idle_poll_hits;    /**< Times the idle core found work while polling, see @c set_idle_poll */
+  unsigned long idle_poll_misses;  /**< Times the idle core polled in vain, and halted */
+  unsigned long wake_affine_hits;   /**< Threads woken up by a partner on this core, e.g., at a pipe, and queued on it */
+  unsigned long wake_affine_misses; /**< Threads woken up by a partner on this core and queued elsewhere, as the core was busy */
+} core_stats;
+
+
+/** @brief Return the scheduling counters of the cores.
+
+  The counters of a core are updated when a thread leaves it, so the
+  time of the threads running at the time of the call is not counted yet.
+  The utilization of the cores over an interval can be computed from the 
+  change of @c busy_time between two calls.
+
+  @param stats an array of @c n records, filled for cores 0 to n-1
+  @param n the length of @c stats
+  @returns the number of records filled, which is the smaller of @c n and 
+    the number of cores, or -1 if @c stats is NULL.
+ */
+int GetCoreStats(core_stats* stats, unsigned int n);
 
 
 /*******************************************
@@ -826,6 +2105,39 @@ int procinfo_read(void* procinfo_obj, char* buf, unsigned int size);
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Select the scheduling policy of the following boots.
+
+   The policies are
+   - @c "mlfq": a multilevel feedback queue (the default),
+   - @c "rr": round robin,
+   - @c "fair": the thread with the least CPU time runs next.
+
+   If this is not called, the policy is taken from the environment 
+   variable @c TINYOS_SCHED, if it is set.
+
+   @returns 0 on success, or -1 if the policy is unknown.
+   */
+int set_sched_policy(const char* name);
+
+/** @brief The longest idle polling window, in microseconds */
+#define IDLE_POLL_MAX 100000
+
+/** @brief Select the idle polling window of the following boots.
+
+   A core that runs out of threads halts, and a halted core takes some
+   tens of microseconds to restart. With a window of @c usec microseconds,
+   an idle core first polls the ready queues for that long, spinning, 
+   and halts only if no thread becomes ready. This lowers the latency of 
+   wakeups, at the cost of host CPU time. The default is 0, to halt at once.
+
+   If this is not called, the window is taken from the environment 
+   variable @c TINYOS_IDLE_POLL, if it is set.
+
+   @returns 0 on success, or -1 if @c usec exceeds @c IDLE_POLL_MAX.
+   @see core_stats
+   */
+int set_idle_poll(unsigned int usec);
+
 
 /** @} */
 
@@ -0,0 +1,62 @@
+#ifndef __TINYOS_CONFIG_H
+#define __TINYOS_CONFIG_H
+
+/**
+	@file tinyos_config.h
+	@brief Compile-time configuration of the kernel and the virtual machine.
+
+	Each setting can be given on the compiler command line, e.g.
+	@c -DMAX_PROC=1024, and the value here is only the default. All the
+	sources must be built with the same settings.
+
+	@c CONFIG_UP builds a uniprocessor system, for deployments that run a
+	single core by design. Build it with <tt>make UP=1</tt>, or
+	<tt>make up</tt>. In it, the kernel spinlocks (see @c Spin_Lock) compile
+	down to preemption control, and the bookkeeping of idle and halted
+	cores disappears.
+*/
+
+/** @brief Non-zero for a uniprocessor build */
+#ifndef CONFIG_UP
+#define CONFIG_UP 0
+#endif
+
+/** @brief Maximum number of cores for a virtual machine, up to 32. */
+#ifndef MAX_CORES
+#if CONFIG_UP
+#define MAX_CORES 1
+#else
+#define MAX_CORES 32
+#endif
+#endif
+
+/** @brief The number of priority levels of the scheduler, up to 31. */
+#ifndef PRIORITY_LISTS
+#define PRIORITY_LISTS 10
+#endif
+
+/** @brief The maximum number of processes */
+#ifndef MAX_PROC
+#define MAX_PROC 65536
+#endif
+
+/** @brief The maximum number of open files per process.
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors.
+   The file table of a process grows as needed, up to this size. */
+#ifndef MAX_FILEID
+#define MAX_FILEID 1024
+#endif
+
+/** @brief The default capacity of a pipe, in bytes */
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 8000 // 8 KBytes
+#endif
+
+
+/* The core masks and the priority bitmaps are unsigned ints */
+_Static_assert(MAX_CORES >= 1 && MAX_CORES <= 32, "MAX_CORES must be from 1 to 32");
+_Static_assert(! CONFIG_UP || MAX_CORES == 1, "a uniprocessor build has one core");
+_Static_assert(PRIORITY_LISTS >= 1 && PRIORITY_LISTS <= 31, "PRIORITY_LISTS must be from 1 to 31");
+_Static_assert(MAX_FILEID >= 3, "MAX_FILEID must leave room for the standard streams");
+
+#endif
@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int SchedTrace(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -31,6 +32,7 @@ int Symposium_thr(size_t,const char**);
 int RemoteServer(size_t,const char**);
 int RemoteClient(size_t,const char**);
 int Echo(size_t,const char**);
+int Generate(size_t,const char**);
 
 
 struct { const char * cmdname; Program prog; uint nargs; const char* help; } 
@@ -39,6 +41,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"trace", SchedTrace, 0, "Print the recent scheduler events, in Chrome trace format."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -52,8 +55,9 @@ COMMANDS[]  =
 	{"symp_thr", Symposium_thr, 2, "Dining Philosophers(threads): symp_thr  <philosophers> <bites>"},
 	{"hanoi", Hanoi, 1, "The towers of Hanoi."},
 	{"rserver", RemoteServer, 0, "A server for remote execution."},
-	{"rcli", RemoteClient, 1, "Remote client: rcli <cmd> [<args...>]."},
+	{"rcli", RemoteClient, 1, "Remote client: rcli [-p | -l <requests> <conns>] <cmd> [<args...>]."},
 	{"echo", Echo, 0, "echo [<args...>], send the <args...> to stdout"},
+	{"gen", Generate, 1, "gen <bytes>: write <bytes> of text to stdout"},
 
 	{NULL, NULL, 0, NULL}
 };
@@ -128,8 +132,10 @@ int Repeat(size_t argc, const char** argv)
 	if(times<0) {
 		printf("Cannot execute a negative number of times!\n");
 	}
+	/* The children only need the standard streams */
+	Fid_t fdmap[2] = { 0, 1 };
 	while(times--) {
-		Execute(COMMANDS[prog].prog, ac, av);
+		ExecuteEx(COMMANDS[prog].prog, ac, av, fdmap, 2);
 		WaitChild(NOPROC,NULL);
 	}
 	return 0;
@@ -172,8 +178,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %4s %4s %10s %8s %9s %20s\n",
+			"PID", "PPID", "State", "Threads", "Prio", "Core", "CPU(ms)", "Kmem(KB)", "Stack(KB)", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,11 +195,16 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %4d %4d %10lu %8lu %9lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.priority,
+				info.last_core,
+				info.cpu_time/1000,
+				info.kernel_mem/1024,
+				info.stack_mem/1024,
 				pname
 				);
 		}
@@ -203,6 +214,25 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+int SchedTrace(size_t argc, const char** argv)
+{
+	Fid_t ftrace = OpenTrace();
+	if(ftrace==NOFILE) {
+		printf("The kernel does not record traces (build with SCHED_TRACE=1).\n");
+		return 1;
+	}
+
+	char buf[512];
+	int n;
+	FILE* fout = fidopen(1, "w");
+	while((n = Read(ftrace, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, fout);
+	fclose(fout);
+	Close(ftrace);
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -211,6 +241,8 @@ You can run some simple commands. Every command takes a\n\
 only **integer** arguments. The list of commands and the\n\
 number of arguments for each command is shown by\n\
 typing 'ls'. \n\n\
+Commands can be joined into a pipeline with '|', and\n\
+'time <pipeline>' reports the time and bytes it took.\n\n\
 When you are tired of playing, type 'exit' to quit.\n\
 ");
 	return 0;
@@ -251,19 +283,54 @@ int Fibonacci(size_t argc, const char** argv)
 }
 
 
-int Capitalize(size_t argc, const char** argv)
+/*
+	The filters move their data with Read and Write on a large buffer,
+	instead of stdio, so that a pipeline of them moves a buffer at a
+	time through each pipe.
+ */
+#define FILTER_BUFFER 65536
+
+/* Write all of buf to fid, return 0 on success and -1 on error */
+static int write_all(Fid_t fid, const char* buf, unsigned int size)
 {
-	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(toupper(c), fout);
+	while(size > 0) {
+		int rc = Write(fid, buf, size);
+		if(rc <= 0) return -1;
+		buf += rc;
+		size -= rc;
 	}
-	fclose(fin);
-	fclose(fout);
 	return 0;
 }
 
+/* Copy stdin to stdout, transforming each buffer in place */
+static int filter(void (*transform)(char*, int))
+{
+	char* buf = xmalloc(FILTER_BUFFER);
+	int rc;
+	while((rc = Read(0, buf, FILTER_BUFFER)) > 0) {
+		transform(buf, rc);
+		if(write_all(1, buf, rc)) break;
+	}
+	free(buf);
+	return 0;
+}
+
+static void to_upper(char* buf, int n)
+{
+	for(int i=0; i<n; i++) buf[i] = toupper((unsigned char) buf[i]);
+}
+
+static void to_lower(char* buf, int n)
+{
+	for(int i=0; i<n; i++) buf[i] = tolower((unsigned char) buf[i]);
+}
+
+
+int Capitalize(size_t argc, const char** argv)
+{
+	return filter(to_upper);
+}
+
 
 int Echo(size_t argc, const char** argv)
 {
@@ -280,37 +347,40 @@ int Echo(size_t argc, const char** argv)
 
 int LowerCase(size_t argc, const char** argv)
 {
-	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(tolower(c), fout);
-	}
-	fclose(fin);
-	fclose(fout);
-	return 0;
+	return filter(to_lower);
 }
 
 
 int LineEnum(size_t argc, const char** argv)
 {
-	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	/* Room for a line number in front of every input char */
+	const unsigned int outsize = FILTER_BUFFER + 32;
+	char* in = xmalloc(FILTER_BUFFER);
+	char* out = xmalloc(outsize);
+	unsigned int olen = 0;
+
 	int atend=1;
 	size_t count=0;
-	while((c=fgetc(fin))!=EOF) {
-		if(atend) {
-			count++;
-			fprintf(fout, "%6zu: ", count);
-			atend = 0;
+	int rc;
+	while((rc = Read(0, in, FILTER_BUFFER)) > 0) {
+		for(int i=0; i<rc; i++) {
+			if(olen + 32 > outsize) {
+				if(write_all(1, out, olen)) goto done;
+				olen = 0;
+			}
+			if(atend) {
+				count++;
+				olen += snprintf(out+olen, outsize-olen, "%6zu: ", count);
+				atend = 0;
+			}
+			out[olen++] = in[i];
+			if(in[i]=='\n') atend=1;
 		}
-
-		fputc(c, fout);
-		if(c=='\n') atend=1;
 	}
-	fclose(fin);
-	fclose(fout);
+	write_all(1, out, olen);
+done:
+	free(in);
+	free(out);
 	return 0;
 }
 
@@ -360,27 +430,50 @@ int WordCount(size_t argc, const char** argv)
 	size_t nchar, nword, nline;
 	nchar = nword = nline = 0;
 	int wspace = 1;
-	char c;
-	FILE* fin = fidopen(0, "r");
-	while((c=fgetc(fin))!=EOF) {
-		nchar++;
-		if(wspace && !isblank(c)) {
-			wspace = 0;
-			nword ++;
-		}
-		if(c=='\n') {
-			nline++;
-			wspace = 1;
+	char* buf = xmalloc(FILTER_BUFFER);
+	int rc;
+	while((rc = Read(0, buf, FILTER_BUFFER)) > 0) {
+		nchar += rc;
+		for(int i=0; i<rc; i++) {
+			char c = buf[i];
+			if(wspace && !isblank(c)) {
+				wspace = 0;
+				nword ++;
+			}
+			if(c=='\n') {
+				nline++;
+				wspace = 1;
+			}
+			if(isblank(c))
+				wspace = 1;
 		}
-		if(isblank(c))
-			wspace = 1;
 	}
-	fclose(fin);
+	free(buf);
 	printf("%8zd %8zd %8zd\n", nline, nword, nchar);
 	return 0;
 }
 
 
+/* Write the given number of bytes of text: lines of 63 letters */
+int Generate(size_t argc, const char** argv)
+{
+	checkargs(1);
+	unsigned long left = strtoul(argv[1], NULL, 10);
+
+	char* buf = xmalloc(FILTER_BUFFER);
+	for(unsigned int i=0; i<FILTER_BUFFER; i++)
+		buf[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 64) % 26;
+
+	while(left > 0) {
+		unsigned int n = (left < FILTER_BUFFER) ? left : FILTER_BUFFER;
+		if(write_all(1, buf, n)) break;
+		left -= n;
+	}
+	free(buf);
+	return 0;
+}
+
+
 int ListPrograms(size_t argc, const char** argv)
 {
 	printf("no.  %-15s no.of.args   help \n", "Command");
@@ -401,6 +494,23 @@ int ListPrograms(size_t argc, const char** argv)
 
 #define REMOTE_SERVER_DEFAULT_PORT 20
 
+/*
+  The pipelined service. A connection to this port carries many requests,
+  each one message holding the packed arguments of a command, as on the
+  default port. The replies come in the order of the requests. A reply is
+  zero or more messages 'D' followed by output of the command, and then
+  one message 'E' followed by the int exit status. The client ends the
+  connection by shutting down its write side.
+
+  The connections are served by RSRV_WORKERS worker processes, created
+  when the server starts. A worker serves one connection at a time, and 
+  runs each command in a thread of its own, with stdout sent to a pipe.
+ */
+#define REMOTE_SERVER_PIPELINE_PORT 21
+#define RSRV_WORKERS 4
+#define RSRV_MAX_REQUEST 2048
+#define RSRV_REPLY_CHUNK 4096
+
 /*
   The server's "global variables".
  */
@@ -413,10 +523,16 @@ struct __rs_globals
 	port_t port;
 	Tid_t listener;
 	Fid_t listener_socket;
+	int listener_alive;
+
+	/* the pipelined service */
+	Fid_t pipeline_socket;
+	Pid_t workers[RSRV_WORKERS];
 
 	/* Statistics */
 	size_t active_conn;
 	size_t total_conn;
+	size_t total_requests;
 
 	/* used so that each connection gets a unique id */
 	size_t conn_id_counter;
@@ -441,23 +557,30 @@ static void log_print(void* __globals);
 static void log_truncate(void* __globals);
 
 static int rsrv_listener_thread(int port, void* __globals);
+static void rsrv_start_workers(void* __globals);
+static void rsrv_stop_workers(void* __globals);
 
 /* the thread that accepts new connections */
 static int rsrv_listener_thread(int port, void* __globals)
 {
-	Fid_t lsock = Socket(port);
+	int rc = 0;
+	Fid_t lsock = SocketEx(port, SOCKET_MESSAGE);
 	if(Listen(lsock) == -1) {
 		printf("Cannot listen to the given port: %d\n", port);
-		return -1;
+		Close(lsock);
+		rc = -1;
+		goto finish;
 	}
 	GS(listener_socket) = lsock;
 
 	/* Accept loop */
 	while(1) {
 		Fid_t sock = Accept(lsock);
+		if(GS(quit)) {
+			if(sock!=NOFILE) Close(sock);
+			break;
+		}
 		if(sock==NOFILE) {
-			/* We failed! Check if we should quit */
-			if(GS(quit)) return 0;
 			log_message(__globals, "listener(port=%d): failed to accept!\n", port);
 		} else {
 			GS(active_conn)++;
@@ -466,7 +589,50 @@ static int rsrv_listener_thread(int port, void* __globals)
 			ThreadDetach(t);
 		}
 	}
-	return 0;
+
+finish:
+	/* Listen detaches this thread, so it cannot be joined */
+	Mutex_Lock(&GS(mx));
+	GS(listener_alive) = 0;
+	Cond_Broadcast(&GS(conn_done));
+	Mutex_Unlock(&GS(mx));
+	return rc;
+}
+
+
+/* Stop the server */
+static void rsrv_quit(void* __globals)
+{
+	GS(quit) = 1;
+	printf("Quitting\n");
+
+	/* 
+		Closing the listener does not wake up Accept, a last connection does.
+		The listener may not be listening yet, so keep trying.
+	*/
+	Mutex_Lock(&GS(mx));
+	while(GS(listener_alive)) {
+		Mutex_Unlock(&GS(mx));
+		Fid_t sock = SocketEx(NOPORT, SOCKET_MESSAGE);
+		Connect(sock, GS(port), 1000);
+		Close(sock);
+		Mutex_Lock(&GS(mx));
+		if(GS(listener_alive))
+			Cond_TimedWait(&GS(mx), &GS(conn_done), 100);
+	}
+	Mutex_Unlock(&GS(mx));
+	if(GS(listener_socket) != NOFILE)
+		Close(GS(listener_socket));
+
+	Mutex_Lock(&GS(mx));
+	while(GS(active_conn)>0) {
+		printf("Waiting %zu connections ...\n", GS(active_conn));
+		Cond_Wait(&GS(mx), &GS(conn_done));
+	}
+	Mutex_Unlock(&GS(mx));
+	rsrv_stop_workers(__globals);
+
+	log_truncate(__globals);
 }
 
 
@@ -484,12 +650,18 @@ int RemoteServer(size_t argc, const char** argv)
 	GS(port) = REMOTE_SERVER_DEFAULT_PORT;
 	GS(active_conn) = 0;
 	GS(total_conn) = 0;
+	GS(total_requests) = 0;
 	GS(conn_id_counter) = 0;
 
 	log_init(__globals);
 
 	/* Start a thread to listen on */
+	GS(listener_socket) = NOFILE;
+	GS(listener_alive) = 1;
 	GS(listener) = CreateThread(rsrv_listener_thread, GS(port), __globals);
+
+	/* Start the workers of the pipelined service */
+	rsrv_start_workers(__globals);
 	
 	/* Enter the server console */
 	char* linebuff = NULL;
@@ -506,32 +678,20 @@ int RemoteServer(size_t argc, const char** argv)
 			goto again; 
 		}
 		if(rc==-1 && feof(fin)) {
+			/* The console is gone, quit */
+			rsrv_quit(__globals);
 			break;
 		}
 
 		assert(linebuff!=NULL);
 
 		if(strcmp(linebuff, "q\n")==0) {
-			/* Quit */
-			GS(quit) = 1;
-			printf("Quitting\n");
-			Close(GS(listener_socket));
-			ThreadJoin(GS(listener), NULL);
-
-			Mutex_Lock(&GS(mx));
-			while(GS(active_conn)>0) {
-				printf("Waiting %zu connections ...\n", GS(active_conn));
-				Cond_Wait(&GS(mx), &GS(conn_done));
-			}
-			Mutex_Unlock(&GS(mx));
-			
-			
-			log_truncate(__globals);
+			rsrv_quit(__globals);
 			break;
 		} else if(strcmp(linebuff, "s\n")==0) {
 			/* Show statistics */
-			printf("Connections: active=%4zd total=%4zd\n", 
-				GS(active_conn), GS(total_conn));
+			printf("Connections: active=%4zd total=%4zd pipelined requests=%4zd\n", 
+				GS(active_conn), GS(total_conn), GS(total_requests));
 		} else if(strcmp(linebuff, "h\n")==0) {
 			printf("Commands: \n"
 			       "q: quit the server\n"
@@ -620,18 +780,6 @@ static void log_truncate(void* __globals)
 
 
 
-/* Helper to receive a message */
-static int recv_message(Fid_t sock, void* buf, size_t len)
-{
-	size_t count = 0;
-	while(count<len) {
-		int rc = Read(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or end of stream */
-		count += rc;
-	}
-	return count==len;
-}
-
 /* Helper to execute a remote process */
 static int rsrv_process(size_t argc, const char** argv)
 {
@@ -669,12 +817,11 @@ static int rsrv_client(int sock, void* __globals)
 
 	log_message(__globals, "Client[%6zu]: started", ID);
 	
-        /* Get the command from the client. The protocol is
-	   [int argl, void* args] where argl is the length of
-	   the subsequent message args.
+        /* Get the command from the client. The request is one
+	   message, holding the packed arguments.
 	 */
-	int argl;
-	if(! recv_message(sock, &argl, sizeof(argl))) {
+	int argl = MessageSize(sock);
+	if(argl < 1) {
 		log_message(__globals,
 			    "Cliend[%6zu]: error in receiving request, aborting", ID);
 		goto finish;
@@ -683,7 +830,7 @@ static int rsrv_client(int sock, void* __globals)
 	assert(argl>0 && argl <= 2048);
 	{
 		char args[argl];
-		if(! recv_message(sock, args, argl)) {
+		if(Read(sock, args, argl) != argl) {
 			log_message(__globals,
 				    "Cliend[%6zu]: error in receiving request, aborting", ID);
 			goto finish;		
@@ -716,32 +863,356 @@ finish:
 	return 0;
 }
 
+
+/* A command run by a worker */
+struct rsrv_job {
+	Program prog;
+	size_t argc;
+	const char** argv;
+	int status;
+};
+
+/* 
+	The thread of a command. Its stdout is the pipe of the reply, until it
+	is pointed back to stdin, which is an empty pipe. This ends the reply.
+ */
+static int rsrv_job_thread(int argl, void* args)
+{
+	struct rsrv_job* job = args;
+	job->status = job->prog(job->argc, job->argv);
+	Dup2(0, 1);
+	return 0;
+}
+
+/* Send a reply message, return 0 on success */
+static int rsrv_reply(Fid_t sock, char tag, const void* data, unsigned int len)
+{
+	char msg[RSRV_REPLY_CHUNK+1];
+	assert(len <= RSRV_REPLY_CHUNK);
+	msg[0] = tag;
+	memcpy(msg+1, data, len);
+	return (Write(sock, msg, len+1) == (int)(len+1)) ? 0 : -1;
+}
+
+/* Run a request of a pipelined connection and send the reply */
+static int rsrv_serve_request(Fid_t sock, size_t argc, const char** argv)
+{
+	int c = getprog_byname(argv[0]);
+	if(c==-1) {
+		char msg[128];
+		int len = snprintf(msg, sizeof(msg), "Error in remote process: Command %s is not found\n", argv[0]);
+		int status = -1;
+		return rsrv_reply(sock, 'D', msg, len) || rsrv_reply(sock, 'E', &status, sizeof(status));
+	}
+
+	pipe_t p;
+	if(Pipe(&p)==-1) return -1;
+	Dup2(p.write, 1);
+	Close(p.write);
+
+	struct rsrv_job job = { COMMANDS[c].prog, argc, argv, 0 };
+	Tid_t t = CreateThread(rsrv_job_thread, 0, &job);
+	if(t==NOTHREAD) {
+		Dup2(0, 1);
+		Close(p.read);
+		return -1;
+	}
+
+	/* Forward the output, until the job closes its end */
+	char buf[RSRV_REPLY_CHUNK];
+	int rc, err = 0;
+	while((rc = Read(p.read, buf, sizeof(buf))) > 0)
+		if(!err && rsrv_reply(sock, 'D', buf, rc)) err = -1;
+	Close(p.read);
+	ThreadJoin(t, NULL);
+
+	if(!err) err = rsrv_reply(sock, 'E', &job.status, sizeof(job.status));
+	return err;
+}
+
+/* Serve the requests of a pipelined connection, until the client is done */
+static void rsrv_serve_connection(void* __globals, Fid_t sock, size_t ID)
+{
+	int argl;
+	size_t count = 0;
+	while((argl = MessageSize(sock)) > 0) {
+		if(argl > RSRV_MAX_REQUEST) {
+			log_message(__globals, "Worker[%6zu]: request too big, aborting", ID);
+			break;
+		}
+		char args[argl];
+		if(Read(sock, args, argl) != argl) break;
+
+		size_t argc = argscount(argl, args);
+		if(argc == 0) break;
+		const char* argv[argc];
+		argvunpack(argc, argv, argl, args);
+
+		if(rsrv_serve_request(sock, argc, argv)) break;
+		count++;
+
+		Mutex_Lock(&GS(mx));
+		GS(total_requests)++;
+		Mutex_Unlock(&GS(mx));
+	}
+	log_message(__globals, "Worker[%6zu]: served %zu requests", ID, count);
+}
+
+struct rsrv_worker_args {
+	void* globals;
+	Fid_t lsock;
+};
+
+/* A worker process, accepting pipelined connections */
+static int rsrv_worker(int argl, void* args)
+{
+	struct rsrv_worker_args* wa = args;
+	void* __globals = wa->globals;
+	Fid_t lsock = wa->lsock;
+
+	/* 
+		The commands read an empty pipe as stdin. Stdout is the same while
+		no command runs, so that fids 0 and 1 are never free for a new pipe.
+	 */
+	pipe_t empty;
+	if(Pipe(&empty)==-1) return -1;
+	Close(empty.write);
+	Dup2(empty.read, 0);
+	Dup2(empty.read, 1);
+	Close(empty.read);
+
+	while(1) {
+		Fid_t sock = Accept(lsock);
+		if(GS(quit)) {
+			if(sock!=NOFILE) Close(sock);
+			break;
+		}
+		if(sock==NOFILE) continue;
+
+		Mutex_Lock(&GS(mx));
+		size_t ID = ++GS(conn_id_counter);
+		GS(total_conn)++;
+		Mutex_Unlock(&GS(mx));
+
+		rsrv_serve_connection(__globals, sock, ID);
+		Close(sock);
+	}
+	return 0;
+}
+
+/* Create the listener of the pipelined service and its workers */
+static void rsrv_start_workers(void* __globals)
+{
+	for(int i=0; i<RSRV_WORKERS; i++) GS(workers)[i] = NOPROC;
+
+	Fid_t lsock = SocketEx(REMOTE_SERVER_PIPELINE_PORT, SOCKET_MESSAGE);
+	if(lsock==NOFILE || Listen(lsock) == -1) {
+		printf("Cannot listen to the given port: %d\n", REMOTE_SERVER_PIPELINE_PORT);
+		if(lsock!=NOFILE) Close(lsock);
+		GS(pipeline_socket) = NOFILE;
+		return;
+	}
+	GS(pipeline_socket) = lsock;
+
+	struct rsrv_worker_args wa = { __globals, lsock };
+	for(int i=0; i<RSRV_WORKERS; i++)
+		GS(workers)[i] = Exec(rsrv_worker, sizeof(wa), &wa);
+}
+
+/* 
+	The workers share the listener, so closing it does not wake them.
+	Instead, after the quit flag is set, each worker gets a last connection,
+	which it accepts when it is done with its client. This is called when
+	the workers are the only children left.
+ */
+static void rsrv_stop_workers(void* __globals)
+{
+	if(GS(pipeline_socket)==NOFILE) return;
+
+	int left = 0;
+	for(int i=0; i<RSRV_WORKERS; i++)
+		if(GS(workers)[i]!=NOPROC) left++;
+
+	while(left > 0) {
+		Fid_t sock = SocketEx(NOPORT, SOCKET_MESSAGE);
+		if(Connect(sock, REMOTE_SERVER_PIPELINE_PORT, 1000)==0) {
+			WaitChild(NOPROC, NULL);
+			left--;
+		}
+		Close(sock);
+	}
+	Close(GS(pipeline_socket));
+}
+
 /*********************
    the client program
 ************************/
 
-/* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+/* The requests in flight on each connection of the load mode */
+#define RCLI_PIPELINE_DEPTH 8
+
+/* Connect to the pipelined service */
+static Fid_t rcli_connect()
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or End of stream */
-		count += rc;
+	Fid_t sock = SocketEx(NOPORT, SOCKET_MESSAGE);
+	if(sock!=NOFILE && Connect(sock, REMOTE_SERVER_PIPELINE_PORT, 1000)==-1) {
+		Close(sock);
+		sock = NOFILE;
 	}
-	if(count!=len) {
-		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
-		Exit(1);
+	return sock;
+}
+
+/* Send a request, as one message */
+static int rcli_send(Fid_t sock, size_t argc, const char** argv)
+{
+	int argl = argvlen(argc, argv);
+	char args[argl];
+	argvpack(args, argc, argv);
+	return (Write(sock, args, argl) == argl) ? 0 : -1;
+}
+
+/* Receive a reply, copying the output to out unless it is NOFILE */
+static int rcli_recv(Fid_t sock, Fid_t out, int* status)
+{
+	char msg[RSRV_REPLY_CHUNK+1];
+	for(;;) {
+		int rc = Read(sock, msg, sizeof(msg));
+		if(rc < 1) return -1;
+		if(msg[0] == 'E' && rc == 1+sizeof(int)) {
+			memcpy(status, msg+1, sizeof(int));
+			return 0;
+		}
+		if(msg[0] != 'D') return -1;
+		if(out != NOFILE && rc > 1 && Write(out, msg+1, rc-1) != rc-1) return -1;
 	}
 }
 
+/* rcli -p: run one command on the pipelined service */
+static int rcli_pipelined(size_t argc, const char** argv)
+{
+	Fid_t sock = rcli_connect();
+	if(sock==NOFILE) {
+		printf("Could not connect to the server\n");
+		return -1;
+	}
+
+	int status = -1;
+	if(rcli_send(sock, argc, argv) || rcli_recv(sock, 1, &status))
+		printf("In client: I/O error\n");
+	ShutDown(sock, SHUTDOWN_WRITE);
+	Close(sock);
+	return status;
+}
+
+/* A connection of the load mode */
+struct rcli_conn {
+	size_t argc;
+	const char** argv;
+	int requests;
+	TimerDuration* lat;    /* the latency of each request */
+	int done;
+};
+
+static int rcli_conn_thread(int argl, void* args)
+{
+	struct rcli_conn* C = args;
+	C->done = 0;
+
+	Fid_t sock = rcli_connect();
+	if(sock==NOFILE) return -1;
+
+	/* Keep up to RCLI_PIPELINE_DEPTH requests in flight */
+	TimerDuration sent_at[RCLI_PIPELINE_DEPTH];
+	int sent = 0;
+	while(C->done < C->requests) {
+		while(sent < C->requests && sent - C->done < RCLI_PIPELINE_DEPTH) {
+			sent_at[sent % RCLI_PIPELINE_DEPTH] = bios_clock();
+			if(rcli_send(sock, C->argc, C->argv)) goto finish;
+			sent++;
+		}
+		int status;
+		if(rcli_recv(sock, NOFILE, &status)) goto finish;
+		C->lat[C->done] = bios_clock() - sent_at[C->done % RCLI_PIPELINE_DEPTH];
+		C->done++;
+	}
+
+finish:
+	ShutDown(sock, SHUTDOWN_WRITE);
+	Close(sock);
+	return 0;
+}
+
+static int rcli_cmp_lat(const void* a, const void* b)
+{
+	TimerDuration x = *(const TimerDuration*)a, y = *(const TimerDuration*)b;
+	return (x > y) - (x < y);
+}
+
+/* rcli -l: issue requests over concurrent connections and report the latency */
+static int rcli_load(int requests, int conns, size_t argc, const char** argv)
+{
+	if(requests < 1 || conns < 1 || argc < 1) {
+		printf("Usage: rcli -l <requests> <conns> <cmd> [<args...>]\n");
+		return -1;
+	}
+	if(conns > requests) conns = requests;
+
+	TimerDuration* lat = xmalloc(requests * sizeof(TimerDuration));
+	struct rcli_conn C[conns];
+	Tid_t T[conns];
+
+	TimerDuration t0 = bios_clock();
+	int off = 0;
+	for(int i=0; i<conns; i++) {
+		C[i].argc = argc;
+		C[i].argv = argv;
+		C[i].requests = requests/conns + (i < requests%conns);
+		C[i].lat = lat + off;
+		off += C[i].requests;
+		T[i] = CreateThread(rcli_conn_thread, 0, &C[i]);
+	}
+
+	/* Pack the latencies of the completed requests */
+	int done = 0;
+	for(int i=0; i<conns; i++) {
+		ThreadJoin(T[i], NULL);
+		memmove(lat + done, C[i].lat, C[i].done * sizeof(TimerDuration));
+		done += C[i].done;
+	}
+	double secs = (bios_clock() - t0) / 1E6;
+
+	if(done < requests)
+		printf("%d of %d requests failed\n", requests - done, requests);
+	if(done > 0) {
+		qsort(lat, done, sizeof(TimerDuration), rcli_cmp_lat);
+		#define PCT(p) ((unsigned long) lat[(int)((p) * (done-1) / 100.0 + 0.5)])
+		printf("%d requests on %d connections in %.3f s: %.0f req/s\n",
+			done, conns, secs, secs > 0 ? done / secs : 0.0);
+		printf("latency (usec): p50=%lu p90=%lu p99=%lu max=%lu\n",
+			PCT(50), PCT(90), PCT(99), (unsigned long) lat[done-1]);
+		#undef PCT
+	}
+	free(lat);
+	return (done == requests) ? 0 : 1;
+}
+
+
 /* the remote client program */
 int RemoteClient(size_t argc, const char** argv)
 {
 	checkargs(1);
+
+	if(strcmp(argv[1], "-p")==0) {
+		checkargs(2);
+		return rcli_pipelined(argc-2, argv+2);
+	}
+	if(strcmp(argv[1], "-l")==0) {
+		checkargs(4);
+		return rcli_load(getint(2), getint(3), argc-4, argv+4);
+	}
 	
 	/* Create a socket to the server */
-	Fid_t sock = Socket(NOPORT);
+	Fid_t sock = SocketEx(NOPORT, SOCKET_MESSAGE);
 	if(Connect(sock, REMOTE_SERVER_DEFAULT_PORT, 1000)==-1) {
 		printf("Could not connect to the server\n");
 		return -1;
@@ -754,9 +1225,11 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send the request, as one message */
+	if(Write(sock, args, argl) != argl) {
+		printf("In client: I/O error writing %d bytes\n", argl);
+		Exit(1);
+	}
 	ShutDown(sock, SHUTDOWN_WRITE);
 
 	/* Read the server data and display */
@@ -780,25 +1253,68 @@ int RemoteClient(size_t argc, const char** argv)
 ***************************************/
 
 
+int process_line(int argc, const char** argv);
+
+
+/* Get the byte counts of the reaped children of the current process */
+static int get_child_io(unsigned long* nread, unsigned long* nwritten)
+{
+	Fid_t finfo = OpenInfo();
+	if(finfo==NOFILE) return -1;
+
+	Pid_t self = GetPid();
+	procinfo info;
+	int found = -1;
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0)
+		if(info.pid == self) {
+			*nread = info.child_io_read;
+			*nwritten = info.child_io_written;
+			found = 0;
+			break;
+		}
+	Close(finfo);
+	return found;
+}
+
+
+/* time <pipeline>: run the pipeline and report its elapsed time and I/O */
+static void time_pipeline(int argc, const char** argv)
+{
+	unsigned long r0=0, w0=0, r1=0, w1=0;
+	get_child_io(&r0, &w0);
+	TimerDuration t0 = bios_clock();
+
+	process_line(argc, argv);
+
+	TimerDuration t1 = bios_clock();
+	get_child_io(&r1, &w1);
+
+	double secs = (t1 - t0) / 1E6;
+	unsigned long nread = r1 - r0, nwritten = w1 - w0;
+	printf("real %.3f s, read %lu bytes, written %lu bytes", secs, nread, nwritten);
+	if(secs > 0)
+		printf(", %.2f MB/s", nwritten / secs / (1024*1024));
+	printf("\n");
+}
+
+
 int process_builtin(int argc, const char** argv)
 {
 	if(strcmp(argv[0], "?")==0) {
 		printf("Type 'help' for help, 'exit' to quit.\n");
 		return 1;
 	}
+	if(strcmp(argv[0], "time")==0) {
+		if(argc > 1)
+			time_pipeline(argc-1, argv+1);
+		else
+			printf("Usage: time <prog> [<args...>] [| <prog> [<args...>]]...\n");
+		return 1;
+	}
 	return 0;
 }
 
 
-static inline Fid_t savefid(Fid_t fsaved)
-{
-	Fid_t savior = OpenNull();
-	assert(savior!=NOFILE);
-	Dup2(fsaved, savior);
-	return savior;
-}
-
-
 int process_line(int argc, const char** argv)
 {
 	/* Split up into pipeline fragments */
@@ -836,42 +1352,32 @@ int process_line(int argc, const char** argv)
 		comd[i] = c;
 	}
 
-	/* Construct pipeline */
+	/* Construct pipeline. Each child gets its stdin and stdout only, by one
+	   Spawn: it takes over the read end of the previous pipe, and all but the 
+	   last get the write end of a new one. */
 	int child[frag];
-	int savein, saveout;
-
-	savein = savefid(0);
-	saveout = savefid(1);
+	Fid_t fdin = 0;
 
-	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
-		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
-		}
-
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
-
-		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
+		fd_action actions[2] = {
+			{ (fdin != 0) ? SPAWN_MOVE : SPAWN_DUP, 0, fdin },
+			(i<frag-1) ? (fd_action){ SPAWN_PIPE_WRITE, 1, NOFILE } : (fd_action){ SPAWN_DUP, 1, 1 }
+		};
+		child[i] = ExecuteSpawn(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i], actions, 2);
+
+		if(child[i] == NOPROC) {
+			printf("Error: could not start '%s'\n", Vargv[i][0]);
+			if(fdin != 0) Close(fdin);
+			while(++i < frag) child[i] = NOPROC;
+			break;
 		}
+		if(i<frag-1) fdin = actions[1].src;
 	}
 
 	/* Wait for the children */
 	for(int i=0; i<frag; i++) {
 		int exitval;
+		if(child[i] == NOPROC) continue;
 		WaitChild(child[i], &exitval);
 		if(exitval) 
 			printf("%s exited with status %d\n", Vargv[i][0], exitval);						
@@ -6,25 +6,45 @@
 #include <stdio_ext.h>
 
 #include "util.h"
+#include "bios.h"
 #include "tinyos.h"
 #include "tinyoslib.h"
 
 
 
+/* 
+	A stream of fidopen. The streams of all the processes are kept in one
+	list, so that a process can find its own.
+ */
+typedef struct fid_stream {
+	Fid_t fid;
+	Pid_t owner;
+	FILE* file;
+	rlnode node;
+} fid_stream;
+
+static rlnode fid_streams = { .prev = &fid_streams, .next = &fid_streams };
+static FastMutex fid_streams_mx = FASTMUTEX_INIT;
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	int ret = Write(((fid_stream*)cookie)->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* s = cookie;
+	FastMutex_Lock(& fid_streams_mx);
+	rlist_remove(& s->node);
+	FastMutex_Unlock(& fid_streams_mx);
+	free(s);
 	return 0;
 }
 
@@ -36,9 +56,13 @@ static cookie_io_functions_t  tinyos_fid_functions =
 	tinyos_fid_close
 };
 
+/* 
+	The streams of stdio are shared by all the processes, and each one
+	writes to its own fid 1, so they cannot be buffered.
+ */
 static FILE* get_std_stream(int fid, const char* mode)
 {
-	FILE* term = fidopen(fid, mode);
+	FILE* term = fidopen_buffered(fid, mode, _IONBF, 0);
 	assert(term);
 	/* This is glibc-specific and tunrs off fstream locking */
 	__fsetlocking(term, FSETLOCKING_BYCALLER);	
@@ -48,15 +72,56 @@ static FILE* get_std_stream(int fid, const char* mode)
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	return fidopen_buffered(fid, mode, FIDOPEN_AUTO, 0);
+}
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int bufmode, size_t size)
+{
+	if(bufmode == FIDOPEN_AUTO) {
+		int type = StreamType(fid);
+		bufmode = (type == STREAM_PIPE || type == STREAM_SOCKET) ? _IOFBF : _IONBF;
+	}
+	if(size == 0) size = FIDOPEN_BUFSIZE;
+
+	fid_stream* s = (fid_stream*) xmalloc(sizeof(fid_stream));
+	s->fid = fid;
+	s->owner = GetPid();
+	FILE* f = fopencookie(s, mode, tinyos_fid_functions);
+	if(f == NULL) {
+		free(s);
+		return NULL;
+	}
+	s->file = f;
+
+	/* With a NULL buffer, stdio allocates one of the given size */
+	CHECKRC(setvbuf(f, NULL, bufmode, (bufmode == _IONBF) ? 0 : size));
+
+	FastMutex_Lock(& fid_streams_mx);
+	rlnode_init(& s->node, s);
+	rlist_push_back(& fid_streams, & s->node);
+	FastMutex_Unlock(& fid_streams_mx);
 	return f;
 }
 
+
+void fidclose_all()
+{
+	Pid_t self = GetPid();
+	for(;;) {
+		FILE* f = NULL;
+		FastMutex_Lock(& fid_streams_mx);
+		for(rlnode* p = fid_streams.next; p != &fid_streams; p = p->next) {
+			fid_stream* s = p->obj;
+			if(s->owner == self) { f = s->file; break; }
+		}
+		FastMutex_Unlock(& fid_streams_mx);
+
+		if(f == NULL) break;
+		fclose(f);
+	}
+}
+
 FILE *saved_in = NULL, *saved_out = NULL;
 
 
@@ -107,8 +172,10 @@ static int exec_wrapper(int argl, void* args)
 	const char* argv[argc];
 	argvunpack(argc, argv, argl, args);
 
-	/* Make the call */
-	return prog(argc, argv);
+	/* Make the call, and flush what the program left in its streams */
+	int exitval = prog(argc, argv);
+	fidclose_all();
+	return exitval;
 }
 
 
@@ -145,6 +212,12 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 
 
 int Execute(Program prog, size_t argc, const char** argv)
+{
+	return ExecuteEx(prog, argc, argv, NULL, 0);
+}
+
+
+int ExecuteEx(Program prog, size_t argc, const char** argv, const Fid_t* fdmap, int nfds)
 {
 	/* We will pack the prog pointer and the arguments to 
 	  an argument buffer.
@@ -153,8 +226,13 @@ int Execute(Program prog, size_t argc, const char** argv)
 	/* compute the argument buffer size */
 	size_t argl = argvlen(argc, argv) + sizeof(prog);
 
-	/* allocate the buffer */
-	char args[argl];
+	/* 
+		Small arguments are packed on the stack and copied inside the process 
+		table. Larger ones are packed on the heap and given to the process,
+		so that they are not copied again.
+	 */
+	char small[EXEC_INLINE_ARGS];
+	char* args = (argl <= EXEC_INLINE_ARGS) ? small : xmalloc(argl);
 
 	/* put the pointer at the start */
 	memcpy(args, &prog, sizeof(prog));
@@ -163,6 +241,671 @@ int Execute(Program prog, size_t argc, const char** argv)
 	argvpack(args+sizeof(prog), argc, argv);
 
 	/* Execute the process */
-	return Exec(exec_wrapper, argl, args);
+	if(args == small)
+		return ExecEx(exec_wrapper, argl, args, 0, fdmap, nfds);
+	else
+		return ExecGive(exec_wrapper, argl, args, 0, fdmap, nfds);
+}
+
+
+int ExecuteSpawn(Program prog, size_t argc, const char** argv, fd_action* actions, int n)
+{
+	/* Pack the arguments as ExecuteEx does. Spawn copies them. */
+	size_t argl = argvlen(argc, argv) + sizeof(prog);
+	char small[EXEC_INLINE_ARGS];
+	char* args = (argl <= EXEC_INLINE_ARGS) ? small : xmalloc(argl);
+	memcpy(args, &prog, sizeof(prog));
+	argvpack(args+sizeof(prog), argc, argv);
+
+	Pid_t pid = Spawn(exec_wrapper, argl, args, actions, n);
+	if(args != small) free(args);
+	return pid;
+}
+
+
+
+/*
+	Futex-based synchronization. 
+ */
+
+void FastMutex_Lock(FastMutex* mx)
+{
+	int c = 0;
+	if(__atomic_compare_exchange_n(mx, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* Mark it contended, and sleep until we take it */
+	if(c != 2)
+		c = __atomic_exchange_n(mx, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		Futex(mx, FUTEX_WAIT, 2, FUTEX_INFINITE);
+		c = __atomic_exchange_n(mx, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+void FastMutex_Unlock(FastMutex* mx)
+{
+	if(__atomic_exchange_n(mx, 0, __ATOMIC_RELEASE) == 2)
+		Futex(mx, FUTEX_WAKE, 1, 0);
+}
+
+
+static int fastsem_trydown(FastSem* sem)
+{
+	int v = __atomic_load_n(& sem->value, __ATOMIC_RELAXED);
+	while(v > 0)
+		if(__atomic_compare_exchange_n(& sem->value, &v, v-1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+int FastSem_TimedWait(FastSem* sem, timeout_t timeout)
+{
+	while(! fastsem_trydown(sem)) {
+		__atomic_add_fetch(& sem->waiters, 1, __ATOMIC_SEQ_CST);
+		int rc = Futex(& sem->value, FUTEX_WAIT, 0, timeout);
+		__atomic_sub_fetch(& sem->waiters, 1, __ATOMIC_SEQ_CST);
+
+		/* A timeout, unless the value changed under our feet */
+		if(rc == -1 && timeout != FUTEX_INFINITE && __atomic_load_n(& sem->value, __ATOMIC_RELAXED) == 0)
+			return fastsem_trydown(sem);
+	}
+	return 1;
+}
+
+void FastSem_Wait(FastSem* sem)
+{
+	FastSem_TimedWait(sem, FUTEX_INFINITE);
+}
+
+void FastSem_Post(FastSem* sem)
+{
+	__atomic_add_fetch(& sem->value, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(& sem->waiters, __ATOMIC_SEQ_CST) > 0)
+		Futex(& sem->value, FUTEX_WAKE, 1, 0);
+}
+
+
+int FastBarrier_Wait(FastBarrier* bar)
+{
+	int gen = __atomic_load_n(& bar->generation, __ATOMIC_ACQUIRE);
+	if(__atomic_add_fetch(& bar->arrived, 1, __ATOMIC_ACQ_REL) == bar->count) {
+		/* The last one starts the next round */
+		__atomic_store_n(& bar->arrived, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(& bar->generation, 1, __ATOMIC_RELEASE);
+		Futex(& bar->generation, FUTEX_WAKE, bar->count, 0);
+		return 1;
+	}
+	while(__atomic_load_n(& bar->generation, __ATOMIC_ACQUIRE) == gen)
+		Futex(& bar->generation, FUTEX_WAIT, gen, FUTEX_INFINITE);
+	return 0;
+}
+
+
+
+/*
+	The executor.
+
+	Each worker has a deque of tasks: the worker pushes and pops at the
+	back, and thieves take from the front. Tasks from non-workers go to 
+	a shared queue. 'queued' counts the tasks in all the queues; idle 
+	workers sleep on 'work_cv' until it is positive.
+ */
+
+struct executor_task {
+	rlnode node;          /* node in a queue */
+	struct executor* ex;  /* the executor the task was submitted to */
+	Task task;
+	int argl;
+	void* args;
+	int result;
+	int state;            /* TASK_PENDING, TASK_DONE or TASK_DETACHED */
+};
+
+enum { TASK_PENDING, TASK_DONE, TASK_DETACHED };
+
+typedef struct executor_worker {
+	Tid_t tid;
+	Mutex lock;           /* protects deque */
+	rlnode deque;
+} executor_worker;
+
+struct executor {
+	int nworkers;
+	executor_worker* workers;
+
+	Mutex lock;           /* protects shared, idle and shutdown */
+	CondVar work_cv;      /* signalled when tasks are queued */
+	rlnode shared;
+	int queued;
+	int idle;
+	int shutdown;
+};
+
+
+/* Return the worker that the current thread is, or NULL */
+static executor_worker* executor_self(Executor* ex)
+{
+	Tid_t self = ThreadSelf();
+	for(int i=0; i<ex->nworkers; i++)
+		if(ex->workers[i].tid == self) return & ex->workers[i];
+	return NULL;
+}
+
+static struct executor_task* executor_pop(Mutex* lock, rlnode* queue, int back)
+{
+	struct executor_task* t = NULL;
+	Mutex_Lock(lock);
+	if(! is_rlist_empty(queue))
+		t = (back ? rlist_pop_back(queue) : rlist_pop_front(queue))->obj;
+	Mutex_Unlock(lock);
+	return t;
+}
+
+/* Take a task: our own newest first, then the shared queue, then steal the oldest */
+static struct executor_task* executor_take(Executor* ex, executor_worker* me)
+{
+	if(__atomic_load_n(& ex->queued, __ATOMIC_SEQ_CST) == 0) return NULL;
+
+	struct executor_task* t = NULL;
+	if(me) t = executor_pop(& me->lock, & me->deque, 1);
+	if(t == NULL) t = executor_pop(& ex->lock, & ex->shared, 0);
+	int start = me ? (int)(me - ex->workers) : 0;
+	for(int i=1; t == NULL && i <= ex->nworkers; i++) {
+		executor_worker* w = & ex->workers[(start + i) % ex->nworkers];
+		if(w != me) t = executor_pop(& w->lock, & w->deque, 0);
+	}
+	if(t) __atomic_sub_fetch(& ex->queued, 1, __ATOMIC_SEQ_CST);
+	return t;
+}
+
+static void executor_run(struct executor_task* t)
+{
+	t->result = t->task(t->argl, t->args);
+	int pending = TASK_PENDING;
+	if(__atomic_compare_exchange_n(& t->state, &pending, TASK_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		Futex(& t->state, FUTEX_WAKE, 1, 0);
+	else
+		free(t);  /* detached */
+}
+
+static int executor_worker_main(int argl, void* args)
+{
+	Executor* ex = args;
+	executor_worker* me = & ex->workers[argl];
+
+	/* The creator sets our tid, wait until it has */
+	Mutex_Lock(& ex->lock);
+	Mutex_Unlock(& ex->lock);
+
+	while(1) {
+		struct executor_task* t = executor_take(ex, me);
+		if(t) {
+			executor_run(t);
+			continue;
+		}
+
+		Mutex_Lock(& ex->lock);
+		ex->idle++;
+		while(__atomic_load_n(& ex->queued, __ATOMIC_SEQ_CST) == 0 && !ex->shutdown)
+			Cond_Wait(& ex->lock, & ex->work_cv);
+		ex->idle--;
+		int done = ex->shutdown && ex->queued == 0;
+		Mutex_Unlock(& ex->lock);
+		if(done) return 0;
+	}
+}
+
+
+Executor* Executor_Create(int nworkers)
+{
+	if(nworkers <= 0) return NULL;
+
+	Executor* ex = xmalloc(sizeof(Executor));
+	ex->nworkers = nworkers;
+	ex->workers = xmalloc(nworkers * sizeof(executor_worker));
+	ex->lock = MUTEX_INIT;
+	ex->work_cv = COND_INIT;
+	rlnode_init(& ex->shared, NULL);
+	ex->queued = ex->idle = ex->shutdown = 0;
+
+	Mutex_Lock(& ex->lock);
+	for(int i=0; i<nworkers; i++) {
+		executor_worker* w = & ex->workers[i];
+		w->lock = MUTEX_INIT;
+		rlnode_init(& w->deque, NULL);
+		w->tid = NOTHREAD;
+	}
+	int created = 0;
+	for(; created<nworkers; created++)
+		if((ex->workers[created].tid = CreateThread(executor_worker_main, created, ex)) == NOTHREAD)
+			break;
+	ex->nworkers = created;
+	Mutex_Unlock(& ex->lock);
+
+	if(created < nworkers) {
+		Executor_Destroy(ex);
+		return NULL;
+	}
+	return ex;
+}
+
+
+Future* Executor_Submit(Executor* ex, Task task, int argl, void* args)
+{
+	struct executor_task* t = xmalloc(sizeof(struct executor_task));
+	t->task = task;
+	t->argl = argl;
+	t->args = args;
+	t->state = TASK_PENDING;
+	t->ex = ex;
+	rlnode_init(& t->node, t);
+
+	executor_worker* me = executor_self(ex);
+	if(me) {
+		Mutex_Lock(& me->lock);
+		rlist_push_back(& me->deque, & t->node);
+		Mutex_Unlock(& me->lock);
+		__atomic_add_fetch(& ex->queued, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(& ex->idle, __ATOMIC_SEQ_CST) > 0) {
+			Mutex_Lock(& ex->lock);
+			Cond_Signal(& ex->work_cv);
+			Mutex_Unlock(& ex->lock);
+		}
+	} else {
+		Mutex_Lock(& ex->lock);
+		rlist_push_back(& ex->shared, & t->node);
+		__atomic_add_fetch(& ex->queued, 1, __ATOMIC_SEQ_CST);
+		if(ex->idle > 0) Cond_Signal(& ex->work_cv);
+		Mutex_Unlock(& ex->lock);
+	}
+	return t;
 }
 
+
+int Future_Wait(Future* f)
+{
+	/* A worker runs other tasks while it waits, else it might wait for itself */
+	executor_worker* me = executor_self(f->ex);
+
+	while(__atomic_load_n(& f->state, __ATOMIC_ACQUIRE) == TASK_PENDING) {
+		struct executor_task* t = me ? executor_take(f->ex, me) : NULL;
+		if(t)
+			executor_run(t);
+		else
+			Futex(& f->state, FUTEX_WAIT, TASK_PENDING, me ? 1 : FUTEX_INFINITE);
+	}
+
+	int result = f->result;
+	free(f);
+	return result;
+}
+
+
+void Future_Detach(Future* f)
+{
+	int pending = TASK_PENDING;
+	if(! __atomic_compare_exchange_n(& f->state, &pending, TASK_DETACHED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		free(f);  /* done */
+}
+
+
+void Executor_Destroy(Executor* ex)
+{
+	Mutex_Lock(& ex->lock);
+	ex->shutdown = 1;
+	Cond_Broadcast(& ex->work_cv);
+	Mutex_Unlock(& ex->lock);
+
+	for(int i=0; i<ex->nworkers; i++)
+		ThreadJoin(ex->workers[i].tid, NULL);
+	free(ex->workers);
+	free(ex);
+}
+
+
+/*
+	The coroutines.
+
+	A coroutine is allocated as a block of CO_STACK_SIZE bytes, aligned to
+	its size, which starts with its descriptor and holds its stack after it.
+	So, a coroutine finds its descriptor by masking the address of any of 
+	its local variables.
+
+	A carrier runs a coroutine by switching to it, and the coroutine switches
+	back after setting its state. The carrier then puts it in the run queue
+	or the parked list, or frees it, so that no other carrier can switch to
+	a coroutine before its context is saved.
+
+	'work' is posted once for each coroutine made runnable, and the idle 
+	carriers sleep on it. The poller sleeps in Poll instead, so the 'wake' 
+	pipe is polled along with the parked coroutines, and a byte is written 
+	to it when the poller must look again.
+ */
+
+enum { CO_RUNNABLE, CO_PARKED, CO_DONE };
+
+typedef struct coroutine {
+	rlnode node;              /* node in the run queue or the parked list */
+	CoScheduler* sched;
+	cpu_context_t ctx;        /* the context of the coroutine, when switched out */
+	cpu_context_t* carrier;   /* the context of its carrier, when running */
+	Task task;
+	int argl;
+	void* args;
+	int state;
+	Fid_t fid;                /* the stream of a parked coroutine */
+	int events;               /* the events to wait for, then the ready events */
+	TimerDuration deadline;   /* when to stop waiting, or CO_NO_DEADLINE */
+} Coroutine;
+
+/* Polls longer than this may leave parked coroutines unpolled, in msec */
+#define CO_POLL_SLICE 10
+
+/* The deadline of a coroutine that waits for ever */
+#define CO_NO_DEADLINE ((TimerDuration)-1)
+
+struct co_scheduler {
+	FastMutex lock;           /* protects the fields below */
+	rlnode runq;
+	rlnode parked;
+	int live;                 /* the coroutines not finished */
+	int polling;              /* a carrier is the poller */
+	int wake_pending;         /* a byte is in the wake pipe */
+	int shutdown;
+
+	FastSem work;
+	pipe_t wake;
+
+	int nthreads;
+	Tid_t* threads;
+
+	/* The arguments of the poller */
+	Fid_t pfids[MAX_POLL_FIDS];
+	int pevents[MAX_POLL_FIDS];
+	Coroutine* pcos[MAX_POLL_FIDS];
+};
+
+
+static Coroutine* co_self()
+{
+	/* The asm hides that the address is that of a local variable. Else, 
+	   the compiler takes the descriptor for that variable, which no call 
+	   can change, and keeps its fields in registers across the switches. */
+	char here;
+	uintptr_t addr = (uintptr_t) &here;
+	__asm__ volatile("" : "+r"(addr));
+	return (Coroutine*) (addr & ~(uintptr_t)(CO_STACK_SIZE-1));
+}
+
+static void co_start()
+{
+	Coroutine* co = co_self();
+	co->task(co->argl, co->args);
+	co->state = CO_DONE;
+	cpu_swap_context(& co->ctx, co->carrier);
+}
+
+/* Switch to the carrier, leaving the coroutine in a state */
+static void co_switch_out(int state)
+{
+	Coroutine* co = co_self();
+	co->state = state;
+	cpu_swap_context(& co->ctx, co->carrier);
+}
+
+
+/* Make the poller look again. The lock is held. */
+static void co_wake_poller(CoScheduler* s)
+{
+	if(s->polling && !s->wake_pending) {
+		s->wake_pending = 1;
+		Write(s->wake.write, "", 1);
+	}
+}
+
+/* Called when the last coroutine finishes, or at shutdown. The lock is held. */
+static void co_check_done(CoScheduler* s)
+{
+	if(s->live == 0 && s->shutdown)
+		for(int i=0; i<s->nthreads; i++) FastSem_Post(& s->work);
+}
+
+static void co_make_runnable(CoScheduler* s, Coroutine* co)
+{
+	co->state = CO_RUNNABLE;
+	rlist_push_back(& s->runq, & co->node);
+	FastSem_Post(& s->work);
+}
+
+
+/* Poll the parked coroutines, with the lock held, and make the ready ones runnable */
+static void co_poll(CoScheduler* s)
+{
+	s->polling = 1;
+
+	int n = 1;
+	s->pfids[0] = s->wake.read;
+	s->pevents[0] = POLL_READ;
+
+	TimerDuration now = bios_clock();
+	TimerDuration first = CO_NO_DEADLINE;
+	for(rlnode* p = s->parked.next; p != & s->parked && n < MAX_POLL_FIDS; p = p->next, n++) {
+		Coroutine* co = p->obj;
+		s->pcos[n] = co;
+		s->pfids[n] = co->fid;
+		s->pevents[n] = co->events;
+		if(co->deadline < first) first = co->deadline;
+	}
+	timeout_t timeout = POLL_INFINITE;
+	if(first != CO_NO_DEADLINE)
+		timeout = (first <= now) ? 0 : (first - now + 999) / 1000;
+	if(n == MAX_POLL_FIDS && timeout > CO_POLL_SLICE)
+		timeout = CO_POLL_SLICE;
+
+	FastMutex_Unlock(& s->lock);
+	int ready = Poll(s->pfids, s->pevents, n, timeout);
+	FastMutex_Lock(& s->lock);
+
+	/* On error, find the illegal fids one by one */
+	if(ready < 0) {
+		for(int i=0; i<n; i++) {
+			int ev = s->pevents[i];
+			s->pevents[i] = (Poll(& s->pfids[i], &ev, 1, 0) < 0) ? -1 : ev;
+		}
+	}
+
+	if(s->pevents[0] > 0) {
+		char buf[16];
+		while(Read(s->wake.read, buf, sizeof(buf)) > 0) ;
+		s->wake_pending = 0;
+	}
+
+	/* The polled coroutines that are not ready go to the back, after the unpolled ones */
+	now = bios_clock();
+	for(int i=1; i<n; i++) {
+		Coroutine* co = s->pcos[i];
+		rlist_remove(& co->node);
+		if(s->pevents[i] != 0 || (co->deadline != CO_NO_DEADLINE && co->deadline <= now)) {
+			co->events = s->pevents[i];
+			co_make_runnable(s, co);
+		} else
+			rlist_push_back(& s->parked, & co->node);
+	}
+
+	s->polling = 0;
+}
+
+
+static int co_carrier(int argl, void* args)
+{
+	CoScheduler* s = args;
+	cpu_context_t here;
+
+	FastMutex_Lock(& s->lock);
+	while(1) {
+		if(! is_rlist_empty(& s->runq)) {
+			Coroutine* co = rlist_pop_front(& s->runq)->obj;
+			FastMutex_Unlock(& s->lock);
+			co->carrier = & here;
+			cpu_swap_context(& here, & co->ctx);
+			FastMutex_Lock(& s->lock);
+
+			switch(co->state) {
+				case CO_RUNNABLE: 
+					co_make_runnable(s, co);
+					break;
+				case CO_PARKED: 
+					rlist_push_back(& s->parked, & co->node);
+					co_wake_poller(s);
+					break;
+				case CO_DONE:
+					free(co);
+					s->live--;
+					co_check_done(s);
+					break;
+			}
+			continue;
+		}
+
+		if(s->live == 0 && s->shutdown) break;
+
+		if(! s->polling && ! is_rlist_empty(& s->parked)) {
+			co_poll(s);
+			continue;
+		}
+
+		FastMutex_Unlock(& s->lock);
+		FastSem_Wait(& s->work);
+		FastMutex_Lock(& s->lock);
+	}
+	FastMutex_Unlock(& s->lock);
+	return 0;
+}
+
+
+CoScheduler* CoScheduler_Create(int nthreads)
+{
+	if(nthreads <= 0) return NULL;
+
+	CoScheduler* s = xmalloc(sizeof(CoScheduler));
+	s->lock = FASTMUTEX_INIT;
+	rlnode_init(& s->runq, NULL);
+	rlnode_init(& s->parked, NULL);
+	s->live = s->polling = s->wake_pending = s->shutdown = 0;
+	s->work = FASTSEM_INIT(0);
+	s->threads = xmalloc(nthreads * sizeof(Tid_t));
+	s->nthreads = 0;
+
+	if(Pipe(& s->wake) != 0) {
+		free(s->threads);
+		free(s);
+		return NULL;
+	}
+	SetNonBlocking(s->wake.read, 1);
+	SetNonBlocking(s->wake.write, 1);
+
+	for(; s->nthreads < nthreads; s->nthreads++)
+		if((s->threads[s->nthreads] = CreateThread(co_carrier, 0, s)) == NOTHREAD)
+			break;
+
+	if(s->nthreads < nthreads) {
+		CoScheduler_Destroy(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+int CoScheduler_Spawn(CoScheduler* s, Task task, int argl, void* args)
+{
+	Coroutine* co = aligned_alloc(CO_STACK_SIZE, CO_STACK_SIZE);
+	if(co == NULL) return -1;
+	co->sched = s;
+	co->task = task;
+	co->argl = argl;
+	co->args = args;
+	rlnode_init(& co->node, co);
+	cpu_initialize_context(& co->ctx, co+1, CO_STACK_SIZE - sizeof(Coroutine), co_start);
+
+	FastMutex_Lock(& s->lock);
+	if(s->shutdown) {
+		FastMutex_Unlock(& s->lock);
+		free(co);
+		return -1;
+	}
+	s->live++;
+	co_make_runnable(s, co);
+	co_wake_poller(s);
+	FastMutex_Unlock(& s->lock);
+	return 0;
+}
+
+
+void CoScheduler_Destroy(CoScheduler* s)
+{
+	FastMutex_Lock(& s->lock);
+	s->shutdown = 1;
+	co_check_done(s);
+	FastMutex_Unlock(& s->lock);
+
+	for(int i=0; i<s->nthreads; i++)
+		ThreadJoin(s->threads[i], NULL);
+	Close(s->wake.read);
+	Close(s->wake.write);
+	free(s->threads);
+	free(s);
+}
+
+
+void Co_Yield()
+{
+	co_switch_out(CO_RUNNABLE);
+}
+
+
+int Co_Wait(Fid_t fid, int events, timeout_t timeout)
+{
+	Coroutine* co = co_self();
+	co->fid = fid;
+	co->events = events;
+	co->deadline = (timeout == POLL_INFINITE) ? CO_NO_DEADLINE : bios_clock() + timeout*1000ul;
+	co_switch_out(CO_PARKED);
+	return co->events;
+}
+
+
+int Co_Read(Fid_t fid, char* buf, unsigned int size)
+{
+	int rc;
+	while((rc = Read(fid, buf, size)) == WOULDBLOCK)
+		if(Co_Wait(fid, POLL_READ, POLL_INFINITE) < 0) return -1;
+	return rc;
+}
+
+
+int Co_Write(Fid_t fid, const char* buf, unsigned int size)
+{
+	int rc;
+	while((rc = Write(fid, buf, size)) == WOULDBLOCK)
+		if(Co_Wait(fid, POLL_WRITE, POLL_INFINITE) < 0) return -1;
+	return rc;
+}
+
+
+Fid_t Co_Accept(Fid_t lsock)
+{
+	Fid_t rc;
+	while((rc = Accept(lsock)) == WOULDBLOCK)
+		if(Co_Wait(lsock, POLL_READ, POLL_INFINITE) < 0) return NOFILE;
+	return rc;
+}
+
+
+int Co_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	int rc;
+	while((rc = Connect(sock, port, timeout)) == WOULDBLOCK)
+		if(Co_Wait(sock, POLL_WRITE, timeout) <= 0) return -1;
+	return rc;
+}
@@ -16,11 +16,49 @@
 /**
     @brief Open a C stream on a tinyos file descriptor.
 
+	This is @c fidopen_buffered with @c FIDOPEN_AUTO buffering.
+
 	This call returns a new FILE pointer on success and NULL
 	on failure.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
+/** @brief Choose the buffering of a stream by the kind of its fid */
+#define FIDOPEN_AUTO (-1)
+
+/** @brief The buffer size of @c fidopen_buffered, when none is given */
+#define FIDOPEN_BUFSIZE 16384
+
+/**
+	@brief Open a C stream on a tinyos file descriptor, with the given buffering.
+
+	The buffering mode is one of @c _IOFBF, @c _IOLBF and @c _IONBF, as for 
+	@c setvbuf, or @c FIDOPEN_AUTO. The latter chooses full buffering when
+	@c StreamType reports a pipe or a socket, so that each @c Read or @c Write
+	moves a whole buffer, and no buffering for terminals and other streams.
+	A @c size of 0 means @c FIDOPEN_BUFSIZE.
+
+	Beware of line buffering: glibc flushes all the line-buffered streams
+	before some reads, and a stream flushed by another process writes to the 
+	fid of that process.
+
+	The streams are kept per process, and @c fidclose_all closes those
+	that are left open when a program started by @c Execute returns. A 
+	process that calls @c Exit must close its buffered streams first, or
+	their data are lost.
+
+	This call returns a new FILE pointer on success and NULL
+	on failure.
+*/
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int bufmode, size_t size);
+
+/**
+	@brief Flush and close the streams of @c fidopen in the current process.
+
+	This is called when a program started by @c Execute returns.
+*/
+void fidclose_all();
+
 void tinyos_replace_stdio();
 void tinyos_restore_stdio();
 void tinyos_pseudo_console();
@@ -44,6 +82,24 @@ typedef int (*Program)(size_t argc, const char** argv);
 int Execute(Program prog, size_t argc, const char** argv);
 
 
+/**
+	@brief Execute a new process, giving it only the streams of a map.
+
+	This is like @ref Execute, but the streams of the new process are
+	given by @c fdmap, as in @c ExecEx.
+  */
+int ExecuteEx(Program prog, size_t argc, const char** argv, const Fid_t* fdmap, int nfds);
+
+
+/**
+	@brief Execute a new process, building its streams by a list of actions.
+
+	This is like @ref Execute, but the streams of the new process are
+	given by @c actions, as in @c Spawn.
+  */
+int ExecuteSpawn(Program prog, size_t argc, const char** argv, fd_action* actions, int n);
+
+
 /**
 	@brief Try to reclaim the arguments of a process.
 
@@ -73,4 +129,204 @@ int Execute(Program prog, size_t argc, const char** argv);
 int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
+/**
+	@brief A mutex built on @c Futex.
+
+	Locking and unlocking a free mutex takes a single atomic operation,
+	and no system call. The word is 0 when free, 1 when locked and 2 when
+	locked with (possible) sleepers.
+
+	@code
+	FastMutex mx = FASTMUTEX_INIT;
+	@endcode
+  */
+typedef int FastMutex;
+
+/** @brief Initializer for @c FastMutex */
+#define FASTMUTEX_INIT 0
+
+/** @brief Lock a @c FastMutex, sleeping if needed. */
+void FastMutex_Lock(FastMutex* mx);
+
+/** @brief Unlock a @c FastMutex, waking up a sleeper if there is one. */
+void FastMutex_Unlock(FastMutex* mx);
+
+
+/**
+	@brief A counting semaphore built on @c Futex.
+
+	@code
+	FastSem sem = FASTSEM_INIT(3);
+	@endcode
+  */
+typedef struct {
+	int value;     /**< The count */
+	int waiters;   /**< The threads that may be sleeping */
+} FastSem;
+
+/** @brief Initializer for a @c FastSem with count @c n */
+#define FASTSEM_INIT(n) ((FastSem){ (n), 0 })
+
+/** @brief Decrement the count, sleeping while it is 0. */
+void FastSem_Wait(FastSem* sem);
+
+/** 
+	@brief Decrement the count, sleeping up to @c timeout msec while it is 0.
+	@returns 1 if the count was decremented, 0 on timeout.
+  */
+int FastSem_TimedWait(FastSem* sem, timeout_t timeout);
+
+/** @brief Increment the count, waking up a sleeper if there is one. */
+void FastSem_Post(FastSem* sem);
+
+
+/**
+	@brief A barrier for a fixed number of threads, built on @c Futex.
+
+	@code
+	FastBarrier bar = FASTBARRIER_INIT(4);
+	@endcode
+  */
+typedef struct {
+	int count;       /**< The threads that meet at the barrier */
+	int arrived;     /**< The threads that have arrived in this round */
+	int generation;  /**< The rounds completed */
+} FastBarrier;
+
+/** @brief Initializer for a @c FastBarrier of @c n threads */
+#define FASTBARRIER_INIT(n) ((FastBarrier){ (n), 0, 0 })
+
+/** 
+	@brief Wait until @c count threads have called this.
+	@returns 1 in the last thread to arrive, 0 in the others.
+  */
+int FastBarrier_Wait(FastBarrier* bar);
+
+
+/**
+	@brief A pool of worker threads that run submitted tasks.
+
+	An executor runs tasks on a fixed set of worker threads, created
+	once. Submitting a task is a queue push: tasks submitted by other
+	threads go to a shared queue, and tasks submitted by a worker go to
+	the worker's own queue, from which idle workers steal. 
+
+	A worker that waits for a future runs other tasks meanwhile, so tasks
+	can submit subtasks and wait for them, even on a single worker.
+
+	@see Executor_Create
+  */
+typedef struct executor Executor;
+
+/** @brief The result of a submitted task. @see Executor_Submit */
+typedef struct executor_task Future;
+
+/** 
+	@brief Create an executor with @c nworkers worker threads.
+	@returns the new executor, or NULL if @c nworkers is not positive or 
+	  the threads could not be created.
+  */
+Executor* Executor_Create(int nworkers);
+
+/** 
+	@brief Submit @c task(argl, args) to run on the executor.
+
+	The returned future must be passed to either @c Future_Wait or 
+	@c Future_Detach.
+  */
+Future* Executor_Submit(Executor* ex, Task task, int argl, void* args);
+
+/** @brief Wait for a task to finish, release its future and return the value of the task. */
+int Future_Wait(Future* f);
+
+/** @brief Release a future without waiting for the task. */
+void Future_Detach(Future* f);
+
+/** @brief Run all the submitted tasks, then stop the workers and release the executor. */
+void Executor_Destroy(Executor* ex);
+
+
+/**
+	@brief A scheduler of coroutines, run by a few threads.
+
+	A coroutine is a task with a small stack of @c CO_STACK_SIZE bytes,
+	which runs on one of the carrier threads of its scheduler. Coroutines
+	switch at @c Co_Yield and @c Co_Wait only, by a user-level context
+	switch, without a system call. Many coroutines, e.g., one for each
+	connection of a server, can be multiplexed over few threads.
+
+	A coroutine waits for a stream by @c Co_Wait, which parks it until the
+	stream is ready. One idle carrier at a time polls the streams of the
+	parked coroutines, up to @c MAX_POLL_FIDS-1 of them in each @c Poll. The
+	calls @c Co_Read, @c Co_Write, @c Co_Accept and @c Co_Connect retry the
+	calls of a non-blocking stream (see @c SetNonBlocking) until they do not
+	return @c WOULDBLOCK, parking in between. A call that blocks in the kernel
+	blocks its carrier, and the coroutines that the carrier would run.
+
+	Coroutines may not use nested functions, since their stacks are not
+	executable.
+
+	@see CoScheduler_Create
+  */
+typedef struct co_scheduler CoScheduler;
+
+/** @brief The stack size of a coroutine, a power of 2, including its descriptor */
+#define CO_STACK_SIZE (32*1024)
+
+/**
+	@brief Create a coroutine scheduler with @c nthreads carrier threads.
+	@returns the new scheduler, or NULL if @c nthreads is not positive or
+	  the threads could not be created.
+  */
+CoScheduler* CoScheduler_Create(int nthreads);
+
+/**
+	@brief Start a coroutine running @c task(argl, args).
+
+	This may be called by any thread, or coroutine.
+	@returns 0 on success, or -1 if the scheduler is being destroyed, or
+	  the stack could not be allocated.
+  */
+int CoScheduler_Spawn(CoScheduler* sched, Task task, int argl, void* args);
+
+/**
+	@brief Wait for all the coroutines to finish, then stop the carriers and
+	release the scheduler.
+
+	This must not be called by a coroutine of the scheduler.
+  */
+void CoScheduler_Destroy(CoScheduler* sched);
+
+/** @brief Let the other runnable coroutines run. Only coroutines may call this. */
+void Co_Yield();
+
+/**
+	@brief Park the current coroutine until a stream is ready.
+
+	Only coroutines may call this.
+
+	@param fid the stream
+	@param events the @c poll_events to wait for
+	@param timeout the time to wait in milliseconds, or @c POLL_INFINITE
+	@returns the ready events of @c fid, 0 if the timeout expired, or -1
+	   if @c fid is not a legal file id.
+  */
+int Co_Wait(Fid_t fid, int events, timeout_t timeout);
+
+/** @brief @c Read, parking the coroutine while a non-blocking stream has no data. */
+int Co_Read(Fid_t fid, char* buf, unsigned int size);
+
+/** @brief @c Write, parking the coroutine while a non-blocking stream is full. */
+int Co_Write(Fid_t fid, const char* buf, unsigned int size);
+
+/** @brief @c Accept, parking the coroutine while a non-blocking socket has no requests. */
+Fid_t Co_Accept(Fid_t lsock);
+
+/**
+	@brief @c Connect, parking the coroutine while a non-blocking socket waits
+	to be accepted, up to @c timeout milliseconds.
+  */
+int Co_Connect(Fid_t sock, port_t port, timeout_t timeout);
+
+
 #endif
@@ -3,6 +3,8 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stdio.h>
@@ -38,7 +40,13 @@ struct program_arguments ARGS = {
 	.nterm_list = 1 , .term_list = { 0, },
 
 	.ntests = 0,
-	.tests = { }
+	.tests = { },
+
+	.format = OUTPUT_NONE,
+	.output = NULL,
+	.baseline = NULL,
+	.slowdown = 20.0,
+	.jobs = 1
 };
 
 
@@ -164,8 +172,8 @@ void MSG(const char* format, ...)
 /* Open a terminal fifo:  e.g.,  open_fifo("con",2) */
 int open_fifo(const char* name, uint n)
 {
-	char fname[NAME_MAX];
-	snprintf(fname, NAME_MAX, "%s%d", name, n);
+	char fname[PATH_MAX];
+	bios_fifo_path(fname, sizeof(fname), name, n);
 	int fd;
 	CHECK(fd = open(fname, O_RDWR|O_NONBLOCK));
 	/* drain fifo */
@@ -465,6 +473,26 @@ void sendme(uint term, const char* pattern)
 
 
 
+/* The times of the last test executed */
+static struct {
+	double wall;	/* wall-clock time, in sec */
+	double cpu;		/* user and system time, in sec */
+} LAST_TIME;
+
+static double wall_clock()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+static double cpu_seconds(struct rusage* ru)
+{
+	return ru->ru_utime.tv_sec + 1E-6*ru->ru_utime.tv_usec 
+		+ ru->ru_stime.tv_sec + 1E-6*ru->ru_stime.tv_usec;
+}
+
+
 /* Execute procfunc in a subprocess, return 
    1 if it exited normally, 0 otherwise.
 
@@ -487,6 +515,7 @@ int execute_fork(void (*procfunc)(void), unsigned int timeout)
 	CHECK(sigprocmask(SIG_BLOCK, &waitmask, &oldmask));
 
 	/* Fork */
+	double start = wall_clock();
 	CHECK(pid = fork());	
 	if(pid==0) {
 		/* Subprocess */
@@ -520,7 +549,10 @@ int execute_fork(void (*procfunc)(void), unsigned int timeout)
 
 	/* Wait the child */
 	int status;
-	waitpid(pid, &status, 0);
+	struct rusage ru;
+	wait4(pid, &status, 0, &ru);
+	LAST_TIME.wall = wall_clock() - start;
+	LAST_TIME.cpu = cpu_seconds(&ru);
 
 	/* Restore signal mask ?*/
 	sigprocmask(SIG_SETMASK, &oldmask, NULL);
@@ -535,7 +567,13 @@ int execute_nofork(void (*procfunc)(void), unsigned int timeout)
 	/* Note: timeout is ignored, we allow the test to run forever!
 	   It is the user's job to interrupt!
 	 */
+	struct rusage ru0, ru1;
+	getrusage(RUSAGE_SELF, &ru0);
+	double start = wall_clock();
 	procfunc();
+	LAST_TIME.wall = wall_clock() - start;
+	getrusage(RUSAGE_SELF, &ru1);
+	LAST_TIME.cpu = cpu_seconds(&ru1) - cpu_seconds(&ru0);
 	/* Here, we could allow tests to continue */
 	if(FLAG_FAILURE) {
 		/* Here, we could allow tests to continue, still reporting
@@ -560,18 +598,24 @@ int execute(void (*procfunc)(void), unsigned int timeout)
 
 
 
-int execute_boot(int ncores, int nterm, Task bootfunc, int argl, void* args, unsigned int timeout)
+/* Boot a VM with proxies on its terminals */
+static void boot_with_proxies(int ncores, int nterm, Task bootfunc, int argl, void* args)
 {
-	void run_boot() 
-	{
-		for(uint i=0;i<nterm; i++)
-			term_proxy_init(&PROXY[i], i);
+	for(uint i=0;i<nterm; i++)
+		term_proxy_init(&PROXY[i], i);
+
+	boot(ncores, nterm, bootfunc, argl, args);		
 
-		boot(ncores, nterm, bootfunc, argl, args);		
+	for(uint i=0;i<nterm; i++)
+		term_proxy_close(&PROXY[i]);
+}
 
 
-		for(uint i=0;i<nterm; i++)
-			term_proxy_close(&PROXY[i]);
+int execute_boot(int ncores, int nterm, Task bootfunc, int argl, void* args, unsigned int timeout)
+{
+	void run_boot() 
+	{
+		boot_with_proxies(ncores, nterm, bootfunc, argl, args);
 	}
 	return execute(run_boot, timeout);
 }
@@ -587,6 +631,160 @@ int execute_boot(int ncores, int nterm, Task bootfunc, int argl, void* args, uns
 /* Macros for declaring static arrays of tests */
 
 
+/*
+	Results 
+	-------
+
+	Every test run is recorded, to be written out by write_results(). 
+	Bare tests are recorded with 0 cores and terminals.
+ */
+
+typedef enum { RESULT_OK, RESULT_FAILED, RESULT_SKIPPED, RESULT_SLOWER } test_result;
+static const char* result_name[] = { "ok", "failed", "skipped", "slower" };
+
+typedef struct test_record {
+	char name[64];
+	int ncores, nterm;
+	test_result result;
+	double wall, cpu;
+	double baseline;		/* The baseline wall-clock time, or -1 */
+} test_record;
+
+/* A growing array of records */
+typedef struct record_array {
+	test_record* rec;
+	unsigned int size, capacity;
+} record_array;
+
+static record_array RESULTS, BASELINE;
+
+static test_record* record_add(record_array* a)
+{
+	if(a->size == a->capacity) {
+		a->capacity = a->capacity ? 2*a->capacity : 64;
+		a->rec = xrealloc(a->rec, a->capacity * sizeof(test_record));
+	}
+	return & a->rec[a->size++];
+}
+
+static test_record* baseline_find(const char* name, int ncores, int nterm)
+{
+	for(unsigned int i=0; i<BASELINE.size; i++) {
+		test_record* r = & BASELINE.rec[i];
+		if(r->ncores==ncores && r->nterm==nterm && strcmp(r->name, name)==0)
+			return r;
+	}
+	return NULL;
+}
+
+/* 
+	Read a CSV file written by write_results() into BASELINE.
+	Return 1 on success, 0 if the file cannot be opened.
+ */
+static int read_baseline(const char* fname)
+{
+	FILE* f = fopen(fname, "r");
+	if(f==NULL) return 0;
+
+	char line[256];
+	while(fgets(line, sizeof(line), f)) {
+		test_record r;
+		char result[16];
+		if(sscanf(line, "%63[^,],%d,%d,%15[^,],%lf,%lf", 
+				r.name, &r.ncores, &r.nterm, result, &r.wall, &r.cpu) != 6)
+			continue;	/* The header, or a malformed line */
+		if(strcmp(result, "ok")!=0) 
+			continue;	/* Only successful runs are compared */
+		*record_add(&BASELINE) = r;
+	}
+	fclose(f);
+	return 1;
+}
+
+
+/*
+	Record the result of a test run, from the LAST_TIME of the run, and 
+	compare it to the baseline. Return the result, which is RESULT_SLOWER 
+	for a successful run that was slower than its baseline.
+ */
+static test_result record_result(const Test* test, int ncores, int nterm, test_result result)
+{
+	test_record* r = record_add(&RESULTS);
+	snprintf(r->name, sizeof(r->name), "%s", test->name);
+	r->ncores = ncores;
+	r->nterm = nterm;
+	r->wall = (result==RESULT_SKIPPED) ? 0.0 : LAST_TIME.wall;
+	r->cpu = (result==RESULT_SKIPPED) ? 0.0 : LAST_TIME.cpu;
+	r->baseline = -1.0;
+
+	test_record* b = baseline_find(test->name, ncores, nterm);
+	if(b && result==RESULT_OK) {
+		r->baseline = b->wall;
+		if(b->wall >= BASELINE_MIN_TIME && r->wall > b->wall * (1.0 + ARGS.slowdown/100.0)) {
+			MSG("Test is %.0f%% slower than the baseline (%.3f sec, baseline %.3f sec)\n",
+				100.0*(r->wall/b->wall - 1.0), r->wall, b->wall);
+			result = RESULT_SLOWER;
+		}
+	}
+	r->result = result;
+	return result;
+}
+
+
+/* Print the result of a test run, and its times */
+static void print_result(test_result result)
+{
+	static const char* color[] = { GREEN, RED, CYAN, RED };
+	static const char* text[] = { "ok", "*** FAILED ***", "skipped", "*** SLOWER ***" };
+
+	MSG(" %s", COLOR(text[result], color[result]));
+	if(result != RESULT_SKIPPED)
+		MSG("  [%.3fs, cpu %.3fs]", LAST_TIME.wall, LAST_TIME.cpu);
+	MSG("\n");
+}
+
+
+/* Write the RESULTS in the format of ARGS. Return 0 on failure. */
+static int write_results()
+{
+	if(ARGS.format == OUTPUT_NONE) return 1;
+
+	FILE* f = (ARGS.output==NULL) ? stdout : fopen(ARGS.output, "w");
+	if(f==NULL) {
+		MSG("Cannot write results to %s: %s\n", ARGS.output, strerror(errno));
+		return 0;
+	}
+
+	if(ARGS.format == OUTPUT_CSV)
+		fprintf(f, "name,cores,terminals,result,wall,cpu,baseline\n");
+	else
+		fprintf(f, "[");
+
+	for(unsigned int i=0; i<RESULTS.size; i++) {
+		test_record* r = & RESULTS.rec[i];
+		if(ARGS.format == OUTPUT_CSV) {
+			fprintf(f, "%s,%d,%d,%s,%.6f,%.6f,", r->name, r->ncores, r->nterm, 
+				result_name[r->result], r->wall, r->cpu);
+			if(r->baseline >= 0.0) fprintf(f, "%.6f", r->baseline);
+			fprintf(f, "\n");
+		} else {
+			fprintf(f, "%s\n  {\"name\": \"%s\", \"cores\": %d, \"terminals\": %d, "
+				"\"result\": \"%s\", \"wall\": %.6f, \"cpu\": %.6f",
+				i ? "," : "", r->name, r->ncores, r->nterm, 
+				result_name[r->result], r->wall, r->cpu);
+			if(r->baseline >= 0.0) fprintf(f, ", \"baseline\": %.6f", r->baseline);
+			fprintf(f, "}");
+		}
+	}
+
+	if(ARGS.format == OUTPUT_JSON)
+		fprintf(f, "\n]\n");
+
+	if(f != stdout) fclose(f); else fflush(f);
+	return 1;
+}
+
+
 int run_boot_test(const Test* test, uint ncores, uint nterm, int argl, void* args)
 {
 	int result=1;
@@ -603,11 +801,13 @@ int run_boot_test(const Test* test, uint ncores, uint nterm, int argl, void* arg
 				WTERMSIG(status), strsignal(WTERMSIG(status)));
 	}
 
+	test_result tres = record_result(test, ncores, nterm, 
+		skipped ? RESULT_SKIPPED : (result ? RESULT_OK : RESULT_FAILED));
+
 	MSG("%-52s [cores=%2d,term=%1d]:", COLOR(test->name,WHITE), ncores, nterm);
-	MSG(" %s\n", skipped ? COLOR("skipped",CYAN) : 
-		   (result? COLOR("ok",GREEN) : COLOR("*** FAILED ***",RED)) );
+	print_result(tres);
 
-	return result;
+	return tres==RESULT_OK || tres==RESULT_SKIPPED;
 }
 
 
@@ -623,12 +823,21 @@ typedef struct
 /* helper for run_test */
 int run_suite(const char* name, const Test** tests, Results* results);
 
+/* helper for run_test and run_suite */
+static int run_parallel(const Test** tests, int ntests, Results* results);
+
+/* Return 1 if tests are run by several processes at a time */
+static inline int parallel_mode() { return ARGS.fork && ARGS.jobs > 1; }
+
 
 int run_test(const Test* test)
 {
 	int result=1;
 	int status;
 
+	if(parallel_mode() && (test->type==BOOT_FUNC || test->type==BARE_FUNC))
+		return run_parallel(&test, 1, NULL);
+
 	switch(test->type) {
 		case BOOT_FUNC:
 			for(int i=0; i<ARGS.ncore_list; i++)
@@ -643,8 +852,11 @@ int run_test(const Test* test)
 				MSG("Test crashed, signal=%d (%s)\n", 
 					WTERMSIG(status), strsignal(WTERMSIG(status)));
 
+			test_result tres = record_result(test, 0, 0, result ? RESULT_OK : RESULT_FAILED);
+			result = (tres == RESULT_OK);
+
 			MSG("%-70s:", COLOR(test->name,WHITE));
-			MSG(" %s\n", (result? COLOR("ok",GREEN) : COLOR("*** FAILED ***",RED)));
+			print_result(tres);
 
 			break;
 		case SUITE_FUNC:
@@ -682,10 +894,19 @@ int run_suite(const char* name, const Test** tests, Results* results)
 
 	MSG("running suite: %s\n", COLOR(name,YELLOW));
 	INDENT();
-	for(const Test** t = tests; *t!=NULL; t++) {
+	for(const Test** t = tests; *t!=NULL; ) {
+		if(parallel_mode() && (*t)->type != SUITE_FUNC) {
+			/* Run a batch of consecutive bare and boot tests */
+			int n = 0;
+			while(t[n]!=NULL && t[n]->type != SUITE_FUNC) n++;
+			run_parallel(t, n, results);
+			t += n;
+			continue;
+		}
 		int testres = run_test(*t);
 		results->number_of_tests ++;
 		if(testres) results->successful ++;
+		t++;
 	}
 	MSG("suite %s completed [tests=%d, failed=%d]\n", COLOR(name,YELLOW), 
 		results->number_of_tests, 
@@ -700,6 +921,271 @@ int run_suite(const char* name, const Test** tests, Results* results)
 
 
 
+/*
+	Parallel execution
+	------------------
+
+	With -j N (and forking), the runs of consecutive bare and boot tests
+	of a suite are executed by up to N processes at a time. The output of a
+	run goes to a temporary file, and is printed once the runs before it have
+	been printed, so that the report reads as that of a sequential execution.
+
+	A run with terminals gets a private directory of fifos, passed to the 
+	bios through TINYOS_FIFO_DIR, so that concurrent runs do not share them.
+ */
+
+typedef enum { JOB_WAITING, JOB_RUNNING, JOB_DONE } job_state;
+
+typedef struct test_job {
+	const Test* test;
+	int ncores, nterm;		/* 0 and 0 for bare tests */
+	int skipped;
+	int last;				/* This is the last run of the test */
+
+	job_state state;
+	pid_t pid;
+	FILE* out;				/* The output of the run */
+	char fifo_dir[64];		/* The fifo directory, or "" */
+	double start, deadline;
+	int timed_out;
+	int status;
+	double wall, cpu;
+} test_job;
+
+
+static void job_make_fifos(test_job* job)
+{
+	job->fifo_dir[0] = '\0';
+	if(job->nterm == 0) return;
+
+	strcpy(job->fifo_dir, "/tmp/tinyos-test-XXXXXX");
+	if(mkdtemp(job->fifo_dir)==NULL) FATALERR(errno);
+
+	char path[PATH_MAX];
+	for(int i=0; i<job->nterm; i++) {
+		snprintf(path, sizeof(path), "%s/con%d", job->fifo_dir, i);
+		CHECK(mkfifo(path, 0600));
+		snprintf(path, sizeof(path), "%s/kbd%d", job->fifo_dir, i);
+		CHECK(mkfifo(path, 0600));
+	}
+}
+
+static void job_remove_fifos(test_job* job)
+{
+	if(job->fifo_dir[0] == '\0') return;
+
+	char path[PATH_MAX];
+	for(int i=0; i<job->nterm; i++) {
+		snprintf(path, sizeof(path), "%s/con%d", job->fifo_dir, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/kbd%d", job->fifo_dir, i);
+		unlink(path);
+	}
+	rmdir(job->fifo_dir);
+}
+
+
+/* Fork the process of a job. SIGCHLD is blocked by the caller. */
+static void job_start(test_job* job)
+{
+	job->out = tmpfile();
+	if(job->out==NULL) FATALERR(errno);
+	job_make_fifos(job);
+
+	fflush(stdout);
+	fflush(stderr);
+	job->start = wall_clock();
+	job->deadline = job->start + job->test->timeout;
+	job->timed_out = 0;
+	job->state = JOB_RUNNING;
+
+	CHECK(job->pid = fork());
+	if(job->pid == 0) {
+		/* Subprocess */
+		CHECK(dup2(fileno(job->out), 1));
+		CHECK(dup2(fileno(job->out), 2));
+		if(job->fifo_dir[0])
+			setenv(BIOS_FIFO_DIR_ENV, job->fifo_dir, 1);
+		FLAG_FAILURE=0;
+
+		if(job->test->type == BOOT_FUNC)
+			boot_with_proxies(job->ncores, job->nterm, job->test->boot, 0, NULL);
+		else
+			job->test->bare();
+
+		if(FLAG_FAILURE) abort();
+		exit(129);
+	}
+}
+
+
+/* Print the output and the result of a finished (or skipped) job */
+static int job_report(test_job* job)
+{
+	int result = 1;
+	if(! job->skipped) {
+		char buf[4096];
+		size_t n;
+		rewind(job->out);
+		while((n = fread(buf, 1, sizeof(buf), job->out)) > 0)
+			fwrite(buf, 1, n, stderr);
+		fclose(job->out);
+
+		if(job->timed_out)
+			MSG("Test timed out\n");
+		result = WIFEXITED(job->status) && WEXITSTATUS(job->status)==129 ? 1 : 0;
+		if(WIFSIGNALED(job->status))
+			MSG("Test crashed, signal=%d (%s)\n", 
+				WTERMSIG(job->status), strsignal(WTERMSIG(job->status)));
+		LAST_TIME.wall = job->wall;
+		LAST_TIME.cpu = job->cpu;
+	}
+
+	test_result tres = record_result(job->test, job->ncores, job->nterm, 
+		job->skipped ? RESULT_SKIPPED : (result ? RESULT_OK : RESULT_FAILED));
+
+	if(job->test->type == BOOT_FUNC)
+		MSG("%-52s [cores=%2d,term=%1d]:", COLOR(job->test->name,WHITE), job->ncores, job->nterm);
+	else
+		MSG("%-70s:", COLOR(job->test->name,WHITE));
+	print_result(tres);
+
+	return tres==RESULT_OK || tres==RESULT_SKIPPED;
+}
+
+
+/* Wait until a job finishes, or the next deadline */
+static void jobs_wait(test_job* jobs, int njobs, sigset_t* chld)
+{
+	double now = wall_clock();
+	double wake = now + 1.0;
+	for(int i=0; i<njobs; i++)
+		if(jobs[i].state == JOB_RUNNING && ! jobs[i].timed_out && jobs[i].deadline < wake)
+			wake = jobs[i].deadline;
+
+	if(wake > now) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)(wake - now);
+		ts.tv_nsec = (long)((wake - now - ts.tv_sec) * 1E9);
+		sigtimedwait(chld, NULL, &ts);
+	}
+
+	/* Reap the finished jobs */
+	pid_t pid;
+	int status;
+	struct rusage ru;
+	while((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		for(int i=0; i<njobs; i++) {
+			test_job* job = & jobs[i];
+			if(job->state == JOB_RUNNING && job->pid == pid) {
+				job->status = status;
+				job->wall = wall_clock() - job->start;
+				job->cpu = cpu_seconds(&ru);
+				job->state = JOB_DONE;
+				job_remove_fifos(job);
+				break;
+			}
+		}
+	}
+
+	/* Kill the late jobs */
+	now = wall_clock();
+	for(int i=0; i<njobs; i++) {
+		test_job* job = & jobs[i];
+		if(job->state == JOB_RUNNING && ! job->timed_out && now >= job->deadline) {
+			job->timed_out = 1;
+			kill(job->pid, SIGTERM);
+		}
+	}
+}
+
+
+/* Run a sequence of bare and boot tests in parallel */
+static int run_parallel(const Test** tests, int ntests, Results* results)
+{
+	/* Make the jobs */
+	int njobs = 0;
+	for(int k=0; k<ntests; k++)
+		njobs += (tests[k]->type == BOOT_FUNC) ? ARGS.ncore_list * ARGS.nterm_list : 1;
+	test_job* jobs = xmalloc(njobs * sizeof(test_job));
+
+	int j = 0;
+	for(int k=0; k<ntests; k++) {
+		const Test* test = tests[k];
+		if(test->type == BOOT_FUNC) {
+			for(int i=0; i<ARGS.ncore_list; i++)
+				for(int t=0; t<ARGS.nterm_list; t++) {
+					test_job* job = & jobs[j++];
+					job->test = test;
+					job->ncores = ARGS.core_list[i];
+					job->nterm = ARGS.term_list[t];
+					job->skipped = ! ((job->ncores >= test->minimum_cores) 
+						&& (job->nterm >= test->minimum_terminals));
+					job->last = 0;
+				}
+		} else {
+			test_job* job = & jobs[j++];
+			job->test = test;
+			job->ncores = job->nterm = 0;
+			job->skipped = 0;
+			job->last = 0;
+		}
+		jobs[j-1].last = 1;
+	}
+	for(j=0; j<njobs; j++)
+		jobs[j].state = jobs[j].skipped ? JOB_DONE : JOB_WAITING;
+
+	sigset_t chld, oldmask;
+	CHECK(sigemptyset(&chld));
+	CHECK(sigaddset(&chld, SIGCHLD));
+	CHECK(sigprocmask(SIG_BLOCK, &chld, &oldmask));
+
+	int all_ok = 1, test_ok = 1;
+	int next = 0, running = 0;
+	for(int printed = 0; printed < njobs; ) {
+		/* Start jobs, up to the limit */
+		for(; next < njobs && running < ARGS.jobs; next++)
+			if(jobs[next].state == JOB_WAITING) {
+				job_start(& jobs[next]);
+				running++;
+			}
+
+		test_job* job = & jobs[printed];
+		if(job->state != JOB_DONE) {
+			jobs_wait(jobs, njobs, &chld);
+			running = 0;
+			for(int i=0; i<next; i++) 
+				running += (jobs[i].state == JOB_RUNNING);
+			continue;
+		}
+
+		/* Report the next job in order */
+		test_ok &= job_report(job);
+		printed++;
+
+		if(job->last) {
+			if(!test_ok && ARGS.verbose>0) {
+				INDENT(); 
+				MSG("description: ");
+				TAB(); MSG("%s\n", job->test->description); UNINDENT();
+				UNINDENT();
+			}
+			if(results) {
+				results->number_of_tests ++;
+				if(test_ok) results->successful ++;
+			}
+			all_ok &= test_ok;
+			test_ok = 1;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	free(jobs);
+	return all_ok;
+}
+
+
+
 /*
 	Testing the test framework itself!
  */
@@ -818,6 +1304,11 @@ static struct argp_option options [] = {
 	{"list", 'l', 0, 0, "Show a list of available tests" },
 	{"verbose", 'v', 0, 0, "Be verbose: show test descriptions"},
 	{"nocolor", 'n', 0, 0, "Do not color the output"},
+	{"jobs", 'j', "<n>", 0, "Run up to n forked tests at the same time"},
+	{"format", 'F', "csv|json", 0, "Write the results in a machine-readable format"},
+	{"output", 'o', "<file>", 0, "Write the results to a file instead of stdout"},
+	{"baseline", 'b', "<file>", 0, "Fail the tests slower than in a CSV file of results"},
+	{"slowdown", 's', "<percent>", 0, "Slowdown over the baseline that fails a test (default: 20)"},
 	{ NULL }
 };
 
@@ -924,6 +1415,39 @@ parse_options(int key, char *arg, struct argp_state *state)
 				argp_error(state, "Error in parsing list of terminals: %s\n",arg);				
 			break;
 
+		case 'F':
+			if(strcmp(arg, "csv")==0)
+				ARGS.format = OUTPUT_CSV;
+			else if(strcmp(arg, "json")==0)
+				ARGS.format = OUTPUT_JSON;
+			else
+				argp_error(state, "Unknown format: %s\n", arg);
+			break;
+
+		case 'o':
+			ARGS.output = arg;
+			break;
+
+		case 'j': {
+			char* endptr;
+			ARGS.jobs = strtol(arg, &endptr, 10);
+			if(endptr==arg || *endptr!='\0' || ARGS.jobs < 1)
+				argp_error(state, "Error in parsing number of jobs: %s\n", arg);
+			break;
+		}
+
+		case 'b':
+			ARGS.baseline = arg;
+			break;
+
+		case 's': {
+			char* endptr;
+			ARGS.slowdown = strtod(arg, &endptr);
+			if(endptr==arg || *endptr!='\0' || ARGS.slowdown < 0.0)
+				argp_error(state, "Error in parsing slowdown: %s\n", arg);
+			break;
+		}
+
 		case ARGP_KEY_ARG:
 			if(ARGS.ntests >= MAX_TESTS) {
 				argp_error(state, "Number of tests too large (maximum=%d)",MAX_TESTS);
@@ -1011,13 +1535,22 @@ int run_program(int argc, char**argv, const Test* default_test)
 	__default_test = default_test;
 	argp_parse(&argp, argc, argv, 0, 0, &ARGS);
 
-	if(ARGS.show_tests)
+	if(ARGS.show_tests) {
 		show_suite(&all_tests_available);
-	else {
-				for(int k=0; k< ARGS.ntests; k++)
-					run_test(ARGS.tests[k]);
+		return 0;
 	}
-	return 0;
+
+	if(ARGS.baseline && ! read_baseline(ARGS.baseline)) {
+		MSG("Cannot read baseline %s: %s\n", ARGS.baseline, strerror(errno));
+		return 1;
+	}
+
+	int result = 1;
+	for(int k=0; k< ARGS.ntests; k++)
+		result &= run_test(ARGS.tests[k]);
+
+	result &= write_results();
+	return result ? 0 : 1;
 }
 
 
@@ -180,6 +180,31 @@
 	Write(file1, "hi there", 8);
 	@endcode
 
+	### Parallel execution.
+
+	With option @c -j N, up to @c N tests are run at the same time, each in 
+	its own process. The output of each test is held until the tests before 
+	it have finished, so the report looks the same as when they run one at
+	a time. Every test run with terminals is given its own directory of fifos
+	(see @ref bios_fifo_path), so concurrent terminal tests do not collide.
+	Tests that measure time or parallelism should not be run this way.
+
+	### Timing and results.
+
+	Each test run is timed, and the wall-clock and CPU time (of the test process, 
+	when tests are forked) are shown after the result. The results can also be 
+	written in a machine-readable form, with @c --format=csv or @c --format=json,
+	to standard output or to the file given by @c --output.
+	A CSV file of results can be given back with @c --baseline, and then every 
+	test run found in it that takes more than @c --slowdown percent (default 20) 
+	longer than in the baseline is failed as a regression:
+	@verbatim
+	$  ./validate_api -c 1,4 --format=csv --output=base.csv
+	$  ./validate_api -c 1,4 --baseline=base.csv --slowdown=25
+	@endverbatim
+	Test runs shorter than @c BASELINE_MIN_TIME in the baseline are not compared,
+	as they are dominated by noise.
+
 	Optional test parameters
 	------------------------
 
@@ -204,6 +229,12 @@
 /** @brief Maximum number of tests on the command line. */
 #define MAX_TESTS 1024
 
+/** @brief The machine-readable output formats of the results */
+typedef enum { OUTPUT_NONE, OUTPUT_CSV, OUTPUT_JSON } output_format;
+
+/** @brief The shortest baseline wall-clock time (in sec) compared for regressions */
+#define BASELINE_MIN_TIME 0.1
+
 /** @brief Global arguments for test execution */
 extern struct program_arguments
 {
@@ -232,6 +263,12 @@ extern struct program_arguments
 	/** @brief Tests to run */
 	const struct Test* tests[MAX_TESTS];	
 
+	output_format format;		/**< Format of the results, if any */
+	const char* output;			/**< File of the results, or NULL for stdout */
+	const char* baseline;		/**< CSV file of baseline results, or NULL */
+	double slowdown;			/**< Percent of slowdown over the baseline that fails a test */
+	int jobs;					/**< Number of forked tests that can run at a time */
+
 } ARGS; /**< The object used to store the program arguments */
 
 
@@ -376,6 +413,8 @@ int register_test(const Test* test);
 		return run_program(argc, argv, all_tests);
 	}
 	@endcode
+
+	@returns 0 if all the tests that ran succeeded, else 1.
 */
 int run_program(int argc, char**argv, const Test* default_test);
 
@@ -118,10 +118,43 @@ static inline void * xmalloc (size_t size)
   return value;
 }
 
+/**
+	@brief A wrapper for realloc checking for out-of-memory.
+
+	@param ptr the memory block to resize (may be NULL)
+	@param size the new size of the block
+	@returns the resized memory block
+	@see xmalloc
+  */
+static inline void * xrealloc (void* ptr, size_t size)
+{
+  void *value = realloc (ptr, size);
+  if (value == 0 && size != 0)
+    FATAL("virtual memory exhausted");
+  return value;
+}
+
 
 /** @}   check_macros  */
 
 
+/**
+	@brief The size of a cache line of the host, assumed by data layouts.
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+	@brief Align a type or a field to a cache line.
+
+	Data written by different cores is kept in different cache lines, so 
+	that a core writing its own data does not invalidate the line of 
+	another (false sharing). Aligning a struct type also pads its size
+	to a multiple of the line, so the elements of an array of it do not
+	share lines.
+ */
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+
 /*******************************************************
  *
  *
@@ -450,7 +483,7 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of 
 	the list and return in.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rlist_remove(list->prev); }
 
 /**
 	@brief Return the length of a list.
@@ -580,6 +613,468 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/**
+	@defgroup rheaps  Resource heaps
+	@brief  An intrusive pairing heap.
+
+	A heap of @c rhnode nodes, ordered by a function @c less given at
+	initialization. As with @c rlnode, the node is embedded in the object
+	it orders, and its key is a union of pointer and integer types, so the
+	heap never allocates memory.
+
+	Insertion and finding the minimum are O(1), while popping the minimum and
+	removing an arbitrary node are O(log n) amortized. A node that is not in a heap
+	is @em detached; @c rhnode_init() detaches a node, as does its removal
+	from a heap.
+
+	Example:
+	\code
+	int earlier(rhnode* a, rhnode* b) { return a->tcb->wakeup_time < b->tcb->wakeup_time; }
+
+	rheap H;  rheap_init(&H, earlier);
+	rheap_insert(&H, rhnode_init(&tcb->timeout_node, tcb));
+	TCB* first = rheap_min(&H)->tcb;
+	\endcode
+
+	@{
+ */
+
+/** @brief A convenience typedef */
+typedef struct resource_heap_node * rhnode_ptr;
+
+/**
+	@brief Heap node
+*/
+typedef struct resource_heap_node {
+  /** @brief The node's key, as in @c rlnode */
+  union {
+    PCB* pcb; 
+    TCB* tcb;
+    CCB* ccb;
+    DCB* dcb;
+    FCB* fcb;
+    request_t* request;
+    PTCB* ptcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+
+  rhnode_ptr child;   /**< @brief The first child */
+  rhnode_ptr next;    /**< @brief The next sibling */
+  rhnode_ptr prev;    /**< @brief The previous sibling, or the parent of a first child. 
+                         It is NULL for the root and the node itself when detached. */
+} rhnode;
+
+/** @brief The order of a heap: return non-zero iff @c a comes before @c b */
+typedef int (*rheap_less)(rhnode* a, rhnode* b);
+
+/** @brief A heap */
+typedef struct resource_heap {
+	rhnode* root;       /**< @brief The minimum node, or NULL */
+	rheap_less less;    /**< @brief The order of the heap */
+	size_t size;        /**< @brief The number of nodes */
+} rheap;
+
+
+/** @brief Initialize an empty heap with the given order. */
+static inline void rheap_init(rheap* h, rheap_less less)
+{
+	h->root = NULL;
+	h->less = less;
+	h->size = 0;
+}
+
+/** @brief Initialize a detached node with key @c ptr, and return it. */
+static inline rhnode* rhnode_init(rhnode* n, void* ptr)
+{
+	n->obj = ptr;
+	n->child = n->next = NULL;
+	n->prev = n;
+	return n;
+}
+
+/** @brief Return non-zero iff the node is in a heap. */
+static inline int rhnode_linked(rhnode* n) { return n->prev != n; }
+
+/** @brief Check a heap for emptiness. */
+static inline int is_rheap_empty(rheap* h) { return h->root == NULL; }
+
+/** @brief Return the minimum node of a heap, or NULL if it is empty. */
+static inline rhnode* rheap_min(rheap* h) { return h->root; }
+
+/* Link two roots, returning the new root */
+static inline rhnode* rheap_link(rheap* h, rhnode* a, rhnode* b)
+{
+	if(h->less(b, a)) { rhnode* t = a; a = b; b = t; }
+	b->next = a->child;
+	if(b->next) b->next->prev = b;
+	b->prev = a;
+	a->child = b;
+	a->next = a->prev = NULL;
+	return a;
+}
+
+/* Combine a list of siblings into a single tree, by the two-pass rule */
+static inline rhnode* rheap_combine(rheap* h, rhnode* first)
+{
+	/* Link pairs left to right, stacking the results through next */
+	rhnode* stack = NULL;
+	while(first) {
+		rhnode* a = first;
+		rhnode* b = a->next;
+		first = b ? b->next : NULL;
+		if(b) a = rheap_link(h, a, b);
+		a->next = stack;
+		stack = a;
+	}
+
+	/* Link the stack, i.e., right to left */
+	rhnode* root = NULL;
+	while(stack) {
+		rhnode* a = stack;
+		stack = a->next;
+		root = root ? rheap_link(h, root, a) : a;
+	}
+	if(root) root->next = root->prev = NULL;
+	return root;
+}
+
+/** 
+	@brief Insert a detached node into a heap.
+	@pre @c !rhnode_linked(n)
+ */
+static inline void rheap_insert(rheap* h, rhnode* n)
+{
+	assert(! rhnode_linked(n));
+	n->child = n->next = n->prev = NULL;
+	h->root = h->root ? rheap_link(h, h->root, n) : n;
+	h->size++;
+}
+
+/** @brief Remove and return the minimum node of a heap, or NULL if it is empty. */
+static inline rhnode* rheap_pop(rheap* h)
+{
+	rhnode* n = h->root;
+	if(n == NULL) return NULL;
+	h->root = rheap_combine(h, n->child);
+	h->size--;
+	return rhnode_init(n, n->obj);
+}
+
+/**
+	@brief Remove a node from the heap that contains it.
+	@pre @c rhnode_linked(n) and @c n is in @c h
+ */
+static inline void rheap_remove(rheap* h, rhnode* n)
+{
+	assert(rhnode_linked(n));
+	if(n == h->root) { rheap_pop(h); return; }
+
+	/* Cut the subtree of n */
+	if(n->prev->child == n) 
+		n->prev->child = n->next;
+	else
+		n->prev->next = n->next;
+	if(n->next) n->next->prev = n->prev;
+
+	rhnode* sub = rheap_combine(h, n->child);
+	if(sub) h->root = rheap_link(h, h->root, sub);
+	h->size--;
+	rhnode_init(n, n->obj);
+}
+
+/* @} rheaps */
+
+
+
+/**
+	@defgroup rhash  Address hash maps
+	@brief  An open-addressing hash map over storage given by the caller.
+
+	The map associates non-zero integer (or pointer) keys to values, which
+	are a union as in @c rlnode. It uses linear probing in an array of
+	@c capacity slots, a power of 2, provided by the caller. Removal shifts
+	the following entries back, so there are no tombstones and lookups
+	never slow down. An empty slot has key 0.
+
+	The map never allocates memory: @c rhash_insert() fails when the map
+	is 3/4 full. The caller may then provide a larger array with 
+	@c rhash_rehash().
+
+	@{
+ */
+
+/** @brief A slot of a hash map */
+typedef struct rhash_slot {
+  uintptr_t key;      /**< @brief The key, or 0 for an empty slot */
+  /** @brief The value, as in @c rlnode */
+  union {
+    PCB* pcb; 
+    TCB* tcb;
+    FCB* fcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+} rhash_slot;
+
+/** @brief A hash map */
+typedef struct rhash {
+	rhash_slot* slot;      /**< @brief The slots */
+	size_t mask;           /**< @brief The capacity minus 1 */
+	size_t size;           /**< @brief The number of keys */
+} rhash;
+
+/* Fibonacci hashing mixes the low bits of aligned addresses */
+static inline size_t rhash_home(rhash* m, uintptr_t key)
+{
+	return (size_t)(((uint64_t) key * 0x9E3779B97F4A7C15ull) >> 32) & m->mask;
+}
+
+/** 
+	@brief Initialize an empty map over the given slots.
+	@pre @c capacity is a power of 2
+ */
+static inline void rhash_init(rhash* m, rhash_slot* slots, size_t capacity)
+{
+	assert(capacity > 0 && (capacity & (capacity-1)) == 0);
+	m->slot = slots;
+	m->mask = capacity - 1;
+	m->size = 0;
+	for(size_t i=0; i<capacity; i++) slots[i].key = 0;
+}
+
+/** @brief Return the slot of a key, or NULL if it is not in the map. */
+static inline rhash_slot* rhash_find(rhash* m, uintptr_t key)
+{
+	assert(key != 0);
+	for(size_t i = rhash_home(m, key); m->slot[i].key != 0; i = (i+1) & m->mask)
+		if(m->slot[i].key == key) return & m->slot[i];
+	return NULL;
+}
+
+/**
+	@brief Insert a key into the map, and return its slot.
+
+	If the key is already in the map, its slot is returned. Else, the key is
+	added with a zero value. If the map is too full, NULL is returned.
+ */
+static inline rhash_slot* rhash_insert(rhash* m, uintptr_t key)
+{
+	assert(key != 0);
+	size_t i;
+	for(i = rhash_home(m, key); m->slot[i].key != 0; i = (i+1) & m->mask)
+		if(m->slot[i].key == key) return & m->slot[i];
+	if(4*(m->size+1) > 3*(m->mask+1)) return NULL;
+	m->slot[i].key = key;
+	m->slot[i].unum = 0;
+	m->size++;
+	return & m->slot[i];
+}
+
+/** @brief Remove the key in slot @c s, which was returned by the map. */
+static inline void rhash_erase(rhash* m, rhash_slot* s)
+{
+	size_t hole = s - m->slot;
+	assert(hole <= m->mask && s->key != 0);
+	m->size--;
+
+	/* Move back each following entry whose home does not lie between the hole and it */
+	for(size_t i = (hole+1) & m->mask; m->slot[i].key != 0; i = (i+1) & m->mask) {
+		size_t home = rhash_home(m, m->slot[i].key);
+		if(((i - home) & m->mask) >= ((i - hole) & m->mask)) {
+			m->slot[hole] = m->slot[i];
+			hole = i;
+		}
+	}
+	m->slot[hole].key = 0;
+}
+
+/** @brief Remove a key from the map. Return 0 if it was found, else -1. */
+static inline int rhash_remove(rhash* m, uintptr_t key)
+{
+	rhash_slot* s = rhash_find(m, key);
+	if(s == NULL) return -1;
+	rhash_erase(m, s);
+	return 0;
+}
+
+/**
+	@brief Move the map to new slots, and return the old slots to be released.
+	@pre @c capacity is a power of 2, large enough for the keys of the map
+ */
+static inline rhash_slot* rhash_rehash(rhash* m, rhash_slot* slots, size_t capacity)
+{
+	rhash old = *m;
+	rhash_init(m, slots, capacity);
+	for(size_t i=0; i<=old.mask; i++) 
+		if(old.slot[i].key != 0) {
+			rhash_slot* s = rhash_insert(m, old.slot[i].key);
+			assert(s != NULL);
+			*s = old.slot[i];
+		}
+	return old.slot;
+}
+
+/* @} rhash */
+
+
+
+/**
+	@defgroup bitmaps  Bitmap allocators
+	@brief  Sets of small integers, stored as arrays of 64-bit words.
+
+	A bitmap of @c n bits takes @c BITMAP_WORDS(n) words, provided by the caller.
+	Finding the lowest clear (or set) bit from a position scans a word at a time.
+
+	@{
+ */
+
+/** @brief The words of a bitmap of @c n bits */
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+/** @brief Set bit @c i */
+static inline void bitmap_set(uint64_t* bm, unsigned int i) { bm[i/64] |= 1ull << (i%64); }
+
+/** @brief Clear bit @c i */
+static inline void bitmap_clear(uint64_t* bm, unsigned int i) { bm[i/64] &= ~(1ull << (i%64)); }
+
+/** @brief Return non-zero iff bit @c i is set */
+static inline int bitmap_test(const uint64_t* bm, unsigned int i) { return (bm[i/64] >> (i%64)) & 1; }
+
+/*
+	Return the lowest bit at or after @c from, of @c n bits, which equals
+	@c val, or -1.
+ */
+static inline int bitmap_scan(const uint64_t* bm, unsigned int n, unsigned int from, int val)
+{
+	uint64_t flip = val ? 0 : ~0ull;
+	for(unsigned int w = from / 64; w < BITMAP_WORDS(n); w++) {
+		uint64_t m = bm[w] ^ flip;
+		if(w == from / 64) m &= ~0ull << (from % 64);
+		if(m) {
+			unsigned int i = 64*w + __builtin_ctzll(m);
+			return (i < n) ? (int) i : -1;
+		}
+	}
+	return -1;
+}
+
+/** @brief Return the lowest set bit at or after @c from, or -1 */
+static inline int bitmap_next_set(const uint64_t* bm, unsigned int n, unsigned int from)
+{
+	return bitmap_scan(bm, n, from, 1);
+}
+
+/** @brief Return the lowest clear bit at or after @c from, or -1 */
+static inline int bitmap_next_clear(const uint64_t* bm, unsigned int n, unsigned int from)
+{
+	return bitmap_scan(bm, n, from, 0);
+}
+
+/** @brief Set and return the lowest clear bit, or return -1 if all @c n bits are set. */
+static inline int bitmap_alloc(uint64_t* bm, unsigned int n)
+{
+	int i = bitmap_next_clear(bm, n, 0);
+	if(i >= 0) bitmap_set(bm, i);
+	return i;
+}
+
+/* @} bitmaps */
+
+
+
+/**
+	@defgroup mpsc  Bounded MPSC rings
+	@brief  A lock-free queue of many producers and a single consumer.
+
+	The ring holds up to @c capacity (a power of 2) values in slots
+	provided by the caller. Each slot carries a sequence number, which tells
+	whether it is free for the producer of a position, or full for the
+	consumer. Producers claim positions with a compare-and-swap on @c head; 
+	the consumer alone advances @c tail. Push fails, instead of waiting, 
+	when the ring is full.
+
+	@{
+ */
+
+/** @brief A slot of a ring */
+typedef struct mpsc_slot {
+  size_t seq;           /**< @brief The position this slot is ready for */
+  /** @brief The value, as in @c rlnode */
+  union {
+    PCB* pcb; 
+    TCB* tcb;
+    FCB* fcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+} mpsc_slot;
+
+/** @brief A ring */
+typedef struct mpsc_ring {
+	mpsc_slot* slot;      /**< @brief The slots */
+	size_t mask;          /**< @brief The capacity minus 1 */
+	size_t head;          /**< @brief The next position to push, shared by producers */
+	size_t tail;          /**< @brief The next position to pop, owned by the consumer */
+} mpsc_ring;
+
+/** 
+	@brief Initialize an empty ring over the given slots.
+	@pre @c capacity is a power of 2
+ */
+static inline void mpsc_init(mpsc_ring* r, mpsc_slot* slots, size_t capacity)
+{
+	assert(capacity > 0 && (capacity & (capacity-1)) == 0);
+	r->slot = slots;
+	r->mask = capacity - 1;
+	r->head = r->tail = 0;
+	for(size_t i=0; i<capacity; i++) slots[i].seq = i;
+}
+
+/** @brief Push a value. Return 0 on success, or -1 if the ring is full. */
+static inline int mpsc_push(mpsc_ring* r, void* obj)
+{
+	size_t pos = __atomic_load_n(& r->head, __ATOMIC_RELAXED);
+	for(;;) {
+		mpsc_slot* s = & r->slot[pos & r->mask];
+		intptr_t dif = (intptr_t) __atomic_load_n(& s->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(& r->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				s->obj = obj;
+				__atomic_store_n(& s->seq, pos+1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		}
+		else if(dif < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(& r->head, __ATOMIC_RELAXED);
+	}
+}
+
+/** 
+	@brief Pop a value into @c *obj. Return 0 on success, or -1 if the ring is empty.
+
+	Only one thread at a time may pop from a ring.
+ */
+static inline int mpsc_pop(mpsc_ring* r, void** obj)
+{
+	mpsc_slot* s = & r->slot[r->tail & r->mask];
+	if(__atomic_load_n(& s->seq, __ATOMIC_ACQUIRE) != r->tail+1) 
+		return -1;
+	*obj = s->obj;
+	__atomic_store_n(& s->seq, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+	r->tail++;
+	return 0;
+}
+
+/* @} mpsc */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
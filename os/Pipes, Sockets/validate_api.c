@@ -1,10 +1,16 @@
 
 #include <assert.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -12,6 +18,10 @@
 #include "unit_testing.h"
 
 
+/* The cores booted by the bare tests, one in a uniprocessor build */
+#define BARE_CORES (MAX_CORES < 2 ? MAX_CORES : 2)
+
+
 /*
  *
  *   TESTS
@@ -71,6 +81,96 @@ BARE_TEST(test_boot,
 
 
 
+static int sched_policy_child(int argl, void* args)
+{
+	/* Spin for a few quanta (30msec), then exit with the argument */
+	TimerDuration t = bios_clock();
+	while(bios_clock() < t + 30000);
+	return argl;
+}
+
+static int sched_policy_boot(int argl, void* args)
+{
+	const int N = 8;
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(sched_policy_child, i, NULL) != NOPROC);
+
+	int sum = 0, status;
+	for(int i=0; i<N; i++) {
+		ASSERT(WaitChild(NOPROC, &status) != NOPROC);
+		sum += status;
+	}
+	ASSERT(sum == N*(N-1)/2);
+	return 0;
+}
+
+BARE_TEST(test_sched_policies,
+	"Test that the kernel boots and runs processes with every scheduling\n"
+	"policy, and that unknown policies are rejected.")
+{
+	ASSERT(set_sched_policy("nope") == -1);
+	ASSERT(set_sched_policy(NULL) == -1);
+
+	const char* policies[] = { "rr", "fair", "mlfq" };
+	for(int i=0; i<3; i++) {
+		ASSERT(set_sched_policy(policies[i]) == 0);
+		boot(BARE_CORES, 0, sched_policy_boot, 0, NULL);
+	}
+}
+
+
+static int idle_poll_boot(int argl, void* args)
+{
+	pipe_t ping, pong;
+	ASSERT(Pipe(&ping)==0 && Pipe(&pong)==0);
+	const int ROUNDS = 200;
+
+	int echo(int argl, void* args)
+	{
+		char c;
+		ASSERT(SetAffinity(NOTHREAD, 2)==0);
+		for(int i=0; i<ROUNDS; i++)
+			if(Read(ping.read, &c, 1)!=1 || Write(pong.write, &c, 1)!=1) return -1;
+		return 0;
+	}
+
+	core_stats st0[MAX_CORES], st[MAX_CORES];
+	ASSERT(GetCoreStats(st0, MAX_CORES)==2);
+
+	/* The threads go on separate cores */
+	ASSERT(SetAffinity(NOTHREAD, 1)==0);
+	Tid_t t = CreateThread(echo, 0, NULL);
+	for(int i=0; i<ROUNDS; i++) {
+		char c = 'a' + i % 26;
+		ASSERT(Write(ping.write, &c, 1)==1);
+		ASSERT(Read(pong.read, &c, 1)==1 && c=='a' + i % 26);
+	}
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+
+	/* Each round trip leaves a core idle, and the window is long */
+	ASSERT(GetCoreStats(st, MAX_CORES)==2);
+	unsigned long hits = 0;
+	for(int c=0; c<2; c++) {
+		ASSERT(st[c].idle_poll_misses >= st0[c].idle_poll_misses);
+		hits += st[c].idle_poll_hits - st0[c].idle_poll_hits;
+	}
+	ASSERT(hits > 0);
+	return 0;
+}
+
+BARE_TEST(test_idle_poll,
+	"Test that the kernel runs with idle polling, and counts the polls that\n"
+	"found work.")
+{
+	if(MAX_CORES < 2) return;		/* a uniprocessor build does not poll */
+	ASSERT(set_idle_poll(IDLE_POLL_MAX+1) == -1);
+	ASSERT(set_idle_poll(2000) == 0);
+	boot(2, 0, idle_poll_boot, 0, NULL);
+	ASSERT(set_idle_poll(0) == 0);
+}
+
+
 /*********************************************
  *
  *
@@ -145,6 +245,44 @@ BOOT_TEST(test_waitchild_error_on_nonchild,
 }
 
 
+BOOT_TEST(test_waitchildren,
+	"Test that WaitChildren reaps several exited children per call, and\n"
+	"returns 0 when there are no children."
+	)
+{
+	int exit_with_arg(int argl, void* args) { return *(int*)args; }
+
+	const int N = 8;
+	Pid_t cpid[N];
+	for(int i=0; i<N; i++) {
+		cpid[i] = Exec(exit_with_arg, sizeof(i), &i);
+		ASSERT(cpid[i] != NOPROC);
+	}
+
+	ASSERT(WaitChildren(NULL, NULL, 0) == -1);
+
+	int reaped = 0;
+	while(reaped < N) {
+		Pid_t pids[3];
+		int status[3];
+		int n = WaitChildren(pids, status, 3);
+		ASSERT(n >= 1 && n <= 3);
+		for(int k=0; k<n; k++) {
+			int i=0;
+			while(i<N && cpid[i]!=pids[k]) i++;
+			ASSERT(i<N);
+			ASSERT(status[k] == i);
+			cpid[i] = NOPROC;
+		}
+		reaped += n;
+	}
+
+	ASSERT(WaitChildren(NULL, NULL, 1) == 0);
+	ASSERT(WaitChild(NOPROC, NULL) == NOPROC);
+	return 0;
+}
+
+
 /* used to pass information to parent */
 struct test_pid_rec {
 	Pid_t pid;
@@ -214,6 +352,45 @@ BOOT_TEST(test_exec_copies_arguments,
 }
 
 
+BOOT_TEST(test_execgive_arguments,
+	"Test that ExecGive passes the given buffer of arguments, small or large, and releases it on error."
+	)
+{
+	int child(int argl, void* args)
+	{
+		/* The child sees the buffer itself */
+		char* buf = args;
+		int sum = 0;
+		for(int i=0; i<argl; i++) sum += buf[i];
+		return sum;
+	}
+
+	unsigned int sizes[] = { 1, EXEC_INLINE_ARGS, EXEC_INLINE_ARGS+1, 10000 };
+	for(int k=0; k<4; k++) {
+		char* buf = malloc(sizes[k]);
+		memset(buf, 1, sizes[k]);
+		Pid_t cpid = ExecGive(child, sizes[k], buf, 0, NULL, 0);
+		ASSERT(cpid!=NOPROC);
+		int status;
+		ASSERT(WaitChild(cpid, &status)==cpid);
+		ASSERT(status==(int)sizes[k]);
+
+		/* Copied arguments still work, inline or not */
+		char copy[sizes[k]];
+		memset(copy, 1, sizes[k]);
+		cpid = Exec(child, sizes[k], copy);
+		ASSERT(cpid!=NOPROC);
+		ASSERT(WaitChild(cpid, &status)==cpid);
+		ASSERT(status==(int)sizes[k]);
+	}
+
+	/* A bad map fails, and the buffer is released (checked by valgrind) */
+	Fid_t fdmap[1] = { MAX_FILEID-1 };
+	ASSERT(ExecGive(child, 10, malloc(10), 0, fdmap, 1)==NOPROC);
+	return 0;
+}
+
+
 BOOT_TEST(test_wait_for_any_child, 
 	"Test WaitChild when called to wait on any child."
 	)
@@ -404,6 +581,40 @@ BOOT_TEST(test_cond_timedwait_timeout,
 }
 
 
+BOOT_TEST(test_mutex_contention,
+	"Test that a mutex provides mutual exclusion to many contending threads, "
+	"while some of them sleep holding it."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	volatile int counter = 0;
+	const int N = 8, ROUNDS = 2000;
+
+	int incr(int argl, void* args)
+	{
+		for(int i=0; i<ROUNDS; i++) {
+			Mutex_Lock(&m);
+			int c = counter;
+			if(i % 128 == 0) fibo(15);   /* Hold the mutex for a while */
+			counter = c+1;
+			Mutex_Unlock(&m);
+		}
+		return 0;
+	}
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++) {
+		t[i] = CreateThread(incr, 0, NULL);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(counter == N*ROUNDS);
+	return 0;
+}
+
+
 /*
 	Test that a timed wait on a condition variable terminates at a signal.
  */
@@ -477,6 +688,87 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+BOOT_TEST(test_cond_broadcast_rounds,
+	"Test that broadcasts made while holding the mutex wake up all the waiters,\n"
+	"timed or not, round after round, and that many joiners see a thread exit."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar done = COND_INIT;
+	int round = 0, woken = 0;
+	const int N = 8, ROUNDS = 200;
+
+	int waiter(int argl, void* args)
+	{
+		Mutex_Lock(&m);
+		for(int r = 1; r <= ROUNDS; r++) {
+			/* Half of the waiters time out now and then */
+			while(round < r) {
+				if(argl) Cond_TimedWait(&m, &cv, 1);
+				else Cond_Wait(&m, &cv);
+			}
+			if(++woken == N) Cond_Signal(&done);
+		}
+		Mutex_Unlock(&m);
+		return argl;
+	}
+
+	Tid_t t[N];
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(waiter, i%2, NULL);
+
+	Mutex_Lock(&m);
+	for(int r = 1; r <= ROUNDS; r++) {
+		woken = 0;
+		round = r;
+		Cond_Broadcast(&cv);
+		while(woken < N) Cond_Wait(&m, &done);
+	}
+	Mutex_Unlock(&m);
+
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==i%2);
+	}
+
+	/* Many joiners of one thread. Those in ThreadJoin when it exits get its
+	   exit value, and so does the first to come after that, which reaps it. 
+	   The rest find no thread. */
+	int joining = 0;
+	int sleeper(int argl, void* args) 
+	{
+		Mutex_Lock(&m);
+		while(joining < N) Cond_Wait(&m, &done);
+		Mutex_Unlock(&m);
+		return 7;
+	}
+	int joiner(int argl, void* args) 
+	{
+		Mutex_Lock(&m);
+		joining++;
+		Cond_Signal(&done);
+		Mutex_Unlock(&m);
+		int exitval = 0;
+		if(ThreadJoin(*(Tid_t*) args, &exitval) == -1) return 0;
+		return (exitval == 7) ? 1 : -1;
+	}
+
+	Tid_t s = CreateThread(sleeper, 0, NULL);
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(joiner, 0, &s);
+	int joined = 0;
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && (exitval==0 || exitval==1));
+		joined += exitval;
+	}
+	ASSERT(joined >= 1);
+	return 0;
+}
+
+
+
 /*********************************************
  *
  *
@@ -595,6 +887,27 @@ BOOT_TEST(test_read_kbd,
 }
 
 
+BOOT_TEST(test_poll_kbd,
+	"Test that Poll on terminal 0 waits for keyboard input, and the input can then be read.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	int ev = POLL_READ | POLL_WRITE;
+	ASSERT(Poll(&fterm, &ev, 1, 0)==1);
+	ASSERT(ev == POLL_WRITE);
+
+	sendme(0, "Hello");
+	ev = POLL_READ;
+	ASSERT(Poll(&fterm, &ev, 1, POLL_INFINITE)==1);
+	ASSERT(ev == POLL_READ);
+	checked_read(fterm, "Hello");
+	return 0;
+}
+
+
 BOOT_TEST(test_read_kbd_big,
 	"Test that we can read massively from the keyboard on terminal 0.",
 	.minimum_terminals = 1, .timeout = 20
@@ -727,131 +1040,824 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+/* A child of test_execex_fdmap */
+static int fdmap_child(int argl, void* args)
+{
+	/* fid 0 was left closed, the pipe was moved to fid 1 */
+	char c;
+	ASSERT(Read(0, &c, 1)==-1);
+	ASSERT(Write(1, "Hello", 6)==6);
+	for(Fid_t fid=2; fid<MAX_FILEID; fid++)
+		ASSERT(Write(fid, "x", 1)==-1);
+	return 0;
+}
 
-BOOT_TEST(test_null_device,
-	"Test the null device."
+BOOT_TEST(test_execex_fdmap,
+	"Test that ExecEx gives the child only the streams of the map"
 	)
 {
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Fid_t nul = OpenNull();
+	ASSERT(nul!=NOFILE);
+
+	Fid_t bad[2] = { NOFILE, MAX_FILEID-1 };
+	ASSERT(ExecEx(fdmap_child, 0, NULL, 0, bad, 2)==NOPROC);
+	ASSERT(ExecEx(fdmap_child, 0, NULL, 0, bad, -1)==NOPROC);
+	ASSERT(ExecEx(fdmap_child, 0, NULL, 0, NULL, 1)==NOPROC);
+	ASSERT(ExecEx(fdmap_child, 0, NULL, 0, bad, MAX_FILEID+1)==NOPROC);
+
+	Fid_t fdmap[2] = { NOFILE, p.write };
+	Pid_t cpid = ExecEx(fdmap_child, 0, NULL, 0, fdmap, 2);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(Close(p.write)==0);
 
-	void test_read(Fid_t fid)
-	{
-		char z[] = "zavarakatranemia";
-		char z1[] = "\0\0\0\0\0\0\0\0\0\0anemia";
-		ASSERT(Read(fid, z, 10)==10);
-		ASSERT(memcmp(z,z1, 17)==0);
-	}
+	/* The end of data shows that the child had no other copy of the pipe */
+	char buf[6];
+	ASSERT(Read(p.read, buf, 6)==6);
+	ASSERT(strcmp(buf, "Hello")==0);
+	ASSERT(Read(p.read, buf, 6)==0);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+	return 0;
+}
 
-	Fid_t fn = OpenNull();
-	ASSERT(fn!=-1);
 
-	test_read(fn);
-	ASSERT(Write(fn, NULL, 123456)==123456);
+/* The stages of the pipeline of test_spawn_pipeline */
+static int spawn_source(int argl, void* args)
+{
+	for(Fid_t fid=2; fid<MAX_FILEID; fid++)
+		ASSERT(Write(fid, "x", 1)==-1);
+	ASSERT(Write(1, "hello", 5)==5);
+	return 0;
+}
 
-	ASSERT(Close(fn)==0);
+static int spawn_upper(int argl, void* args)
+{
+	for(Fid_t fid=2; fid<MAX_FILEID; fid++)
+		ASSERT(Write(fid, "x", 1)==-1);
+	char buf[16];
+	int n;
+	while((n = Read(0, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++) buf[i] = toupper(buf[i]);
+		ASSERT(Write(1, buf, n)==n);
+	}
+	return n;
+}
+
+/* Fid argl was closed by SPAWN_CLOSE, the rest were inherited */
+static int spawn_inherited(int argl, void* args)
+{
+	ASSERT(Write(argl, "x", 1)==-1);
+	ASSERT(Write(1, "ok", 2)==2);
 	return 0;
 }
 
+/* The lowest free fid of the caller */
+static Fid_t lowest_free_fid()
+{
+	Fid_t fid = OpenNull();
+	ASSERT(fid!=NOFILE);
+	ASSERT(Close(fid)==0);
+	return fid;
+}
+
+BOOT_TEST(test_spawn_pipeline,
+	"Test that Spawn builds the streams of the child by its actions, and starts a pipeline\n"
+	"with one call for each stage."
+	)
+{
+	Fid_t nul = OpenNull();
+	ASSERT(nul!=NOFILE);
+	Fid_t free0 = lowest_free_fid();
+
+	/* Illegal actions change nothing */
+	fd_action bad_op[1] = { { 42, 0, nul } };
+	fd_action bad_fid[2] = { { SPAWN_PIPE_WRITE, 1, NOFILE }, { SPAWN_DUP, MAX_FILEID, nul } };
+	fd_action closed_src[2] = { { SPAWN_PIPE_READ, 0, NOFILE }, { SPAWN_MOVE, 1, free0 } };
+	ASSERT(Spawn(spawn_source, 0, NULL, bad_op, 1)==NOPROC);
+	ASSERT(Spawn(spawn_source, 0, NULL, bad_fid, 2)==NOPROC);
+	ASSERT(Spawn(spawn_source, 0, NULL, closed_src, 2)==NOPROC);
+	ASSERT(Spawn(spawn_source, 0, NULL, closed_src, -1)==NOPROC);
+	ASSERT(Spawn(spawn_source, 0, NULL, NULL, 1)==NOPROC);
+	ASSERT(Spawn(spawn_source, 0, NULL, closed_src, SPAWN_MAX_ACTIONS+1)==NOPROC);
+	ASSERT(lowest_free_fid()==free0);
+	ASSERT(Write(nul, "x", 1)==1);
+
+	/* source | upper | upper, each stage by one call */
+	Task stage[3] = { spawn_source, spawn_upper, spawn_upper };
+	Pid_t pid[3];
+	Fid_t prev = NOFILE;
+	for(int i=0; i<3; i++) {
+		fd_action actions[2] = {
+			{ (i==0) ? SPAWN_CLOSE : SPAWN_MOVE, 0, prev },
+			{ SPAWN_PIPE_WRITE, 1, NOFILE }
+		};
+		pid[i] = Spawn(stage[i], 0, NULL, actions, 2);
+		ASSERT(pid[i]!=NOPROC);
+		if(i>0) 
+			ASSERT(Write(prev, "x", 1)==-1);    /* moved to the child */
+		prev = actions[1].src;
+		ASSERT(prev!=NOFILE);
+	}
 
+	/* The end of data shows that nobody else holds a write end */
+	char buf[8];
+	int n = 0, r;
+	while((r = Read(prev, buf+n, sizeof(buf)-n)) > 0) n += r;
+	ASSERT(r==0 && n==5 && memcmp(buf, "HELLO", 5)==0);
+	ASSERT(Close(prev)==0);
+	for(int i=0; i<3; i++) {
+		int status;
+		ASSERT(WaitChild(pid[i], &status)==pid[i] && status==0);
+	}
+	ASSERT(lowest_free_fid()==free0);
 
-/***********************************************************************************8
-*************************************************/
+	/* Inherit all, then drop one and add a pipe */
+	fd_action inherit[3] = { { SPAWN_INHERIT, 0, NOFILE }, { SPAWN_CLOSE, nul, NOFILE }, { SPAWN_PIPE_WRITE, 1, NOFILE } };
+	Pid_t cpid = Spawn(spawn_inherited, nul, NULL, inherit, 3);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(Read(inherit[2].src, buf, 2)==2 && memcmp(buf, "ok", 2)==0);
+	ASSERT(Read(inherit[2].src, buf, 2)==0);
+	ASSERT(Close(inherit[2].src)==0);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+	ASSERT(Close(nul)==0);
+	return 0;
+}
 
 
+BOOT_TEST(test_file_stats,
+	"Test the counters of GetFileStats"
+	)
+{
+	file_stats st0, st;
+	ASSERT(GetFileStats(NULL)==-1);
+	ASSERT(GetFileStats(&st0)==0);
+	ASSERT(st0.total >= MAX_FILEID);
+	ASSERT(st0.in_use == st0.allocs - st0.frees);
+
+	pipe_t p[20];
+	for(int i=0; i<20; i++)
+		ASSERT(Pipe(p+i)==0);
+	ASSERT(GetFileStats(&st)==0);
+	ASSERT(st.in_use == st0.in_use + 40);
+	ASSERT(st.allocs == st0.allocs + 40);
+	ASSERT(st.refills > st0.refills);
+
+	for(int i=0; i<20; i++) {
+		ASSERT(Close(p[i].read)==0);
+		ASSERT(Close(p[i].write)==0);
+	}
+	ASSERT(GetFileStats(&st)==0);
+	ASSERT(st.in_use == st0.in_use);
+	ASSERT(st.frees == st0.frees + 40);
+	ASSERT(st.failures == st0.failures);
+	return 0;
+}
 
 
-void checked_write(Fid_t fid, const char* message)
+BOOT_TEST(test_core_stats,
+	"Test that GetCoreStats charges the time of running threads to their cores"
+	)
 {
-	int mlen = strlen(message);
-	for(int count=0; count < mlen;) {
-		int wno = Write(fid, message+count, 1);
-		ASSERT(wno>0);
-		count += wno;
+	core_stats st0[MAX_CORES], st[MAX_CORES];
+	ASSERT(GetCoreStats(NULL, 1)==-1);
+	ASSERT(GetCoreStats(st0, MAX_CORES)==cpu_cores());
+	ASSERT(GetCoreStats(st0, 1)==1);
+	ASSERT(GetCoreStats(st0, MAX_CORES)==cpu_cores());
+
+	int busy(int argl, void* args) { return fibo(25); }
+	Tid_t t = CreateThread(busy, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	fibo(25);
+
+	ASSERT(GetCoreStats(st, MAX_CORES)==cpu_cores());
+	unsigned long busy_time = 0, switches = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		ASSERT(st[c].busy_time >= st0[c].busy_time);
+		ASSERT(st[c].idle_time >= st0[c].idle_time);
+		ASSERT(st[c].steals >= st0[c].steals);
+		ASSERT(st[c].interrupts >= st0[c].interrupts);
+		busy_time += st[c].busy_time - st0[c].busy_time;
+		switches += st[c].switches - st0[c].switches;
 	}
+	/* The thread ran and left its core */
+	ASSERT(busy_time > 0);
+	ASSERT(switches >= 1);
+	return 0;
 }
 
 
+#define BLOCK_TEST_BLOCKS 64
+#define BLOCK_TEST_SIZE (BLOCK_TEST_BLOCKS*BIOS_BLOCK_SIZE)
 
-BOOT_TEST(test_write_con,
-	"Test that we can write a few bytes to the console on terminal 0.",
-	.minimum_terminals = 1
-	)
+static char block_pattern(unsigned int i) { return (char)(i*7 + i/BIOS_BLOCK_SIZE); }
+
+/* Move the whole disk in pieces of the given size */
+static unsigned int block_transfer_all(Fid_t f, char* buf, int write, unsigned int piece)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	unsigned int done = 0;
+	int rc;
+	do {
+		unsigned int n = BLOCK_TEST_SIZE - done;
+		if(n > piece) n = piece;
+		rc = write ? Write(f, buf+done, n) : Read(f, buf+done, n);
+		if(rc > 0) done += rc;
+	} while(rc > 0 && done < BLOCK_TEST_SIZE);
+	return done;
+}
 
-	expect(0, "Hello");
-	checked_write(fterm, "Hello");
+static int block_write_boot(int argl, void* args)
+{
+	ASSERT(GetBlockDevices()==1);
+	ASSERT(OpenBlock(1)==NOFILE);
+	ASSERT(GetBlockStats(NULL)==-1);
+
+	char* buf = malloc(BLOCK_TEST_SIZE);
+	for(unsigned int i=0; i<BLOCK_TEST_SIZE; i++) buf[i] = block_pattern(i);
+
+	Fid_t f = OpenBlock(0);
+	ASSERT(f!=NOFILE);
+	ASSERT(StreamType(f)==STREAM_BLOCK);
+	ASSERT(block_transfer_all(f, buf, 1, 3*BIOS_BLOCK_SIZE)==BLOCK_TEST_SIZE);
+	ASSERT(Write(f, buf, 1)==-1);
+	ASSERT(Close(f)==0);
+
+	/* Whole blocks are not read, and every block was written once, by a few coalesced requests */
+	block_stats st;
+	ASSERT(GetBlockStats(&st)==0);
+	ASSERT(st.blocks_read==0);
+	ASSERT(st.blocks_written==BLOCK_TEST_BLOCKS);
+	ASSERT(st.write_requests <= BLOCK_TEST_BLOCKS/BIOS_MAX_REQUEST_BLOCKS + 2);
+
+	/* The blocks are still cached */
+	memset(buf, 0, BLOCK_TEST_SIZE);
+	f = OpenBlock(0);
+	ASSERT(block_transfer_all(f, buf, 0, 10000)==BLOCK_TEST_SIZE);
+	ASSERT(Read(f, buf, 1)==0);
+	ASSERT(Close(f)==0);
+	for(unsigned int i=0; i<BLOCK_TEST_SIZE; i++) ASSERT(buf[i]==block_pattern(i));
+
+	block_stats st2;
+	ASSERT(GetBlockStats(&st2)==0);
+	ASSERT(st2.misses==st.misses);
+	ASSERT(st2.blocks_read==st.blocks_read);
+	ASSERT(st2.hits > st.hits);
+
+	free(buf);
 	return 0;
 }
 
+static int block_read_boot(int argl, void* args)
+{
+	char* buf = malloc(BLOCK_TEST_SIZE);
+	Fid_t f = OpenBlock(0);
+	ASSERT(f!=NOFILE);
+	ASSERT(block_transfer_all(f, buf, 0, 10000)==BLOCK_TEST_SIZE);
+	ASSERT(Close(f)==0);
+	for(unsigned int i=0; i<BLOCK_TEST_SIZE; i++) ASSERT(buf[i]==block_pattern(i));
+
+	/* A cold sequential read is mostly served by read-ahead, in few requests */
+	block_stats st;
+	ASSERT(GetBlockStats(&st)==0);
+	ASSERT(st.blocks_read==BLOCK_TEST_BLOCKS);
+	ASSERT(st.readahead > BLOCK_TEST_BLOCKS/2);
+	ASSERT(st.read_requests <= BLOCK_TEST_BLOCKS/4);
+	ASSERT(st.blocks_written==0);
+
+	free(buf);
+	return 0;
+}
 
-BOOT_TEST(test_write_con_big,
-	"Test that we can write massively to the console on terminal 0.",
-	.minimum_terminals = 1
+BARE_TEST(test_block_device,
+	"Test that a block device stores its data in the host file, through the\n"
+	"buffer cache, and that the cache coalesces and reads ahead."
 	)
 {
-	assert(GetTerminalDevices()>0);
-	Fid_t fterm = OpenTerminal(0);
-	ASSERT(fterm!=NOFILE);
+	char path[] = "/tmp/tinyos_diskXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd >= 0);
+	ASSERT(ftruncate(fd, BLOCK_TEST_SIZE)==0);
+
+	ASSERT(vm_config_disks("/nonexistent/disk.img")==-1);
+	ASSERT(vm_config_disks(path)==0);
+	boot(BARE_CORES, 0, block_write_boot, 0, NULL);
+	boot(BARE_CORES, 0, block_read_boot, 0, NULL);
+	ASSERT(vm_config_disks(NULL)==0);
+
+	char* buf = malloc(BLOCK_TEST_SIZE);
+	ASSERT(pread(fd, buf, BLOCK_TEST_SIZE, 0)==BLOCK_TEST_SIZE);
+	for(unsigned int i=0; i<BLOCK_TEST_SIZE; i++) ASSERT(buf[i]==block_pattern(i));
+	free(buf);
+
+	close(fd);
+	unlink(path);
+}
 
-	char bytes[1025];
-	FUDGE(bytes);
-	bytes[1024]='\0';
 
-	/* send me 1Mbyte */
-	for(int i=0; i<1024; i++)
-		expect(0, bytes);
+BOOT_TEST(test_file_open_read_write,
+	"Test that files are created, read and written through their position,\n"
+	"and that Seek and Stat report it."
+	)
+{
+	ASSERT(Open("/f", OPEN_RDWR)==NOFILE);
+	ASSERT(Open("f", OPEN_RDWR|OPEN_CREAT)==NOFILE);
+	ASSERT(Open("/", OPEN_RDWR)==NOFILE);
+	ASSERT(Open("/f", OPEN_CREAT)==NOFILE);
+
+	Fid_t f = Open("/f", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(StreamType(f)==STREAM_FILE);
+	ASSERT(Open("/f", OPEN_RDWR|OPEN_CREAT|OPEN_EXCL)==NOFILE);
+
+	ASSERT(Write(f, "hello world", 11)==11);
+	ASSERT(Seek(f, 0, SEEK_FROM_CURRENT)==11);
+	ASSERT(Seek(f, -5, SEEK_FROM_END)==6);
+	char buf[32];
+	ASSERT(Read(f, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "world", 5)==0);
+	ASSERT(Read(f, buf, sizeof(buf))==0);
+	ASSERT(Seek(f, -1, SEEK_FROM_START)==-1);
+	ASSERT(Seek(f, MAX_FILE_SIZE+1, SEEK_FROM_START)==-1);
+
+	/* A gap reads as zeros */
+	ASSERT(Seek(f, 20, SEEK_FROM_START)==20);
+	ASSERT(Write(f, "!", 1)==1);
+	ASSERT(Seek(f, 0, SEEK_FROM_START)==0);
+	ASSERT(Read(f, buf, sizeof(buf))==21);
+	for(int i=11; i<20; i++) ASSERT(buf[i]==0);
+	ASSERT(buf[20]=='!');
+
+	file_info info;
+	ASSERT(Stat("/f", NULL)==-1);
+	ASSERT(Stat("/g", &info)==-1);
+	ASSERT(Stat("/f", &info)==0);
+	ASSERT(info.type==FILE_REGULAR && info.size==21);
+	ASSERT(Stat("/", &info)==0);
+	ASSERT(info.type==FILE_DIRECTORY && info.size==1);
+
+	/* The modes of a stream are honoured */
+	Fid_t r = Open("/f", OPEN_RDONLY);
+	ASSERT(Write(r, "x", 1)==-1);
+	Fid_t a = Open("/f", OPEN_WRONLY|OPEN_APPEND);
+	ASSERT(Read(a, buf, 1)==-1);
+	ASSERT(Write(a, "?", 1)==1);
+	ASSERT(Seek(a, 0, SEEK_FROM_CURRENT)==22);
+	ASSERT(Close(a)==0);
+	ASSERT(Read(r, buf, sizeof(buf))==22 && buf[21]=='?');
+	ASSERT(Close(r)==0);
+
+	Fid_t t = Open("/f", OPEN_WRONLY|OPEN_TRUNC);
+	ASSERT(Stat("/f", &info)==0 && info.size==0);
+	ASSERT(Close(t)==0);
+	ASSERT(Close(f)==0);
+	return 0;
+}
 
-	/* Create a 16kb block */
-	char buffer[16384];
-	FUDGE(buffer);
 
-	int total = 1<<20;
-	int count = 0;
+BOOT_TEST(test_file_directories,
+	"Test that directories are created and removed, and that paths are resolved."
+	)
+{
+	ASSERT(MkDir("/")==-1);
+	ASSERT(MkDir("/a/b")==-1);
+	ASSERT(MkDir("/a")==0);
+	ASSERT(MkDir("/a")==-1);
+	ASSERT(MkDir("//a//b/")==0);
+
+	Fid_t f = Open("/a/b/c", OPEN_WRONLY|OPEN_CREAT);
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "data", 4)==4);
+	ASSERT(Close(f)==0);
+	ASSERT(Open("/a/b/c/d", OPEN_WRONLY|OPEN_CREAT)==NOFILE);
+	ASSERT(Open("/a/b", OPEN_RDONLY)==NOFILE);
+
+	/* Names are limited to MAX_NAME_LENGTH */
+	char name[MAX_NAME_LENGTH+3];
+	memset(name, 'x', sizeof(name));
+	name[0] = '/';
+	name[MAX_NAME_LENGTH+2] = '\0';
+	ASSERT(MkDir(name)==-1);
+	name[MAX_NAME_LENGTH+1] = '\0';
+	ASSERT(MkDir(name)==0);
+	ASSERT(Unlink(name)==0);
+
+	file_info info;
+	ASSERT(Stat("/a/b", &info)==0 && info.type==FILE_DIRECTORY && info.size==1);
+	ASSERT(Stat("/a/b/c", &info)==0 && info.type==FILE_REGULAR && info.size==4);
+
+	ASSERT(Unlink("/")==-1);
+	ASSERT(Unlink("/a/b")==-1);
+	ASSERT(Unlink("/a/b/c")==0);
+	ASSERT(Stat("/a/b/c", &info)==-1);
+	ASSERT(Unlink("/a/b")==0);
+	ASSERT(Unlink("/a")==0);
+	ASSERT(Stat("/a", &info)==-1);
+	return 0;
+}
 
-	while(count < total)
-	{
-		int remain = total-count;
 
-		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
-		ASSERT(rc>0);
-		count += rc;
+BOOT_TEST(test_file_map,
+	"Test that a file is held in few extents, that MapFile returns them\n"
+	"without copying, and that mappings outlive the stream and the file."
+	)
+{
+	const unsigned int size = 3*1024*1024 + 100;
+	Fid_t f = Open("/big", OPEN_RDWR|OPEN_CREAT);
+	ASSERT(MapFile(f, 0, NULL)==NULL);
+	unsigned int len;
+	ASSERT(MapFile(f, 0, &len)==NULL);
+
+	char* buf = malloc(size);
+	for(unsigned int i=0; i<size; i++) buf[i] = (char)(i*13 + i/4096);
+	for(unsigned int done=0; done<size; done += 5000)
+		ASSERT(Write(f, buf+done, (size-done < 5000) ? size-done : 5000) > 0);
+
+	file_info info;
+	ASSERT(Stat("/big", &info)==0 && info.size==size);
+	ASSERT(info.extents <= 16);
+
+	/* The mappings cover the file, in order */
+	unsigned long off = 0;
+	unsigned int maps = 0;
+	char* first = NULL;
+	while(off < size) {
+		char* p = MapFile(f, off, &len);
+		ASSERT(p!=NULL && len > 0 && off+len <= size);
+		ASSERT(memcmp(p, buf+off, len)==0);
+		if(first == NULL) first = p; else ASSERT(UnmapFile(p)==0);
+		off += len;
+		maps++;
 	}
-
+	ASSERT(maps <= info.extents);
+	ASSERT(MapFile(f, size, &len)==NULL);
+	ASSERT(UnmapFile(buf)==-1);
+
+	/* Writes are seen through the mapping, which outlives the file */
+	ASSERT(Seek(f, 0, SEEK_FROM_START)==0);
+	ASSERT(Write(f, "xyz", 3)==3);
+	ASSERT(memcmp(first, "xyz", 3)==0);
+	ASSERT(Close(f)==0);
+	ASSERT(Unlink("/big")==0);
+	ASSERT(first[3]==buf[3]);
+	ASSERT(UnmapFile(first)==0);
+	ASSERT(UnmapFile(first)==-1);
+
+	free(buf);
 	return 0;
 }
 
 
+static void aio_push(aio_ring* ring, aio_sqe sqe)
+{
+	ring->sq[ring->sq_tail & (ring->entries-1)] = sqe;
+	__atomic_store_n(& ring->sq_tail, ring->sq_tail+1, __ATOMIC_RELEASE);
+}
 
-BOOT_TEST(test_write_error_on_bad_fid,
-	"Test that Write will return an error when called on a bad fid"
+static int aio_pop(aio_ring* ring, aio_cqe* cqe)
+{
+	if(__atomic_load_n(& ring->cq_tail, __ATOMIC_ACQUIRE) == ring->cq_head) return 0;
+	*cqe = ring->cq[ring->cq_head & (2*ring->entries-1)];
+	__atomic_store_n(& ring->cq_head, ring->cq_head+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+BOOT_TEST(test_aio_pipe,
+	"Test that a read and a write of a pipe, submitted in one batch by one\n"
+	"thread, both complete, and that AioEnter checks its arguments."
 	)
 {
-	char buffer[10];
-	ASSERT(Write(0, buffer, 10)==-1);
+	aio_ring* ring;
+	ASSERT(AioSetup(0, &ring)==NOFILE);
+	ASSERT(AioSetup(AIO_MAX_ENTRIES+1, &ring)==NOFILE);
+	ASSERT(AioSetup(4, NULL)==NOFILE);
+
+	Fid_t r = AioSetup(3, &ring);
+	ASSERT(r!=NOFILE && ring->entries==4);
+	ASSERT(AioEnter(NOFILE, 0, 0, 0)==-1);
+	Fid_t null = OpenNull();
+	ASSERT(AioEnter(null, 0, 0, 0)==-1);
+	ASSERT(Close(null)==0);
+	ASSERT(AioEnter(r, 0, 0, 0)==0);
+	ASSERT(Read(r, NULL, 0)==-1);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	char in[6] = {0};
+
+	/* The read is started first, and blocks until the write */
+	aio_push(ring, (aio_sqe){ .op=AIO_READ, .fid=p.read, .buf=in, .len=5, .user_data=(void*)1 });
+	aio_push(ring, (aio_sqe){ .op=AIO_WRITE, .fid=p.write, .buf="hello", .len=5, .user_data=(void*)2 });
+	aio_push(ring, (aio_sqe){ .op=AIO_NOP, .user_data=(void*)3 });
+	ASSERT(AioEnter(r, 3, 3, AIO_INFINITE)==3);
+	ASSERT(ring->sq_head==3);
+
+	int seen = 0;
+	aio_cqe cqe;
+	while(aio_pop(ring, &cqe)) {
+		intptr_t tag = (intptr_t) cqe.user_data;
+		ASSERT(tag>=1 && tag<=3);
+		ASSERT(cqe.result == (tag==3 ? 0 : 5));
+		seen |= 1<<tag;
+	}
+	ASSERT(seen==0xe);
+	ASSERT(strcmp(in, "hello")==0);
+
+	/* A bad fid completes with an error */
+	aio_push(ring, (aio_sqe){ .op=AIO_READ, .fid=MAX_FILEID, .buf=in, .len=5 });
+	ASSERT(AioEnter(r, 1, 1, AIO_INFINITE)==1);
+	ASSERT(aio_pop(ring, &cqe) && cqe.result==-1);
+
+	/* A read that does not complete times out, and is discarded by Close */
+	aio_push(ring, (aio_sqe){ .op=AIO_READ, .fid=p.read, .buf=in, .len=5 });
+	ASSERT(AioEnter(r, 1, 1, 50)==1);
+	ASSERT(! aio_pop(ring, &cqe));
+	ASSERT(Close(r)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Close(p.read)==0);
 	return 0;
 }
 
 
-BOOT_TEST(test_write_to_many_terminals,
-	"Test that Write can send to all terminals",
-	.minimum_terminals = 2
+BOOT_TEST(test_aio_many_pending,
+	"Test that more operations than the entries of a ring can wait to start,\n"
+	"when the workers are all blocked, and that each one completes once."
 	)
 {
-	Fid_t term[MAX_TERMINALS];
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		term[i] = OpenTerminal(i);
-		ASSERT(term[i]!=NOFILE);
+	enum { N = 32 };
+	aio_ring* ring;
+	Fid_t r = AioSetup(N, &ring);
+	ASSERT(r!=NOFILE && ring->entries==N);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	char in[2*N];
+
+	/* Two batches of reads of an empty pipe, all but the first
+	   AIO_MAX_WORKERS of them waiting for a worker */
+	for(int b=0; b<2; b++) {
+		for(intptr_t i=b*N; i<(b+1)*N; i++)
+			aio_push(ring, (aio_sqe){ .op=AIO_READ, .fid=p.read, .buf=in+i, .len=1, .user_data=(void*)i });
+		ASSERT(AioEnter(r, N, 0, 0)==N);
 	}
 
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
-		char message[32];
-		sprintf(message, "This is terminal %d", i);
-
-		expect(i, message);
+	char out[2*N];
+	memset(out, 'x', sizeof(out));
+	ASSERT(Write(p.write, out, sizeof(out))==sizeof(out));
+	ASSERT(AioEnter(r, 0, 2*N, AIO_INFINITE)==0);
+
+	int seen[2*N] = { 0 };
+	aio_cqe cqe;
+	while(aio_pop(ring, &cqe)) {
+		intptr_t tag = (intptr_t) cqe.user_data;
+		ASSERT(tag>=0 && tag<2*N);
+		ASSERT(cqe.result==1);
+		seen[tag]++;
 	}
-	for(uint i = 0; i < GetTerminalDevices(); i++) {
+	for(int i=0; i<2*N; i++)
+		ASSERT(seen[i]==1);
+
+	ASSERT(Close(r)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Close(p.read)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_aio_sockets,
+	"Test that an accept and a connect, submitted in one batch by one thread,\n"
+	"both complete, and that the connection is usable."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+
+	aio_ring* ring;
+	Fid_t r = AioSetup(8, &ring);
+	ASSERT(r!=NOFILE);
+
+	aio_push(ring, (aio_sqe){ .op=AIO_ACCEPT, .fid=lsock, .user_data=(void*)1 });
+	aio_push(ring, (aio_sqe){ .op=AIO_CONNECT, .fid=cli, .port=100, .timeout=1000, .user_data=(void*)2 });
+	ASSERT(AioEnter(r, 2, 2, AIO_INFINITE)==2);
+
+	Fid_t srv = NOFILE;
+	int connected = 0;
+	aio_cqe cqe;
+	while(aio_pop(ring, &cqe)) {
+		if(cqe.user_data==(void*)1) srv = cqe.result;
+		else { ASSERT(cqe.result==0); connected = 1; }
+	}
+	ASSERT(srv!=NOFILE && connected);
+
+	char buf[4];
+	ASSERT(Write(cli, "abc", 4)==4);
+	ASSERT(Read(srv, buf, 4)==4 && strcmp(buf, "abc")==0);
+
+	ASSERT(Close(r)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_many_files,
+	"Test that a process can use all MAX_FILEID fids, given lowest first,\n"
+	"and that a child inherits the high fids."
+	)
+{
+	for(Fid_t fid=0; fid<MAX_FILEID; fid++)
+		ASSERT(OpenNull()==fid);
+	ASSERT(OpenNull()==NOFILE);
+
+	/* The lowest free fid is given first */
+	ASSERT(Close(700)==0);
+	ASSERT(Close(300)==0);
+	ASSERT(OpenNull()==300);
+	ASSERT(OpenNull()==700);
+
+	/* A high fid can hold any stream */
+	pipe_t p;
+	for(Fid_t fid=2; fid<MAX_FILEID; fid++)
+		ASSERT(Close(fid)==0);
+	ASSERT(Pipe(&p)==0);
+	ASSERT(p.read==2 && p.write==3);
+	ASSERT(Dup2(p.write, MAX_FILEID-1)==0);
+	ASSERT(Close(p.write)==0);
+
+	int child(int argl, void* args)
+	{
+		ASSERT(Write(MAX_FILEID-1, "Hello", 6)==6);
+		return 0;
+	}
+
+	Pid_t cpid = Exec(child, 0, NULL);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(Close(MAX_FILEID-1)==0);
+
+	char buf[6];
+	ASSERT(Read(p.read, buf, 6)==6);
+	ASSERT(strcmp(buf, "Hello")==0);
+	ASSERT(Read(p.read, buf, 6)==0);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_null_device,
+	"Test the null device."
+	)
+{
+
+	void test_read(Fid_t fid)
+	{
+		char z[] = "zavarakatranemia";
+		char z1[] = "\0\0\0\0\0\0\0\0\0\0anemia";
+		ASSERT(Read(fid, z, 10)==10);
+		ASSERT(memcmp(z,z1, 17)==0);
+	}
+
+	Fid_t fn = OpenNull();
+	ASSERT(fn!=-1);
+
+	test_read(fn);
+	ASSERT(Write(fn, NULL, 123456)==123456);
+
+	ASSERT(Close(fn)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_trace_device,
+	"Test that the trace stream is a JSON array of events, when the kernel\n"
+	"records traces, and that it cannot be opened otherwise."
+	)
+{
+#ifdef SCHED_TRACE
+	Fid_t ft = OpenTrace();
+	ASSERT(ft!=NOFILE);
+
+	char buf[1000];
+	char first = 0, last = 0;
+	int events = 0, n;
+	while((n = Read(ft, buf, sizeof(buf))) > 0) {
+		if(first==0) first = buf[0];
+		for(int i=0; i<n; i++) {
+			if(buf[i]=='{' && i+1<n && buf[i+1]=='"') events++;
+			if(buf[i]!='\n') last = buf[i];
+		}
+	}
+	ASSERT(n==0);
+	ASSERT(first=='[');
+	ASSERT(last==']');
+	ASSERT(events > 0);
+	ASSERT(Close(ft)==0);
+#else
+	ASSERT(OpenTrace()==NOFILE);
+#endif
+	return 0;
+}
+
+
+
+/***********************************************************************************8
+*************************************************/
+
+
+
+
+void checked_write(Fid_t fid, const char* message)
+{
+	int mlen = strlen(message);
+	for(int count=0; count < mlen;) {
+		int wno = Write(fid, message+count, 1);
+		ASSERT(wno>0);
+		count += wno;
+	}
+}
+
+
+
+BOOT_TEST(test_write_con,
+	"Test that we can write a few bytes to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	expect(0, "Hello");
+	checked_write(fterm, "Hello");
+	return 0;
+}
+
+
+BOOT_TEST(test_write_con_big,
+	"Test that we can write massively to the console on terminal 0.",
+	.minimum_terminals = 1
+	)
+{
+	assert(GetTerminalDevices()>0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+
+	/* send me 1Mbyte */
+	for(int i=0; i<1024; i++)
+		expect(0, bytes);
+
+	/* Create a 16kb block */
+	char buffer[16384];
+	FUDGE(buffer);
+
+	int total = 1<<20;
+	int count = 0;
+
+	while(count < total)
+	{
+		int remain = total-count;
+
+		int rc = Write(fterm, buffer, (remain<16384)? remain: 16384);
+		ASSERT(rc>0);
+		count += rc;
+	}
+
+	return 0;
+}
+
+
+
+BOOT_TEST(test_write_error_on_bad_fid,
+	"Test that Write will return an error when called on a bad fid"
+	)
+{
+	char buffer[10];
+	ASSERT(Write(0, buffer, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_write_to_many_terminals,
+	"Test that Write can send to all terminals",
+	.minimum_terminals = 2
+	)
+{
+	Fid_t term[MAX_TERMINALS];
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		term[i] = OpenTerminal(i);
+		ASSERT(term[i]!=NOFILE);
+	}
+
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
+		char message[32];
+		sprintf(message, "This is terminal %d", i);
+
+		expect(i, message);
+	}
+	for(uint i = 0; i < GetTerminalDevices(); i++) {
 		char message[32];
 		sprintf(message, "This is terminal %d", i);
 
@@ -871,19 +1877,26 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_sched_policies,
+	&test_idle_poll,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
+	&test_waitchildren,
 	&test_waitchild_error_on_invalid_pid,
 	&test_exec_getpid_wait,
 	&test_exec_copies_arguments,
+	&test_execgive_arguments,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
 	&test_orphans_adopted_by_init,
+	&test_mutex_contention,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_rounds,
 	&test_null_device,
+	&test_trace_device,
 	&test_get_terminals,
 	&test_open_terminals,
 	&test_dup2_error_on_nonfile,
@@ -893,6 +1906,7 @@ TEST_SUITE(basic_tests,
 	&test_close_success_on_valid_nonfile_fid,
 	&test_close_terminals,
 	&test_read_kbd,
+	&test_poll_kbd,
 	&test_read_kbd_big,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
@@ -901,6 +1915,18 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_many_files,
+	&test_execex_fdmap,
+	&test_spawn_pipeline,
+	&test_file_stats,
+	&test_core_stats,
+	&test_block_device,
+	&test_file_open_read_write,
+	&test_file_directories,
+	&test_file_map,
+	&test_aio_pipe,
+	&test_aio_many_pending,
+	&test_aio_sockets,
 	NULL
 };
 
@@ -970,95 +1996,1137 @@ BOOT_TEST(test_exit_many_threads,
 
 
 
-TEST_SUITE(thread_tests, 
-	"A suite of tests for threads."
+BOOT_TEST(test_create_thread_stack_size,
+	"Test that a thread created with a large stack can use all of it."
 	)
 {
-	&test_create_join_thread,
-	&test_exit_many_threads,
-	NULL
-};
+	const unsigned int SZ = 1024*1024;
 
+	int task(int argl, void* args) {
+		/* This does not fit in the default stack */
+		volatile char big[512*1024];
+		for(unsigned int i=0; i<sizeof(big); i+=1024) big[i] = (char)i;
+		int sum = 0;
+		for(unsigned int i=0; i<sizeof(big); i+=1024) sum += big[i];
+		return sum;
+	}
 
+	Tid_t t = CreateThreadStack(task, 0, NULL, SZ);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
 
+	/* A small hint is still a valid thread */
+	int small(int argl, void* args) { return 3; }
+	t = CreateThreadStack(small, 0, NULL, 1);
+	ASSERT(t!=NOTHREAD);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==3);
+	return 0;
+}
 
 
+BOOT_TEST(test_exec_stack_size_in_procinfo,
+	"Test that the main stack size of a process given to ExecStack is reported by procinfo."
+	)
+{
+	const unsigned int SZ = 256*1024;
 
+	int child(int argl, void* args) {
+		volatile char buf[192*1024];
+		buf[0] = 1; buf[sizeof(buf)-1] = 1;
+		return buf[0]+buf[sizeof(buf)-1];
+	}
 
-/*********************************************
- *
- *
- *
- *  Pipe tests
- *
- *
- *
- *********************************************/
+	Pid_t pid = ExecStack(child, 0, NULL, SZ);
+	ASSERT(pid!=NOPROC);
 
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
 
+	int found = 0;
+	procinfo info;
+	while(Read(finfo, (char*)&info, sizeof(info))==sizeof(info)) {
+		if(info.pid==pid) {
+			ASSERT(info.stack_size == SZ);
+			found = 1;
+		}
+	}
+	ASSERT(found);
+	ASSERT(Close(finfo)==0);
 
-BOOT_TEST(test_pipe_open,
-	"Open a pipe and put just a little data in it"
+	int exitval;
+	ASSERT(WaitChild(pid, &exitval)==pid);
+	ASSERT(exitval==2);
+	return 0;
+}
+
+
+BOOT_TEST(test_procinfo_snapshot,
+	"Test that an info stream returns a snapshot taken at OpenInfo, packing\n"
+	"as many records as fit into each Read."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	int void_child(int argl, void* args) { return 0; }
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
+	const int N = 3;
+	Pid_t cpid[N];
+	for(int i=0; i<N; i++)
+		ASSERT((cpid[i] = Exec(void_child, 0, NULL)) != NOPROC);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+
+	/* Not in the snapshot */
+	Pid_t late = Exec(void_child, 0, NULL);
+	ASSERT(late != NOPROC);
+
+	/* A buffer too small for one record */
+	procinfo info[2*N];
+	ASSERT(Read(finfo, (char*)info, sizeof(procinfo)-1) == -1);
+
+	/* init and the children, in pid order */
+	ASSERT(Read(finfo, (char*)info, sizeof(info)) == (N+1)*sizeof(procinfo));
+	ASSERT(info[0].pid == 1);
+	ASSERT(info[0].ppid == NOPROC);
+	for(int i=0; i<N; i++) {
+		ASSERT(info[i+1].pid == cpid[i]);
+		ASSERT(info[i+1].ppid == 1);
 	}
+	ASSERT(Read(finfo, (char*)info, sizeof(info)) == 0);
+	ASSERT(Close(finfo)==0);
+
+	while(WaitChild(NOPROC, NULL) != NOPROC);
 	return 0;
 }
 
 
-BOOT_TEST(test_pipe_fails_on_exhausted_fid,
-	"Test that Pipe will fail if the fids are exhausted."
-	)
+/* Look up the info of a process, returning 1 if it was found */
+static int find_procinfo(Pid_t pid, procinfo* info)
 {
-	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==0);
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==-1);	
-	return 0;
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	int found = 0;
+	while(!found && Read(finfo, (char*)info, sizeof(*info))==sizeof(*info))
+		found = (info->pid == pid);
+	ASSERT(Close(finfo)==0);
+	return found;
 }
 
 
-
-BOOT_TEST(test_pipe_close_reader,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_procinfo_cpu_accounting,
+	"Test that procinfo reports the scheduling of the threads of a process."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	Close(pipe.read);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	int reader(int argl, void* args) {
+		pipe_t* p = args;
+		char c;
+		ASSERT(Read(p->read, &c, 1)==1);
+		return 0;
 	}
+	Pid_t pid = Exec(reader, sizeof(p), &p);
+	ASSERT(pid!=NOPROC);
+
+	/* Wait until the child sleeps at the pipe (cause 3 is SCHED_PIPE) */
+	procinfo info;
+	do {
+		ASSERT(find_procinfo(pid, &info));
+	} while(info.sched_switches[3] == 0);
+	ASSERT(info.alive);
+	ASSERT(info.priority >= 0);
+	ASSERT(info.run_count >= 1);
+
+	ASSERT(Write(p.write, "x", 1)==1);
+	do {
+		ASSERT(find_procinfo(pid, &info));
+	} while(info.alive);
+
+	ASSERT(info.priority == -1);
+	ASSERT(info.run_count >= 2);
+	ASSERT(info.voluntary_switches >= 2);
+	unsigned long total = 0;
+	for(int c=0; c<PROCINFO_SCHED_CAUSES; c++) total += info.sched_switches[c];
+	ASSERT(total == info.voluntary_switches + info.involuntary_switches);
+
+	ASSERT(WaitChild(pid, NULL)==pid);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_close_writer,
-	"Open a pipe and put just a little data in it"
+
+BOOT_TEST(test_procinfo_io_accounting,
+	"Test that procinfo reports the bytes moved by a process, and by its reaped children."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	int writer(int argl, void* args) {
+		pipe_t* p = args;
+		char buf[1000] = { 0 };
+		Close(p->read);
+		ASSERT(Write(p->write, buf, 100)==100);
+		iovec_t iov[2] = { { buf, 200 }, { buf, 300 } };
+		ASSERT(WriteV(p->write, iov, 2)==500);
+		return 0;
+	}
+	Pid_t pid = Exec(writer, sizeof(p), &p);
+	ASSERT(pid!=NOPROC);
+	Close(p.write);
+
+	procinfo info;
+	ASSERT(find_procinfo(GetPid(), &info));
+	unsigned long read0 = info.io_read;
+	ASSERT(info.child_io_written == 0);
+
+	char buf[1000];
+	int n = 0, rc;
+	while((rc = Read(p.read, buf, sizeof(buf))) > 0) n += rc;
+	ASSERT(rc == 0 && n == 600);
+
+	ASSERT(find_procinfo(pid, &info));
+	ASSERT(info.io_read == 0);
+	ASSERT(info.io_written == 600);
+
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(info.io_read >= read0 + 600);
+	ASSERT(info.child_io_read == 0);
+	ASSERT(info.child_io_written == 600);
+
+	Close(p.read);
+	return 0;
+}
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+
+BOOT_TEST(test_memory_limits,
+	"Test that procinfo reports the kernel and stack memory of a process, and that\n"
+	"CreateThread, Pipe and Socket fail cleanly over the limits of SetLimit."
+	)
+{
+	int task(int argl, void* args) { return 0; }
+
+	unsigned long limit;
+	ASSERT(GetLimit(LIMIT_KERNEL_MEMORY, &limit)==0 && limit==0);
+	ASSERT(GetLimit(LIMIT_STACK_MEMORY, NULL)==-1);
+	ASSERT(SetLimit((limit_resource) 2, 1)==-1);
+
+	procinfo info;
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(info.stack_mem >= info.stack_size);
+	ASSERT(info.kernel_mem > 0);
+
+	/* A pipe is charged until it is released */
+	unsigned long kmem = info.kernel_mem;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(info.kernel_mem >= kmem + BUFFER_SIZE);
+	Close(p.read);
+	Close(p.write);
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(info.kernel_mem == kmem);
+
+	/* Nothing more fits under the current usage */
+	ASSERT(SetLimit(LIMIT_KERNEL_MEMORY, kmem)==0);
+	ASSERT(GetLimit(LIMIT_KERNEL_MEMORY, &limit)==0 && limit==kmem);
+	ASSERT(Pipe(&p)==-1);
+	ASSERT(Socket(NOPORT)==NOFILE);
+	ASSERT(CreateThread(task, 0, NULL)==NOTHREAD);
+	ASSERT(SetLimit(LIMIT_KERNEL_MEMORY, 0)==0);
+
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(SetLimit(LIMIT_STACK_MEMORY, info.stack_mem)==0);
+	ASSERT(CreateThread(task, 0, NULL)==NOTHREAD);
+	ASSERT(Pipe(&p)==0);
+	Close(p.read);
+	Close(p.write);
+
+	/* A child inherits the limits, but gets its main thread */
+	int child(int argl, void* args) {
+		unsigned long limit;
+		ASSERT(GetLimit(LIMIT_STACK_MEMORY, &limit)==0 && limit==*(unsigned long*)args);
+		return CreateThread(task, 0, NULL)==NOTHREAD ? 0 : 1;
+	}
+	Pid_t pid = Exec(child, sizeof(info.stack_mem), &info.stack_mem);
+	ASSERT(pid!=NOPROC);
+	int exitval;
+	ASSERT(WaitChild(pid, &exitval)==pid && exitval==0);
+
+	/* Without the limit, all succeed again */
+	ASSERT(SetLimit(LIMIT_STACK_MEMORY, 0)==0);
+	Tid_t t = CreateThread(task, 0, NULL);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(sock!=NOFILE);
+	Close(sock);
+	return 0;
+}
+
+
+static Mutex pi_mutex = MUTEX_INIT;
+
+static volatile int pi_done = 0;
+
+static int pi_locker(int argl, void* args)
+{
+	Mutex_Lock(&pi_mutex);
+	Mutex_Unlock(&pi_mutex);
+	return 0;
+}
+
+static int pi_spinner(int argl, void* args)
+{
+	while(! pi_done);
+	return 0;
+}
+
+/* Spin until the priority of the process satisfies a condition, for at most 5 sec */
+#define WAIT_PRIORITY(info, cond) do { \
+	TimerDuration t = bios_clock(); \
+	do { ASSERT(find_procinfo(GetPid(), &(info))); } \
+	while(!(cond) && bios_clock() < t + 5000000); \
+	ASSERT(cond); } while(0)
+
+static int pi_boot(int argl, void* args)
+{
+	procinfo info;
+	ASSERT(find_procinfo(GetPid(), &info));
+	int top = info.priority;
+
+	/* Lose all priority by spinning, along with another thread */
+	Tid_t s = CreateThread(pi_spinner, 0, NULL);
+	ASSERT(s != NOTHREAD);
+	WAIT_PRIORITY(info, info.priority == 0);
+
+	/* A new thread blocks on a mutex we hold, and lends us its priority */
+	Mutex_Lock(&pi_mutex);
+	Tid_t t = CreateThread(pi_locker, 0, NULL);
+	ASSERT(t != NOTHREAD);
+	WAIT_PRIORITY(info, info.priority == top);
+
+	/* The loan ends with the mutex */
+	Mutex_Unlock(&pi_mutex);
+	ASSERT(find_procinfo(GetPid(), &info));
+	ASSERT(info.priority < top);
+
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	pi_done = 1;
+	ASSERT(ThreadJoin(s, NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(test_mutex_priority_inheritance,
+	"Test that a thread holding a mutex is raised to the priority of\n"
+	"a thread waiting for it, until it unlocks it.")
+{
+	ASSERT(set_sched_policy("mlfq") == 0);
+	boot(1, 0, pi_boot, 0, NULL);
+}
+
+
+/* Set by the preempting thread of test_preempt_by_higher_priority */
+static int preempt_done;
+
+static int preempt_spinner(int argl, void* args)
+{
+	while(! __atomic_load_n(&preempt_done, __ATOMIC_ACQUIRE))
+		;
+	return 0;
+}
+
+static int preempt_spinners(int argl, void* args)
+{
+	ASSERT(SetAffinity(NOTHREAD, 2)==0);
+	Tid_t t = CreateThread(preempt_spinner, 0, NULL);
+	ASSERT(SetAffinity(t, 2)==0);
+	preempt_spinner(0, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	procinfo info;
+	ASSERT(find_procinfo(GetPid(), &info));
+	return info.sched_switches[PROCINFO_SCHED_CAUSES-1] > 0 ? 0 : 1;
+}
+
+static int preempt_waker(int argl, void* args)
+{
+	/* Gaining core 1 at the top priority preempts a spinner */
+	ASSERT(SetAffinity(NOTHREAD, 2)==0);
+	__atomic_store_n(&preempt_done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int preempt_boot(int argl, void* args)
+{
+	ASSERT(SetAffinity(NOTHREAD, 1)==0);
+	preempt_done = 0;
+	Pid_t spinners = Exec(preempt_spinners, 0, NULL);
+	ASSERT(spinners != NOPROC);
+
+	/* Wait until the spinners have used up some quanta, and lost priority */
+	procinfo info;
+	int word = 0;
+	do {
+		Futex(&word, FUTEX_WAIT, 0, 10);
+		ASSERT(find_procinfo(spinners, &info));
+	} while(info.involuntary_switches < 20);
+
+	Pid_t waker = Exec(preempt_waker, 0, NULL);
+	ASSERT(waker != NOPROC);
+	ASSERT(WaitChild(waker, NULL)==waker);
+	int status;
+	ASSERT(WaitChild(spinners, &status)==spinners);
+	ASSERT(status == 0);
+	return 0;
+}
+
+BARE_TEST(test_preempt_by_higher_priority,
+	"Test that a thread queued on a busy core preempts its thread, if it\n"
+	"has a higher priority.")
+{
+	if(MAX_CORES < 2) return;
+	ASSERT(set_sched_policy("mlfq") == 0);
+	boot(2, 0, preempt_boot, 0, NULL);
+}
+
+
+BOOT_TEST(test_futex_wait_wake,
+	"Test that Futex waits only on the expected value, times out, and wakes up sleepers."
+	)
+{
+	int word = 0;
+	ASSERT(Futex(NULL, FUTEX_WAKE, 1, 0)==-1);
+	ASSERT(Futex(&word, FUTEX_WAIT, 1, FUTEX_INFINITE)==-1);
+	ASSERT(Futex(&word, FUTEX_WAKE, 10, 0)==0);
+
+	TimerDuration t0 = bios_clock();
+	ASSERT(Futex(&word, FUTEX_WAIT, 0, 20)==-1);
+	ASSERT(bios_clock() - t0 >= 20000);
+
+	int sleeper(int argl, void* args) {
+		int* w = args;
+		while(__atomic_load_n(w, __ATOMIC_SEQ_CST) == 0)
+			Futex(w, FUTEX_WAIT, 0, FUTEX_INFINITE);
+		return 0;
+	}
+
+	Tid_t t[3];
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(sleeper, sizeof(word), &word);
+
+	/* Wake up one, once some sleep, then all of them */
+	int woken = 0, idle = 0;
+	while(woken == 0)
+		if((woken = Futex(&word, FUTEX_WAKE, 1, 0)) == 0)
+			Futex(&idle, FUTEX_WAIT, 0, 1);
+	ASSERT(woken == 1);
+
+	__atomic_store_n(&word, 1, __ATOMIC_SEQ_CST);
+	Futex(&word, FUTEX_WAKE, 10, 0);
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+/* The state shared by the threads of test_futex_primitives */
+#define FAST_THREADS 4
+#define FAST_ROUNDS 200
+static FastMutex fast_mx;
+static FastSem fast_sem;
+static FastBarrier fast_bar;
+static int fast_counter, fast_inside, fast_max_inside, fast_last;
+
+static int fast_worker(int argl, void* args)
+{
+	for(int r=0; r<FAST_ROUNDS; r++) {
+		FastMutex_Lock(&fast_mx);
+		fast_counter++;
+		FastMutex_Unlock(&fast_mx);
+
+		/* At most two threads pass the semaphore at a time */
+		FastSem_Wait(&fast_sem);
+		int in = __atomic_add_fetch(&fast_inside, 1, __ATOMIC_SEQ_CST);
+		FastMutex_Lock(&fast_mx);
+		if(in > fast_max_inside) fast_max_inside = in;
+		FastMutex_Unlock(&fast_mx);
+		__atomic_sub_fetch(&fast_inside, 1, __ATOMIC_SEQ_CST);
+		FastSem_Post(&fast_sem);
+
+		/* Everyone has counted this round */
+		if(FastBarrier_Wait(&fast_bar))
+			__atomic_add_fetch(&fast_last, 1, __ATOMIC_SEQ_CST);
+		if(fast_counter < (r+1)*FAST_THREADS) return 1;
+		FastBarrier_Wait(&fast_bar);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_futex_primitives,
+	"Test the FastMutex, FastSem and FastBarrier of tinyoslib."
+	)
+{
+	fast_mx = FASTMUTEX_INIT;
+	fast_sem = FASTSEM_INIT(2);
+	fast_bar = FASTBARRIER_INIT(FAST_THREADS);
+	fast_counter = fast_inside = fast_max_inside = fast_last = 0;
+
+	Tid_t t[FAST_THREADS];
+	for(int i=0; i<FAST_THREADS; i++)
+		t[i] = CreateThread(fast_worker, 0, NULL);
+	for(int i=0; i<FAST_THREADS; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0);
+		ASSERT(exitval==0);
+	}
+
+	ASSERT(fast_counter == FAST_THREADS*FAST_ROUNDS);
+	ASSERT(fast_max_inside >= 1 && fast_max_inside <= 2);
+	ASSERT(fast_last == FAST_ROUNDS);
+	ASSERT(fast_mx == 0 && fast_sem.value == 2);
+
+	FastSem s = FASTSEM_INIT(1);
+	ASSERT(FastSem_TimedWait(&s, 10)==1);
+	ASSERT(FastSem_TimedWait(&s, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_semaphore,
+	"Test that Sem_Down sleeps until Sem_Up, and that Sem_TimedDown times out."
+	)
+{
+	Semaphore sem = SEM_INIT(2);
+	ASSERT(Sem_TimedDown(&sem, 10)==1);
+	Sem_Down(&sem);
+	TimerDuration t0 = bios_clock();
+	ASSERT(Sem_TimedDown(&sem, 20)==0);
+	ASSERT(bios_clock() - t0 >= 20000);
+
+	int upper(int argl, void* args) {
+		for(int i=0; i<100; i++) Sem_Up(args);
+		return 0;
+	}
+	Tid_t t = CreateThread(upper, 0, &sem);
+	for(int i=0; i<100; i++) Sem_Down(&sem);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(sem.value==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_rwlock_writer_preference,
+	"Test that readers share an RWLock, and that a waiting writer holds back new readers."
+	)
+{
+	RWLock rw = RWLOCK_INIT;
+	RWLock_ReadLock(&rw);
+	ASSERT(RWLock_TimedReadLock(&rw, 10)==1);
+	ASSERT(RWLock_TimedWriteLock(&rw, 10)==0);
+	ASSERT(rw.writers_waiting==0 && rw.readers==2);
+	RWLock_ReadUnlock(&rw);
+
+	int writer(int argl, void* args) {
+		RWLock* rw = args;
+		RWLock_WriteLock(rw);
+		int ok = (rw->readers == 0);
+		RWLock_WriteUnlock(rw);
+		return ok ? 0 : 1;
+	}
+	Tid_t t = CreateThread(writer, 0, &rw);
+	Semaphore idle = SEM_INIT(0);
+	while(__atomic_load_n(&rw.writers_waiting, __ATOMIC_SEQ_CST) == 0)
+		Sem_TimedDown(&idle, 1);
+
+	/* We still hold a read lock, but new readers must wait for the writer */
+	ASSERT(RWLock_TimedReadLock(&rw, 10)==0);
+	RWLock_ReadUnlock(&rw);
+
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+	RWLock_ReadLock(&rw);
+	RWLock_ReadUnlock(&rw);
+	RWLock_WriteLock(&rw);
+	ASSERT(rw.writer==1);
+	RWLock_WriteUnlock(&rw);
+	return 0;
+}
+
+
+/* Tasks for test_executor */
+static Executor* exec_pool;
+static int exec_detached;
+
+static int exec_double(int argl, void* args) { return 2*argl; }
+
+static int exec_count(int argl, void* args)
+{
+	__atomic_add_fetch(&exec_detached, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* Subtasks are waited for inside the pool */
+static int exec_fib(int n, void* args)
+{
+	if(n < 2) return n;
+	Future* a = Executor_Submit(exec_pool, exec_fib, n-1, NULL);
+	Future* b = Executor_Submit(exec_pool, exec_fib, n-2, NULL);
+	return Future_Wait(a) + Future_Wait(b);
+}
+
+BOOT_TEST(test_executor,
+	"Test that an executor runs submitted tasks, detached tasks, and tasks that wait for subtasks."
+	)
+{
+	ASSERT(Executor_Create(0)==NULL);
+
+	for(int nw = 1; nw <= 3; nw += 2) {
+		exec_pool = Executor_Create(nw);
+		ASSERT(exec_pool != NULL);
+
+		Future* f[100];
+		for(int i=0; i<100; i++)
+			f[i] = Executor_Submit(exec_pool, exec_double, i, NULL);
+		for(int i=0; i<100; i++)
+			ASSERT(Future_Wait(f[i]) == 2*i);
+
+		ASSERT(Future_Wait(Executor_Submit(exec_pool, exec_fib, 12, NULL)) == 144);
+
+		exec_detached = 0;
+		for(int i=0; i<50; i++)
+			Future_Detach(Executor_Submit(exec_pool, exec_count, 0, NULL));
+
+		/* Destroy runs the queued tasks first */
+		Executor_Destroy(exec_pool);
+		ASSERT(exec_detached == 50);
+	}
+	return 0;
+}
+
+
+/* Tasks for test_coroutines */
+static CoScheduler* co_sched;
+static int co_counter;
+static Fid_t co_lsock;
+
+static int co_yielder(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		__atomic_add_fetch(&co_counter, 1, __ATOMIC_SEQ_CST);
+		Co_Yield();
+	}
+	return 0;
+}
+
+/* Read a number from a pipe, and pass it on incremented */
+static int co_relay(int argl, void* args)
+{
+	pipe_t* p = args;
+	int x;
+	if(Co_Read(p[argl].read, (char*)&x, sizeof(x)) == sizeof(x)) {
+		x++;
+		ASSERT(Co_Write(p[argl+1].write, (char*)&x, sizeof(x)) == sizeof(x));
+	}
+	return 0;
+}
+
+static int co_timeout(int argl, void* args)
+{
+	pipe_t* p = args;
+	ASSERT(Co_Wait(MAX_FILEID, POLL_READ, POLL_INFINITE) == -1);
+	if(Co_Wait(p->read, POLL_READ, 20) == 0)
+		__atomic_add_fetch(&co_counter, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int co_echo_server(int argl, void* args)
+{
+	Fid_t conn = Co_Accept(co_lsock);
+	ASSERT(conn != NOFILE);
+	SetNonBlocking(conn, 1);
+	int x;
+	ASSERT(Co_Read(conn, (char*)&x, sizeof(x)) == sizeof(x));
+	ASSERT(Co_Write(conn, (char*)&x, sizeof(x)) == sizeof(x));
+	Close(conn);
+	return 0;
+}
+
+static int co_echo_client(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	SetNonBlocking(sock, 1);
+	ASSERT(Co_Connect(sock, 100, 1000) == 0);
+	int x;
+	ASSERT(Co_Write(sock, (char*)&argl, sizeof(argl)) == sizeof(argl));
+	ASSERT(Co_Read(sock, (char*)&x, sizeof(x)) == sizeof(x) && x == argl);
+	Close(sock);
+	__atomic_add_fetch(&co_counter, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+BOOT_TEST(test_coroutines,
+	"Test that coroutines yield to each other, park on pipes and sockets until\n"
+	"they are ready, and time out, over one and over several threads."
+	)
+{
+	ASSERT(CoScheduler_Create(0)==NULL);
+
+	for(int nt = 1; nt <= 3; nt += 2) {
+		co_sched = CoScheduler_Create(nt);
+		ASSERT(co_sched != NULL);
+
+		/* Yielding */
+		co_counter = 0;
+		for(int i=0; i<500; i++)
+			ASSERT(CoScheduler_Spawn(co_sched, co_yielder, 10, NULL) == 0);
+
+		/* A chain of relays, each parked until the previous one writes */
+		const int N = 200;
+		pipe_t p[N+1];
+		for(int i=0; i<=N; i++) {
+			ASSERT(Pipe(&p[i])==0);
+			if(i < N) SetNonBlocking(p[i].read, 1);
+		}
+		for(int i=N-1; i>=0; i--)
+			ASSERT(CoScheduler_Spawn(co_sched, co_relay, i, p) == 0);
+		int x = 0;
+		ASSERT(Write(p[0].write, (char*)&x, sizeof(x)) == sizeof(x));
+		ASSERT(Read(p[N].read, (char*)&x, sizeof(x)) == sizeof(x) && x == N);
+
+		/* Timeouts, and illegal fids */
+		for(int i=0; i<5; i++)
+			ASSERT(CoScheduler_Spawn(co_sched, co_timeout, 0, &p[0]) == 0);
+
+		/* Sockets */
+		co_lsock = Socket(100);
+		ASSERT(Listen(co_lsock)==0);
+		SetNonBlocking(co_lsock, 1);
+		for(int i=0; i<20; i++) {
+			ASSERT(CoScheduler_Spawn(co_sched, co_echo_server, 0, NULL) == 0);
+			ASSERT(CoScheduler_Spawn(co_sched, co_echo_client, i, NULL) == 0);
+		}
+
+		CoScheduler_Destroy(co_sched);
+		ASSERT(co_counter == 500*10 + 5 + 20);
+		ASSERT(Close(co_lsock)==0);
+		for(int i=0; i<=N; i++) {
+			Close(p[i].read);
+			Close(p[i].write);
+		}
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_stale_tids_rejected,
+	"Test that the Tids of joined threads, and of other processes, are not valid, even when their slots are reused."
+	)
+{
+	int task(int argl, void* args) { return argl; }
+
+	Tid_t t = CreateThread(task, 1, NULL);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ThreadJoin(t, NULL)==-1);
+	ASSERT(ThreadDetach(t)==-1);
+
+	/* The slot of t is reused, but not its Tid */
+	Tid_t s = CreateThread(task, 2, NULL);
+	ASSERT(s!=NOTHREAD && s!=t);
+	ASSERT(ThreadJoin(t, NULL)==-1);
+	int exitval;
+	ASSERT(ThreadJoin(s, &exitval)==0 && exitval==2);
+
+	/* Many threads, recycling slots and PTCBs */
+	Tid_t seen[8];
+	for(int r=0; r<8; r++) {
+		Tid_t ts[100];
+		for(int i=0; i<100; i++) {
+			ts[i] = CreateThread(task, i, NULL);
+			ASSERT(ts[i]!=NOTHREAD);
+		}
+		for(int i=0; i<100; i++) {
+			ASSERT(ThreadJoin(ts[i], &exitval)==0 && exitval==i);
+		}
+		seen[r] = ts[0];
+		for(int q=0; q<r; q++) ASSERT(seen[q]!=seen[r]);
+	}
+
+	/* A Tid of this process is not a Tid of a child */
+	Tid_t w = CreateThread(task, 3, NULL);
+	int child(int argl, void* args) {
+		Tid_t ptid = *(Tid_t*) args;
+		ASSERT(ThreadJoin(ptid, NULL)==-1);
+		ASSERT(ThreadDetach(ptid)==-1);
+		return 0;
+	}
+	Pid_t pid = Exec(child, sizeof(w), &w);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, &exitval)==pid && exitval==0);
+	ASSERT(ThreadJoin(w, &exitval)==0 && exitval==3);
+
+	ASSERT(ThreadJoin(NOTHREAD, NULL)==-1);
+	ASSERT(ThreadJoin((Tid_t)-1, NULL)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_exit_reclaims_threads,
+	"Test that processes can exit with unjoined threads and shared memory attachments, over and over."
+	)
+{
+	int task(int argl, void* args) { return argl; }
+
+	/* Each child leaves exited and detached threads, and an attachment */
+	int child(int argl, void* args) {
+		Fid_t shm = *(Fid_t*) args;
+		ASSERT(ShmAttach(shm, NULL)!=NULL);
+		for(int i=0; i<50; i++) {
+			Tid_t t = CreateThread(task, i, NULL);
+			ASSERT(t!=NOTHREAD);
+			if(i%2) ASSERT(ThreadDetach(t)==0);
+		}
+		int exitval;
+		Tid_t t = CreateThread(task, 7, NULL);
+		ASSERT(ThreadJoin(t, &exitval)==0 && exitval==7);
+		return 0;
+	}
+
+	Fid_t shm = ShmCreate(4096);
+	ASSERT(shm!=NOFILE);
+	for(int r=0; r<100; r++) {
+		Pid_t pid = Exec(child, sizeof(shm), &shm);
+		ASSERT(pid!=NOPROC);
+		int status;
+		ASSERT(WaitChild(pid, &status)==pid && status==0);
+	}
+	ASSERT(Close(shm)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetAffinity restricts the cores a thread runs on."
+	)
+{
+	unsigned int ncores = cpu_cores();
+	unsigned int all = (ncores < 32) ? (1u << ncores) - 1 : ~0u;
+	unsigned int mask;
+
+	ASSERT(GetAffinity(NOTHREAD, &mask)==0);
+	ASSERT((mask & all) == all);
+	ASSERT(GetAffinity(NOTHREAD, NULL)==-1);
+	ASSERT(SetAffinity(NOTHREAD, 0)==-1);
+	if(ncores < 32)
+		ASSERT(SetAffinity(NOTHREAD, ~all)==-1);
+	ASSERT(SetAffinity((Tid_t)-1, 1)==-1);
+	ASSERT(GetAffinity((Tid_t)-1, &mask)==-1);
+
+	/* A thread of the process */
+	static int go;
+	go = 0;
+	int waiter(int argl, void* args) {
+		while(__atomic_load_n(&go, __ATOMIC_ACQUIRE)==0)
+			Futex(&go, FUTEX_WAIT, 0, FUTEX_INFINITE);
+		return argl;
+	}
+	Tid_t t = CreateThread(waiter, 5, NULL);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(SetAffinity(t, 1)==0);
+	ASSERT(GetAffinity(t, &mask)==0 && mask==1);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	Futex(&go, FUTEX_WAKE, 1, 0);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==5);
+	ASSERT(SetAffinity(t, 1)==-1);
+
+	/* A process pinned to each core stays there, as procinfo shows */
+	int pinned(int argl, void* args) {
+		ASSERT(SetAffinity(NOTHREAD, 1u << argl)==0);
+		int word = 0;
+		for(int i=0; i<5; i++) {
+			Futex(&word, FUTEX_WAIT, 0, 1);
+			procinfo info;
+			ASSERT(find_procinfo(GetPid(), &info));
+			ASSERT(info.last_core == argl);
+		}
+		return 0;
+	}
+	for(unsigned int c=0; c<ncores; c++) {
+		Pid_t pid = Exec(pinned, c, NULL);
+		ASSERT(pid!=NOPROC);
+		int status;
+		ASSERT(WaitChild(pid, &status)==pid && status==0);
+	}
+
+	ASSERT(SetAffinity(NOTHREAD, all)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_deadline,
+	"Test that SetDeadline admits reservations up to the capacity of the cores, and that\n"
+	"exiting threads give them back."
+	)
+{
+	unsigned int ncores = cpu_cores();
+
+	ASSERT(SetDeadline((Tid_t)-1, 10000, 1000)==-1);
+	ASSERT(SetDeadline(NOTHREAD, 10000, 20000)==-1);
+	ASSERT(SetDeadline(NOTHREAD, 10000, DEADLINE_MIN_RUNTIME-1)==-1);
+	ASSERT(SetDeadline(NOTHREAD, DEADLINE_MAX_PERIOD+1, 1000)==-1);
+	ASSERT(SetDeadline(NOTHREAD, 0, 0)==0);
+
+	/* Each core takes one thread at 95% */
+	static int go;
+	go = 0;
+	int waiter(int argl, void* args) {
+		while(__atomic_load_n(&go, __ATOMIC_ACQUIRE)==0)
+			Futex(&go, FUTEX_WAIT, 0, FUTEX_INFINITE);
+		return argl;
+	}
+	Tid_t t[ncores+1];
+	for(unsigned int i=0; i<=ncores; i++) {
+		t[i] = CreateThread(waiter, i, NULL);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(unsigned int i=0; i<ncores; i++)
+		ASSERT(SetDeadline(t[i], 10000, 9500)==0);
+	ASSERT(SetDeadline(t[ncores], 10000, DEADLINE_MIN_RUNTIME)==-1);
+	ASSERT(SetDeadline(t[0], 20000, 19000)==0);     /* a new reservation replaces the old */
+	ASSERT(SetDeadline(t[0], 0, 0)==0);
+	ASSERT(SetDeadline(t[ncores], 10000, 9500)==0);
+	ASSERT(SetDeadline(t[0], 10000, DEADLINE_MIN_RUNTIME)==-1);
+
+	/* Exiting threads give their reservations back */
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	Futex(&go, FUTEX_WAKE, ncores+1, 0);
+	for(unsigned int i=0; i<=ncores; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(SetDeadline(NOTHREAD, 10000, 9500)==0);
+	ASSERT(SetDeadline(NOTHREAD, 0, 0)==0);
+	return 0;
+}
+
+
+/* Set to stop the spinners of test_deadline_share */
+static int dl_stop;
+
+static int dl_spinner(int argl, void* args)
+{
+	ASSERT(SetAffinity(NOTHREAD, 1)==0);
+	if(argl==0)
+		ASSERT(SetDeadline(NOTHREAD, 50000, 25000)==0);
+	while(! __atomic_load_n(&dl_stop, __ATOMIC_RELAXED))
+		;
+	return 0;
+}
+
+static int dl_share_boot(int argl, void* args)
+{
+	dl_stop = 0;
+	Pid_t pid[3];
+	for(int i=0; i<3; i++) {
+		pid[i] = Exec(dl_spinner, i, NULL);
+		ASSERT(pid[i]!=NOPROC);
+	}
+
+	/* The shares are the CPU times of the spinners over one window */
+	int word = 0;
+	procinfo info;
+	unsigned long before[3], after[3];
+	Futex(&word, FUTEX_WAIT, 0, 50);
+	for(int i=0; i<3; i++) {
+		ASSERT(find_procinfo(pid[i], &info));
+		before[i] = info.cpu_time;
+	}
+	Futex(&word, FUTEX_WAIT, 0, 1000);
+	for(int i=0; i<3; i++) {
+		ASSERT(find_procinfo(pid[i], &info));
+		after[i] = info.cpu_time;
+	}
+	__atomic_store_n(&dl_stop, 1, __ATOMIC_RELAXED);
+	for(int i=0; i<3; i++) {
+		int status;
+		ASSERT(WaitChild(pid[i], &status)==pid[i] && status==0);
+	}
+
+	unsigned long dl = after[0]-before[0];
+	unsigned long total = dl;
+	for(int i=1; i<3; i++) {
+		unsigned long other = after[i]-before[i];
+		ASSERT(2*dl > 3*other);
+		total += other;
+	}
+	ASSERT(4*dl < 3*total);
+	return 0;
+}
+
+BARE_TEST(test_deadline_share,
+	"Test that a deadline thread gets its runtime ahead of other threads on\n"
+	"its core, but no more.")
+{
+	/* A deadline process at 50% and two spinners share core 0. Without the 
+	   reservation, each would get a third of it, and without enforcing the 
+	   runtime, the spinners would get nothing. The shares are the CPU times
+	   that the scheduler charges, over twenty periods. A period much longer
+	   than the latency of the host timers keeps them from blurring the 
+	   shares, and the fair policy splits the rest evenly between the 
+	   spinners, which the levels of mlfq do not. */
+	ASSERT(set_sched_policy("fair") == 0);
+	boot(1, 0, dl_share_boot, 0, NULL);
+}
+
+
+BOOT_TEST(test_sleep,
+	"Test that Sleep waits for at least the given time, not much longer, and that\n"
+	"sleepers wake up in the order of their wakeup times."
+	)
+{
+	ASSERT(Sleep(0)==0);
+
+	TimerDuration best = (TimerDuration)-1;
+	for(int i=0; i<5; i++) {
+		TimerDuration t0 = bios_clock();
+		ASSERT(Sleep(2000)==0);
+		TimerDuration t = bios_clock() - t0;
+		ASSERT(t >= 2000);
+		if(t < best) best = t;
+	}
+	ASSERT(best < 2000 + 5000);
+
+	static int woken, order[3];
+	woken = 0;
+	int sleeper(int argl, void* args) {
+		Sleep(5000*(argl+1));
+		order[__atomic_fetch_add(&woken, 1, __ATOMIC_RELAXED)] = argl;
+		return 0;
+	}
+	Tid_t t[3];
+	for(int i=0; i<3; i++) {
+		t[i] = CreateThread(sleeper, 2-i, NULL);
+		ASSERT(t[i]!=NOTHREAD);
+	}
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	for(int i=0; i<3; i++)
+		ASSERT(order[i]==i);
+	return 0;
+}
+
+
+TEST_SUITE(thread_tests, 
+	"A suite of tests for threads."
+	)
+{
+	&test_create_join_thread,
+	&test_exit_many_threads,
+	&test_create_thread_stack_size,
+	&test_exec_stack_size_in_procinfo,
+	&test_procinfo_snapshot,
+	&test_procinfo_cpu_accounting,
+	&test_procinfo_io_accounting,
+	&test_memory_limits,
+	&test_mutex_priority_inheritance,
+	&test_preempt_by_higher_priority,
+	&test_futex_wait_wake,
+	&test_futex_primitives,
+	&test_semaphore,
+	&test_rwlock_writer_preference,
+	&test_executor,
+	&test_coroutines,
+	&test_stale_tids_rejected,
+	&test_exit_reclaims_threads,
+	&test_thread_affinity,
+	&test_thread_deadline,
+	&test_deadline_share,
+	&test_sleep,
+	NULL
+};
+
+
+
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+BOOT_TEST(test_pipe_open,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_fails_on_exhausted_fid,
+	"Test that Pipe will fail if the fids are exhausted."
+	)
+{
+	pipe_t pipe;
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==0);
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==-1);	
+	return 0;
+}
+
+
+
+BOOT_TEST(test_pipe_close_reader,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	Close(pipe.read);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_close_writer,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
 	}
 
 	char buffer[12] = { [0] = 0 };
@@ -1074,121 +3142,648 @@ BOOT_TEST(test_pipe_close_writer,
 }
 
 
-/* Takes one integer argument, writes that many bytes to stdout.
- */
-int data_producer(int argl, void* args)
+/* Takes one integer argument, writes that many bytes to stdout.
+ */
+int data_producer(int argl, void* args)
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+
+	Close(0);
+
+	char buffer[32768];
+
+	while(nbytes>0) {
+		unsigned int n = (nbytes<32768) ? nbytes : 32768;
+		int rc = Write(1, buffer, n);
+		assert(rc>0);
+		nbytes -= rc;
+	}
+	Close(1);
+	return 0;
+}
+
+/* Takes one integer argument. Reads its standard input to exhaustion,
+   asserts it read that many bytes. */
+int data_consumer(int argl, void* args) 
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+	Close(1);
+
+	char buffer[16384];
+	int count = 0;
+
+	int rc = 1;
+	while(rc) {
+		rc = Read(0, buffer, 16384);
+		assert(rc>=0);
+		count += rc;
+	}
+	ASSERT(count == nbytes);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_single_producer,
+	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 10000000;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipeex_small_capacity,
+	"Open a pipe with a small buffer, and pass data through it around the end of the buffer"
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, PIPE_MIN_CAPACITY, 0)==0);
+
+	char out[PIPE_MIN_CAPACITY], in[PIPE_MIN_CAPACITY];
+	for(int i=0; i<PIPE_MIN_CAPACITY; i++) out[i] = i % 251;
+
+	/* Move the read position to the middle of the buffer */
+	ASSERT(Write(pipe.write, out, 300)==300);
+	ASSERT(Read(pipe.read, in, 300)==300);
+	ASSERT(memcmp(in, out, 300)==0);
+
+	/* Fill the buffer through the wrap-around */
+	ASSERT(Write(pipe.write, out, PIPE_MIN_CAPACITY)==PIPE_MIN_CAPACITY);
+	ASSERT(Read(pipe.read, in, PIPE_MIN_CAPACITY)==PIPE_MIN_CAPACITY);
+	ASSERT(memcmp(in, out, PIPE_MIN_CAPACITY)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipeex_grow,
+	"Open a growable pipe and write more than its initial capacity, without a reader"
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, PIPE_MIN_CAPACITY, 8*PIPE_MIN_CAPACITY)==0);
+
+	const int N = 8*PIPE_MIN_CAPACITY;
+	char out[N], in[N];
+	for(int i=0; i<N; i++) out[i] = i % 251;
+
+	/* Leave some data in the buffer, so that it is wrapped when it grows */
+	ASSERT(Write(pipe.write, out, 300)==300);
+	ASSERT(Read(pipe.read, in, 100)==100);
+	ASSERT(Write(pipe.write, out+300, N-300)==N-300);
+
+	ASSERT(Read(pipe.read, in+100, N-100)==N-100);
+	ASSERT(memcmp(in, out, N)==0);
+
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, in, N)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_pipes,
+	"Splice data from one pipe to another, and check the end of data and the errors"
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	char buffer[12] = { [0] = 0 };
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	ASSERT(Splice(p1.read, p2.write, 5)==5);
+	ASSERT(Splice(p1.read, p2.write, 100)==7);
+	ASSERT(Read(p2.read, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Wrong directions and the same pipe are errors */
+	ASSERT(Splice(p1.write, p2.write, 12)==-1);
+	ASSERT(Splice(p1.read, p2.read, 12)==-1);
+	ASSERT(Splice(p1.read, p1.write, 12)==-1);
+	ASSERT(Splice(NOFILE, p2.write, 12)==-1);
+
+	Close(p1.write);
+	ASSERT(Splice(p1.read, p2.write, 12)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_blocking,
+	"Splice 1 Mbyte from a producer to a consumer, through two pipes"
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	const int N = 1000000;
+	int producer(int argl, void* args) {
+		char buffer[1000];
+		for(int i=0; i<N; i+=1000) {
+			for(int j=0; j<1000; j++) buffer[j] = (i+j) % 251;
+			ASSERT(Write(p1.write, buffer, 1000)==1000);
+		}
+		Close(p1.write);
+		return 0;
+	}
+	int consumer(int argl, void* args) {
+		char buffer[777];
+		int count = 0, rc;
+		while((rc = Read(p2.read, buffer, 777)) > 0) {
+			for(int j=0; j<rc; j++) ASSERT(buffer[j] == (char)((count+j) % 251));
+			count += rc;
+		}
+		ASSERT(count == N);
+		return 0;
+	}
+
+	Tid_t t1 = CreateThread(producer, 0, NULL);
+	Tid_t t2 = CreateThread(consumer, 0, NULL);
+
+	int rc, total = 0;
+	while((rc = Splice(p1.read, p2.write, 3000)) > 0)
+		total += rc;
+	ASSERT(rc == 0);
+	ASSERT(total == N);
+	Close(p2.write);
+
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_readv_writev,
+	"Write a header and a payload to a pipe with one WriteV, and read them back with ReadV"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int header = 12;
+	iovec_t out[2] = { { &header, sizeof(header) }, { "Hello world", 12 } };
+	ASSERT(WriteV(pipe.write, out, 2)==sizeof(header)+12);
+
+	int h = 0;
+	char buffer[12] = { [0] = 0 };
+	iovec_t in[2] = { { &h, sizeof(h) }, { buffer, 12 } };
+	ASSERT(ReadV(pipe.read, in, 2)==sizeof(h)+12);
+	ASSERT(h == 12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Illegal arguments */
+	ASSERT(WriteV(pipe.write, out, -1)==-1);
+	ASSERT(WriteV(pipe.write, out, MAX_IOVEC+1)==-1);
+	ASSERT(WriteV(pipe.read, out, 2)==-1);
+	ASSERT(ReadV(pipe.write, in, 2)==-1);
+	ASSERT(ReadV(NOFILE, in, 2)==-1);
+	ASSERT(WriteV(pipe.write, out, 0)==0);
+
+	/* Reading stops at the end of data */
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	Close(pipe.write);
+	ASSERT(ReadV(pipe.read, in+1, 1)==5);
+	ASSERT(ReadV(pipe.read, in, 2)==0);
+
+	/* Streams without vector support use Read and Write */
+	Fid_t null = OpenNull();
+	ASSERT(WriteV(null, out, 2)==sizeof(header)+12);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_pipe,
+	"Poll the two ends of pipes, with and without blocking"
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	/* Nothing to read yet, but there is room to write */
+	Fid_t fids[3] = { p1.read, p2.read, p1.write };
+	int ev[3] = { POLL_READ, POLL_READ, POLL_WRITE };
+	ASSERT(Poll(fids, ev, 3, 0)==1);
+	ASSERT(ev[0]==0 && ev[1]==0 && ev[2]==POLL_WRITE);
+
+	ev[0] = ev[1] = POLL_READ;
+	ASSERT(Poll(fids, ev, 2, 100)==0);
+
+	/* Wait for a writer */
+	int writer(int argl, void* args) {
+		ASSERT(Write(p2.write, "Hello world", 12)==12);
+		return 0;
+	}
+	Tid_t t = CreateThread(writer, 0, NULL);
+	ev[0] = ev[1] = POLL_READ;
+	ASSERT(Poll(fids, ev, 2, POLL_INFINITE)==1);
+	ASSERT(ev[0]==0 && ev[1]==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	char buffer[12];
+	ASSERT(Read(p2.read, buffer, 12)==12);
+
+	/* Closing the writer gives the end of data */
+	Close(p1.write);
+	ev[0] = POLL_READ;
+	ASSERT(Poll(fids, ev, 1, POLL_INFINITE)==1);
+	ASSERT(ev[0]==(POLL_READ|POLL_HANGUP));
+
+	/* Illegal arguments */
+	ASSERT(Poll(fids, ev, -1, 0)==-1);
+	fids[0] = NOFILE;
+	ASSERT(Poll(fids, ev, 1, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Read and write a non-blocking pipe"
+	)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
+	pipe_t p;
+	ASSERT(PipeEx(&p, PIPE_MIN_CAPACITY, 0)==0);
+	ASSERT(SetNonBlocking(p.read, 1)==0);
+	ASSERT(SetNonBlocking(p.write, 1)==0);
+	ASSERT(SetNonBlocking(NOFILE, 1)==-1);
+
+	/* An empty pipe would block the reader */
+	char buffer[PIPE_MIN_CAPACITY+12];
+	ASSERT(Read(p.read, buffer, 12)==WOULDBLOCK);
+
+	ASSERT(Write(p.write, "Hello world", 12)==12);
+	ASSERT(Read(p.read, buffer, 100)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A full pipe would block the writer, after a partial write */
+	memset(buffer, 'x', sizeof(buffer));
+	ASSERT(Write(p.write, buffer, sizeof(buffer))==PIPE_MIN_CAPACITY);
+	ASSERT(Write(p.write, buffer, 1)==WOULDBLOCK);
+	iovec_t iov[1] = { { buffer, 1 } };
+	ASSERT(WriteV(p.write, iov, 1)==WOULDBLOCK);
+
+	/* In blocking mode again, the reader gets all the data */
+	ASSERT(SetNonBlocking(p.read, 0)==0);
+	ASSERT(Read(p.read, buffer, PIPE_MIN_CAPACITY)==PIPE_MIN_CAPACITY);
+	ASSERT(SetNonBlocking(p.read, 1)==0);
+	ASSERT(ReadV(p.read, iov, 1)==WOULDBLOCK);
+
+	/* The end of data does not block */
+	Close(p.write);
+	ASSERT(Read(p.read, buffer, 12)==0);
+	return 0;
+}
 
-	Close(0);
 
-	char buffer[32768];
+/* Write the bytes 0,1,2,... in chunks of changing size */
+#define SEQUENCE_CHUNKS 2000
+#define SEQUENCE_CHUNK(i) (1 + ((i)*37) % 977)
 
-	while(nbytes>0) {
-		unsigned int n = (nbytes<32768) ? nbytes : 32768;
-		int rc = Write(1, buffer, n);
-		assert(rc>0);
-		nbytes -= rc;
+static int sequence_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*) args;
+	unsigned char chunk[977];
+	unsigned int next = 0;
+	for(int i=0; i<SEQUENCE_CHUNKS; i++) {
+		unsigned int n = SEQUENCE_CHUNK(i);
+		for(unsigned int j=0; j<n; j++) chunk[j] = (next+j) & 0xff;
+		ASSERT(Write(fid, (char*) chunk, n)==n);
+		next += n;
 	}
-	Close(1);
+	Close(fid);
 	return 0;
 }
 
-/* Takes one integer argument. Reads its standard input to exhaustion,
-   asserts it read that many bytes. */
-int data_consumer(int argl, void* args) 
+BOOT_TEST(test_pipe_spsc_order,
+	"Stream data between a writer thread and a reader mixing Read with ReadV"
+	)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
-	Close(1);
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Tid_t t = CreateThread(sequence_writer, sizeof(p.write), &p.write);
 
-	char buffer[16384];
-	int count = 0;
+	unsigned char buf[1500];
+	unsigned int next = 0;
+	int rc;
+	for(int i=0; ; i++) {
+		if(i % 3) {
+			rc = Read(p.read, (char*) buf, 1 + i % sizeof(buf));
+		} else {
+			iovec_t iov[2] = { { buf, 100 }, { buf+100, 1000 } };
+			rc = ReadV(p.read, iov, 2);
+		}
+		ASSERT(rc >= 0);
+		if(rc == 0) break;
+		for(int j=0; j<rc; j++) ASSERT(buf[j] == ((next+j) & 0xff));
+		next += rc;
+	}
+	unsigned int total = 0;
+	for(int i=0; i<SEQUENCE_CHUNKS; i++) total += SEQUENCE_CHUNK(i);
+	ASSERT(next == total);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
 
-	int rc = 1;
-	while(rc) {
-		rc = Read(0, buffer, 16384);
-		assert(rc>=0);
-		count += rc;
+
+/* Threads of test_pipe_many_sleepers */
+static pipe_t sleepers_pipe;
+static int sleepers_counts[6];
+
+static int sleepers_writer(int argl, void* args)
+{
+	char buf[700];
+	memset(buf, argl, sizeof(buf));
+	for(int left = 20000, i = 0; left > 0; i++) {
+		int n = 1 + (i*37 + argl*11) % sizeof(buf);
+		if(n > left) n = left;
+		ASSERT(Write(sleepers_pipe.write, buf, n)==n);
+		left -= n;
 	}
-	ASSERT(count == nbytes);
 	return 0;
 }
 
+static int sleepers_reader(int argl, void* args)
+{
+	char buf[600];
+	int rc;
+	for(int i = 0; (rc = Read(sleepers_pipe.read, buf, 1 + (i*53 + argl*7) % sizeof(buf))) > 0; i++)
+		for(int j=0; j<rc; j++)
+			__atomic_add_fetch(& sleepers_counts[(int) buf[j]], 1, __ATOMIC_RELAXED);
+	ASSERT(rc==0);
+	return 0;
+}
 
-BOOT_TEST(test_pipe_single_producer,
-	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+BOOT_TEST(test_pipe_many_sleepers,
+	"Test that a small pipe with many readers and writers sleeping at once\n"
+	"wakes them up as needed, and loses no data."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
+	ASSERT(PipeEx(&sleepers_pipe, PIPE_MIN_CAPACITY, 0)==0);
+	Tid_t w[6], r[6];
+	for(int i=0; i<6; i++) sleepers_counts[i] = 0;
+	for(int i=0; i<6; i++) {
+		r[i] = CreateThread(sleepers_reader, i, NULL);
+		w[i] = CreateThread(sleepers_writer, i, NULL);
+	}
+	for(int i=0; i<6; i++)
+		ASSERT(ThreadJoin(w[i], NULL)==0);
+	ASSERT(Close(sleepers_pipe.write)==0);
+	for(int i=0; i<6; i++)
+		ASSERT(ThreadJoin(r[i], NULL)==0);
+	for(int i=0; i<6; i++)
+		ASSERT(sleepers_counts[i]==20000);
+	ASSERT(Close(sleepers_pipe.read)==0);
+	return 0;
+}
 
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
+
+BOOT_TEST(test_pipe_wake_affine,
+	"Test that a reader woken up by its writer is queued on the writer's core,\n"
+	"and that the placements are counted in the core stats."
+	)
+{
+	pipe_t ping, pong;
+	ASSERT(Pipe(&ping)==0 && Pipe(&pong)==0);
+	const int ROUNDS = 200;
+
+	int echo(int argl, void* args)
+	{
+		char c;
+		for(int i=0; i<ROUNDS; i++)
+			if(Read(ping.read, &c, 1)!=1 || Write(pong.write, &c, 1)!=1) return -1;
+		return 0;
 	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
+
+	core_stats st0[MAX_CORES], st[MAX_CORES];
+	ASSERT(GetCoreStats(st0, MAX_CORES)==cpu_cores());
+	Tid_t t = CreateThread(echo, 0, NULL);
+	for(int i=0; i<ROUNDS; i++) {
+		char c = 'a' + i % 26;
+		ASSERT(Write(ping.write, &c, 1)==1);
+		ASSERT(Read(pong.read, &c, 1)==1 && c=='a' + i % 26);
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Most wakeups find the core of the waker free */
+	ASSERT(GetCoreStats(st, MAX_CORES)==cpu_cores());
+	unsigned long hits = 0;
+	for(uint c=0; c<cpu_cores(); c++) {
+		ASSERT(st[c].wake_affine_misses >= st0[c].wake_affine_misses);
+		hits += st[c].wake_affine_hits - st0[c].wake_affine_hits;
 	}
+	ASSERT(hits > 0);
+	return 0;
+}
 
-	int N = 10000000;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
 
-	Close(0);
-	Close(1);
+static int fid_writer(size_t argc, const char** argv)
+{
+	/* Left open, for the exit of Execute to flush */
+	FILE* f = fidopen(1, "w");
+	fprintf(f, "%s", argv[0]);
+	return 0;
+}
 
-	WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+BOOT_TEST(test_fidopen_buffering,
+	"Test that fidopen buffers pipes fully, and that Execute flushes the streams left open."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(StreamType(p.read)==STREAM_PIPE);
+	ASSERT(StreamType(p.write)==STREAM_PIPE);
+	ASSERT(StreamType(OpenNull())==STREAM_OTHER);
+	ASSERT(StreamType(NOFILE)==-1);
+	ASSERT(StreamType(MAX_FILEID)==-1);
+
+	/* Nothing reaches the pipe before a flush */
+	char buf[16];
+	ASSERT(SetNonBlocking(p.read, 1)==0);
+	FILE* f = fidopen(p.write, "w");
+	fprintf(f, "hello");
+	ASSERT(Read(p.read, buf, sizeof(buf))==WOULDBLOCK);
+	fflush(f);
+	ASSERT(Read(p.read, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* An explicit mode overrides the kind of the stream */
+	FILE* u = fidopen_buffered(p.write, "w", _IONBF, 0);
+	fprintf(u, "x");
+	ASSERT(Read(p.read, buf, sizeof(buf))==1);
+	fclose(u);
+	fclose(f);
+	ASSERT(SetNonBlocking(p.read, 0)==0);
+
+	const char* argv[] = { "world" };
+	Fid_t fdmap[2] = { NOFILE, p.write };
+	Pid_t pid = ExecuteEx(fid_writer, 1, argv, fdmap, 2);
+	ASSERT(pid!=NOPROC);
+	Close(p.write);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	int n = 0, rc;
+	while((rc = Read(p.read, buf+n, sizeof(buf)-n)) > 0) n += rc;
+	ASSERT(n==5 && memcmp(buf, "world", 5)==0);
+	Close(p.read);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+
+BOOT_TEST(test_shm_create_attach,
+	"Test that shared memory regions are created zeroed, and that attachments outlive the stream"
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
+	ASSERT(ShmCreate(0)==NOFILE);
+	ASSERT(ShmCreate(SHM_MAX_SIZE+1)==NOFILE);
+	ASSERT(ShmAttach(NOFILE, NULL)==NULL);
+	ASSERT(ShmDetach(NULL)==-1);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(ShmAttach(p.read, NULL)==NULL);
+	Close(p.read);
+	Close(p.write);
+
+	Fid_t fid = ShmCreate(10000);
+	ASSERT(fid!=NOFILE);
+	char buf[4];
+	ASSERT(Read(fid, buf, 4)==-1);
+	ASSERT(Write(fid, buf, 4)==-1);
+
+	unsigned int size = 0;
+	char* a = ShmAttach(fid, &size);
+	ASSERT(a!=NULL && size==10000);
+	for(unsigned int i=0; i<size; i++) ASSERT(a[i]==0);
+
+	/* Both attachments return the region, and it survives Close */
+	ASSERT(ShmAttach(fid, NULL)==a);
+	ASSERT(Close(fid)==0);
+	memset(a, 1, size);
+	ASSERT(ShmDetach(a)==0);
+	a[size-1] = 2;
+	ASSERT(ShmDetach(a)==0);
+	ASSERT(ShmDetach(a)==-1);
+	return 0;
+}
 
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
-	}
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+/* The region shared by test_shm_share_with_child */
+typedef struct {
+	Mutex mx;
+	CondVar cv;
+	int done;
+	int data[1000];
+} shm_test_region;
 
-	Close(0);
-	Close(1);
+static int shm_child(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*) args;
+	shm_test_region* r = ShmAttach(fid, NULL);
+	if(r == NULL) return 1;
 
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+	Mutex_Lock(&r->mx);
+	for(int i=0; i<1000; i++) r->data[i] = i*i;
+	r->done = 1;
+	Cond_Broadcast(&r->cv);
+	Mutex_Unlock(&r->mx);
+
+	/* The attachment is dropped at exit */
+	return 0;
+}
+
+BOOT_TEST(test_shm_share_with_child,
+	"Test that a child process can attach to an inherited region, and synchronize through it"
+	)
+{
+	Fid_t fid = ShmCreate(sizeof(shm_test_region));
+	ASSERT(fid!=NOFILE);
+	shm_test_region* r = ShmAttach(fid, NULL);
+	ASSERT(r!=NULL);
+	r->mx = MUTEX_INIT;
+	r->cv = COND_INIT;
+
+	Pid_t pid = Exec(shm_child, sizeof(fid), &fid);
+	ASSERT(pid!=NOPROC);
+	ASSERT(Close(fid)==0);
+
+	Mutex_Lock(&r->mx);
+	while(! r->done)
+		Cond_Wait(&r->mx, &r->cv);
+	Mutex_Unlock(&r->mx);
+	for(int i=0; i<1000; i++) ASSERT(r->data[i]==i*i);
+
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==0);
+	ASSERT(ShmDetach(r)==0);
 	return 0;
 }
 
@@ -1203,6 +3798,19 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipeex_small_capacity,
+	&test_pipeex_grow,
+	&test_splice_pipes,
+	&test_splice_blocking,
+	&test_pipe_readv_writev,
+	&test_poll_pipe,
+	&test_pipe_nonblocking,
+	&test_pipe_spsc_order,
+	&test_pipe_many_sleepers,
+	&test_pipe_wake_affine,
+	&test_fidopen_buffering,
+	&test_shm_create_attach,
+	&test_shm_share_with_child,
 	NULL
 };
 
@@ -1730,6 +4338,505 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_socket_readv_writev,
+	"Send framed messages over a connection with WriteV and ReadV"
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(int i=0; i<1000; i++) {
+		int header = i;
+		iovec_t out[2] = { { &header, sizeof(header) }, { "Hello world", 12 } };
+		ASSERT(WriteV(cli, out, 2)==sizeof(header)+12);
+
+		int h = -1;
+		char buffer[12] = { [0] = 0 };
+		iovec_t in[2] = { { &h, sizeof(h) }, { buffer, 12 } };
+		ASSERT(ReadV(srv, in, 2)==sizeof(h)+12);
+		ASSERT(h == i);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+
+	/* Unconnected sockets have no streams */
+	iovec_t out[1] = { { "Hello world", 12 } };
+	ASSERT(WriteV(lsock, out, 1)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_poll,
+	"Serve many connections from one thread, with Poll"
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	const int N = 5;
+	int client(int argl, void* args) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(sock != NOFILE);
+		ASSERT(Connect(sock, 100, 1000)==0);
+		char buffer[12];
+		ASSERT(Write(sock, "Hello world", 12)==12);
+		ASSERT(Read(sock, buffer, 12)==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+		Close(sock);
+		return 0;
+	}
+	Tid_t t[N];
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(client, 0, NULL);
+
+	/* An echo server: fids[0] is the listener, the rest are connections */
+	Fid_t fids[N+1];
+	int ev[N+1];
+	int nfids = 1, done = 0;
+	fids[0] = lsock;
+	while(done < N) {
+		for(int i=0; i<nfids; i++) ev[i] = POLL_READ;
+		ASSERT(Poll(fids, ev, nfids, POLL_INFINITE) > 0);
+
+		for(int i=1; i<nfids; i++) {
+			if(! ev[i]) continue;
+			char buffer[12];
+			int rc = Read(fids[i], buffer, 12);
+			if(rc == 12) {
+				ASSERT(Write(fids[i], buffer, 12)==12);
+			}
+			else {
+				/* The client has closed */
+				ASSERT(rc == 0);
+				Close(fids[i]);
+				fids[i--] = fids[--nfids];
+				done++;
+			}
+		}
+		if(ev[0] & POLL_READ) {
+			Fid_t srv = Accept(lsock);
+			ASSERT(srv != NOFILE);
+			fids[nfids++] = srv;
+		}
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_splice,
+	"Relay data from one connection to another with Splice"
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli1 = Socket(NOPORT), srv1;
+	Fid_t cli2 = Socket(NOPORT), srv2;
+	connect_sockets(cli1, lsock, &srv1, 100);
+	connect_sockets(cli2, lsock, &srv2, 100);
+
+	/* cli1 -> srv1 -> (splice) -> srv2 -> cli2 */
+	char buffer[12] = {[0]=0};
+	for(int i=0; i<100; i++) {
+		ASSERT(Write(cli1, "Hello world", 12)==12);
+		int count = 0;
+		while(count < 12) {
+			int rc = Splice(srv1, srv2, 12-count);
+			ASSERT(rc > 0);
+			count += rc;
+		}
+		ASSERT(Read(cli2, buffer, 12)==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+
+	/* A pipe end that is shut down cannot be spliced */
+	ASSERT(ShutDown(srv2, SHUTDOWN_WRITE)==0);
+	ASSERT(Write(cli1, "Hello world", 12)==12);
+	ASSERT(Splice(srv1, srv2, 12)==-1);
+
+	ASSERT(ShutDown(cli1, SHUTDOWN_WRITE)==0);
+	ASSERT(Read(srv1, buffer, 12)==12);
+	ASSERT(Splice(srv1, cli2, 12)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_nonblocking,
+	"Accept and connect without blocking, waiting with Poll"
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+
+	/* No client yet */
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+
+	Fid_t cli = Socket(NOPORT);  ASSERT(cli!=NOFILE);
+	ASSERT(SetNonBlocking(cli, 1)==0);
+	ASSERT(Connect(cli, 100, 1000)==WOULDBLOCK);
+	ASSERT(Connect(cli, 100, 1000)==WOULDBLOCK);
+
+	/* The client is not connected until the request is accepted */
+	Fid_t fid = cli;
+	int ev = POLL_WRITE;
+	ASSERT(Poll(&fid, &ev, 1, 0)==0);
+
+	fid = lsock; ev = POLL_READ;
+	ASSERT(Poll(&fid, &ev, 1, POLL_INFINITE)==1);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE && srv!=WOULDBLOCK);
+
+	fid = cli; ev = POLL_WRITE;
+	ASSERT(Poll(&fid, &ev, 1, POLL_INFINITE)==1);
+	ASSERT(ev==POLL_WRITE);
+	ASSERT(Connect(cli, 100, 1000)==0);
+
+	/* Non-blocking reads on the connection */
+	char buffer[12];
+	ASSERT(Read(cli, buffer, 12)==WOULDBLOCK);
+	ASSERT(Write(srv, "Hello world", 12)==12);
+	ASSERT(Read(cli, buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* A pending request fails when the listener closes */
+	Fid_t cli2 = Socket(NOPORT);  ASSERT(cli2!=NOFILE);
+	ASSERT(SetNonBlocking(cli2, 1)==0);
+	ASSERT(Connect(cli2, 100, 1000)==WOULDBLOCK);
+	ASSERT(Close(lsock)==0);
+	fid = cli2; ev = POLL_WRITE;
+	ASSERT(Poll(&fid, &ev, 1, POLL_INFINITE)==1);
+	ASSERT(ev==POLL_ERROR);
+	ASSERT(Connect(cli2, 100, 1000)==-1);
+
+	/* Closing a socket with a pending request */
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli3 = Socket(NOPORT);  ASSERT(cli3!=NOFILE);
+	ASSERT(SetNonBlocking(cli3, 1)==0);
+	ASSERT(Connect(cli3, 100, 1000)==WOULDBLOCK);
+	ASSERT(Close(cli3)==0);
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_ephemeral_ports,
+	"Test that clients get distinct ephemeral ports, released at close"
+	)
+{
+	Fid_t lsock = Socket(MAX_PORT);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli1 = Socket(NOPORT), srv1;
+	Fid_t cli2 = Socket(NOPORT), srv2;
+	port_t local, peer;
+	ASSERT(SocketPorts(cli1, &local, &peer)==0);
+	ASSERT(local==NOPORT && peer==NOPORT);
+
+	connect_sockets(cli1, lsock, &srv1, MAX_PORT);
+	connect_sockets(cli2, lsock, &srv2, MAX_PORT);
+
+	port_t p1, p2;
+	ASSERT(SocketPorts(cli1, &p1, &peer)==0);
+	ASSERT(p1 >= EPHEMERAL_PORT_MIN && peer==MAX_PORT);
+	ASSERT(SocketPorts(cli2, &p2, NULL)==0);
+	ASSERT(p2 >= EPHEMERAL_PORT_MIN && p2 != p1);
+
+	/* The server side knows the port of each client */
+	ASSERT(SocketPorts(srv1, &local, &peer)==0);
+	ASSERT(local==MAX_PORT && peer==p1);
+	ASSERT(SocketPorts(srv2, NULL, &peer)==0);
+	ASSERT(peer==p2);
+
+	/* The port of a closed client is reused */
+	Close(cli1);
+	Fid_t cli3 = Socket(NOPORT), srv3;
+	connect_sockets(cli3, lsock, &srv3, MAX_PORT);
+	ASSERT(SocketPorts(cli3, &local, NULL)==0);
+	ASSERT(local==p1);
+
+	/* A failed connect does not keep a port */
+	Fid_t cli4 = Socket(NOPORT);
+	ASSERT(Connect(cli4, MAX_PORT-1, 100)==-1);
+	ASSERT(SocketPorts(cli4, &local, NULL)==0);
+	ASSERT(local==NOPORT);
+
+	ASSERT(SocketPorts(NOFILE, &local, &peer)==-1);
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SocketPorts(p.read, &local, &peer)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_backlog_accept_many,
+	"Test the backlog of ListenEx, FIFO service and AcceptMany"
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(ListenEx(lsock, -1)==-1);
+	ASSERT(ListenEx(lsock, 2)==0);
+
+	/* Fill the backlog with non-blocking connects */
+	Fid_t cli[3];
+	for(int i=0; i<3; i++) {
+		cli[i] = Socket(NOPORT);  ASSERT(cli[i]!=NOFILE);
+		ASSERT(SetNonBlocking(cli[i], 1)==0);
+	}
+	ASSERT(Connect(cli[0], 100, 1000)==WOULDBLOCK);
+	ASSERT(Connect(cli[1], 100, 1000)==WOULDBLOCK);
+
+	/* A full backlog fails at once, blocking or not */
+	ASSERT(Connect(cli[2], 100, 1000)==-1);
+	ASSERT(SetNonBlocking(cli[2], 0)==0);
+	ASSERT(Connect(cli[2], 100, -1)==-1);
+
+	Fid_t fids[4];
+	ASSERT(AcceptMany(lsock, fids, 0)==-1);
+	ASSERT(AcceptMany(NOFILE, fids, 4)==-1);
+	ASSERT(AcceptMany(lsock, fids, 4)==2);
+
+	/* The requests were served in order */
+	for(int i=0; i<2; i++) {
+		port_t local, peer;
+		ASSERT(Connect(cli[i], 100, 1000)==0);
+		ASSERT(SocketPorts(cli[i], &local, NULL)==0);
+		ASSERT(SocketPorts(fids[i], NULL, &peer)==0);
+		ASSERT(local == peer);
+	}
+
+	/* There is room again */
+	Fid_t srv;
+	connect_sockets(cli[2], lsock, &srv, 100);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_message_mode,
+	"Test that message sockets keep the boundaries of messages"
+	)
+{
+	ASSERT(SocketEx(100, 7)==NOFILE);
+
+	Fid_t lsock = SocketEx(100, SOCKET_MESSAGE);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* A stream socket does not connect to a message listener */
+	Fid_t bad = Socket(NOPORT);
+	ASSERT(Connect(bad, 100, 100)==-1);
+	ASSERT(MessageSize(bad)==-1);
+
+	Fid_t cli = SocketEx(NOPORT, SOCKET_MESSAGE), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* Two writes are two reads */
+	char buf[32];
+	ASSERT(Write(cli, "hello", 5)==5);
+	ASSERT(Write(cli, "world!", 6)==6);
+	ASSERT(MessageSize(srv)==5);
+	ASSERT(Read(srv, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* A short read leaves the rest of the message */
+	ASSERT(Read(srv, buf, 4)==4);
+	ASSERT(MessageSize(srv)==2);
+	ASSERT(Read(srv, buf+4, sizeof(buf))==2);
+	ASSERT(memcmp(buf, "world!", 6)==0);
+
+	/* A vectored write is one message */
+	iovec_t iov[2] = { {"abc", 3}, {"de", 2} };
+	ASSERT(WriteV(srv, iov, 2)==5);
+	ASSERT(Read(cli, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "abcde", 5)==0);
+
+	/* Messages must fit in the buffer */
+	static char big[BUFFER_SIZE];
+	ASSERT(Write(cli, big, sizeof(big))==-1);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(Splice(srv, p.write, 10)==-1);
+
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ASSERT(MessageSize(srv)==0);
+	ASSERT(Read(srv, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
+/* 
+	Two free ports on the host loopback, for the addresses of two nodes.
+	The ports stay bound by fd[] until the caller closes them, so that no
+	other process is given them meanwhile. The nodes can still bind them,
+	with SO_REUSEADDR, since these sockets do not listen.
+ */
+static void net_test_addrs(char* addrs, size_t size, int fd[2])
+{
+	int port[2];
+	for(int i=0; i<2; i++) {
+		struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = 0 };
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(sa);
+		int one = 1;
+		fd[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		ASSERT(fd[i] >= 0);
+		ASSERT(setsockopt(fd[i], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))==0);
+		ASSERT(bind(fd[i], (struct sockaddr*) &sa, sizeof(sa))==0);
+		ASSERT(getsockname(fd[i], (struct sockaddr*) &sa, &len)==0);
+		port[i] = ntohs(sa.sin_port);
+	}
+	snprintf(addrs, size, "127.0.0.1:%d,127.0.0.1:%d", port[0], port[1]);
+}
+
+#define NET_TEST_PORT 100
+#define NET_TEST_BYTES (1<<20)
+
+static inline char net_pattern(unsigned int i) { return (char)(i*7 + i/4096); }
+
+/* Node 1 writes a byte here when it listens, since a connect is refused before that */
+static int net_ready_fd = -1;
+
+/* Node 1 echoes two connections, each until the client shuts down its writes */
+static int net_server_boot(int argl, void* args)
+{
+	ASSERT(GetNodeId()==1);
+	Fid_t lsock = Socket(NET_TEST_PORT);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(write(net_ready_fd, "", 1)==1);
+
+	for(int i=0; i<2; i++) {
+		Fid_t s = Accept(lsock);
+		ASSERT(s!=NOFILE);
+		port_t local, peer;
+		ASSERT(SocketPorts(s, &local, &peer)==0);
+		ASSERT(local==NET_TEST_PORT && peer!=NOPORT);
+
+		static char buf[8192];
+		int n;
+		while((n = Read(s, buf, sizeof(buf))) > 0)
+			ASSERT(Write(s, buf, n)==n);
+		ASSERT(n==0);
+		ASSERT(Close(s)==0);
+	}
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
+static int net_send_pattern(int argl, void* args)
+{
+	Fid_t s = argl;
+	static char buf[10000];
+	for(unsigned int pos=0; pos<NET_TEST_BYTES; ) {
+		unsigned int n = NET_TEST_BYTES - pos;
+		if(n > sizeof(buf)) n = sizeof(buf);
+		for(unsigned int i=0; i<n; i++) buf[i] = net_pattern(pos+i);
+		ASSERT(Write(s, buf, n)==(int) n);
+		pos += n;
+	}
+	ASSERT(ShutDown(s, SHUTDOWN_WRITE)==0);
+	return 0;
+}
+
+static int net_client_boot(int argl, void* args)
+{
+	ASSERT(GetNodeId()==0);
+
+	/* Node 1 already listens */
+	Fid_t s = Socket(NOPORT);
+	ASSERT(ConnectNode(s, 2, NET_TEST_PORT, 1000)==-1);
+	ASSERT(ConnectNode(s, 1, NET_TEST_PORT, 20000)==0);
+	ASSERT(ConnectNode(s, 1, NET_TEST_PORT, 1000)==-1);
+	ASSERT(StreamType(s)==STREAM_SOCKET);
+
+	char buf[8192];
+	ASSERT(Write(s, "hello", 5)==5);
+	ASSERT(Read(s, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(MessageSize(s)==-1);
+	ASSERT(ShutDown(s, SHUTDOWN_WRITE)==0);
+	ASSERT(Write(s, "x", 1)==-1);
+	ASSERT(Read(s, buf, sizeof(buf))==0);
+
+	Fid_t fids[1] = { s };
+	int events[1] = { POLL_READ };
+	ASSERT(Poll(fids, events, 1, 0)==1 && (events[0] & POLL_READ));
+	ASSERT(Close(s)==0);
+
+	/* No listener on the port, and no message sockets */
+	s = Socket(NOPORT);
+	ASSERT(ConnectNode(s, 1, NET_TEST_PORT+1, 5000)==-1);
+	ASSERT(Close(s)==0);
+	s = SocketEx(NOPORT, SOCKET_MESSAGE);
+	ASSERT(ConnectNode(s, 1, NET_TEST_PORT, 1000)==-1);
+	ASSERT(Close(s)==0);
+
+	/* Much more than the window, in both directions at once */
+	s = Socket(NOPORT);
+	ASSERT(ConnectNode(s, 1, NET_TEST_PORT, 5000)==0);
+	Tid_t t = CreateThread(net_send_pattern, s, NULL);
+	unsigned int pos = 0;
+	int n;
+	while((n = Read(s, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++) ASSERT(buf[i]==net_pattern(pos+i));
+		pos += n;
+	}
+	ASSERT(n==0 && pos==NET_TEST_BYTES);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Close(s)==0);
+	return 0;
+}
+
+BARE_TEST(test_socket_network,
+	"Test that sockets connect and transfer data between the nodes of a network,\n"
+	"each one a virtual machine in its own host process."
+	)
+{
+	char addrs[64];
+	int probe[2];
+	net_test_addrs(addrs, sizeof(addrs), probe);
+	ASSERT(vm_config_network(0, "127.0.0.1")==-1);
+	ASSERT(vm_config_network(2, addrs)==-1);
+
+	int ready[2];
+	ASSERT(pipe(ready)==0);
+	pid_t pid = fork();
+	ASSERT(pid >= 0);
+	if(pid == 0) {
+		close(ready[0]);
+		net_ready_fd = ready[1];
+		ASSERT(vm_config_network(1, addrs)==0);
+		boot(BARE_CORES, 0, net_server_boot, 0, NULL);
+		_exit(FLAG_FAILURE);
+	}
+	close(ready[1]);
+
+	/* Boot node 0 once node 1 listens */
+	char c;
+	int up = (read(ready[0], &c, 1) == 1);
+	close(ready[0]);
+	if(! up) kill(pid, SIGKILL);
+	ASSERT(up);
+	ASSERT(vm_config_network(0, addrs)==0);
+	boot(BARE_CORES, 0, net_client_boot, 0, NULL);
+	ASSERT(vm_config_network(-1, NULL)==0);
+	close(probe[0]);
+	close(probe[1]);
+
+	/* The server waits for connections that will not come */
+	if(FLAG_FAILURE) kill(pid, SIGKILL);
+	int status;
+	ASSERT(waitpid(pid, &status, 0)==pid);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status)==0);
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -1765,6 +4872,15 @@ TEST_SUITE(socket_tests,
 	&test_shudown_read,
 	&test_shudown_write,
 
+	&test_socket_readv_writev,
+	&test_socket_poll,
+	&test_socket_splice,
+	&test_socket_nonblocking,
+	&test_socket_ephemeral_ports,
+	&test_listen_backlog_accept_many,
+	&test_socket_message_mode,
+	&test_socket_network,
+
 	NULL
 };
 